@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+// I/O-heavy: mostly printf and putchar.
+int main() {
+  for (int i = 1; i <= 5000; i++) {
+    if (i % 15 == 0)
+      puts("FizzBuzz");
+    else if (i % 5 == 0)
+      puts("Buzz");
+    else if (i % 3 == 0)
+      puts("Fizz");
+    else
+      printf("%d\n", i);
+  }
+  return 0;
+}
@@ -0,0 +1,14 @@
+#include <stdio.h>
+
+// Arithmetic-heavy: nearly all the time goes to __builtin_mul and
+// my_div, which 8cc calls for *, / and %.
+int main() {
+  int h = 0;
+  for (int i = 1; i <= 4000; i++) {
+    int x = i * 211 % 65521;
+    int y = x / (i % 97 + 1) + x % (i % 13 + 3);
+    h = (h * 31 + y) % 100003;
+  }
+  printf("%d\n", h);
+  return 0;
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Memory-heavy: sorts an array of structs through function pointers.
+
+#define N 3000
+
+typedef struct {
+  int key;
+  int index;
+} Item;
+
+int cmp_item(const void* a, const void* b) {
+  const Item* ia = a;
+  const Item* ib = b;
+  if (ia->key != ib->key)
+    return ia->key - ib->key;
+  return ia->index - ib->index;
+}
+
+int main() {
+  Item* items = malloc(sizeof(Item) * N);
+  int x = 1;
+  for (int i = 0; i < N; i++) {
+    x = (x * 75 + 74) % 65537;
+    items[i].key = x;
+    items[i].index = i;
+  }
+  qsort(items, N, sizeof(Item), cmp_item);
+  int h = 0;
+  for (int i = 0; i < N; i++) {
+    if (i && items[i - 1].key > items[i].key) {
+      puts("not sorted");
+      return 1;
+    }
+    h = (h * 7 + items[i].index) % 1000003;
+  }
+  printf("%d %d %d\n", items[0].key, items[N - 1].key, h);
+  return 0;
+}
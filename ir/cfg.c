@@ -0,0 +1,389 @@
+#include <ir/cfg.h>
+
+#include <stdlib.h>
+
+static int cfg_reg_mask(Value* v) {
+  return v->type == REG ? 1 << v->reg : 0;
+}
+
+int inst_reads(Inst* inst) {
+  switch (inst->op) {
+    case MOV:
+    case LOAD:
+    case PUTC:
+      return cfg_reg_mask(&inst->src);
+    case ADD:
+    case SUB:
+    case STORE:
+    case EQ:
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+    case MUL:
+    case DIV:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
+      return cfg_reg_mask(&inst->dst) | cfg_reg_mask(&inst->src);
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGT:
+    case JLE:
+    case JGE:
+      return (cfg_reg_mask(&inst->dst) | cfg_reg_mask(&inst->src) |
+              cfg_reg_mask(&inst->jmp));
+    case JMP:
+      return cfg_reg_mask(&inst->jmp);
+    case MEMCPY:
+    case MEMSET:
+      return (cfg_reg_mask(&inst->dst) | cfg_reg_mask(&inst->src) |
+              cfg_reg_mask(&inst->jmp));
+    case DUMP:
+      return ALL_REGS;
+    default:
+      return 0;
+  }
+}
+
+int inst_write(Inst* inst) {
+  switch (inst->op) {
+    case MOV:
+    case ADD:
+    case SUB:
+    case LOAD:
+    case GETC:
+    case EQ:
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+    case MUL:
+    case DIV:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
+      return inst->dst.reg;
+    default:
+      return -1;
+  }
+}
+
+static void cfg_add_target(CFG* cfg, int v) {
+  if (v < 0 || v >= cfg->num_blocks || cfg->is_indirect_target[v])
+    return;
+  cfg->is_indirect_target[v] = true;
+  cfg->num_indirect_targets++;
+}
+
+// Without label information, any immediate which is a valid pc may be
+// a code address.
+static void cfg_guess_indirect_targets(CFG* cfg) {
+  Module* m = cfg->module;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (inst->op == JMP)
+      continue;
+    if (inst->src.type == IMM)
+      cfg_add_target(cfg, inst->src.imm);
+  }
+  for (Data* d = m->data; d; d = d->next)
+    cfg_add_target(cfg, d->v);
+}
+
+static void cfg_find_indirect_targets(CFG* cfg) {
+  Module* m = cfg->module;
+  cfg->is_indirect_target = calloc(cfg->num_blocks, sizeof(bool));
+  if (m->addr_taken) {
+    for (int pc = 0; pc < cfg->num_blocks; pc++) {
+      if (m->addr_taken[pc])
+        cfg_add_target(cfg, pc);
+    }
+  } else {
+    cfg_guess_indirect_targets(cfg);
+  }
+
+  cfg->indirect_targets = calloc(cfg->num_indirect_targets, sizeof(int));
+  int n = 0;
+  for (int pc = 0; pc < cfg->num_blocks; pc++) {
+    if (cfg->is_indirect_target[pc])
+      cfg->indirect_targets[n++] = pc;
+  }
+}
+
+static void cfg_add_edge(CFG* cfg, int from, int to) {
+  if (to < 0 || to >= cfg->num_blocks)
+    return;
+  BasicBlock* b = &cfg->blocks[from];
+  for (int i = 0; i < b->num_succs; i++) {
+    if (b->succs[i] == to)
+      return;
+  }
+  b->succs[b->num_succs++] = to;
+  cfg->blocks[to].num_preds++;
+}
+
+// The pc a call pushes as its return address, or -1 if b isn't a call,
+// as 8cc emits them:
+//
+//   mov A, .Lret; sub SP, 1; store A, SP; jmp f
+//
+// f may be a register, for a call through a function pointer.
+static int cfg_call_return(CFG* cfg, BasicBlock* b) {
+  Inst* last = &b->insts[b->num_insts - 1];
+  if (last->op != JMP)
+    return -1;
+  int known = 0;
+  int vals[NUM_REGS];
+  int ret = -1;
+  for (Inst* inst = b->insts; inst != last; inst++) {
+    if (inst->op == STORE && inst->src.type == REG && inst->src.reg == SP &&
+        !inst->disp && (known & (1 << inst->dst.reg)))
+      ret = vals[inst->dst.reg];
+    int w = inst_write(inst);
+    if (inst->op == MOV && inst->src.type == IMM) {
+      known |= 1 << w;
+      vals[w] = inst->src.imm;
+    } else if (w >= 0) {
+      known &= ~(1 << w);
+    }
+  }
+  return ret >= 0 && ret < cfg->num_blocks ? ret : -1;
+}
+
+static bool cfg_returns(BasicBlock* b) {
+  Inst* last = &b->insts[b->num_insts - 1];
+  if (last->op != JMP || last->jmp.type != REG)
+    return false;
+  for (Inst* inst = last - 1; inst >= b->insts; inst--) {
+    if (inst_write(inst) == (int)last->jmp.reg) {
+      return (inst->op == LOAD && inst->src.type == REG &&
+              inst->src.reg == SP && !inst->disp);
+    }
+  }
+  return false;
+}
+
+// A growing array of (return block, target) pairs.
+typedef struct {
+  int* v;
+  int num;
+  int cap;
+} CFGPairs;
+
+static void cfg_add_pair(CFGPairs* p, int ret, int target) {
+  if (p->num == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    p->v = realloc(p->v, p->cap * 2 * sizeof(int));
+  }
+  p->v[p->num * 2] = ret;
+  p->v[p->num * 2 + 1] = target;
+  p->num++;
+}
+
+static int cfg_compare_pairs(const void* a, const void* b) {
+  const int* x = a;
+  const int* y = b;
+  if (x[0] != y[0])
+    return x[0] < y[0] ? -1 : 1;
+  return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+// Walks the body of every function called directly, i.e., the blocks
+// reachable from its entry with calls stepping over to their return
+// pcs, and gives the returns found there the return pcs of the calls to
+// the function. Every return may go back to a call through a register.
+static void cfg_find_return_targets(CFG* cfg) {
+  int n = cfg->num_blocks;
+  // The return pc of each call and the callee of each direct one.
+  int* ret_of = malloc(n * sizeof(int));
+  int* callee = malloc(n * sizeof(int));
+  int* num_calls = calloc(n + 1, sizeof(int));
+  CFGPairs pairs = { NULL, 0, 0 };
+  for (int pc = 0; pc < n; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    ret_of[pc] = callee[pc] = -1;
+    if (!b->num_insts)
+      continue;
+    b->returns = cfg_returns(b);
+    ret_of[pc] = b->call_return = cfg_call_return(cfg, b);
+    if (ret_of[pc] >= 0 && b->num_succs) {
+      callee[pc] = b->succs[0];
+      num_calls[callee[pc] + 1]++;
+    }
+  }
+  for (int pc = 0; pc < n; pc++) {
+    if (ret_of[pc] < 0 || !cfg->blocks[pc].jumps_indirectly)
+      continue;
+    for (int r = 0; r < n; r++) {
+      if (cfg->blocks[r].returns)
+        cfg_add_pair(&pairs, r, ret_of[pc]);
+    }
+  }
+
+  // The return pcs of the calls to f, grouped by f.
+  for (int f = 0; f < n; f++)
+    num_calls[f + 1] += num_calls[f];
+  int* rets = malloc((num_calls[n] + 1) * sizeof(int));
+  int* fill = calloc(n, sizeof(int));
+  for (int pc = 0; pc < n; pc++) {
+    int f = callee[pc];
+    if (f >= 0)
+      rets[num_calls[f] + fill[f]++] = ret_of[pc];
+  }
+
+  int* seen = calloc(n, sizeof(int));
+  int* stack = malloc(n * sizeof(int));
+  for (int f = 0; f < n; f++) {
+    if (num_calls[f] == num_calls[f + 1])
+      continue;
+    int sp = 0;
+    stack[sp++] = f;
+    seen[f] = f + 1;
+    while (sp) {
+      BasicBlock* b = &cfg->blocks[stack[--sp]];
+      if (b->returns) {
+        for (int i = num_calls[f]; i < num_calls[f + 1]; i++)
+          cfg_add_pair(&pairs, b->pc, rets[i]);
+      }
+      int next[2];
+      int num_next = 0;
+      if (ret_of[b->pc] >= 0) {
+        next[num_next++] = ret_of[b->pc];
+      } else {
+        for (int i = 0; i < b->num_succs; i++)
+          next[num_next++] = b->succs[i];
+      }
+      for (int i = 0; i < num_next; i++) {
+        if (seen[next[i]] != f + 1) {
+          seen[next[i]] = f + 1;
+          stack[sp++] = next[i];
+        }
+      }
+    }
+  }
+
+  qsort(pairs.v, pairs.num, 2 * sizeof(int), cfg_compare_pairs);
+  for (int i = 0; i < pairs.num;) {
+    BasicBlock* b = &cfg->blocks[pairs.v[i * 2]];
+    int j = i;
+    while (j < pairs.num && pairs.v[j * 2] == b->pc)
+      j++;
+    b->ret_targets = malloc((j - i) * sizeof(int));
+    for (; i < j; i++) {
+      int t = pairs.v[i * 2 + 1];
+      if (!b->num_ret_targets || b->ret_targets[b->num_ret_targets - 1] != t)
+        b->ret_targets[b->num_ret_targets++] = t;
+    }
+  }
+  free(pairs.v);
+  free(seen);
+  free(stack);
+  free(rets);
+  free(fill);
+  free(num_calls);
+  free(callee);
+  free(ret_of);
+}
+
+static int cfg_transfer(BasicBlock* b, int live) {
+  for (int i = b->num_insts - 1; i >= 0; i--) {
+    Inst* inst = &b->insts[i];
+    if (inst->op == EXIT) {
+      live = 0;
+      continue;
+    }
+    int w = inst_write(inst);
+    if (w >= 0)
+      live &= ~(1 << w);
+    live |= inst_reads(inst);
+  }
+  return live;
+}
+
+static void cfg_compute_liveness(CFG* cfg) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    int indirect_live = 0;
+    for (int i = 0; i < cfg->num_indirect_targets; i++)
+      indirect_live |= cfg->blocks[cfg->indirect_targets[i]].live_in;
+
+    for (int pc = cfg->num_blocks - 1; pc >= 0; pc--) {
+      BasicBlock* b = &cfg->blocks[pc];
+      int live = b->jumps_indirectly ? indirect_live : 0;
+      for (int i = 0; i < b->num_succs; i++)
+        live |= cfg->blocks[b->succs[i]].live_in;
+      int live_in = cfg_transfer(b, live);
+      if (live != b->live_out || live_in != b->live_in) {
+        b->live_out = live;
+        b->live_in = live_in;
+        changed = true;
+      }
+    }
+  }
+}
+
+CFG* build_cfg(Module* m) {
+  CFG* cfg = calloc(1, sizeof(CFG));
+  cfg->module = m;
+  cfg->num_blocks = m->num_pcs;
+  cfg->blocks = calloc(cfg->num_blocks, sizeof(BasicBlock));
+  cfg_find_indirect_targets(cfg);
+
+  for (int pc = 0; pc < cfg->num_blocks; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    b->pc = pc;
+    b->insts = m->text + m->pc_starts[pc];
+    b->num_insts = m->pc_lens[pc];
+    b->call_return = -1;
+    // A jump and the fall through at most.
+    b->succs = calloc(2, sizeof(int));
+
+    bool falls_through = true;
+    for (int i = 0; i < b->num_insts; i++) {
+      Inst* inst = &b->insts[i];
+      if (inst->op == EXIT) {
+        falls_through = false;
+        break;
+      }
+      if (inst->op < JEQ || inst->op > JMP)
+        continue;
+      if (inst->jmp.type == REG)
+        b->jumps_indirectly = true;
+      else
+        cfg_add_edge(cfg, pc, inst->jmp.imm);
+      if (inst->op == JMP) {
+        falls_through = false;
+        break;
+      }
+    }
+    if (falls_through)
+      cfg_add_edge(cfg, pc, pc + 1);
+  }
+
+  for (int pc = 0; pc < cfg->num_blocks; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    b->preds = calloc(b->num_preds, sizeof(int));
+    b->num_preds = 0;
+  }
+  for (int pc = 0; pc < cfg->num_blocks; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    for (int i = 0; i < b->num_succs; i++) {
+      BasicBlock* s = &cfg->blocks[b->succs[i]];
+      s->preds[s->num_preds++] = pc;
+    }
+  }
+
+  cfg_find_return_targets(cfg);
+  cfg_compute_liveness(cfg);
+  return cfg;
+}
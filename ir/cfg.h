@@ -0,0 +1,62 @@
+#ifndef ELVM_CFG_H_
+#define ELVM_CFG_H_
+
+#include <stdbool.h>
+
+#include <ir/ir.h>
+
+// Sets of registers are bit masks with bit r for register r.
+#define ALL_REGS ((1 << NUM_REGS) - 1)
+
+typedef struct {
+  int pc;
+  // The instructions of the block, a slice of module->text.
+  Inst* insts;
+  int num_insts;
+  // Direct successors and predecessors, as pcs. Edges taken by a jump
+  // through a register aren't listed: such a block may go to every
+  // indirect target.
+  int* succs;
+  int num_succs;
+  int* preds;
+  int num_preds;
+  bool jumps_indirectly;
+  // The pc the block pushes as its return address if it ends with a
+  // call (see below), or -1.
+  int call_return;
+  // Whether the block returns, i.e., ends with a jmp through the
+  // register it loaded from SP, and if so, the pcs after the calls
+  // which may reach it. A call is a direct jmp after storing an
+  // immediate pc at SP. Calls through registers aren't followed, so the
+  // targets are a hint to check first, not all the block may go to.
+  bool returns;
+  int* ret_targets;
+  int num_ret_targets;
+  // Registers which may be read before they are written.
+  int live_in;
+  int live_out;
+} BasicBlock;
+
+typedef struct {
+  Module* module;
+  // Indexed by pc.
+  BasicBlock* blocks;
+  int num_blocks;
+  // The pcs whose address may be loaded into a register and jumped to:
+  // module->addr_taken, or when it's unknown, every immediate in text
+  // or data which is a valid pc. Code addresses computed by arithmetic
+  // are not covered.
+  bool* is_indirect_target;
+  int* indirect_targets;
+  int num_indirect_targets;
+} CFG;
+
+// Builds the CFG of an indexed module. It refers to module->text, so it
+// must be rebuilt when the text changes.
+CFG* build_cfg(Module* module);
+
+// The registers inst reads, and the register it writes or -1.
+int inst_reads(Inst* inst);
+int inst_write(Inst* inst);
+
+#endif  // ELVM_CFG_H_
@@ -1,18 +1,163 @@
 #include <stdlib.h>
+#include <string.h>
 
+#include <ir/cfg.h>
 #include <ir/ir.h>
 
+#if !defined(NOFILE) && !defined(__eir__)
+
+static int compare_ints(const void* a, const void* b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Prints the count, min, median, 90th percentile, mean and max of n
+// values, which it sorts.
+static void dump_dist(const char* name, int* v, int n) {
+  if (!n) {
+    printf("%-16s %8d\n", name, 0);
+    return;
+  }
+  long sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += v[i];
+  qsort(v, n, sizeof(int), compare_ints);
+  printf("%-16s %8d  min %d  p50 %d  p90 %d  mean %.1f  max %d\n",
+         name, n, v[0], v[n / 2], v[n * 9 / 10], (double)sum / n, v[n - 1]);
+}
+
+// Prints what backends and optimizer passes are tuned by: the op and
+// operand mix, the sizes of basic blocks and of the chunks of
+// chunk_size pcs which emit_chunked_main_loop makes functions of, the
+// jumps through registers, the data size, and the functions, estimated
+// as the targets of calls (see BasicBlock in ir/cfg.h).
+static void dump_stats(Module* m, int chunk_size) {
+  int ops[LAST_OP] = {};
+  int imm_srcs[LAST_OP] = {};
+  int imm_jmps[LAST_OP] = {};
+  int indirect_jumps = 0;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    ops[inst->op]++;
+    imm_srcs[inst->op] += inst->src.type == IMM;
+    imm_jmps[inst->op] += inst->jmp.type == IMM;
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == REG)
+      indirect_jumps++;
+  }
+
+  printf("insts            %8d\n", m->num_insts);
+  printf("pcs              %8d\n", m->num_pcs);
+  printf("data words       %8d\n", m->num_data);
+  printf("\n%8s %7s %8s %8s %8s %8s  op\n",
+         "count", "%", "src_reg", "src_imm", "jmp_reg", "jmp_imm");
+  for (int op = 0; op < LAST_OP; op++) {
+    if (!ops[op])
+      continue;
+    printf("%8d %6.2f%%", ops[op], 100.0 * ops[op] / m->num_insts);
+    if (op == GETC || op == EXIT || op == DUMP || op == JMP)
+      printf(" %8s %8s", "-", "-");
+    else
+      printf(" %8d %8d", ops[op] - imm_srcs[op], imm_srcs[op]);
+    if ((op >= JEQ && op <= JMP) || op == MEMCPY || op == MEMSET)
+      printf(" %8d %8d  ", ops[op] - imm_jmps[op], imm_jmps[op]);
+    else
+      printf(" %8s %8s  ", "-", "-");
+    dump_op(op, stdout);
+    printf("\n");
+  }
+
+  CFG* cfg = build_cfg(m);
+  int* sizes = malloc((m->num_pcs + 1) * sizeof(int));
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    sizes[pc] = m->pc_lens[pc];
+  printf("\n");
+  dump_dist("block insts", sizes, m->num_pcs);
+
+  int num_chunks = (m->num_pcs + chunk_size - 1) / chunk_size;
+  for (int c = 0; c < num_chunks; c++) {
+    sizes[c] = 0;
+    for (int pc = c * chunk_size;
+         pc < m->num_pcs && pc < (c + 1) * chunk_size; pc++)
+      sizes[c] += m->pc_lens[pc];
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "chunk insts/%d", chunk_size);
+  dump_dist(name, sizes, num_chunks);
+  free(sizes);
+
+  int calls = 0;
+  int indirect_calls = 0;
+  int returns = 0;
+  int functions = 0;
+  bool* is_callee = calloc(m->num_pcs, sizeof(bool));
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    returns += b->returns;
+    if (b->call_return < 0)
+      continue;
+    calls++;
+    if (b->jumps_indirectly) {
+      indirect_calls++;
+    } else if (b->num_succs && !is_callee[b->succs[0]]) {
+      is_callee[b->succs[0]] = true;
+      functions++;
+    }
+  }
+  free(is_callee);
+
+  printf("\nindirect jumps   %8d  (returns %d, calls %d)\n",
+         indirect_jumps, returns, indirect_calls);
+  printf("direct calls     %8d\n", calls - indirect_calls);
+  printf("functions        %8d  (called directly)\n", functions);
+  printf("indirect targets %8d\n", cfg->num_indirect_targets);
+}
+
+#endif
+
 int main(int argc, char* argv[]) {
 #if defined(NOFILE) || defined(__eir__)
   Module* m = load_eir(stdin);
   // Host dump_ir.c.exe should dump to stdout for testing.
   stderr = stdout;
 #else
+  // -b writes .eirb to stdout, -B does the same without the line table.
+  // -s prints statistics instead, with chunks of -chunk=N pcs (512 by
+  // default, as elc).
+  bool eirb = false;
+  bool eirb_lines = false;
+  bool stats = false;
+  int chunk_size = 512;
+  for (; argc >= 2 && argv[1][0] == '-'; argc--, argv++) {
+    if (!strcmp(argv[1], "-b") || !strcmp(argv[1], "-B")) {
+      eirb = true;
+      eirb_lines = argv[1][1] == 'b';
+    } else if (!strcmp(argv[1], "-s")) {
+      stats = true;
+    } else if (!strncmp(argv[1], "-chunk=", 7)) {
+      chunk_size = atoi(argv[1] + 7);
+      if (chunk_size <= 0) {
+        fprintf(stderr, "invalid chunk size: %s\n", argv[1] + 7);
+        exit(1);
+      }
+    } else {
+      fprintf(stderr, "unknown option: %s\n", argv[1]);
+      exit(1);
+    }
+  }
   if (argc < 2) {
     fprintf(stderr, "no input file\n");
     exit(1);
   }
   Module* m = load_eir_from_file(argv[1]);
+  if (eirb) {
+    dump_eirb(m, eirb_lines, stdout);
+    return 0;
+  }
+  if (stats) {
+    dump_stats(m, chunk_size);
+    return 0;
+  }
 #endif
   for (Inst* inst = m->text; inst; inst = inst->next) {
     dump_inst(inst);
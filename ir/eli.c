@@ -4,26 +4,161 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <ir/intrinsic.h>
 #include <ir/ir.h>
 
+#ifndef __eir__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef ELI_LIBRARY
+#include <setjmp.h>
+#endif
+
+// --jit runs the code generated by target/x86.c in-process.
+#if defined(__x86_64__) && defined(__linux__) && !defined(__eir__) && \
+  !defined(NOFILE) && !defined(ELI_LIBRARY)
+#define ELI_JIT
+typedef void (*x86_jit_entry_t)(int* mem);
+x86_jit_entry_t x86_jit_compile(Module* module, void* putc_fn,
+                                void* getc_fn, void* fail_fn);
+void x86_jit_write_perf_map(Module* module, FILE* fp);
+#endif
+
+// On ELVM itself, words are natively 24 bits and memory is scarce, so
+// values wrap at the (smaller) memory size. Host builds mask values by
+// the word size and map memory lazily; both can be changed with -w and
+// -m.
 #ifdef __eir__
 #define MEMSZ 0x100000
+#define WRAP(v) (((v) + MEMSZ) % MEMSZ)
+#define OUT_OF_MEM(a) ((a) < 0)
+int mem[MEMSZ];
 #else
 #define MEMSZ 0x1000000
+#define WRAP(v) ((v) & g_word_mask)
+#define OUT_OF_MEM(a) ((unsigned int)(a) >= g_mem_size)
+int* mem;
+static int g_word_mask = UINT_MAX;
+static unsigned int g_mem_size = MEMSZ;
+#endif
+
+// --snapshot and --resume save and restore the VM state. --batch forks
+// a run per input from one loaded state.
+#if !defined(__eir__) && !defined(NOFILE) && !defined(ELI_LIBRARY)
+#define ELI_SNAPSHOT
+// The size of the stdin and stdout buffers. Unless --flush-at-exit is
+// given, stdout to a terminal stays line buffered so prompts show up.
+#define ELI_STDIO_BUF (1 << 16)
+static bool g_flush_at_exit;
+#define ELI_BATCH
+#include <sys/wait.h>
 #endif
 
 int pc;
-Inst* prog[65536];
-int mem[MEMSZ];
 int regs[6];
 bool verbose;
+bool jit;
+// --perf-map: --jit, and the symbols of its code for perf.
+static bool g_perf_map;
+
+// -DELI_LIBRARY builds eli_run for libelvm instead of main. I/O goes
+// through the caller's callbacks and EXIT returns from eli_run.
+#ifdef ELI_LIBRARY
+static int (*g_lib_getc)(void*);
+static void (*g_lib_putc)(int, void*);
+static void* g_lib_ctx;
+static jmp_buf g_lib_exit;
+# define ELI_PUTC(c) g_lib_putc(c, g_lib_ctx)
+# define ELI_GETC() g_lib_getc(g_lib_ctx)
+# define ELI_EXIT() longjmp(g_lib_exit, 1)
+#elif defined(ELI_SNAPSHOT)
+// Only eli touches stdio, so the unlocked versions are safe. main gives
+// stdin and stdout large buffers.
+# define ELI_PUTC(c) \
+  (g_snapshot_path ? snapshot_putc(c) : (void)putchar_unlocked(c))
+# define ELI_GETC() getchar_unlocked()
+# define ELI_EXIT() exit(0)
+#else
+# define ELI_PUTC(c) putchar(c)
+# define ELI_GETC() getchar()
+# define ELI_EXIT() exit(0)
+#endif
+
+#ifndef __eir__
+// -p counts executions of each instruction and memory accesses in each
+// range of 1<<PROF_MEM_SHIFT words, and reports hot spots at exit.
+// --profile-out FILE counts the same and writes the entries of each
+// block to FILE, for elc -profile=.
+// --cost-profile FILE counts the executions of each op by operand kind
+// and the transfers between pcs, for tools/predict.py.
+#define PROF_MEM_SHIFT 12
+#define PROF_TOP 20
+static bool g_profile;
+static bool g_prof_report;
+static const char* g_prof_out;
+static const char* g_cost_out;
+static Module* g_prof_module;
+static long* g_prof_insts;
+static long* g_prof_loads;
+static long* g_prof_stores;
+# define PROF_INST(m, inst) \
+  if (g_profile) g_prof_insts[(inst) - (m)->text]++
+# define PROF_MEM(counts, addr) \
+  if (g_profile) counts[(addr) >> PROF_MEM_SHIFT]++
+
+// A transfer from one pc to another: a taken conditional jump, a JMP,
+// or falling through to the next block.
+enum { EDGE_TAKEN, EDGE_JMP, EDGE_FALL };
+typedef struct {
+  int from;
+  int to;
+  int kind;
+  long count;
+} ProfEdge;
+// An open addressing hash table of the edges.
+static ProfEdge* g_prof_edges;
+static int g_prof_edges_cap;
+static int g_prof_num_edges;
+# define PROF_EDGE(from, to, kind) \
+  if (g_cost_out) prof_edge(from, to, kind)
+
+// -s reports the memory working set at exit: the peak heap break (the
+// value of _edata), the deepest stack pointer, the touched pages, and
+// the last accesses kept in a ring buffer.
+#define MEMSTAT_PAGE_SHIFT 8
+#define MEMSTAT_RING 16
+typedef struct {
+  int addr;
+  bool is_store;
+  Inst* inst;
+} MemAccess;
+static bool g_mem_stats;
+static int g_memstat_edata;
+static int g_memstat_brk_init;
+static int g_memstat_brk_max;
+static int g_memstat_sp_min;
+static unsigned char* g_memstat_pages;
+static MemAccess g_memstat_ring[MEMSTAT_RING];
+static long g_memstat_num_accesses;
+# define MEMSTAT_INST()                                                 \
+  if (g_mem_stats && regs[SP] && regs[SP] < g_memstat_sp_min)           \
+    g_memstat_sp_min = regs[SP]
+# define MEMSTAT_MEM(addr, is_store, inst)                              \
+  if (g_mem_stats) memstat_access(addr, is_store, inst)
+#else
+# define PROF_INST(m, inst)
+# define PROF_EDGE(from, to, kind)
+# define PROF_MEM(counts, addr)
+# define MEMSTAT_INST()
+# define MEMSTAT_MEM(addr, is_store, inst)
+#endif
 
 #ifdef __GNUC__
 __attribute__((noreturn))
 #endif
 static void error(const char* msg) {
-  fprintf(stderr, "%s (pc=%d)\n", msg, pc);
-  exit(1);
+  ir_fatal("%s (pc=%d)", msg, pc);
 }
 
 static inline void dump_regs(Inst* inst) {
@@ -47,7 +182,7 @@ static int value(Value* v) {
   if (v->type == REG) {
     return regs[v->reg];
   } else if (v->type == IMM) {
-    return v->imm;
+    return WRAP(v->imm);
   } else {
     error("invalid value");
   }
@@ -57,6 +192,30 @@ static int src(Inst* inst) {
   return value(&inst->src);
 }
 
+// Copies n words from s to d, which may overlap, or fills them with s
+// for MEMSET. Returns false if the words aren't all in memory.
+static bool run_mem_op(Op op, int d, int s, int n) {
+  if (n == 0)
+    return true;
+  if (OUT_OF_MEM(d) || OUT_OF_MEM(d + n - 1))
+    return false;
+  if (op == MEMSET) {
+    for (int i = 0; i < n; i++)
+      mem[d + i] = s;
+    return true;
+  }
+  if (OUT_OF_MEM(s) || OUT_OF_MEM(s + n - 1))
+    return false;
+  if (d < s) {
+    for (int i = 0; i < n; i++)
+      mem[d + i] = mem[s + i];
+  } else {
+    for (int i = n - 1; i >= 0; i--)
+      mem[d + i] = mem[s + i];
+  }
+  return true;
+}
+
 static int cmp(Inst* inst) {
   int op = inst->op;
   if (op >= 16)
@@ -84,43 +243,410 @@ static int cmp(Inst* inst) {
   }
 }
 
-int main(int argc, char* argv[]) {
-#if defined(NOFILE) || defined(__eir__)
-  Module* m = load_eir(stdin);
-#else
-  if (argc >= 2 && !strcmp(argv[1], "-v")) {
-    verbose = true;
-    argc--;
-    argv++;
+#ifndef __eir__
+
+static long* g_prof_sort_keys;
+
+static int prof_cmp(const void* a, const void* b) {
+  long ka = g_prof_sort_keys[*(const int*)a];
+  long kb = g_prof_sort_keys[*(const int*)b];
+  if (ka != kb)
+    return ka < kb ? 1 : -1;
+  return *(const int*)a - *(const int*)b;
+}
+
+// Returns indices of the non-zero keys, hottest first.
+static int* prof_sort(long* keys, int n, int* num_hot) {
+  int* order = malloc(sizeof(int) * (n ? n : 1));
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    if (keys[i])
+      order[k++] = i;
   }
+  g_prof_sort_keys = keys;
+  qsort(order, k, sizeof(int), prof_cmp);
+  *num_hot = k;
+  return order;
+}
 
-  if (argc < 2) {
-    fprintf(stderr, "no input file\n");
-    return 1;
+// One "pc entries" line for each block which ran.
+static void write_profile(Module* m, const char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return;
   }
+  fprintf(fp, "# pc entries\n");
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    if (m->pc_lens[pc] && g_prof_insts[m->pc_starts[pc]])
+      fprintf(fp, "%d %ld\n", pc, g_prof_insts[m->pc_starts[pc]]);
+  }
+  fclose(fp);
+}
 
-  Module* m = load_eir_from_file(argv[1]);
-#endif
+static ProfEdge* prof_find_edge(int from, int to, int kind) {
+  unsigned int mask = g_prof_edges_cap - 1;
+  unsigned int i = ((unsigned int)from * 31 + to) * 3 + kind;
+  for (;; i++) {
+    ProfEdge* e = &g_prof_edges[i & mask];
+    if (!e->count || (e->from == from && e->to == to && e->kind == kind))
+      return e;
+  }
+}
 
-  int i;
-  i = 0;
-  for (Data* d = m->data; d; d = d->next, i++) {
-    mem[i] = d->v;
+static void prof_edge(int from, int to, int kind) {
+  if (g_prof_num_edges * 2 >= g_prof_edges_cap) {
+    ProfEdge* old = g_prof_edges;
+    int old_cap = g_prof_edges_cap;
+    g_prof_edges_cap = old_cap ? old_cap * 2 : 1024;
+    g_prof_edges = calloc(g_prof_edges_cap, sizeof(ProfEdge));
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i].count)
+        *prof_find_edge(old[i].from, old[i].to, old[i].kind) = old[i];
+    }
+    free(old);
+  }
+  ProfEdge* e = prof_find_edge(from, to, kind);
+  if (!e->count) {
+    e->from = from;
+    e->to = to;
+    e->kind = kind;
+    g_prof_num_edges++;
+  }
+  e->count++;
+}
+
+// "op_kind count" lines, where kind is reg or imm for the source (the
+// target of JMP) and absent for ops without one, then "taken", "jmp"
+// and "fall" lines of "from to count".
+static void write_cost_profile(Module* m, const char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return;
+  }
+  long counts[LAST_OP][2] = {{0}};
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    Value* v = inst->op == JMP ? &inst->jmp : &inst->src;
+    counts[inst->op][v->type == REG] += g_prof_insts[i];
+  }
+  fprintf(fp, "# op count\n");
+  for (int op = 0; op < LAST_OP; op++) {
+    for (int k = 0; k < 2; k++) {
+      if (!counts[op][k])
+        continue;
+      dump_op(op, fp);
+      if (op == GETC || op == EXIT || op == DUMP)
+        fprintf(fp, " %ld\n", counts[op][k]);
+      else
+        fprintf(fp, "_%s %ld\n", k ? "reg" : "imm", counts[op][k]);
+    }
+  }
+  static const char* kinds[] = { "taken", "jmp", "fall" };
+  fprintf(fp, "# kind from to count\n");
+  for (int i = 0; i < g_prof_edges_cap; i++) {
+    ProfEdge* e = &g_prof_edges[i];
+    if (e->count)
+      fprintf(fp, "%s %d %d %ld\n", kinds[e->kind], e->from, e->to, e->count);
+  }
+  fclose(fp);
+}
+
+static void dump_profile(void) {
+  Module* m = g_prof_module;
+  if (g_prof_out)
+    write_profile(m, g_prof_out);
+  if (g_cost_out)
+    write_cost_profile(m, g_cost_out);
+  if (!g_prof_report)
+    return;
+  long total = 0;
+  long* pcs = calloc(m->num_pcs, sizeof(long));
+  for (int i = 0; i < m->num_insts; i++) {
+    total += g_prof_insts[i];
+    pcs[m->text[i].pc] += g_prof_insts[i];
+  }
+  if (!total)
+    total = 1;
+
+  fflush(stdout);
+  int n;
+  int* order = prof_sort(pcs, m->num_pcs, &n);
+  fprintf(stderr, "\n=== profile: %ld instructions ===\n", total);
+  fprintf(stderr, "--- hot blocks ---\n");
+  fprintf(stderr, "%14s %6s %14s %8s %8s\n",
+          "insts", "%", "entries", "pc", "line");
+  for (int i = 0; i < n && i < PROF_TOP; i++) {
+    int pc = order[i];
+    Inst* first = &m->text[m->pc_starts[pc]];
+    fprintf(stderr, "%14ld %6.2f %14ld %8d %8d\n",
+            pcs[pc], pcs[pc] * 100.0 / total,
+            g_prof_insts[m->pc_starts[pc]], pc, first->lineno);
+  }
+  free(order);
+
+  order = prof_sort(g_prof_insts, m->num_insts, &n);
+  fprintf(stderr, "--- hot instructions ---\n");
+  fprintf(stderr, "%14s %6s  %s\n", "count", "%", "inst");
+  for (int i = 0; i < n && i < PROF_TOP; i++) {
+    fprintf(stderr, "%14ld %6.2f  ", g_prof_insts[order[i]],
+            g_prof_insts[order[i]] * 100.0 / total);
+    dump_inst_fp(&m->text[order[i]], stderr);
+  }
+  free(order);
+
+  int num_ranges = (MEMSZ >> PROF_MEM_SHIFT);
+  long* accesses = calloc(num_ranges, sizeof(long));
+  for (int i = 0; i < num_ranges; i++)
+    accesses[i] = g_prof_loads[i] + g_prof_stores[i];
+  order = prof_sort(accesses, num_ranges, &n);
+  fprintf(stderr, "--- hot memory ranges ---\n");
+  fprintf(stderr, "%14s %14s  %s\n", "loads", "stores", "range");
+  for (int i = 0; i < n && i < PROF_TOP; i++) {
+    int r = order[i];
+    fprintf(stderr, "%14ld %14ld  %d-%d\n", g_prof_loads[r],
+            g_prof_stores[r], r << PROF_MEM_SHIFT,
+            ((r + 1) << PROF_MEM_SHIFT) - 1);
   }
-  for (Inst* inst = m->text; inst; i++) {
-    pc = inst->pc;
-    prog[pc] = inst;
-    for (; inst && pc == inst->pc; inst = inst->next) {}
+  free(order);
+  free(accesses);
+  free(pcs);
+}
+
+static void init_profile(Module* m) {
+  g_prof_module = m;
+  g_prof_insts = calloc(m->num_insts, sizeof(long));
+  g_prof_loads = calloc(MEMSZ >> PROF_MEM_SHIFT, sizeof(long));
+  g_prof_stores = calloc(MEMSZ >> PROF_MEM_SHIFT, sizeof(long));
+  atexit(dump_profile);
+}
+
+static void memstat_access(int addr, bool is_store, Inst* inst) {
+  MemAccess* a = &g_memstat_ring[g_memstat_num_accesses++ % MEMSTAT_RING];
+  a->addr = addr;
+  a->is_store = is_store;
+  a->inst = inst;
+  g_memstat_pages[addr >> MEMSTAT_PAGE_SHIFT] = 1;
+  if (is_store && addr == g_memstat_edata) {
+    int brk = regs[inst->dst.reg];
+    if (brk > g_memstat_brk_max)
+      g_memstat_brk_max = brk;
   }
+}
+
+static void dump_mem_stats(void) {
+  int num_pages = 0;
+  int last_page = -1;
+  for (int i = 0; i < (MEMSZ >> MEMSTAT_PAGE_SHIFT); i++) {
+    if (g_memstat_pages[i]) {
+      num_pages++;
+      if ((i << MEMSTAT_PAGE_SHIFT) < g_memstat_sp_min)
+        last_page = i;
+    }
+  }
+  int stack = g_memstat_sp_min == MEMSZ ? 0 : MEMSZ - g_memstat_sp_min;
+
+  fflush(stdout);
+  fprintf(stderr, "\n=== memory: %ld accesses ===\n", g_memstat_num_accesses);
+  fprintf(stderr, "data: %d words\n", g_memstat_brk_init);
+  fprintf(stderr, "heap: %d words (peak break=%d)\n",
+          g_memstat_brk_max - g_memstat_brk_init, g_memstat_brk_max);
+  fprintf(stderr, "stack: %d words (min SP=%d)\n",
+          stack, stack ? g_memstat_sp_min : 0);
+  fprintf(stderr, "touched: %d pages of %d words, "
+          "highest below stack: %d\n",
+          num_pages, 1 << MEMSTAT_PAGE_SHIFT,
+          last_page < 0 ? -1 : ((last_page + 1) << MEMSTAT_PAGE_SHIFT) - 1);
+  fprintf(stderr, "--- last accesses ---\n");
+  long n = g_memstat_num_accesses;
+  for (long i = n < MEMSTAT_RING ? 0 : n - MEMSTAT_RING; i < n; i++) {
+    MemAccess* a = &g_memstat_ring[i % MEMSTAT_RING];
+    fprintf(stderr, "%s %8d  ", a->is_store ? "store" : "load ", a->addr);
+    dump_inst_fp(a->inst, stderr);
+  }
+}
+
+static void init_mem_stats(Module* m) {
+  // The last data word is the heap break, which starts right after it.
+  int num_data = 0;
+  for (Data* d = m->data; d; d = d->next)
+    num_data++;
+  g_memstat_edata = num_data - 1;
+  g_memstat_brk_init = num_data;
+  g_memstat_brk_max = num_data;
+  g_memstat_sp_min = MEMSZ;
+  g_memstat_pages = calloc(MEMSZ >> MEMSTAT_PAGE_SHIFT, 1);
+  atexit(dump_mem_stats);
+}
+
+#endif  // !__eir__
+
+#ifdef ELI_SNAPSHOT
+
+// --snapshot FILE writes the VM state to FILE and exits once the
+// program reaches its first GETC or DUMP, before running it. No input
+// has been read by then. --resume FILE starts from there instead of
+// from the data and the entry pc, so runs with different inputs skip
+// the shared startup. The file holds host-endian ints: a header, the
+// output written before the marker (which a resumed run writes
+// again), and the non-zero chunks of memory.
+#define SNAPSHOT_MAGIC 0x53494c45  // "ELIS"
+#define SNAPSHOT_CHUNK 1024
+static const char* g_snapshot_path;
+static const char* g_resume_path;
+static char* g_snapshot_out;
+static int g_snapshot_out_len;
+static int g_snapshot_out_cap;
+// The index of the instruction to resume at, or -1.
+static int g_resume_inst = -1;
 
-  pc = m->text->pc;
+typedef struct {
+  int magic;
+  int num_insts;
+  int word_mask;
+  unsigned int mem_size;
+  int inst;
+  int pc;
+  int regs[6];
+  int out_len;
+} SnapshotHeader;
+
+// Keeps the output before a --snapshot marker, as well as writing it.
+static void snapshot_putc(int c) {
+  if (g_snapshot_out_len == g_snapshot_out_cap) {
+    g_snapshot_out_cap = g_snapshot_out_cap * 2 + 4096;
+    g_snapshot_out = realloc(g_snapshot_out, g_snapshot_out_cap);
+  }
+  g_snapshot_out[g_snapshot_out_len++] = c;
+  putchar_unlocked(c);
+}
+
+// Whether any host page of the chunk at base was touched. Untouched
+// pages of the anonymous mapping are zero, so they needn't be read.
+static bool snapshot_chunk_resident(unsigned char* vec, long page_size,
+                                    unsigned int base, unsigned int n) {
+  long first = (long)base * sizeof(int) / page_size;
+  long last = ((long)(base + n) * sizeof(int) - 1) / page_size;
+  for (long i = first; i <= last; i++) {
+    if (vec[i] & 1)
+      return true;
+  }
+  return false;
+}
+
+static void save_snapshot(Module* m, Inst* inst) {
+  FILE* fp = fopen(g_snapshot_path, "wb");
+  if (!fp)
+    ir_fatal("failed to open %s", g_snapshot_path);
+  SnapshotHeader h = {
+    SNAPSHOT_MAGIC, m->num_insts, g_word_mask, g_mem_size,
+    (int)(inst - m->text), inst->pc, { 0 }, g_snapshot_out_len
+  };
+  memcpy(h.regs, regs, sizeof(regs));
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(g_snapshot_out, 1, g_snapshot_out_len, fp);
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t bytes = (size_t)g_mem_size * sizeof(int);
+  unsigned char* vec = calloc((bytes + page_size - 1) / page_size, 1);
+  if (mincore(mem, bytes, vec))
+    memset(vec, 1, (bytes + page_size - 1) / page_size);
+  for (unsigned int base = 0; base < g_mem_size; base += SNAPSHOT_CHUNK) {
+    unsigned int n = g_mem_size - base;
+    if (n > SNAPSHOT_CHUNK)
+      n = SNAPSHOT_CHUNK;
+    if (!snapshot_chunk_resident(vec, page_size, base, n))
+      continue;
+    unsigned int i;
+    for (i = 0; i < n && !mem[base + i]; i++) {}
+    if (i == n)
+      continue;
+    int idx = base / SNAPSHOT_CHUNK;
+    fwrite(&idx, sizeof(idx), 1, fp);
+    fwrite(&mem[base], sizeof(int), n, fp);
+  }
+  int end = -1;
+  fwrite(&end, sizeof(end), 1, fp);
+  free(vec);
+  if (ferror(fp) || fclose(fp))
+    ir_fatal("failed to write %s", g_snapshot_path);
+  fflush(stdout);
+  exit(0);
+}
+
+static void load_snapshot(Module* m, const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    ir_fatal("failed to open %s", path);
+  SnapshotHeader h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != SNAPSHOT_MAGIC)
+    ir_fatal("%s: not a snapshot", path);
+  if (h.num_insts != m->num_insts)
+    ir_fatal("%s: taken from another program", path);
+  if (h.word_mask != g_word_mask || h.mem_size != g_mem_size)
+    ir_fatal("%s: taken with other -w or -m", path);
+  char* out = malloc(h.out_len + 1);
+  if (fread(out, 1, h.out_len, fp) != (size_t)h.out_len)
+    ir_fatal("%s: truncated", path);
+  fwrite(out, 1, h.out_len, stdout);
+  free(out);
+
+  for (;;) {
+    int idx;
+    if (fread(&idx, sizeof(idx), 1, fp) != 1)
+      ir_fatal("%s: truncated", path);
+    if (idx < 0)
+      break;
+    unsigned int base = (unsigned int)idx * SNAPSHOT_CHUNK;
+    if (base >= g_mem_size)
+      ir_fatal("%s: broken", path);
+    unsigned int n = g_mem_size - base;
+    if (n > SNAPSHOT_CHUNK)
+      n = SNAPSHOT_CHUNK;
+    if (fread(&mem[base], sizeof(int), n, fp) != n)
+      ir_fatal("%s: truncated", path);
+  }
+  fclose(fp);
+  if (h.inst < 0 || h.inst >= m->num_insts)
+    ir_fatal("%s: broken", path);
+  g_resume_inst = h.inst;
+  pc = h.pc;
+  memcpy(regs, h.regs, sizeof(regs));
+}
+
+# define SNAPSHOT(m, inst) \
+  if (g_snapshot_path) save_snapshot(m, inst)
+#else
+# define SNAPSHOT(m, inst)
+#endif  // ELI_SNAPSHOT
+
+// The reference interpreter. Used when tracing with -v or profiling.
+static void run_switch(Module* m) {
+  Inst* text_end = m->text + m->num_insts;
+  Inst* resume = NULL;
+#ifdef ELI_SNAPSHOT
+  if (g_resume_inst >= 0)
+    resume = &m->text[g_resume_inst];
+#endif
+  if (!resume)
+    pc = m->text->pc;
   for (;;) {
-    Inst* inst = prog[pc];
-    for (; inst; inst = inst->next) {
+    if (pc >= m->num_pcs || !m->pc_lens[pc])
+      error("jump to invalid pc");
+    // Falls through to the following blocks until a jump is taken.
+    Inst* inst = resume ? resume : &m->text[m->pc_starts[pc]];
+    Inst* entry = inst;
+    resume = NULL;
+    for (; inst != text_end; inst++) {
       if (verbose) {
         dump_regs(inst);
         dump_inst(inst);
       }
+      PROF_INST(m, inst);
+      if (inst != entry && inst[-1].pc != inst->pc)
+        PROF_EDGE(inst[-1].pc, inst->pc, EDGE_FALL);
+      MEMSTAT_INST();
       int npc = -1;
       switch (inst->op) {
         case MOV:
@@ -130,23 +656,21 @@ int main(int argc, char* argv[]) {
 
         case ADD:
           assert(inst->dst.type == REG);
-          regs[inst->dst.reg] += src(inst);
-          regs[inst->dst.reg] += MEMSZ;
-          regs[inst->dst.reg] %= MEMSZ;
+          regs[inst->dst.reg] = WRAP(regs[inst->dst.reg] + src(inst));
           break;
 
         case SUB:
           assert(inst->dst.type == REG);
-          regs[inst->dst.reg] -= src(inst);
-          regs[inst->dst.reg] += MEMSZ;
-          regs[inst->dst.reg] %= MEMSZ;
+          regs[inst->dst.reg] = WRAP(regs[inst->dst.reg] - src(inst));
           break;
 
         case LOAD: {
           assert(inst->dst.type == REG);
           int addr = src(inst);
-          if (addr < 0)
-            error("zero page load");
+          if (OUT_OF_MEM(addr))
+            error("load out of memory");
+          PROF_MEM(g_prof_loads, addr);
+          MEMSTAT_MEM(addr, false, inst);
           regs[inst->dst.reg] = mem[addr];
           break;
         }
@@ -154,28 +678,30 @@ int main(int argc, char* argv[]) {
         case STORE: {
           assert(inst->dst.type == REG);
           int addr = src(inst);
-          if (addr < 0)
-            error("zero page store");
+          if (OUT_OF_MEM(addr))
+            error("store out of memory");
+          PROF_MEM(g_prof_stores, addr);
+          MEMSTAT_MEM(addr, true, inst);
           mem[addr] = regs[inst->dst.reg];
           break;
         }
 
         case PUTC:
-          putchar(src(inst));
+          ELI_PUTC(src(inst));
           break;
 
         case GETC: {
-          int c = getchar();
-          regs[inst->dst.reg] = c == EOF ? 0 : c;
-          regs[inst->dst.reg] += MEMSZ;
-          regs[inst->dst.reg] %= MEMSZ;
+          SNAPSHOT(m, inst);
+          int c = ELI_GETC();
+          regs[inst->dst.reg] = WRAP(c == EOF ? 0 : c);
           break;
         }
 
         case EXIT:
-          exit(0);
+          ELI_EXIT();
 
         case DUMP:
+          SNAPSHOT(m, inst);
           break;
 
         case EQ:
@@ -187,6 +713,27 @@ int main(int argc, char* argv[]) {
           regs[inst->dst.reg] = cmp(inst);
           break;
 
+        case MUL:
+        case DIV:
+        case MOD:
+        case AND:
+        case OR:
+        case XOR:
+        case SHL:
+        case SHR:
+          regs[inst->dst.reg] =
+              WRAP(eval_ext_op(inst->op, regs[inst->dst.reg], src(inst)));
+          break;
+
+        case MEMCPY:
+        case MEMSET:
+          if (!run_mem_op(inst->op, regs[inst->dst.reg], src(inst),
+                          value(&inst->jmp))) {
+            error(inst->op == MEMCPY ?
+                  "memcpy out of memory" : "memset out of memory");
+          }
+          break;
+
         case JEQ:
         case JNE:
         case JLT:
@@ -204,11 +751,940 @@ int main(int argc, char* argv[]) {
       }
 
       if (npc != -1) {
+        PROF_EDGE(inst->pc, npc, inst->op == JMP ? EDGE_JMP : EDGE_TAKEN);
         pc = npc;
         break;
       }
     }
+    if (inst == text_end)
+      error("fell off the end of text");
+  }
+
+}
+
+// The fast engine. Each Inst is lowered once into a Code whose handler
+// is specialized by op and operand types, so dispatch needs neither the
+// op switch nor the REG/IMM checks. Handlers are threaded by computed
+// goto when the host compiler supports it and called through function
+// pointers otherwise (e.g., on ELVM itself).
+
+#if defined(__GNUC__) && !defined(__eir__)
+# define ELI_COMPUTED_GOTO
+#endif
+
+typedef struct Code_ {
+  union {
+    struct Code_* (*fn)(struct Code_*);
+    void* label;
+  };
+  int kind;
+  // Register indices or immediates, depending on the kind.
+  int dst;
+  int src;
+  int jmp;
+  // The resolved destination of an immediate jump, or NULL if invalid.
+  struct Code_* target;
+  // The address register of a fused load or store with an offset.
+  int aux;
+  Inst* inst;
+} Code;
+
+static Code* g_codes;
+static Module* g_module;
+
+static Code* jump_to(int npc) {
+  if (npc < 0 || npc >= g_module->num_pcs || !g_module->pc_lens[npc]) {
+    pc = npc;
+    error("jump to invalid pc");
+  }
+  return &g_codes[g_module->pc_starts[npc]];
+}
+
+static void code_error(Code* c, const char* msg) {
+  pc = c->inst ? c->inst->pc : pc;
+  error(msg);
+}
+
+#define R(x) regs[c->x]
+#define I(x) c->x
+
+// Handlers come in REG/IMM pairs so lowering can add the operand type to
+// the base kind. Conditional jumps and block memory ops come in
+// quadruples: +1 for an immediate src and +2 for an immediate jmp.
+#define ELI_ARITH(X, name, expr)                         \
+  X(name##_reg, R(dst) = expr(R(dst), R(src)); NEXT)   \
+  X(name##_imm, R(dst) = expr(R(dst), I(src)); NEXT)
+
+#define ELI_MOV(d, s) (s)
+#define ELI_ADD(d, s) WRAP((d) + (s))
+#define ELI_SUB(d, s) WRAP((d) - (s))
+#define ELI_EQ(d, s) ((d) == (s))
+#define ELI_NE(d, s) ((d) != (s))
+#define ELI_LT(d, s) ((d) < (s))
+#define ELI_GT(d, s) ((d) > (s))
+#define ELI_LE(d, s) ((d) <= (s))
+#define ELI_GE(d, s) ((d) >= (s))
+#define ELI_MUL(d, s) WRAP((unsigned int)(d) * (unsigned int)(s))
+#define ELI_DIV(d, s) WRAP(eval_ext_op(DIV, d, s))
+#define ELI_MOD(d, s) eval_ext_op(MOD, d, s)
+#define ELI_AND(d, s) ((d) & (s))
+#define ELI_OR(d, s) ((d) | (s))
+#define ELI_XOR(d, s) ((d) ^ (s))
+#define ELI_SHL(d, s) WRAP(eval_ext_op(SHL, d, s))
+#define ELI_SHR(d, s) eval_ext_op(SHR, d, s)
+
+#define ELI_JCC(X, name, expr)                                          \
+  X(name##_reg_reg, if (expr(R(dst), R(src))) JUMP(jump_to(R(jmp))); NEXT) \
+  X(name##_imm_reg, if (expr(R(dst), I(src))) JUMP(jump_to(R(jmp))); NEXT) \
+  X(name##_reg_imm, if (expr(R(dst), R(src))) JUMP_IMM(); NEXT)        \
+  X(name##_imm_imm, if (expr(R(dst), I(src))) JUMP_IMM(); NEXT)
+
+#define ELI_MEM_OP_BODY(op, s, n)                                       \
+  if (!run_mem_op(op, R(dst), s, n))                                    \
+    code_error(c, op == MEMCPY ?                                        \
+               "memcpy out of memory" : "memset out of memory");        \
+  NEXT
+
+#define ELI_MEM_OP(X, name, op)                                         \
+  X(name##_reg_reg, ELI_MEM_OP_BODY(op, R(src), R(jmp)))                \
+  X(name##_imm_reg, ELI_MEM_OP_BODY(op, I(src), R(jmp)))                \
+  X(name##_reg_imm, ELI_MEM_OP_BODY(op, R(src), I(jmp)))                \
+  X(name##_imm_imm, ELI_MEM_OP_BODY(op, I(src), I(jmp)))
+
+// Superinstructions for the sequences 8cc emits most, which lowering
+// fuses so they take one dispatch. Each runs the whole sequence, so
+// every register it writes is still written, and moves past it. A
+// compare followed by a jump on its result being zero or not comes in
+// quadruples: +1 for an immediate src and +2 for a jump on zero.
+#define NEXT2 NEXT_N(2)
+#define NEXT3 NEXT_N(3)
+
+#define ELI_CMPJ(X, name, expr)                                         \
+  X(name##_reg_nz, R(dst) = expr(R(dst), R(src));                       \
+    if (R(dst)) JUMP_IMM(); NEXT2)                                      \
+  X(name##_imm_nz, R(dst) = expr(R(dst), I(src));                       \
+    if (R(dst)) JUMP_IMM(); NEXT2)                                      \
+  X(name##_reg_z, R(dst) = expr(R(dst), R(src));                        \
+    if (!R(dst)) JUMP_IMM(); NEXT2)                                     \
+  X(name##_imm_z, R(dst) = expr(R(dst), I(src));                        \
+    if (!R(dst)) JUMP_IMM(); NEXT2)
+
+#define ELI_FUSED_CODES(X)                                              \
+  /* sub dst, 1; store src, dst */                                      \
+  X(push, R(dst) = WRAP(R(dst) - 1);                                    \
+    if (OUT_OF_MEM(R(dst))) code_error(c + 1, "store out of memory");   \
+    mem[R(dst)] = R(src); NEXT2)                                        \
+  /* load dst, src; add src, 1 */                                       \
+  X(pop, if (OUT_OF_MEM(R(src))) code_error(c, "load out of memory");   \
+    R(dst) = mem[R(src)]; R(src) = WRAP(R(src) + 1); NEXT2)             \
+  /* mov aux, src; add aux, jmp; load dst, aux */                       \
+  X(load_off, R(aux) = WRAP(R(src) + I(jmp));                           \
+    if (OUT_OF_MEM(R(aux))) code_error(c + 2, "load out of memory");    \
+    R(dst) = mem[R(aux)]; NEXT3)                                        \
+  /* mov aux, src; add aux, jmp; store dst, aux */                      \
+  X(store_off, R(aux) = WRAP(R(src) + I(jmp));                          \
+    if (OUT_OF_MEM(R(aux))) code_error(c + 2, "store out of memory");   \
+    mem[R(aux)] = R(dst); NEXT3)                                        \
+  /* <cmp> dst, src; jne/jeq jmp, dst, 0 */                             \
+  ELI_CMPJ(X, eqj, ELI_EQ)                                              \
+  ELI_CMPJ(X, nej, ELI_NE)                                              \
+  ELI_CMPJ(X, ltj, ELI_LT)                                              \
+  ELI_CMPJ(X, gtj, ELI_GT)                                              \
+  ELI_CMPJ(X, lej, ELI_LE)                                              \
+  ELI_CMPJ(X, gej, ELI_GE)
+
+#define ELI_CODES(X)                                                    \
+  X(oops, code_error(c, "oops"); NEXT)                                  \
+  X(end, code_error(c, "fell off the end of text"); NEXT)               \
+  ELI_ARITH(X, mov, ELI_MOV)                                            \
+  ELI_ARITH(X, add, ELI_ADD)                                            \
+  ELI_ARITH(X, sub, ELI_SUB)                                            \
+  X(load_reg, if (OUT_OF_MEM(R(src))) code_error(c, "load out of memory"); \
+    R(dst) = mem[R(src)]; NEXT)                                          \
+  X(load_imm, R(dst) = mem[I(src)]; NEXT)                               \
+  X(store_reg, if (OUT_OF_MEM(R(src))) code_error(c, "store out of memory"); \
+    mem[R(src)] = R(dst); NEXT)                                          \
+  X(store_imm, mem[I(src)] = R(dst); NEXT)                              \
+  X(load_oob, code_error(c, "load out of memory"); NEXT)                \
+  X(store_oob, code_error(c, "store out of memory"); NEXT)              \
+  X(putc_reg, ELI_PUTC(R(src)); NEXT)                                   \
+  X(putc_imm, ELI_PUTC(I(src)); NEXT)                                   \
+  X(getc, SNAPSHOT(g_module, c->inst);                                  \
+    { int ch = ELI_GETC(); R(dst) = WRAP(ch == EOF ? 0 : ch); } NEXT)   \
+  X(exit, ELI_EXIT(); NEXT)                                             \
+  X(dump, SNAPSHOT(g_module, c->inst); NEXT)                            \
+  ELI_ARITH(X, eq, ELI_EQ)                                              \
+  ELI_ARITH(X, ne, ELI_NE)                                              \
+  ELI_ARITH(X, lt, ELI_LT)                                              \
+  ELI_ARITH(X, gt, ELI_GT)                                              \
+  ELI_ARITH(X, le, ELI_LE)                                              \
+  ELI_ARITH(X, ge, ELI_GE)                                              \
+  ELI_ARITH(X, mul, ELI_MUL)                                            \
+  ELI_ARITH(X, div, ELI_DIV)                                            \
+  ELI_ARITH(X, mod, ELI_MOD)                                            \
+  ELI_ARITH(X, and, ELI_AND)                                            \
+  ELI_ARITH(X, or, ELI_OR)                                              \
+  ELI_ARITH(X, xor, ELI_XOR)                                            \
+  ELI_ARITH(X, shl, ELI_SHL)                                            \
+  ELI_ARITH(X, shr, ELI_SHR)                                            \
+  ELI_MEM_OP(X, memcpy, MEMCPY)                                         \
+  ELI_MEM_OP(X, memset, MEMSET)                                         \
+  ELI_JCC(X, jeq, ELI_EQ)                                               \
+  ELI_JCC(X, jne, ELI_NE)                                               \
+  ELI_JCC(X, jlt, ELI_LT)                                               \
+  ELI_JCC(X, jgt, ELI_GT)                                               \
+  ELI_JCC(X, jle, ELI_LE)                                               \
+  ELI_JCC(X, jge, ELI_GE)                                               \
+  X(jmp_reg, JUMP(jump_to(R(jmp))))                                     \
+  X(jmp_imm, JUMP_IMM())                                                \
+  ELI_FUSED_CODES(X)
+
+#define JUMP_IMM() JUMP(c->target ? c->target : jump_to(I(jmp)))
+
+enum {
+#define X(name, body) K_##name,
+  ELI_CODES(X)
+#undef X
+  NUM_KINDS
+};
+
+static int lower_kind(Inst* inst) {
+  int src_imm = inst->src.type == IMM;
+  int jmp_imm = inst->jmp.type == IMM;
+  switch (inst->op) {
+    case MOV: return K_mov_reg + src_imm;
+    case ADD: return K_add_reg + src_imm;
+    case SUB: return K_sub_reg + src_imm;
+    case LOAD: return K_load_reg + src_imm;
+    case STORE: return K_store_reg + src_imm;
+    case PUTC: return K_putc_reg + src_imm;
+    case GETC: return K_getc;
+    case EXIT: return K_exit;
+    case DUMP: return K_dump;
+    case EQ: return K_eq_reg + src_imm;
+    case NE: return K_ne_reg + src_imm;
+    case LT: return K_lt_reg + src_imm;
+    case GT: return K_gt_reg + src_imm;
+    case LE: return K_le_reg + src_imm;
+    case GE: return K_ge_reg + src_imm;
+    case MUL: return K_mul_reg + src_imm;
+    case DIV: return K_div_reg + src_imm;
+    case MOD: return K_mod_reg + src_imm;
+    case AND: return K_and_reg + src_imm;
+    case OR: return K_or_reg + src_imm;
+    case XOR: return K_xor_reg + src_imm;
+    case SHL: return K_shl_reg + src_imm;
+    case SHR: return K_shr_reg + src_imm;
+    case MEMCPY: return K_memcpy_reg_reg + src_imm + jmp_imm * 2;
+    case MEMSET: return K_memset_reg_reg + src_imm + jmp_imm * 2;
+    case JEQ: return K_jeq_reg_reg + src_imm + jmp_imm * 2;
+    case JNE: return K_jne_reg_reg + src_imm + jmp_imm * 2;
+    case JLT: return K_jlt_reg_reg + src_imm + jmp_imm * 2;
+    case JGT: return K_jgt_reg_reg + src_imm + jmp_imm * 2;
+    case JLE: return K_jle_reg_reg + src_imm + jmp_imm * 2;
+    case JGE: return K_jge_reg_reg + src_imm + jmp_imm * 2;
+    case JMP: return K_jmp_reg + jmp_imm;
+    default: return K_oops;
+  }
+}
+
+static bool is_reg(Value* v, int reg) {
+  return v->type == REG && (int)v->reg == reg;
+}
+
+static bool is_imm(Value* v, int imm) {
+  return v->type == IMM && v->imm == imm;
+}
+
+// Turns the first Code of each sequence ELI_FUSED_CODES covers into its
+// superinstruction. The others stay as they are; nothing jumps to them,
+// as they aren't the first of their pc.
+static void fuse_codes(Module* m, Code* codes) {
+  for (int i = 0; i + 1 < m->num_insts; i++) {
+    Inst* a = &m->text[i];
+    Inst* b = &m->text[i + 1];
+    Inst* c = i + 2 < m->num_insts ? &m->text[i + 2] : NULL;
+    Code* code = &codes[i];
+    if (b->pc != a->pc)
+      continue;
+    if (c && c->pc != a->pc)
+      c = NULL;
+
+    if (a->op == SUB && is_imm(&a->src, 1) && b->op == STORE &&
+        b->dst.type == REG && is_reg(&b->src, a->dst.reg)) {
+      code->kind = K_push;
+      code->src = b->dst.reg;
+    } else if (a->op == LOAD && a->src.type == REG && b->op == ADD &&
+               is_reg(&b->dst, a->src.reg) && is_imm(&b->src, 1)) {
+      code->kind = K_pop;
+    } else if (c && a->op == MOV && a->src.type == REG && b->op == ADD &&
+               is_reg(&b->dst, a->dst.reg) && b->src.type == IMM &&
+               (c->op == LOAD || c->op == STORE) &&
+               is_reg(&c->src, a->dst.reg)) {
+      code->kind = c->op == LOAD ? K_load_off : K_store_off;
+      code->aux = a->dst.reg;
+      code->dst = c->dst.reg;
+      code->jmp = WRAP(b->src.imm);
+    } else if (a->op >= EQ && a->op <= GE &&
+               (b->op == JEQ || b->op == JNE) &&
+               is_reg(&b->dst, a->dst.reg) && is_imm(&b->src, 0) &&
+               b->jmp.type == IMM) {
+      code->kind = (K_eqj_reg_nz + (a->op - EQ) * 4 +
+                    (a->src.type == IMM) + (b->op == JEQ) * 2);
+      code->jmp = codes[i + 1].jmp;
+      code->target = codes[i + 1].target;
+    }
+  }
+}
+
+static Code* lower_module(Module* m) {
+  // One extra Code catches execution falling off the end of text.
+  Code* codes = calloc(m->num_insts + 1, sizeof(Code));
+  g_codes = codes;
+  g_module = m;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    Code* c = &codes[i];
+    c->kind = lower_kind(inst);
+    c->inst = inst;
+    c->dst = inst->dst.type == REG ? (int)inst->dst.reg : inst->dst.imm;
+    c->src = inst->src.type == REG ? (int)inst->src.reg : WRAP(inst->src.imm);
+    if ((inst->op == LOAD || inst->op == STORE) && inst->src.type == IMM &&
+        OUT_OF_MEM(c->src)) {
+      c->kind = inst->op == LOAD ? K_load_oob : K_store_oob;
+    }
+    c->jmp = inst->jmp.type == REG ? (int)inst->jmp.reg : inst->jmp.imm;
+    if (IS_EXT_OP(inst->op) && inst->jmp.type == IMM)
+      c->jmp = WRAP(c->jmp);
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM &&
+        c->jmp < m->num_pcs && m->pc_lens[c->jmp]) {
+      c->target = &codes[m->pc_starts[c->jmp]];
+    }
+  }
+  codes[m->num_insts].kind = K_end;
+  fuse_codes(m, codes);
+  return codes;
+}
+
+// Where run_threaded starts: the entry pc, or a resumed snapshot's
+// instruction, which is never fused into the Code before it.
+static Code* resume_code(Module* m) {
+#ifdef ELI_SNAPSHOT
+  if (g_resume_inst >= 0)
+    return &g_codes[g_resume_inst];
+#endif
+  return jump_to(m->text->pc);
+}
+
+#ifdef ELI_COMPUTED_GOTO
+
+#define NEXT c++; goto *c->label;
+#define NEXT_N(n) c += n; goto *c->label;
+#define JUMP(t) { c = (t); goto *c->label; }
+
+static void run_threaded(Module* m) {
+  static void* labels[] = {
+#define X(name, body) &&L_##name,
+    ELI_CODES(X)
+#undef X
+  };
+  Code* codes = g_codes && g_module == m ? g_codes : lower_module(m);
+  for (int i = 0; i <= m->num_insts; i++)
+    codes[i].label = labels[codes[i].kind];
+
+  Code* c = resume_code(m);
+  goto *c->label;
+#define X(name, body) L_##name: body
+  ELI_CODES(X)
+#undef X
+}
+
+#else
+
+#define NEXT return c + 1;
+#define NEXT_N(n) return c + n;
+#define JUMP(t) return (t);
+
+#define X(name, body) static Code* h_##name(Code* c) { body }
+ELI_CODES(X)
+#undef X
+
+static void run_threaded(Module* m) {
+  static Code* (*handlers[])(Code*) = {
+#define X(name, body) h_##name,
+    ELI_CODES(X)
+#undef X
+  };
+  Code* codes = g_codes && g_module == m ? g_codes : lower_module(m);
+  for (int i = 0; i <= m->num_insts; i++)
+    codes[i].fn = handlers[codes[i].kind];
+
+  Code* c = resume_code(m);
+  for (;;)
+    c = c->fn(c);
+}
+
+#endif  // ELI_COMPUTED_GOTO
+
+#ifdef ELI_JIT
+
+static void jit_putc(int c) {
+  putchar_unlocked(c);
+}
+
+static int jit_getc(void) {
+  int c = getchar_unlocked();
+  return c == EOF ? 0 : c;
+}
+
+static void jit_fail(int reason) {
+  error(reason ? "fell off the end of text" : "jump to invalid pc");
+}
+
+// Returns false if the module can't be run by the JIT, e.g., with a
+// non-default word or memory size.
+static bool run_jit(Module* m) {
+  if (g_word_mask != UINT_MAX || g_mem_size != MEMSZ)
+    return false;
+  x86_jit_entry_t entry = x86_jit_compile(m, jit_putc, jit_getc, jit_fail);
+  if (!entry)
+    return false;
+  if (g_perf_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* fp = fopen(path, "w");
+    if (fp) {
+      x86_jit_write_perf_map(m, fp);
+      fclose(fp);
+    }
+  }
+  entry(mem);
+  return true;
+}
+
+#endif  // ELI_JIT
+
+// Loads the data into mem, which must be zero-filled.
+static void load_data(Module* m) {
+  unsigned int i;
+  i = 0;
+  for (Data* d = m->data; d; d = d->next, i++) {
+    if (OUT_OF_MEM(i))
+      error("data does not fit in memory");
+    mem[i] = WRAP(d->v);
+  }
+}
+
+// Runs the text of m, whose data is in mem, until EXIT.
+static void run_loaded(Module* m) {
+#ifdef ELI_SNAPSHOT
+  // A snapshot holds the data as the program left it.
+  if (g_resume_path)
+    load_snapshot(m, g_resume_path);
+#endif
+
+#ifndef __eir__
+  if (g_profile)
+    init_profile(m);
+  if (g_mem_stats)
+    init_mem_stats(m);
+  bool instrumented = g_profile || g_mem_stats;
+#else
+  bool instrumented = false;
+#endif
+#ifdef ELI_JIT
+  // Falls back to the interpreter when the JIT can't be used.
+  if (jit && !verbose && !instrumented && !g_snapshot_path &&
+      !g_resume_path && run_jit(m))
+    return;
+#endif
+  if (instrumented || verbose)
+    run_switch(m);
+  else
+    run_threaded(m);
+}
+
+static void run_module(Module* m) {
+  load_data(m);
+  run_loaded(m);
+}
+
+#ifdef ELI_BATCH
+
+// Runs m with in as stdin and out as stdout in a child, which shares
+// the loaded memory and the threaded code copy-on-write. Returns the
+// exit status of the child, or -1 if it didn't exit.
+static int batch_run(Module* m, const char* in, const char* out) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+    ir_fatal("fork failed");
+  if (pid == 0) {
+    if (!freopen(in, "rb", stdin))
+      ir_fatal("failed to open %s", in);
+    if (!freopen(out, "wb", stdout))
+      ir_fatal("failed to open %s", out);
+    run_loaded(m);
+    exit(0);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+// --batch loads m once and runs it per input. With input files, each
+// one's output goes to the file with ".out" appended. Without, each
+// line of stdin is an input path and an output path separated by a
+// tab, and each run is answered with a line of the output path and
+// the exit status, so another process can drive eli through pipes.
+static int run_batch(Module* m, int num_inputs, char** inputs) {
+  load_data(m);
+  if (!jit && !verbose && !g_profile && !g_mem_stats)
+    lower_module(m);
+
+  int failed = 0;
+  if (num_inputs) {
+    for (int i = 0; i < num_inputs; i++) {
+      char* out = malloc(strlen(inputs[i]) + 5);
+      sprintf(out, "%s.out", inputs[i]);
+      int status = batch_run(m, inputs[i], out);
+      if (status) {
+        fprintf(stderr, "%s: exit status %d\n", inputs[i], status);
+        failed = 1;
+      }
+      free(out);
+    }
+    return failed;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, "\r\n")] = 0;
+    char* out = strchr(line, '\t');
+    if (!out) {
+      if (line[0])
+        fprintf(stderr, "batch: expected input<TAB>output: %s\n", line);
+      continue;
+    }
+    *out++ = 0;
+    printf("%s\t%d\n", out, batch_run(m, line, out));
+    fflush(stdout);
+  }
+  return failed;
+}
+
+// --lockstep is --batch with input files run LANES at a time in
+// lockstep, one per lane.
+// Each step runs the instruction with the lowest index any lane is at,
+// for all the lanes there. Registers are vectors with a lane each, so
+// MOV, ADD, SUB and comparisons of all the lanes are a few SIMD
+// instructions. Other ops loop over the lanes, each with its own
+// memory and files. A lane which exits takes the next input.
+#define LANES 8
+#define LANE_IDLE 0x7fffffff
+
+typedef int LaneVec __attribute__((vector_size(LANES * sizeof(int))));
+
+typedef struct {
+  LaneVec regs[6];
+  // The index of each lane's next instruction, or LANE_IDLE.
+  LaneVec idx;
+  int* mem[LANES];
+  FILE* in[LANES];
+  FILE* out[LANES];
+  const char* name[LANES];
+  // The data as loaded into each lane's memory.
+  int* data;
+  int num_data;
+  char** inputs;
+  int num_inputs;
+  int next_input;
+  int failed;
+} Lanes;
+
+// Sets the lanes of dst selected by on to v.
+#define LANE_SET(dst, v, on) dst = ((v) & (on)) | (dst & ~(on))
+
+static void lane_start(Lanes* ln, int l);
+
+// Finishes the run of lane l and starts it on the next input, if any.
+static void lane_finish(Lanes* ln, int l, const char* msg, int at) {
+  if (msg) {
+    fprintf(stderr, "%s: %s (pc=%d)\n", ln->name[l], msg, at);
+    ln->failed = 1;
+  }
+  fclose(ln->in[l]);
+  if (fclose(ln->out[l])) {
+    fprintf(stderr, "%s: failed to write output\n", ln->name[l]);
+    ln->failed = 1;
+  }
+  munmap(ln->mem[l], g_mem_size * sizeof(int));
+  ln->idx[l] = LANE_IDLE;
+  lane_start(ln, l);
+}
+
+static void lane_start(Lanes* ln, int l) {
+  while (ln->next_input < ln->num_inputs) {
+    const char* in = ln->inputs[ln->next_input++];
+    char* out = malloc(strlen(in) + 5);
+    sprintf(out, "%s.out", in);
+    ln->in[l] = fopen(in, "rb");
+    ln->out[l] = ln->in[l] ? fopen(out, "wb") : NULL;
+    free(out);
+    if (!ln->out[l]) {
+      fprintf(stderr, "%s: failed to open\n", in);
+      if (ln->in[l])
+        fclose(ln->in[l]);
+      ln->failed = 1;
+      continue;
+    }
+    ln->mem[l] = mmap(NULL, g_mem_size * sizeof(int), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ln->mem[l] == MAP_FAILED)
+      ir_fatal("failed to allocate memory");
+    memcpy(ln->mem[l], ln->data, ln->num_data * sizeof(int));
+    for (int r = 0; r < 6; r++)
+      ln->regs[r][l] = 0;
+    ln->name[l] = in;
+    ln->idx[l] = 0;
+    return;
+  }
+}
+
+static int lane_value(Lanes* ln, Value* v, int l) {
+  return v->type == REG ? ln->regs[v->reg][l] : WRAP(v->imm);
+}
+
+// Sets r to -1 in the lanes where the comparison of op holds and to 0
+// elsewhere. Vectors are passed by pointer, as their size would make
+// the ABI depend on AVX.
+static void lane_cmp(int op, LaneVec* d, LaneVec* s, LaneVec* r) {
+  if (op >= 16)
+    op -= 8;
+  switch (op) {
+    case JEQ: *r = *d == *s; break;
+    case JNE: *r = *d != *s; break;
+    case JLT: *r = *d < *s; break;
+    case JGT: *r = *d > *s; break;
+    case JLE: *r = *d <= *s; break;
+    case JGE: *r = *d >= *s; break;
+    default: *r = (LaneVec){0} - 1;
+  }
+}
+
+// Runs inst, which is an op without a vector form, in each lane of on.
+static void lane_step(Lanes* ln, Inst* inst, LaneVec* on) {
+  for (int l = 0; l < LANES; l++) {
+    if (!(*on)[l])
+      continue;
+    int* d = inst->dst.type == REG ? &ln->regs[inst->dst.reg][l] : NULL;
+    int s = lane_value(ln, &inst->src, l);
+    switch (inst->op) {
+      case LOAD:
+        if (OUT_OF_MEM(s))
+          lane_finish(ln, l, "load out of memory", inst->pc);
+        else
+          *d = ln->mem[l][s];
+        break;
+
+      case STORE:
+        if (OUT_OF_MEM(s))
+          lane_finish(ln, l, "store out of memory", inst->pc);
+        else
+          ln->mem[l][s] = *d;
+        break;
+
+      case PUTC:
+        putc_unlocked(s, ln->out[l]);
+        break;
+
+      case GETC: {
+        int c = getc_unlocked(ln->in[l]);
+        *d = WRAP(c == EOF ? 0 : c);
+        break;
+      }
+
+      case EXIT:
+        lane_finish(ln, l, NULL, 0);
+        break;
+
+      case DUMP:
+        break;
+
+      case MUL:
+      case DIV:
+      case MOD:
+      case AND:
+      case OR:
+      case XOR:
+      case SHL:
+      case SHR:
+        *d = WRAP(eval_ext_op(inst->op, *d, s));
+        break;
+
+      case MEMCPY:
+      case MEMSET: {
+        int* saved = mem;
+        mem = ln->mem[l];
+        bool ok = run_mem_op(inst->op, *d, s, lane_value(ln, &inst->jmp, l));
+        mem = saved;
+        if (!ok) {
+          lane_finish(ln, l, inst->op == MEMCPY ?
+                      "memcpy out of memory" : "memset out of memory",
+                      inst->pc);
+        }
+        break;
+      }
+
+      default:
+        ir_fatal("oops op=%d", inst->op);
+    }
+  }
+}
+
+static int run_lockstep(Module* m, int num_inputs, char** inputs) {
+  Lanes ln;
+  memset(&ln, 0, sizeof(ln));
+  ln.inputs = inputs;
+  ln.num_inputs = num_inputs;
+  for (Data* d = m->data; d; d = d->next)
+    ln.num_data++;
+  if (OUT_OF_MEM(ln.num_data - 1) && ln.num_data)
+    ir_fatal("data does not fit in memory");
+  ln.data = malloc(ln.num_data * sizeof(int) + 1);
+  int i = 0;
+  for (Data* d = m->data; d; d = d->next)
+    ln.data[i++] = WRAP(d->v);
+  for (int l = 0; l < LANES; l++) {
+    ln.idx[l] = LANE_IDLE;
+    lane_start(&ln, l);
   }
 
+  for (;;) {
+    int cur = LANE_IDLE;
+    for (int l = 0; l < LANES; l++) {
+      if (ln.idx[l] < cur)
+        cur = ln.idx[l];
+    }
+    if (cur == LANE_IDLE)
+      break;
+    LaneVec on = ln.idx == cur;
+    if (cur == m->num_insts) {
+      for (int l = 0; l < LANES; l++) {
+        if (on[l])
+          lane_finish(&ln, l, "fell off the end of text", -1);
+      }
+      continue;
+    }
+
+    Inst* inst = &m->text[cur];
+    LaneVec s;
+    if (inst->src.type == REG)
+      s = ln.regs[inst->src.reg];
+    else
+      s = (LaneVec){0} + WRAP(inst->src.imm);
+    LaneVec* d = inst->dst.type == REG ? &ln.regs[inst->dst.reg] : NULL;
+    LaneVec c;
+    switch (inst->op) {
+      case MOV:
+        LANE_SET(*d, s, on);
+        ln.idx -= on;
+        break;
+
+      case ADD:
+        LANE_SET(*d, (*d + s) & g_word_mask, on);
+        ln.idx -= on;
+        break;
+
+      case SUB:
+        LANE_SET(*d, (*d - s) & g_word_mask, on);
+        ln.idx -= on;
+        break;
+
+      case EQ:
+      case NE:
+      case LT:
+      case GT:
+      case LE:
+      case GE:
+        lane_cmp(inst->op, d, &s, &c);
+        LANE_SET(*d, c & 1, on);
+        ln.idx -= on;
+        break;
+
+      case JEQ:
+      case JNE:
+      case JLT:
+      case JGT:
+      case JLE:
+      case JGE:
+      case JMP: {
+        lane_cmp(inst->op, d, &s, &c);
+        LaneVec taken = on & c;
+        ln.idx -= on & ~taken;
+        for (int l = 0; l < LANES; l++) {
+          if (!taken[l])
+            continue;
+          int npc = lane_value(&ln, &inst->jmp, l);
+          if (npc < 0 || npc >= m->num_pcs || !m->pc_lens[npc])
+            lane_finish(&ln, l, "jump to invalid pc", inst->pc);
+          else
+            ln.idx[l] = m->pc_starts[npc];
+        }
+        break;
+      }
+
+      default:
+        // Lanes which finish here get their new index.
+        ln.idx -= on;
+        lane_step(&ln, inst, &on);
+    }
+  }
+  free(ln.data);
+  return ln.failed;
+}
+
+#endif  // ELI_BATCH
+
+#ifdef ELI_LIBRARY
+
+void eli_run(Module* m, int (*getc_fn)(void*),
+             void (*putc_fn)(int, void*), void* ctx) {
+  g_lib_getc = getc_fn;
+  g_lib_putc = putc_fn;
+  g_lib_ctx = ctx;
+  memset(regs, 0, sizeof(regs));
+  mem = mmap(NULL, g_mem_size * sizeof(int), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    mem = NULL;
+    error("failed to allocate memory");
+  }
+  if (!setjmp(g_lib_exit))
+    run_module(m);
+}
+
+// Frees what eli_run allocated, also after it failed with ir_fatal.
+void eli_release(void) {
+  if (mem)
+    munmap(mem, g_mem_size * sizeof(int));
+  mem = NULL;
+  free(g_codes);
+  g_codes = NULL;
+}
+
+#else
+
+int main(int argc, char* argv[]) {
+#ifdef ELI_BATCH
+  bool batch = false;
+  bool lockstep = false;
+#endif
+#if defined(NOFILE) || defined(__eir__)
+  Module* m = load_eir(stdin);
+#else
+  bool intrinsics = false;
+  for (; argc >= 2 && argv[1][0] == '-'; argc--, argv++) {
+    if (!strcmp(argv[1], "-v")) {
+      verbose = true;
+    } else if (!strcmp(argv[1], "-p")) {
+      g_profile = true;
+      g_prof_report = true;
+    } else if (argc >= 3 && !strcmp(argv[1], "--profile-out")) {
+      g_profile = true;
+      g_prof_out = argv[2];
+      argc--;
+      argv++;
+    } else if (argc >= 3 && !strcmp(argv[1], "--cost-profile")) {
+      g_profile = true;
+      g_cost_out = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-s")) {
+      g_mem_stats = true;
+    } else if (!strcmp(argv[1], "--intrinsics")) {
+      // Runs known libc routines natively (see ir/intrinsic.h).
+      intrinsics = true;
+    } else if (!strcmp(argv[1], "--jit")) {
+      jit = true;
+    } else if (!strcmp(argv[1], "--perf-map")) {
+      jit = true;
+      g_perf_map = true;
+#ifdef ELI_BATCH
+    } else if (!strcmp(argv[1], "--flush-at-exit")) {
+      g_flush_at_exit = true;
+    } else if (!strcmp(argv[1], "--batch")) {
+      batch = true;
+    } else if (!strcmp(argv[1], "--lockstep")) {
+      batch = true;
+      lockstep = true;
+#endif
+    } else if (argc >= 3 && !strcmp(argv[1], "--snapshot")) {
+      g_snapshot_path = argv[2];
+      argc--;
+      argv++;
+    } else if (argc >= 3 && !strcmp(argv[1], "--resume")) {
+      g_resume_path = argv[2];
+      argc--;
+      argv++;
+    } else if (argc >= 3 && !strcmp(argv[1], "-w")) {
+      // Word size in bits.
+      int bits = atoi(argv[2]);
+      if (bits < 8 || bits > 24) {
+        fprintf(stderr, "word size must be 8 to 24 bits\n");
+        return 1;
+      }
+      g_word_mask = (1 << bits) - 1;
+      argc--;
+      argv++;
+    } else if (argc >= 3 && !strcmp(argv[1], "-m")) {
+      // Memory size in words.
+      g_mem_size = atoi(argv[2]);
+      if (g_mem_size == 0 || g_mem_size > MEMSZ) {
+        fprintf(stderr, "memory size must be 1 to %d words\n", MEMSZ);
+        return 1;
+      }
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+  }
+
+  if (argc < 2) {
+    fprintf(stderr, "no input file\n");
+    return 1;
+  }
+
+  Module* m = load_eir_from_file(argv[1]);
+  if (intrinsics)
+    substitute_intrinsics(m);
+
+  setvbuf(stdin, NULL, _IOFBF, ELI_STDIO_BUF);
+  if (g_flush_at_exit || !isatty(STDOUT_FILENO))
+    setvbuf(stdout, NULL, _IOFBF, ELI_STDIO_BUF);
+#endif
+
+#ifndef __eir__
+  // Pages are zero-filled on first touch, so short runs don't pay for
+  // clearing the whole memory.
+  mem = mmap(NULL, g_mem_size * sizeof(int), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "failed to allocate memory\n");
+    return 1;
+  }
+#endif
+
+#ifdef ELI_BATCH
+  if (lockstep && argc > 2)
+    return run_lockstep(m, argc - 2, argv + 2);
+  if (batch)
+    return run_batch(m, argc - 2, argv + 2);
+#endif
+  run_module(m);
   return 0;
 }
+
+#endif  // ELI_LIBRARY
@@ -0,0 +1,171 @@
+#include <ir/intrinsic.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// The most instructions of an intrinsic's block.
+#define INTRINSIC_MAX_INSTS 16
+
+typedef struct {
+  Inst insts[INTRINSIC_MAX_INSTS];
+  int num_insts;
+  int lineno;
+} IntrinsicBuf;
+
+static Inst* intrinsic_emit(IntrinsicBuf* b, Op op, Reg dst) {
+  Inst* inst = &b->insts[b->num_insts++];
+  memset(inst, 0, sizeof(*inst));
+  inst->op = op;
+  inst->dst.type = REG;
+  inst->dst.reg = dst;
+  inst->src.type = REG;
+  inst->jmp.type = REG;
+  inst->lineno = b->lineno;
+  return inst;
+}
+
+static Inst* intrinsic_rr(IntrinsicBuf* b, Op op, Reg dst, Reg src) {
+  Inst* inst = intrinsic_emit(b, op, dst);
+  inst->src.reg = src;
+  return inst;
+}
+
+static void intrinsic_ri(IntrinsicBuf* b, Op op, Reg dst, int imm) {
+  Inst* inst = intrinsic_emit(b, op, dst);
+  inst->src.type = IMM;
+  inst->src.imm = imm;
+}
+
+// Loads the first num_args arguments into A, B and C, through D. The
+// addresses are left for optimize_module to fold into disps, as not
+// every consumer of the module takes them.
+static void intrinsic_args(IntrinsicBuf* b, int num_args) {
+  static const Reg regs[] = { A, B, C };
+  intrinsic_rr(b, MOV, D, SP);
+  for (int i = 0; i < num_args; i++) {
+    intrinsic_ri(b, ADD, D, 1);
+    intrinsic_rr(b, LOAD, regs[i], D);
+  }
+}
+
+// Pops the return address into B and jumps to it, as 8cc's epilogue.
+static void intrinsic_ret(IntrinsicBuf* b) {
+  intrinsic_rr(b, LOAD, B, SP);
+  intrinsic_ri(b, ADD, SP, 1);
+  intrinsic_emit(b, JMP, A)->jmp.reg = B;
+}
+
+// A = a op b, for __builtin_mul(a, b) and the like.
+static void intrinsic_binop(IntrinsicBuf* b, Op op) {
+  intrinsic_args(b, 2);
+  intrinsic_rr(b, op, A, B);
+}
+
+static void intrinsic_mul(IntrinsicBuf* b) {
+  intrinsic_binop(b, MUL);
+}
+
+static void intrinsic_div(IntrinsicBuf* b) {
+  intrinsic_binop(b, DIV);
+}
+
+static void intrinsic_mod(IntrinsicBuf* b) {
+  intrinsic_binop(b, MOD);
+}
+
+// my_div(a, b, o) stores the quotient and the remainder in o[0] and
+// o[1].
+static void intrinsic_my_div(IntrinsicBuf* b) {
+  intrinsic_args(b, 3);
+  intrinsic_rr(b, MOV, D, A);
+  intrinsic_rr(b, DIV, D, B);
+  intrinsic_rr(b, STORE, D, C);
+  intrinsic_rr(b, MOD, A, B);
+  intrinsic_ri(b, ADD, C, 1);
+  intrinsic_rr(b, STORE, A, C);
+}
+
+// memcpy(d, s, n) and memset(d, c, n), which return d.
+static void intrinsic_mem_op(IntrinsicBuf* b, Op op) {
+  intrinsic_args(b, 3);
+  intrinsic_rr(b, op, A, B)->jmp.reg = C;
+}
+
+static void intrinsic_memcpy(IntrinsicBuf* b) {
+  intrinsic_mem_op(b, MEMCPY);
+}
+
+static void intrinsic_memset(IntrinsicBuf* b) {
+  intrinsic_mem_op(b, MEMSET);
+}
+
+static const struct {
+  const char* name;
+  void (*emit)(IntrinsicBuf* b);
+} INTRINSICS[] = {
+  { "__builtin_mul", intrinsic_mul },
+  { "__builtin_div", intrinsic_div },
+  { "__builtin_mod", intrinsic_mod },
+  { "my_div", intrinsic_my_div },
+  { "memcpy", intrinsic_memcpy },
+  { "memset", intrinsic_memset },
+};
+
+// Fills b with the block of the intrinsic named name, or returns false
+// if there is none.
+static bool intrinsic_block(const char* name, IntrinsicBuf* b) {
+  if (!name)
+    return false;
+  for (size_t i = 0; i < sizeof(INTRINSICS) / sizeof(INTRINSICS[0]); i++) {
+    if (!strcmp(INTRINSICS[i].name, name)) {
+      b->num_insts = 0;
+      INTRINSICS[i].emit(b);
+      intrinsic_ret(b);
+      return true;
+    }
+  }
+  return false;
+}
+
+void substitute_intrinsics(Module* m) {
+  if (!m->pc_labels || is_split_basic_block_by_mem())
+    return;
+  int num_pcs = m->num_pcs;
+  if (num_pcs > m->num_pc_labels)
+    num_pcs = m->num_pc_labels;
+  IntrinsicBuf b;
+  b.lineno = -1;
+  int num_insts = m->num_insts;
+  for (int pc = 0; pc < num_pcs; pc++) {
+    if (m->pc_lens[pc] && intrinsic_block(m->pc_labels[pc], &b))
+      num_insts += b.num_insts - m->pc_lens[pc];
+  }
+  if (num_insts == m->num_insts)
+    return;
+
+  Inst* text = malloc(num_insts * sizeof(Inst));
+  int n = 0;
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    Inst* insts = &m->text[m->pc_starts[pc]];
+    int len = m->pc_lens[pc];
+    b.lineno = len ? insts[0].lineno : -1;
+    if (pc < num_pcs && len && intrinsic_block(m->pc_labels[pc], &b)) {
+      for (int i = 0; i < b.num_insts; i++) {
+        text[n] = b.insts[i];
+        text[n++].pc = pc;
+      }
+      for (int i = 0; i < b.num_insts; i++) {
+        if (IS_EXT_OP(b.insts[i].op))
+          m->ext_ops |= EXT_OP_BIT(b.insts[i].op);
+      }
+      continue;
+    }
+    memcpy(text + n, insts, len * sizeof(Inst));
+    n += len;
+  }
+  m->text = text;
+  m->num_insts = n;
+  for (int i = 0; i < n; i++)
+    m->text[i].next = i + 1 < n ? &m->text[i + 1] : NULL;
+  index_module(m);
+}
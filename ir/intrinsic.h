@@ -0,0 +1,19 @@
+#ifndef ELVM_INTRINSIC_H_
+#define ELVM_INTRINSIC_H_
+
+#include <ir/ir.h>
+
+// Replaces the entry block of each libc routine in m which has a native
+// equivalent among the extension ops with a single block running it:
+// __builtin_mul, __builtin_div, __builtin_mod, my_div, memcpy and
+// memset. They are found by their labels in pc_labels, so this is a
+// no-op for .eirb input. The block follows 8cc's calling convention:
+// the return address is at SP and the arguments above it, the result
+// goes in A, and B to D are clobbered. The rest of the compiled body
+// stays in place, unreached. Run it before optimize_module, which may
+// then inline the new blocks, and before lower_ext_ops, which expands
+// the ops again for backends without them. Not for backends which
+// split basic blocks by memory accesses.
+void substitute_intrinsics(Module* m);
+
+#endif  // ELVM_INTRINSIC_H_
@@ -1,6 +1,7 @@
 #include <ir/ir.h>
 
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,45 +10,208 @@
 
 #include <ir/table.h>
 
+// On the host, the lexer scans a whole-file buffer with plain pointers.
+// ELVM's getchar is already the only I/O primitive and its memory is
+// tight, so the self-hosted build keeps streaming through fgetc.
+#ifndef __eir__
+# define IR_BUFFERED
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <time.h>
+# include <unistd.h>
+#endif
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+# define IR_HEAP_STATS
+# include <malloc.h>
+#endif
+
 static bool g_split_basic_block_by_mem = false;
+static bool g_prune_unreachable = false;
+static bool g_merge_strings = false;
+// The settings of split_cold_blocks. g_cold_align is 0 when it's off.
+static int g_cold_align;
+static long** g_cold_counts;
+static int* g_cold_num_counts;
 
-typedef struct DataPrivate_ {
-  int v;
-  struct DataPrivate_* next;
-  Value val;
-  int lineno;
-} DataPrivate;
+void (*elvm_error_hook)(const char* msg);
+
+void ir_fatal(const char* fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, 255, fmt, ap);
+  va_end(ap);
+  buf[255] = 0;
+  if (elvm_error_hook)
+    elvm_error_hook(buf);
+  fprintf(stderr, "%s\n", buf);
+  exit(1);
+}
+
+// The data words of one .data subsection, in the order they appear.
+typedef struct {
+  Value* vals;
+  int len;
+  int cap;
+} DataBucket;
+
+// A string literal which now lives at offset off of the one labeled of.
+typedef struct {
+  const char* label;
+  const char* of;
+  int off;
+} StrAlias;
+
+// PARSE_ALL builds the whole module. A streamed module is parsed twice:
+// PARSE_LAYOUT collects data and labels and only counts instructions,
+// then PARSE_TEXT ignores data and resolves references as it reads.
+typedef enum {
+  PARSE_ALL, PARSE_LAYOUT, PARSE_TEXT
+} ParseMode;
 
 typedef struct {
   const char* filename;
+  ParseMode mode;
   int lineno;
   int col;
+#ifdef IR_BUFFERED
+  const char* cur;
+  const char* end;
+#else
   FILE* fp;
+#endif
   Table* symtab;
+  // Every name the parser keeps, once each: a set of copies in arena
+  // chunks, which all labels and references share. Tables then find
+  // them by pointer without comparing the strings.
+  Table* strs;
+  char* str_arena;
+  int str_arena_left;
+  // The labels in text, whose values are pcs.
+  Table* text_labels;
+  bool* addr_taken;
+  bool* data_labels;
   int in_text;
   Inst* text;
   int pc;
   int subsection;
-  DataPrivate* data;
+  // Data words by subsection, which serialize_data concatenates into
+  // data_vals. resolve_syms then turns them into num_data words.
+  DataBucket* buckets;
+  int num_buckets;
+  // The string literals merge_strings folded into others.
+  StrAlias* str_aliases;
+  int num_str_aliases;
+  Value* data_vals;
+  Data* data;
+  int num_data;
   bool prev_boundary;
+  int num_insts;
+  int ext_ops;
+  // Instructions of the current chunk when streaming.
+  Inst* chunk;
+  int chunk_len;
+  int chunk_cap;
+  Inst scratch_inst;
+  Value scratch_data;
+  // The .file and .loc directives (see Module), which PARSE_TEXT skips.
+  const char** src_files;
+  int num_src_files;
+  SrcLoc* src_locs;
+  int num_src_locs;
+  int src_locs_cap;
+  const char** pc_labels;
 } Parser;
 
 enum {
   DATA = LAST_OP + 1, TEXT, LONG, STRING, FILENAME, LOC
 };
 
+// STR and STR_END are the words of a .string, the latter its NUL, which
+// serialize_data turns into IMM. DROPPED marks what merge_strings_syms
+// removes.
 enum {
-  REF = IMM + 1, LABEL
+  REF = IMM + 1, LABEL, STR, STR_END, DROPPED
 };
 
 #ifdef __GNUC__
 __attribute__((noreturn))
 #endif
 static void ir_error(Parser* p, const char* msg) {
-  fprintf(stderr, "%s:%d:%d: %s\n", p->filename, p->lineno, p->col, msg);
-  exit(1);
+  ir_fatal("%s:%d:%d: %s", p->filename, p->lineno, p->col, msg);
 }
 
+#ifdef IR_BUFFERED
+
+static int ir_getc(Parser* p) {
+  if (p->cur == p->end) {
+    p->col++;
+    return EOF;
+  }
+  int c = (unsigned char)*p->cur++;
+  if (c == '\n') {
+    p->lineno++;
+    p->col = 0;
+  } else {
+    p->col++;
+  }
+  return c;
+}
+
+static void ir_ungetc(Parser* p, int c) {
+  if (c == EOF)
+    return;
+  if (c == '\n') {
+    p->lineno--;
+  }
+  p->cur--;
+}
+
+static int peek(Parser* p) {
+  return p->cur == p->end ? EOF : (unsigned char)*p->cur;
+}
+
+static void skip_until_ret(Parser* p) {
+  const char* s = p->cur;
+  for (; s != p->end && *s != '\n'; s++) {}
+  p->col += s - p->cur;
+  p->cur = s;
+}
+
+static void skip_ws(Parser* p) {
+  const char* s = p->cur;
+  for (; s != p->end && isspace((unsigned char)*s); s++) {
+    if (*s == '\n') {
+      p->lineno++;
+      p->col = 0;
+    } else {
+      p->col++;
+    }
+  }
+  p->cur = s;
+}
+
+static void read_while_ident(Parser* p, char* buf, int len) {
+  const char* s = p->cur;
+  const char* e = p->end - s > len ? s + len : p->end;
+  for (; s != e; s++) {
+    int c = (unsigned char)*s;
+    if (!isalnum(c) && c != '_' && c != '.')
+      break;
+  }
+  if (s - p->cur == len)
+    ir_error(p, "too long ident");
+  memcpy(buf, p->cur, s - p->cur);
+  buf[s - p->cur] = 0;
+  p->col += s - p->cur;
+  p->cur = s;
+}
+
+#else
+
 static int ir_getc(Parser* p) {
   int c = fgetc(p->fp);
   if (c == '\n') {
@@ -105,6 +269,8 @@ static void read_while_ident(Parser* p, char* buf, int len) {
   ir_error(p, "too long ident");
 }
 
+#endif  // IR_BUFFERED
+
 static int read_int(Parser* p, int c) {
   bool is_minus = false;
   int r = 0;
@@ -123,58 +289,84 @@ static int read_int(Parser* p, int c) {
   return is_minus ? -r : r;
 }
 
-static DataPrivate* add_data(Parser* p) {
-  DataPrivate* n = malloc(sizeof(DataPrivate));
-  n->next = 0;
-  n->v = p->subsection;
-  n->lineno = p->lineno;
-  p->data->next = n;
-  p->data = n;
-  return n;
+static Value* add_data(Parser* p) {
+  if (p->mode == PARSE_TEXT)
+    return &p->scratch_data;
+  if (p->subsection >= p->num_buckets) {
+    int n = p->subsection + 1;
+    p->buckets = realloc(p->buckets, n * sizeof(DataBucket));
+    memset(p->buckets + p->num_buckets, 0,
+           (n - p->num_buckets) * sizeof(DataBucket));
+    p->num_buckets = n;
+  }
+  DataBucket* b = &p->buckets[p->subsection];
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    b->vals = realloc(b->vals, b->cap * sizeof(Value));
+  }
+  return &b->vals[b->len++];
 }
 
 static void add_imm_data(Parser* p, int v) {
-  DataPrivate* n = add_data(p);
-  n->val.type = IMM;
-  n->val.imm = v;
+  Value* d = add_data(p);
+  d->type = IMM;
+  d->imm = v;
 }
 
-static void serialize_data(Parser* p, DataPrivate* data_root) {
-  bool done = false;
-  DataPrivate serialized_root = {};
-  DataPrivate* serialized = &serialized_root;
-  intptr_t mp = 0;
-  for (int subsection = 0; !done; subsection++) {
-    done = true;
-    for (DataPrivate* data = data_root; data->next;) {
-      DataPrivate* prev = data;
-      data = prev->next;
-      if (data->v != subsection) {
-        continue;
-      }
-      done = false;
+static void add_str_data(Parser* p, int v) {
+  Value* d = add_data(p);
+  d->type = (ValueType)(v ? STR : STR_END);
+  d->imm = v;
+}
 
-      prev->next = data->next;
+// Lays out the subsections in order, binds the data labels, and appends
+// the _edata word, which holds the address right after it.
+static void serialize_data(Parser* p) {
+  int n = 1;
+  for (int i = 0; i < p->num_buckets; i++) {
+    for (int j = 0; j < p->buckets[i].len; j++)
+      n += p->buckets[i].vals[j].type != (ValueType)LABEL;
+  }
 
-      if (data->val.type == (ValueType)LABEL) {
-        p->symtab = table_add(p->symtab, data->val.tmp, (void*)mp);
+  p->data_vals = malloc(n * sizeof(Value));
+  p->data_labels = calloc(n, sizeof(bool));
+  intptr_t mp = 0;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    for (int j = 0; j < b->len; j++) {
+      if (b->vals[j].type == (ValueType)LABEL) {
+        p->symtab = table_add(p->symtab, b->vals[j].tmp, (void*)mp);
+        p->data_labels[mp] = true;
       } else {
-        serialized->next = data;
-        serialized = data;
-        serialized->next = 0;
+        p->data_vals[mp] = b->vals[j];
+        if (b->vals[j].type != (ValueType)REF)
+          p->data_vals[mp].type = IMM;
         mp++;
       }
-      data = prev;
     }
+    free(b->vals);
+  }
+  free(p->buckets);
+  p->buckets = NULL;
+  p->num_buckets = 0;
+
+  for (int i = 0; i < p->num_str_aliases; i++) {
+    StrAlias* a = &p->str_aliases[i];
+    const void* addr;
+    table_get(p->symtab, a->of, &addr);
+    addr = (void*)((intptr_t)addr + a->off);
+    p->symtab = table_add(p->symtab, a->label, addr);
+    p->data_labels[(intptr_t)addr] = true;
   }
+  free(p->str_aliases);
+  p->str_aliases = NULL;
+  p->num_str_aliases = 0;
 
   p->symtab = table_add(p->symtab, "_edata", (void*)mp);
-  serialized->next = malloc(sizeof(DataPrivate));
-  serialized->next->v = mp + 1;
-  serialized->next->next = 0;
-  serialized->next->val.type = IMM;
-  serialized->next->val.imm = mp + 1;
-  data_root->next = serialized_root.next;
+  p->data_labels[mp] = true;
+  p->data_vals[mp].type = IMM;
+  p->data_vals[mp].imm = mp + 1;
+  p->num_data = n;
 }
 
 static Op get_op(Parser* p, const char* buf) {
@@ -224,22 +416,175 @@ static Op get_op(Parser* p, const char* buf) {
     return LE;
   } else if (!strcmp(buf, "ge")) {
     return GE;
+  } else if (!strcmp(buf, "mul")) {
+    return MUL;
+  } else if (!strcmp(buf, "div")) {
+    return DIV;
+  } else if (!strcmp(buf, "mod")) {
+    return MOD;
+  } else if (!strcmp(buf, "and")) {
+    return AND;
+  } else if (!strcmp(buf, "or")) {
+    return OR;
+  } else if (!strcmp(buf, "xor")) {
+    return XOR;
+  } else if (!strcmp(buf, "shl")) {
+    return SHL;
+  } else if (!strcmp(buf, "shr")) {
+    return SHR;
+  } else if (!strcmp(buf, "memcpy")) {
+    return MEMCPY;
+  } else if (!strcmp(buf, "memset")) {
+    return MEMSET;
   } else if (!strcmp(buf, ".text")) {
-    return TEXT;
+    return (Op)TEXT;
   } else if (!strcmp(buf, ".data")) {
-    return DATA;
+    return (Op)DATA;
   } else if (!strcmp(buf, ".long")) {
-    return LONG;
+    return (Op)LONG;
   } else if (!strcmp(buf, ".string")) {
-    return STRING;
+    return (Op)STRING;
   } else if (!strcmp(buf, ".file")) {
-    return FILENAME;
+    return (Op)FILENAME;
   } else if (!strcmp(buf, ".loc")) {
-    return LOC;
+    return (Op)LOC;
   }
   return OP_UNSET;
 }
 
+static Inst* add_inst(Parser* p) {
+  Inst* inst;
+  if (p->mode == PARSE_ALL) {
+    inst = calloc(1, sizeof(Inst));
+    p->text->next = inst;
+  } else if (p->mode == PARSE_LAYOUT) {
+    inst = &p->scratch_inst;
+    memset(inst, 0, sizeof(Inst));
+  } else {
+    if (p->chunk_len == p->chunk_cap) {
+      p->chunk_cap = p->chunk_cap ? p->chunk_cap * 2 : 1024;
+      p->chunk = realloc(p->chunk, p->chunk_cap * sizeof(Inst));
+    }
+    inst = &p->chunk[p->chunk_len++];
+    memset(inst, 0, sizeof(Inst));
+  }
+  p->text = inst;
+  p->num_insts++;
+  return inst;
+}
+
+#define STR_ARENA_SIZE 65536
+
+// The interned copy of s, a name of at most 63 chars.
+static const char* intern(Parser* p, const char* s) {
+  const void* r;
+  if (table_get(p->strs, s, &r))
+    return r;
+  int n = strlen(s) + 1;
+  if (p->str_arena_left < n) {
+    p->str_arena = malloc(STR_ARENA_SIZE);
+    p->str_arena_left = STR_ARENA_SIZE;
+  }
+  char* c = p->str_arena;
+  memcpy(c, s, n);
+  p->str_arena += n;
+  p->str_arena_left -= n;
+  p->strs = table_add(p->strs, c, c);
+  return c;
+}
+
+static void parse_ref(Parser* p, Op op, const char* name, Value* a) {
+  a->type = (ValueType)REF;
+  if (p->mode == PARSE_ALL || (p->mode == PARSE_LAYOUT && op == (Op)LONG)) {
+    a->tmp = (void*)intern(p, name);
+  } else if (p->mode == PARSE_TEXT && op < LAST_OP) {
+    a->type = IMM;
+    if (!table_get(p->symtab, name, (void*)&a->imm)) {
+      ir_fatal("undefined sym: %s", name);
+    }
+  } else {
+    // Labels the current pass doesn't need.
+    a->type = IMM;
+    a->imm = 0;
+  }
+}
+
+static void add_src_file(Parser* p, int file, const char* name) {
+  if (file >= p->num_src_files) {
+    int n = file + 1;
+    p->src_files = realloc(p->src_files, n * sizeof(char*));
+    memset(p->src_files + p->num_src_files, 0,
+           (n - p->num_src_files) * sizeof(char*));
+    p->num_src_files = n;
+  }
+  p->src_files[file] = name;
+}
+
+static void add_src_loc(Parser* p, int eir_line, int file, int line) {
+  if (p->num_src_locs) {
+    SrcLoc* last = &p->src_locs[p->num_src_locs - 1];
+    if (last->file == file && last->line == line)
+      return;
+  }
+  if (p->num_src_locs == p->src_locs_cap) {
+    p->src_locs_cap = p->src_locs_cap ? p->src_locs_cap * 2 : 256;
+    p->src_locs = realloc(p->src_locs, p->src_locs_cap * sizeof(SrcLoc));
+  }
+  SrcLoc* loc = &p->src_locs[p->num_src_locs++];
+  loc->eir_line = eir_line;
+  loc->file = file;
+  loc->line = line;
+}
+
+static int read_directive_int(Parser* p) {
+  skip_ws(p);
+  int c = ir_getc(p);
+  if (!isdigit(c))
+    ir_error(p, "digit expected");
+  return read_int(p, c);
+}
+
+// .file <number> "<name>"
+static void parse_file_directive(Parser* p) {
+  int file = read_directive_int(p);
+  skip_ws(p);
+  if (ir_getc(p) != '"')
+    ir_error(p, "expected open '\"'");
+  int len = 0;
+  int cap = 64;
+  char* name = malloc(cap);
+  for (;;) {
+    int c = ir_getc(p);
+    if (c == '"')
+      break;
+    if (c == '\\')
+      c = ir_getc(p);
+    if (c == '\n' || c == EOF)
+      ir_error(p, "expected close '\"'");
+    if (len + 1 == cap) {
+      cap *= 2;
+      name = realloc(name, cap);
+    }
+    name[len++] = c;
+  }
+  name[len] = 0;
+  if (p->mode == PARSE_TEXT)
+    free(name);
+  else
+    add_src_file(p, file, name);
+  skip_until_ret(p);
+}
+
+// .loc <file> <line> <column>, whose column isn't kept.
+static void parse_loc_directive(Parser* p) {
+  int eir_line = p->lineno;
+  int file = read_directive_int(p);
+  int line = read_directive_int(p);
+  if (p->mode != PARSE_TEXT)
+    add_src_loc(p, eir_line, file, line);
+  skip_until_ret(p);
+}
+
 static void parse_line(Parser* p, int c) {
   char buf[64];
   buf[0] = c;
@@ -289,19 +634,19 @@ static void parse_line(Parser* p, int c) {
         } else {
           ir_error(p, "unknown escape");
         }
-        add_imm_data(p, c);
+        add_str_data(p, c);
       } else {
-        add_imm_data(p, c);
+        add_str_data(p, c);
       }
       c = ir_getc(p);
     }
-    add_imm_data(p, 0);
+    add_str_data(p, 0);
     return;
   } else if (op == (Op)FILENAME) {
-    skip_until_ret(p);
+    parse_file_directive(p);
     return;
   } else if (op == (Op)LOC) {
-    skip_until_ret(p);
+    parse_loc_directive(p);
     return;
   } else if (op == OP_UNSET) {
     c = ir_getc(p);
@@ -312,11 +657,15 @@ static void parse_line(Parser* p, int c) {
           p->pc++;
         value = p->pc;
         p->prev_boundary = true;
-        p->symtab = table_add(p->symtab, strdup(buf), (void*)value);
-      } else {
-        DataPrivate* d = add_data(p);
-        d->val.type = LABEL;
-        d->val.tmp = strdup(buf);
+        if (p->mode != PARSE_TEXT) {
+          const char* name = intern(p, buf);
+          p->symtab = table_add(p->symtab, name, (void*)value);
+          p->text_labels = table_add(p->text_labels, name, (void*)value);
+        }
+      } else if (p->mode != PARSE_TEXT) {
+        Value* d = add_data(p);
+        d->type = (ValueType)LABEL;
+        d->tmp = (void*)intern(p, buf);
       }
       return;
     }
@@ -341,6 +690,10 @@ static void parse_line(Parser* p, int c) {
     argc = 2;
   else if (op == DUMP)
     argc = 0;
+  else if (op <= SHR)
+    argc = 2;
+  else if (op <= MEMSET)
+    argc = 3;
   else if (op == (Op)LONG)
     argc = 1;
   else if (op == (Op)DATA) {
@@ -382,8 +735,7 @@ static void parse_line(Parser* p, int c) {
       } else if (!strcmp(buf, "BP")) {
         a.reg = BP;
       } else {
-        a.type = (ValueType)REF;
-        a.tmp = strdup(buf);
+        parse_ref(p, op, buf, &a);
       }
     }
     args[i] = a;
@@ -393,9 +745,9 @@ static void parse_line(Parser* p, int c) {
     if (args[0].type == IMM) {
       add_imm_data(p, args[0].imm);
     } else if (args[0].type == (ValueType)REF) {
-      DataPrivate* d = add_data(p);
-      d->val.type = REF;
-      d->val.tmp = args[0].tmp;
+      Value* d = add_data(p);
+      d->type = (ValueType)REF;
+      d->tmp = args[0].tmp;
     } else {
       ir_error(p, "number expected");
     }
@@ -404,18 +756,21 @@ static void parse_line(Parser* p, int c) {
     if (argc == 1) {
       if (args[0].type != IMM)
         ir_error(p, "number expected");
+      if (args[0].imm < 0)
+        ir_error(p, "negative subsection");
       p->subsection = args[0].imm;
     }
     p->in_text = 0;
     return;
   }
 
-  p->text->next = calloc(1, sizeof(Inst));
-  p->text = p->text->next;
+  add_inst(p);
   p->text->op = op;
   p->text->pc = p->pc;
   p->text->lineno = p->lineno;
   p->prev_boundary = false;
+  if (IS_EXT_OP(op))
+    p->ext_ops |= EXT_OP_BIT(op);
   switch (op) {
     case LOAD:
     case STORE:
@@ -433,6 +788,14 @@ static void parse_line(Parser* p, int c) {
     case GT:
     case LE:
     case GE:
+    case MUL:
+    case DIV:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
       p->text->src = args[1];
       FALLTHROUGH;
     case GETC:
@@ -443,6 +806,12 @@ static void parse_line(Parser* p, int c) {
     case EXIT:
     case DUMP:
       break;
+    case MEMCPY:
+    case MEMSET:
+      p->text->dst = args[0];
+      p->text->src = args[1];
+      p->text->jmp = args[2];
+      break;
     case JEQ:
     case JNE:
     case JLT:
@@ -466,113 +835,1277 @@ static void parse_line(Parser* p, int c) {
 #endif
 }
 
-static void parse_eir(Parser* p) {
-  Inst text_root = {};
-  DataPrivate data_root = {};
-  int c;
-
+// Starts a pass with the implicit "jmp main" at pc 0.
+static void start_parse(Parser* p, Inst* text_root) {
   p->in_text = 1;
   p->lineno = 1;
-  p->text = &text_root;
-  p->data = &data_root;
+  p->col = 0;
+  p->text = text_root;
   p->pc = 0;
   p->prev_boundary = true;
 
-  p->text->next = calloc(1, sizeof(Inst));
-  p->text = p->text->next;
+  add_inst(p);
   p->text->op = JMP;
   p->text->pc = p->pc++;
   p->text->lineno = -1;
-  p->text->jmp.type = (ValueType)REF;
-  p->text->jmp.tmp = "main";
   p->text->next = 0;
-  p->symtab = table_add(p->symtab, "main", (void*)1);
+  if (p->mode == PARSE_TEXT) {
+    p->text->jmp.type = IMM;
+    table_get(p->symtab, "main", (void*)&p->text->jmp.imm);
+  } else {
+    p->text->jmp.type = (ValueType)REF;
+    p->text->jmp.tmp = (void*)intern(p, "main");
+    p->symtab = table_add(p->symtab, p->text->jmp.tmp, (void*)1);
+  }
+}
+
+// Parses one line. Returns false at the end of input.
+static bool parse_next(Parser* p) {
+  skip_ws(p);
+  int c = ir_getc(p);
+  if (c == EOF)
+    return false;
+
+  if (c == '#') {
+    skip_until_ret(p);
+  } else if (c == '_' || c == '.' || isalpha(c)) {
+    parse_line(p, c);
+  } else {
+    ir_error(p, "unexpected char");
+  }
+  return true;
+}
+
+// The live pcs and data regions of prune_unreachable. A data region
+// runs from a label to the next one of its subsection; the words before
+// the first label of a subsection are a region which is always live.
+typedef struct {
+  Parser* p;
+  Inst** pc_insts;
+  bool* live_pcs;
+  Table* data_labels;
+  Value** region_vals;
+  int* region_lens;
+  int* region_buckets;
+  int num_regions;
+  bool* live_regions;
+  int* stack;
+  int sp;
+} Pruner;
+
+static void prune_push_region(Pruner* r, int region) {
+  if (!r->live_regions[region]) {
+    r->live_regions[region] = true;
+    r->stack[r->sp++] = region * 2 + 1;
+  }
+}
+
+// Pushes what v refers to, as pc * 2 or region * 2 + 1. A data label
+// also keeps the regions just before and after its own in the same
+// subsection, which code reaches by arithmetic on the label, as with
+// "mov A, bufend" and "sub A, N".
+static void prune_mark_ref(Pruner* r, Value* v) {
+  if (v->type != (ValueType)REF)
+    return;
+  const void* id;
+  if (table_get(r->p->text_labels, v->tmp, &id)) {
+    if (!r->live_pcs[(intptr_t)id]) {
+      r->live_pcs[(intptr_t)id] = true;
+      r->stack[r->sp++] = (intptr_t)id * 2;
+    }
+  } else if (table_get(r->data_labels, v->tmp, &id)) {
+    int region = (intptr_t)id;
+    prune_push_region(r, region);
+    if (r->region_buckets[region - 1] == r->region_buckets[region])
+      prune_push_region(r, region - 1);
+    if (region + 1 < r->num_regions &&
+        r->region_buckets[region + 1] == r->region_buckets[region])
+      prune_push_region(r, region + 1);
+  }
+}
+
+static void prune_mark_pc(Pruner* r, int pc) {
+  if (pc <= r->p->pc && !r->live_pcs[pc]) {
+    r->live_pcs[pc] = true;
+    r->stack[r->sp++] = pc * 2;
+  }
+}
+
+// Drops the blocks which can't be reached from pc 0 and the data which
+// no live code or data refers to, then renumbers the pcs. A block is
+// reached by falling through, by a direct jump, or when its label is
+// used as a value anywhere live, which covers jumps through registers.
+// Code addresses computed by arithmetic are not followed, and data
+// addresses only into the regions next to the label's.
+static void prune_unreachable_syms(Parser* p) {
+  int num_pcs = p->pc + 1;
+  int num_regions = 0;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    num_regions++;
+    for (int j = 0; j < b->len; j++) {
+      if (b->vals[j].type == (ValueType)LABEL &&
+          (!j || b->vals[j - 1].type != (ValueType)LABEL))
+        num_regions++;
+    }
+  }
+
+  Pruner r = { p };
+  r.pc_insts = calloc(num_pcs, sizeof(Inst*));
+  r.live_pcs = calloc(num_pcs, sizeof(bool));
+  r.region_vals = calloc(num_regions, sizeof(Value*));
+  r.region_lens = calloc(num_regions, sizeof(int));
+  r.region_buckets = malloc(num_regions * sizeof(int));
+  r.num_regions = num_regions;
+  r.live_regions = calloc(num_regions, sizeof(bool));
+  r.stack = malloc((num_pcs + num_regions) * sizeof(int));
+  for (Inst* inst = p->text; inst; inst = inst->next) {
+    if (!r.pc_insts[inst->pc])
+      r.pc_insts[inst->pc] = inst;
+  }
+
+  int region = -1;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    r.region_vals[++region] = b->vals;
+    r.region_buckets[region] = i;
+    prune_push_region(&r, region);
+    for (int j = 0; j < b->len; j++) {
+      Value* v = &b->vals[j];
+      if (v->type == (ValueType)LABEL) {
+        if (!j || v[-1].type != (ValueType)LABEL) {
+          r.region_vals[++region] = v;
+          r.region_buckets[region] = i;
+        }
+        r.data_labels = table_add(r.data_labels, v->tmp,
+                                  (void*)(intptr_t)region);
+      }
+      r.region_lens[region]++;
+    }
+  }
+
+  // Without a main, start_parse's jmp goes to its placeholder, pc 1.
+  const void* main_pc;
+  prune_mark_pc(&r, 0);
+  if (!table_get(p->text_labels, "main", &main_pc))
+    prune_mark_pc(&r, 1);
+  while (r.sp) {
+    int id = r.stack[--r.sp];
+    if (id % 2) {
+      Value* v = r.region_vals[id / 2];
+      for (int j = 0; j < r.region_lens[id / 2]; j++)
+        prune_mark_ref(&r, &v[j]);
+      continue;
+    }
+    int pc = id / 2;
+    Inst* last = NULL;
+    for (Inst* inst = r.pc_insts[pc]; inst && inst->pc == pc;
+         inst = inst->next) {
+      prune_mark_ref(&r, &inst->dst);
+      prune_mark_ref(&r, &inst->src);
+      prune_mark_ref(&r, &inst->jmp);
+      last = inst;
+    }
+    if (!last || last->op != JMP)
+      prune_mark_pc(&r, pc + 1);
+  }
+
+  // A dead pc maps to the next live one, which only its dead labels see.
+  int* new_pcs = malloc(num_pcs * sizeof(int));
+  int n = 0;
+  for (int pc = 0; pc < num_pcs; pc++) {
+    new_pcs[pc] = n;
+    n += r.live_pcs[pc];
+  }
+
+  Inst head = {};
+  Inst* tail = &head;
+  p->num_insts = 0;
+  p->ext_ops = 0;
+  for (Inst* inst = p->text; inst;) {
+    Inst* next = inst->next;
+    if (r.live_pcs[inst->pc]) {
+      inst->pc = new_pcs[inst->pc];
+      if (IS_EXT_OP(inst->op))
+        p->ext_ops |= EXT_OP_BIT(inst->op);
+      tail->next = inst;
+      tail = inst;
+      p->num_insts++;
+    } else {
+      free(inst);
+    }
+    inst = next;
+  }
+  tail->next = NULL;
+  p->text = head.next;
+
+  Table* labels = p->text_labels;
+  for (int i = 0; labels && i < labels->cap; i++) {
+    TableEntry* e = &labels->entries[i];
+    if (!e->key)
+      continue;
+    void* pc = (void*)(intptr_t)new_pcs[(intptr_t)e->value];
+    p->symtab = table_add(p->symtab, e->key, pc);
+    e->value = pc;
+  }
+  p->pc = new_pcs[num_pcs - 1];
 
+  region = -1;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    int len = 0;
+    region++;
+    for (int j = 0; j < b->len; j++) {
+      if (b->vals[j].type == (ValueType)LABEL &&
+          (!j || b->vals[j - 1].type != (ValueType)LABEL))
+        region++;
+      if (r.live_regions[region])
+        b->vals[len++] = b->vals[j];
+    }
+    b->len = len;
+  }
+
+  free(new_pcs);
+  free(r.pc_insts);
+  free(r.live_pcs);
+  free(r.region_vals);
+  free(r.region_lens);
+  free(r.region_buckets);
+  free(r.live_regions);
+  free(r.stack);
+}
+
+// The pc of the text label v refers to, or -1.
+static int cold_ref_pc(Parser* p, Value* v) {
+  const void* pc;
+  if (v->type == (ValueType)REF && table_get(p->text_labels, v->tmp, &pc))
+    return (intptr_t)pc;
+  return -1;
+}
+
+static bool cold_falls_through(Inst* last) {
+  return last && last->op != JMP && last->op != EXIT;
+}
+
+// Whether the block at pc can only run into EXIT, given what is known
+// to be cold so far.
+static bool cold_block(Parser* p, Inst* first, Inst* last, int pc,
+                       bool* cold, int num_pcs) {
+  for (Inst* inst = first; inst != last->next; inst = inst->next) {
+    if (inst->op == EXIT)
+      return true;
+  }
+  if (last->op >= JEQ && last->op <= JMP) {
+    int t = cold_ref_pc(p, &last->jmp);
+    if (t < 0 || !cold[t])
+      return false;
+  }
+  return !cold_falls_through(last) || (pc + 1 < num_pcs && cold[pc + 1]);
+}
+
+// Moves the cold blocks after the others, from a multiple of
+// g_cold_align on, keeping the order of each group, and renumbers the
+// pcs. A block is cold if it can only run into EXIT, like the error
+// paths which call abort, or with a profile, if it never ran. Labels
+// used as values move with their blocks, as they are still names here.
+// A block which fell through into one now elsewhere gets a jmp, in a
+// pc of its own after a conditional jump. With a numeric jump target,
+// which would go stale, nothing moves.
+static void split_cold_syms(Parser* p) {
+  int num_pcs = p->pc + 1;
+  Inst** firsts = calloc(num_pcs, sizeof(Inst*));
+  Inst** lasts = calloc(num_pcs, sizeof(Inst*));
+  bool* cold = calloc(num_pcs, sizeof(bool));
+  int* order = malloc(num_pcs * sizeof(int));
+  int* new_pcs = malloc(num_pcs * sizeof(int));
+  const char** labels = calloc(num_pcs, sizeof(char*));
+  for (Inst* inst = p->text; inst; inst = inst->next) {
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM)
+      goto out;
+    if (!firsts[inst->pc])
+      firsts[inst->pc] = inst;
+    lasts[inst->pc] = inst;
+  }
+
+  long* counts = *g_cold_counts;
+  int num_counts = *g_cold_num_counts;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int pc = num_pcs - 1; pc > 0; pc--) {
+      if (!cold[pc] && lasts[pc] &&
+          cold_block(p, firsts[pc], lasts[pc], pc, cold, num_pcs)) {
+        cold[pc] = true;
+        changed = true;
+      }
+    }
+  }
+  int num_cold = 0;
+  for (int pc = 1; pc < num_pcs; pc++) {
+    if (counts && lasts[pc] && (pc >= num_counts || !counts[pc]))
+      cold[pc] = true;
+    num_cold += cold[pc];
+  }
+  if (!num_cold)
+    goto out;
+
+  int n = 0;
+  for (int pc = 0; pc < num_pcs; pc++) {
+    if (!cold[pc])
+      order[n++] = pc;
+  }
+  for (int pc = 0; pc < num_pcs; pc++) {
+    if (cold[pc])
+      order[n++] = pc;
+  }
+
+  Table* text_labels = p->text_labels;
+  for (int i = 0; text_labels && i < text_labels->cap; i++) {
+    TableEntry* e = &text_labels->entries[i];
+    if (e->key)
+      labels[(intptr_t)e->value] = e->key;
+  }
+
+  Inst head = {};
+  Inst* tail = &head;
+  int new_pc = 0;
+  for (int i = 0; i < num_pcs; i++) {
+    int pc = order[i];
+    if (i == num_pcs - num_cold)
+      new_pc = (new_pc + g_cold_align - 1) / g_cold_align * g_cold_align;
+    new_pcs[pc] = new_pc++;
+    if (!lasts[pc])
+      continue;
+    for (Inst* inst = firsts[pc];; inst = inst->next) {
+      inst->pc = new_pcs[pc];
+      tail->next = inst;
+      tail = inst;
+      if (inst == lasts[pc])
+        break;
+    }
+    int next = pc + 1;
+    if (!cold_falls_through(tail) || next == num_pcs ||
+        (i + 1 < num_pcs && order[i + 1] == next))
+      continue;
+    if (!labels[next]) {
+      char buf[32];
+      sprintf(buf, ".Lcold%d", next);
+      labels[next] = intern(p, buf);
+      p->symtab = table_add(p->symtab, labels[next], (void*)(intptr_t)next);
+      p->text_labels = table_add(p->text_labels, labels[next],
+                                 (void*)(intptr_t)next);
+    }
+    Inst* jmp = calloc(1, sizeof(Inst));
+    jmp->op = JMP;
+    jmp->jmp.type = (ValueType)REF;
+    jmp->jmp.tmp = (void*)labels[next];
+    jmp->lineno = tail->lineno;
+    jmp->pc = tail->op >= JEQ && tail->op <= JGE ? new_pc++ : tail->pc;
+    tail->next = jmp;
+    tail = jmp;
+    p->num_insts++;
+  }
+  tail->next = NULL;
+  p->text = head.next;
+  p->pc = new_pc - 1;
+
+  text_labels = p->text_labels;
+  for (int i = 0; text_labels && i < text_labels->cap; i++) {
+    TableEntry* e = &text_labels->entries[i];
+    if (!e->key)
+      continue;
+    void* pc = (void*)(intptr_t)new_pcs[(intptr_t)e->value];
+    p->symtab = table_add(p->symtab, e->key, pc);
+    e->value = pc;
+  }
+
+  // The profile follows the blocks.
+  if (counts) {
+    long* moved = calloc(new_pc, sizeof(long));
+    for (int pc = 0; pc < num_pcs && pc < num_counts; pc++)
+      moved[new_pcs[pc]] = counts[pc];
+    free(counts);
+    *g_cold_counts = moved;
+    *g_cold_num_counts = new_pc;
+  }
+
+out:
+  free(firsts);
+  free(lasts);
+  free(cold);
+  free(order);
+  free(new_pcs);
+  free(labels);
+}
+
+// A region of merge_strings_syms which holds a string literal alone.
+typedef struct {
+  const char* label;
+  Value* vals;
+  int len;
+  int index;
+  int owner;
+  int off;
+} StrLiteral;
+
+// Orders the literals by their words from the last one back, so that
+// each literal comes right before those it is a suffix of.
+static int compare_str_literals(const void* a, const void* b) {
+  const StrLiteral* x = a;
+  const StrLiteral* y = b;
+  for (int i = 1; i <= x->len && i <= y->len; i++) {
+    int c = x->vals[x->len - i].imm;
+    int d = y->vals[y->len - i].imm;
+    if (c != d)
+      return c < d ? -1 : 1;
+  }
+  if (x->len != y->len)
+    return x->len - y->len;
+  return x->index - y->index;
+}
+
+// Whether the words of x end those of y.
+static bool is_str_suffix(const StrLiteral* x, const StrLiteral* y) {
+  if (x->len > y->len)
+    return false;
+  for (int i = 1; i <= x->len; i++) {
+    if (x->vals[x->len - i].imm != y->vals[y->len - i].imm)
+      return false;
+  }
+  return true;
+}
+
+// The length of the region after the label at vals[j] if it is one
+// .string and nothing else, under a single .L label, which 8cc only
+// gives the literals, or 0.
+static int str_literal_len(DataBucket* b, int j) {
+  Value* v = &b->vals[j];
+  if ((j && v[-1].type == (ValueType)LABEL) ||
+      strncmp(v->tmp, ".L", 2))
+    return 0;
+  int len = 0;
+  while (j + 1 + len < b->len && v[1 + len].type == (ValueType)STR)
+    len++;
+  if (j + 1 + len == b->len || v[1 + len].type != (ValueType)STR_END ||
+      (j + 2 + len < b->len && v[2 + len].type != (ValueType)LABEL))
+    return 0;
+  return len + 1;
+}
+
+// Drops each string literal which equals another one or the end of a
+// longer one, and binds its label into that one instead. Modifying a
+// literal is undefined in C, so they may share their words.
+static void merge_strings_syms(Parser* p) {
+  int num_lits = 0;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    for (int j = 0; j < b->len; j++) {
+      if (b->vals[j].type == (ValueType)LABEL)
+        num_lits += str_literal_len(b, j) > 0;
+    }
+  }
+  if (num_lits < 2)
+    return;
+
+  StrLiteral* lits = malloc(num_lits * sizeof(StrLiteral));
+  int n = 0;
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    for (int j = 0; j < b->len; j++) {
+      int len;
+      if (b->vals[j].type != (ValueType)LABEL ||
+          !(len = str_literal_len(b, j)))
+        continue;
+      StrLiteral* l = &lits[n];
+      l->label = b->vals[j].tmp;
+      l->vals = &b->vals[j + 1];
+      l->len = len;
+      l->index = n++;
+    }
+  }
+  qsort(lits, n, sizeof(StrLiteral), compare_str_literals);
+
+  p->str_aliases = malloc(n * sizeof(StrAlias));
+  for (int i = n - 1; i >= 0; i--) {
+    StrLiteral* l = &lits[i];
+    StrLiteral* next = &lits[i + 1];
+    l->owner = i;
+    l->off = 0;
+    if (i + 1 == n || !is_str_suffix(l, next))
+      continue;
+    l->owner = next->owner;
+    l->off = next->off + next->len - l->len;
+    StrAlias* a = &p->str_aliases[p->num_str_aliases++];
+    a->label = l->label;
+    a->of = lits[l->owner].label;
+    a->off = l->off;
+    for (int j = -1; j < l->len; j++)
+      l->vals[j].type = (ValueType)DROPPED;
+  }
+  free(lits);
+
+  for (int i = 0; i < p->num_buckets; i++) {
+    DataBucket* b = &p->buckets[i];
+    int len = 0;
+    for (int j = 0; j < b->len; j++) {
+      if (b->vals[j].type != (ValueType)DROPPED)
+        b->vals[len++] = b->vals[j];
+    }
+    b->len = len;
+  }
+}
+
+// What follows parsing the text: pruning, merging the string literals,
+// then laying out the data.
+static void finish_parse(Parser* p) {
+  if (g_prune_unreachable && p->mode == PARSE_ALL) {
+    ir_phase_begin("prune_unreachable");
+    prune_unreachable_syms(p);
+  }
+  if (g_cold_align && p->mode == PARSE_ALL) {
+    ir_phase_begin("split_cold_blocks");
+    split_cold_syms(p);
+  }
+  if (g_merge_strings) {
+    ir_phase_begin("merge_strings");
+    merge_strings_syms(p);
+  }
+
+  ir_phase_begin("serialize_data");
+  serialize_data(p);
+}
+
+static void parse_eir(Parser* p) {
+  Inst text_root = {};
+
+  ir_phase_begin("parse_eir");
+  start_parse(p, &text_root);
+  while (parse_next(p)) {}
+  p->text = text_root.next;
+  finish_parse(p);
+}
+
+#ifdef IR_BUFFERED
+
+// Inputs of IR_PARALLEL_MIN bytes or more are parsed in chunks of at
+// least IR_MIN_CHUNK bytes, by up to IR_MAX_THREADS threads.
+#define IR_PARALLEL_MIN (1 << 20)
+#define IR_MIN_CHUNK (256 << 10)
+#define IR_MAX_THREADS 16
+
+// A range of whole lines, parsed on its own from the section it starts
+// in. Its pcs start at 0, as if a label had just ended the block
+// before it, and parse_eir_parallel shifts them into place.
+typedef struct {
+  Parser p;
+  Inst root;
+  pthread_t thread;
+  bool started;
+} ParseChunk;
+
+static void* parse_chunk(void* arg) {
+  ParseChunk* c = arg;
+  c->p.text = &c->root;
+  while (parse_next(&c->p)) {}
+  return NULL;
+}
+
+static bool is_ident_char(int c) {
+  return isalnum(c) || c == '_' || c == '.';
+}
+
+// Reads the line at s as parse_line would, only far enough to follow
+// .text and .data and to skip .string literals, which may hold
+// newlines. Returns the start of the next line.
+static const char* prescan_line(const char* s, const char* end,
+                                int* lineno, int* in_text,
+                                int* subsection) {
   for (;;) {
-    skip_ws(p);
-    c = ir_getc(p);
-    if (c == EOF)
+    while (s != end && *s != '\n' && isspace((unsigned char)*s))
+      s++;
+    if (s == end || !is_ident_char((unsigned char)*s))
       break;
+    const char* tok = s;
+    while (s != end && is_ident_char((unsigned char)*s))
+      s++;
+    int len = s - tok;
+    if (s != end && *s == ':') {
+      // A label, which a statement may follow on the same line.
+      s++;
+      continue;
+    }
+    if (len == 5 && !memcmp(tok, ".text", 5)) {
+      *in_text = 1;
+    } else if (len == 5 && !memcmp(tok, ".data", 5)) {
+      *in_text = 0;
+      while (s != end && (*s == ' ' || *s == '\t'))
+        s++;
+      if (s != end && isdigit((unsigned char)*s))
+        *subsection = strtol(s, NULL, 10);
+    } else if (len == 7 && !memcmp(tok, ".string", 7)) {
+      while (s != end && *s != '"' && *s != '\n')
+        s++;
+      if (s != end && *s == '"') {
+        for (s++; s != end && *s != '"'; s++) {
+          if (*s == '\\' && s + 1 != end)
+            s++;
+          if (*s == '\n')
+            ++*lineno;
+        }
+      }
+    }
+    break;
+  }
+  const char* nl = s == end ? NULL : memchr(s, '\n', end - s);
+  if (!nl)
+    return end;
+  ++*lineno;
+  return nl + 1;
+}
 
-    if (c == '#') {
-      skip_until_ret(p);
-    } else if (c == '_' || c == '.' || isalpha(c)) {
-      parse_line(p, c);
-    } else {
-      ir_error(p, "unexpected char");
+// parse_eir on num_chunks threads. The chunks are split at line starts
+// found by a sequential scan, which also gives each the line number and
+// the section it starts in. Their text is then concatenated with its
+// pcs shifted by the pc where the chunk before ended, their data is
+// appended to each subsection in order, and the symbols are resolved
+// as usual afterwards.
+static void parse_eir_parallel(Parser* p, int num_chunks) {
+  Inst text_root = {};
+
+  ir_phase_begin("parse_eir");
+  start_parse(p, &text_root);
+  ParseChunk* chunks = calloc(num_chunks, sizeof(ParseChunk));
+  const char* s = p->cur;
+  size_t len = p->end - p->cur;
+  int lineno = 1;
+  int in_text = 1;
+  int subsection = 0;
+  int n = 0;
+  while (s != p->end) {
+    if (s - p->cur >= (ptrdiff_t)(len / num_chunks * n)) {
+      if (n)
+        chunks[n - 1].p.end = s;
+      Parser* q = &chunks[n++].p;
+      q->filename = p->filename;
+      q->mode = PARSE_ALL;
+      q->cur = s;
+      q->lineno = lineno;
+      q->in_text = in_text;
+      q->subsection = subsection;
+      q->prev_boundary = true;
+      if (n == num_chunks)
+        break;
     }
+    s = prescan_line(s, p->end, &lineno, &in_text, &subsection);
+  }
+  chunks[n - 1].p.end = p->end;
+
+  for (int i = 1; i < n; i++) {
+    chunks[i].started = !pthread_create(&chunks[i].thread, NULL,
+                                        parse_chunk, &chunks[i]);
+    if (!chunks[i].started)
+      parse_chunk(&chunks[i]);
+  }
+  parse_chunk(&chunks[0]);
+  for (int i = 1; i < n; i++) {
+    if (chunks[i].started)
+      pthread_join(chunks[i].thread, NULL);
   }
 
-  serialize_data(p, &data_root);
+  // A chunk whose first text is a label starts a new block, unless the
+  // text before it ended one already.
+  Inst* tail = p->text;
+  for (int i = 0; i < n; i++) {
+    Parser* q = &chunks[i].p;
+    Table* labels = q->text_labels;
+    bool has_text = q->num_insts > 0;
+    bool starts_with_label = false;
+    for (int j = 0; labels && j < labels->cap; j++) {
+      if (labels->entries[j].key) {
+        has_text = true;
+        starts_with_label |= !labels->entries[j].value;
+      }
+    }
+
+    if (has_text) {
+      int offset = p->pc + (starts_with_label && !p->prev_boundary);
+      for (Inst* inst = chunks[i].root.next; inst; inst = inst->next) {
+        inst->pc += offset;
+        tail->next = inst;
+        tail = inst;
+      }
+      for (int j = 0; labels && j < labels->cap; j++) {
+        TableEntry* e = &labels->entries[j];
+        if (!e->key)
+          continue;
+        void* pc = (void*)((intptr_t)e->value + offset);
+        p->symtab = table_add(p->symtab, e->key, pc);
+        p->text_labels = table_add(p->text_labels, e->key, pc);
+      }
+      p->pc = q->pc + offset;
+      p->prev_boundary = q->prev_boundary;
+      p->num_insts += q->num_insts;
+      p->ext_ops |= q->ext_ops;
+    }
+
+    for (int j = 0; j < q->num_buckets; j++) {
+      DataBucket* b = &q->buckets[j];
+      p->subsection = j;
+      for (int k = 0; k < b->len; k++)
+        *add_data(p) = b->vals[k];
+      free(b->vals);
+    }
+    free(q->buckets);
+
+    for (int j = 0; j < q->num_src_files; j++) {
+      if (q->src_files[j])
+        add_src_file(p, j, q->src_files[j]);
+    }
+    for (int j = 0; j < q->num_src_locs; j++) {
+      SrcLoc* loc = &q->src_locs[j];
+      add_src_loc(p, loc->eir_line, loc->file, loc->line);
+    }
+    free(q->src_files);
+    free(q->src_locs);
+  }
+  free(chunks);
   p->text = text_root.next;
-  p->data = data_root.next;
+  finish_parse(p);
+}
+
+// The number of threads to parse p's input with, or 1.
+static int parse_threads(Parser* p) {
+  size_t len = p->end - p->cur;
+  if (p->mode != PARSE_ALL || elvm_error_hook || len < IR_PARALLEL_MIN)
+    return 1;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > IR_MAX_THREADS)
+    n = IR_MAX_THREADS;
+  if (n > (long)(len / IR_MIN_CHUNK))
+    n = len / IR_MIN_CHUNK;
+  return n < 1 ? 1 : n;
 }
 
+#endif  // IR_BUFFERED
+
 static void resolve(Value* v, Table* symtab) {
   if (v->type != (ValueType)REF)
     return;
   const char* name = (const char*)v->tmp;
   if (!table_get(symtab, name, (void*)&v->imm)) {
-    fprintf(stderr, "undefined sym: %s\n", name);
-    exit(1);
+    ir_fatal("undefined sym: %s", name);
   }
   //fprintf(stderr, "resolved: %s %d\n", name, v->imm);
   v->type = IMM;
 }
 
+// Records that the pc of the text label v refers to is used as a value.
+static void mark_addr_taken(Parser* p, Value* v) {
+  const void* pc;
+  if (v->type == (ValueType)REF &&
+      table_get(p->text_labels, v->tmp, &pc)) {
+    p->addr_taken[(intptr_t)pc] = true;
+  }
+}
+
 static void resolve_syms(Parser* p) {
-  for (DataPrivate* data = p->data; data; data = data->next) {
-    if (data->val.type == (ValueType)REF) {
-      resolve(&data->val, p->symtab);
+  p->addr_taken = calloc(p->pc + 1, sizeof(bool));
+  // Of several labels at a pc, the first by name is kept, so the choice
+  // doesn't depend on the hash table.
+  p->pc_labels = calloc(p->pc + 1, sizeof(char*));
+  Table* labels = p->text_labels;
+  for (int i = 0; labels && i < labels->cap; i++) {
+    TableEntry* e = &labels->entries[i];
+    if (!e->key || e->key[0] == '.')
+      continue;
+    const char** label = &p->pc_labels[(intptr_t)e->value];
+    if (!*label || strcmp(e->key, *label) < 0)
+      *label = e->key;
+  }
+  p->data = calloc(p->num_data, sizeof(Data));
+  for (int i = 0; i < p->num_data; i++) {
+    Value* v = &p->data_vals[i];
+    if (v->type == (ValueType)REF) {
+      mark_addr_taken(p, v);
+      resolve(v, p->symtab);
     }
-    data->v = MOD24(data->val.imm);
+    p->data[i].v = MOD24(v->imm);
+    p->data[i].next = i + 1 < p->num_data ? &p->data[i + 1] : NULL;
   }
+  free(p->data_vals);
+  p->data_vals = NULL;
 
   for (Inst* inst = p->text; inst; inst = inst->next) {
+    mark_addr_taken(p, &inst->dst);
+    mark_addr_taken(p, &inst->src);
     resolve(&inst->dst, p->symtab);
     resolve(&inst->src, p->symtab);
     resolve(&inst->jmp, p->symtab);
   }
 }
 
-Module* load_eir_impl(const char* filename, FILE* fp) {
-  Parser parser = {
-    .filename = filename,
-    .fp = fp
-  };
-  parse_eir(&parser);
-  resolve_syms(&parser);
+const SrcLoc* find_src_loc(Module* m, int lineno) {
+  int lo = 0;
+  int hi = m->num_src_locs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (m->src_locs[mid].eir_line <= lineno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? &m->src_locs[lo - 1] : NULL;
+}
+
+void index_module(Module* m) {
+  Inst* last = &m->text[m->num_insts - 1];
+  m->num_pcs = last->pc + 1;
+  m->pc_starts = calloc(m->num_pcs, sizeof(int));
+  m->pc_lens = calloc(m->num_pcs, sizeof(int));
+  for (int i = m->num_insts - 1; i >= 0; i--) {
+    int pc = m->text[i].pc;
+    m->pc_starts[pc] = i;
+    m->pc_lens[pc]++;
+  }
+}
+
+
+static Module* load_eir_impl(Parser* parser) {
+#ifdef IR_BUFFERED
+  // Errors exit from whichever thread finds them, so a caller with
+  // elvm_error_hook gets the sequential parser.
+  int num_threads = parse_threads(parser);
+  if (num_threads > 1)
+    parse_eir_parallel(parser, num_threads);
+  else
+    parse_eir(parser);
+#else
+  parse_eir(parser);
+#endif
+  ir_phase_begin("resolve_syms");
+  resolve_syms(parser);
+
+  int num_insts = 0;
+  for (Inst* inst = parser->text; inst; inst = inst->next)
+    num_insts++;
+  Inst* text = calloc(num_insts, sizeof(Inst));
+  Inst* inst = parser->text;
+  for (int i = 0; i < num_insts; i++) {
+    Inst* next = inst->next;
+    text[i] = *inst;
+    text[i].next = i + 1 < num_insts ? &text[i + 1] : NULL;
+    free(inst);
+    inst = next;
+  }
+
+  Module* m = malloc(sizeof(Module));
+  m->text = text;
+  m->data = parser->data;
+  m->num_data = parser->num_data;
+  m->num_insts = num_insts;
+  m->addr_taken = parser->addr_taken;
+  m->data_labels = parser->data_labels;
+  m->global_vars = NULL;
+  m->ext_ops = parser->ext_ops;
+  m->src_files = parser->src_files;
+  m->num_src_files = parser->num_src_files;
+  m->src_locs = parser->src_locs;
+  m->num_src_locs = parser->num_src_locs;
+  m->pc_labels = parser->pc_labels;
+  m->num_pc_labels = parser->pc + 1;
+  index_module(m);
+  ir_phase_end();
+  return m;
+}
+
+#ifdef IR_BUFFERED
+
+// Binary EIR (.eirb). Every field is a little-endian 32bit word:
+//
+//   header: magic, version, flags, number of insts, number of data
+//   text:   op | dst.type << 8 | src.type << 9 | jmp.type << 10,
+//           dst, src, jmp, pc
+//   data:   v
+//   lines:  lineno for each inst (only when EIRB_HAS_LINES is set)
+//
+// Labels are already resolved, so loading is a flat copy into two
+// contiguous Inst and Data arrays.
+
+#define EIRB_MAGIC 0x42524945  // "EIRB"
+#define EIRB_VERSION 1
+#define EIRB_HEADER_WORDS 5
+#define EIRB_INST_WORDS 5
+
+enum {
+  EIRB_SPLIT_BY_MEM = 1,
+  EIRB_HAS_LINES = 2
+};
+
+static void eirb_put(uint32_t v, FILE* fp) {
+  putc(v & 255, fp);
+  putc((v >> 8) & 255, fp);
+  putc((v >> 16) & 255, fp);
+  putc(v >> 24, fp);
+}
+
+static int eirb_get(const unsigned char* p) {
+  return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static bool is_eirb(const char* buf, size_t len) {
+  return len >= 4 && eirb_get((const unsigned char*)buf) == EIRB_MAGIC;
+}
+
+void dump_eirb(Module* module, bool with_lines, FILE* fp) {
+  int ninsts = 0;
+  int ndata = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next)
+    ninsts++;
+  for (Data* data = module->data; data; data = data->next)
+    ndata++;
+
+  eirb_put(EIRB_MAGIC, fp);
+  eirb_put(EIRB_VERSION, fp);
+  eirb_put((g_split_basic_block_by_mem ? EIRB_SPLIT_BY_MEM : 0) |
+           (with_lines ? EIRB_HAS_LINES : 0), fp);
+  eirb_put(ninsts, fp);
+  eirb_put(ndata, fp);
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    eirb_put(inst->op | inst->dst.type << 8 | inst->src.type << 9 |
+             inst->jmp.type << 10, fp);
+    eirb_put(inst->dst.imm, fp);
+    eirb_put(inst->src.imm, fp);
+    eirb_put(inst->jmp.imm, fp);
+    eirb_put(inst->pc, fp);
+  }
+  for (Data* data = module->data; data; data = data->next)
+    eirb_put(data->v, fp);
+  if (with_lines) {
+    for (Inst* inst = module->text; inst; inst = inst->next)
+      eirb_put(inst->lineno, fp);
+  }
+}
+
+static void eirb_error(const char* filename, const char* msg) {
+  ir_fatal("%s: %s", filename, msg);
+}
+
+static Value eirb_value(int type, const unsigned char* p) {
+  Value v;
+  v.type = (ValueType)(type & 1);
+  v.imm = eirb_get(p);
+  return v;
+}
+
+static Module* load_eirb(const char* filename, const char* buf, size_t len) {
+  ir_phase_begin("load_eirb");
+  const unsigned char* p = (const unsigned char*)buf;
+  if (len < EIRB_HEADER_WORDS * 4)
+    eirb_error(filename, "truncated eirb header");
+  if (eirb_get(p + 4) != EIRB_VERSION)
+    eirb_error(filename, "unsupported eirb version");
+  int flags = eirb_get(p + 8);
+  int ninsts = eirb_get(p + 12);
+  int ndata = eirb_get(p + 16);
+  if (!(flags & EIRB_SPLIT_BY_MEM) != !g_split_basic_block_by_mem)
+    eirb_error(filename, "eirb was written with a different "
+               "basic block split mode");
+  size_t words = EIRB_HEADER_WORDS + (size_t)ninsts * EIRB_INST_WORDS + ndata;
+  if (flags & EIRB_HAS_LINES)
+    words += ninsts;
+  if (ninsts <= 0 || ndata <= 0 || len < words * 4)
+    eirb_error(filename, "truncated eirb");
+
+  Inst* text = calloc(ninsts, sizeof(Inst));
+  int ext_ops = 0;
+  const unsigned char* q = p + EIRB_HEADER_WORDS * 4;
+  for (int i = 0; i < ninsts; i++, q += EIRB_INST_WORDS * 4) {
+    Inst* inst = &text[i];
+    int w = eirb_get(q);
+    inst->op = (Op)(w & 255);
+    inst->dst = eirb_value(w >> 8, q + 4);
+    inst->src = eirb_value(w >> 9, q + 8);
+    inst->jmp = eirb_value(w >> 10, q + 12);
+    inst->pc = eirb_get(q + 16);
+    if (inst->op < 0 || inst->op >= LAST_OP ||
+        inst->pc < (i ? text[i - 1].pc : 0))
+      eirb_error(filename, "broken eirb");
+    if (IS_EXT_OP(inst->op))
+      ext_ops |= EXT_OP_BIT(inst->op);
+    inst->next = i + 1 < ninsts ? &text[i + 1] : NULL;
+  }
+
+  Data* data = ndata ? calloc(ndata, sizeof(Data)) : NULL;
+  for (int i = 0; i < ndata; i++, q += 4) {
+    data[i].v = eirb_get(q);
+    data[i].next = i + 1 < ndata ? &data[i + 1] : NULL;
+  }
+
+  if (flags & EIRB_HAS_LINES) {
+    for (int i = 0; i < ninsts; i++, q += 4)
+      text[i].lineno = eirb_get(q);
+  }
 
   Module* m = malloc(sizeof(Module));
-  m->text = parser.text;
-  m->data = (Data*)parser.data;
+  m->text = text;
+  m->data = data;
+  m->num_data = ndata;
+  m->num_insts = ninsts;
+  // Labels are gone, so which immediates are code addresses is unknown.
+  m->addr_taken = NULL;
+  m->data_labels = NULL;
+  m->global_vars = NULL;
+  m->ext_ops = ext_ops;
+  m->src_files = NULL;
+  m->num_src_files = 0;
+  m->src_locs = NULL;
+  m->num_src_locs = 0;
+  m->pc_labels = NULL;
+  m->num_pc_labels = 0;
+  index_module(m);
+  ir_phase_end();
   return m;
 }
 
+// Reads the whole stream with a single growing buffer. Used for stdin
+// and for files which cannot be mapped (e.g., pipes).
+static char* read_all(FILE* fp, size_t* len) {
+  size_t cap = 65536;
+  size_t n = 0;
+  char* buf = malloc(cap);
+  for (;;) {
+    n += fread(buf + n, 1, cap - n, fp);
+    if (n < cap)
+      break;
+    cap *= 2;
+    buf = realloc(buf, cap);
+  }
+  *len = n;
+  return buf;
+}
+
 Module* load_eir(FILE* fp) {
-  return load_eir_impl("<stdin>", fp);
+  size_t len;
+  char* buf = read_all(fp, &len);
+  Module* r;
+  if (is_eirb(buf, len)) {
+    r = load_eirb("<stdin>", buf, len);
+  } else {
+    Parser parser = {
+      .filename = "<stdin>",
+      .cur = buf,
+      .end = buf + len
+    };
+    r = load_eir_impl(&parser);
+  }
+  free(buf);
+  return r;
+}
+
+Module* load_eir_from_memory(const char* buf, size_t len) {
+  if (is_eirb(buf, len))
+    return load_eirb("<memory>", buf, len);
+  Parser parser = {
+    .filename = "<memory>",
+    .cur = buf,
+    .end = buf + len
+  };
+  return load_eir_impl(&parser);
+}
+
+// Maps a regular file, or reads it when it can't be mapped (e.g., a pipe).
+static char* map_file(const char* filename, size_t* len, bool* mapped) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    ir_fatal("no such file: %s", filename);
+  }
+
+  *len = st.st_size;
+  void* buf = MAP_FAILED;
+  if (S_ISREG(st.st_mode) && *len)
+    buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  *mapped = buf != MAP_FAILED;
+  if (*mapped) {
+    close(fd);
+    return buf;
+  }
+
+  FILE* fp = fdopen(fd, "r");
+  if (!fp) {
+    ir_fatal("no such file: %s", filename);
+  }
+  buf = read_all(fp, len);
+  fclose(fp);
+  return buf;
+}
+
+static void unmap_file(char* buf, size_t len, bool mapped) {
+  if (mapped)
+    munmap(buf, len);
+  else
+    free(buf);
+}
+
+Module* load_eir_from_file(const char* filename) {
+  size_t len;
+  bool mapped;
+  char* buf = map_file(filename, &len, &mapped);
+
+  Module* r;
+  if (is_eirb(buf, len)) {
+    r = load_eirb(filename, buf, len);
+  } else {
+    Parser parser = {
+      .filename = filename,
+      .cur = buf,
+      .end = buf + len
+    };
+    r = load_eir_impl(&parser);
+  }
+  unmap_file(buf, len, mapped);
+  return r;
+}
+
+struct EIRStream_ {
+  Parser parser;
+  char* buf;
+  size_t len;
+  bool mapped;
+  // The index in parser.chunk of the first instruction not returned yet.
+  int next;
+};
+
+EIRStream* open_eir_stream(const char* filename, Module** module) {
+  EIRStream* s = calloc(1, sizeof(EIRStream));
+  s->buf = map_file(filename, &s->len, &s->mapped);
+  if (is_eirb(s->buf, s->len)) {
+    unmap_file(s->buf, s->len, s->mapped);
+    free(s);
+    return NULL;
+  }
+
+  Parser* p = &s->parser;
+  p->filename = filename;
+  p->mode = PARSE_LAYOUT;
+  p->cur = s->buf;
+  p->end = s->buf + s->len;
+  parse_eir(p);
+  resolve_syms(p);
+
+  Module* m = calloc(1, sizeof(Module));
+  m->data = p->data;
+  m->num_data = p->num_data;
+  m->num_insts = p->num_insts;
+  m->num_pcs = p->scratch_inst.pc + 1;
+  m->ext_ops = p->ext_ops;
+  m->src_files = p->src_files;
+  m->num_src_files = p->num_src_files;
+  m->src_locs = p->src_locs;
+  m->num_src_locs = p->num_src_locs;
+  m->pc_labels = p->pc_labels;
+  m->num_pc_labels = p->pc + 1;
+  *module = m;
+
+  p->mode = PARSE_TEXT;
+  p->cur = s->buf;
+  start_parse(p, NULL);
+  return s;
+}
+
+Inst* read_eir_stream(EIRStream* s, int max_pc) {
+  Parser* p = &s->parser;
+  p->chunk_len -= s->next;
+  memmove(p->chunk, p->chunk + s->next, p->chunk_len * sizeof(Inst));
+  while (!p->chunk_len || p->chunk[p->chunk_len - 1].pc < max_pc) {
+    if (!parse_next(p))
+      break;
+  }
+
+  int n = p->chunk_len;
+  while (n && p->chunk[n - 1].pc >= max_pc)
+    n--;
+  for (int i = 0; i < n; i++)
+    p->chunk[i].next = i + 1 < n ? &p->chunk[i + 1] : NULL;
+  s->next = n;
+  return n ? p->chunk : NULL;
+}
+
+void close_eir_stream(EIRStream* s) {
+  unmap_file(s->buf, s->len, s->mapped);
+  free(s->parser.chunk);
+  free(s);
+}
+
+#else
+
+Module* load_eir(FILE* fp) {
+  Parser parser = {
+    .filename = "<stdin>",
+    .fp = fp
+  };
+  return load_eir_impl(&parser);
 }
 
 Module* load_eir_from_file(const char* filename) {
   FILE* fp = fopen(filename, "r");
   if (!fp) {
-    fprintf(stderr, "no such file: %s\n", filename);
-    exit(1);
+    ir_fatal("no such file: %s", filename);
   }
-  Module* r = load_eir_impl(filename, fp);
+  Parser parser = {
+    .filename = filename,
+    .fp = fp
+  };
+  Module* r = load_eir_impl(&parser);
   fclose(fp);
   return r;
 }
 
+#endif  // IR_BUFFERED
+
 void split_basic_block_by_mem() {
   g_split_basic_block_by_mem = true;
 }
 
+bool is_split_basic_block_by_mem(void) {
+  return g_split_basic_block_by_mem;
+}
+
+void prune_unreachable(void) {
+  g_prune_unreachable = true;
+}
+
+void merge_strings(void) {
+  g_merge_strings = true;
+}
+
+void split_cold_blocks(int align, long** pc_counts, int* num_pc_counts) {
+  g_cold_align = align;
+  g_cold_counts = pc_counts;
+  g_cold_num_counts = num_pc_counts;
+}
+
+unsigned int eval_ext_op(Op op, unsigned int dst, unsigned int src) {
+  switch (op) {
+    case MUL: return (dst * src) & UINT_MAX;
+    case DIV: return src ? dst / src : UINT_MAX;
+    case MOD: return src ? dst % src : dst;
+    case AND: return dst & src;
+    case OR: return dst | src;
+    case XOR: return dst ^ src;
+    case SHL: return src < 24 ? (dst << src) & UINT_MAX : 0;
+    case SHR: return src < 24 ? dst >> src : 0;
+    default:
+      ir_fatal("oops op=%d", op);
+  }
+}
+
 void dump_op(Op op, FILE* fp) {
   static const char* op_strs[] = {
     "mov", "add", "sub", "load", "store", "putc", "getc", "exit",
     "jeq", "jne", "jlt", "jgt", "jle", "jge", "jmp", "xxx",
-    "eq", "ne", "lt", "gt", "le", "ge", "dump"
+    "eq", "ne", "lt", "gt", "le", "ge", "dump",
+    "mul", "div", "mod", "and", "or", "xor", "shl", "shr",
+    "memcpy", "memset"
   };
   fprintf(fp, "%s", op_strs[op]);
 }
@@ -581,7 +2114,9 @@ void dump_val(Value* val, FILE* fp) {
   static const char* reg_strs[] = {
     "A", "B", "C", "D", "BP", "SP"
   };
-  if (val->type == REG) {
+  if (val->type == REG && IS_VREG(val->reg)) {
+    fprintf(fp, "R%d", val->reg - R0);
+  } else if (val->type == REG) {
     fprintf(fp, "%s", reg_strs[val->reg]);
   } else if (val->type == IMM) {
     fprintf(fp, "%d", val->imm);
@@ -604,6 +2139,14 @@ void dump_inst_fp(Inst* inst, FILE* fp) {
     case GT:
     case LE:
     case GE:
+    case MUL:
+    case DIV:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
       fprintf(fp, " ");
       dump_val(&inst->dst, fp);
       fprintf(fp, " ");
@@ -637,9 +2180,17 @@ void dump_inst_fp(Inst* inst, FILE* fp) {
       fprintf(fp, " ");
       dump_val(&inst->jmp, fp);
       break;
+    case MEMCPY:
+    case MEMSET:
+      fprintf(fp, " ");
+      dump_val(&inst->dst, fp);
+      fprintf(fp, " ");
+      dump_val(&inst->src, fp);
+      fprintf(fp, " ");
+      dump_val(&inst->jmp, fp);
+      break;
     default:
-      fprintf(fp, "oops op=%d\n", inst->op);
-      exit(1);
+      ir_fatal("oops op=%d", inst->op);
   }
   fprintf(fp, " pc=%d @", inst->pc);
   int lineno = inst->lineno;
@@ -653,3 +2204,85 @@ void dump_inst_fp(Inst* inst, FILE* fp) {
 void dump_inst(Inst* inst) {
   dump_inst_fp(inst, stderr);
 }
+
+#ifndef __eir__
+
+#define MAX_IR_PHASES 32
+
+typedef struct {
+  const char* name;
+  double sec;
+  long heap;
+} IRPhase;
+
+static bool g_ir_phases_enabled;
+static IRPhase g_ir_phases[MAX_IR_PHASES];
+static int g_num_ir_phases;
+static IRPhase* g_cur_ir_phase;
+static double g_ir_phase_start;
+static long g_ir_phase_heap;
+
+static double ir_phase_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long ir_phase_heap(void) {
+#ifdef IR_HEAP_STATS
+  struct mallinfo2 mi = mallinfo2();
+  return (long)(mi.uordblks + mi.hblkhd);
+#else
+  return 0;
+#endif
+}
+
+void enable_ir_phases(void) {
+  g_ir_phases_enabled = true;
+}
+
+void ir_phase_begin(const char* name) {
+  if (!g_ir_phases_enabled)
+    return;
+  ir_phase_end();
+  // A phase which runs more than once (e.g., loading twice) accumulates.
+  IRPhase* phase = NULL;
+  for (int i = 0; i < g_num_ir_phases; i++) {
+    if (!strcmp(g_ir_phases[i].name, name))
+      phase = &g_ir_phases[i];
+  }
+  if (!phase) {
+    if (g_num_ir_phases == MAX_IR_PHASES)
+      return;
+    phase = &g_ir_phases[g_num_ir_phases++];
+    phase->name = name;
+  }
+  g_cur_ir_phase = phase;
+  g_ir_phase_heap = ir_phase_heap();
+  g_ir_phase_start = ir_phase_now();
+}
+
+void ir_phase_end(void) {
+  if (!g_cur_ir_phase)
+    return;
+  g_cur_ir_phase->sec += ir_phase_now() - g_ir_phase_start;
+  g_cur_ir_phase->heap += ir_phase_heap() - g_ir_phase_heap;
+  g_cur_ir_phase = NULL;
+}
+
+void dump_ir_phases(FILE* fp) {
+  ir_phase_end();
+  double total = 0;
+  for (int i = 0; i < g_num_ir_phases; i++)
+    total += g_ir_phases[i].sec;
+  fprintf(fp, "%-24s %10s %6s %12s\n", "phase", "ms", "%", "heap KB");
+  for (int i = 0; i < g_num_ir_phases; i++) {
+    IRPhase* phase = &g_ir_phases[i];
+    fprintf(fp, "%-24s %10.3f %6.2f %+12ld\n", phase->name,
+            phase->sec * 1e3, total ? phase->sec * 100 / total : 0.0,
+            phase->heap / 1024);
+  }
+  fprintf(fp, "%-24s %10.3f\n", "total", total * 1e3);
+}
+
+#endif  // !__eir__
@@ -1,6 +1,7 @@
 #ifndef ELVM_IR_H_
 #define ELVM_IR_H_
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #define UINT_MAX 16777215
@@ -12,9 +13,17 @@
 #endif
 
 typedef enum {
-  A, B, C, D, BP, SP
+  A, B, C, D, BP, SP,
+  // Virtual registers, which only promote_stack_slots (see ir/opt.h)
+  // puts in a module, and only with VREG_BIT in its ext_ops.
+  R0, R1, R2, R3, R4, R5, R6, R7,
+  R8, R9, R10, R11, R12, R13, R14, R15
 } Reg;
 
+#define NUM_VREGS 16
+#define NUM_REGS (R0 + NUM_VREGS)
+#define IS_VREG(r) ((r) >= R0)
+
 typedef enum {
   REG, IMM
 } ValueType;
@@ -25,9 +34,27 @@ typedef enum {
   JEQ = 8, JNE, JLT, JGT, JLE, JGE, JMP,
   // Optional operations follow.
   EQ = 16, NE, LT, GT, LE, GE, DUMP,
+  // Extensions. Backends which can't run them natively get them
+  // lowered into the ops above (see ir/lower.h).
+  MUL, DIV, MOD, AND, OR, XOR, SHL, SHR,
+  // Block memory ops. dst and src are addresses, or src is the value
+  // for MEMSET, and jmp is the number of words.
+  MEMCPY, MEMSET,
   LAST_OP
 } Op;
 
+// The bit of an extension op in a set of them.
+#define IS_EXT_OP(op) ((op) >= MUL && (op) < LAST_OP)
+#define EXT_OP_BIT(op) (1 << ((op) - MUL))
+#define ALL_EXT_OPS (EXT_OP_BIT(LAST_OP) - 1)
+// Not an op, but kept in the same sets: LOAD and STORE with a disp.
+#define MEM_DISP_BIT (1 << 30)
+// Likewise, operands in virtual registers.
+#define VREG_BIT (1 << 29)
+// Likewise, data words kept in variables of their own (see
+// find_global_vars in ir/opt.h).
+#define GLOBAL_VAR_BIT (1 << 28)
+
 typedef struct {
   ValueType type;
   union {
@@ -42,8 +69,21 @@ typedef struct Inst_ {
   Value dst;
   Value src;
   Value jmp;
+  // For LOAD and STORE, added to the address in src, wrapped to 24
+  // bits. optimize_module folds address arithmetic into it, and
+  // lower_ext_ops expands it again for backends without MEM_DISP_BIT.
+  int disp;
   int pc;
   int lineno;
+  // Set by mark_unmasked for an ADD, SUB, MUL or SHL which may skip
+  // the wrap to 24 bits on a machine with wider registers.
+  bool unmasked;
+  // Set by mark_unmasked for an ADD, SUB, MUL or SHL whose result
+  // can't reach 1<<24 when its operands are wrapped.
+  bool in_range;
+  // Set by find_global_vars for a LOAD or STORE of a data word at a
+  // constant address which no pointer reaches.
+  bool global_var;
   struct Inst_* next;
 } Inst;
 
@@ -52,19 +92,151 @@ typedef struct Data_ {
   struct Data_* next;
 } Data;
 
+// A C source location of a .loc directive. It holds for the EIR lines
+// from eir_line up to the next .loc. file is the number of a .file.
+typedef struct {
+  int eir_line;
+  int file;
+  int line;
+} SrcLoc;
+
 typedef struct {
+  // All instructions, stored as one contiguous array in program order.
+  // text[i].next is &text[i+1] so both walks work.
   Inst* text;
+  // Likewise, the data words as one contiguous array, from address 0.
+  // The last one is _edata, the start of the heap.
   Data* data;
+  int num_data;
+  int num_insts;
+  // The index in text of the first instruction of each basic block and
+  // the number of its instructions, indexed by pc. A pc with no
+  // instruction (e.g., a label at the end of .text) has length 0.
+  int* pc_starts;
+  int* pc_lens;
+  int num_pcs;
+  // Whether a text label at each pc is used as a value (moved into a
+  // register, stored, or in data) rather than only as the target of
+  // direct jumps. Only these pcs can be reached by a jump through a
+  // register. NULL when unknown, e.g., for .eirb input.
+  bool* addr_taken;
+  // Whether a data label is bound to each data word, which starts an
+  // object (a global or a string). NULL when unknown, as for addr_taken.
+  bool* data_labels;
+  // The data words find_global_vars found only at constant addresses,
+  // or NULL if it didn't run.
+  bool* global_vars;
+  // The extension ops used in text, as EXT_OP_BITs, and MEM_DISP_BIT
+  // if a LOAD or STORE has a disp.
+  int ext_ops;
+  // The names of the .file directives by their number, NULL for unused
+  // numbers, and the .loc directives in order, one per change of
+  // location. Instructions find theirs by lineno (see find_src_loc), so
+  // the passes which copy or move them keep it. Empty for .eirb input.
+  const char** src_files;
+  int num_src_files;
+  SrcLoc* src_locs;
+  int num_src_locs;
+  // A text label at each pc below num_pc_labels which doesn't start
+  // with '.', as 8cc's local labels do, or NULL. These are the functions
+  // of the C source, which name the symbols of the native backends.
+  // Pcs lowering adds have none. NULL for .eirb input.
+  const char** pc_labels;
+  int num_pc_labels;
 } Module;
 
 Module* load_eir(FILE* fp);
 
 Module* load_eir_from_file(const char* filename);
 
+#ifndef __eir__
+// Parses EIR or .eirb from len bytes at buf, which the module doesn't
+// keep.
+Module* load_eir_from_memory(const char* buf, size_t len);
+#endif
+
+// If set, fatal errors of the IR library and of the backends call it
+// with the message instead of printing it and exiting. It must not
+// return, e.g., it longjmps back to the caller of the library.
+extern void (*elvm_error_hook)(const char* msg);
+
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+void ir_fatal(const char* fmt, ...);
+
 void split_basic_block_by_mem();
+bool is_split_basic_block_by_mem(void);
+
+// Makes load_eir drop the code which can't be reached from main and the
+// data which no reachable code refers to, as every program carries all
+// of libc. Text pcs are renumbered. It doesn't apply to .eirb input or
+// to streamed text.
+void prune_unreachable(void);
+
+// Makes load_eir lay out each string literal (a .string alone under a
+// .L label, as 8cc emits them) which equals another one or the end of a
+// longer one only once, binding its label into the other. This also
+// applies to streamed text, as the data is all read up front.
+void merge_strings(void);
+
+// Makes load_eir move the cold blocks, those which can only run into
+// EXIT, after the others, from a multiple of align pcs on, so chunked
+// backends keep the hot code in fewer functions. Text pcs are
+// renumbered. *pc_counts, the entries of each pc in a run of eli (see
+// --profile-out) or NULL, adds the blocks which never ran, and is
+// renumbered too. Like prune_unreachable, it applies to PARSE_ALL only.
+void split_cold_blocks(int align, long** pc_counts, int* num_pc_counts);
+
+// Per-phase timings for elc -time. Each ir_phase_begin ends the current
+// phase, if any, and starts the named one; ir_phase_end ends it. Only
+// recorded after enable_ir_phases, and compiled out on ELVM itself.
+#ifndef __eir__
+void enable_ir_phases(void);
+void ir_phase_begin(const char* name);
+void ir_phase_end(void);
+// Prints each phase's wall time and net heap growth.
+void dump_ir_phases(FILE* fp);
+#else
+# define ir_phase_begin(name)
+# define ir_phase_end()
+#endif
+
+// The source location in effect at the EIR line lineno of an
+// instruction, or NULL if there is none, e.g., for the implicit jump to
+// main, whose lineno is -1.
+const SrcLoc* find_src_loc(Module* m, int lineno);
+
+// dst op src for the extension ops MUL to SHR on 24bit words.
+// Division by zero gives UINT_MAX, modulo by zero gives dst, and shifts
+// by 24 or more give 0.
+unsigned int eval_ext_op(Op op, unsigned int dst, unsigned int src);
+
+// Fills num_pcs, pc_starts and pc_lens from text, e.g., after
+// instructions were removed. num_insts must be up to date.
+void index_module(Module* m);
+
+#ifndef __eir__
+// Streams the text of an EIR file instead of keeping it in memory.
+// open_eir_stream loads the data and the labels into *module, whose text
+// is left NULL. Each read_eir_stream call then parses the instructions
+// with a pc below max_pc which haven't been returned yet; the list is
+// valid until the next call, and NULL means the end of text.
+// open_eir_stream returns NULL for .eirb input, which has no text to
+// re-parse; use load_eir_from_file then.
+typedef struct EIRStream_ EIRStream;
+EIRStream* open_eir_stream(const char* filename, Module** module);
+Inst* read_eir_stream(EIRStream* s, int max_pc);
+void close_eir_stream(EIRStream* s);
+
+// Writes the module in the binary EIR format (.eirb). load_eir and
+// load_eir_from_file detect .eirb input by its magic.
+void dump_eirb(Module* module, bool with_lines, FILE* fp);
+#endif
 
 void dump_inst(Inst* inst);
 void dump_inst_fp(Inst* inst, FILE* fp);
+void dump_op(Op op, FILE* fp);
 
 #ifdef __GNUC__
 #if __has_attribute(fallthrough)
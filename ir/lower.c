@@ -0,0 +1,502 @@
+#include <ir/lower.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/cfg.h>
+
+// The scratch words after _edata. A call saves every register in the
+// word indexed by it, as helpers use all of them.
+enum {
+  LOWER_X = SP + 1, LOWER_Y, LOWER_Z, LOWER_RET, LOWER_RESULT,
+  LOWER_NUM_SCRATCH
+};
+
+#define LOWER_TOP_BIT 8388608
+
+// Instructions written in pc order. A block ends after a jump, and
+// after a load or a store when basic blocks are split by them.
+typedef struct {
+  Inst* insts;
+  int num_insts;
+  int cap;
+  int pc;
+  bool in_block;
+  int lineno;
+  int scratch;
+} LowerBuf;
+
+static Value lower_reg(Reg r) {
+  Value v;
+  v.type = REG;
+  v.reg = r;
+  return v;
+}
+
+static Value lower_imm(int imm) {
+  Value v;
+  v.type = IMM;
+  v.imm = imm;
+  return v;
+}
+
+static void lower_end_block(LowerBuf* b) {
+  if (b->in_block) {
+    b->pc++;
+    b->in_block = false;
+  }
+}
+
+// Starts a new block and returns its pc.
+static int lower_label(LowerBuf* b) {
+  lower_end_block(b);
+  return b->pc;
+}
+
+// Appends a copy of inst in the current block and returns its index.
+static int lower_copy(LowerBuf* b, Inst* inst) {
+  if (b->num_insts == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 256;
+    Inst* insts = malloc(b->cap * sizeof(Inst));
+    memcpy(insts, b->insts, b->num_insts * sizeof(Inst));
+    free(b->insts);
+    b->insts = insts;
+  }
+  int i = b->num_insts++;
+  b->insts[i] = *inst;
+  b->insts[i].pc = b->pc;
+  b->in_block = true;
+  if ((inst->op >= JEQ && inst->op <= JMP) ||
+      ((inst->op == LOAD || inst->op == STORE) &&
+       is_split_basic_block_by_mem())) {
+    lower_end_block(b);
+  }
+  return i;
+}
+
+static int lower_emit(LowerBuf* b, Op op, Value dst, Value src) {
+  Inst inst;
+  memset(&inst, 0, sizeof(inst));
+  inst.op = op;
+  inst.dst = dst;
+  inst.src = src;
+  inst.lineno = b->lineno;
+  return lower_copy(b, &inst);
+}
+
+// Emits a jump; pass -1 as jmp and patch it when it's a forward one.
+static int lower_jump(LowerBuf* b, Op op, Value jmp, Value dst, Value src) {
+  Inst inst;
+  memset(&inst, 0, sizeof(inst));
+  inst.op = op;
+  inst.jmp = jmp;
+  inst.dst = dst;
+  inst.src = src;
+  inst.lineno = b->lineno;
+  return lower_copy(b, &inst);
+}
+
+static void lower_patch(LowerBuf* b, int i, int pc) {
+  b->insts[i].jmp.imm = pc;
+}
+
+#define EMIT_RR(op, d, s) lower_emit(b, op, lower_reg(d), lower_reg(s))
+#define EMIT_RI(op, d, s) lower_emit(b, op, lower_reg(d), lower_imm(s))
+#define JUMP_RR(op, j, d, s) \
+  lower_jump(b, op, lower_imm(j), lower_reg(d), lower_reg(s))
+#define JUMP_RI(op, j, d, s) \
+  lower_jump(b, op, lower_imm(j), lower_reg(d), lower_imm(s))
+#define GOTO(j) lower_jump(b, JMP, lower_imm(j), lower_reg(A), lower_reg(A))
+
+// Loads the operands of a call into B and C. Only A is loaded into, so
+// this works on backends which only support "load A, imm".
+static void lower_load_args(LowerBuf* b) {
+  EMIT_RI(LOAD, A, b->scratch + LOWER_X);
+  EMIT_RR(MOV, B, A);
+  EMIT_RI(LOAD, A, b->scratch + LOWER_Y);
+  EMIT_RR(MOV, C, A);
+}
+
+// Helpers leave their result in A and jump to ret_pc, which stores it
+// and returns to the continuation. Shift-and-add over the bits of C.
+static void lower_mul(LowerBuf* b, int ret_pc) {
+  lower_load_args(b);
+  EMIT_RI(MOV, A, 0);
+  EMIT_RI(MOV, D, 24);
+  int loop = lower_label(b);
+  EMIT_RR(ADD, A, A);
+  int skip = JUMP_RI(JLT, -1, C, LOWER_TOP_BIT);
+  EMIT_RR(ADD, A, B);
+  lower_patch(b, skip, lower_label(b));
+  EMIT_RR(ADD, C, C);
+  EMIT_RI(SUB, D, 1);
+  JUMP_RI(JNE, loop, D, 0);
+  GOTO(ret_pc);
+}
+
+// Restoring division of B by C: the quotient goes to BP and the
+// remainder to D. A is set when doubling D overflows, in which case D
+// is above C for sure. Comparisons only write A to D, as some backends
+// can't set BP and SP from flags.
+static void lower_div(LowerBuf* b, int ret_pc, bool is_mod) {
+  lower_load_args(b);
+  EMIT_RI(MOV, BP, 0);
+  EMIT_RI(MOV, D, 0);
+  EMIT_RI(MOV, SP, 24);
+  int loop = lower_label(b);
+  EMIT_RR(MOV, A, D);
+  EMIT_RI(GE, A, LOWER_TOP_BIT);
+  EMIT_RR(ADD, D, D);
+  int no_bit = JUMP_RI(JLT, -1, B, LOWER_TOP_BIT);
+  EMIT_RI(ADD, D, 1);
+  lower_patch(b, no_bit, lower_label(b));
+  EMIT_RR(ADD, B, B);
+  EMIT_RR(ADD, BP, BP);
+  int overflow = JUMP_RI(JNE, -1, A, 0);
+  int no_sub = JUMP_RR(JLT, -1, D, C);
+  lower_patch(b, overflow, lower_label(b));
+  EMIT_RR(SUB, D, C);
+  EMIT_RI(ADD, BP, 1);
+  lower_patch(b, no_sub, lower_label(b));
+  EMIT_RI(SUB, SP, 1);
+  JUMP_RI(JNE, loop, SP, 0);
+  EMIT_RR(MOV, A, is_mod ? D : BP);
+  GOTO(ret_pc);
+}
+
+// Combines the top bits of B and C in A and D into BP, from the
+// highest bit.
+static void lower_bitwise(LowerBuf* b, int ret_pc, Op op) {
+  lower_load_args(b);
+  EMIT_RI(MOV, BP, 0);
+  EMIT_RI(MOV, SP, 24);
+  int loop = lower_label(b);
+  EMIT_RR(ADD, BP, BP);
+  EMIT_RR(MOV, A, B);
+  EMIT_RI(GE, A, LOWER_TOP_BIT);
+  EMIT_RR(MOV, D, C);
+  EMIT_RI(GE, D, LOWER_TOP_BIT);
+  if (op == XOR) {
+    EMIT_RR(NE, A, D);
+  } else {
+    EMIT_RR(ADD, A, D);
+    if (op == AND)
+      EMIT_RI(EQ, A, 2);
+    else
+      EMIT_RI(NE, A, 0);
+  }
+  EMIT_RR(ADD, BP, A);
+  EMIT_RR(ADD, B, B);
+  EMIT_RR(ADD, C, C);
+  EMIT_RI(SUB, SP, 1);
+  JUMP_RI(JNE, loop, SP, 0);
+  EMIT_RR(MOV, A, BP);
+  GOTO(ret_pc);
+}
+
+static void lower_shl(LowerBuf* b, int ret_pc) {
+  lower_load_args(b);
+  EMIT_RR(MOV, A, B);
+  int in_range = JUMP_RI(JLT, -1, C, 24);
+  EMIT_RI(MOV, A, 0);
+  GOTO(ret_pc);
+  int loop = lower_label(b);
+  lower_patch(b, in_range, loop);
+  JUMP_RI(JEQ, ret_pc, C, 0);
+  EMIT_RR(ADD, A, A);
+  EMIT_RI(SUB, C, 1);
+  GOTO(loop);
+}
+
+// Shifts the top 24 - C bits of B into BP.
+static void lower_shr(LowerBuf* b, int ret_pc) {
+  lower_load_args(b);
+  EMIT_RI(MOV, A, 0);
+  JUMP_RI(JGE, ret_pc, C, 24);
+  EMIT_RI(MOV, BP, 0);
+  EMIT_RI(MOV, D, 24);
+  EMIT_RR(SUB, D, C);
+  int loop = lower_label(b);
+  EMIT_RR(ADD, BP, BP);
+  EMIT_RR(MOV, A, B);
+  EMIT_RI(GE, A, LOWER_TOP_BIT);
+  EMIT_RR(ADD, BP, A);
+  EMIT_RR(ADD, B, B);
+  EMIT_RI(SUB, D, 1);
+  JUMP_RI(JNE, loop, D, 0);
+  EMIT_RR(MOV, A, BP);
+  GOTO(ret_pc);
+}
+
+// Copies D words from C to B, backward when B is above C so that the
+// ranges may overlap.
+static void lower_memcpy(LowerBuf* b, int ret_pc) {
+  lower_load_args(b);
+  EMIT_RI(LOAD, A, b->scratch + LOWER_Z);
+  EMIT_RR(MOV, D, A);
+  JUMP_RI(JEQ, ret_pc, D, 0);
+  int backward = JUMP_RR(JGT, -1, B, C);
+  int loop = lower_label(b);
+  EMIT_RR(LOAD, A, C);
+  EMIT_RR(STORE, A, B);
+  EMIT_RI(ADD, B, 1);
+  EMIT_RI(ADD, C, 1);
+  EMIT_RI(SUB, D, 1);
+  JUMP_RI(JNE, loop, D, 0);
+  GOTO(ret_pc);
+  lower_patch(b, backward, lower_label(b));
+  EMIT_RR(ADD, B, D);
+  EMIT_RR(ADD, C, D);
+  loop = lower_label(b);
+  EMIT_RI(SUB, B, 1);
+  EMIT_RI(SUB, C, 1);
+  EMIT_RR(LOAD, A, C);
+  EMIT_RR(STORE, A, B);
+  EMIT_RI(SUB, D, 1);
+  JUMP_RI(JNE, loop, D, 0);
+  GOTO(ret_pc);
+}
+
+static void lower_memset(LowerBuf* b, int ret_pc) {
+  lower_load_args(b);
+  EMIT_RI(LOAD, A, b->scratch + LOWER_Z);
+  EMIT_RR(MOV, D, A);
+  JUMP_RI(JEQ, ret_pc, D, 0);
+  int loop = lower_label(b);
+  EMIT_RR(STORE, C, B);
+  EMIT_RI(ADD, B, 1);
+  EMIT_RI(SUB, D, 1);
+  JUMP_RI(JNE, loop, D, 0);
+  GOTO(ret_pc);
+}
+
+static int lower_helper(LowerBuf* b, Op op, int ret_pc) {
+  int pc = lower_label(b);
+  switch (op) {
+    case MUL: lower_mul(b, ret_pc); break;
+    case DIV: lower_div(b, ret_pc, false); break;
+    case MOD: lower_div(b, ret_pc, true); break;
+    case AND:
+    case OR:
+    case XOR: lower_bitwise(b, ret_pc, op); break;
+    case SHL: lower_shl(b, ret_pc); break;
+    case SHR: lower_shr(b, ret_pc); break;
+    case MEMCPY: lower_memcpy(b, ret_pc); break;
+    case MEMSET: lower_memset(b, ret_pc); break;
+    default: break;
+  }
+  return pc;
+}
+
+// Stores an operand for the helper. Immediates go through A, so A
+// itself is reloaded from where it was saved.
+static void lower_store_arg(LowerBuf* b, Value* v, int addr) {
+  if (v->type == REG) {
+    if (v->reg == A)
+      EMIT_RI(LOAD, A, b->scratch + A);
+    EMIT_RI(STORE, v->reg, addr);
+  } else {
+    EMIT_RI(MOV, A, v->imm);
+    EMIT_RI(STORE, A, addr);
+  }
+}
+
+// Saves the registers and the operands of inst, jumps to the helper and
+// restores the registers, with the result in dst unless inst is a block
+// memory op. Returns the pc of the continuation, which the helper
+// returns to.
+static int lower_call(LowerBuf* b, Inst* inst, int helper_pc) {
+  int s = b->scratch;
+  bool is_mem = inst->op == MEMCPY || inst->op == MEMSET;
+  for (int r = A; r <= SP; r++)
+    EMIT_RI(STORE, r, s + r);
+  EMIT_RI(STORE, inst->dst.reg, s + LOWER_X);
+  lower_store_arg(b, &inst->src, s + LOWER_Y);
+  if (is_mem)
+    lower_store_arg(b, &inst->jmp, s + LOWER_Z);
+  int ret = EMIT_RI(MOV, A, 0);
+  EMIT_RI(STORE, A, s + LOWER_RET);
+  GOTO(helper_pc);
+
+  int cont = lower_label(b);
+  b->insts[ret].src.imm = cont;
+  for (int r = B; r <= SP; r++) {
+    if (r == (int)inst->dst.reg && !is_mem)
+      continue;
+    EMIT_RI(LOAD, A, s + r);
+    EMIT_RR(MOV, r, A);
+  }
+  EMIT_RI(LOAD, A, s + (is_mem ? A : LOWER_RESULT));
+  if (!is_mem && inst->dst.reg != A) {
+    EMIT_RR(MOV, inst->dst.reg, A);
+    EMIT_RI(LOAD, A, s + A);
+  }
+  return cont;
+}
+
+// Computes the address of each LOAD and STORE with a disp in a
+// register again: the loaded one, or for a store, its base, which is
+// restored after it.
+static void lower_mem_disp(Module* m) {
+  Inst* text = malloc(m->num_insts * 3 * sizeof(Inst));
+  int n = 0;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (!inst->disp) {
+      text[n++] = *inst;
+      continue;
+    }
+    Inst add = *inst;
+    add.op = ADD;
+    add.src.type = IMM;
+    add.src.imm = inst->disp;
+    add.disp = 0;
+    Inst mem = *inst;
+    mem.disp = 0;
+    if (inst->op == LOAD) {
+      if (inst->dst.reg != inst->src.reg) {
+        text[n] = *inst;
+        text[n].op = MOV;
+        text[n++].disp = 0;
+      }
+      add.dst = inst->dst;
+      mem.src = inst->dst;
+      text[n++] = add;
+      text[n++] = mem;
+    } else {
+      add.dst = inst->src;
+      text[n++] = add;
+      text[n++] = mem;
+      add.op = SUB;
+      text[n++] = add;
+    }
+  }
+  m->text = text;
+  m->num_insts = n;
+  for (int i = 0; i < n; i++)
+    m->text[i].next = i + 1 < n ? &m->text[i + 1] : NULL;
+  index_module(m);
+}
+
+// Appends n zero words after _edata and returns the address of the
+// first one.
+static int lower_add_scratch(Module* m, int n) {
+  int num_data = m->num_data;
+  m->num_data += n;
+  m->data = realloc(m->data, m->num_data * sizeof(Data));
+  memset(m->data + num_data, 0, n * sizeof(Data));
+  // The scratch words belong to the _edata object.
+  if (m->data_labels) {
+    m->data_labels = realloc(m->data_labels, m->num_data * sizeof(bool));
+    memset(m->data_labels + num_data, 0, n * sizeof(bool));
+  }
+  for (int i = 0; i < m->num_data; i++)
+    m->data[i].next = i + 1 < m->num_data ? &m->data[i + 1] : NULL;
+  m->data[num_data - 1].v = num_data + n;
+  return num_data;
+}
+
+void lower_ext_ops(Module* m, int native_ops) {
+  int ops = m->ext_ops & ~native_ops;
+  // Only a backend with VREG_BIT gets promote_stack_slots.
+  if (ops & VREG_BIT)
+    ir_fatal("virtual registers can't be lowered");
+  if (ops & MEM_DISP_BIT) {
+    lower_mem_disp(m);
+    ops &= ~MEM_DISP_BIT;
+    m->ext_ops &= ~MEM_DISP_BIT;
+  }
+  if (!ops)
+    return;
+
+  int num_calls = 0;
+  for (int i = 0; i < m->num_insts; i++) {
+    Op op = m->text[i].op;
+    if (IS_EXT_OP(op) && (ops & EXT_OP_BIT(op)))
+      num_calls++;
+  }
+
+  // The last data word is _edata, the start of the heap, which moves
+  // past the scratch words.
+  int num_data = lower_add_scratch(m, LOWER_NUM_SCRATCH);
+
+  LowerBuf text = { .scratch = num_data };
+  LowerBuf tail = { .scratch = num_data, .pc = m->num_pcs };
+  LowerBuf* b = &tail;
+  int ret_pc = lower_label(b);
+  EMIT_RI(STORE, A, b->scratch + LOWER_RESULT);
+  EMIT_RI(LOAD, A, b->scratch + LOWER_RET);
+  lower_jump(b, JMP, lower_reg(A), lower_reg(A), lower_reg(A));
+  int helpers[LAST_OP - MUL] = {0};
+  for (int op = MUL; op < LAST_OP; op++) {
+    if (ops & EXT_OP_BIT(op))
+      helpers[op - MUL] = lower_helper(b, (Op)op, ret_pc);
+  }
+  lower_end_block(b);
+
+  int* conts = malloc(num_calls * sizeof(int));
+  int num_conts = 0;
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    Inst* insts = &m->text[m->pc_starts[pc]];
+    int len = m->pc_lens[pc];
+    text.pc = pc;
+    text.in_block = false;
+    int i = 0;
+    for (; i < len; i++) {
+      Op op = insts[i].op;
+      if (IS_EXT_OP(op) && (ops & EXT_OP_BIT(op)))
+        break;
+      lower_copy(&text, &insts[i]);
+    }
+    if (i == len)
+      continue;
+
+    text.lineno = insts[i].lineno;
+    lower_jump(&text, JMP, lower_imm(tail.pc), lower_reg(A), lower_reg(A));
+    while (i < len) {
+      b->lineno = insts[i].lineno;
+      conts[num_conts++] = lower_call(b, &insts[i], helpers[insts[i].op - MUL]);
+      for (i++; i < len; i++) {
+        Op op = insts[i].op;
+        if (IS_EXT_OP(op) && (ops & EXT_OP_BIT(op)))
+          break;
+        lower_copy(b, &insts[i]);
+      }
+    }
+
+    // The original block fell through to the next one.
+    Op last_op = insts[len - 1].op;
+    if (last_op != JMP && last_op != EXIT) {
+      int next = pc + 1;
+      while (next < m->num_pcs && !m->pc_lens[next])
+        next++;
+      if (next < m->num_pcs)
+        GOTO(next);
+      else
+        lower_emit(b, EXIT, lower_reg(A), lower_reg(A));
+    }
+    lower_end_block(b);
+  }
+
+  int old_num_pcs = m->num_pcs;
+  m->num_insts = text.num_insts + tail.num_insts;
+  m->text = malloc(m->num_insts * sizeof(Inst));
+  memcpy(m->text, text.insts, text.num_insts * sizeof(Inst));
+  memcpy(m->text + text.num_insts, tail.insts, tail.num_insts * sizeof(Inst));
+  for (int i = 0; i < m->num_insts; i++)
+    m->text[i].next = i + 1 < m->num_insts ? &m->text[i + 1] : NULL;
+  index_module(m);
+  m->ext_ops &= native_ops;
+
+  if (m->addr_taken) {
+    bool* addr_taken = calloc(m->num_pcs, sizeof(bool));
+    memcpy(addr_taken, m->addr_taken, old_num_pcs * sizeof(bool));
+    for (int i = 0; i < num_conts; i++)
+      addr_taken[conts[i]] = true;
+    m->addr_taken = addr_taken;
+  }
+  free(conts);
+  free(text.insts);
+  free(tail.insts);
+}
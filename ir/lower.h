@@ -0,0 +1,16 @@
+#ifndef ELVM_LOWER_H_
+#define ELVM_LOWER_H_
+
+#include <ir/ir.h>
+
+// Rewrites the extension ops of a loaded module which aren't in
+// native_ops (a set of EXT_OP_BITs) into the base ops, so backends
+// without them can still run the module. Each such op saves the
+// registers, calls a helper loop appended to text and continues in a
+// new block after it. Existing pcs and label addresses stay the same;
+// the new blocks and a few scratch words after _edata are appended.
+// A LOAD or STORE with a disp is expanded in place, unless native_ops
+// has MEM_DISP_BIT.
+void lower_ext_ops(Module* m, int native_ops);
+
+#endif  // ELVM_LOWER_H_
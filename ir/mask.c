@@ -0,0 +1,188 @@
+#include <ir/mask.h>
+
+#include <stdlib.h>
+
+#include <ir/cfg.h>
+
+// The values a register may hold in a block, assuming every result
+// was wrapped. Unsigned, as ints are 24bit when self-hosted.
+typedef struct {
+  unsigned int lo;
+  unsigned int hi;
+} MaskRange;
+
+static bool mask_is_arith(Op op) {
+  return op == ADD || op == SUB || op == MUL || op == SHL;
+}
+
+// Forward pass: whether the result of each ADD, SUB, MUL and SHL stays
+// below 1<<24 when its operands are wrapped, into inst->in_range and
+// inst->unmasked.
+static void mask_find_ranges(Inst** insts, int n) {
+  MaskRange r[NUM_REGS];
+  for (int i = 0; i < NUM_REGS; i++) {
+    r[i].lo = 0;
+    r[i].hi = UINT_MAX;
+  }
+  for (int i = 0; i < n; i++) {
+    Inst* inst = insts[i];
+    inst->unmasked = false;
+    inst->in_range = false;
+    int w = inst_write(inst);
+    if (w < 0)
+      continue;
+    MaskRange s;
+    if (inst->src.type == REG) {
+      s = r[inst->src.reg];
+    } else {
+      s.lo = s.hi = inst->src.imm;
+    }
+    MaskRange* d = &r[w];
+    bool fits = false;
+    switch (inst->op) {
+      case MOV:
+        *d = s;
+        continue;
+
+      case ADD:
+        fits = d->hi <= UINT_MAX - s.hi;
+        if (fits) {
+          d->lo += s.lo;
+          d->hi += s.hi;
+        }
+        break;
+
+      case SUB:
+        fits = d->lo >= s.hi;
+        if (fits) {
+          d->lo -= s.hi;
+          d->hi -= s.lo;
+        }
+        break;
+
+      case MUL:
+        fits = !d->hi || s.hi <= UINT_MAX / d->hi;
+        if (fits) {
+          d->lo *= s.lo;
+          d->hi *= s.hi;
+        }
+        break;
+
+      case SHL:
+        fits = inst->src.type == IMM && s.hi < 24 && !(d->hi >> (24 - s.hi));
+        if (fits) {
+          d->lo <<= s.hi;
+          d->hi <<= s.hi;
+        }
+        break;
+
+      case GETC:
+        d->lo = 0;
+        d->hi = 255;
+        continue;
+
+      case EQ:
+      case NE:
+      case LT:
+      case GT:
+      case LE:
+      case GE:
+        d->lo = 0;
+        d->hi = 1;
+        continue;
+
+      case AND:
+        d->lo = 0;
+        if (s.hi < d->hi)
+          d->hi = s.hi;
+        continue;
+
+      case MOD:
+      case SHR:
+        d->lo = 0;
+        continue;
+
+      default:
+        d->lo = 0;
+        d->hi = UINT_MAX;
+        continue;
+    }
+    inst->unmasked = inst->in_range = fits;
+    if (!fits) {
+      d->lo = 0;
+      d->hi = UINT_MAX;
+    }
+  }
+}
+
+// Backward pass, tracking the registers whose bits above 24 don't
+// matter at each point. Nothing is known after the block, and a jump
+// may leave it at any of them.
+static void mask_block(Inst** insts, int n) {
+  mask_find_ranges(insts, n);
+  int wide = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    Inst* inst = insts[i];
+    Op op = inst->op;
+    int dst = inst->dst.type == REG ? 1 << inst->dst.reg : 0;
+    int src = inst->src.type == REG ? 1 << inst->src.reg : 0;
+    if (op == EXIT) {
+      wide = ALL_REGS;
+      continue;
+    }
+    if (op >= JEQ && op <= JMP) {
+      wide = 0;
+      continue;
+    }
+
+    if (mask_is_arith(op)) {
+      bool fits = inst->unmasked;
+      inst->unmasked = (wide & dst) || fits;
+      if (!(wide & dst) && fits) {
+        // The range assumed wrapped operands.
+        wide &= ~(dst | src);
+      } else {
+        wide |= dst;
+        if (op == SHL)
+          wide &= ~src;
+      }
+      continue;
+    }
+
+    if (op == MOV || op == AND || op == OR || op == XOR) {
+      // The high bits of the result come from the operands, except
+      // for an AND with an immediate, which clears them.
+      bool out_wide = wide & dst;
+      if (op == MOV || (op == AND && inst->src.type == IMM) || out_wide) {
+        wide |= dst;
+      } else {
+        wide &= ~dst;
+      }
+      if (!out_wide)
+        wide &= ~src;
+      continue;
+    }
+
+    int w = inst_write(inst);
+    if (w >= 0)
+      wide |= 1 << w;
+    wide &= ~inst_reads(inst);
+  }
+}
+
+void mark_unmasked(Inst* text) {
+  static Inst** insts;
+  static int cap;
+  while (text) {
+    int n = 0;
+    for (Inst* inst = text; inst && inst->pc == text->pc; inst = inst->next) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        insts = realloc(insts, cap * sizeof(Inst*));
+      }
+      insts[n++] = inst;
+    }
+    mask_block(insts, n);
+    text = insts[n - 1]->next;
+  }
+}
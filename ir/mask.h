@@ -0,0 +1,21 @@
+#ifndef ELVM_MASK_H_
+#define ELVM_MASK_H_
+
+#include <ir/ir.h>
+
+// Sets Inst.unmasked for the ADD, SUB, MUL and SHL instructions of a
+// list of whole basic blocks (e.g., a module's text or a chunk of a
+// stream) which don't need their result wrapped to 24 bits when
+// registers are 32bit or wider. That is the case when the result can't
+// reach 1<<24 in the first place, or when the value is overwritten or
+// only fed to arithmetic that wraps before anything observes it: a
+// comparison, a memory access, PUTC, a register jump or the end of
+// the block. The low 24 bits of +, -, * and << don't depend on the
+// higher bits of their operands, so the wrap can be done once at
+// the end of such a chain.
+//
+// Inst.in_range is also set for those which can't reach 1<<24, for
+// targets whose arithmetic isn't modular at all.
+void mark_unmasked(Inst* text);
+
+#endif  // ELVM_MASK_H_
@@ -0,0 +1,1314 @@
+#include <ir/opt.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/cfg.h>
+
+// Blocks are never emptied: a pc without instructions would lose its
+// entry in every backend's dispatch, so the last instruction of a
+// block always survives.
+typedef struct {
+  Module* m;
+  bool* dead;
+  int* num_live;
+} Optimizer;
+
+static bool opt_uses_src(Op op) {
+  return op != GETC && op != EXIT && op != JMP && op != DUMP;
+}
+
+static bool opt_cmp(Op op, unsigned int l, unsigned int r) {
+  switch (op) {
+    case EQ: case JEQ: return l == r;
+    case NE: case JNE: return l != r;
+    case LT: case JLT: return l < r;
+    case GT: case JGT: return l > r;
+    case LE: case JLE: return l <= r;
+    case GE: case JGE: return l >= r;
+    default: return true;
+  }
+}
+
+static void opt_kill(Optimizer* o, int i) {
+  int pc = o->m->text[i].pc;
+  if (o->dead[i] || o->num_live[pc] == 1)
+    return;
+  o->dead[i] = true;
+  o->num_live[pc]--;
+}
+
+// Forward pass over one block: propagates constants into operands,
+// folds arithmetic, comparisons and conditional jumps on constants, and
+// drops no-ops and everything after exit.
+static void opt_fold_block(Optimizer* o, int start, int len) {
+  int known = 0;
+  int vals[SP + 1];
+  for (int i = start; i < start + len; i++) {
+    Inst* inst = &o->m->text[i];
+    if (o->dead[i])
+      continue;
+
+    if (opt_uses_src(inst->op) && inst->src.type == REG &&
+        (known & (1 << inst->src.reg)) &&
+        !(inst->op == MOV && inst->src.reg == inst->dst.reg)) {
+      inst->src.type = IMM;
+      inst->src.imm = vals[inst->src.reg];
+    }
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == REG &&
+        (known & (1 << inst->jmp.reg))) {
+      inst->jmp.type = IMM;
+      inst->jmp.imm = vals[inst->jmp.reg];
+    }
+
+    Reg dst = inst->dst.reg;
+    bool dst_known = inst->dst.type == REG && (known & (1 << dst));
+
+    switch (inst->op) {
+      case MOV:
+        if (inst->src.type == REG) {
+          if (inst->src.reg == dst) {
+            opt_kill(o, i);
+            continue;
+          }
+          break;
+        }
+        if (dst_known && vals[dst] == inst->src.imm) {
+          opt_kill(o, i);
+          continue;
+        }
+        known |= 1 << dst;
+        vals[dst] = inst->src.imm;
+        continue;
+
+      case ADD:
+      case SUB:
+        if (inst->src.type == IMM && inst->src.imm == 0) {
+          opt_kill(o, i);
+          continue;
+        }
+        if (dst_known && inst->src.type == IMM) {
+          int v = (inst->op == ADD ?
+                   vals[dst] + inst->src.imm : vals[dst] - inst->src.imm);
+          inst->op = MOV;
+          inst->src.imm = v & UINT_MAX;
+          vals[dst] = inst->src.imm;
+          continue;
+        }
+        break;
+
+      case EQ:
+      case NE:
+      case LT:
+      case GT:
+      case LE:
+      case GE:
+        if (dst_known && inst->src.type == IMM) {
+          int v = opt_cmp(inst->op, vals[dst], inst->src.imm);
+          inst->op = MOV;
+          inst->src.imm = v;
+          vals[dst] = v;
+          continue;
+        }
+        break;
+
+      case MUL:
+      case DIV:
+      case MOD:
+      case AND:
+      case OR:
+      case XOR:
+      case SHL:
+      case SHR:
+        if (dst_known && inst->src.type == IMM) {
+          int v = eval_ext_op(inst->op, vals[dst], inst->src.imm);
+          inst->op = MOV;
+          inst->src.imm = v;
+          vals[dst] = v;
+          continue;
+        }
+        break;
+
+      case JEQ:
+      case JNE:
+      case JLT:
+      case JGT:
+      case JLE:
+      case JGE:
+        if (dst_known && inst->src.type == IMM) {
+          if (opt_cmp(inst->op, vals[dst], inst->src.imm)) {
+            inst->op = JMP;
+            inst->dst.type = inst->src.type = REG;
+            inst->dst.reg = inst->src.reg = A;
+          } else {
+            opt_kill(o, i);
+          }
+        }
+        continue;
+
+      case EXIT:
+        for (int j = i + 1; j < start + len; j++)
+          opt_kill(o, j);
+        return;
+
+      default:
+        break;
+    }
+
+    int w = inst_write(inst);
+    if (w >= 0)
+      known &= ~(1 << w);
+  }
+}
+
+// The value of a register in opt_forward_block: that of a symbol plus
+// an offset, where symbol 0 is the constant 0 and the others are
+// unknown values.
+typedef struct {
+  int sym;
+  int off;
+} OptVal;
+
+typedef struct {
+  OptVal addr;
+  OptVal val;
+} OptMem;
+
+#define OPT_MAX_MEM 16
+
+static OptVal opt_val(OptVal* regs, Value* v) {
+  if (v->type == REG)
+    return regs[v->reg];
+  return (OptVal){ 0, v->imm };
+}
+
+static bool opt_val_eq(OptVal a, OptVal b) {
+  return a.sym == b.sym && a.off == b.off;
+}
+
+// Turns a load of val into a move from a register which holds it, or
+// from an immediate. Returns false if no register does.
+static bool opt_forward_load(Inst* inst, OptVal* regs, OptVal val) {
+  Value src = { .type = IMM, .imm = val.off };
+  if (val.sym) {
+    int r = 0;
+    while (r <= SP && !opt_val_eq(regs[r], val))
+      r++;
+    if (r > SP)
+      return false;
+    src.type = REG;
+    src.reg = r;
+  }
+  inst->op = MOV;
+  inst->src = src;
+  inst->disp = 0;
+  return true;
+}
+
+// Forward pass over one block: replaces a load of what the block
+// already stored or loaded at the same address with a move from a
+// register (or an immediate) which still holds it, as 8cc pops what it
+// just pushed and reloads the locals it just stored:
+//
+//   store A, SP; mov B, A; ...; load C, SP  =>  ...; mov C, B
+//
+// Addresses are compared by their symbolic values, so "mov B, BP; add
+// B, 3" twice is the same address. A store only keeps what it can't
+// alias: addresses at other offsets from the same symbol. Moves of what
+// a register already holds go as well.
+static void opt_forward_block(Optimizer* o, int start, int len) {
+  OptVal regs[SP + 1];
+  OptMem mem[OPT_MAX_MEM];
+  int num_mem = 0;
+  int num_syms = 1;
+  for (int r = 0; r <= SP; r++)
+    regs[r] = (OptVal){ num_syms++, 0 };
+
+  for (int i = start; i < start + len; i++) {
+    Inst* inst = &o->m->text[i];
+    if (o->dead[i])
+      continue;
+    Reg dst = inst->dst.reg;
+
+    switch (inst->op) {
+      case MOV: {
+        OptVal v = opt_val(regs, &inst->src);
+        if (opt_val_eq(regs[dst], v))
+          opt_kill(o, i);
+        regs[dst] = v;
+        continue;
+      }
+
+      case ADD:
+      case SUB:
+        if (inst->src.type != IMM)
+          break;
+        regs[dst].off = (inst->op == ADD ?
+                         regs[dst].off + inst->src.imm :
+                         regs[dst].off - inst->src.imm) & UINT_MAX;
+        continue;
+
+      case LOAD:
+      case STORE: {
+        OptVal addr = opt_val(regs, &inst->src);
+        addr.off = (addr.off + inst->disp) & UINT_MAX;
+        int hit = -1;
+        for (int j = 0; j < num_mem; j++) {
+          if (opt_val_eq(mem[j].addr, addr))
+            hit = j;
+        }
+        if (inst->op == LOAD) {
+          if (hit >= 0 && opt_forward_load(inst, regs, mem[hit].val)) {
+            regs[dst] = mem[hit].val;
+            continue;
+          }
+          regs[dst] = (OptVal){ num_syms++, 0 };
+          if (hit >= 0) {
+            mem[hit].val = regs[dst];
+            continue;
+          }
+        } else {
+          int n = 0;
+          for (int j = 0; j < num_mem; j++) {
+            if (mem[j].addr.sym == addr.sym && j != hit)
+              mem[n++] = mem[j];
+          }
+          num_mem = n;
+        }
+        if (num_mem == OPT_MAX_MEM) {
+          num_mem--;
+          for (int j = 0; j < num_mem; j++)
+            mem[j] = mem[j + 1];
+        }
+        mem[num_mem++] = (OptMem){ addr, regs[dst] };
+        continue;
+      }
+
+      case MEMCPY:
+      case MEMSET:
+        num_mem = 0;
+        break;
+
+      default:
+        break;
+    }
+
+    int w = inst_write(inst);
+    if (w >= 0)
+      regs[w] = (OptVal){ num_syms++, 0 };
+  }
+}
+
+// Backward pass over one block: removes register writes which are
+// overwritten or dead before being read.
+static void opt_dse_block(Optimizer* o, int start, int len, int live) {
+  for (int i = start + len - 1; i >= start; i--) {
+    Inst* inst = &o->m->text[i];
+    if (o->dead[i])
+      continue;
+    if (inst->op == EXIT) {
+      live = 0;
+      continue;
+    }
+    int w = inst_write(inst);
+    // getc consumes input, so it stays even when its result is unused.
+    if (w >= 0 && inst->op != GETC && !(live & (1 << w))) {
+      opt_kill(o, i);
+      if (o->dead[i])
+        continue;
+    }
+    if (w >= 0)
+      live &= ~(1 << w);
+    live |= inst_reads(inst);
+  }
+}
+
+// The conditional jump which is taken when a comparison op yields 0
+// or 1, e.g., JGE and JLT for LT.
+static Op opt_cmp_jump(Op cmp, bool taken_on_true) {
+  static const Op kNegated[] = { JNE, JEQ, JGE, JLE, JGT, JLT };
+  return taken_on_true ? (Op)(JEQ + (cmp - EQ)) : kNegated[cmp - EQ];
+}
+
+// Fuses a comparison into the conditional jump on its result which
+// ends the block, as 8cc emits for every if and loop:
+//
+//   eq A, B; jne L, A, 0  =>  jeq L, A, B
+//
+// when A is dead after the jump.
+static void opt_fuse_cmp_jump(Optimizer* o, CFG* cfg, int pc) {
+  Module* m = o->m;
+  int k = m->pc_starts[pc] + m->pc_lens[pc] - 1;
+  int i = k - 1;
+  while (i >= m->pc_starts[pc] && o->dead[i])
+    i--;
+  if (o->dead[k] || i < m->pc_starts[pc])
+    return;
+  Inst* cmp = &m->text[i];
+  Inst* jmp = &m->text[k];
+  if (cmp->op < EQ || cmp->op > GE || (jmp->op != JEQ && jmp->op != JNE))
+    return;
+  Reg r = cmp->dst.reg;
+  if (jmp->dst.type != REG || jmp->dst.reg != r ||
+      jmp->src.type != IMM || jmp->src.imm != 0 ||
+      (jmp->jmp.type == REG && jmp->jmp.reg == r) ||
+      (cfg->blocks[pc].live_out & (1 << r)))
+    return;
+  jmp->op = opt_cmp_jump(cmp->op, jmp->op == JNE);
+  jmp->src = cmp->src;
+  opt_kill(o, i);
+}
+
+// The live instruction before i in its block, or -1.
+static int opt_prev(Optimizer* o, int start, int i) {
+  for (i--; i >= start; i--) {
+    if (!o->dead[i])
+      return i;
+  }
+  return -1;
+}
+
+// Folds the address computation of a memory op into its disp, as 8cc
+// computes the address of every local and argument:
+//
+//   mov B, BP; add B, 16777214; load A, B  =>  load A, BP (disp -2)
+//
+// when B is dead after the load (or is what it loads). Without the
+// mov, the base is B before the add. A store of its own base isn't
+// folded, as lowering would change the stored value.
+static void opt_fold_disp_block(Optimizer* o, int start, int len, int live) {
+  Module* m = o->m;
+  for (int i = start + len - 1; i >= start; i--) {
+    Inst* inst = &m->text[i];
+    if (o->dead[i])
+      continue;
+    if (inst->op == EXIT) {
+      live = 0;
+      continue;
+    }
+
+    int j = opt_prev(o, start, i);
+    if ((inst->op == LOAD || inst->op == STORE) && inst->src.type == REG &&
+        !inst->disp && j >= 0) {
+      Reg r = inst->src.reg;
+      Inst* add = &m->text[j];
+      bool r_dead = (inst->op == LOAD ?
+                     inst->dst.reg == r || !(live & (1 << r)) :
+                     inst->dst.reg != r && !(live & (1 << r)));
+      if (r_dead && (add->op == ADD || add->op == SUB) &&
+          add->dst.reg == r && add->src.type == IMM) {
+        int k = opt_prev(o, start, j);
+        Inst* mov = k >= 0 ? &m->text[k] : NULL;
+        Reg base = r;
+        if (mov && mov->op == MOV && mov->dst.reg == r &&
+            mov->src.type == REG &&
+            !(inst->op == STORE && inst->dst.reg == mov->src.reg)) {
+          base = mov->src.reg;
+        } else {
+          mov = NULL;
+        }
+        int disp = (add->op == ADD ? add->src.imm : -add->src.imm) & UINT_MAX;
+        opt_kill(o, j);
+        if (mov)
+          opt_kill(o, k);
+        inst->src.reg = base;
+        inst->disp = disp;
+        m->ext_ops |= MEM_DISP_BIT;
+      }
+    }
+
+    int w = inst_write(inst);
+    if (w >= 0)
+      live &= ~(1 << w);
+    live |= inst_reads(inst);
+  }
+}
+
+// The only live instruction of a block, or NULL.
+static Inst* opt_single(Optimizer* o, int pc) {
+  Module* m = o->m;
+  if (pc < 0 || pc >= m->num_pcs || o->num_live[pc] != 1)
+    return NULL;
+  for (int i = m->pc_starts[pc]; i < m->pc_starts[pc] + m->pc_lens[pc]; i++) {
+    if (!o->dead[i])
+      return &m->text[i];
+  }
+  return NULL;
+}
+
+// Retargets direct jumps to blocks which only jump elsewhere, then
+// removes jumps to the next pc, where control falls through anyway.
+static void opt_thread_jumps(Optimizer* o) {
+  Module* m = o->m;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (o->dead[i] || inst->op < JEQ || inst->op > JMP ||
+        inst->jmp.type != IMM)
+      continue;
+    for (int n = 0; n < m->num_pcs; n++) {
+      Inst* t = opt_single(o, inst->jmp.imm);
+      if (!t || t->op != JMP || t->jmp.type != IMM ||
+          t->jmp.imm == inst->jmp.imm)
+        break;
+      inst->jmp.imm = t->jmp.imm;
+    }
+  }
+
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (!o->dead[i] && inst->op >= JEQ && inst->op <= JMP &&
+        inst->jmp.type == IMM && inst->jmp.imm == inst->pc + 1)
+      opt_kill(o, i);
+  }
+}
+
+static void opt_init(Optimizer* o, Module* m) {
+  o->m = m;
+  o->dead = calloc(m->num_insts, sizeof(bool));
+  o->num_live = calloc(m->num_pcs, sizeof(int));
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    o->num_live[pc] = m->pc_lens[pc];
+}
+
+// Removes dead instructions from the text and reindexes it.
+static void opt_compact(Optimizer* o) {
+  Module* m = o->m;
+  int n = 0;
+  for (int i = 0; i < m->num_insts; i++) {
+    if (!o->dead[i])
+      m->text[n++] = m->text[i];
+  }
+  for (int i = 0; i < n; i++)
+    m->text[i].next = i + 1 < n ? &m->text[i + 1] : NULL;
+  m->num_insts = n;
+  index_module(m);
+
+  free(o->dead);
+  free(o->num_live);
+  opt_init(o, m);
+}
+
+// Loops for opt_hoist_invariants. A block is in the loop of header h
+// when loop_of[pc] is h + 1, so the marks needn't be cleared.
+typedef struct {
+  CFG* cfg;
+  int* loop_of;
+  int* body;
+  int num_body;
+} LoopFinder;
+
+// The most blocks of a loop opt_hoist_invariants looks into, which
+// bounds its walks.
+#define MAX_LOOP_BLOCKS 256
+
+// Collects the natural loop of header h, the blocks which reach one of
+// its backward predecessors without passing h, and returns the block
+// which enters it (its preheader), or -1 if h heads no loop which is
+// only entered through h from that one block, whose only successor is
+// h. Blocks of the loop mustn't be indirect targets, which also keeps
+// out loops around calls, as their return pcs are. Leaving a loop is
+// fine, by any jump.
+static int opt_find_loop(LoopFinder* lf, int h) {
+  CFG* cfg = lf->cfg;
+  BasicBlock* hb = &cfg->blocks[h];
+  if (!h || cfg->is_indirect_target[h])
+    return -1;
+  lf->num_body = 0;
+  lf->loop_of[h] = h + 1;
+  lf->body[lf->num_body++] = h;
+  bool has_latch = false;
+  for (int i = 0; i < hb->num_preds; i++) {
+    int p = hb->preds[i];
+    if (p < h)
+      continue;
+    has_latch = true;
+    if (lf->loop_of[p] == h + 1)
+      continue;
+    lf->loop_of[p] = h + 1;
+    lf->body[lf->num_body++] = p;
+  }
+  if (!has_latch)
+    return -1;
+  for (int n = 1; n < lf->num_body; n++) {
+    BasicBlock* b = &cfg->blocks[lf->body[n]];
+    if (!b->pc || cfg->is_indirect_target[b->pc])
+      return -1;
+    for (int i = 0; i < b->num_preds; i++) {
+      int p = b->preds[i];
+      if (lf->loop_of[p] == h + 1)
+        continue;
+      if (lf->num_body == MAX_LOOP_BLOCKS)
+        return -1;
+      lf->loop_of[p] = h + 1;
+      lf->body[lf->num_body++] = p;
+    }
+  }
+
+  int pre = -1;
+  for (int i = 0; i < hb->num_preds; i++) {
+    int p = hb->preds[i];
+    if (lf->loop_of[p] == h + 1)
+      continue;
+    if (pre >= 0 && pre != p)
+      return -1;
+    pre = p;
+  }
+  if (pre < 0)
+    return -1;
+  BasicBlock* pb = &cfg->blocks[pre];
+  Inst* last = &pb->insts[pb->num_insts - 1];
+  if (pb->jumps_indirectly || pb->call_return >= 0 ||
+      (last->op >= JEQ && last->op < JMP))
+    return -1;
+  if (last->op == JMP ? last->jmp.type != IMM || last->jmp.imm != h :
+      pre + 1 != h)
+    return -1;
+  return pre;
+}
+
+// Whether a store in the loop may write what load reads. Only accesses
+// with the same base, an invariant register such as BP or an immediate
+// address, are told apart by their disps (modulo 2^24).
+static bool opt_may_alias(Inst* load, Inst* store) {
+  if (store->op != STORE)
+    return true;
+  if (load->src.type != store->src.type)
+    return true;
+  int l = load->src.type == IMM ? load->src.imm : 0;
+  int s = store->src.type == IMM ? store->src.imm : 0;
+  if (load->src.type == REG && load->src.reg != store->src.reg)
+    return true;
+  return !(((l + load->disp) - (s + store->disp)) & UINT_MAX);
+}
+
+// Loop-invariant code motion: moves movs and loads at the head of a
+// loop which compute the same value on every iteration to the end of
+// the block before the loop. Such an inst writes a register nothing
+// else in the loop writes and which the header doesn't read before it,
+// and reads registers the loop doesn't write; a load also needs every
+// store of the loop to go elsewhere, and no block memory op. The
+// header runs whenever the loop is entered, so the register ends up
+// the same, on the way out too. pcs stay as they are; with four
+// registers shared by every expression, this mostly catches constants
+// and globals kept in a register for the whole loop.
+static void opt_hoist_invariants(Module* m) {
+  CFG* cfg = build_cfg(m);
+  LoopFinder lf = { cfg, calloc(m->num_pcs, sizeof(int)),
+                    malloc(MAX_LOOP_BLOCKS * sizeof(int)), 0 };
+  // The header whose insts move into a preheader, by its pc, or -1.
+  int* header_of = malloc(m->num_pcs * sizeof(int));
+  bool* hoisted = calloc(m->num_insts, sizeof(bool));
+  bool any = false;
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    header_of[pc] = -1;
+
+  for (int h = 0; h < m->num_pcs; h++) {
+    int pre = opt_find_loop(&lf, h);
+    if (pre < 0)
+      continue;
+    int num_writes[NUM_REGS] = {0};
+    Inst* stores[8];
+    int num_stores = 0;
+    bool clobbers = false;
+    for (int n = 0; n < lf.num_body; n++) {
+      BasicBlock* b = &cfg->blocks[lf.body[n]];
+      for (int i = 0; i < b->num_insts; i++) {
+        Inst* inst = &b->insts[i];
+        int w = inst_write(inst);
+        if (w >= 0)
+          num_writes[w]++;
+        if (inst->op == STORE && num_stores < 8)
+          stores[num_stores++] = inst;
+        else if (inst->op == STORE || inst->op == MEMCPY ||
+                 inst->op == MEMSET)
+          clobbers = true;
+      }
+    }
+
+    BasicBlock* hb = &cfg->blocks[h];
+    int read = 0;
+    for (int i = 0; i < hb->num_insts - 1; i++) {
+      Inst* inst = &hb->insts[i];
+      int r = inst_reads(inst);
+      int w = inst_write(inst);
+      bool ok = ((inst->op == MOV || inst->op == LOAD) &&
+                 num_writes[w] == 1 && !(read & (1 << w)) &&
+                 !(r & (1 << w)));
+      for (int j = 0; ok && j < NUM_REGS; j++) {
+        if ((r & (1 << j)) && num_writes[j])
+          ok = false;
+      }
+      if (ok && inst->op == LOAD) {
+        ok = !clobbers;
+        for (int j = 0; ok && j < num_stores; j++)
+          ok = !opt_may_alias(inst, stores[j]);
+      }
+      if (ok) {
+        hoisted[inst - m->text] = true;
+        header_of[pre] = h;
+        num_writes[w]--;
+        any = true;
+      }
+      read |= r;
+    }
+  }
+
+  if (any) {
+    Inst* text = malloc(m->num_insts * sizeof(Inst));
+    int n = 0;
+    for (int pc = 0; pc < m->num_pcs; pc++) {
+      int start = m->pc_starts[pc];
+      int len = m->pc_lens[pc];
+      int h = header_of[pc];
+      Inst* last = &m->text[start + len - 1];
+      int end = h >= 0 && last->op == JMP ? len - 1 : len;
+      for (int i = 0; i <= len; i++) {
+        if (i == end && h >= 0) {
+          int hs = m->pc_starts[h];
+          for (int j = hs; j < hs + m->pc_lens[h]; j++) {
+            if (hoisted[j]) {
+              text[n] = m->text[j];
+              text[n++].pc = pc;
+            }
+          }
+        }
+        if (i < len && !hoisted[start + i])
+          text[n++] = m->text[start + i];
+      }
+    }
+    memcpy(m->text, text, n * sizeof(Inst));
+    free(text);
+    for (int i = 0; i < n; i++)
+      m->text[i].next = i + 1 < n ? &m->text[i + 1] : NULL;
+    index_module(m);
+  }
+  free(lf.loop_of);
+  free(lf.body);
+  free(header_of);
+  free(hoisted);
+}
+
+static int g_inline_budget = 24;
+
+void set_inline_budget(int num_insts) {
+  g_inline_budget = num_insts;
+}
+
+// The callee of a direct call at the end of b whose whole body is one
+// block of up to g_inline_budget instructions ending in its return,
+// e.g., a leaf with 8cc's prologue and epilogue, or NULL.
+static BasicBlock* opt_inline_callee(CFG* cfg, BasicBlock* b) {
+  if (b->call_return < 0 || b->jumps_indirectly || b->num_succs != 1)
+    return NULL;
+  BasicBlock* callee = &cfg->blocks[b->succs[0]];
+  if (callee == b || !callee->returns ||
+      callee->num_insts > g_inline_budget)
+    return NULL;
+  return callee;
+}
+
+// The index in b of the mov of the return address a call pushes (see
+// cfg_call_return), or -1.
+static int opt_ret_mov(BasicBlock* b) {
+  int known[NUM_REGS];
+  for (int r = 0; r < NUM_REGS; r++)
+    known[r] = -1;
+  int ret = -1;
+  for (int i = 0; i < b->num_insts - 1; i++) {
+    Inst* inst = &b->insts[i];
+    if (inst->op == STORE && inst->src.type == REG && inst->src.reg == SP &&
+        !inst->disp)
+      ret = known[inst->dst.reg];
+    int w = inst_write(inst);
+    if (inst->op == MOV && inst->src.type == IMM)
+      known[w] = i;
+    else if (w >= 0)
+      known[w] = -1;
+  }
+  return ret;
+}
+
+// Replaces the jump of each call to a small leaf with the leaf's
+// instructions, its return becoming a direct jump to the return pc.
+// The copy runs as the leaf did, so the rest of optimize_module can see
+// through its frame. Only the return address it pushes and loads is
+// 0 when nothing else refers to the return pc, which then isn't taken
+// as a code address (8cc's callers and leaves never look at it).
+static void opt_inline_leaves(Module* m) {
+  if (g_inline_budget <= 0 || is_split_basic_block_by_mem())
+    return;
+  CFG* cfg = build_cfg(m);
+  int* num_refs = calloc(m->num_pcs, sizeof(int));
+  for (int i = 0; i < m->num_insts; i++) {
+    Value* v[3] = { &m->text[i].dst, &m->text[i].src, &m->text[i].jmp };
+    for (int j = 0; j < 3; j++) {
+      if (v[j]->type == IMM && v[j]->imm >= 0 && v[j]->imm < m->num_pcs)
+        num_refs[v[j]->imm]++;
+    }
+  }
+  for (int i = 0; i < m->num_data; i++) {
+    if (m->data[i].v >= 0 && m->data[i].v < m->num_pcs)
+      num_refs[m->data[i].v]++;
+  }
+  int num_insts = m->num_insts;
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    BasicBlock* callee = opt_inline_callee(cfg, &cfg->blocks[pc]);
+    if (callee)
+      num_insts += callee->num_insts - 1;
+  }
+  if (num_insts == m->num_insts) {
+    free(num_refs);
+    return;
+  }
+
+  Inst* text = malloc(num_insts * sizeof(Inst));
+  int n = 0;
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    BasicBlock* callee = opt_inline_callee(cfg, b);
+    int ret_mov = callee ? opt_ret_mov(b) : -1;
+    if (ret_mov >= 0 && num_refs[b->call_return] != 1)
+      ret_mov = -1;
+    for (int i = 0; i < b->num_insts; i++) {
+      if (!callee || i < b->num_insts - 1) {
+        text[n++] = b->insts[i];
+        if (i == ret_mov) {
+          text[n - 1].src.imm = 0;
+          if (m->addr_taken)
+            m->addr_taken[b->call_return] = false;
+        }
+        continue;
+      }
+      for (int j = 0; j < callee->num_insts; j++) {
+        text[n] = callee->insts[j];
+        text[n++].pc = pc;
+      }
+      Inst* ret = &text[n - 1];
+      ret->jmp.type = IMM;
+      ret->jmp.imm = b->call_return;
+    }
+  }
+  m->text = text;
+  m->num_insts = n;
+  for (int i = 0; i < n; i++)
+    m->text[i].next = i + 1 < n ? &m->text[i + 1] : NULL;
+  index_module(m);
+  free(num_refs);
+}
+
+void optimize_module(Module* m) {
+  if (!m->num_insts)
+    return;
+
+  ir_phase_begin("opt_inline_leaves");
+  opt_inline_leaves(m);
+
+  Optimizer o;
+  ir_phase_begin("opt_forward");
+  opt_init(&o, m);
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    opt_forward_block(&o, m->pc_starts[pc], m->pc_lens[pc]);
+
+  ir_phase_begin("opt_fold");
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    opt_fold_block(&o, m->pc_starts[pc], m->pc_lens[pc]);
+  opt_compact(&o);
+
+  // Folding may turn register jumps into direct ones, which makes the
+  // liveness more precise.
+  ir_phase_begin("opt_dse");
+  CFG* cfg = build_cfg(m);
+  for (int pc = 0; pc < m->num_pcs; pc++) {
+    opt_dse_block(&o, m->pc_starts[pc], m->pc_lens[pc],
+                  cfg->blocks[pc].live_out);
+  }
+  opt_compact(&o);
+
+  ir_phase_begin("opt_fuse_cmp_jump");
+  cfg = build_cfg(m);
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    opt_fuse_cmp_jump(&o, cfg, pc);
+  opt_compact(&o);
+
+  // Blocks split at memory ops (for target_bf) can't hold the address
+  // arithmetic with them.
+  if (!is_split_basic_block_by_mem()) {
+    ir_phase_begin("opt_fold_disp");
+    cfg = build_cfg(m);
+    for (int pc = 0; pc < m->num_pcs; pc++) {
+      opt_fold_disp_block(&o, m->pc_starts[pc], m->pc_lens[pc],
+                          cfg->blocks[pc].live_out);
+    }
+    opt_compact(&o);
+
+    ir_phase_begin("opt_hoist_invariants");
+    opt_hoist_invariants(m);
+    free(o.dead);
+    free(o.num_live);
+    opt_init(&o, m);
+  }
+
+  ir_phase_begin("opt_thread_jumps");
+  opt_thread_jumps(&o);
+  opt_compact(&o);
+  free(o.dead);
+  free(o.num_live);
+  ir_phase_end();
+}
+
+// A function for promote_stack_slots: the blocks reachable from a call
+// target, with calls stepping over to their return pcs, as
+// cfg_find_return_targets walks them.
+typedef struct {
+  int entry;
+  int* blocks;
+  int num_blocks;
+  int* callees;
+  int num_callees;
+  // Whether it calls through a register, or jumps through one other
+  // than to return, which may go anywhere.
+  bool calls_indirectly;
+  bool wild;
+  // Whether its slots can't be promoted: its frame may be reached
+  // other than by BP-relative loads and stores, or its blocks by other
+  // functions.
+  bool bad;
+  // The disps of its locals (below BP) with their number of accesses,
+  // and the virtual register of each, or -1.
+  int* slots;
+  int* slot_uses;
+  int* slot_vregs;
+  int num_slots;
+  int uses;
+  int vregs;
+} PromoteFunc;
+
+typedef struct {
+  Module* m;
+  CFG* cfg;
+  PromoteFunc* funcs;
+  int num_funcs;
+  // The function whose entry is at each pc, or -1.
+  int* func_at;
+  // reach[f * reach_stride + g / 8] has bit g % 8 if f may call g,
+  // directly or not.
+  unsigned char* reach;
+  int reach_stride;
+} Promoter;
+
+static void promote_add_entry(Promoter* p, int pc) {
+  if (pc < 0 || pc >= p->m->num_pcs || p->func_at[pc] >= 0 ||
+      !p->m->pc_lens[pc])
+    return;
+  p->func_at[pc] = p->num_funcs;
+  p->funcs = realloc(p->funcs, (p->num_funcs + 1) * sizeof(PromoteFunc));
+  PromoteFunc* f = &p->funcs[p->num_funcs++];
+  memset(f, 0, sizeof(*f));
+  f->entry = pc;
+}
+
+// Entries are the targets of direct calls, the code addresses which
+// aren't return pcs, and where pc 0 jumps (to main).
+static void promote_find_entries(Promoter* p) {
+  CFG* cfg = p->cfg;
+  int n = cfg->num_blocks;
+  bool* is_ret = calloc(n, sizeof(bool));
+  for (int pc = 0; pc < n; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    if (b->call_return < 0)
+      continue;
+    is_ret[b->call_return] = true;
+    if (!b->jumps_indirectly && b->num_succs)
+      promote_add_entry(p, b->succs[0]);
+  }
+  for (int i = 0; i < cfg->num_indirect_targets; i++) {
+    if (!is_ret[cfg->indirect_targets[i]])
+      promote_add_entry(p, cfg->indirect_targets[i]);
+  }
+  BasicBlock* b = &cfg->blocks[0];
+  if (b->num_insts) {
+    Inst* last = &b->insts[b->num_insts - 1];
+    if (last->op == JMP && last->jmp.type == IMM)
+      promote_add_entry(p, last->jmp.imm);
+  }
+  free(is_ret);
+}
+
+static void promote_walk(Promoter* p, int fi, int* owner, int* seen,
+                         int* stack) {
+  CFG* cfg = p->cfg;
+  PromoteFunc* f = &p->funcs[fi];
+  f->blocks = malloc(cfg->num_blocks * sizeof(int));
+  int sp = 0;
+  stack[sp++] = f->entry;
+  seen[f->entry] = fi + 1;
+  while (sp) {
+    BasicBlock* b = &cfg->blocks[stack[--sp]];
+    f->blocks[f->num_blocks++] = b->pc;
+    if (owner[b->pc] >= 0) {
+      f->bad = true;
+      p->funcs[owner[b->pc]].bad = true;
+    }
+    owner[b->pc] = fi;
+
+    int next[2];
+    int num_next = 0;
+    if (b->call_return >= 0) {
+      next[num_next++] = b->call_return;
+      if (b->jumps_indirectly || !b->num_succs) {
+        f->calls_indirectly = true;
+      } else {
+        f->callees = realloc(f->callees, (f->num_callees + 1) * sizeof(int));
+        f->callees[f->num_callees++] = p->func_at[b->succs[0]];
+      }
+    } else if (b->jumps_indirectly && !b->returns) {
+      f->wild = true;
+      f->bad = true;
+    } else {
+      for (int i = 0; i < b->num_succs; i++)
+        next[num_next++] = b->succs[i];
+    }
+    for (int i = 0; i < num_next; i++) {
+      int to = next[i];
+      // The prologue would run again.
+      if (to == f->entry)
+        f->bad = true;
+      if (seen[to] != fi + 1) {
+        seen[to] = fi + 1;
+        stack[sp++] = to;
+      }
+    }
+  }
+
+  // Entered from elsewhere, maybe with another BP.
+  for (int i = 0; i < f->num_blocks; i++) {
+    int pc = f->blocks[i];
+    if (pc != f->entry && cfg->is_indirect_target[pc]) {
+      bool is_ret = false;
+      for (int j = 0; j < f->num_blocks; j++)
+        is_ret |= cfg->blocks[f->blocks[j]].call_return == pc;
+      if (!is_ret)
+        f->bad = true;
+    }
+  }
+}
+
+// Calls through registers may reach every function whose address is
+// taken, and wild jumps every function.
+static void promote_find_reach(Promoter* p) {
+  int nf = p->num_funcs;
+  p->reach_stride = (nf + 7) / 8;
+  p->reach = calloc((size_t)nf * p->reach_stride, 1);
+  int* stack = malloc((nf + 1) * sizeof(int));
+  for (int start = 0; start < nf; start++) {
+    unsigned char* r = &p->reach[(size_t)start * p->reach_stride];
+    int sp = 0;
+    stack[sp++] = start;
+    while (sp) {
+      PromoteFunc* f = &p->funcs[stack[--sp]];
+      for (int g = 0; g < nf; g++) {
+        bool edge;
+        if (f->wild) {
+          edge = true;
+        } else if (f->calls_indirectly &&
+                   p->cfg->is_indirect_target[p->funcs[g].entry]) {
+          edge = true;
+        } else {
+          edge = false;
+          for (int i = 0; i < f->num_callees; i++)
+            edge |= f->callees[i] == g;
+        }
+        if (edge && !(r[g / 8] & (1 << g % 8))) {
+          r[g / 8] |= 1 << g % 8;
+          stack[sp++] = g;
+        }
+      }
+    }
+  }
+  free(stack);
+}
+
+static bool promote_reaches(Promoter* p, int f, int g) {
+  return p->reach[(size_t)f * p->reach_stride + g / 8] & (1 << g % 8);
+}
+
+static int promote_disp(Inst* inst) {
+  int d = inst->disp & UINT_MAX;
+  return d > UINT_MAX / 2 ? d - UINT_MAX - 1 : d;
+}
+
+static bool promote_is_slot(Inst* inst) {
+  return ((inst->op == LOAD || inst->op == STORE) &&
+          inst->src.type == REG && inst->src.reg == BP &&
+          promote_disp(inst) < 0);
+}
+
+// Checks that BP is set up once by the prologue of the entry, 8cc's
+//
+//   mov D, SP; add D, -1; store BP, D; mov SP, D; mov BP, SP
+//
+// is only changed again by returns and the frames of inlined leaves
+// (see opt_inline_leaves), and is only read as the base of loads and
+// stores, and counts the accesses to each local. With rewrite, moves
+// the accesses to the locals given virtual registers instead.
+static void promote_scan(Promoter* p, PromoteFunc* f, bool rewrite) {
+  for (int i = 0; i < f->num_blocks && !f->bad; i++) {
+    BasicBlock* b = &p->cfg->blocks[f->blocks[i]];
+    bool frame = b->pc != f->entry;
+    bool set_up = frame;
+    // The inlined frames entered in this block, and whether BP was
+    // just saved for one.
+    int depth = 0;
+    bool saving = false;
+    for (int j = 0; j < b->num_insts && !f->bad; j++) {
+      Inst* inst = &b->insts[j];
+      int reads = inst_reads(inst);
+      if ((inst->op == LOAD || inst->op == STORE) &&
+          inst->src.type == REG && inst->src.reg == BP) {
+        if (!frame)
+          f->bad = true;
+        reads &= ~(1 << BP);
+        if (inst->op == STORE && inst->dst.reg == BP)
+          reads |= 1 << BP;
+      }
+      if (reads & (1 << BP)) {
+        if (inst->op == STORE && inst->dst.reg == BP &&
+            inst->src.reg != BP)
+          saving = frame;
+        else if (!(inst->op == MOV && inst->dst.reg == SP &&
+                   (b->returns || depth)))
+          f->bad = true;
+      }
+      if (inst_write(inst) == BP) {
+        bool from_sp = (inst->op == MOV && inst->src.type == REG &&
+                        inst->src.reg == SP);
+        if (from_sp && !frame && !set_up && b->pc == f->entry) {
+          frame = set_up = true;
+        } else if (from_sp && saving) {
+          depth++;
+          saving = false;
+        } else if (!from_sp && depth) {
+          depth--;
+        } else if (!from_sp && b->returns) {
+          frame = false;
+        } else {
+          f->bad = true;
+        }
+      }
+      if (f->bad || depth || !promote_is_slot(inst))
+        continue;
+
+      int d = promote_disp(inst);
+      int k = 0;
+      while (k < f->num_slots && f->slots[k] != d)
+        k++;
+      if (rewrite) {
+        if (f->slot_vregs[k] < 0)
+          continue;
+        Reg v = (Reg)(R0 + f->slot_vregs[k]);
+        if (inst->op == LOAD) {
+          inst->src.reg = v;
+        } else {
+          inst->src = inst->dst;
+          inst->dst.reg = v;
+        }
+        inst->op = MOV;
+        inst->disp = 0;
+        continue;
+      }
+      if (k == f->num_slots) {
+        f->slots = realloc(f->slots, (k + 1) * sizeof(int));
+        f->slot_uses = realloc(f->slot_uses, (k + 1) * sizeof(int));
+        f->slots[k] = d;
+        f->slot_uses[k] = 0;
+        f->num_slots++;
+      }
+      f->slot_uses[k]++;
+      f->uses++;
+    }
+    if (!set_up || depth || saving)
+      f->bad = true;
+  }
+}
+
+static Promoter* g_promoter;
+
+static int promote_compare_funcs(const void* a, const void* b) {
+  const PromoteFunc* x = &g_promoter->funcs[*(const int*)a];
+  const PromoteFunc* y = &g_promoter->funcs[*(const int*)b];
+  if (x->uses != y->uses)
+    return x->uses > y->uses ? -1 : 1;
+  return x->entry - y->entry;
+}
+
+// Gives the most used locals of f the virtual registers which no
+// function that may be active at the same time has, so none needs to
+// save them around calls.
+static void promote_assign(Promoter* p, int fi, int* order, int num_done) {
+  PromoteFunc* f = &p->funcs[fi];
+  int taken = 0;
+  for (int i = 0; i < num_done; i++) {
+    int g = order[i];
+    if (promote_reaches(p, fi, g) || promote_reaches(p, g, fi))
+      taken |= p->funcs[g].vregs;
+  }
+  f->slot_vregs = malloc(f->num_slots * sizeof(int));
+  for (int k = 0; k < f->num_slots; k++)
+    f->slot_vregs[k] = -1;
+  for (;;) {
+    int best = -1;
+    for (int k = 0; k < f->num_slots; k++) {
+      if (f->slot_vregs[k] < 0 &&
+          (best < 0 || f->slot_uses[k] > f->slot_uses[best]))
+        best = k;
+    }
+    int v = 0;
+    while (v < NUM_VREGS && (taken & (1 << v)))
+      v++;
+    if (best < 0 || v == NUM_VREGS)
+      break;
+    f->slot_vregs[best] = v;
+    taken |= 1 << v;
+    f->vregs |= 1 << v;
+  }
+}
+
+void promote_stack_slots(Module* m) {
+  if (!m->num_insts)
+    return;
+  ir_phase_begin("promote_stack_slots");
+  Promoter p;
+  memset(&p, 0, sizeof(p));
+  p.m = m;
+  p.cfg = build_cfg(m);
+  int n = m->num_pcs;
+  p.func_at = malloc(n * sizeof(int));
+  for (int pc = 0; pc < n; pc++)
+    p.func_at[pc] = -1;
+  promote_find_entries(&p);
+
+  int* owner = malloc(n * sizeof(int));
+  int* seen = calloc(n, sizeof(int));
+  int* stack = malloc(n * sizeof(int));
+  for (int pc = 0; pc < n; pc++)
+    owner[pc] = -1;
+  for (int fi = 0; fi < p.num_funcs; fi++)
+    promote_walk(&p, fi, owner, seen, stack);
+  promote_find_reach(&p);
+
+  int* order = malloc((p.num_funcs + 1) * sizeof(int));
+  int num_order = 0;
+  for (int fi = 0; fi < p.num_funcs; fi++) {
+    PromoteFunc* f = &p.funcs[fi];
+    // A recursive call would find the caller's locals in the registers.
+    if (!f->bad && !promote_reaches(&p, fi, fi))
+      promote_scan(&p, f, false);
+    if (!f->bad && f->num_slots)
+      order[num_order++] = fi;
+  }
+  g_promoter = &p;
+  qsort(order, num_order, sizeof(int), promote_compare_funcs);
+  for (int i = 0; i < num_order; i++) {
+    promote_assign(&p, order[i], order, i);
+    if (p.funcs[order[i]].vregs) {
+      promote_scan(&p, &p.funcs[order[i]], true);
+      m->ext_ops |= VREG_BIT;
+    }
+  }
+
+  for (int fi = 0; fi < p.num_funcs; fi++) {
+    PromoteFunc* f = &p.funcs[fi];
+    free(f->blocks);
+    free(f->callees);
+    free(f->slots);
+    free(f->slot_uses);
+    free(f->slot_vregs);
+  }
+  free(p.funcs);
+  free(p.func_at);
+  free(p.reach);
+  free(order);
+  free(owner);
+  free(seen);
+  free(stack);
+  ir_phase_end();
+}
+
+// Marks the object (the last data label at or before it) of v, if it's
+// a data address, as reached by a pointer.
+static void global_mark_escaped(Module* m, int* obj, bool* escaped, int v) {
+  v &= UINT_MAX;
+  if (v < m->num_data)
+    escaped[obj[v]] = true;
+}
+
+void find_global_vars(Module* m) {
+  if (!m->data_labels)
+    return;
+  ir_phase_begin("find_global_vars");
+  int n = m->num_data;
+  int* obj = malloc(n * sizeof(int));
+  for (int i = 0, o = 0; i < n; i++) {
+    if (m->data_labels[i])
+      o = i;
+    obj[i] = o;
+  }
+  bool* escaped = calloc(n, sizeof(bool));
+  bool* accessed = calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++)
+    global_mark_escaped(m, obj, escaped, m->data[i].v);
+  // A pointer is made by a MOV, or by an ADD or SUB of an index, from
+  // an immediate, or it's a disp with a register base, which is where
+  // opt_fold_disp leaves the base of an array. Comparisons, masks and
+  // the other arithmetic don't make one out of their immediates.
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    switch (inst->op) {
+      case MOV:
+      case ADD:
+      case SUB:
+        if (inst->src.type == IMM)
+          global_mark_escaped(m, obj, escaped, inst->src.imm);
+        break;
+
+      case LOAD:
+      case STORE:
+        if (inst->src.type == IMM) {
+          int a = (inst->src.imm + inst->disp) & UINT_MAX;
+          if (a < n)
+            accessed[a] = true;
+        } else {
+          global_mark_escaped(m, obj, escaped, inst->disp);
+        }
+        break;
+
+      case MEMCPY:
+        if (inst->src.type == IMM)
+          global_mark_escaped(m, obj, escaped, inst->src.imm);
+        // fall through
+      case MEMSET:
+        if (inst->dst.type == IMM)
+          global_mark_escaped(m, obj, escaped, inst->dst.imm);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  m->global_vars = calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++)
+    m->global_vars[i] = accessed[i] && !escaped[obj[i]];
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if ((inst->op == LOAD || inst->op == STORE) && inst->src.type == IMM) {
+      int a = (inst->src.imm + inst->disp) & UINT_MAX;
+      inst->global_var = a < n && m->global_vars[a];
+    }
+  }
+  free(obj);
+  free(escaped);
+  free(accessed);
+  ir_phase_end();
+}
@@ -0,0 +1,44 @@
+#ifndef ELVM_OPT_H_
+#define ELVM_OPT_H_
+
+#include <ir/ir.h>
+
+// Simplifies the text of a loaded module in place. Every pc and the
+// address of every label stay the same, so immediates which happen to
+// be code addresses keep working; only instructions inside basic
+// blocks are rewritten or removed, and jump targets are threaded.
+// Loads of what a block just stored or loaded become register moves.
+// Address arithmetic ending in a LOAD or STORE is folded into its
+// disp, which lower_ext_ops undoes for backends without it. Direct
+// calls to a function which is a single block (a leaf without branches)
+// of up to the inline budget get its instructions in place of the call
+// jump. Movs and loads at the head of a loop which are the same on every
+// iteration move to the block which enters it.
+void optimize_module(Module* m);
+
+// The most instructions a function inlined by optimize_module may have,
+// with the 11 of 8cc's prologue and epilogue, 24 by default. 0 disables
+// inlining.
+void set_inline_budget(int num_insts);
+
+// Moves the locals of functions (as 8cc lays them out, below BP) into
+// the virtual registers R0 to R15, after optimize_module has folded
+// their addresses into disps. Only a function which can't recurse and
+// whose frame is only reached by BP-relative loads and stores has them
+// promoted, and two functions which may be active at the same time get
+// different registers, so calls don't need to save them. Loads and
+// stores become moves in place, so only run this for a backend with
+// VREG_BIT.
+void promote_stack_slots(Module* m);
+
+// Finds the data words which are only loaded and stored at constant
+// addresses, so a backend with GLOBAL_VAR_BIT may keep them in
+// variables of their own, and marks those loads and stores global_var.
+// A word qualifies when no pointer can reach its object, the words from
+// the data label at or before it to the next one: no data word, disp
+// with a register base, address of a block op or immediate a MOV, ADD
+// or SUB takes is in the object. Runs after lower_ext_ops,
+// which adds loads and stores of its own, and only with data labels.
+void find_global_vars(Module* m);
+
+#endif  // ELVM_OPT_H_
@@ -3,20 +3,75 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define TABLE_INITIAL_CAP 64
+
+static unsigned int table_hash(const char* key) {
+  unsigned int h = 0;
+  for (; *key; key++)
+    h = h * 31 + (unsigned char)*key;
+  return h;
+}
+
+static TableEntry* table_find(Table* tbl, const char* key,
+                              unsigned int hash) {
+  // cap is a power of two, so masking never leaves the array.
+  unsigned int mask = tbl->cap - 1;
+  unsigned int i = hash & mask;
+  for (;;) {
+    TableEntry* e = &tbl->entries[i];
+    if (!e->key)
+      return e;
+    if (e->hash == hash && (e->key == key || !strcmp(e->key, key)))
+      return e;
+    i = (i + 1) & mask;
+  }
+}
+
+static void table_init(Table* tbl, int cap) {
+  tbl->entries = calloc(cap, sizeof(TableEntry));
+  tbl->cap = cap;
+  tbl->size = 0;
+}
+
+static void table_grow(Table* tbl) {
+  TableEntry* entries = tbl->entries;
+  int cap = tbl->cap;
+  table_init(tbl, cap * 2);
+  for (int i = 0; i < cap; i++) {
+    TableEntry* e = &entries[i];
+    if (!e->key)
+      continue;
+    *table_find(tbl, e->key, e->hash) = *e;
+    tbl->size++;
+  }
+  free(entries);
+}
+
 Table* table_add(Table* tbl, const char* key, const void* value) {
-  Table* ntbl = malloc(sizeof(Table));
-  ntbl->next = tbl;
-  ntbl->key = key;
-  ntbl->value = value;
-  return ntbl;
+  if (!tbl) {
+    tbl = malloc(sizeof(Table));
+    table_init(tbl, TABLE_INITIAL_CAP);
+  }
+  if ((tbl->size + 1) * 2 > tbl->cap)
+    table_grow(tbl);
+
+  unsigned int hash = table_hash(key);
+  TableEntry* e = table_find(tbl, key, hash);
+  if (!e->key) {
+    e->key = key;
+    e->hash = hash;
+    tbl->size++;
+  }
+  e->value = value;
+  return tbl;
 }
 
 bool table_get(Table* tbl, const char* key, const void** value) {
-  for (; tbl; tbl = tbl->next) {
-    if (!strcmp(tbl->key, key)) {
-      *value = tbl->value;
-      return true;
-    }
-  }
-  return false;
+  if (!tbl)
+    return false;
+  TableEntry* e = table_find(tbl, key, table_hash(key));
+  if (!e->key)
+    return false;
+  *value = e->value;
+  return true;
 }
@@ -3,10 +3,18 @@
 
 #include <stdbool.h>
 
-typedef struct Table_ {
+typedef struct {
   const char* key;
   const void* value;
-  struct Table_* next;
+  unsigned int hash;
+} TableEntry;
+
+// An open-addressing hash table. Pass NULL to table_add to create a
+// new table. Adding an existing key overwrites its value.
+typedef struct Table_ {
+  TableEntry* entries;
+  int cap;
+  int size;
 } Table;
 
 Table* table_add(Table* tbl, const char* key, const void* value);
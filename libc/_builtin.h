@@ -35,6 +35,41 @@ void my_div(unsigned int a, unsigned int b, _my_div_t* o) {
   o->rem = a;
 }
 
+// b << i for the divisors printf uses, up to the last one below 1<<24,
+// so dividing by them needn't build the tables my_div does.
+static const unsigned int __builtin_div10_table[] = {
+  10, 20, 40, 80, 160, 320, 640, 1280, 2560, 5120, 10240, 20480, 40960,
+  81920, 163840, 327680, 655360, 1310720, 2621440, 5242880, 10485760,
+};
+
+static const unsigned int __builtin_div16_table[] = {
+  16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768,
+  65536, 131072, 262144, 524288, 1048576, 2097152, 4194304, 8388608,
+};
+
+static void my_div_table(unsigned int a, const unsigned int* d, int n,
+                         _my_div_t* o) {
+  unsigned int q = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    q += q;
+    if (a >= d[i]) {
+      q++;
+      a -= d[i];
+    }
+  }
+  o->quot = q;
+  o->rem = a;
+}
+
+static void my_div_const(unsigned int a, unsigned int b, _my_div_t* o) {
+  if (b == 10)
+    my_div_table(a, __builtin_div10_table, 21, o);
+  else if (b == 16)
+    my_div_table(a, __builtin_div16_table, 20, o);
+  else
+    my_div(a, b, o);
+}
+
 static int __builtin_mul(int a, int b) {
   int i, e, v;
   if (a < b) {
@@ -74,13 +109,13 @@ static unsigned int __builtin_div(unsigned int a, unsigned int b) {
   if (b == 1)
     return a;
   _my_div_t r;
-  my_div(a, b, &r);
+  my_div_const(a, b, &r);
   return r.quot;
 }
 
 static unsigned int __builtin_mod(unsigned int a, unsigned int b) {
   _my_div_t r;
-  my_div(a, b, &r);
+  my_div_const(a, b, &r);
   return r.rem;
 }
 
@@ -95,6 +130,10 @@ static const int __builtin_bits_table[] = {
 
 #define __BUILTIN_TO_BIT(v, t) (v >= t ? (v -= t, 1) : 0)
 
+// Define ELVM_SMALL_BUILTINS to get the bit-by-bit versions below,
+// which need no tables in data.
+#ifdef ELVM_SMALL_BUILTINS
+
 static unsigned int __builtin_and(unsigned int a, unsigned int b) {
   int r = 0;
   for (int i = 0; i < 24; i++) {
@@ -164,4 +203,178 @@ static unsigned int __builtin_shr(unsigned int a, unsigned int b) {
   return r;
 }
 
+#else
+
+// 16x16 results of a bitwise op, indexed by a's nibble * 16 + b's.
+static const int __builtin_and_table[] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1,
+  0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 2, 2,
+  0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3,
+  0, 0, 0, 0, 4, 4, 4, 4, 0, 0, 0, 0, 4, 4, 4, 4,
+  0, 1, 0, 1, 4, 5, 4, 5, 0, 1, 0, 1, 4, 5, 4, 5,
+  0, 0, 2, 2, 4, 4, 6, 6, 0, 0, 2, 2, 4, 4, 6, 6,
+  0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7,
+  0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 8, 8, 8, 8, 8, 8,
+  0, 1, 0, 1, 0, 1, 0, 1, 8, 9, 8, 9, 8, 9, 8, 9,
+  0, 0, 2, 2, 0, 0, 2, 2, 8, 8, 10, 10, 8, 8, 10, 10,
+  0, 1, 2, 3, 0, 1, 2, 3, 8, 9, 10, 11, 8, 9, 10, 11,
+  0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+  0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13,
+  0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+static const int __builtin_or_table[] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15,
+  2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15,
+  3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15,
+  4, 5, 6, 7, 4, 5, 6, 7, 12, 13, 14, 15, 12, 13, 14, 15,
+  5, 5, 7, 7, 5, 5, 7, 7, 13, 13, 15, 15, 13, 13, 15, 15,
+  6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+  7, 7, 7, 7, 7, 7, 7, 7, 15, 15, 15, 15, 15, 15, 15, 15,
+  8, 9, 10, 11, 12, 13, 14, 15, 8, 9, 10, 11, 12, 13, 14, 15,
+  9, 9, 11, 11, 13, 13, 15, 15, 9, 9, 11, 11, 13, 13, 15, 15,
+  10, 11, 10, 11, 14, 15, 14, 15, 10, 11, 10, 11, 14, 15, 14, 15,
+  11, 11, 11, 11, 15, 15, 15, 15, 11, 11, 11, 11, 15, 15, 15, 15,
+  12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15,
+  13, 13, 15, 15, 13, 13, 15, 15, 13, 13, 15, 15, 13, 13, 15, 15,
+  14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+};
+
+static const int __builtin_xor_table[] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+  2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+  4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8, 9, 10, 11,
+  5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10,
+  6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9,
+  7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+  8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+  9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6,
+  10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5,
+  11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+  12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+  13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+  14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+  15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+};
+
+#define __BUILTIN_NIBBLE_BIT(t, wa, wb)         \
+  do {                                          \
+    if (a >= t) {                               \
+      a -= t;                                   \
+      i += wa;                                  \
+    }                                           \
+    if (b >= t) {                               \
+      b -= t;                                   \
+      i += wb;                                  \
+    }                                           \
+  } while (0)
+
+// Takes both operands a nibble at a time from the top and looks each
+// pair up in table. Nibbles which are zero in both are skipped, so
+// operands below 16 need a single lookup.
+static unsigned int __builtin_nibble_op(unsigned int a, unsigned int b,
+                                        const int* table) {
+  unsigned int m = a > b ? a : b;
+  int n = 0;
+  while (n < 20 && m < __builtin_bits_table[n + 3])
+    n += 4;
+  int r = 0;
+  for (; n < 24; n += 4) {
+    int i = 0;
+    __BUILTIN_NIBBLE_BIT(__builtin_bits_table[n], 128, 8);
+    __BUILTIN_NIBBLE_BIT(__builtin_bits_table[n + 1], 64, 4);
+    __BUILTIN_NIBBLE_BIT(__builtin_bits_table[n + 2], 32, 2);
+    __BUILTIN_NIBBLE_BIT(__builtin_bits_table[n + 3], 16, 1);
+    r += r;
+    r += r;
+    r += r;
+    r += r;
+    r += table[i];
+  }
+  return r;
+}
+
+static unsigned int __builtin_and(unsigned int a, unsigned int b) {
+  if (a == 0 || b == 0)
+    return 0;
+  return __builtin_nibble_op(a, b, __builtin_and_table);
+}
+
+static unsigned int __builtin_or(unsigned int a, unsigned int b) {
+  if (a == 0)
+    return b;
+  if (b == 0)
+    return a;
+  return __builtin_nibble_op(a, b, __builtin_or_table);
+}
+
+static unsigned int __builtin_xor(unsigned int a, unsigned int b) {
+  if (a == 0)
+    return b;
+  if (b == 0)
+    return a;
+  return __builtin_nibble_op(a, b, __builtin_xor_table);
+}
+
+static unsigned int __builtin_not(unsigned int a) {
+  return 0xffffff - a;
+}
+
+// Drops the b bits shifted out of the top, then doubles a b times,
+// four at a time while b allows.
+static unsigned int __builtin_shl(unsigned int a, unsigned int b) {
+  if (b >= 24 || a == 0)
+    return 0;
+  if (b == 0)
+    return a;
+  if (a >= __builtin_bits_table[b - 1]) {
+    for (int i = 0; i < b; i++) {
+      int t = __builtin_bits_table[i];
+      if (a >= t)
+        a -= t;
+    }
+  }
+  for (; b >= 4; b -= 4) {
+    a += a;
+    a += a;
+    a += a;
+    a += a;
+  }
+  for (; b; b--)
+    a += a;
+  return a;
+}
+
+// Collects the bits of a from its top set bit down to 1 << b.
+static unsigned int __builtin_shr(unsigned int a, unsigned int b) {
+  if (b >= 24)
+    return 0;
+  if (b == 0)
+    return a;
+  int e = 23 - b;
+  if (a < __builtin_bits_table[e])
+    return 0;
+  int i = 0;
+  while (a < __builtin_bits_table[i])
+    i++;
+  int r = 0;
+  for (; i <= e; i++) {
+    int t = __builtin_bits_table[i];
+    r += r;
+    if (a >= t) {
+      a -= t;
+      r++;
+    }
+  }
+  return r;
+}
+
+#endif  // ELVM_SMALL_BUILTINS
+
 #endif  // ELVM_LIBC_BUILTIN_H_
@@ -20,49 +20,59 @@ int puts(const char* p) {
   putchar('\n');
 }
 
-int vsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+// Where _vformat writes: into buf, or with putchar if buf is NULL.
+// off counts every character, including those past size.
+typedef struct {
+  char* buf;
+  size_t size;
+  size_t off;
+} _format_sink;
+
+static void _format_put(_format_sink* o, int c) {
+  if (!o->buf)
+    putchar(c);
+  else if (o->off + 1 < o->size)
+    o->buf[o->off] = c;
+  o->off++;
+}
+
+static void _format_str(_format_sink* o, const char* p) {
+  for (; *p; p++)
+    _format_put(o, *p);
+}
+
+// The formatting core of printf and snprintf. Each field goes straight
+// to the sink in one pass.
+static int _vformat(_format_sink* o, const char* fmt, va_list ap) {
   const char* inp;
-  size_t off = 0;
-  int is_overlow = 0;
   for (inp = fmt; *inp; inp++) {
     if (*inp != '%') {
-      if (!is_overlow) {
-        if (off + 1 >= size) {
-          is_overlow = 1;
-          buf[off] = 0;
-        } else {
-          buf[off] = *inp;
-        }
-      }
-      off++;
+      _format_put(o, *inp);
       continue;
     }
 
     char cur_buf[32];
-    char* cur_p;
  retry:
     switch (*++inp) {
       case 'l':
         goto retry;
       case 'd':
       case 'u':
-        cur_p = stringify_int(va_arg(ap, long), cur_buf + sizeof(cur_buf) - 1);
+        _format_str(o, stringify_int(va_arg(ap, long),
+                                     cur_buf + sizeof(cur_buf) - 1));
         break;
       case 'x':
-        cur_p = stringify_hex(va_arg(ap, long), cur_buf + sizeof(cur_buf) - 1);
+        _format_str(o, stringify_hex(va_arg(ap, long),
+                                     cur_buf + sizeof(cur_buf) - 1));
         break;
       case 's':
-        cur_p = va_arg(ap, char*);
+        _format_str(o, va_arg(ap, char*));
         break;
       case 'c':
-        cur_buf[0] = va_arg(ap, char);
-        cur_buf[1] = 0;
-        cur_p = cur_buf;
+        _format_put(o, va_arg(ap, char));
         break;
       case '%':
-        cur_buf[0] = '%';
-        cur_buf[1] = 0;
-        cur_p = cur_buf;
+        _format_put(o, '%');
         break;
       default:
         print_int(*inp);
@@ -71,20 +81,18 @@ int vsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
         print_str(": unknown format!\n");
         exit(1);
     }
-
-    size_t len = strlen(cur_p);
-    if (!is_overlow) {
-      if (off + len >= size) {
-        is_overlow = 1;
-        buf[off] = 0;
-      } else {
-        strcpy(buf + off, cur_p);
-      }
-    }
-    off += len;
   }
-  buf[off] = 0;
-  return off;
+  if (o->buf && o->size)
+    o->buf[o->off < o->size ? o->off : o->size - 1] = 0;
+  return o->off;
+}
+
+int vsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+  _format_sink o;
+  o.buf = buf;
+  o.size = size;
+  o.off = 0;
+  return _vformat(&o, fmt, ap);
 }
 
 int vsprintf(char* buf, const char* fmt, va_list ap) {
@@ -108,11 +116,11 @@ int sprintf(char* buf, const char* fmt, ...) {
 }
 
 int vprintf(const char* fmt, va_list ap) {
-  char buf[256];
-  int r = vsnprintf(buf, 256, fmt, ap);
-  buf[r] = 0;
-  print_str(buf);
-  return r;
+  _format_sink o;
+  o.buf = NULL;
+  o.size = 0;
+  o.off = 0;
+  return _vformat(&o, fmt, ap);
 }
 
 int printf(const char* fmt, ...) {
@@ -131,8 +139,9 @@ FILE* stderr = (FILE*)1;
 int fprintf(FILE* fp, const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vprintf(fmt, ap);
+  int r = vprintf(fmt, ap);
   va_end(ap);
+  return r;
 }
 
 int vfprintf(FILE* fp, const char* fmt, va_list ap) {
@@ -163,6 +172,20 @@ int fputs(const char* s, FILE* fp) {
   print_str(s);
 }
 
+int fputc(int c, FILE* fp) {
+  return putchar(c);
+}
+
+int putc(int c, FILE* fp) {
+  return putchar(c);
+}
+
+// Every character is a PUTC, which backends with costly writes (e.g.,
+// x86) buffer themselves and flush before GETC and EXIT.
+int fflush(FILE* fp) {
+  return 0;
+}
+
 int fgets(char* s, int size, FILE* fp) {
   for (int i = 0; i < size - 1; i++) {
     int c = getchar();
@@ -21,7 +21,7 @@ void abort(void) {
   exit(1);
 }
 
-void* malloc(int n) {
+static int* _malloc_sbrk(int n) {
   int* r = _edata;
   _edata += n;
   if (r > _edata) {
@@ -31,6 +31,13 @@ void* malloc(int n) {
   return r;
 }
 
+#ifndef ELVM_MALLOC_FREE_LIST
+
+// The default allocator only bumps _edata, which keeps the code small.
+void* malloc(int n) {
+  return _malloc_sbrk(n);
+}
+
 int* calloc(int n, int s) {
   return malloc(n * s);
 }
@@ -38,6 +45,187 @@ int* calloc(int n, int s) {
 void free(void* p) {
 }
 
+// Memory is never reused, so copying n words from p can only read the
+// old block and newer allocations.
+void* realloc(void* p, int n) {
+  int* r = malloc(n);
+  if (p) {
+    for (int i = 0; i < n; i++)
+      r[i] = ((int*)p)[i];
+  }
+  return r;
+}
+
+#else
+
+// With ELVM_MALLOC_FREE_LIST defined, freed blocks are reused. A block
+// is a header of two words, its size in words including the header and
+// whether it is free, followed by the payload. A free block keeps the
+// next one of its class in the first payload word. Small blocks are
+// binned by exact size and larger ones by powers of two. Adjacent free
+// blocks are merged by a sweep over the heap when a request can't be
+// served but enough has been freed since the last sweep. Free blocks at
+// the end of the heap are given back to _edata.
+
+#define _MALLOC_HDR 2
+#define _MALLOC_MIN 3
+#define _MALLOC_NUM_SMALL 32
+#define _MALLOC_NUM_CLASSES (_MALLOC_NUM_SMALL + 20)
+
+static int* _malloc_heap;
+static int* _malloc_bins[_MALLOC_NUM_CLASSES];
+static int _malloc_freed;
+
+static int _malloc_class(int size) {
+  if (size < _MALLOC_NUM_SMALL)
+    return size;
+  int c = _MALLOC_NUM_SMALL;
+  for (int s = _MALLOC_NUM_SMALL + _MALLOC_NUM_SMALL;
+       s <= size && c < _MALLOC_NUM_CLASSES - 1; s += s) {
+    c++;
+  }
+  return c;
+}
+
+static void _malloc_push(int* b) {
+  int c = _malloc_class(b[0]);
+  b[1] = 1;
+  b[2] = (int)_malloc_bins[c];
+  _malloc_bins[c] = b;
+}
+
+static void _malloc_unlink(int* b) {
+  int** pp = &_malloc_bins[_malloc_class(b[0])];
+  while (*pp != b)
+    pp = (int**)&(*pp)[2];
+  *pp = (int*)b[2];
+}
+
+// Splits the tail of b off into a free block if it is big enough.
+static void _malloc_split(int* b, int size) {
+  int rest = b[0] - size;
+  if (rest < _MALLOC_MIN)
+    return;
+  int* r = b + size;
+  r[0] = rest;
+  b[0] = size;
+  _malloc_push(r);
+}
+
+static int* _malloc_find(int size) {
+  int c = _malloc_class(size);
+  int* b;
+  if (c >= _MALLOC_NUM_SMALL) {
+    // Blocks of a large class may be smaller than size.
+    for (b = _malloc_bins[c]; b; b = (int*)b[2]) {
+      if (b[0] >= size) {
+        _malloc_unlink(b);
+        return b;
+      }
+    }
+    c++;
+  }
+  for (; c < _MALLOC_NUM_CLASSES; c++) {
+    b = _malloc_bins[c];
+    if (b) {
+      _malloc_bins[c] = (int*)b[2];
+      return b;
+    }
+  }
+  return NULL;
+}
+
+// Merges runs of free blocks and rebuilds the bins from them.
+static void _malloc_sweep(void) {
+  for (int c = 0; c < _MALLOC_NUM_CLASSES; c++)
+    _malloc_bins[c] = NULL;
+  int* b = _malloc_heap;
+  while (b < _edata) {
+    int* e = b + b[0];
+    if (b[1]) {
+      while (e < _edata && e[1])
+        e += e[0];
+      if (e == _edata) {
+        _edata = b;
+        break;
+      }
+      b[0] = e - b;
+      _malloc_push(b);
+    }
+    b = e;
+  }
+  _malloc_freed = 0;
+}
+
+void* malloc(int n) {
+  if (!_malloc_heap)
+    _malloc_heap = _edata;
+  int size = n + _MALLOC_HDR;
+  if (size < _MALLOC_MIN)
+    size = _MALLOC_MIN;
+  int* b = _malloc_find(size);
+  if (!b && _malloc_freed >= size) {
+    _malloc_sweep();
+    b = _malloc_find(size);
+  }
+  if (b) {
+    _malloc_split(b, size);
+  } else {
+    b = _malloc_sbrk(size);
+    b[0] = size;
+  }
+  b[1] = 0;
+  return b + _MALLOC_HDR;
+}
+
+int* calloc(int n, int s) {
+  int* r = malloc(n * s);
+  for (int i = 0; i < n * s; i++)
+    r[i] = 0;
+  return r;
+}
+
+void free(void* p) {
+  if (!p)
+    return;
+  int* b = (int*)p - _MALLOC_HDR;
+  if (b + b[0] == _edata) {
+    _edata = b;
+    return;
+  }
+  _malloc_freed += b[0];
+  _malloc_push(b);
+}
+
+void* realloc(void* p, int n) {
+  if (!p)
+    return malloc(n);
+  int* b = (int*)p - _MALLOC_HDR;
+  int size = n + _MALLOC_HDR;
+  if (size < _MALLOC_MIN)
+    size = _MALLOC_MIN;
+  int* e = b + b[0];
+  // Grows in place at the end of the heap or into a free neighbor.
+  if (e == _edata && size > b[0]) {
+    _malloc_sbrk(size - b[0]);
+    b[0] = size;
+  } else if (e < _edata && e[1] && b[0] + e[0] >= size) {
+    _malloc_unlink(e);
+    b[0] += e[0];
+  }
+  if (b[0] >= size) {
+    _malloc_split(b, size);
+    return p;
+  }
+  int* r = malloc(n);
+  for (int i = 0; i < b[0] - _MALLOC_HDR; i++)
+    r[i] = ((int*)p)[i];
+  free(p);
+  return r;
+}
+
+#endif  // ELVM_MALLOC_FREE_LIST
+
 // From Bionic:
 long
 strtol(const char *nptr, char **endptr, int base)
@@ -142,47 +330,85 @@ char* getenv(const char* name) {
   return NULL;
 }
 
+// compar's sign, with ELVM's unsigned compares: a negative result is a
+// large word.
+#define _QSORT_LT(a, b) (compar(a, b) >= 32768)
+#define _QSORT_GT(a, b) ((compar(a, b) - 1) < 32768)
+// Ranges of fewer elements are insertion sorted.
+#define _QSORT_MIN 8
+
+static void _qsort_swap(char* a, char* b, size_t size) {
+  char t;
+  for (; size >= 4; size -= 4, a += 4, b += 4) {
+    t = a[0]; a[0] = b[0]; b[0] = t;
+    t = a[1]; a[1] = b[1]; b[1] = t;
+    t = a[2]; a[2] = b[2]; b[2] = t;
+    t = a[3]; a[3] = b[3]; b[3] = t;
+  }
+  for (; size; size--, a++, b++) {
+    t = *a; *a = *b; *b = t;
+  }
+}
+
+// Sorts [lo, end). min is _QSORT_MIN elements, in bytes. Only the
+// smaller side of a partition is sorted recursively, so the stack
+// stays O(log n) deep.
+static void _qsort_range(char* lo, char* end, size_t size, size_t min,
+                         int (*compar)(const void*, const void*)) {
+  while ((size_t)(end - lo) >= min) {
+    // The median of the first, middle and last elements goes to lo.
+    char* hi = end - size;
+    char* mid = lo + (size_t)(end - lo) / size / 2 * size;
+    if (_QSORT_LT(mid, lo))
+      _qsort_swap(mid, lo, size);
+    if (_QSORT_LT(hi, mid)) {
+      _qsort_swap(hi, mid, size);
+      if (_QSORT_LT(mid, lo))
+        _qsort_swap(mid, lo, size);
+    }
+    _qsort_swap(lo, mid, size);
+
+    // hi is no less than the pivot, which stops both scans.
+    char* i = lo;
+    char* j = end;
+    for (;;) {
+      do {
+        i += size;
+      } while (_QSORT_LT(i, lo));
+      do {
+        j -= size;
+      } while (_QSORT_GT(j, lo));
+      if (i >= j)
+        break;
+      _qsort_swap(i, j, size);
+    }
+    _qsort_swap(lo, j, size);
+
+    if (j - lo < end - j) {
+      _qsort_range(lo, j, size, min, compar);
+      lo = j + size;
+    } else {
+      _qsort_range(j + size, end, size, min, compar);
+      end = j;
+    }
+  }
+
+  for (char* p = lo + size; p < end; p += size) {
+    for (char* q = p; q > lo && _QSORT_GT(q - size, q); q -= size)
+      _qsort_swap(q - size, q, size);
+  }
+}
+
 void qsort(void* vbase, size_t nmemb, size_t size,
            int (*compar)(const void*, const void*)) {
   if (nmemb <= 1)
     return;
   char* base = (char*)vbase;
-  char* pivot = base + (nmemb / 2) * size;
-  char* left = base;
-  char* right = base + (nmemb - 1) * size;
-#if 0
-  printf("nmemb=%d size=%d\n", nmemb, size);
-  for (int i = 0; i < nmemb; i++) {
-    printf("%d ", *((int*)base + i));
-  }
-  puts("");
-#endif
-  for (;;) {
-    //printf("left=%d right=%d", left-base, right-base);
-    while (compar(left, pivot) >= 32768)
-      left += size;
-    while ((compar(right, pivot) - 1) < 32768)
-      right -= size;
-    //printf(" => left=%d right=%d\n", left-base, right-base);
-    if (left >= right)
-      break;
-    for (size_t i = 0; i < size; i++) {
-      char tmp = left[i];
-      left[i] = right[i];
-      right[i] = tmp;
-    }
-    if (pivot == left)
-      pivot = right;
-    else if (pivot == right)
-      pivot = left;
-    left += size;
-    right -= size;
-  }
-  //left -= size;
-  right += size;
-  qsort(base, (size_t)(left - base) / size, size, compar);
-  qsort(right, (size_t)(base + nmemb * size - right) / size,
-        size, compar);
+  _qsort_range(base, base + nmemb * size, size, _QSORT_MIN * size, compar);
 }
 
+#undef _QSORT_LT
+#undef _QSORT_GT
+#undef _QSORT_MIN
+
 #endif  // ELVM_LIBC_STDLIB_H_
@@ -5,62 +5,122 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+// The loops below are unrolled, so that each pointer increment (an ADD
+// and maybe a mask) and each bounds check covers several words. A
+// frontend which defines __ELVM_MEMOPS__ emits __builtin_memcpy and
+// __builtin_memset as the MEMCPY and MEMSET ops, which many backends
+// run natively.
+
 void* memset(void* d, int c, size_t n) {
-  size_t i;
-  for (i = 0; i < n; i++) {
-    ((char*)d)[i] = c;
+#ifdef __ELVM_MEMOPS__
+  __builtin_memset(d, c, n);
+#else
+  char* p = d;
+  for (; n >= 8; n -= 8, p += 8) {
+    p[0] = c;
+    p[1] = c;
+    p[2] = c;
+    p[3] = c;
+    p[4] = c;
+    p[5] = c;
+    p[6] = c;
+    p[7] = c;
   }
+  for (; n; n--, p++)
+    *p = c;
+#endif
   return d;
 }
 
 void* memcpy(void* d, const void* s, size_t n) {
-  size_t i;
-  for (i = 0; i < n; i++) {
-    ((char*)d)[i] = ((char*)s)[i];
+#ifdef __ELVM_MEMOPS__
+  __builtin_memcpy(d, s, n);
+#else
+  char* p = d;
+  const char* q = s;
+  for (; n >= 8; n -= 8, p += 8, q += 8) {
+    p[0] = q[0];
+    p[1] = q[1];
+    p[2] = q[2];
+    p[3] = q[3];
+    p[4] = q[4];
+    p[5] = q[5];
+    p[6] = q[6];
+    p[7] = q[7];
   }
+  for (; n; n--, p++, q++)
+    *p = *q;
+#endif
   return d;
 }
 
 size_t strlen(const char* s) {
-  size_t r;
-  for (r = 0; s[r]; r++) {}
-  return r;
+  const char* p = s;
+  for (;; p += 4) {
+    if (!p[0])
+      return p - s;
+    if (!p[1])
+      return p - s + 1;
+    if (!p[2])
+      return p - s + 2;
+    if (!p[3])
+      return p - s + 3;
+  }
 }
 
-char* strcat(char* d, const char* s) {
+char* strcpy(char* d, const char* s) {
   char* r = d;
-  for (; *d; d++) {}
-  for (; *s; s++, d++)
-    *d = *s;
-  return r;
+  for (;; d += 4, s += 4) {
+    if (!(d[0] = s[0]))
+      return r;
+    if (!(d[1] = s[1]))
+      return r;
+    if (!(d[2] = s[2]))
+      return r;
+    if (!(d[3] = s[3]))
+      return r;
+  }
 }
 
-char* strcpy(char* d, const char* s) {
-  char* r = d;
-  for (; *s; s++, d++)
-    *d = *s;
-  *d = 0;
-  return r;
+char* strcat(char* d, const char* s) {
+  strcpy(d + strlen(d), s);
+  return d;
 }
 
+#define __STRCMP_STEP(i)                        \
+  if (a[i] != b[i])                             \
+    return a[i] < b[i] ? -1 : 1;                \
+  if (!a[i])                                    \
+    return 0;
+
 int strcmp(const char* a, const char* b) {
-  for (;*a || *b; a++, b++) {
-    if (*a < *b)
-      return -1;
-    if (*a > *b)
-      return 1;
+  for (;; a += 4, b += 4) {
+    __STRCMP_STEP(0)
+    __STRCMP_STEP(1)
+    __STRCMP_STEP(2)
+    __STRCMP_STEP(3)
   }
-  return 0;
 }
 
+#undef __STRCMP_STEP
+
+#define __STRCHR_STEP(i)                        \
+  if (!s[i])                                    \
+    return NULL;                                \
+  if (s[i] == c)                                \
+    return s + i;
+
 char* strchr(char* s, int c) {
-  for (; *s; s++) {
-    if (*s == c)
-      return s;
+  for (;; s += 4) {
+    __STRCHR_STEP(0)
+    __STRCHR_STEP(1)
+    __STRCHR_STEP(2)
+    __STRCHR_STEP(3)
   }
-  return NULL;
 }
 
+#undef __STRCHR_STEP
+
 char* strdup(const char* s) {
   int l = strlen(s);
   char* r = malloc(l + 1);
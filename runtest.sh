@@ -11,6 +11,27 @@ ext=$(echo ${cmd} | sed 's/.*\.//')
 
 ins=$(/bin/ls */${name}*.in 2> /dev/null || true)
 
+# With RUNTEST_CACHE set to a directory (e.g. out/test_cache), results
+# are cached there by the contents of the command's files (the test
+# binary and a runner such as out/eli), the inputs and this script, so
+# a binary regenerated byte for byte isn't run again. The key doesn't
+# cover what a runner script runs in turn (out/bfopt, tinycc/tcc, node
+# and so on), so the cache is off by default: use it only while those
+# stay the same.
+cache=${RUNTEST_CACHE:-}
+if [ -n "${cache}" ]; then
+    key=$( (echo ${cmd}
+            for w in ${cmd} $0; do
+                if [ -f ${w} ]; then echo "== ${w}"; cat ${w}; fi
+            done
+            for i in ${ins}; do echo "== ${i}"; cat ${i}; done) |
+           sha256sum | cut -d' ' -f1)
+    if [ -f ${cache}/${key} ]; then
+        cp ${cache}/${key} ${out}
+        exit 0
+    fi
+fi
+
 if [ -z "${ins}" ]; then
     if [ ${ext} = "sed" ]; then
         echo | ${cmd} > ${tmp}
@@ -34,4 +55,9 @@ else
     done
 fi
 
+if [ -n "${cache}" ]; then
+    mkdir -p ${cache}
+    cp ${tmp} ${cache}/${key}.tmp
+    mv ${cache}/${key}.tmp ${cache}/${key}
+fi
 mv ${tmp} ${out}
@@ -28,7 +28,7 @@ include clear_vars.mk
 SRCS := $(filter-out $(TEST_FILTER),$(OUT.eir.$(TARGET)))
 EXT := out
 DEPS := $(TEST_INS) runtest.sh
-$(eval CMD = ./runtest.sh $$1 $(RUNNER) $$2)
+$(eval CMD = $(RUNTEST) $$1 $(RUNNER) $$2)
 OUT.eir.$(TARGET).out := $(SRCS:%=%.$(EXT))
 include build.mk
 
@@ -58,11 +58,20 @@ include diff.mk
 elc-$(TARGET): $(DIFFS)
 test-$(TARGET)-full: elc-$(TARGET)
 
+bench-$(TARGET): BENCH_RUNNER := $(RUNNER)
+bench-$(TARGET): $(BENCH_EIRS) $(BENCH_INS) $(ELC) $(ELI)
+	tools/bench.py $(@:bench-%=%) '$(BENCH_RUNNER)' out/bench/$(@:bench-%=%).tsv $(BENCH_EIRS)
+
+microbench-$(TARGET): MICROBENCH_RUNNER := $(RUNNER)
+microbench-$(TARGET): $(ELC)
+	mkdir -p out/bench
+	tools/microbench.py $(@:microbench-%=%) '$(MICROBENCH_RUNNER)' out/bench/micro-$(@:microbench-%=%).tsv
+
 else
 
 $(info Skip building $(TARGET) due to lack of $(TOOL))
 
-$(TARGET) elc-$(TARGET):
+$(TARGET) elc-$(TARGET) bench-$(TARGET) microbench-$(TARGET):
 	@echo "*** Skip building $@ ***"
 
 endif  # CAN_BUILD
@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ir/ir.h>
+#include <target/util.h>
+
+// The ELVM registers are W19-W24, which system calls keep. X0-X3 and X8
+// are for system calls and the I/O routines, and X9-X12 are scratch
+// registers of a single instruction.
+static const int A64_REGNO[] = {
+  19,  // A
+  20,  // B
+  21,  // C
+  22,  // D
+  23,  // BP
+  24,  // SP
+};
+
+#define A64_X0 0
+#define A64_X1 1
+#define A64_X2 2
+#define A64_X3 3
+#define A64_X4 4
+#define A64_X8 8
+#define A64_T0 9
+#define A64_T1 10
+#define A64_T2 11
+#define A64_T3 12
+#define A64_MEM 25
+#define A64_RODATA 26
+#define A64_IO 27
+#define A64_LR 30
+#define A64_ZR 31
+
+// UDIV and LSLV/LSRV make every extension op native.
+const int target_aarch64_ext_ops = ALL_EXT_OPS;
+
+typedef enum {
+  A64_EQ = 0, A64_NE = 1, A64_HS = 2, A64_LO = 3,
+  A64_HI = 8, A64_LS = 9, A64_GE = 10, A64_LT = 11, A64_GT = 12, A64_LE = 13
+} A64Cond;
+
+// The conditions of JEQ..JGE and EQ..GE. The opposite one is cond ^ 1.
+static const A64Cond A64_CONDS[] = {
+  A64_EQ, A64_NE, A64_LT, A64_GT, A64_LE, A64_GE
+};
+
+// Set when the code is too large for the +-1MB of B.cond and CBZ, which
+// then skip over a B.
+static bool g_a64_long_jumps;
+
+static int a64_reg(Reg r) {
+  return A64_REGNO[r];
+}
+
+static void a64_emit(uint32_t ins) {
+  emit_le(ins);
+}
+
+static void a64_mov_reg(int rd, int rm) {
+  if (rd != rm)
+    a64_emit(0x2a0003e0 | rm << 16 | rd);  // mov Wd, Wm
+}
+
+// MOVZ and MOVK for the low and high halves.
+static void a64_mov_imm(int rd, uint32_t imm) {
+  a64_emit(0x52800000 | (imm & 0xffff) << 5 | rd);
+  if (imm >> 16)
+    a64_emit(0x72a00000 | (imm >> 16) << 5 | rd);
+}
+
+static void a64_mov(int rd, Value* v) {
+  if (v->type == REG) {
+    a64_mov_reg(rd, a64_reg(v->reg));
+  } else {
+    a64_mov_imm(rd, v->imm);
+  }
+}
+
+// Returns the register which holds v, moving an immediate to tmp.
+static int a64_value_reg(Value* v, int tmp) {
+  if (v->type == REG)
+    return a64_reg(v->reg);
+  a64_mov_imm(tmp, v->imm);
+  return tmp;
+}
+
+// ubfx Wd, Wd, #0, #24
+static void a64_mask(int rd) {
+  a64_emit(0x53005c00 | rd << 5 | rd);
+}
+
+// ADD or SUB of a 24bit immediate as up to two 12bit ones. op is the
+// 32bit "add Wd, Wn, #imm" or "sub" opcode.
+static void a64_addsub_imm(uint32_t op, int rd, int imm) {
+  if (imm & 0xfff || !imm)
+    a64_emit(op | (imm & 0xfff) << 10 | rd << 5 | rd);
+  if (imm >> 12)
+    a64_emit(op | 1 << 22 | (imm >> 12) << 10 | rd << 5 | rd);
+}
+
+static void a64_cmp(Inst* inst) {
+  int rn = a64_reg(inst->dst.reg);
+  if (inst->src.type == IMM && inst->src.imm < 4096) {
+    a64_emit(0x7100001f | inst->src.imm << 10 | rn << 5);
+  } else {
+    int rm = a64_value_reg(&inst->src, A64_T0);
+    a64_emit(0x6b00001f | rm << 16 | rn << 5);
+  }
+}
+
+static void a64_setcc(Inst* inst) {
+  a64_cmp(inst);
+  // cset Wd, cond
+  a64_emit(0x1a9f07e0 | (A64_CONDS[inst->op - EQ] ^ 1) << 12 |
+           a64_reg(inst->dst.reg));
+}
+
+static uint32_t a64_imm19(int addr) {
+  return ((addr - emit_cnt()) / 4 & 0x7ffff) << 5;
+}
+
+static void a64_b(uint32_t op, int addr) {
+  a64_emit(op | ((addr - emit_cnt()) / 4 & 0x3ffffff));
+}
+
+// B.cond or, for long jumps, the opposite B.cond over a B.
+static void a64_bcond(A64Cond cond, int addr) {
+  if (g_a64_long_jumps) {
+    a64_emit(0x54000040 | (cond ^ 1));
+    a64_b(0x14000000, addr);
+  } else {
+    a64_emit(0x54000000 | a64_imm19(addr) | cond);
+  }
+}
+
+// CBZ or CBNZ (op) of a W register.
+static void a64_cbz(uint32_t op, int rt, int addr) {
+  if (g_a64_long_jumps) {
+    a64_emit((op ^ 1 << 24) | 2 << 5 | rt);
+    a64_b(0x14000000, addr);
+  } else {
+    a64_emit(op | a64_imm19(addr) | rt);
+  }
+}
+
+static void a64_jmp_reg(Reg reg) {
+  // ldr W9, [RODATA, Wreg, uxtw #2]; br X9
+  a64_emit(0xb8605800 | a64_reg(reg) << 16 | A64_RODATA << 5 | A64_T0);
+  a64_emit(0xd61f0000 | A64_T0 << 5);
+}
+
+static void a64_jcc(Inst* inst, int* pc2addr) {
+  if (inst->jmp.type == REG) {
+    if (inst->op != JMP) {
+      a64_cmp(inst);
+      // b.<opposite> over the jump
+      a64_emit(0x54000060 | (A64_CONDS[inst->op - JEQ] ^ 1));
+    }
+    a64_jmp_reg(inst->jmp.reg);
+    return;
+  }
+
+  int addr = pc2addr[inst->jmp.imm];
+  if (inst->op == JMP) {
+    a64_b(0x14000000, addr);
+  } else if ((inst->op == JEQ || inst->op == JNE) &&
+             inst->src.type == IMM && !inst->src.imm) {
+    a64_cbz(inst->op == JEQ ? 0x34000000 : 0x35000000,
+            a64_reg(inst->dst.reg), addr);
+  } else {
+    a64_cmp(inst);
+    a64_bcond(A64_CONDS[inst->op - JEQ], addr);
+  }
+}
+
+// LDR or STR of Wt at the word address in src.
+static void a64_mem(bool is_load, int rt, Value* src) {
+  if (src->type == IMM && src->imm < 4096) {
+    // The unsigned offset form, scaled by 4.
+    a64_emit((is_load ? 0xb9400000 : 0xb9000000) | src->imm << 10 |
+             A64_MEM << 5 | rt);
+    return;
+  }
+  // ldr/str Wt, [MEM, Wm, uxtw #2]
+  int rm = a64_value_reg(src, A64_T0);
+  a64_emit((is_load ? 0xb8605800 : 0xb8205800) | rm << 16 |
+           A64_MEM << 5 | rt);
+}
+
+// MUL, DIV, MOD, AND, OR, XOR, SHL and SHR. A DIV by zero gives
+// UINT_MAX, a MOD by zero gives dst and shifts by 24 or more give 0, as
+// in eval_ext_op.
+static void a64_ext_op(Inst* inst) {
+  int rd = a64_reg(inst->dst.reg);
+  if ((inst->op == SHL || inst->op == SHR) && inst->src.type == IMM) {
+    int s = inst->src.imm;
+    if (s >= 24) {
+      a64_mov_imm(rd, 0);
+    } else if (inst->op == SHL) {
+      // ubfiz Wd, Wd, #s, #(24-s)
+      a64_emit(0x53000000 | ((32 - s) & 31) << 16 | (23 - s) << 10 |
+               rd << 5 | rd);
+    } else {
+      // lsr Wd, Wd, #s
+      a64_emit(0x53007c00 | s << 16 | rd << 5 | rd);
+    }
+    return;
+  }
+
+  int rm = a64_value_reg(&inst->src, A64_T0);
+  switch (inst->op) {
+    case MUL:
+      a64_emit(0x1b007c00 | rm << 16 | rd << 5 | rd);
+      if (!inst->unmasked)
+        a64_mask(rd);
+      break;
+
+    case DIV:
+      // udiv W10, Wd, Wm; mov W11, #0xffffff; cmp Wm, #0
+      a64_emit(0x1ac00800 | rm << 16 | rd << 5 | A64_T1);
+      a64_mov_imm(A64_T2, 0xffffff);
+      a64_emit(0x7100001f | rm << 5);
+      // csel Wd, W11, W10, eq
+      a64_emit(0x1a800000 | A64_T1 << 16 | A64_EQ << 12 | A64_T2 << 5 | rd);
+      break;
+
+    case MOD:
+      // udiv W10, Wd, Wm; msub Wd, W10, Wm, Wd. UDIV gives 0 for a
+      // zero divisor, which leaves dst.
+      a64_emit(0x1ac00800 | rm << 16 | rd << 5 | A64_T1);
+      a64_emit(0x1b008000 | rm << 16 | rd << 10 | A64_T1 << 5 | rd);
+      break;
+
+    case AND:
+      a64_emit(0x0a000000 | rm << 16 | rd << 5 | rd);
+      break;
+
+    case OR:
+      a64_emit(0x2a000000 | rm << 16 | rd << 5 | rd);
+      break;
+
+    case XOR:
+      a64_emit(0x4a000000 | rm << 16 | rd << 5 | rd);
+      break;
+
+    case SHL:
+    case SHR:
+      // lslv/lsrv W10, Wd, Wm; cmp Wm, #24; csel Wd, W10, WZR, lo
+      a64_emit((inst->op == SHL ? 0x1ac02000 : 0x1ac02400) |
+               rm << 16 | rd << 5 | A64_T1);
+      a64_emit(0x7100001f | 24 << 10 | rm << 5);
+      a64_emit(0x1a800000 | A64_ZR << 16 | A64_LO << 12 | A64_T1 << 5 | rd);
+      if (inst->op == SHL && !inst->unmasked)
+        a64_mask(rd);
+      break;
+
+    default:
+      error("oops");
+  }
+}
+
+// MEMCPY and MEMSET by word loops on X9 (dst), X10 (src) and W11
+// (count). MEMCPY goes backward when the destination is after the
+// source.
+static void a64_mem_op(Inst* inst) {
+  a64_mov(A64_T0, &inst->dst);
+  a64_mov(A64_T1, &inst->src);
+  a64_mov(A64_T2, &inst->jmp);
+  // add X9, MEM, W9, uxtw #2
+  a64_emit(0x8b204800 | A64_T0 << 16 | A64_MEM << 5 | A64_T0);
+  if (inst->op == MEMSET) {
+    // cbz W11, done; loop: str W10, [X9], #4; subs W11, W11, #1;
+    // b.ne loop
+    a64_emit(0x34000000 | 4 << 5 | A64_T2);
+    a64_emit(0xb8004400 | A64_T0 << 5 | A64_T1);
+    a64_emit(0x71000400 | A64_T2 << 5 | A64_T2);
+    a64_emit(0x54000000 | (-2 & 0x7ffff) << 5 | A64_NE);
+    return;
+  }
+  // add X10, MEM, W10, uxtw #2
+  a64_emit(0x8b204800 | A64_T1 << 16 | A64_MEM << 5 | A64_T1);
+  // cbz W11, done; cmp X9, X10; b.hi backward
+  a64_emit(0x34000000 | 14 << 5 | A64_T2);
+  a64_emit(0xeb00001f | A64_T1 << 16 | A64_T0 << 5);
+  a64_emit(0x54000000 | 6 << 5 | A64_HI);
+  // forward: ldr W12, [X10], #4; str W12, [X9], #4; subs W11, W11, #1;
+  // b.ne forward; b done
+  a64_emit(0xb8404400 | A64_T1 << 5 | A64_T3);
+  a64_emit(0xb8004400 | A64_T0 << 5 | A64_T3);
+  a64_emit(0x71000400 | A64_T2 << 5 | A64_T2);
+  a64_emit(0x54000000 | (-3 & 0x7ffff) << 5 | A64_NE);
+  a64_emit(0x14000007);
+  // backward: add X9, X9, W11, uxtw #2; add X10, X10, W11, uxtw #2
+  a64_emit(0x8b204800 | A64_T2 << 16 | A64_T0 << 5 | A64_T0);
+  a64_emit(0x8b204800 | A64_T2 << 16 | A64_T1 << 5 | A64_T1);
+  // loop: ldr W12, [X10, #-4]!; str W12, [X9, #-4]!; subs W11, W11, #1;
+  // b.ne loop
+  a64_emit(0xb85fcc00 | A64_T1 << 5 | A64_T3);
+  a64_emit(0xb81fcc00 | A64_T0 << 5 | A64_T3);
+  a64_emit(0x71000400 | A64_T2 << 5 | A64_T2);
+  a64_emit(0x54000000 | (-3 & 0x7ffff) << 5 | A64_NE);
+  // done:
+}
+
+// The I/O runtime keeps a 4 KB output and input buffer after the ELVM
+// memory, like the arm one, and IO points at it. The routines are
+// called with BL and use X0-X4 and X8.
+#define A64_IO_BUF_SIZE 4096
+#define A64_OUT_CNT 0
+#define A64_IN_POS 4
+#define A64_IN_CNT 8
+#define A64_OUT_BUF 12
+#define A64_IO_END ((1 << 26) + A64_OUT_BUF + A64_IO_BUF_SIZE * 2)
+
+static int g_a64_flush_addr;
+static int g_a64_putc_addr;
+static int g_a64_getc_addr;
+
+static void a64_io_ldr(int rt, int off) {
+  a64_emit(0xb9400000 | off / 4 << 10 | A64_IO << 5 | rt);
+}
+
+static void a64_io_str(int rt, int off) {
+  a64_emit(0xb9000000 | off / 4 << 10 | A64_IO << 5 | rt);
+}
+
+static void a64_svc(int sysno) {
+  a64_mov_imm(A64_X8, sysno);
+  a64_emit(0xd4000001);
+}
+
+static void a64_ret() {
+  a64_emit(0xd65f03c0);
+}
+
+// Points the B.cond or CBZ at "at", which is op with no offset, to the
+// current address.
+static void a64_patch_imm19(int at, uint32_t op) {
+  int addr = emit_cnt();
+  emit_patch_begin(at);
+  a64_emit(op | a64_imm19(addr));
+  emit_patch_end();
+}
+
+static void a64_emit_flush_func() {
+  g_a64_flush_addr = emit_cnt();
+  a64_io_ldr(A64_X2, A64_OUT_CNT);
+  int done = emit_cnt();
+  a64_emit(0x34000000 | A64_X2);  // cbz W2, done
+  a64_io_str(A64_ZR, A64_OUT_CNT);
+  // add X1, IO, #OUT_BUF
+  a64_emit(0x91000000 | A64_OUT_BUF << 10 | A64_IO << 5 | A64_X1);
+  int loop = emit_cnt();
+  a64_mov_imm(A64_X0, 1);  // stdout
+  a64_svc(64);  // write
+  // cmp X0, #0; b.le done
+  a64_emit(0xf100001f | A64_X0 << 5);
+  int done2 = emit_cnt();
+  a64_emit(0x54000000 | A64_LE);
+  // add X1, X1, X0; subs W2, W2, W0; b.gt loop
+  a64_emit(0x8b000000 | A64_X0 << 16 | A64_X1 << 5 | A64_X1);
+  a64_emit(0x6b000000 | A64_X0 << 16 | A64_X2 << 5 | A64_X2);
+  a64_emit(0x54000000 | a64_imm19(loop) | A64_GT);
+  a64_patch_imm19(done, 0x34000000 | A64_X2);
+  a64_patch_imm19(done2, 0x54000000 | A64_LE);
+  a64_ret();
+}
+
+// Appends W0 to the output buffer.
+static void a64_emit_putc_func() {
+  g_a64_putc_addr = emit_cnt();
+  a64_io_ldr(A64_X2, A64_OUT_CNT);
+  // add X3, IO, #OUT_BUF; strb W0, [X3, X2]
+  a64_emit(0x91000000 | A64_OUT_BUF << 10 | A64_IO << 5 | A64_X3);
+  a64_emit(0x38206800 | A64_X2 << 16 | A64_X3 << 5 | A64_X0);
+  // add W2, W2, #1
+  a64_emit(0x11000400 | A64_X2 << 5 | A64_X2);
+  a64_io_str(A64_X2, A64_OUT_CNT);
+  // cmp W2, #IO_BUF_SIZE; b.eq flush; ret
+  a64_mov_imm(A64_X3, A64_IO_BUF_SIZE);
+  a64_emit(0x6b00001f | A64_X3 << 16 | A64_X2 << 5);
+  a64_emit(0x54000000 | a64_imm19(g_a64_flush_addr) | A64_EQ);
+  a64_ret();
+}
+
+// Returns the next input byte, or 0 at EOF, in W0.
+static void a64_emit_getc_func() {
+  g_a64_getc_addr = emit_cnt();
+  a64_io_ldr(A64_X2, A64_IN_POS);
+  a64_io_ldr(A64_X3, A64_IN_CNT);
+  // cmp W2, W3; b.lo have
+  a64_emit(0x6b00001f | A64_X3 << 16 | A64_X2 << 5);
+  int have = emit_cnt();
+  a64_emit(0x54000000 | A64_LO);
+  // mov X4, LR; bl flush; mov LR, X4
+  a64_emit(0xaa0003e0 | A64_LR << 16 | A64_X4);
+  a64_b(0x94000000, g_a64_flush_addr);
+  a64_emit(0xaa0003e0 | A64_X4 << 16 | A64_LR);
+  a64_mov_imm(A64_X0, 0);  // stdin
+  // add X1, IO, #OUT_BUF; add X1, X1, #IO_BUF_SIZE
+  a64_emit(0x91000000 | A64_OUT_BUF << 10 | A64_IO << 5 | A64_X1);
+  a64_emit(0x91400400 | A64_X1 << 5 | A64_X1);
+  a64_mov_imm(A64_X2, A64_IO_BUF_SIZE);
+  a64_svc(63);  // read
+  a64_io_str(A64_ZR, A64_IN_POS);
+  a64_mov_imm(A64_X2, 0);
+  // cmp X0, #0; csel W0, W0, WZR, gt; str W0, [IO, #IN_CNT]
+  a64_emit(0xf100001f | A64_X0 << 5);
+  a64_emit(0x1a800000 | A64_ZR << 16 | A64_GT << 12 | A64_X0 << 5 | A64_X0);
+  a64_io_str(A64_X0, A64_IN_CNT);
+  // b.gt have; ret (W0 is 0 at EOF)
+  int have2 = emit_cnt();
+  a64_emit(0x54000000 | A64_GT);
+  a64_ret();
+  a64_patch_imm19(have, 0x54000000 | A64_LO);
+  a64_patch_imm19(have2, 0x54000000 | A64_GT);
+  // add X3, IO, #OUT_BUF; add X3, X3, #IO_BUF_SIZE; ldrb W0, [X3, X2]
+  a64_emit(0x91000000 | A64_OUT_BUF << 10 | A64_IO << 5 | A64_X3);
+  a64_emit(0x91400400 | A64_X3 << 5 | A64_X3);
+  a64_emit(0x38606800 | A64_X2 << 16 | A64_X3 << 5 | A64_X0);
+  // add W2, W2, #1; str W2, [IO, #IN_POS]; ret
+  a64_emit(0x11000400 | A64_X2 << 5 | A64_X2);
+  a64_io_str(A64_X2, A64_IN_POS);
+  a64_ret();
+}
+
+static void a64_emit_io_funcs() {
+  int over = emit_cnt();
+  a64_emit(0);
+  a64_emit_flush_func();
+  a64_emit_putc_func();
+  a64_emit_getc_func();
+  int end = emit_cnt();
+  emit_patch_begin(over);
+  a64_b(0x14000000, end);
+  emit_patch_end();
+}
+
+// MOVZ and MOVK of an address, which is always two instructions so it
+// can be patched.
+static void a64_mov_addr(int rd, uint32_t addr) {
+  a64_emit(0x52800000 | (addr & 0xffff) << 5 | rd);
+  a64_emit(0x72a00000 | (addr >> 16) << 5 | rd);
+}
+
+// The offsets of the jump table and of the initial memory image, which
+// follow the code, and of the instructions which load their addresses.
+static int g_a64_table;
+static int g_a64_image;
+static int g_a64_table_load;
+static int g_a64_image_load;
+
+static int a64_image_size(Data* data) {
+  int n = 0;
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v)
+      n = mp + 1;
+  }
+  return n;
+}
+
+static int a64_addr(int offset) {
+  return ELF_TEXT_START + ELF64_HEADER_SIZE + offset;
+}
+
+static void a64_init_state(Data* data) {
+  a64_mov_imm(A64_X0, 0);
+  a64_mov_imm(A64_X1, A64_IO_END);
+  a64_mov_imm(A64_X2, 3);  // PROT_READ | PROT_WRITE
+  a64_mov_imm(A64_X3, 0x22);  // MAP_PRIVATE | MAP_ANONYMOUS
+  a64_emit(0x92800000 | A64_X4);  // mov X4, #-1
+  a64_mov_imm(5, 0);
+  a64_svc(222);  // mmap
+  // mov MEM, X0; mov W9, #1<<26; add IO, MEM, X9
+  a64_emit(0xaa0003e0 | A64_X0 << 16 | A64_MEM);
+  a64_mov_imm(A64_T0, 1 << 26);
+  a64_emit(0x8b000000 | A64_T0 << 16 | A64_MEM << 5 | A64_IO);
+
+  g_a64_table_load = emit_cnt();
+  a64_mov_addr(A64_RODATA, a64_addr(g_a64_table));
+
+  // Copies the initial memory from the image after the code.
+  int n = a64_image_size(data);
+  if (n) {
+    g_a64_image_load = emit_cnt();
+    a64_mov_addr(A64_T1, a64_addr(g_a64_image));
+    // mov X9, MEM; mov W11, #n
+    a64_emit(0xaa0003e0 | A64_MEM << 16 | A64_T0);
+    a64_mov_imm(A64_T2, n);
+    // loop: ldr W12, [X10], #4; str W12, [X9], #4; subs W11, W11, #1;
+    // b.ne loop
+    a64_emit(0xb8404400 | A64_T1 << 5 | A64_T3);
+    a64_emit(0xb8004400 | A64_T0 << 5 | A64_T3);
+    a64_emit(0x71000400 | A64_T2 << 5 | A64_T2);
+    a64_emit(0x54000000 | (-3 & 0x7ffff) << 5 | A64_NE);
+  }
+
+  for (int i = 0; i < 6; i++)
+    a64_mov_imm(A64_REGNO[i], 0);
+  a64_emit_io_funcs();
+}
+
+static void a64_emit_inst(Inst* inst, int* pc2addr) {
+  int rd = a64_reg(inst->dst.reg);
+  switch (inst->op) {
+    case MOV:
+      a64_mov(rd, &inst->src);
+      break;
+
+    case ADD:
+    case SUB:
+      if (inst->src.type == REG) {
+        a64_emit((inst->op == ADD ? 0x0b000000 : 0x4b000000) |
+                 a64_reg(inst->src.reg) << 16 | rd << 5 | rd);
+      } else {
+        a64_addsub_imm(inst->op == ADD ? 0x11000000 : 0x51000000,
+                       rd, inst->src.imm);
+      }
+      if (!inst->unmasked)
+        a64_mask(rd);
+      break;
+
+    case LOAD:
+    case STORE:
+      a64_mem(inst->op == LOAD, rd, &inst->src);
+      break;
+
+    case PUTC:
+      a64_mov(A64_X0, &inst->src);
+      a64_b(0x94000000, g_a64_putc_addr);  // bl putc
+      break;
+
+    case GETC:
+      a64_b(0x94000000, g_a64_getc_addr);  // bl getc
+      a64_mov_reg(rd, A64_X0);
+      break;
+
+    case EXIT:
+      a64_b(0x94000000, g_a64_flush_addr);  // bl flush
+      a64_mov_imm(A64_X0, 0);
+      a64_svc(93);  // exit
+      break;
+
+    case DUMP:
+      break;
+
+    case EQ:
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+      a64_setcc(inst);
+      break;
+
+    case MUL:
+    case DIV:
+    case MOD:
+    case AND:
+    case OR:
+    case XOR:
+    case SHL:
+    case SHR:
+      a64_ext_op(inst);
+      break;
+
+    case MEMCPY:
+    case MEMSET:
+      a64_mem_op(inst);
+      break;
+
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGT:
+    case JLE:
+    case JGE:
+    case JMP:
+      a64_jcc(inst, pc2addr);
+      break;
+
+    default:
+      error("oops");
+  }
+}
+
+// Emits the whole text and returns the number of jumps, whose offsets
+// and instructions are kept to emit them again.
+static int a64_emit_text(Module* module, int* pc2addr, Inst** jmps,
+                         int* jmp_addrs) {
+  emit_reset();
+  emit_start_code();
+  a64_init_state(module->data);
+  int num_jmps = 0;
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      pc2addr[inst->pc] = emit_cnt();
+    }
+    prev_pc = inst->pc;
+    if (inst->op >= JEQ && inst->op <= JMP) {
+      jmps[num_jmps] = inst;
+      jmp_addrs[num_jmps++] = emit_cnt();
+    }
+    a64_emit_inst(inst, pc2addr);
+  }
+  return num_jmps;
+}
+
+void target_aarch64(Module* module) {
+  int pc_cnt = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    pc_cnt++;
+  }
+
+  // As in arm, jumps refer to later pcs, so they are emitted again in
+  // place once the layout is known. Code over 1MB is emitted again
+  // from the start with long conditional jumps.
+  int* pc2addr = calloc(pc_cnt, sizeof(int));
+  Inst** jmps = calloc(pc_cnt, sizeof(Inst*));
+  int* jmp_addrs = calloc(pc_cnt, sizeof(int));
+  g_a64_long_jumps = false;
+  g_a64_table = g_a64_image = 0;
+  int num_jmps = a64_emit_text(module, pc2addr, jmps, jmp_addrs);
+  if (emit_cnt() >= 1 << 20) {
+    g_a64_long_jumps = true;
+    num_jmps = a64_emit_text(module, pc2addr, jmps, jmp_addrs);
+  }
+
+  g_a64_table = emit_cnt();
+  g_a64_image = g_a64_table + pc_cnt * 4;
+  set_elf_symbols(module, pc2addr, ELF64_HEADER_SIZE, g_a64_table);
+
+  emit_patch_begin(g_a64_table_load);
+  a64_mov_addr(A64_RODATA, a64_addr(g_a64_table));
+  emit_patch_end();
+  int n = a64_image_size(module->data);
+  if (n) {
+    emit_patch_begin(g_a64_image_load);
+    a64_mov_addr(A64_T1, a64_addr(g_a64_image));
+    emit_patch_end();
+  }
+  for (int i = 0; i < num_jmps; i++) {
+    emit_patch_begin(jmp_addrs[i]);
+    a64_emit_inst(jmps[i], pc2addr);
+    emit_patch_end();
+  }
+
+  for (int i = 0; i < pc_cnt; i++) {
+    emit_le(a64_addr(pc2addr[i]));
+  }
+  Data* data = module->data;
+  for (int mp = 0; mp < n; data = data->next, mp++)
+    emit_le(data->v);
+
+  emit_elf64_header(183, emit_cnt());
+  emit_flush();
+  emit_elf_sections();
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <ir/cfg.h>
 #include <ir/ir.h>
 #include <target/util.h>
 
@@ -39,23 +40,40 @@ static int ARMREG[] = {
 
 void emit_elf_header(uint16_t machine, uint32_t filesz);
 
+// The condition of the instructions emit_4le emits, which makes a short
+// block skipped by a conditional jump run predicated instead (see
+// arm_can_predicate). 0xe is "always".
+static int g_arm_cond = 0xe;
+
 static void emit_4le(int a, int b, int c, int d) {
+  if ((a >> 4) == 0xe)
+    a = g_arm_cond << 4 | (a & 15);
   emit_1(d);
   emit_1(c);
   emit_1(b);
   emit_1(a);
 }
 
+static void emit_arm_word(uint32_t w) {
+  emit_4le(w >> 24, (w >> 16) & 255, (w >> 8) & 255, w & 255);
+}
+
 static void emit_svc() {
   emit_4le(0xef, 0x00, 0x00, 0x00);
 }
 
 typedef enum {
   ARM_AND = 0x00,
+  ARM_EOR = 0x20,
   ARM_SUB = 0x40,
   ARM_ADD = 0x80,
 } ArmOp;
 
+// The arithmetic extension ops emitted natively. ARMv6 has no divide,
+// and shifts by a register only look at its low byte.
+const int target_arm_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(AND) | EXT_OP_BIT(OR) | EXT_OP_BIT(XOR);
+
 static void emit_reg2op(ArmOp op, Reg dst, Reg src) {
   emit_4le(0xe0, op + ARMREG[dst], ARMREG[dst] * 16, ARMREG[src]);
 }
@@ -67,6 +85,15 @@ typedef enum {
   Shl8 = 12
 } ImmRot;
 
+static void emit_arm_orr_reg(Reg dst, Reg src) {
+  emit_4le(0xe1, 0x80 + ARMREG[dst], ARMREG[dst] * 16, ARMREG[src]);
+}
+
+// MUL dst, rm, rs. Before ARMv6, dst and rm must differ.
+static void emit_arm_mul(Reg dst, Reg rm, Reg rs) {
+  emit_4le(0xe0, ARMREG[dst], ARMREG[rs], 0x90 + ARMREG[rm]);
+}
+
 static void emit_arm_mov_reg(Reg dst, Reg src) {
   emit_4le(0xe1, 0xa0, ARMREG[dst] * 16, ARMREG[src]);
 }
@@ -83,49 +110,140 @@ static void emit_arm_add_imm8(Reg dst, int imm8, ImmRot rot) {
   emit_4le(0xe2, ARM_ADD + ARMREG[dst], ARMREG[dst] * 16 + rot, imm8);
 }
 
-static void emit_arm_sub_imm8(Reg dst, int imm8, ImmRot rot) {
-  emit_4le(0xe2, ARM_SUB + ARMREG[dst], ARMREG[dst] * 16 + rot, imm8);
+// The operand2 of v, its imm8 and rotation, or -1 if v isn't an imm8
+// rotated right by an even amount.
+static int arm_encode_imm(uint32_t v) {
+  for (int rot = 0; rot < 16; rot++) {
+    uint32_t x = rot ? v << (2 * rot) | v >> (32 - 2 * rot) : v;
+    if (x < 256)
+      return rot << 8 | x;
+  }
+  return -1;
 }
 
-static void emit_arm_mov_imm(Reg dst, int imm) {
-  emit_arm_mov_imm8(dst, imm % 256, Shl0);
-  imm /= 256;
-  if (!imm)
-    return;
-  emit_arm_add_imm8(dst, imm % 256, Shl8);
-  imm /= 256;
-  if (!imm)
-    return;
-  emit_arm_add_imm8(dst, imm % 256, Shl16);
+// A data processing op (by its 4-bit opcode) of rn and an encoded
+// immediate into rd.
+static void emit_arm_dp_imm(int opcode, Reg rd, Reg rn, int enc) {
+  int s = opcode >= 8 && opcode <= 11;
+  emit_arm_word(0xe2000000 | opcode << 21 | s << 20 | ARMREG[rn] << 16 |
+                ARMREG[rd] << 12 | enc);
 }
 
-static void emit_arm_add_imm(Reg dst, int imm) {
-  if (imm > 0xffff00) {
-    emit_arm_sub_imm8(dst, 0x1000000 - imm, Shl0);
-    return;
+#define ARM_DP_AND 0
+#define ARM_DP_EOR 1
+#define ARM_DP_SUB 2
+#define ARM_DP_ADD 4
+#define ARM_DP_CMP 10
+#define ARM_DP_ORR 12
+#define ARM_DP_MOV 13
+#define ARM_DP_MVN 15
+
+// Immediates which aren't an operand2 are loaded from a literal pool
+// with a PC-relative ldr. A pool is emitted after the next unconditional
+// jump (see arm_flush_pool), or in a branch over it before its first
+// load would be out of the 4 KB reach of ldr.
+#define ARM_POOL_SIZE 256
+#define ARM_POOL_REACH 3584
+
+static uint32_t g_pool_vals[ARM_POOL_SIZE];
+static int g_pool_len;
+// The ldrs to patch, by their address, entry and destination.
+static int g_pool_ldrs[ARM_POOL_SIZE * 4];
+static int g_pool_ldr_vals[ARM_POOL_SIZE * 4];
+static int g_pool_ldr_regs[ARM_POOL_SIZE * 4];
+static int g_pool_num_ldrs;
+
+// Emits the pool here, which control must not reach, and patches the
+// loads from it.
+static void arm_flush_pool(void) {
+  int base = emit_cnt();
+  for (int i = 0; i < g_pool_len; i++)
+    emit_le(g_pool_vals[i]);
+  for (int i = 0; i < g_pool_num_ldrs; i++) {
+    int at = g_pool_ldrs[i];
+    int off = base + g_pool_ldr_vals[i] * 4 - (at + 8);
+    emit_patch_begin(at);
+    emit_1(off & 255);
+    emit_1(g_pool_ldr_regs[i] * 16 | off >> 8);
+    emit_patch_end();
   }
+  g_pool_len = 0;
+  g_pool_num_ldrs = 0;
+}
 
-  emit_arm_add_imm8(dst, imm % 256, Shl0);
-  imm /= 256;
-  if (!imm)
-    return;
-  emit_arm_add_imm8(dst, imm % 256, Shl8);
-  imm /= 256;
-  if (!imm)
+// B or BL with the condition and opcode in the top byte.
+static void emit_arm_branch(int op, int addr) {
+  uint32_t v = addr / 4 - (emit_cnt() + 8) / 4;
+  emit_1(v % 256);
+  v /= 256;
+  emit_1(v % 256);
+  v /= 256;
+  emit_1(v % 256);
+  emit_1(op);
+}
+
+// Points the branch at "at" to the current address.
+static void patch_arm_branch(int at, int op) {
+  int addr = emit_cnt();
+  emit_patch_begin(at);
+  emit_arm_branch(op, addr);
+  emit_patch_end();
+}
+
+// Emits the pool in a branch over it when its first load is about to be
+// out of reach, or it is full.
+static void arm_check_pool(void) {
+  if (!g_pool_num_ldrs ||
+      (emit_cnt() + g_pool_len * 4 < g_pool_ldrs[0] + ARM_POOL_REACH &&
+       g_pool_len < ARM_POOL_SIZE - 8 &&
+       g_pool_num_ldrs < ARM_POOL_SIZE * 4 - 8))
     return;
-  emit_arm_add_imm8(dst, imm, Shl16);
+  int over = emit_cnt();
+  emit_arm_branch(0xea, 0);
+  arm_flush_pool();
+  patch_arm_branch(over, 0xea);
+}
+
+// ldr dst, [PC, #offset] of v in the pool.
+static void emit_arm_ldr_literal(Reg dst, uint32_t v) {
+  int i = 0;
+  while (i < g_pool_len && g_pool_vals[i] != v)
+    i++;
+  if (i == g_pool_len)
+    g_pool_vals[g_pool_len++] = v;
+  g_pool_ldrs[g_pool_num_ldrs] = emit_cnt();
+  g_pool_ldr_vals[g_pool_num_ldrs] = i;
+  g_pool_ldr_regs[g_pool_num_ldrs++] = ARMREG[dst];
+  emit_4le(0xe5, 0x9f, ARMREG[dst] * 16, 0);
 }
 
-static void emit_arm_sub_imm(Reg dst, int imm) {
-  emit_arm_sub_imm8(dst, imm % 256, Shl0);
-  imm /= 256;
-  if (!imm)
+static void emit_arm_mov_imm(Reg dst, int imm) {
+  int enc = arm_encode_imm(imm);
+  if (enc >= 0) {
+    emit_arm_dp_imm(ARM_DP_MOV, dst, R0, enc);
+  } else if ((enc = arm_encode_imm(~imm)) >= 0) {
+    emit_arm_dp_imm(ARM_DP_MVN, dst, R0, enc);
+  } else {
+    emit_arm_ldr_literal(dst, imm);
+  }
+}
+
+// Adds (or subtracts, for ARM_DP_SUB) imm to dst, through R0 when it
+// isn't an operand2. When the result is masked, subtracting 2^24 - imm
+// is the same.
+static void emit_arm_add_imm(int opcode, Reg dst, int imm, bool masked) {
+  int enc = arm_encode_imm(imm);
+  if (enc >= 0) {
+    emit_arm_dp_imm(opcode, dst, dst, enc);
     return;
-  emit_arm_sub_imm8(dst, imm % 256, Shl8);
-  imm /= 256;
-  if (!imm)
+  }
+  int other = opcode == ARM_DP_ADD ? ARM_DP_SUB : ARM_DP_ADD;
+  if (masked && (enc = arm_encode_imm(0x1000000 - imm)) >= 0) {
+    emit_arm_dp_imm(other, dst, dst, enc);
     return;
-  emit_arm_sub_imm8(dst, imm, Shl16);
+  }
+  emit_arm_mov_imm(R0, imm);
+  emit_reg2op(opcode == ARM_DP_ADD ? ARM_ADD : ARM_SUB, dst, R0);
 }
 
 typedef enum {
@@ -142,6 +260,11 @@ static void emit_arm_cmp(Inst* inst) {
   if (inst->src.type == REG) {
     reg = inst->src.reg;
   } else {
+    int enc = arm_encode_imm(inst->src.imm);
+    if (enc >= 0) {
+      emit_arm_dp_imm(ARM_DP_CMP, R0, inst->dst.reg, enc);
+      return;
+    }
     reg = R0;
     emit_arm_mov_imm(reg, inst->src.imm);
   }
@@ -160,21 +283,130 @@ static void emit_arm_jcc(Inst* inst, int op, int* pc2addr) {
   }
 
   if (inst->jmp.type == REG) {
-    emit_arm_mem(MEM_LOAD, ARM_PC, RODATA, inst->jmp.reg);
+    // ldr<cc> PC, [RODATA, reg, lsl #2]
+    emit_4le((op & 0xf0) | 0x07, MEM_LOAD + ARMREG[RODATA],
+             ARMREG[ARM_PC] * 16 + 1, ARMREG[inst->jmp.reg]);
   } else {
-    uint32_t v = pc2addr[inst->jmp.imm] / 4 - (emit_cnt() + 8) / 4;
-    emit_1(v % 256);
-    v /= 256;
-    emit_1(v % 256);
-    v /= 256;
-    emit_1(v % 256);
-    emit_1(op);
+    emit_arm_branch(op, pc2addr[inst->jmp.imm]);
   }
 }
 
-static void init_state_arm(Data* data, int rodata_addr) {
+static void emit_arm_load_rodata(int rodata_addr) {
+  emit_arm_mov_imm8(RODATA, rodata_addr % 256, Shl0);
+  rodata_addr /= 256;
+  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl8);
+  rodata_addr /= 256;
+  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl16);
+}
+
+// The I/O runtime keeps a 4 KB output and input buffer after the ELVM
+// memory, like the x86 one. The routines are called with BL and use R0
+// to R3. R7 holds D, so it is saved around system calls.
+#define IO_BUF_SIZE 4096
+#define OUT_CNT 0
+#define IN_POS 4
+#define IN_CNT 8
+#define OUT_BUF 12
+
+static int g_flush_addr;
+static int g_putc_addr;
+static int g_getc_addr;
+
+
+static void emit_arm_svc_keep_r7(int sysno) {
+  emit_4le(0xe5, 0x2d, 0x70, 0x04);  // push R7
+  emit_arm_mov_imm8(R7, sysno, Shl0);
+  emit_svc();
+  emit_4le(0xe4, 0x9d, 0x70, 0x04);  // pop R7
+}
+
+static void emit_arm_io_base(Reg r) {
+  // add r, ARM_MEM, #1<<26
+  emit_4le(0xe2, 0x8a, ARMREG[r] * 16 + 4, 0x04);
+}
+
+static void emit_arm_flush_func() {
+  g_flush_addr = emit_cnt();
+  emit_arm_io_base(R1);
+  emit_4le(0xe5, 0x91, 0x20, OUT_CNT);  // ldr R2, [R1, #OUT_CNT]
+  emit_4le(0xe3, 0x52, 0x00, 0x00);  // cmp R2, #0
+  emit_4le(0x01, 0xa0, 0xf0, 0x0e);  // moveq PC, LR
+  emit_arm_mov_imm8(R3, 0, Shl0);
+  emit_4le(0xe5, 0x81, 0x30, OUT_CNT);  // str R3, [R1, #OUT_CNT]
+  emit_4le(0xe2, 0x81, 0x10, OUT_BUF);  // add R1, R1, #OUT_BUF
+  int loop = emit_cnt();
+  emit_arm_mov_imm8(R0, 1, Shl0);  // stdout
+  emit_arm_svc_keep_r7(4);  // write
+  emit_4le(0xe3, 0x50, 0x00, 0x00);  // cmp R0, #0
+  emit_4le(0xd1, 0xa0, 0xf0, 0x0e);  // movle PC, LR
+  emit_4le(0xe0, 0x81, 0x10, 0x00);  // add R1, R1, R0
+  emit_4le(0xe0, 0x52, 0x20, 0x00);  // subs R2, R2, R0
+  emit_arm_branch(0xca, loop);  // bgt loop
+  emit_4le(0xe1, 0xa0, 0xf0, 0x0e);  // mov PC, LR
+}
+
+// Appends R0 to the output buffer.
+static void emit_arm_putc_func() {
+  g_putc_addr = emit_cnt();
+  emit_arm_io_base(R1);
+  emit_4le(0xe5, 0x91, 0x20, OUT_CNT);  // ldr R2, [R1, #OUT_CNT]
+  emit_4le(0xe2, 0x81, 0x30, OUT_BUF);  // add R3, R1, #OUT_BUF
+  emit_4le(0xe7, 0xc3, 0x00, 0x02);  // strb R0, [R3, R2]
+  emit_4le(0xe2, 0x82, 0x20, 0x01);  // add R2, R2, #1
+  emit_4le(0xe5, 0x81, 0x20, OUT_CNT);  // str R2, [R1, #OUT_CNT]
+  emit_4le(0xe3, 0x52, 0x0a, 0x01);  // cmp R2, #IO_BUF_SIZE
+  emit_4le(0x11, 0xa0, 0xf0, 0x0e);  // movne PC, LR
+  emit_arm_branch(0xea, g_flush_addr);  // b flush
+}
+
+// Returns the next input byte, or 0 at EOF, in R0.
+static void emit_arm_getc_func() {
+  g_getc_addr = emit_cnt();
+  emit_arm_io_base(R1);
+  emit_4le(0xe5, 0x91, 0x20, IN_POS);  // ldr R2, [R1, #IN_POS]
+  emit_4le(0xe5, 0x91, 0x30, IN_CNT);  // ldr R3, [R1, #IN_CNT]
+  emit_4le(0xe1, 0x52, 0x00, 0x03);  // cmp R2, R3
+  int have = emit_cnt();
+  emit_arm_branch(0x3a, 0);  // blo have
+  emit_4le(0xe5, 0x2d, 0xe0, 0x04);  // push LR
+  emit_arm_branch(0xeb, g_flush_addr);  // bl flush
+  emit_4le(0xe4, 0x9d, 0xe0, 0x04);  // pop LR
+  emit_arm_io_base(R1);
+  emit_4le(0xe2, 0x81, 0x10, OUT_BUF);  // add R1, R1, #OUT_BUF
+  emit_4le(0xe2, 0x81, 0x1a, 0x01);  // add R1, R1, #IO_BUF_SIZE
+  emit_arm_mov_imm8(R0, 0, Shl0);  // stdin
+  emit_4le(0xe3, 0xa0, 0x2a, 0x01);  // mov R2, #IO_BUF_SIZE
+  emit_arm_svc_keep_r7(3);  // read
+  emit_arm_io_base(R1);
+  emit_arm_mov_imm8(R2, 0, Shl0);
+  emit_4le(0xe5, 0x81, 0x20, IN_POS);  // str R2, [R1, #IN_POS]
+  emit_4le(0xe3, 0x50, 0x00, 0x00);  // cmp R0, #0
+  emit_4le(0xd3, 0xa0, 0x00, 0x00);  // movle R0, #0
+  emit_4le(0xe5, 0x81, 0x00, IN_CNT);  // str R0, [R1, #IN_CNT]
+  emit_4le(0xd1, 0xa0, 0xf0, 0x0e);  // movle PC, LR
+  patch_arm_branch(have, 0x3a);
+  emit_4le(0xe2, 0x81, 0x30, OUT_BUF);  // add R3, R1, #OUT_BUF
+  emit_4le(0xe2, 0x83, 0x3a, 0x01);  // add R3, R3, #IO_BUF_SIZE
+  emit_4le(0xe7, 0xd3, 0x00, 0x02);  // ldrb R0, [R3, R2]
+  emit_4le(0xe2, 0x82, 0x20, 0x01);  // add R2, R2, #1
+  emit_4le(0xe5, 0x81, 0x20, IN_POS);  // str R2, [R1, #IN_POS]
+  emit_4le(0xe1, 0xa0, 0xf0, 0x0e);  // mov PC, LR
+}
+
+static void emit_arm_io_funcs() {
+  int over = emit_cnt();
+  emit_arm_branch(0xea, 0);
+  emit_arm_flush_func();
+  emit_arm_putc_func();
+  emit_arm_getc_func();
+  patch_arm_branch(over, 0xea);
+}
+
+// Returns the offset of the RODATA load, which is patched later.
+static int init_state_arm(Data* data) {
   emit_arm_mov_imm8(R0, 0, Shl0);
   emit_arm_mov_imm8(R1, 4, Shl24);
+  emit_arm_add_imm8(R1, 0x40, Shl8);  // the I/O buffers
   emit_arm_mov_imm8(R2, 3, Shl0);  // PROT_READ | PROT_WRITE
   emit_arm_mov_imm8(R3, 0x22, Shl0);  // MAP_PRIVATE | MAP_ANONYMOUS
   emit_arm_mvn_imm8(R4, 0, Shl0);  // 0xffffffff
@@ -190,19 +422,18 @@ static void init_state_arm(Data* data, int rodata_addr) {
       continue;
     int d = (mp - prev) * 4;
     if (d >= 4096) {
-      emit_arm_add_imm(R0, d);
+      emit_arm_mov_imm(R1, d);
+      emit_reg2op(ARM_ADD, R0, R1);
       d = 0;
     }
+    arm_check_pool();
     emit_arm_mov_imm(R1, data->v);
     emit_4le(0xe5, 0xa0, 0x10 + d / 256, d % 256);
     prev = mp;
   }
 
-  emit_arm_mov_imm8(RODATA, rodata_addr % 256, Shl0);
-  rodata_addr /= 256;
-  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl8);
-  rodata_addr /= 256;
-  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl16);
+  int rodata_load = emit_cnt();
+  emit_arm_load_rodata(0);
   emit_arm_mvn_imm8(FFFFFF, 0xff, Shl24);
 
   emit_arm_mov_imm8(A, 0, Shl0);
@@ -211,6 +442,8 @@ static void init_state_arm(Data* data, int rodata_addr) {
   emit_arm_mov_imm8(D, 0, Shl0);
   emit_arm_mov_imm8(BP, 0, Shl0);
   emit_arm_mov_imm8(SP, 0, Shl0);
+  emit_arm_io_funcs();
+  return rodata_load;
 }
 
 static void arm_emit_inst(Inst* inst, int* pc2addr) {
@@ -229,24 +462,35 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
     if (inst->src.type == REG) {
       emit_reg2op(ARM_ADD, inst->dst.reg, inst->src.reg);
     } else {
-      emit_arm_add_imm(inst->dst.reg, inst->src.imm);
+      emit_arm_add_imm(ARM_DP_ADD, inst->dst.reg, inst->src.imm,
+                       !inst->unmasked);
     }
-    emit_reg2op(ARM_AND, inst->dst.reg, FFFFFF);
+    if (!inst->unmasked)
+      emit_reg2op(ARM_AND, inst->dst.reg, FFFFFF);
     break;
 
   case SUB:
     if (inst->src.type == REG) {
       emit_reg2op(ARM_SUB, inst->dst.reg, inst->src.reg);
     } else {
-      emit_arm_sub_imm(inst->dst.reg, inst->src.imm);
+      emit_arm_add_imm(ARM_DP_SUB, inst->dst.reg, inst->src.imm,
+                       !inst->unmasked);
     }
-    emit_reg2op(ARM_AND, inst->dst.reg, FFFFFF);
+    if (!inst->unmasked)
+      emit_reg2op(ARM_AND, inst->dst.reg, FFFFFF);
     break;
 
   case LOAD:
   case STORE:
     if (inst->src.type == REG) {
       reg = inst->src.reg;
+    } else if (inst->src.imm < 1024) {
+      // ldr/str dst, [ARM_MEM, #imm*4]
+      int off = inst->src.imm * 4;
+      emit_4le(0xe5, (inst->op == LOAD ? MEM_LOAD : MEM_STORE) +
+               ARMREG[ARM_MEM], ARMREG[inst->dst.reg] * 16 + off / 256,
+               off % 256);
+      break;
     } else {
       emit_arm_mov_imm(R0, inst->src.imm);
       reg = R0;
@@ -257,31 +501,20 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
 
   case PUTC:
     if (inst->src.type == REG) {
-      reg = inst->src.reg;
+      emit_arm_mov_reg(R0, inst->src.reg);
     } else {
-      reg = R0;
-      emit_arm_mov_imm8(reg, inst->src.imm, Shl0);
+      emit_arm_mov_imm8(R0, inst->src.imm, Shl0);
     }
-    emit_4le(0xe5, 0x2d, ARMREG[reg] * 16, 0x04);  // push reg
-    emit_arm_mov_imm8(R0, 1, Shl0);  // stdout
-    emit_arm_mov_reg(R1, ARM_SP);
-    emit_arm_mov_imm8(R2, 1, Shl0);
-    emit_arm_mov_imm8(R7, 4, Shl0);  // write
-    emit_svc();
-    emit_4le(0xe4, 0x9d, ARMREG[R0] * 16, 0x04);  // pop R0
+    emit_arm_branch(0xeb, g_putc_addr);  // bl putc
     break;
 
   case GETC:
-    emit_arm_mov_imm8(R0, 0, Shl0);  // stdin
-    emit_4le(0xe5, 0x2d, ARMREG[R0] * 16, 0x04);  // push 0
-    emit_arm_mov_reg(R1, ARM_SP);
-    emit_arm_mov_imm8(R2, 1, Shl0);
-    emit_arm_mov_imm8(R7, 3, Shl0);  // read
-    emit_svc();
-    emit_4le(0xe4, 0x9d, ARMREG[inst->dst.reg] * 16, 0x04);  // pop dst
+    emit_arm_branch(0xeb, g_getc_addr);  // bl getc
+    emit_arm_mov_reg(inst->dst.reg, R0);
     break;
 
   case EXIT:
+    emit_arm_branch(0xeb, g_flush_addr);  // bl flush
     emit_arm_mov_imm8(R0, 0, Shl0);
     emit_arm_mov_imm8(R7, 1, Shl0);  // exit
     emit_svc();
@@ -314,6 +547,40 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
     emit_arm_setcc(inst, 0xa3);
     break;
 
+  case MUL:
+  case AND:
+  case OR:
+  case XOR:
+    if (inst->op != MUL && inst->src.type == IMM &&
+        arm_encode_imm(inst->src.imm) >= 0) {
+      emit_arm_dp_imm(inst->op == AND ? ARM_DP_AND :
+                      inst->op == OR ? ARM_DP_ORR : ARM_DP_EOR,
+                      inst->dst.reg, inst->dst.reg,
+                      arm_encode_imm(inst->src.imm));
+      break;
+    }
+    if (inst->src.type == REG && inst->src.reg != inst->dst.reg) {
+      reg = inst->src.reg;
+    } else if (inst->src.type == REG) {
+      emit_arm_mov_reg(R0, inst->src.reg);
+      reg = R0;
+    } else {
+      emit_arm_mov_imm(R0, inst->src.imm);
+      reg = R0;
+    }
+    if (inst->op == MUL) {
+      emit_arm_mul(inst->dst.reg, reg, inst->dst.reg);
+      if (!inst->unmasked)
+        emit_reg2op(ARM_AND, inst->dst.reg, FFFFFF);
+    } else if (inst->op == AND) {
+      emit_reg2op(ARM_AND, inst->dst.reg, reg);
+    } else if (inst->op == OR) {
+      emit_arm_orr_reg(inst->dst.reg, reg);
+    } else {
+      emit_reg2op(ARM_EOR, inst->dst.reg, reg);
+    }
+    break;
+
   case JEQ:
     emit_arm_jcc(inst, 0x0a, pc2addr);
     break;
@@ -347,38 +614,100 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
   }
 }
 
+// The conditions of JEQ to JGE.
+static const int ARM_JCC_CONDS[] = { 0x0, 0x1, 0xb, 0xc, 0xd, 0xa };
+
+// Whether the block at pc, entered only by falling through from a
+// conditional jump over it, can run predicated on the jump not being
+// taken instead. Its instructions must not set the flags or branch.
+static bool arm_can_predicate(CFG* cfg, int pc) {
+  if (pc <= 0 || pc >= cfg->num_blocks - 1 ||
+      cfg->is_indirect_target[pc] || cfg->blocks[pc].num_preds != 1)
+    return false;
+  BasicBlock* b = &cfg->blocks[pc];
+  if (b->num_insts > 3)
+    return false;
+  Inst* inst = b->insts;
+  for (int i = 0; i < b->num_insts; i++, inst = inst->next) {
+    switch (inst->op) {
+    case MOV: case ADD: case SUB: case LOAD: case STORE:
+    case MUL: case AND: case OR: case XOR: case DUMP:
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
 void target_arm(Module* module) {
   emit_reset();
-  init_state_arm(module->data, 0);
+  emit_start_code();
+  int rodata_load = init_state_arm(module->data);
 
   int pc_cnt = 0;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     pc_cnt++;
   }
 
+  CFG* cfg = build_cfg(module);
+
+  // Branches to later pcs are patched once the layout is known.
   int* pc2addr = calloc(pc_cnt, sizeof(int));
+  Inst** jmps = calloc(pc_cnt, sizeof(Inst*));
+  int* jmp_addrs = calloc(pc_cnt, sizeof(int));
+  int num_jmps = 0;
   int prev_pc = -1;
+  int predicated_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     if (prev_pc != inst->pc) {
+      if (inst->pc != predicated_pc) {
+        g_arm_cond = 0xe;
+        arm_check_pool();
+      }
       pc2addr[inst->pc] = emit_cnt();
     }
     prev_pc = inst->pc;
-    arm_emit_inst(inst, pc2addr);
-  }
 
-  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
-
-  emit_elf_header(40, emit_cnt() + pc_cnt * 4);
-
-  emit_reset();
-  emit_start();
-  init_state_arm(module->data, rodata_addr);
+    bool is_jcc = inst->op >= JEQ && inst->op <= JGE;
+    if (is_jcc && inst->jmp.type == IMM && inst->jmp.imm == inst->pc + 2 &&
+        inst->next && inst->next->pc == inst->pc + 1 &&
+        arm_can_predicate(cfg, inst->pc + 1)) {
+      emit_arm_cmp(inst);
+      g_arm_cond = ARM_JCC_CONDS[inst->op - JEQ] ^ 1;
+      predicated_pc = inst->pc + 1;
+      continue;
+    }
 
-  for (Inst* inst = module->text; inst; inst = inst->next) {
     arm_emit_inst(inst, pc2addr);
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM) {
+      jmps[num_jmps] = inst;
+      jmp_addrs[num_jmps++] = emit_cnt() - 4;
+    }
+    if (inst->op == JMP || inst->op == EXIT)
+      arm_flush_pool();
   }
+  g_arm_cond = 0xe;
+  arm_flush_pool();
 
+  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
+  set_elf_symbols(module, pc2addr, ELF_HEADER_SIZE, emit_cnt());
+
+  emit_patch_begin(rodata_load);
+  emit_arm_load_rodata(rodata_addr);
+  emit_patch_end();
+  for (int i = 0; i < num_jmps; i++) {
+    emit_patch_begin(jmp_addrs[i]);
+    Op op = jmps[i]->op;
+    emit_arm_branch((op == JMP ? 0xe : ARM_JCC_CONDS[op - JEQ]) << 4 | 0xa,
+                    pc2addr[jmps[i]->jmp.imm]);
+    emit_patch_end();
+  }
   for (int i = 0; i < pc_cnt; i++) {
     emit_le(ELF_TEXT_START + pc2addr[i] + ELF_HEADER_SIZE);
   }
+
+  emit_elf_header(40, emit_cnt());
+  emit_flush();
+  emit_elf_sections();
 }
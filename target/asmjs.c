@@ -1,17 +1,51 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// In target/js.c.
+extern bool JS_WORKER;
+void emit_js_worker_glue(void);
+
+// The heap holds 2^k words, fewer than the 2^24 of the address space
+// when the program allows: its lower half maps the addresses from 0 up,
+// _edata and the heap past it, and its upper half those below 1<<24,
+// the stack, so an address is the word at a & mask. An access between
+// the two halves goes to slowload and slowstore instead. Once that
+// happens, main returns between functions and the module is
+// instantiated again on a heap with room for all the memory in use.
+#define ASMJS_MIN_HALF (1 << 16)
+
+// The lower half of the initial heap, in words: _edata with room for
+// as many words past it, at least ASMJS_MIN_HALF.
+static int asmjs_initial_half(Data* data) {
+  int edata = 0;
+  for (; data; data = data->next)
+    edata++;
+  int half = ASMJS_MIN_HALF;
+  while (half < 1 << 23 && half < edata * 2)
+    half *= 2;
+  return half;
+}
+
+static int asmjs_half;
+
 static void init_state_asmjs(Data* data) {
+  asmjs_half = asmjs_initial_half(data);
   emit_line("var main = function() {");
   emit_line("var mod = function(stdlib, foreign, heap) {");
   emit_line("\"use asm\";");
   emit_line("var mem = new stdlib.Int32Array(heap);");
   emit_line("var putchar = foreign.putchar;");
   emit_line("var getchar = foreign.getchar;");
+  emit_line("var slowload = foreign.slowload;");
+  emit_line("var slowstore = foreign.slowstore;");
+  emit_line("var slowused = foreign.slowused;");
+  emit_line("var half = foreign.half | 0;");
+  emit_line("var gap = foreign.gap | 0;");
+  emit_line("var mask = foreign.mask | 0;");
   emit_line("var running = 1;");
 
   for (int i = 0; i < 7; i++) {
-    emit_line("var %s = 0;", reg_names[i]);
+    emit_line("var r_%s = 0;", reg_names[i]);
   }
   emit_line("function init() {");
   for (int mp = 0; data; data = data->next, mp++) {
@@ -26,6 +60,14 @@ static void asmjs_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("function func%d() {", func_id);
   inc_indent();
+  // Works on local copies of the module's registers, which engines
+  // keep in machine registers.
+  for (int i = 0; i < 7; i++) {
+    emit_line("var %s = 0;", reg_names[i]);
+  }
+  for (int i = 0; i < 7; i++) {
+    emit_line("%s = r_%s | 0;", reg_names[i], reg_names[i]);
+  }
   emit_line("while ((%d <= (pc | 0)) & ((pc | 0) < %d) & running) {",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -59,11 +101,15 @@ static const char *unsigned_cmp_str(Inst *inst) {
 }
 
 static void asmjs_emit_func_epilogue(void) {
+  clear_src_loc();
   dec_indent();
   emit_line("}"); /* switch (pc) */
   emit_line("pc = (pc + 1) | 0;");
   dec_indent();
   emit_line("}"); /* while (_ <= pc && pc < _ && running) */
+  for (int i = 0; i < 7; i++) {
+    emit_line("r_%s = %s;", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("}"); /* function func%d */
 }
@@ -76,7 +122,28 @@ static void asmjs_emit_pc_change(int pc) {
   inc_indent();
 }
 
+static void asmjs_emit_mem(Inst* inst) {
+  const char* addr = src_str(inst);
+  const char* dst = reg_names[inst->dst.reg];
+  const char* word = format("mem[((%s & mask) << 2) >> 2]", addr);
+  const char* fast = (inst->op == LOAD ?
+                      format("%s = %s | 0;", dst, word) :
+                      format("%s = %s;", word, dst));
+  // The lower half never shrinks, nor does the upper one.
+  if (inst->src.type == IMM &&
+      (inst->src.imm < asmjs_half || inst->src.imm >= (1 << 24) - asmjs_half)) {
+    emit_line("%s", fast);
+    return;
+  }
+  emit_line("if ((((%s - half) | 0) >>> 0) < (gap >>> 0)) %s", addr,
+            (inst->op == LOAD ?
+             format("%s = slowload(%s | 0) | 0;", dst, addr) :
+             format("slowstore(%s | 0, %s | 0);", addr, dst)));
+  emit_line("else %s", fast);
+}
+
 static void asmjs_emit_inst(Inst* inst) {
+  set_src_loc(inst);
   switch (inst->op) {
   case MOV:
     emit_line("%s = %s;", reg_names[inst->dst.reg], src_str(inst));
@@ -95,11 +162,8 @@ static void asmjs_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[(%s << 2) >> 2] | 0;", reg_names[inst->dst.reg], src_str(inst));
-    break;
-
   case STORE:
-    emit_line("mem[(%s << 2) >> 2] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    asmjs_emit_mem(inst);
     break;
 
   case PUTC:
@@ -145,6 +209,7 @@ static void asmjs_emit_inst(Inst* inst) {
 }
 
 void target_asmjs(Module* module) {
+  start_src_map();
   init_state_asmjs(module->data);
 
   int num_funcs = emit_chunked_main_loop(module->text,
@@ -153,29 +218,88 @@ void target_asmjs(Module* module) {
                                          asmjs_emit_pc_change,
                                          asmjs_emit_inst);
 
+  // Returns 0 when the heap has to grow, 1 at the end.
   emit_line("");
   emit_line("function main() {");
-  emit_line("init();");
   emit_line("while (running) {");
   inc_indent();
-  emit_line("switch ((pc | 0) / %d | 0) {", CHUNKED_FUNC_SIZE);
+  emit_line("switch ((r_pc | 0) / %d | 0) {", CHUNKED_FUNC_SIZE);
   for (int i = 0; i < num_funcs; i++) {
     emit_line("case %d:", i);
     emit_line(" func%d();", i);
     emit_line(" break;");
   }
   emit_line("}"); /* switch (pc / CHUNKED_FUNC_SIZE) */
+  emit_line("if (slowused() | 0) return 0;");
   dec_indent();
   emit_line("}"); /* while (running) */
+  emit_line("return 1;");
   emit_line("}"); /* function main */
 
-  emit_line("return main;");
+  // The registers move to the module on the new heap.
+  emit_line("");
+  emit_line("function get_reg(i) {");
+  emit_line("i = i | 0;");
+  emit_line("switch (i | 0) {");
+  for (int i = 0; i < 7; i++)
+    emit_line("case %d: return r_%s | 0;", i, reg_names[i]);
+  emit_line("}");
+  emit_line("return 0;");
+  emit_line("}");
+  emit_line("function set_reg(i, v) {");
+  emit_line("i = i | 0;");
+  emit_line("v = v | 0;");
+  emit_line("switch (i | 0) {");
+  for (int i = 0; i < 7; i++)
+    emit_line("case %d: r_%s = v; break;", i, reg_names[i]);
+  emit_line("}");
+  emit_line("}");
+
+  emit_line("return {init: init, main: main, get_reg: get_reg, set_reg: set_reg};");
   emit_line("};"); /* var mod = function() */
   emit_line("return function(getchar, putchar) {");
-  emit_line("return mod((0,eval)('this'), {getchar: getchar, putchar: putchar}, new ArrayBuffer(1 << 26))();");
+  emit_line("var slow = new Map();");
+  emit_line("var words = 0;");
+  emit_line("var heap = null;");
+  emit_line("var m = null;");
+  // Instantiates the module on 2^k words with a lower half of half.
+  emit_line("var start = function(half) {");
+  emit_line(" var old = heap && new Int32Array(heap);");
+  emit_line(" var oldm = m, oldhalf = words / 2;");
+  emit_line(" words = half * 2;");
+  emit_line(" heap = new ArrayBuffer(words * 4);");
+  emit_line(" m = mod((0,eval)('this'), {");
+  emit_line("  getchar: getchar, putchar: putchar,");
+  emit_line("  slowload: function(a) { return slow.get(a) | 0; },");
+  emit_line("  slowstore: function(a, v) { slow.set(a, v); },");
+  emit_line("  slowused: function() { return slow.size ? 1 : 0; },");
+  emit_line("  half: half, gap: (1 << 24) - words, mask: words - 1");
+  emit_line(" }, heap);");
+  emit_line(" if (!old)");
+  emit_line("  return m.init();");
+  emit_line(" var mem = new Int32Array(heap);");
+  emit_line(" mem.set(old.subarray(0, oldhalf));");
+  emit_line(" mem.set(old.subarray(oldhalf), words - oldhalf);");
+  emit_line(" slow.forEach(function(v, a) { mem[a & words - 1] = v; });");
+  emit_line(" slow.clear();");
+  emit_line(" for (var i = 0; i < 7; i++)");
+  emit_line("  m.set_reg(i, oldm.get_reg(i));");
+  emit_line("};");
+  emit_line("start(%d);", asmjs_half);
+  emit_line("while (!m.main()) {");
+  emit_line(" var half = words / 2;");
+  emit_line(" slow.forEach(function(v, a) {");
+  emit_line("  while (half < 1 << 23 && (a < 1 << 23 ? a >= half : a < (1 << 24) - half))");
+  emit_line("   half *= 2;");
+  emit_line(" });");
+  emit_line(" start(half);");
+  emit_line("}");
   emit_line("};"); /* function(getchar, putchar) */
   emit_line("}();"); /* var main = function() */
 
+  if (JS_WORKER)
+    emit_js_worker_glue();
+
   // For nodejs
   emit_line("if (typeof require != 'undefined') {");
   emit_line(" var sys = require('sys');");
@@ -191,4 +315,5 @@ void target_asmjs(Module* module) {
   emit_line(" };");
   emit_line(" main(getchar, putchar);");
   emit_line("}");
+  emit_src_map_url("//# ");
 }
@@ -8,29 +8,85 @@
 
 static const uint BEF_MEM = 4782969;  // 9**7
 
+// Rows are wider than Befunge-93's 80 columns, which the program has
+// outgrown in height anyway, so blocks take fewer rows and turns.
+#define BEF_WIDTH 160
+
 typedef struct {
-  char block[299][80];
+  char block[299][BEF_WIDTH];
   uint x;
   uint y;
   uint vx;
   bool was_jmp;
+  // The number of pcs which the dispatch can skip at once, or 0.
+  int group;
+  int num_pcs;
 } Befunge;
 
 Befunge g_bef;
 
+const int target_bef_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(DIV) | EXT_OP_BIT(MOD);
+
 static void bef_emit(uint c);
 
 static void bef_clear_block_line(int y) {
   assert(y < 297);
-  for (uint i = 0; i < 78; i++)
+  for (uint i = 0; i < BEF_WIDTH - 1; i++)
     g_bef.block[y][i] = ' ';
-  g_bef.block[y][79] = '\0';
+  g_bef.block[y][BEF_WIDTH - 1] = '\0';
+}
+
+static int bef_num_digits(uint v, char *c);
+
+// Emits a row of the dispatch column with c at column x.
+static void bef_emit_lane_row(char c0, char c, int x) {
+  char row[10] = "         ";
+  row[0] = c0;
+  row[x] = c;
+  emit_line("%s", row);
+}
+
+// Jumps count the pc down by one per block from the top. Before the
+// first block of each group, rows in columns 0 to 8 (column 6 is the
+// way back up) subtract the group size and skip to the next group
+// down column 8 when the count is at least that:
+//
+//   v       <   the lane from the previous group joins
+//   >:   # v
+//          N-1  (a column of digits)
+//          `
+//          !
+//   v      _v
+//           N   (a column of digits)
+//           -
+static void bef_emit_group_head(int pc) {
+  int n = g_bef.group;
+  if (!n || pc % n)
+    return;
+  if (pc)
+    bef_emit_lane_row('v', '<', 8);
+  if (pc + n >= g_bef.num_pcs)
+    return;
+  emit_line(">:   # v");
+  char num[37];
+  int len = bef_num_digits(n - 1, num);
+  for (int i = 0; i < len; i++)
+    bef_emit_lane_row(' ', num[i], 7);
+  bef_emit_lane_row(' ', '`', 7);
+  bef_emit_lane_row(' ', '!', 7);
+  emit_line("v      _v");
+  len = bef_num_digits(n, num);
+  for (int i = 0; i < len; i++)
+    bef_emit_lane_row(' ', num[i], 8);
+  bef_emit_lane_row(' ', '-', 8);
 }
 
 static void bef_block_init() {
   if (g_bef.x) {
     for (uint i = 0; i <= g_bef.y; i++) {
-      puts(g_bef.block[i]);
+      emit_str(g_bef.block[i]);
+      emit_char('\n');
     }
   }
 
@@ -45,7 +101,7 @@ static void bef_block_init() {
 static void bef_emit(uint c) {
   g_bef.block[g_bef.y][g_bef.x] = c;
   g_bef.x += g_bef.vx;
-  if (g_bef.x == 10 || g_bef.x == 78) {
+  if (g_bef.x == 10 || g_bef.x == BEF_WIDTH - 2) {
     g_bef.block[g_bef.y][g_bef.x] = 'v';
     g_bef.y++;
     g_bef.vx *= -1;
@@ -97,7 +153,6 @@ static char* befnumcache[BEFNUMCACHESIZE] = {
   "0","1","2","3","4","5","6","7","8","9",
   "19+", "29+", "39+", "49+", "59+", "69+", "79+", "89+", "99+",
 };
-static int bef_num_digits(uint v, char *c);
 static int bef_num_factor_core(uint v, char *c) {
   int shortlen = 36;
   int incr = 1 + (v&1); // Skip even numbers for odd numbers
@@ -209,8 +264,79 @@ static void bef_emit_store_reg(uint r) {
   bef_emit('p');
 }
 
+// The high or low 12 bits of v.
+static void bef_emit_half(Value* v, bool hi) {
+  if (v->type == IMM) {
+    bef_emit_num(hi ? v->imm >> 12 : v->imm & 4095);
+    return;
+  }
+  bef_emit_value(v);
+  bef_emit_s("88*:*");
+  bef_emit(hi ? '/' : '%');
+}
+
+// Cells are only assumed to be 32-bit, so a product which may not fit
+// is summed from 12-bit halves, leaving out the high ones' product as
+// it's a multiple of 2^24.
+static void bef_emit_mul(Inst* inst) {
+  if (inst->in_range || (inst->src.type == IMM && inst->src.imm < 128)) {
+    bef_emit_dst(inst);
+    bef_emit_src(inst);
+    bef_emit('*');
+  } else {
+    bef_emit_half(&inst->dst, false);
+    bef_emit_half(&inst->src, false);
+    bef_emit('*');
+    bef_emit_half(&inst->dst, true);
+    bef_emit_half(&inst->src, false);
+    bef_emit('*');
+    bef_emit_half(&inst->dst, false);
+    bef_emit_half(&inst->src, true);
+    bef_emit('*');
+    bef_emit('+');
+    bef_emit_s("88*:*%88*:**+");
+  }
+  if (!inst->in_range) {
+    bef_emit_uint_mod();
+    bef_emit('%');
+  }
+}
+
+// DIV by 0 gives UINT_MAX and MOD by 0 leaves dst. A register divisor
+// is made 1 when it's 0, and the difference added afterwards.
+static void bef_emit_divmod(Inst* inst) {
+  bool is_div = inst->op == DIV;
+  if (inst->src.type == IMM) {
+    if (inst->src.imm) {
+      bef_emit_dst(inst);
+      bef_emit_src(inst);
+      bef_emit(is_div ? '/' : '%');
+    } else if (is_div) {
+      bef_emit_num(UINT_MAX);
+    } else {
+      bef_emit_dst(inst);
+    }
+    return;
+  }
+  bef_emit_dst(inst);
+  bef_emit_src(inst);
+  bef_emit_s(":!+");
+  bef_emit(is_div ? '/' : '%');
+  bef_emit_src(inst);
+  bef_emit('!');
+  if (is_div) {
+    bef_emit_num(UINT_MAX);
+    bef_emit_dst(inst);
+    bef_emit('-');
+  } else {
+    bef_emit_dst(inst);
+  }
+  bef_emit('*');
+  bef_emit('+');
+}
+
 static void bef_make_room() {
-  uint r = g_bef.vx == 1 ? 79 - g_bef.x : g_bef.x - 10;
+  uint r = g_bef.vx == 1 ? BEF_WIDTH - 1 - g_bef.x : g_bef.x - 10;
   if (r < 10) {
     uint y = g_bef.y;
     while (y == g_bef.y)
@@ -300,6 +426,17 @@ static void bef_emit_inst(Inst* inst) {
       bef_emit_store_reg(inst->dst.reg);
       break;
 
+    case MUL:
+      bef_emit_mul(inst);
+      bef_emit_store_reg(inst->dst.reg);
+      break;
+
+    case DIV:
+    case MOD:
+      bef_emit_divmod(inst);
+      bef_emit_store_reg(inst->dst.reg);
+      break;
+
     case LOAD:
       bef_emit('0');
       bef_emit_src(inst);
@@ -427,6 +564,16 @@ static void bef_init_state(Data* data) {
 void target_bef(Module* module) {
   bef_init_state(module->data);
 
+  // Skipping a group costs about twice what skipping a block does, so
+  // groups of sqrt(2 * num_pcs) pcs minimize the average dispatch.
+  for (Inst* inst = module->text; inst; inst = inst->next)
+    g_bef.num_pcs = inst->pc + 1;
+  g_bef.group = 1;
+  while ((g_bef.group + 1) * (g_bef.group + 1) <= 2 * g_bef.num_pcs)
+    g_bef.group++;
+  if (g_bef.group < 4)
+    g_bef.group = 0;
+
   int prev_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     if (prev_pc != inst->pc) {
@@ -434,6 +581,7 @@ void target_bef(Module* module) {
         bef_block_init();
       else
         bef_flush_code_block();
+      bef_emit_group_head(inst->pc);
     }
     prev_pc = inst->pc;
     bef_emit_inst(inst);
@@ -38,19 +38,45 @@ static const int BF_MEM_A = 4;
 static const int BF_MEM_WRK = 7;
 static const int BF_MEM_USE = 13;
 #define BF_MEM_CTL_LEN 16
-static const int BF_MEM_BLK_LEN = (256*3) + BF_MEM_CTL_LEN;
+
+// Set by elc -bf-fold. The memory is 256 superblocks of 256 blocks and
+// an access walks past the blocks before its own, so the stack at the
+// top of the address space is the farthest away. Folding adds one to
+// the superblock and block numbers of an address, which puts the top
+// block of the stack first and the data and the heap right after it.
+bool BF_FOLD_MEM;
+
+// Set by elc -bf-wide. A word takes one 32-bit cell instead of three
+// 8-bit ones, so ADD and SUB are plain loops without carries and a
+// memory block is a third as long. pc and the low byte of an address
+// are split into hex digits, which pick code and cells in up to 16
+// tests each instead of 256. A cell only keeps its word modulo
+// 2^24, and is reduced where the exact value matters: compares,
+// addresses and jump targets. Reductions multiply and divide by 16 in
+// loops like [----------------<+>], so the output needs cells which wrap
+// at 2^32 and an interpreter which runs such loops at once, e.g., bfopt
+// -w.
+bool BF_WIDE;
+
+static int bf_word_cells(void) {
+  return BF_WIDE ? 1 : 3;
+}
+
+static int bf_mem_blk_len(void) {
+  return 256 * bf_word_cells() + BF_MEM_CTL_LEN;
+}
 
 static void bf_emit(const char* s) {
-  fputs(s, stdout);
+  emit_str(s);
 }
 
 static void bf_comment(const char* s) {
-  printf("\n# %s\n", s);
+  emit_printf("\n# %s\n", s);
 }
 
 static void bf_rep(char c, int n) {
   for (int i = 0; i < n; i++)
-    putchar(c);
+    emit_char(c);
 }
 
 static void bf_set_ptr(int ptr) {
@@ -70,7 +96,7 @@ static void bf_move_neg(int from, int to) {
   bf_move_ptr(from);
   bf_emit("[-");
   bf_move_ptr(to);
-  putchar('-');
+  emit_char('-');
   bf_move_ptr(from);
   bf_emit("]");
 }
@@ -79,7 +105,7 @@ static void bf_move(int from, int to) {
   bf_move_ptr(from);
   bf_emit("[-");
   bf_move_ptr(to);
-  putchar('+');
+  emit_char('+');
   bf_move_ptr(from);
   bf_emit("]");
 }
@@ -88,31 +114,42 @@ static void bf_move2(int from, int to, int to2) {
   bf_move_ptr(from);
   bf_emit("[-");
   bf_move_ptr(to);
-  putchar('+');
+  emit_char('+');
   bf_move_ptr(to2);
-  putchar('+');
+  emit_char('+');
   bf_move_ptr(from);
   bf_emit("]");
 }
 
-static void bf_move_word(int from, int to) {
+// Moves the three cells around from, which are a word, or an address
+// split into bytes in the memory block.
+static void bf_move_bytes(int from, int to) {
   bf_move(from-1, to-1);
   bf_move(from, to);
   bf_move(from+1, to+1);
 }
 
+static void bf_move_word(int from, int to) {
+  if (BF_WIDE)
+    bf_move(from, to);
+  else
+    bf_move_bytes(from, to);
+}
+
 static void bf_move_word2(int from, int to, int to2) {
+  if (BF_WIDE) {
+    bf_move2(from, to, to2);
+    return;
+  }
   bf_move2(from-1, to-1, to2-1);
   bf_move2(from, to, to2);
   bf_move2(from+1, to+1, to2+1);
 }
 
-#if 0
 static void bf_copy(int from, int to, int wrk) {
   bf_move2(from, to, wrk);
   bf_move(wrk, from);
 }
-#endif
 
 static void bf_copy_word(int from, int to, int wrk) {
   bf_move_word2(from, to, wrk);
@@ -133,10 +170,72 @@ static void bf_add(int ptr, int v) {
   }
 }
 
+// Multiplies (k > 0) or exactly divides (k < 0) the cell a by f^|k|.
+// The value bounces between a and the empty cell b, and this returns
+// the one which ends up with it.
+static int bf_scale(int a, int b, int f, int k) {
+  for (; k; k += k > 0 ? -1 : 1) {
+    bf_move_ptr(a);
+    if (k > 0) {
+      bf_emit("[-");
+      bf_move_ptr(b);
+      bf_rep('+', f);
+    } else {
+      bf_emit("[");
+      bf_rep('-', f);
+      bf_move_ptr(b);
+      emit_char('+');
+    }
+    bf_move_ptr(a);
+    bf_emit("]");
+    int t = a;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Puts v, a non-negative word, into the empty cell ptr by Horner's
+// method in base 16, using the empty cell tmp.
+static void bf_build(int ptr, int tmp, int v) {
+  int digits[6];
+  int n = 0;
+  for (; v; v /= 16)
+    digits[n++] = v % 16;
+  if (!n)
+    return;
+  int cur = (n - 1) % 2 ? tmp : ptr;
+  bf_add(cur, digits[n-1]);
+  for (int i = n - 2; i >= 0; i--) {
+    cur = bf_scale(cur, cur == ptr ? tmp : ptr, 16, 1);
+    bf_add(cur, digits[i]);
+  }
+}
+
 static void bf_add_word(int ptr, int v) {
-  bf_add(ptr - 1, v / 65536);
-  bf_add(ptr, v / 256 % 256);
-  bf_add(ptr + 1, v % 256);
+  if (!BF_WIDE) {
+    bf_add(ptr - 1, v / 65536);
+    bf_add(ptr, v / 256 % 256);
+    bf_add(ptr + 1, v % 256);
+    return;
+  }
+
+#ifndef __eir__
+  v &= 0xffffff;
+#endif
+  bool neg = v >= 0x800000;
+  if (neg)
+    v = 0xffffff - v + 1;
+  if (v < 64) {
+    bf_move_ptr(ptr);
+    bf_rep(neg ? '-' : '+', v);
+    return;
+  }
+  bf_build(ptr + 1, ptr + 2, v);
+  if (neg)
+    bf_move_neg(ptr + 1, ptr);
+  else
+    bf_move(ptr + 1, ptr);
 }
 
 static void bf_clear(int ptr) {
@@ -144,12 +243,53 @@ static void bf_clear(int ptr) {
   bf_emit("[-]");
 }
 
+// Reduces the cell ptr of -bf-wide modulo 2^24, by multiplying it by
+// 256 and dividing it back, using the empty cell tmp.
+static void bf_reduce(int ptr, int tmp) {
+  bf_scale(ptr, tmp, 16, 2);
+  bf_scale(ptr, tmp, 16, -2);
+}
+
+// Moves the low 4 or 8 bits of the reduced cell v to the empty cell lo,
+// and leaves the rest of v shifted right. t and t2 are empty.
+static void bf_split_low(int v, int lo, int t, int t2, int bits) {
+  bf_copy(v, lo, t);
+  // Shift the higher bits out of the top of the cell, and back.
+  int c = bf_scale(lo, t, 256, 3);
+  if (bits == 4)
+    c = bf_scale(c, lo + t - c, 16, 1);
+  c = bf_scale(c, lo + t - c, 256, -3);
+  if (bits == 4)
+    bf_scale(c, lo + t - c, 16, -1);
+  bf_copy(lo, t2, t);
+  bf_move_neg(t2, v);
+  if (bf_scale(v, t, 16, -bits / 4) != v)
+    bf_move(t, v);
+}
+
 static void bf_clear_word(int ptr) {
+  if (BF_WIDE) {
+    bf_clear(ptr);
+    return;
+  }
   bf_clear(ptr-1);
   bf_clear(ptr);
   bf_clear(ptr+1);
 }
 
+static void bf_loop_begin(int ptr, char c) {
+  bf_move_ptr(ptr);
+  bf_emit("[");
+  if (c)
+    emit_char(c);
+  bf.loop_ptr = ptr;
+}
+
+static void bf_loop_end(void) {
+  bf_move_ptr(bf.loop_ptr);
+  bf_emit("]");
+}
+
 static int bf_regpos(int r) {
   switch (r) {
   case A: return BF_A;
@@ -172,7 +312,35 @@ static void bf_dbg(const char* s) {
   bf_clear(BF_DBG);
 }
 
+// Runs the rest of the program only if 2^24 fits in a cell. Like the
+// 8-bit check, this leaves a loop open, which target_bf closes.
+static void bf_interpreter_check_wide(void) {
+  bf_comment("interpreter check");
+
+  bf_add(BF_RUNNING, 1);
+  bf_add(BF_RUNNING + 3, 1);
+  bf_add(BF_RUNNING + 1, 1);
+  bf_scale(BF_RUNNING + 1, BF_RUNNING + 2, 16, 6);
+  bf_loop_begin(BF_RUNNING + 1, 0); {
+    bf_clear(BF_RUNNING + 1);
+    bf_add(BF_RUNNING + 3, -1);
+  }; bf_loop_end();
+
+  bf_loop_begin(BF_RUNNING + 3, '-'); {
+    bf_add(BF_RUNNING, -1);
+    bf_dbg("Sorry this program needs a 32bit interpreter\n");
+  }; bf_loop_end();
+
+  bf_move_ptr(BF_RUNNING);
+  bf_emit("[-");
+}
+
 static void bf_interpreter_check(void) {
+  if (BF_WIDE) {
+    bf_interpreter_check_wide();
+    return;
+  }
+
   bf_comment("interpreter check");
 
   // Test for cell wrap != 256
@@ -200,25 +368,18 @@ static void bf_init_state(Data* data) {
     if (data->v) {
       int hi = mp / 256;
       int lo = mp % 256;
-      int ptr = BF_MEM + BF_MEM_BLK_LEN * hi + BF_MEM_CTL_LEN + lo * 3;
+      // -bf-wide adds 0x10100 to the whole address, with carries.
+      if (BF_FOLD_MEM && BF_WIDE)
+        hi = (hi + 257) % 65536;
+      else if (BF_FOLD_MEM)
+        hi = (hi / 256 + 1) % 256 * 256 + (hi + 1) % 256;
+      int ptr = (BF_MEM + bf_mem_blk_len() * hi + BF_MEM_CTL_LEN +
+                 lo * bf_word_cells());
       bf_add_word(ptr, data->v);
     }
   }
 }
 
-static void bf_loop_begin(int ptr, char c) {
-  bf_move_ptr(ptr);
-  bf_emit("[");
-  if (c)
-    putchar(c);
-  bf.loop_ptr = ptr;
-}
-
-static void bf_loop_end(void) {
-  bf_move_ptr(bf.loop_ptr);
-  bf_emit("]");
-}
-
 static void bf_ifzero_begin_impl(int off, bool reset, const char* ifnz) {
   bf.ifzero_omp[bf.ifzero_cnt] = bf.mp;
   bf.mp = 0;
@@ -268,7 +429,24 @@ static int bf_emit_addsub_prep(Inst* inst) {
   return dst;
 }
 
+static void bf_emit_addsub_wide(Inst* inst, bool is_sub) {
+  int dst = bf_regpos(inst->dst.reg);
+  if (inst->src.type == REG) {
+    bf_copy(bf_regpos(inst->src.reg), BF_WRK, BF_WRK+1);
+    if (is_sub)
+      bf_move_neg(BF_WRK, dst);
+    else
+      bf_move(BF_WRK, dst);
+  } else {
+    bf_add_word(dst, is_sub ? -inst->src.imm : inst->src.imm);
+  }
+}
+
 static void bf_emit_add(Inst* inst) {
+  if (BF_WIDE) {
+    bf_emit_addsub_wide(inst, false);
+    return;
+  }
   int dst = bf_emit_addsub_prep(inst);
 
   // Add BF_WRK to dst.
@@ -299,6 +477,10 @@ static void bf_emit_add(Inst* inst) {
 }
 
 static void bf_emit_sub(Inst* inst) {
+  if (BF_WIDE) {
+    bf_emit_addsub_wide(inst, true);
+    return;
+  }
   int dst = bf_emit_addsub_prep(inst);
 
   // Add BF_WRK to dst.
@@ -328,12 +510,62 @@ static void bf_emit_sub(Inst* inst) {
   bf_move_neg(BF_WRK-1, dst-1);
 }
 
+// Leaves the flag in BF_WRK as bf_emit_cmp does. The difference of the
+// operands is zero modulo 2^24 iff they are equal, and once both are
+// reduced, it is below 2^24 iff LHS >= RHS.
+static void bf_emit_cmp_wide(Inst* inst, int op) {
+  int lhs = BF_WRK+1;
+  int rhs = BF_WRK+4;
+  int dstpos = lhs;
+  int srcpos = rhs;
+  if (op == JGT || op == JLE) {
+    dstpos = rhs;
+    srcpos = lhs;
+  }
+
+  bf_copy(bf_regpos(inst->dst.reg), dstpos, BF_WRK+2);
+  if (inst->src.type == REG) {
+    bf_copy(bf_regpos(inst->src.reg), srcpos, BF_WRK+2);
+  } else {
+    int imm = inst->src.imm;
+#ifndef __eir__
+    imm &= 0xffffff;
+#endif
+    bf_build(srcpos, BF_WRK+2, imm);
+  }
+
+  if (op == JEQ || op == JNE) {
+    bf_move_neg(rhs, lhs);
+    bf_scale(lhs, BF_WRK+2, 16, 2);
+  } else {
+    bf_reduce(dstpos, BF_WRK+2);
+    if (inst->src.type == REG)
+      bf_reduce(srcpos, BF_WRK+2);
+    bf_move_neg(rhs, lhs);
+    bf_copy(lhs, BF_WRK+5, BF_WRK+2);
+    bf_reduce(BF_WRK+5, BF_WRK+2);
+    bf_move_neg(BF_WRK+5, lhs);
+  }
+
+  bool if_zero = op == JEQ || op == JGE || op == JLE;
+  if (if_zero)
+    bf_add(BF_WRK, 1);
+  bf_loop_begin(lhs, 0); {
+    bf_clear(lhs);
+    bf_add(BF_WRK, if_zero ? -1 : 1);
+  }; bf_loop_end();
+}
+
 static void bf_emit_cmp(Inst* inst) {
   if (inst->op == JMP) {
     bf_add(BF_WRK, 1);
     return;
   }
   int op = normalize_cond(inst->op, false);
+  if (BF_WIDE) {
+    bf_emit_cmp_wide(inst, op);
+    return;
+  }
 
   int lhspos = BF_WRK;
   int rhspos = BF_WRK+3;
@@ -492,14 +724,17 @@ static void bf_emit_op(Inst* inst) {
     bf_emit_cmp(inst);
     int dst = bf_regpos(inst->dst.reg);
     bf_clear_word(dst);
-    bf_move_word(BF_WRK, dst+1);
+    if (BF_WIDE)
+      bf_move(BF_WRK, dst);
+    else
+      bf_move_word(BF_WRK, dst+1);
     break;
   }
 
   case PUTC:
     if (inst->src.type == REG) {
       int src = bf_regpos(inst->src.reg);
-      bf_move_ptr(src + 1);
+      bf_move_ptr(BF_WIDE ? src : src + 1);
       bf_emit(".");
     } else {
       bf_add(BF_WRK, inst->src.imm % 256);
@@ -510,14 +745,15 @@ static void bf_emit_op(Inst* inst) {
 
   case GETC: {
     int src = bf_regpos(inst->dst.reg);
+    int low = BF_WIDE ? src : src + 1;
     bf_clear_word(src);
-    bf_move_ptr(src+1);
+    bf_move_ptr(low);
     bf_emit(",");
     bf_emit("+");
     bf_ifzero_begin(1); {
-      bf_add(src + 1, 1);
+      bf_add(low, 1);
     }; bf_ifzero_end();
-    bf_add(src + 1, -1);
+    bf_add(low, -1);
     break;
   }
 
@@ -541,6 +777,8 @@ static void bf_emit_op(Inst* inst) {
     bf_clear_word(BF_NPC);
     if (inst->jmp.type == REG) {
       bf_copy_word(bf_regpos(inst->jmp.reg), BF_NPC, BF_WRK);
+      if (BF_WIDE)
+        bf_reduce(BF_NPC, BF_NPC+1);
     } else {
       bf_add_word(BF_NPC, inst->jmp.imm);
     }
@@ -554,7 +792,91 @@ static void bf_emit_op(Inst* inst) {
   }
 }
 
+// Opens the part of the pc dispatch which runs when the cell d is zero,
+// using the empty cell d+dir and the flag at d+dir*2.
+static void bf_dispatch_begin(int d, int dir) {
+  bf_add(d + dir * 2, -1);
+  bf_move_ptr(d);
+  bf_emit(dir < 0 ? "[<]<+[-<+" : "[>]>+[->+");
+  bf_set_ptr(d + dir * 2);
+}
+
+// Closes it, and counts d down for the next part.
+static void bf_dispatch_end(int d, int dir) {
+  bf_move_ptr(d + dir * 2);
+  bf_emit("]");
+  bf_add(d, -1);
+}
+
+static Inst* bf_emit_pc(Inst* inst, int pc) {
+  for (; inst && inst->pc == pc; inst = inst->next) {
+    emit_printf("\n# ");
+    dump_inst_fp(inst, cur_emitter()->out);
+
+    if (0) {
+      bf_emit("@");
+      bf_dbg(format("%d pc=%d\n", inst->op, pc));
+    }
+
+    bf_emit_op(inst);
+  }
+  return inst;
+}
+
+// The hex digits of pc for -bf-wide, the lowest at BF_OP+5 and each
+// higher one three cells before.
+static int bf_pc_digit_pos(int i) {
+  return BF_OP + 5 - 3 * i;
+}
+
+static Inst* bf_emit_dispatch_wide(Inst* inst, int digit, int pc) {
+  int d = bf_pc_digit_pos(digit);
+  for (int i = 0; i < 16 && inst; i++) {
+    bf_dispatch_begin(d, 1);
+    if (digit) {
+      inst = bf_emit_dispatch_wide(inst, digit - 1, pc * 16 + i);
+    } else {
+      emit_printf("\n# pc=%d\n", pc * 16 + i);
+      inst = bf_emit_pc(inst, pc * 16 + i);
+    }
+    bf_dispatch_end(d, 1);
+  }
+  return inst;
+}
+
+// With 32-bit cells, pc is split into as many hex digits as the last
+// pc has, and each picks one of 16 parts, which takes far fewer tests
+// than the 256 pc_h parts and up to 256 pc_l parts below.
+static void bf_emit_code_wide(Inst* inst) {
+  int digits = 1;
+  for (Inst* i = inst; i; i = i->next) {
+    while (digits < 5 && i->pc >> (4 * digits))
+      digits++;
+  }
+  if (digits > 4)
+    error("too many instructions for bf");
+  int top = bf_pc_digit_pos(digits - 1);
+
+  bf_comment("fetch pc");
+  bf_move2(BF_PC, BF_NPC, top);
+
+  bf_comment("increment pc");
+  bf_add(BF_NPC, 1);
+  for (int i = 0; i < digits - 1; i++)
+    bf_split_low(top, bf_pc_digit_pos(i), top + 1, top + 2, 4);
+
+  bf_emit_dispatch_wide(inst, digits - 1, 0);
+
+  for (int i = 0; i < digits; i++)
+    bf_clear(bf_pc_digit_pos(i));
+}
+
 void bf_emit_code(Inst* inst) {
+  if (BF_WIDE) {
+    bf_emit_code_wide(inst);
+    return;
+  }
+
   bf_comment("fetch pc");
   bf_move_word2(BF_PC, BF_NPC, BF_OP);
 
@@ -569,51 +891,94 @@ void bf_emit_code(Inst* inst) {
   bf_set_ptr(BF_NPC+3);
 
   for (int pc_h = 0; pc_h < 256; pc_h++) {
-    printf("\n# pc_h=%d\n", pc_h);
+    emit_printf("\n# pc_h=%d\n", pc_h);
 
-    bf_add(BF_OP-2, -1);
-    bf_move_ptr(BF_OP);
-    bf_emit("[<]<+[-<+");
-    bf_set_ptr(BF_OP-2);
+    bf_dispatch_begin(BF_OP, -1);
 
     for (int pc_l = 0; pc_l < 256; pc_l++) {
       int pc = pc_h * 256 + pc_l;
       if (!inst)
         break;
 
-      bf_add(BF_OP+3, -1);
-      bf_move_ptr(BF_OP+1);
-      bf_emit("[>]>+[->+");
-      bf_set_ptr(BF_OP+3);
+      bf_dispatch_begin(BF_OP+1, 1);
+
+      emit_printf("\n# pc_l=%d\n", pc_l);
 
-      printf("\n# pc_l=%d\n", pc_l);
+      inst = bf_emit_pc(inst, pc);
 
-      for (; inst && inst->pc == pc; inst = inst->next) {
-        printf("\n# ");
-        dump_inst_fp(inst, stdout);
+      bf_dispatch_end(BF_OP+1, 1);
+    }
 
-        if (0) {
-          bf_emit("@");
-          bf_dbg(format("%d pc=%d\n", inst->op, pc));
-        }
+    bf_dispatch_end(BF_OP, -1);
+  }
 
-        bf_emit_op(inst);
-      }
+  bf_clear_word(BF_OP);
+}
 
-      bf_move_ptr(BF_OP+3);
-      bf_emit("]");
-      bf_add(BF_OP+1, -1);
+// Turns the address in the memory block into the superblock, block and
+// cell numbers at BF_MEM_A-1, BF_MEM_A and BF_MEM_A+1. With 8-bit cells
+// they are already there.
+static void bf_prepare_addr(void) {
+  if (!BF_WIDE) {
+    if (BF_FOLD_MEM) {
+      bf_add(BF_MEM_A-1, 1);
+      bf_add(BF_MEM_A, 1);
     }
+    return;
+  }
 
-    bf_move_ptr(BF_OP-2);
-    bf_emit("]");
-    bf_add(BF_OP, -1);
+  if (BF_FOLD_MEM)
+    bf_add_word(BF_MEM_A, 0x10100);
+  bf_reduce(BF_MEM_A, BF_MEM_WRK+3);
+  bf_split_low(BF_MEM_A, BF_MEM_A+1, BF_MEM_WRK+3, BF_MEM_WRK+4, 8);
+  bf_split_low(BF_MEM_A, BF_MEM_WRK+4, BF_MEM_WRK+3, BF_MEM_WRK+5, 8);
+  bf_move(BF_MEM_A, BF_MEM_A-1);
+  bf_move(BF_MEM_WRK+4, BF_MEM_A);
+}
+
+static void bf_emit_mem_cell(int al, bool is_store) {
+  int cell = BF_MEM_CTL_LEN + al * bf_word_cells();
+  if (is_store) {
+    bf_clear_word(cell);
+    bf_move_word(BF_MEM_V, cell);
+  } else {
+    bf_copy_word(cell, BF_MEM_V, BF_MEM_WRK + 2);
   }
+}
 
-  bf_clear_word(BF_OP);
+// Loads or stores the cell of the block picked by the low byte of the
+// address, testing the 256 cells in turn. With 32-bit cells the byte
+// is split into two hex digits instead, for up to 32 tests.
+static void bf_emit_mem_select(bool is_store) {
+  if (!BF_WIDE) {
+    for (int al = 0; al < 256; al++) {
+      bf_move_ptr(BF_MEM_A + 1);
+      bf_ifzero_begin(1); {
+        bf_emit_mem_cell(al, is_store);
+      }; bf_ifzero_end();
+      bf_add(BF_MEM_A + 1, -1);
+    }
+    bf_clear(BF_MEM_A + 1);
+    return;
+  }
+
+  int lo = BF_MEM_WRK + 3;
+  bf_split_low(BF_MEM_A + 1, lo, lo + 1, lo + 2, 4);
+  for (int hi = 0; hi < 16; hi++) {
+    bf_dispatch_begin(BF_MEM_A + 1, 1);
+    for (int i = 0; i < 16; i++) {
+      bf_dispatch_begin(lo, 1);
+      bf_emit_mem_cell(hi * 16 + i, is_store);
+      bf_dispatch_end(lo, 1);
+    }
+    bf_dispatch_end(BF_MEM_A + 1, 1);
+  }
+  bf_clear(BF_MEM_A + 1);
+  bf_clear(lo);
 }
 
 static void bf_emit_mem_load(void) {
+  int blk_len = bf_mem_blk_len();
   bf_comment("memory (load)");
 
   bf_move_ptr(BF_LOAD_REQ);
@@ -621,40 +986,34 @@ static void bf_emit_mem_load(void) {
 
   bf_move_ptr(BF_MEM);
   bf_set_ptr(0);
+  bf_prepare_addr();
 
   bf_loop_begin(BF_MEM_A-1, '-'); {
-    bf_move_word(BF_MEM_A, BF_MEM_A + BF_MEM_BLK_LEN*256);
-    bf_move_ptr(BF_MEM_A + BF_MEM_BLK_LEN*256);
+    bf_move_bytes(BF_MEM_A, BF_MEM_A + blk_len*256);
+    bf_move_ptr(BF_MEM_A + blk_len*256);
     bf_set_ptr(BF_MEM_A);
     bf_add(BF_MEM_USE+1, 1);
   }; bf_loop_end();
 
   bf_loop_begin(BF_MEM_A, '-'); {
-    bf_move_word(BF_MEM_A, BF_MEM_A + BF_MEM_BLK_LEN);
-    bf_move_ptr(BF_MEM_A + BF_MEM_BLK_LEN);
+    bf_move_bytes(BF_MEM_A, BF_MEM_A + blk_len);
+    bf_move_ptr(BF_MEM_A + blk_len);
     bf_set_ptr(BF_MEM_A);
     bf_add(BF_MEM_USE, 1);
   }; bf_loop_end();
 
-  for (int al = 0; al < 256; al++) {
-    bf_move_ptr(BF_MEM_A + 1);
-    bf_ifzero_begin(1); {
-      bf_copy_word(BF_MEM_CTL_LEN + al * 3, BF_MEM_V, BF_MEM_WRK + 2);
-    }; bf_ifzero_end();
-    bf_add(BF_MEM_A + 1, -1);
-  }
-  bf_clear(BF_MEM_A + 1);
+  bf_emit_mem_select(false);
 
   bf_loop_begin(BF_MEM_USE, '-'); {
     bf_move_ptr(BF_MEM_V);
-    bf_set_ptr(BF_MEM_V + BF_MEM_BLK_LEN);
-    bf_move_word(BF_MEM_V + BF_MEM_BLK_LEN, BF_MEM_V);
+    bf_set_ptr(BF_MEM_V + blk_len);
+    bf_move_word(BF_MEM_V + blk_len, BF_MEM_V);
   }; bf_loop_end();
 
   bf_loop_begin(BF_MEM_USE+1, '-'); {
     bf_move_ptr(BF_MEM_V);
-    bf_set_ptr(BF_MEM_V + BF_MEM_BLK_LEN * 256);
-    bf_move_word(BF_MEM_V + BF_MEM_BLK_LEN * 256, BF_MEM_V);
+    bf_set_ptr(BF_MEM_V + blk_len * 256);
+    bf_move_word(BF_MEM_V + blk_len * 256, BF_MEM_V);
   }; bf_loop_end();
 
   bf_move_ptr(0);
@@ -667,6 +1026,7 @@ static void bf_emit_mem_load(void) {
 }
 
 static void bf_emit_mem_store(void) {
+  int blk_len = bf_mem_blk_len();
   bf_comment("memory (store)");
 
   bf_move_ptr(BF_STORE_REQ);
@@ -674,44 +1034,37 @@ static void bf_emit_mem_store(void) {
 
   bf_move_ptr(BF_MEM);
   bf_set_ptr(0);
+  bf_prepare_addr();
 
   bf_loop_begin(BF_MEM_A-1, '-'); {
-    bf_move_word(BF_MEM_V, BF_MEM_V + BF_MEM_BLK_LEN*256);
-    bf_move_word(BF_MEM_A, BF_MEM_A + BF_MEM_BLK_LEN*256);
-    bf_move_ptr(BF_MEM_A + BF_MEM_BLK_LEN*256);
+    bf_move_word(BF_MEM_V, BF_MEM_V + blk_len*256);
+    bf_move_bytes(BF_MEM_A, BF_MEM_A + blk_len*256);
+    bf_move_ptr(BF_MEM_A + blk_len*256);
     bf_set_ptr(BF_MEM_A);
     bf_add(BF_MEM_USE+1, 1);
   }; bf_loop_end();
 
   bf_loop_begin(BF_MEM_A, '-'); {
-    bf_move_word(BF_MEM_V, BF_MEM_V + BF_MEM_BLK_LEN);
-    bf_move_word(BF_MEM_A, BF_MEM_A + BF_MEM_BLK_LEN);
-    bf_move_ptr(BF_MEM_A + BF_MEM_BLK_LEN);
+    bf_move_word(BF_MEM_V, BF_MEM_V + blk_len);
+    bf_move_bytes(BF_MEM_A, BF_MEM_A + blk_len);
+    bf_move_ptr(BF_MEM_A + blk_len);
     bf_set_ptr(BF_MEM_A);
     bf_add(BF_MEM_USE, 1);
   }; bf_loop_end();
 
   // VH VL 0 AL 1
-  for (int al = 0; al < 256; al++) {
-    bf_move_ptr(BF_MEM_A + 1);
-    bf_ifzero_begin(1); {
-      bf_clear_word(BF_MEM_CTL_LEN + al * 3);
-      bf_move_word(BF_MEM_V, BF_MEM_CTL_LEN + al * 3);
-    }; bf_ifzero_end();
-    bf_add(BF_MEM_A + 1, -1);
-  }
-  bf_clear(BF_MEM_A + 1);
+  bf_emit_mem_select(true);
 
   bf_move_ptr(BF_MEM_USE);
   bf_emit("[-");
-  for (int i = 0; i < BF_MEM_BLK_LEN; i++)
-    putchar('<');
+  for (int i = 0; i < blk_len; i++)
+    emit_char('<');
   bf_emit("]");
 
   bf_move_ptr(BF_MEM_USE+1);
   bf_emit("[-");
-  for (int i = 0; i < BF_MEM_BLK_LEN*256; i++)
-    putchar('<');
+  for (int i = 0; i < blk_len*256; i++)
+    emit_char('<');
   bf_emit("]");
 
   bf_move_ptr(0);
@@ -1,16 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __eir__
+#include <sys/stat.h>
+#endif
+
+#include <ir/cfg.h>
 #include <ir/ir.h>
 #include <target/util.h>
 
-static void c_init_state(void) {
+// The virtual registers of promote_stack_slots are plain globals.
+static void c_emit_vregs(Module* module) {
+  if (!(module->ext_ops & VREG_BIT))
+    return;
+  for (int i = 0; i < NUM_VREGS; i++)
+    emit_line("unsigned int %s;", reg_str((Reg)(R0 + i)));
+}
+
+// Where target_c writes its output as separate translation units, and
+// how many of them hold the functions, chosen by -c-split= and
+// -c-units=.
+const char* C_SPLIT_DIR;
+int C_SPLIT_UNITS = 8;
+
+static void c_init_state(Module* module) {
   emit_line("#include <stdio.h>");
   emit_line("#include <stdlib.h>");
+  emit_line("#include <string.h>");
 
   for (int i = 0; i < 7; i++) {
     emit_line("unsigned int %s;", reg_names[i]);
   }
+  c_emit_vregs(module);
   emit_line("unsigned int mem[1<<24];");
 }
 
+// With the whole module at hand, a return checks its likely targets in
+// the same function first (see BasicBlock.ret_targets) and jumps to
+// their case directly, skipping the loop and the switch on pc. Not
+// with the chunk cache, whose key only has the instructions.
+static BasicBlock* c_blocks;
+static bool* c_has_ret_label;
+
+static bool c_is_local_ret(Inst* inst, int pc) {
+  return pc / CHUNKED_FUNC_SIZE == inst->pc / CHUNKED_FUNC_SIZE;
+}
+
+static void c_find_ret_labels(Module* module) {
+  if (!module->text || cur_emitter()->chunk_cache_dir)
+    return;
+  c_blocks = build_cfg(module)->blocks;
+  c_has_ret_label = calloc(module->num_pcs, sizeof(bool));
+  for (int pc = 0; pc < module->num_pcs; pc++) {
+    BasicBlock* b = &c_blocks[pc];
+    for (int i = 0; i < b->num_ret_targets; i++) {
+      int t = b->ret_targets[i];
+      if (t / CHUNKED_FUNC_SIZE == pc / CHUNKED_FUNC_SIZE)
+        c_has_ret_label[t] = true;
+    }
+  }
+}
+
 static void c_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("void func%d() {", func_id);
@@ -38,33 +88,77 @@ static void c_emit_pc_change(int pc) {
   emit_line("");
   dec_indent();
   emit_line("case %d:", pc);
+  if (c_has_ret_label && c_has_ret_label[pc])
+    emit_line("L%d:", pc);
   inc_indent();
 }
 
+static void c_emit_return(Inst* inst) {
+  BasicBlock* b = &c_blocks[inst->pc];
+  const char* reg = reg_str(inst->jmp.reg);
+  emit_line("switch (%s) {", reg);
+  for (int i = 0; i < b->num_ret_targets; i++) {
+    int pc = b->ret_targets[i];
+    if (c_is_local_ret(inst, pc))
+      emit_line("case %d: pc = %d; goto L%d;", pc, pc, pc);
+  }
+  emit_line("}");
+  emit_line("pc = %s - 1;", reg);
+}
+
+// s as the body of a C string literal.
+static const char* c_escape_str(const char* s) {
+  char* buf = format("%*s", (int)strlen(s) * 4, "");
+  char* p = buf;
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      p += sprintf(p, "\\%c", c);
+    else if (c < 32 || c >= 127)
+      p += sprintf(p, "\\%03o", c);
+    else
+      *p++ = c;
+  }
+  *p = 0;
+  return buf;
+}
+
+// Points the C compiler, and so debuggers and profilers, at the source
+// line of inst with elc -g.
+static void c_emit_line_marker(Inst* inst) {
+  const SrcLoc* loc = set_src_loc(inst);
+  if (loc)
+    emit_line("#line %d \"%s\"", loc->line,
+              c_escape_str(src_file_name(loc)));
+}
+
 static void c_emit_inst(Inst* inst) {
+  c_emit_line_marker(inst);
   switch (inst->op) {
   case MOV:
-    emit_line("%s = %s;", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = %s;", reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case ADD:
-    emit_line("%s = (%s + %s) & " UINT_MAX_STR ";",
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+    emit_line(inst->unmasked ? "%s = %s + %s;" :
+              "%s = (%s + %s) & " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case SUB:
-    emit_line("%s = (%s - %s) & " UINT_MAX_STR ";",
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+    emit_line(inst->unmasked ? "%s = %s - %s;" :
+              "%s = (%s - %s) & " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s];", reg_str(inst->dst.reg), mem_addr_str(inst));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s;", mem_addr_str(inst), reg_str(inst->dst.reg));
     break;
 
   case PUTC:
@@ -73,7 +167,7 @@ static void c_emit_inst(Inst* inst) {
 
   case GETC:
     emit_line("{ int _ = getchar(); %s = _ != EOF ? _ : 0; }",
-              reg_names[inst->dst.reg]);
+              reg_str(inst->dst.reg));
     break;
 
   case EXIT:
@@ -90,7 +184,59 @@ static void c_emit_inst(Inst* inst) {
   case LE:
   case GE:
     emit_line("%s = %s;",
-              reg_names[inst->dst.reg], cmp_str(inst, "1"));
+              reg_str(inst->dst.reg), cmp_str(inst, "1"));
+    break;
+
+  case MUL:
+    emit_line(inst->unmasked ? "%s = %s * %s;" :
+              "%s = (%s * %s) & " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case DIV:
+    emit_line("%s = %s ? %s / %s : " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case MOD:
+    emit_line("%s = %s ? %s %% %s : %s;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg));
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    emit_line("%s %s= %s;", reg_str(inst->dst.reg),
+              inst->op == AND ? "&" : inst->op == OR ? "|" : "^",
+              src_str(inst));
+    break;
+
+  case SHL:
+    emit_line("%s = %s < 24 ? (%s << %s) & " UINT_MAX_STR " : 0;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case SHR:
+    emit_line("%s = %s < 24 ? %s >> %s : 0;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case MEMCPY:
+    emit_line("memmove(mem + %s, mem + %s, %s * sizeof(*mem));",
+              reg_str(inst->dst.reg), src_str(inst),
+              value_str(&inst->jmp));
+    break;
+
+  case MEMSET:
+    emit_line("{ unsigned int i; for (i = 0; i < %s; i++) mem[%s + i] = %s; }",
+              value_str(&inst->jmp), reg_str(inst->dst.reg),
+              src_str(inst));
     break;
 
   case JEQ:
@@ -100,6 +246,10 @@ static void c_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
+    if (inst->jmp.type == REG && c_blocks && c_blocks[inst->pc].returns) {
+      c_emit_return(inst);
+      break;
+    }
     emit_line("if (%s) pc = %s - 1;",
               cmp_str(inst, "1"), value_str(&inst->jmp));
     break;
@@ -109,38 +259,340 @@ static void c_emit_inst(Inst* inst) {
   }
 }
 
+const int target_c_ext_ops = ALL_EXT_OPS | MEM_DISP_BIT | VREG_BIT;
+
+// Emits the data words up to the last non-zero one as mem_init, which
+// main copies into mem. The last word, _edata, is never zero.
+static void c_emit_data(Module* module) {
+  int n = module->num_data;
+  while (n > 1 && !module->data[n - 1].v)
+    n--;
+  emit_line("");
+  emit_line("static const unsigned int mem_init[%d] = {", n);
+  inc_indent();
+  char line[256];
+  for (int i = 0; i < n; i += 16) {
+    int len = 0;
+    for (int j = i; j < n && j < i + 16; j++)
+      len += sprintf(line + len, "%d,", module->data[j].v);
+    emit_line("%s", line);
+  }
+  dec_indent();
+  emit_line("};");
+  emit_line("");
+}
+
+static void c_emit_main(Module* module, int num_funcs) {
+  c_emit_data(module);
+  emit_line("int main() {");
+  inc_indent();
+  emit_line("memcpy(mem, mem_init, sizeof(mem_init));");
+
+  emit_line("");
+  emit_line("while (1) {");
+  inc_indent();
+  emit_line("switch (pc / %d | 0) {", CHUNKED_FUNC_SIZE);
+  for (int i = 0; i < num_funcs; i++) {
+    emit_line("case %d:", i);
+    emit_line(" func%d();", i);
+    emit_line(" break;");
+  }
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+
+  emit_line("return 1;");
+  dec_indent();
+  emit_line("}");
+}
+
+#ifndef __eir__
+// Points the current emitter at C_SPLIT_DIR/name, closing the file it
+// wrote before unless that is out.
+static void c_split_open(const char* name, FILE* out) {
+  Emitter* e = cur_emitter();
+  if (e->out != out)
+    fclose(e->out);
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", C_SPLIT_DIR, name);
+  e->out = fopen(path, "w");
+  if (!e->out)
+    error("cannot open %s", path);
+  clear_src_loc();
+}
+
+// Writes the functions as C_SPLIT_UNITS files of consecutive ones
+// (funcs<N>.c), and the state, the data and main (main.c), which share
+// the declarations of elvm.h, with a Makefile building them all, so a
+// host compiler takes them one core each, as `make -j -C DIR`.
+static void c_emit_split(Module* module) {
+  Emitter* e = cur_emitter();
+  FILE* out = e->out;
+  int num_funcs = (module->num_pcs + CHUNKED_FUNC_SIZE - 1) /
+      CHUNKED_FUNC_SIZE;
+  int per_unit = (num_funcs + C_SPLIT_UNITS - 1) / C_SPLIT_UNITS;
+  if (!per_unit)
+    per_unit = 1;
+  mkdir(C_SPLIT_DIR, 0777);
+
+  c_split_open("elvm.h", out);
+  emit_line("#include <stdio.h>");
+  emit_line("#include <stdlib.h>");
+  emit_line("#include <string.h>");
+  for (int i = 0; i < 7; i++)
+    emit_line("extern unsigned int %s;", reg_names[i]);
+  if (module->ext_ops & VREG_BIT) {
+    for (int i = 0; i < NUM_VREGS; i++)
+      emit_line("extern unsigned int %s;", reg_str((Reg)(R0 + i)));
+  }
+  emit_line("extern unsigned int mem[1<<24];");
+  for (int i = 0; i < num_funcs; i++)
+    emit_line("void func%d();", i);
+
+  // Each unit walks its slice of the text, cut off from the next one.
+  int num_units = 0;
+  for (int f = 0; f < num_funcs; f += per_unit, num_units++) {
+    int end_pc = (f + per_unit) * CHUNKED_FUNC_SIZE;
+    Inst* first = &module->text[module->pc_starts[f * CHUNKED_FUNC_SIZE]];
+    Inst* last = NULL;
+    Inst* next = NULL;
+    if (end_pc < module->num_pcs) {
+      last = &module->text[module->pc_starts[end_pc] - 1];
+      next = last->next;
+      last->next = NULL;
+    }
+    c_split_open(format("funcs%d.c", num_units), out);
+    emit_line("#include \"elvm.h\"");
+    emit_chunked_main_loop(first, c_emit_func_prologue, c_emit_func_epilogue,
+                           c_emit_pc_change, c_emit_inst);
+    if (last)
+      last->next = next;
+  }
+
+  c_split_open("main.c", out);
+  emit_line("#include \"elvm.h\"");
+  for (int i = 0; i < 7; i++)
+    emit_line("unsigned int %s;", reg_names[i]);
+  c_emit_vregs(module);
+  emit_line("unsigned int mem[1<<24];");
+  c_emit_main(module, num_funcs);
+
+  c_split_open("Makefile", out);
+  emit_line("CC ?= cc");
+  emit_line("CFLAGS ?= -O2");
+  emit_str("OBJS := main.o");
+  for (int i = 0; i < num_units; i++)
+    emit_printf(" funcs%d.o", i);
+  emit_line("");
+  emit_line("");
+  emit_line("a.out: $(OBJS)");
+  emit_line("\t$(CC) $(CFLAGS) -o $@ $(OBJS)");
+  emit_line("");
+  emit_line("%%.o: %%.c elvm.h");
+  emit_line("\t$(CC) $(CFLAGS) -c -o $@ $<");
+  fclose(e->out);
+  e->out = out;
+}
+#endif
+
 void target_c(Module* module) {
-  c_init_state();
+#ifndef __eir__
+  if (C_SPLIT_DIR) {
+    c_find_ret_labels(module);
+    c_emit_split(module);
+    return;
+  }
+#endif
+  c_init_state(module);
+  c_find_ret_labels(module);
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          c_emit_func_prologue,
                                          c_emit_func_epilogue,
                                          c_emit_pc_change,
                                          c_emit_inst);
+  c_emit_main(module, num_funcs);
+}
 
-  emit_line("int main() {");
-  inc_indent();
+// The CFG mode splits the program into functions (see plan_chunks),
+// with the registers as locals and a label per jump target, so the C
+// compiler sees the control flow and can keep registers in machine
+// registers. Jumps within a function are gotos. A jump through a
+// register goes to a dispatch on pc, which is a computed goto with GNU
+// C and a switch otherwise, and a jump out of the function saves the
+// registers and returns to main, which calls the function of pc. A
+// return first switches over its likely targets in the function.
 
-  Data* data = module->data;
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d;", mp, data->v);
+static ChunkPlan* c_cfg_plan;
+static BasicBlock* c_cfg_blocks;
+static bool* c_cfg_has_label;
+static int c_cfg_num_pcs;
+static int c_cfg_func_id;
+
+static bool c_cfg_is_local(int pc) {
+  return (pc >= 0 && pc < c_cfg_num_pcs &&
+          c_cfg_plan->func_of_pc[pc] == c_cfg_func_id);
+}
+
+static void c_cfg_emit_inst(Inst* inst) {
+  c_emit_line_marker(inst);
+  if (inst->op < JEQ || inst->op > JMP) {
+    c_emit_inst(inst);
+    return;
+  }
+
+  const char* cond = cmp_str(inst, "1");
+  BasicBlock* b = &c_cfg_blocks[inst->pc];
+  if (b->returns) {
+    emit_line("pc = %s;", reg_str(inst->jmp.reg));
+    emit_line("switch (pc) {");
+    for (int i = 0; i < b->num_ret_targets; i++) {
+      int pc = b->ret_targets[i];
+      if (c_cfg_is_local(pc))
+        emit_line("case %d: goto L%d;", pc, pc);
     }
+    emit_line("}");
+    emit_line("goto dispatch;");
+  } else if (inst->jmp.type == REG) {
+    emit_line("if (%s) { pc = %s; goto dispatch; }",
+              cond, reg_str(inst->jmp.reg));
+  } else if (c_cfg_is_local(inst->jmp.imm)) {
+    if (inst->op == JMP)
+      emit_line("goto L%d;", inst->jmp.imm);
+    else
+      emit_line("if (%s) goto L%d;", cond, inst->jmp.imm);
+  } else {
+    emit_line("if (%s) { pc = %d; goto leave; }", cond, inst->jmp.imm);
   }
+}
+
+static void c_cfg_find_labels(CFG* cfg) {
+  Module* m = cfg->module;
+  c_cfg_num_pcs = m->num_pcs;
+  c_cfg_plan = plan_chunks(cfg);
+  c_cfg_blocks = cfg->blocks;
+  c_cfg_has_label = calloc(m->num_pcs, sizeof(bool));
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (inst->op < JEQ || inst->op > JMP || inst->jmp.type != IMM)
+      continue;
+    int target = inst->jmp.imm;
+    if (target >= 0 && target < m->num_pcs)
+      c_cfg_has_label[target] = true;
+  }
+  for (int pc = 0; pc < m->num_pcs; pc++)
+    c_cfg_has_label[pc] |= c_cfg_plan->is_entry[pc];
+}
 
+static void c_cfg_emit_dispatch(int start, int end) {
+  bool* is_entry = c_cfg_plan->is_entry;
   emit_line("");
-  emit_line("while (1) {");
+  emit_line("dispatch:");
+  emit_line("if (pc - %d >= %d) goto leave;", start, end - start);
+  emit_line("#ifdef __GNUC__");
+  emit_line("{");
   inc_indent();
-  emit_line("switch (pc / %d | 0) {", CHUNKED_FUNC_SIZE);
-  for (int i = 0; i < num_funcs; i++) {
-    emit_line("case %d:", i);
-    emit_line(" func%d();", i);
-    emit_line(" break;");
+  emit_line("static void* const labels[%d] = {", end - start);
+  for (int pc = start; pc < end; pc++) {
+    if (is_entry[pc])
+      emit_line("  [%d] = &&L%d,", pc - start, pc);
+  }
+  emit_line("};");
+  emit_line("if (labels[pc - %d]) goto *labels[pc - %d];", start, start);
+  dec_indent();
+  emit_line("}");
+  emit_line("#else");
+  emit_line("switch (pc) {");
+  for (int pc = start; pc < end; pc++) {
+    if (is_entry[pc])
+      emit_line("case %d: goto L%d;", pc, pc);
   }
   emit_line("}");
+  emit_line("#endif");
+  emit_line("exit(1);");
+}
+
+static void c_cfg_emit_func(Module* module, int func_id) {
+  int start = c_cfg_plan->starts[func_id];
+  int end = c_cfg_plan->starts[func_id + 1];
+  c_cfg_func_id = func_id;
+
+  emit_line("");
+  emit_line("static void func%d(void) {", func_id);
+  inc_indent();
+  for (int i = 0; i < 6; i++)
+    emit_line("unsigned int %s = reg[%d];", reg_names[i], i);
+  emit_line("goto dispatch;");
+
+  for (int pc = start; pc < end; pc++) {
+    if (c_cfg_has_label[pc]) {
+      emit_line("");
+      emit_line("L%d:", pc);
+    }
+    Inst* inst = &module->text[module->pc_starts[pc]];
+    for (int i = 0; i < module->pc_lens[pc]; i++, inst++) {
+      FormatMark mark = format_mark();
+      c_cfg_emit_inst(inst);
+      format_release(mark);
+    }
+  }
+  emit_line("pc = %d;", end);
+  emit_line("goto leave;");
+
+  c_cfg_emit_dispatch(start, end);
+
+  emit_line("");
+  emit_line("leave:");
+  for (int i = 0; i < 6; i++)
+    emit_line("reg[%d] = %s;", i, reg_names[i]);
   dec_indent();
   emit_line("}");
+}
 
+// Calls the function of pc by a binary search over functions lo to hi.
+static void c_cfg_emit_call(int lo, int hi) {
+  if (lo + 1 == hi) {
+    emit_line("func%d();", lo);
+    return;
+  }
+  int mid = (lo + hi) / 2;
+  emit_line("if (pc < %d) {", c_cfg_plan->starts[mid]);
+  inc_indent();
+  c_cfg_emit_call(lo, mid);
+  dec_indent();
+  emit_line("} else {");
+  inc_indent();
+  c_cfg_emit_call(mid, hi);
+  dec_indent();
+  emit_line("}");
+}
+
+void target_c_cfg(Module* module) {
+  CFG* cfg = build_cfg(module);
+  c_cfg_find_labels(cfg);
+
+  emit_line("#include <stdio.h>");
+  emit_line("#include <stdlib.h>");
+  emit_line("#include <string.h>");
+  emit_line("unsigned int reg[6], pc;");
+  c_emit_vregs(module);
+  emit_line("unsigned int mem[1<<24];");
+
+  int num_funcs = c_cfg_plan->num_funcs;
+  for (int i = 0; i < num_funcs; i++)
+    c_cfg_emit_func(module, i);
+
+  c_emit_data(module);
+  emit_line("int main() {");
+  inc_indent();
+  emit_line("memcpy(mem, mem_init, sizeof(mem_init));");
+  emit_line("");
+  emit_line("while (pc < %d) {", module->num_pcs);
+  inc_indent();
+  if (num_funcs)
+    c_cfg_emit_call(0, num_funcs);
+  dec_indent();
+  emit_line("}");
   emit_line("return 1;");
   dec_indent();
   emit_line("}");
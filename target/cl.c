@@ -5,15 +5,18 @@ static void init_state_cl(Data* data) {
   emit_line("(declaim (optimize (debug 0) (safety 0) (speed 3)))");
   emit_line("(defpackage #:elvm-compiled (:use #:cl) (:export #:elvm-main))");
   emit_line("(in-package #:elvm-compiled)");
+  emit_line("(deftype elvm-word () '(unsigned-byte 24))");
   for (int i = 0; i < 7; i++) {
-    emit_line("(defvar %s 0)", reg_names[i]);
+    emit_line("(defvar elvm-%s 0)", reg_names[i]);
   }
-  emit_line("(declaim (type fixnum");
-  for (int i = 0; i < 7; i++) {
-    emit_line(" %s", reg_names[i]);
+  emit_line("(declaim (type elvm-word");
+  for (int i = 0; i < 6; i++) {
+    emit_line(" elvm-%s", reg_names[i]);
   }
-  emit_line("))");
-  emit_line("(defvar mem nil)");
+  emit_line(") (type fixnum elvm-pc))");
+  emit_line("(declaim (type (simple-array (unsigned-byte 32) (16777216)) mem))");
+  emit_line("(defvar mem (make-array 16777216"
+            " :element-type '(unsigned-byte 32) :initial-element 0))");
   emit_line("(defparameter mem-init '(");
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
@@ -26,10 +29,23 @@ static void init_state_cl(Data* data) {
   emit_line("(defvar elvm-output nil)");
 }
 
+// Registers are lexical variables in each chunk, loaded from the
+// elvm-* specials on entry and stored back on exit.
 static void cl_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("(defun elvm-func%d ()", func_id);
   inc_indent();
+  emit_line("(let (");
+  for (int i = 0; i < 7; i++) {
+    emit_line(" (%s elvm-%s)", reg_names[i], reg_names[i]);
+  }
+  emit_line(")");
+  inc_indent();
+  emit_line("(declare (type elvm-word");
+  for (int i = 0; i < 6; i++) {
+    emit_line(" %s", reg_names[i]);
+  }
+  emit_line(") (type fixnum pc))");
   emit_line("(loop while (and (<= %d pc) (< pc %d) elvm-running) do",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -44,6 +60,11 @@ static void cl_emit_func_epilogue(void) {
   emit_line("(setq pc (+ pc 1))");
   dec_indent();
   emit_line(")");
+  for (int i = 0; i < 7; i++) {
+    emit_line("(setq elvm-%s %s)", reg_names[i], reg_names[i]);
+  }
+  dec_indent();
+  emit_line(")");
   dec_indent();
   emit_line(")");
 }
@@ -164,21 +185,23 @@ void target_cl(Module* module) {
   emit_line("(setq elvm-input input-stream)");
   emit_line("(setq elvm-output output-stream)");
   for (int i = 0; i < 7; i++) {
-    emit_line("(setq %s 0)", reg_names[i]);
+    emit_line("(setq elvm-%s 0)", reg_names[i]);
   }
-  emit_line("(setq mem (make-array 16777216 :element-type 'fixnum :initial-element 0))");
+  emit_line("(fill mem 0)");
   emit_line("(dolist (p mem-init)");
   emit_line(" (setf (aref mem (car p)) (cdr p)))");
   emit_line("(setq elvm-running t)");
-  emit_line("(loop while elvm-running do");
-  inc_indent();
-  emit_line("(case (truncate pc %d)", CHUNKED_FUNC_SIZE);
-  inc_indent();
+  // A vector of the functions, as case may test every function in turn.
+  emit_line("(let ((funcs (vector");
   for (int i = 0; i < num_funcs; i++) {
-    emit_line("(%d (elvm-func%d))", i, i);
+    emit_line("              #'elvm-func%d", i);
   }
-  emit_line(")))");
-  dec_indent();
+  emit_line("              )))");
+  inc_indent();
+  emit_line("(declare (type simple-vector funcs))");
+  emit_line("(loop while elvm-running do");
+  emit_line(" (funcall (the function (svref funcs (truncate elvm-pc %d)))))))",
+            CHUNKED_FUNC_SIZE);
   dec_indent();
   dec_indent();
   emit_line("(elvm-main)");
@@ -3,6 +3,15 @@
 
 size_t BUF_SIZE = 10000;
 
+// Set by elc -cpp20. Runs the program in a consteval function over a
+// std::array memory which holds the data, the heap and the stack
+// folded below it, CPP20_HEAP_SIZE words in all past _edata, rounded
+// up to a power of two. Each chunk of pcs is a constexpr function, so
+// a jump scans only its own switch.
+bool CPP20_CONSTEVAL;
+// The words past _edata, set by elc -cpp-mem=.
+int CPP20_HEAP_SIZE = 1 << 16;
+
 static void cpp_defs(void) {
   emit_line("#include <cstdio>");
   emit_line("#include <utility>");
@@ -150,7 +159,164 @@ void cpp_emit_main_loop(Inst* inst) {
   }
 }
 
+static const char* CPP20_REG_NAMES[] = {
+  "s.a", "s.b", "s.c", "s.d", "s.bp", "s.sp", "s.pc"
+};
+
+static void cpp20_defs(Data* data) {
+  int data_size = 0;
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v)
+      data_size = mp + 1;
+  }
+  int mem_size = 1;
+  while (mem_size < (1 << 24) && mem_size < data_size + CPP20_HEAP_SIZE)
+    mem_size <<= 1;
+
+  emit_line("#include <array>");
+  emit_line("#include <cstdio>");
+  emit_line("");
+  emit_line("constexpr unsigned int BUF_SIZE = %d;", (int)BUF_SIZE);
+  emit_line("constexpr unsigned int MEM_MASK = %d;", mem_size - 1);
+  emit_line("");
+  emit_line("constexpr char input[] =");
+  emit_line("#include \"input.txt\"");
+  emit_line(";");
+  emit_line("");
+  emit_line("struct buffer {");
+  emit_line(" unsigned int size;");
+  emit_line(" std::array<unsigned char, BUF_SIZE> b;");
+  emit_line("};");
+  emit_line("");
+  emit_line("struct state {");
+  emit_line(" unsigned int a, b, c, d, bp, sp, pc;");
+  emit_line(" unsigned int i_cur;");
+  emit_line(" bool running;");
+  emit_line(" std::array<unsigned int, MEM_MASK + 1> mem;");
+  emit_line(" buffer out;");
+  emit_line("};");
+}
+
+// An address in the folded memory, masked when compiling if it's an
+// immediate.
+static const char* cpp20_addr_str(Value* v) {
+  if (v->type == REG)
+    return format("%s & MEM_MASK", reg_names[v->reg]);
+  return format("%d & MEM_MASK", v->imm);
+}
+
+static void cpp20_emit_func_prologue(int func_id) {
+  emit_line("");
+  emit_line("constexpr void func%d(state& s) {", func_id);
+  inc_indent();
+  emit_line("while (%d <= s.pc && s.pc < %d) {",
+            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+  inc_indent();
+  emit_line("switch (s.pc) {");
+  inc_indent();
+}
+
+static void cpp20_emit_func_epilogue(void) {
+  dec_indent();
+  emit_line("}");
+  emit_line("s.pc++;");
+  dec_indent();
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+}
+
+static void cpp20_emit_inst(Inst* inst) {
+  switch (inst->op) {
+  case LOAD:
+    emit_line("%s = s.mem[%s];",
+              reg_names[inst->dst.reg], cpp20_addr_str(&inst->src));
+    break;
+
+  case STORE:
+    emit_line("s.mem[%s] = %s;",
+              cpp20_addr_str(&inst->src), reg_names[inst->dst.reg]);
+    break;
+
+  case PUTC:
+    emit_line("if (s.out.size < BUF_SIZE) s.out.b[s.out.size++] = %s;",
+              src_str(inst));
+    break;
+
+  case GETC:
+    emit_line("%s = (input[s.i_cur] ? (unsigned char)input[s.i_cur++] : 0);",
+              reg_names[inst->dst.reg]);
+    break;
+
+  case EXIT:
+    emit_line("s.running = false;");
+    emit_line("return;");
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP:
+    emit_line("if (%s) s.pc = %s - 1;",
+              cmp_str(inst, "1"), value_str(&inst->jmp));
+    break;
+
+  default:
+    cpp_emit_inst(inst);
+  }
+}
+
+static void target_cpp20(Module* module) {
+  reg_names = CPP20_REG_NAMES;
+  cpp20_defs(module->data);
+
+  int num_funcs = emit_chunked_main_loop(module->text,
+                                         cpp20_emit_func_prologue,
+                                         cpp20_emit_func_epilogue,
+                                         cpp_emit_pc_change,
+                                         cpp20_emit_inst);
+
+  emit_line("");
+  emit_line("consteval buffer consteval_main() {");
+  inc_indent();
+  emit_line("state s{};");
+  emit_line("s.running = true;");
+  int mp = 0;
+  for (Data* data = module->data; data; data = data->next, mp++) {
+    if (data->v) {
+      emit_line("s.mem[%d] = %d;", mp, data->v);
+    }
+  }
+  emit_line("while (s.running) {");
+  inc_indent();
+  emit_line("switch (s.pc / %d) {", CHUNKED_FUNC_SIZE);
+  for (int i = 0; i < num_funcs; i++) {
+    emit_line("case %d: func%d(s); break;", i, i);
+  }
+  emit_line("default: s.running = false;");
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+  emit_line("return s.out;");
+  dec_indent();
+  emit_line("}");
+
+  emit_line("");
+  emit_line("int main() {");
+  emit_line(" constexpr buffer buf = consteval_main();");
+  emit_line(" fwrite(buf.b.data(), 1, buf.size, stdout);");
+  emit_line("}");
+}
+
 void target_cpp(Module* module) {
+  if (CPP20_CONSTEVAL) {
+    target_cpp20(module);
+    return;
+  }
+
   cpp_defs();
   emit_line("");
   emit_line("constexpr buffer constexpr_main() {");
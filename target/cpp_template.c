@@ -6,96 +6,97 @@ static void cpp_template_emit_file_prologue(void) {
   emit_line("#include <cstdio>");
   emit_line("");
   emit_line(cpp_template_lib);
-  emit_line("");
-  emit_line("typedef enum { a, b, c, d, bp, sp } Reg_Name;");
 }
 
-static const char* cpp_template_op_str(Inst* inst) {
-  const char * op_str;
-  const char * src_str = inst->src.type == REG ? "reg" : "imm";
-  switch (inst->op) {
-  case MOV:
-    op_str = "mov"; break;
-  case ADD:
-    op_str = "add"; break;
-  case SUB:
-    op_str = "sub"; break;
-  case LOAD:
-    op_str = "load"; break;
-  case STORE:
-    op_str = "store"; break;
-  case PUTC:
-    op_str = "putc"; break;
-  case EQ:
-  case NE:
-  case LT:
-  case GT:
-  case LE:
-  case GE:
-    op_str = "cmp"; break;
-  case JEQ:
-  case JNE:
-  case JLT:
-  case JGT:
-  case JLE:
-  case JGE:
-    op_str = "jcmp"; break;
-  default:
-    error("oops");
-  }
-  return format("%s_%s", op_str, src_str);
+// Each block is one specialization of block<env, pc>, which computes
+// its registers as a run of constants, keeps its stores in a list which
+// its loads look at first, and applies them to the memory at its end.
+// The version of each register, the input cursor, the stores and the
+// output buffer count up within the block, as a0, a1, ... and so on.
+static int cpp_template_regs[6];
+static int cpp_template_in;
+static int cpp_template_st;
+static int cpp_template_buf;
+// The pc after the block, and whether it exits.
+static const char* cpp_template_next_pc;
+static bool cpp_template_exited;
+
+static const char* cpp_template_reg(Reg r) {
+  return format("%s%d", reg_names[r], cpp_template_regs[r]);
 }
 
+static const char* cpp_template_value(Value* v) {
+  if (v->type == REG)
+    return cpp_template_reg(v->reg);
+  return format("%d", v->imm);
+}
 
-int reg_id = 0;
-int mem_id = 0;
-int buf_id = 0;
-int exit_flag = 0;
+static const char* cpp_template_src(Inst* inst) {
+  return cpp_template_value(&inst->src);
+}
+
+// Defines the next version of the register r as v.
+static void cpp_template_set_reg(Reg r, const char* v) {
+  cpp_template_regs[r]++;
+  emit_line("static const int %s = %s;", cpp_template_reg(r), v);
+}
+
+static const char* cpp_template_cmp_str(Inst* inst) {
+  static const char* ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+  int op = inst->op >= JEQ && inst->op <= JGE ? inst->op - JEQ : inst->op - EQ;
+  return format("%s %s %s", cpp_template_reg(inst->dst.reg), ops[op],
+                cpp_template_src(inst));
+}
 
 static void cpp_template_emit_inst(Inst* inst) {
+  if (cpp_template_exited)
+    return;
   switch (inst->op) {
   case MOV:
+    cpp_template_set_reg(inst->dst.reg, cpp_template_src(inst));
+    break;
+
   case ADD:
   case SUB:
-    emit_line("typedef %s<r%d, %s, %s> r%d;",
-              cpp_template_op_str(inst),
-              reg_id, reg_names[inst->dst.reg], src_str(inst), reg_id + 1);
-    reg_id++;
+    cpp_template_set_reg(inst->dst.reg,
+                         format("(%s %s %s) & (MEM_SIZE - 1)",
+                                cpp_template_reg(inst->dst.reg),
+                                inst->op == ADD ? "+" : "-",
+                                cpp_template_src(inst)));
     break;
 
   case LOAD:
-    emit_line("typedef %s<r%d, m%d, %s, %s> r%d;",
-              cpp_template_op_str(inst),
-              reg_id, mem_id, reg_names[inst->dst.reg], src_str(inst), reg_id + 1);
-    reg_id++;
+    cpp_template_set_reg(inst->dst.reg,
+                         format("load_pending<typename env::mem, st%d, "
+                                "(%s) & (MEM_SIZE - 1)>::val",
+                                cpp_template_st, cpp_template_src(inst)));
     break;
 
   case STORE:
-    emit_line("typedef %s<r%d, m%d, %s, %s> m%d;",
-              cpp_template_op_str(inst),
-              reg_id, mem_id, reg_names[inst->dst.reg], src_str(inst), mem_id + 1);
-    mem_id++;
+    emit_line("typedef cons<Store<(%s) & (MEM_SIZE - 1), %s>, st%d> st%d;",
+              cpp_template_src(inst), cpp_template_reg(inst->dst.reg),
+              cpp_template_st, cpp_template_st + 1);
+    cpp_template_st++;
     break;
 
   case PUTC:
-    emit_line("typedef %s<r%d, b%d,%s> b%d;",
-              cpp_template_op_str(inst),
-              reg_id, buf_id, src_str(inst), buf_id + 1);
-    buf_id++;
+    emit_line("typedef cons<Int<%s>, buf%d> buf%d;",
+              cpp_template_src(inst), cpp_template_buf, cpp_template_buf + 1);
+    cpp_template_buf++;
     break;
 
   case GETC:
-    emit_line("typedef getc_reg<r%d, %s> r%d;",
-              reg_id, reg_names[inst->dst.reg], reg_id + 1);
-    reg_id++;
+    cpp_template_set_reg(inst->dst.reg,
+                         format("input[in%d] & (MEM_SIZE - 1)",
+                                cpp_template_in));
+    emit_line("static const int in%d = in%d + (input[in%d] ? 1 : 0);",
+              cpp_template_in + 1, cpp_template_in, cpp_template_in);
+    cpp_template_in++;
     break;
 
   case EXIT:
-    emit_line("typedef exit_inst<r%d> r%d;",
-              reg_id, reg_id + 1);
-    exit_flag = 1;
-    reg_id++;
-    return;
+    cpp_template_exited = true;
+    break;
 
   case DUMP:
     break;
@@ -106,14 +107,8 @@ static void cpp_template_emit_inst(Inst* inst) {
   case GT:
   case LE:
   case GE:
-    emit_line("typedef %s<r%d, %s, %s, %d> r%d;",
-              cpp_template_op_str(inst),
-              reg_id,
-              reg_names[inst->dst.reg],
-              src_str(inst),
-              inst->op - EQ,
-              reg_id + 1);
-    reg_id++;
+    cpp_template_set_reg(inst->dst.reg,
+                         format("(%s) ? 1 : 0", cpp_template_cmp_str(inst)));
     break;
 
   case JEQ:
@@ -122,101 +117,166 @@ static void cpp_template_emit_inst(Inst* inst) {
   case JGT:
   case JLE:
   case JGE:
-    emit_line("typedef %s<r%d, %s - 1, %s, %s, %d> r%d;",
-              cpp_template_op_str(inst),
-              reg_id,
-              value_str(&inst->jmp),
-              reg_names[inst->dst.reg],
-              src_str(inst),
-              inst->op - JEQ,
-              reg_id + 1);
-    reg_id++;
+    cpp_template_next_pc = format("(%s) ? %s : %s",
+                                  cpp_template_cmp_str(inst),
+                                  cpp_template_value(&inst->jmp),
+                                  cpp_template_next_pc);
     break;
 
   case JMP:
-    emit_line("typedef jmp_%s<r%d, %s> r%d;",
-              inst->jmp.type == REG ? "reg" : "imm",
-              reg_id, value_str(&inst->jmp), reg_id + 1);
-    reg_id++;
+    cpp_template_next_pc = cpp_template_value(&inst->jmp);
     break;
 
   default:
     error("oops");
   }
-  return;
 }
 
-static void cpp_template_emit_pc_change(int pc) {
-  emit_line("typedef inc_pc<r%d, m%d, b%d> result;", reg_id, mem_id, buf_id);
-  dec_indent();
-  emit_line("};");
+static void cpp_template_emit_block_prologue(int pc) {
   emit_line("");
-  emit_line("template <typename r0, typename m0, typename b0>");
-  emit_line("struct func_switch_impl<r0, m0, b0, %d> {", pc);
+  emit_line("template <typename env>");
+  emit_line("struct block<env, %d> {", pc);
   inc_indent();
+  for (int i = 0; i < 6; i++) {
+    cpp_template_regs[i] = 0;
+    emit_line("static const int %s0 = env::regs::%s;",
+              reg_names[i], reg_names[i]);
+  }
+  emit_line("static const int in0 = env::regs::input_cur;");
+  emit_line("typedef Nil st0;");
+  emit_line("typedef typename env::buf buf0;");
+  cpp_template_in = 0;
+  cpp_template_st = 0;
+  cpp_template_buf = 0;
+  cpp_template_next_pc = format("%d", pc + 1);
+  cpp_template_exited = false;
 }
 
-static void cpp_template_emit_func_epilogue() {
-  emit_line("typedef inc_pc<r%d, m%d, b%d> result;", reg_id, mem_id, buf_id);
+static void cpp_template_emit_block_epilogue(void) {
+  const char* regs = "";
+  for (int i = 0; i < 6; i++)
+    regs = format("%s%s, ", regs, cpp_template_reg(i));
+  emit_line("typedef regs_tuple<%s%s, in%d, %s> regs;",
+            regs, cpp_template_next_pc, cpp_template_in,
+            cpp_template_exited ? "true" : "false");
+  emit_line("typedef typename apply_stores<typename env::mem, st%d>::result "
+            "mem;", cpp_template_st);
+  emit_line("typedef make_env<regs, mem, buf%d> result;", cpp_template_buf);
   dec_indent();
   emit_line("};");
-  emit_line("");
-  emit_line("template <typename env, int pc>");
-  emit_line("struct func_switch : func_switch_impl<"
-            "typename env::regs, typename env::mem, "
-            "typename env::buf, pc>::result {};");
 }
 
-void cpp_template_emit_func_switch_impl(Inst* inst) {
-  int prev_pc = 0;
-  emit_line("template <typename r0, typename m0, typename b0, int pc>");
-  emit_line("struct func_switch_impl { typedef inc_pc<r0, m0, b0> result; };");
-  emit_line("");
-  emit_line("template <typename r0, typename m0, typename b0>");
-  emit_line("struct func_switch_impl<r0, m0, b0, 0> {");
+static void cpp_template_emit_blocks(Inst* inst) {
+  emit_line("// A block with no instructions falls through.");
+  emit_line("template <typename env, int pc>");
+  emit_line("struct block {");
   inc_indent();
-  for (; inst; inst = inst->next) {
-    if (prev_pc != inst->pc) {
-      cpp_template_emit_pc_change(inst->pc);
-      reg_id = 0;
-      mem_id = 0;
-      buf_id = 0;
-      exit_flag = 0;
+  emit_line("typedef typename update_pc<typename env::regs, pc + 1>::result "
+            "regs;");
+  emit_line("typedef make_env<regs, typename env::mem, typename env::buf> "
+            "result;");
+  dec_indent();
+  emit_line("};");
+  for (int pc = -1; inst; inst = inst->next) {
+    if (pc != inst->pc) {
+      if (pc >= 0)
+        cpp_template_emit_block_epilogue();
+      pc = inst->pc;
+      cpp_template_emit_block_prologue(pc);
     }
-    prev_pc = inst->pc;
-
     cpp_template_emit_inst(inst);
+    if (!inst->next)
+      cpp_template_emit_block_epilogue();
   }
-  cpp_template_emit_func_epilogue();
 }
 
+// The main loop runs 1, 2, 4, ... blocks per level until the program
+// exits, so the instantiation depth grows with the log of the steps.
+// Past EXIT a step is the identity, which is instantiated only once.
 static void cpp_template_emit_main_loop(void) {
-  emit_line("template <typename env, bool, int>");
-  emit_line("struct main_loop { typedef env result; };");
-  emit_line("template <typename env, int pc>");
-  emit_line("struct main_loop<env, false, pc> {");
+  emit_line("template <typename env, bool exited = env::regs::exit_flag>");
+  emit_line("struct step : block<env, env::regs::pc> {};");
+  emit_line("template <typename env>");
+  emit_line("struct step<env, true> { typedef env result; };");
+  emit_line("");
+  emit_line("template <typename env, int k>");
+  emit_line("struct run_blocks {");
+  inc_indent();
+  emit_line("typedef typename run_blocks<env, k - 1>::result half;");
+  emit_line("typedef typename run_blocks<half, k - 1>::result result;");
+  dec_indent();
+  emit_line("};");
+  emit_line("template <typename env>");
+  emit_line("struct run_blocks<env, 0> : step<env> {};");
+  emit_line("");
+  emit_line("template <typename env, int k, "
+            "bool exited = env::regs::exit_flag>");
+  emit_line("struct main_loop {");
   inc_indent();
-  emit_line("typedef func_switch<env, pc> env2;");
-  emit_line("typedef typename main_loop<env2, env2::regs::exit_flag, env2::regs::pc>::result result;");
+  emit_line("typedef typename run_blocks<env, k>::result env2;");
+  emit_line("typedef typename main_loop<env2, k + 1>::result result;");
+  dec_indent();
+  emit_line("};");
+  emit_line("template <typename env, int k>");
+  emit_line("struct main_loop<env, k, true> { typedef env result; };");
+}
+
+// MEM_DEPTH of the library.
+#define CPP_TEMPLATE_MEM_DEPTH 16
+
+static Data* cpp_template_skip_data(Data* data, int n) {
+  for (int i = 0; i < n && data; i++)
+    data = data->next;
+  return data;
+}
+
+static bool cpp_template_is_zero(Data* data, int n) {
+  for (int i = 0; i < n && data; i++, data = data->next) {
+    if (data->v)
+      return false;
+  }
+  return true;
+}
+
+// Emits the subtree of the 2^depth words from data, sharing mk_tree
+// for the ones which are all zero.
+static void cpp_template_emit_data_tree(Data* data, int depth) {
+  if (cpp_template_is_zero(data, 1 << depth)) {
+    emit_line("mk_tree<%d>", depth);
+  } else if (depth == 0) {
+    emit_line("Leaf<Int<%d>>", data->v);
+  } else {
+    int half = 1 << (depth - 1);
+    emit_line("Node<Int<%d>,", depth);
+    inc_indent();
+    cpp_template_emit_data_tree(data, depth - 1);
+    emit_line(",");
+    cpp_template_emit_data_tree(cpp_template_skip_data(data, half), depth - 1);
+    dec_indent();
+    emit_line(">");
+  }
+}
+
+// The memory with the data in it, built as one balanced tree rather
+// than a store_value per word.
+static void cpp_template_emit_data_memory(Data* data) {
+  emit_line("struct data_memory {");
+  inc_indent();
+  emit_line("static const int depth = MEM_DEPTH;");
+  emit_line("typedef");
+  cpp_template_emit_data_tree(data, CPP_TEMPLATE_MEM_DEPTH);
+  emit_line("tree;");
   dec_indent();
   emit_line("};");
 }
 
 static void cpp_template_emit_calc_main(Data* data) {
+  cpp_template_emit_data_memory(data);
+  emit_line("");
   emit_line("struct calc_main {");
   inc_indent();
-  emit_line("typedef init_memory<MEM_SIZE> mem0;");
-  int mp;
-  for (mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("typedef store_value<mem%d, %d, %d> mem%d;", mp, mp, data->v, mp + 1);
-    } else {
-      emit_line("typedef mem%d mem%d;", mp, mp + 1);
-    }
-  }
-  emit_line("typedef init_regs<0> regs;");
-  emit_line(" typedef make_env<regs, mem%d, Nil> env;", mp);
-  emit_line("typedef main_loop<env, false, 0>::result result;");
+  emit_line("typedef make_env<init_regs, data_memory, Nil> env;");
+  emit_line("typedef main_loop<env, 0>::result result;");
   dec_indent();
   emit_line("};");
 }
@@ -225,7 +285,7 @@ void target_cpp_template(Module* module) {
   cpp_template_emit_file_prologue();
   emit_line("");
 
-  cpp_template_emit_func_switch_impl(module->text);
+  cpp_template_emit_blocks(module->text);
   emit_line("");
 
   cpp_template_emit_main_loop();
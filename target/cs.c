@@ -1,21 +1,48 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
-static void cs_emit_func_prologue(int func_id) {
+// Each chunk of CHUNKED_FUNC_SIZE pcs is split into methods of up to
+// CS_METHOD_BUDGET estimated bytes of IL, well below the 60000 bytes
+// over which RyuJIT stops optimizing. A method keeps the registers in
+// locals and switches on dense case labels, which become an IL switch.
+// It returns to the chunk's dispatch loop when pc leaves its range.
+#define CS_METHOD_BUDGET 30000
+#define CS_MAX_METHODS 1024
+
+static int cs_func_id;
+static int cs_method_starts[CS_MAX_METHODS];
+static int cs_num_methods;
+static int cs_method_size;
+
+static void cs_emit_method_prologue(int pc) {
+  if (cs_num_methods == CS_MAX_METHODS)
+    error("too many methods in a chunk");
+  cs_method_starts[cs_num_methods] = pc;
+  cs_method_size = 0;
   emit_line("");
-  emit_line("private static void func%d() {", func_id);
+  emit_line("private static void func%d_%d() {",
+            cs_func_id, cs_num_methods++);
   inc_indent();
-  emit_line("while (%d <= pc && pc < %d) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+  for (int i = 0; i < 7; i++) {
+    emit_line("int %s = Program.%s;", reg_names[i], reg_names[i]);
+  }
+  emit_line("for (;;) {");
   inc_indent();
   emit_line("switch (pc) {");
-  emit_line("case -1:  /* dummy */");
+  emit_line("case %d:", pc);
   inc_indent();
 }
 
-static void cs_emit_func_epilogue(void) {
+static void cs_emit_method_epilogue(void) {
   emit_line("break;");
   dec_indent();
+  emit_line("default:");
+  inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("Program.%s = %s;", reg_names[i], reg_names[i]);
+  }
+  emit_line("return;");
+  dec_indent();
   emit_line("}");
   emit_line("pc++;");
   dec_indent();
@@ -24,7 +51,44 @@ static void cs_emit_func_epilogue(void) {
   emit_line("}");
 }
 
+static void cs_emit_func_prologue(int func_id) {
+  cs_func_id = func_id;
+  cs_num_methods = 0;
+}
+
+static void cs_emit_func_epilogue(void) {
+  cs_emit_method_epilogue();
+  emit_line("");
+  emit_line("private static void func%d() {", cs_func_id);
+  inc_indent();
+  emit_line("while (%d <= pc && pc < %d) {",
+            cs_func_id * CHUNKED_FUNC_SIZE,
+            (cs_func_id + 1) * CHUNKED_FUNC_SIZE);
+  inc_indent();
+  for (int i = 1; i < cs_num_methods; i++) {
+    emit_line("%sif (pc < %d) func%d_%d();",
+              i > 1 ? "else " : "", cs_method_starts[i],
+              cs_func_id, i - 1);
+  }
+  emit_line("%sfunc%d_%d();", cs_num_methods > 1 ? "else " : "",
+            cs_func_id, cs_num_methods - 1);
+  dec_indent();
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+}
+
 static void cs_emit_pc_change(int pc) {
+  if (cs_num_methods == 0) {
+    cs_emit_method_prologue(pc);
+    return;
+  }
+  if (cs_method_size > CS_METHOD_BUDGET) {
+    cs_emit_method_epilogue();
+    cs_emit_method_prologue(pc);
+    return;
+  }
+  cs_method_size += 8;
   emit_line("break;");
   emit_line("");
   dec_indent();
@@ -33,6 +97,7 @@ static void cs_emit_pc_change(int pc) {
 }
 
 static void cs_emit_inst(Inst* inst) {
+  cs_method_size += estimate_bytecode_size(inst);
   switch (inst->op) {
   case MOV:
     emit_line("%s = %s;", reg_names[inst->dst.reg], src_str(inst));
@@ -141,7 +206,6 @@ void target_cs(Module* module) {
 
   int num_inits = cs_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
   int num_funcs = emit_chunked_main_loop(module->text,
                                          cs_emit_func_prologue,
                                          cs_emit_func_epilogue,
@@ -2,10 +2,20 @@
 #include <target/util.h>
 
 static void init_state_el(Data* data) {
+  emit_line(";; -*- lexical-binding: t -*-");
+  for (int i = 0; i < 7; i++) {
+    emit_line("(defvar elvm-%s 0)", reg_names[i]);
+  }
+  emit_line("(defvar mem nil)");
+  emit_line("(defvar elvm-running nil)");
+  emit_line("(defvar elvm-input nil)");
+  emit_line("(defvar elvm-input-pos 0)");
+  emit_line("(defvar elvm-output nil)");
   emit_line("(setq elvm-main (lambda ()");
   emit_line("(load \"cl\" nil t)");
+  emit_line("(setq elvm-input-pos 0)");
   for (int i = 0; i < 7; i++) {
-    emit_line("(setq %s 0)", reg_names[i]);
+    emit_line("(setq elvm-%s 0)", reg_names[i]);
   }
   emit_line("(setq mem (make-vector 16777216 0))");
   for (int mp = 0; data; data = data->next, mp++) {
@@ -15,10 +25,22 @@ static void init_state_el(Data* data) {
   }
 }
 
+// Registers are lexical variables in each chunk, loaded from the
+// elvm-* globals on entry and stored back on exit, and the chunk is
+// byte-compiled once it is defined.
+static int el_func_id;
+
 static void el_emit_func_prologue(int func_id) {
+  el_func_id = func_id;
   emit_line("");
   emit_line("(defun elvm-func%d ()", func_id);
   inc_indent();
+  emit_line("(let (");
+  for (int i = 0; i < 7; i++) {
+    emit_line(" (%s elvm-%s)", reg_names[i], reg_names[i]);
+  }
+  emit_line(")");
+  inc_indent();
   emit_line("(while (and (<= %d pc) (< pc %d) elvm-running)",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -33,8 +55,14 @@ static void el_emit_func_epilogue(void) {
   emit_line("(setq pc (+ pc 1))");
   dec_indent();
   emit_line(")");
+  for (int i = 0; i < 7; i++) {
+    emit_line("(setq elvm-%s %s)", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line(")");
+  dec_indent();
+  emit_line(")");
+  emit_line("(byte-compile 'elvm-func%d)", el_func_id);
 }
 
 static void el_emit_pc_change(int pc) {
@@ -143,29 +171,34 @@ void target_el(Module* module) {
                                          el_emit_pc_change,
                                          el_emit_inst);
 
+  // A vector of the functions, as this loop isn't byte-compiled and an
+  // interpreted cl-case tests every function in turn.
   emit_line("");
-  emit_line("(while elvm-running");
-  inc_indent();
-  emit_line("(cl-case (/ pc %d)", CHUNKED_FUNC_SIZE);
+  emit_line("(let ((funcs (vector");
   for (int i = 0; i < num_funcs; i++) {
-    emit_line("(%d (elvm-func%d))", i, i);
+    emit_line("              'elvm-func%d", i);
   }
-  emit_line(")");
+  emit_line("              )))");
+  inc_indent();
+  emit_line("(while elvm-running");
+  emit_line(" (funcall (aref funcs (/ elvm-pc %d)))))", CHUNKED_FUNC_SIZE);
   dec_indent();
-  emit_line(")");
 
   emit_line("))");
 
+  // The input is read at an index rather than by taking substrings,
+  // and the output is kept as a reversed list of characters, which is
+  // printed at once at the end, so neither is copied per character.
   emit_line("(defun getchar ()");
-  emit_line(" (if (eq (length elvm-input) 0) 0");
-  emit_line("  (setq r (string-to-char elvm-input))");
-  emit_line("  (setq elvm-input (substring elvm-input 1))");
-  emit_line("  r))");
+  emit_line(" (if (>= elvm-input-pos (length elvm-input)) 0");
+  emit_line("  (prog1 (aref elvm-input elvm-input-pos)");
+  emit_line("   (setq elvm-input-pos (1+ elvm-input-pos)))))");
   emit_line("(if noninteractive (progn");
   emit_line(" (setq elvm-input");
   emit_line("  (with-temp-buffer");
   emit_line("   (insert-file-contents \"/dev/stdin\")");
   emit_line("   (buffer-string)))");
-  emit_line(" (defun putchar (c) (princ (char-to-string c)))");
-  emit_line(" (funcall elvm-main)))");
+  emit_line(" (defun putchar (c) (push c elvm-output))");
+  emit_line(" (funcall elvm-main)");
+  emit_line(" (princ (concat (nreverse elvm-output)))))");
 }
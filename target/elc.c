@@ -1,96 +1,455 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if !defined(NOFILE) && !defined(__eir__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
+#include <ir/intrinsic.h>
 #include <ir/ir.h>
+#include <ir/lower.h>
+#include <ir/mask.h>
+#include <ir/opt.h>
+#include <target/targets.h>
 #include <target/util.h>
 
-void target_arm(Module* module);
-void target_asmjs(Module* module);
-void target_bef(Module* module);
-void target_bf(Module* module);
-void target_c(Module* module);
-void target_cl(Module* module);
-void target_cpp(Module* module);
-void target_cpp_template(Module* module);
-void target_cr(Module* module);
-void target_cs(Module* module);
-void target_el(Module* module);
-void target_forth(Module* module);
-void target_fs(Module* module);
-void target_go(Module* module);
-void target_i(Module* module);
-void target_java(Module* module);
-void target_js(Module* module);
-void target_lua(Module* module);
-void target_ll(Module* module);
-void target_php(Module* module);
-void target_piet(Module* module);
-void target_pietasm(Module* module);
-void target_pl(Module* module);
-void target_py(Module* module);
-void target_ps(Module* module);
-void target_rb(Module* module);
-void target_scm_sr(Module* module);
-void target_sed(Module* module);
-void target_sh(Module* module);
-void target_sqlite3(Module* module);
-void target_swift(Module* module);
-void target_tex(Module* module);
-void target_tf(Module* module);
-void target_tm(Module* module);
-void target_unl(Module* module);
-void target_vim(Module* module);
-void target_ws(Module* module);
-void target_x86(Module* module);
-
-typedef void (*target_func_t)(Module*);
-
-static target_func_t get_target_func(const char* ext) {
-  if (!strcmp(ext, "arm")) return target_arm;
-  if (!strcmp(ext, "asmjs")) return target_asmjs;
-  if (!strcmp(ext, "bef")) return target_bef;
-  if (!strcmp(ext, "bf")) {
-    split_basic_block_by_mem();
-    return target_bf;
-  }
-  if (!strcmp(ext, "c")) return target_c;
-  if (!strcmp(ext, "cl")) return target_cl;
-  if (!strcmp(ext, "cpp")) return target_cpp;
-  if (!strcmp(ext, "cpp_template")) return target_cpp_template;
-  if (!strcmp(ext, "cr")) return target_cr;
-  if (!strcmp(ext, "cs")) return target_cs;
-  if (!strcmp(ext, "el")) return target_el;
-  if (!strcmp(ext, "forth")) return target_forth;
-  if (!strcmp(ext, "fs")) return target_fs;
-  if (!strcmp(ext, "go")) return target_go;
-  if (!strcmp(ext, "i")) return target_i;
-  if (!strcmp(ext, "java")) return target_java;
-  if (!strcmp(ext, "js")) return target_js;
-  if (!strcmp(ext, "lua")) return target_lua;
-  if (!strcmp(ext, "ll")) return target_ll;
-  if (!strcmp(ext, "php")) return target_php;
-  if (!strcmp(ext, "piet")) return target_piet;
-  if (!strcmp(ext, "pietasm")) return target_pietasm;
-  if (!strcmp(ext, "pl")) return target_pl;
-  if (!strcmp(ext, "py")) return target_py;
-  if (!strcmp(ext, "ps")) return target_ps;
-  if (!strcmp(ext, "rb")) return target_rb;
-  if (!strcmp(ext, "scm_sr")) return target_scm_sr;
-  if (!strcmp(ext, "sed")) return target_sed;
-  if (!strcmp(ext, "sh")) return target_sh;
-  if (!strcmp(ext, "sqlite3")) return target_sqlite3;
-  if (!strcmp(ext, "swift")) return target_swift;
-  if (!strcmp(ext, "tex")) return target_tex;
-  if (!strcmp(ext, "tf")) return target_tf;
-  if (!strcmp(ext, "tm")) return target_tm;
-  if (!strcmp(ext, "unl")) return target_unl;
-  if (!strcmp(ext, "vim")) return target_vim;
-  if (!strcmp(ext, "ws")) return target_ws;
-  if (!strcmp(ext, "x86")) return target_x86;
-  error("unknown flag: %s", ext);
+// Memory layout of target_bf, chosen by -bf-fold, and its 32-bit
+// cells, chosen by -bf-wide.
+extern bool BF_FOLD_MEM;
+extern bool BF_WIDE;
+// Shared LOAD and STORE rows in target_piet, chosen by -piet-share.
+extern bool PIET_SHARE_MEM;
+// A bash-only target_sh, chosen by -sh-bash.
+extern bool SH_BASH;
+// Bucketed memory in target_sed, chosen by -sed-bucket.
+extern bool SED_BUCKET_MEM;
+// A vim9script target_vim, chosen by -vim9.
+extern bool VIM9_SCRIPT;
+// A TF2 target_tf, chosen by -tf2.
+extern bool TF2_FUNCTION;
+// Count registers in target_tex, chosen by -tex-count.
+extern bool TEX_COUNT_REGS;
+// A C++20 consteval target_cpp, chosen by -cpp20, its output buffer
+// size, set by -cpp-out=, and its words past _edata, set by -cpp-mem=.
+extern bool CPP20_CONSTEVAL;
+extern size_t BUF_SIZE;
+extern int CPP20_HEAP_SIZE;
+// target_c as C_SPLIT_UNITS files of functions, a main.c and a Makefile
+// in C_SPLIT_DIR, chosen by -c-split= and -c-units=.
+extern const char* C_SPLIT_DIR;
+extern int C_SPLIT_UNITS;
+// target_js and target_asmjs as Web Workers, chosen by -js-worker, and
+// the compact output of target_js, chosen by -js-compact.
+extern bool JS_WORKER;
+extern bool JS_COMPACT;
+// A LuaJIT target_lua, chosen by -luajit.
+extern bool LUA_JIT;
+
+#if !defined(NOFILE) && !defined(__eir__)
+static bool is_streamable(target_func_t f) {
+  return (f == target_asmjs || f == target_c || f == target_cl ||
+          f == target_cr || f == target_cs || f == target_el ||
+          f == target_forth || f == target_fs || f == target_java ||
+          f == target_js || f == target_ll || f == target_lua ||
+          f == target_php || f == target_py || f == target_rb ||
+          f == target_swift || f == target_vim);
+}
+
+// Per-phase timings on stderr, chosen by -time.
+static bool g_time_phases;
+
+// The chunk cache directory, set by -cache=.
+static const char* g_cache_dir;
+
+// The inline budget of -inline=, or -1 for that of each backend.
+static int g_inline_budget = -1;
+
+// The profile of -profile=.
+static const char* g_profile_path;
+
+// Source locations in the output, chosen by -g.
+static bool g_debug_info;
+
+// -cold moves the cold blocks to chunks of their own.
+static bool g_split_cold;
+
+// -intrinsics runs known libc routines by extension ops.
+static bool g_intrinsics;
+
+// Reads the "pc entries" lines of eli --profile-out into the emitter,
+// for plan_chunks.
+static void load_pc_profile(const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s", path);
+  Emitter* e = cur_emitter();
+  int cap = 1024;
+  e->pc_counts = calloc(cap, sizeof(long));
+  char line[256];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    int pc;
+    long count;
+    if (sscanf(line, "%d %ld", &pc, &count) != 2 || pc < 0 || count < 0)
+      error("%s:%d: invalid profile line", path, lineno);
+    if (pc >= cap) {
+      int old = cap;
+      while (pc >= cap)
+        cap *= 2;
+      e->pc_counts = realloc(e->pc_counts, cap * sizeof(long));
+      memset(e->pc_counts + old, 0, (cap - old) * sizeof(long));
+    }
+    e->pc_counts[pc] = count;
+    if (pc >= e->num_pc_counts)
+      e->num_pc_counts = pc + 1;
+  }
+  fclose(fp);
+}
+
+// Makes emit_chunked_main_loop of the backend named name reuse the
+// functions in g_cache_dir. The key has every option above, and elc
+// itself, as a newer one may emit them differently.
+static void set_chunk_cache(const char* name, target_func_t f,
+                            Module* module) {
+  // The key doesn't have the source locations of -g.
+  if (!g_cache_dir || !has_cacheable_chunks(f) || g_debug_info)
+    return;
+  struct stat st;
+  if (stat("/proc/self/exe", &st))
+    memset(&st, 0, sizeof(st));
+  Emitter* e = cur_emitter();
+  e->chunk_cache_dir = g_cache_dir;
+  // The profile moves function boundaries, so its contents count too.
+  unsigned long profile_hash = 5381;
+  for (int pc = 0; pc < e->num_pc_counts; pc++)
+    profile_hash = profile_hash * 33 + e->pc_counts[pc] * 7 + pc;
+  // A backend may declare every global variable in each function.
+  unsigned long globals_hash = 5381;
+  if (module && module->global_vars) {
+    for (int i = 0; i < module->num_data; i++) {
+      if (module->global_vars[i])
+        globals_hash = globals_hash * 33 + i;
+    }
+  }
+  e->chunk_cache_salt = strdup(format(
+      "%s %ld.%ld %d%d%d%d%d%d%d%d%d%d%d %zu %d %d %d %d %lx %lx", name,
+      (long)st.st_size, (long)st.st_mtime, BF_FOLD_MEM, BF_WIDE,
+      PIET_SHARE_MEM, SH_BASH, SED_BUCKET_MEM, VIM9_SCRIPT, TF2_FUNCTION,
+      TEX_COUNT_REGS, CPP20_CONSTEVAL, JS_COMPACT, LUA_JIT, BUF_SIZE,
+      CPP20_HEAP_SIZE, MEM_MODEL, CHUNKED_FUNC_SIZE, BULK_DATA_MIN,
+      profile_hash, globals_hash));
+}
+
+// Runs the backend. With -time, its output goes through memory so the
+// bytes can be counted, and the report follows.
+static void run_backend(const char* name, target_func_t f, Module* module) {
+  if (g_debug_info)
+    cur_emitter()->src_module = module;
+  set_chunk_cache(name, f, module);
+  if (!g_time_phases) {
+    f(module);
+    return;
+  }
+  Emitter* e = cur_emitter();
+  FILE* out = e->out;
+  char* buf;
+  size_t len;
+  e->out = open_memstream(&buf, &len);
+  if (!e->out)
+    error("open_memstream failed");
+  char phase[64];
+  snprintf(phase, sizeof(phase), "emit_%s", name);
+  ir_phase_begin(phase);
+  f(module);
+  ir_phase_end();
+  fclose(e->out);
+  e->out = out;
+  fwrite(buf, 1, len, out);
+  free(buf);
+
+  fprintf(stderr, "=== elc -%s ===\n", name);
+  dump_ir_phases(stderr);
+  fprintf(stderr, "%zu bytes emitted, %ld format() calls\n",
+          len, e->num_formats);
+  if (e->chunk_cache_dir)
+    fprintf(stderr, "%d functions from %s\n",
+            e->num_cached_chunks, e->chunk_cache_dir);
+}
+
+// -z=gzip or -z=zstd pipes the output through the compressor, which
+// writes where stdout went. Either way stdout gets a large buffer, as
+// the output of some backends takes gigabytes.
+#define OUTPUT_BUF_SIZE (1 << 20)
+static const char* g_compressor;
+static pid_t g_compressor_pid;
+
+static void start_output_sink(void) {
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUF_SIZE);
+  if (!g_compressor)
+    return;
+  int fds[2];
+  if (pipe(fds))
+    error("pipe failed");
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork failed");
+  if (pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    // The fastest levels, as the point is to write less.
+    execlp(g_compressor, g_compressor, "-c", "-q", "-1", (char*)NULL);
+    fprintf(stderr, "cannot run %s\n", g_compressor);
+    _exit(127);
+  }
+  dup2(fds[1], STDOUT_FILENO);
+  close(fds[0]);
+  close(fds[1]);
+  g_compressor_pid = pid;
+}
+
+// Flushes the output and waits for the compressor to finish it.
+static void finish_output_sink(void) {
+  if (fflush(stdout))
+    error("failed to write the output");
+  if (!g_compressor_pid)
+    return;
+  fclose(stdout);
+  int status;
+  if (waitpid(g_compressor_pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status))
+    error("%s failed", g_compressor);
+  g_compressor_pid = 0;
+}
+
+// A backend and the file it writes, given as -<target>=<path>.
+typedef struct {
+  const char* name;
+  const char* path;
+} TargetJob;
+
+static void run_target_job(TargetJob* job, Module* module,
+                           const char* filename, bool optimize) {
+  if (!freopen(job->path, "w", stdout))
+    error("cannot open %s", job->path);
+  start_output_sink();
+  target_func_t target_func = get_target_func(job->name);
+  // target_bf parses with basic blocks split at memory accesses.
+  if (is_split_basic_block_by_mem()) {
+    module = load_eir_from_file(filename);
+    if (optimize)
+      optimize_module(module);
+  }
+  if (optimize && (get_native_ext_ops(target_func) & VREG_BIT))
+    promote_stack_slots(module);
+  ir_phase_begin("lower_ext_ops");
+  lower_ext_ops(module, get_native_ext_ops(target_func));
+  ir_phase_begin("mark_unmasked");
+  mark_unmasked(module->text);
+  if (optimize && (get_native_ext_ops(target_func) & GLOBAL_VAR_BIT))
+    find_global_vars(module);
+  run_backend(job->name, target_func, module);
+  finish_output_sink();
+}
+
+// Parses the EIR once and runs every backend in a forked worker, which
+// has its own copy of the module and of the backends' global state, so
+// they run concurrently without sharing anything.
+static void run_target_jobs(TargetJob* jobs, int num_jobs,
+                            const char* filename, bool optimize) {
+  Module* module = load_eir_from_file(filename);
+  if (g_intrinsics)
+    substitute_intrinsics(module);
+  // The module is optimized once for all, with the smallest budget.
+  int budget = g_inline_budget;
+  for (int i = 0; i < num_jobs && g_inline_budget < 0; i++) {
+    int b = get_inline_budget(get_target_func(jobs[i].name));
+    if (!i || b < budget)
+      budget = b;
+  }
+  set_inline_budget(budget);
+  if (optimize)
+    optimize_module(module);
+  fflush(stdout);
+  for (int i = 0; i < num_jobs; i++) {
+    pid_t pid = fork();
+    if (pid < 0)
+      error("fork failed");
+    if (pid == 0) {
+      run_target_job(&jobs[i], module, filename, optimize);
+      exit(0);
+    }
+  }
+  int num_failed = 0;
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      num_failed++;
+  }
+  if (num_failed)
+    error("%d of %d targets failed", num_failed, num_jobs);
+}
+
+int main(int argc, char* argv[]);
+
+// The most arguments a request of the server may have.
+#define SERVER_MAX_ARGS 64
+
+// Responds to a request the server can't run with status 1 and msg as
+// what it wrote to stderr.
+static void serve_error(FILE* out, const char* msg) {
+  fprintf(out, "0 1 %zu\n%s\n", strlen(msg) + 1, msg);
+  fflush(out);
 }
 
+// Compiles the requests read from in, writing the responses to out.
+// A request is a line of elc's arguments without the input file,
+// separated by spaces, a line with the size of the EIR in bytes and
+// the EIR. Each runs as elc would in a forked child, so the backends
+// always start from the state the server has, which never compiles
+// anything itself. The response is the output as it comes, in chunks
+// of a line with their size and the bytes, then a line "0 <exit status>
+// <size>" and that many bytes of what the child wrote to stderr. A
+// request with too many arguments or with --server is refused, and one
+// with a bad size ends the session after the error, as the rest of the
+// input can't be split into requests.
+static void serve(FILE* in, FILE* out) {
+  FILE* eir = tmpfile();
+  FILE* err = tmpfile();
+  if (!eir || !err)
+    error("tmpfile failed");
+  char* line = NULL;
+  size_t cap = 0;
+  char size_line[32];
+  char* buf = NULL;
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/fd/%d", fileno(eir));
+  while (getline(&line, &cap, in) > 0 &&
+         fgets(size_line, sizeof(size_line), in)) {
+    char* end;
+    long size = strtol(size_line, &end, 10);
+    if (end == size_line || (*end && *end != '\n') || size < 0) {
+      serve_error(out, "elc: bad request size");
+      break;
+    }
+    char* new_buf = realloc(buf, (size_t)size + 1);
+    if (!new_buf) {
+      serve_error(out, "elc: request too large");
+      break;
+    }
+    buf = new_buf;
+    if (fread(buf, 1, size, in) != (size_t)size)
+      break;
+    // The child shares the offsets of both files.
+    if (ftruncate(fileno(eir), 0) || ftruncate(fileno(err), 0))
+      error("ftruncate failed");
+    rewind(eir);
+    rewind(err);
+    fwrite(buf, 1, size, eir);
+    fflush(eir);
+
+    char* args[SERVER_MAX_ARGS + 2];
+    int num_args = 0;
+    const char* bad = NULL;
+    args[num_args++] = "elc";
+    for (char* tok = strtok(line, " \t\n"); tok && !bad;
+         tok = strtok(NULL, " \t\n")) {
+      if (num_args >= SERVER_MAX_ARGS)
+        bad = "elc: too many arguments";
+      else if (!strncmp(tok, "--server", 8))
+        bad = "elc: --server in a request";
+      else
+        args[num_args++] = tok;
+    }
+    if (bad) {
+      serve_error(out, bad);
+      continue;
+    }
+    args[num_args++] = path;
+    args[num_args] = NULL;
+
+    int fds[2];
+    if (pipe(fds))
+      error("pipe failed");
+    fflush(out);
+    pid_t pid = fork();
+    if (pid < 0)
+      error("fork failed");
+    if (pid == 0) {
+      // Keeps the child off the requests, even when it exits.
+      int null_fd = open("/dev/null", O_RDONLY);
+      dup2(null_fd, STDIN_FILENO);
+      close(null_fd);
+      dup2(fds[1], STDOUT_FILENO);
+      dup2(fileno(err), STDERR_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      exit(main(num_args, args));
+    }
+    close(fds[1]);
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+      fprintf(out, "%zd\n", n);
+      fwrite(chunk, 1, n, out);
+      fflush(out);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    long err_size = lseek(fileno(err), 0, SEEK_END);
+    fprintf(out, "0 %d %ld\n",
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128, err_size);
+    rewind(err);
+    while ((n = fread(chunk, 1, sizeof(chunk), err)) > 0)
+      fwrite(chunk, 1, n, out);
+    fflush(out);
+  }
+  free(line);
+  free(buf);
+  fclose(eir);
+  fclose(err);
+}
+
+// elc --server serves requests on stdin, and elc --server=<path> those
+// of each connection to a Unix socket at path, one after another.
+static int run_server(const char* path) {
+  if (!*path) {
+    serve(stdin, stdout);
+    return 0;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(sock, 16))
+    error("cannot listen on %s", path);
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0)
+      continue;
+    FILE* in = fdopen(conn, "r");
+    FILE* out = fdopen(dup(conn), "w");
+    serve(in, out);
+    fclose(in);
+    fclose(out);
+  }
+}
+#endif
+
 int main(int argc, char* argv[]) {
 #if defined(NOFILE) || defined(__eir__)
   char buf[32];
@@ -104,13 +463,113 @@ int main(int argc, char* argv[]) {
   }
   target_func_t target_func = get_target_func(buf);
   Module* module = load_eir(stdin);
+  lower_ext_ops(module, get_native_ext_ops(target_func));
+  mark_unmasked(module->text);
+  target_func(module);
 #else
+  if (argc == 2 && !strncmp(argv[1], "--server", 8) &&
+      (!argv[1][8] || argv[1][8] == '='))
+    return run_server(argv[1][8] ? argv[1] + 9 : "");
   target_func_t target_func = NULL;
+  const char* target_name = NULL;
   const char* filename = NULL;
+  bool optimize = false;
+  TargetJob* jobs = calloc(argc, sizeof(TargetJob));
+  int num_jobs = 0;
   for (int i = 1; i < argc; i++) {
     const char* arg = argv[i];
-    if (arg[0] == '-') {
-      target_func = get_target_func(arg + 1);
+    if (!strcmp(arg, "-O")) {
+      optimize = true;
+      prune_unreachable();
+      merge_strings();
+    } else if (!strcmp(arg, "-merge-strings")) {
+      merge_strings();
+    } else if (!strcmp(arg, "-g")) {
+      g_debug_info = true;
+    } else if (!strcmp(arg, "-cold")) {
+      g_split_cold = true;
+    } else if (!strcmp(arg, "-intrinsics")) {
+      g_intrinsics = true;
+    } else if (!strncmp(arg, "-z=", 3)) {
+      g_compressor = arg + 3;
+      if (strcmp(g_compressor, "gzip") && strcmp(g_compressor, "zstd"))
+        error("unknown compressor: %s", g_compressor);
+    } else if (!strcmp(arg, "-time")) {
+      g_time_phases = true;
+      enable_ir_phases();
+    } else if (!strcmp(arg, "-bf-fold")) {
+      BF_FOLD_MEM = true;
+    } else if (!strcmp(arg, "-bf-wide")) {
+      BF_WIDE = true;
+    } else if (!strcmp(arg, "-piet-share")) {
+      PIET_SHARE_MEM = true;
+    } else if (!strcmp(arg, "-sh-bash")) {
+      SH_BASH = true;
+    } else if (!strcmp(arg, "-sed-bucket")) {
+      SED_BUCKET_MEM = true;
+    } else if (!strcmp(arg, "-vim9")) {
+      VIM9_SCRIPT = true;
+    } else if (!strcmp(arg, "-tf2")) {
+      TF2_FUNCTION = true;
+    } else if (!strcmp(arg, "-tex-count")) {
+      TEX_COUNT_REGS = true;
+    } else if (!strcmp(arg, "-cpp20")) {
+      CPP20_CONSTEVAL = true;
+    } else if (!strncmp(arg, "-cpp-out=", 9)) {
+      int n = atoi(arg + 9);
+      if (n <= 0)
+        error("invalid output buffer size: %s", arg + 9);
+      BUF_SIZE = n;
+    } else if (!strncmp(arg, "-cpp-mem=", 9)) {
+      CPP20_HEAP_SIZE = atoi(arg + 9);
+      if (CPP20_HEAP_SIZE <= 0)
+        error("invalid memory size: %s", arg + 9);
+    } else if (!strncmp(arg, "-c-split=", 9)) {
+      C_SPLIT_DIR = arg + 9;
+    } else if (!strncmp(arg, "-c-units=", 9)) {
+      C_SPLIT_UNITS = atoi(arg + 9);
+      if (C_SPLIT_UNITS <= 0)
+        error("invalid unit count: %s", arg + 9);
+    } else if (!strcmp(arg, "-js-worker")) {
+      JS_WORKER = true;
+    } else if (!strcmp(arg, "-js-compact")) {
+      JS_COMPACT = true;
+    } else if (!strcmp(arg, "-luajit")) {
+      LUA_JIT = true;
+    } else if (!strcmp(arg, "-mem=full")) {
+      MEM_MODEL = MEM_FULL;
+    } else if (!strcmp(arg, "-mem=sparse")) {
+      MEM_MODEL = MEM_SPARSE;
+    } else if (!strcmp(arg, "-mem=packed")) {
+      MEM_MODEL = MEM_PACKED;
+    } else if (!strncmp(arg, "-bulk-data=", 11)) {
+      BULK_DATA_MIN = atoi(arg + 11);
+      if (BULK_DATA_MIN < 0)
+        error("invalid word count: %s", arg + 11);
+    } else if (!strncmp(arg, "-chunk=", 7)) {
+      CHUNKED_FUNC_SIZE = atoi(arg + 7);
+      if (CHUNKED_FUNC_SIZE <= 0)
+        error("invalid chunk size: %s", arg + 7);
+    } else if (!strncmp(arg, "-cache=", 7)) {
+      g_cache_dir = arg + 7;
+    } else if (!strncmp(arg, "-inline=", 8)) {
+      g_inline_budget = atoi(arg + 8);
+      if (g_inline_budget < 0)
+        error("invalid inline budget: %s", arg + 8);
+    } else if (!strncmp(arg, "-profile=", 9)) {
+      g_profile_path = arg + 9;
+    } else if (arg[0] == '-' && strchr(arg, '=')) {
+      char* name = strdup(arg + 1);
+      char* path = strchr(name, '=');
+      *path = 0;
+      if (!find_target_func(name))
+        error("unknown flag: %s", arg + 1);
+      jobs[num_jobs].name = name;
+      jobs[num_jobs].path = path + 1;
+      num_jobs++;
+    } else if (arg[0] == '-') {
+      target_name = arg + 1;
+      target_func = get_target_func(target_name);
     } else {
       filename = arg;
     }
@@ -119,11 +578,62 @@ int main(int argc, char* argv[]) {
   if (!filename) {
     error("no input file");
   }
+  if (g_profile_path) {
+    // -O renumbers the pcs, which eli doesn't.
+    if (optimize)
+      error("-profile= can't be used with -O");
+    load_pc_profile(g_profile_path);
+  }
+  if (g_split_cold) {
+    Emitter* e = cur_emitter();
+    split_cold_blocks(CHUNKED_FUNC_SIZE, &e->pc_counts, &e->num_pc_counts);
+  }
+  if (num_jobs) {
+    if (target_func)
+      error("-<target> and -<target>=<path> can't be mixed");
+    run_target_jobs(jobs, num_jobs, filename, optimize);
+    return 0;
+  }
   if (!target_func) {
     error("no target");
   }
 
-  Module* module = load_eir_from_file(filename);
+  start_output_sink();
+
+  // Backends which only walk the text through emit_chunked_main_loop
+  // get it streamed, so elc never holds more than a chunk of it.
+  // With -time they aren't, so that parsing is timed on its own.
+  Module* module = NULL;
+  EIRStream* stream = NULL;
+  if (!optimize && !g_time_phases && !C_SPLIT_DIR && !g_split_cold &&
+      !g_intrinsics && is_streamable(target_func))
+    stream = open_eir_stream(filename, &module);
+  // Lowering rewrites the whole text, which a stream doesn't keep.
+  if (stream && (module->ext_ops & ~get_native_ext_ops(target_func))) {
+    close_eir_stream(stream);
+    stream = NULL;
+  }
+  if (stream) {
+    set_text_stream(stream);
+  } else {
+    module = load_eir_from_file(filename);
+    if (g_intrinsics)
+      substitute_intrinsics(module);
+    set_inline_budget(g_inline_budget >= 0 ? g_inline_budget :
+                      get_inline_budget(target_func));
+    if (optimize)
+      optimize_module(module);
+    // Elsewhere the locals would only move to other memory words.
+    if (optimize && (get_native_ext_ops(target_func) & VREG_BIT))
+      promote_stack_slots(module);
+    ir_phase_begin("lower_ext_ops");
+    lower_ext_ops(module, get_native_ext_ops(target_func));
+    ir_phase_begin("mark_unmasked");
+    mark_unmasked(module->text);
+    if (optimize && (get_native_ext_ops(target_func) & GLOBAL_VAR_BIT))
+      find_global_vars(module);
+  }
+  run_backend(target_name, target_func, module);
+  finish_output_sink();
 #endif
-  target_func(module);
 }
@@ -4,6 +4,11 @@
 #define FORTH_MEM_SIZE_STR "16777216"
 #define FORTH_ADDR_MASK UINT_MAX
 
+// This assumes 64-bit cells, as gforth has, so a product of two words
+// doesn't overflow before it's masked.
+const int target_forth_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(DIV) | EXT_OP_BIT(MOD);
+
 static const char* FORTH_REG_NAMES[] = {
   "reg-a", "reg-b", "reg-c", "reg-d", "reg-bp", "reg-sp", "reg-pc"
 };
@@ -14,11 +19,10 @@ static void init_state_forth(Data* data) {
     emit_line("variable %s", reg_names[i]);
     emit_line("0 %s !", reg_names[i]);
   }
-  emit_line("variable mem");
-  emit_line(FORTH_MEM_SIZE_STR " cells allocate throw mem !");
+  emit_line(FORTH_MEM_SIZE_STR " cells allocate throw constant mem");
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
-      emit_line("%d mem @ %d cells + !", data->v, mp);
+      emit_line("%d mem %d cells + !", data->v, mp);
     }
   }
   emit_line("");
@@ -79,6 +83,14 @@ static const char* forth_src_str(Inst* inst) {
   return forth_value_str(&inst->src);
 }
 
+// The address of the word at inst->src. An immediate one is computed
+// while the word is compiled.
+static const char* forth_mem_addr_str(Inst* inst) {
+  if (inst->src.type == IMM)
+    return format("[ mem %d cells + ] literal", inst->src.imm);
+  return format("mem %s cells +", forth_src_str(inst));
+}
+
 static void emit_cmp(Inst* inst, const char* cmp_op) {
   emit_line("%s @ %s %s if 1 else 0 then %s !",
             reg_names[inst->dst.reg], forth_src_str(inst),
@@ -116,14 +128,33 @@ static void forth_emit_inst(Inst* inst) {
     emit_line("%s !", reg_names[inst->dst.reg]);
     break;
 
+  case MUL:
+    emit_line("%s @ %s * %d and",
+              reg_names[inst->dst.reg], forth_src_str(inst), FORTH_ADDR_MASK);
+    emit_line("%s !", reg_names[inst->dst.reg]);
+    break;
+
+  // DIV by 0 gives UINT_MAX and MOD by 0 leaves dst.
+  case DIV:
+    emit_line("%s @ %s ?dup if / else drop %d then",
+              reg_names[inst->dst.reg], forth_src_str(inst), UINT_MAX);
+    emit_line("%s !", reg_names[inst->dst.reg]);
+    break;
+
+  case MOD:
+    emit_line("%s @ %s ?dup if mod then",
+              reg_names[inst->dst.reg], forth_src_str(inst));
+    emit_line("%s !", reg_names[inst->dst.reg]);
+    break;
+
   case LOAD:
-    emit_line("mem @ %s cells + @ %s !",
-              forth_src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("%s @ %s !",
+              forth_mem_addr_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case STORE:
-    emit_line("%s @ mem  @ %s cells + !",
-              reg_names[inst->dst.reg], forth_src_str(inst));
+    emit_line("%s @ %s !",
+              reg_names[inst->dst.reg], forth_mem_addr_str(inst));
     break;
 
   case PUTC:
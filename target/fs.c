@@ -8,7 +8,7 @@ static const char* FS_REG_NAMES[] = {
 static void init_state_fs(Data* data) {
   reg_names = FS_REG_NAMES;
   for (int i = 0; i < 7; i++) {
-    emit_line("let mutable %s = 0", reg_names[i]);
+    emit_line("let mutable elvm_%s = 0", reg_names[i]);
   }
   emit_line("let mem : int array = Array.zeroCreate (1 <<< 24)");
   emit_line("");
@@ -19,10 +19,15 @@ static void init_state_fs(Data* data) {
   }
 }
 
+// The registers are locals in each chunk, loaded from the elvm_*
+// globals on entry and stored back on exit.
 static void fs_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("let func%d() =", func_id);
   inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("let mutable %s = elvm_%s", reg_names[i], reg_names[i]);
+  }
   emit_line("while %d <= pc && pc < %d do",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -35,6 +40,9 @@ static void fs_emit_func_epilogue(void) {
   emit_line("| _ -> failwith(\"oops\")");
   emit_line("pc <- pc + 1");
   dec_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("elvm_%s <- %s", reg_names[i], reg_names[i]);
+  }
   dec_indent();
 }
 
@@ -155,7 +163,7 @@ void target_fs(Module* module) {
 
   emit_line("while true do");
   inc_indent();
-  emit_line("match pc / %d with", CHUNKED_FUNC_SIZE);
+  emit_line("match elvm_pc / %d with", CHUNKED_FUNC_SIZE);
   for (int i = 0; i < num_funcs; i++) {
     emit_line("| %d -> func%d()", i, i);
   }
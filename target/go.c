@@ -3,6 +3,14 @@
 
 #define GO_INT_TYPE "int32"
 
+// mem is a pointer to an array of 1 << 24 words, so masking a register
+// address lets the Go compiler drop the bounds check.
+static const char* go_mem_addr_str(Inst* inst) {
+  if (inst->src.type == REG)
+    return format("%s & " UINT_MAX_STR, reg_names[inst->src.reg]);
+  return src_str(inst);
+}
+
 static void go_emit_inst(Inst* inst) {
   switch (inst->op) {
   case MOV:
@@ -22,11 +30,13 @@ static void go_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s]",
+              reg_names[inst->dst.reg], go_mem_addr_str(inst));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s",
+              go_mem_addr_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -72,7 +82,7 @@ static void go_emit_inst(Inst* inst) {
 }
 
 static void go_init_state(Data* data) {
-  emit_line("copy(mem, []" GO_INT_TYPE "{");
+  emit_line("copy(mem[:], []" GO_INT_TYPE "{");
   for (int mp = 0; data; data = data->next, mp++) {
     emit_line(" %d,", data->v);
   }
@@ -93,7 +103,7 @@ void target_go(Module* module) {
   emit_line("var buf [1]byte");
   emit_line("_ = buf");
 
-  emit_line("mem := make([]" GO_INT_TYPE ", 1<<24)");
+  emit_line("mem := new([1 << 24]" GO_INT_TYPE ")");
   go_init_state(module->data);
 
   emit_line("");
@@ -111,7 +121,9 @@ void target_go(Module* module) {
       prev_pc = inst->pc;
       inc_indent();
     }
+    FormatMark mark = format_mark();
     go_emit_inst(inst);
+    format_release(mark);
   }
   // end of switch
   dec_indent();
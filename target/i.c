@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdlib.h>
 
 #include <ir/ir.h>
 #include <target/util.h>
@@ -13,6 +14,7 @@ static const char* I_REG_NAMES[] = {
 // :11 = reg jmp
 // :12 = prev putc
 // :13 = prev getc
+// :14 = whether the add function goes on
 // ;1  = memory
 // ;2  = putc table
 // ;3  = getc table (for CLC-INTERCAL only)
@@ -82,16 +84,16 @@ static uint i_interleave(uint a, uint b) {
 
 static uint i_emit_please_cnt;
 static void i_emit_line(const char* fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  char* r = vformat(fmt, ap);
-  va_end(ap);
-
   if (++i_emit_please_cnt == 3) {
-    printf("PLEASE ");
+    emit_printf("PLEASE ");
     i_emit_please_cnt = 0;
   }
-  printf("DO %s\n", r);
+  emit_printf("DO ");
+  va_list ap;
+  va_start(ap, fmt);
+  emit_vprintf(fmt, ap);
+  va_end(ap);
+  emit_char('\n');
 }
 
 static char* i_imm(uint v) {
@@ -190,6 +192,15 @@ static void i_emit_intercal_boolize() {
 
 static void i_emit_cmp(Inst* inst, int add_fn) {
   int op = normalize_cond(inst->op, false);
+  if (op == JEQ || op == JNE) {
+    // Equality needs only the XOR, not a subtraction.
+    i_emit_xor(8, I_REG_NAMES[inst->dst.reg], i_src_str(inst));
+    i_emit_line(":8 <- #65535 ~ :8");
+    i_emit_line(":8 <- :8 ~ #1");
+    if (op == JEQ)
+      i_emit_xor(8, ":8", "#1");
+    return;
+  }
   if (op == JGT || op == JLE) {
     op = op == JGT ? JLT : JGE;
     i_emit_line(":9 <- %s", I_REG_NAMES[inst->dst.reg]);
@@ -201,17 +212,6 @@ static void i_emit_cmp(Inst* inst, int add_fn) {
   i_emit_sub(add_fn);
 
   switch (op) {
-    case JEQ:
-      i_emit_line(":8 <- #65535 ~ :8");
-      i_emit_line(":8 <- :8 ~ #1");
-      i_emit_xor(8, ":8", "#1");
-      break;
-
-    case JNE:
-      i_emit_line(":8 <- #65535 ~ :8");
-      i_emit_line(":8 <- :8 ~ #1");
-      break;
-
     case JGE:
       i_emit_xor(8, ":8", "#32768");
       FALLTHROUGH;
@@ -226,6 +226,17 @@ static void i_emit_cmp(Inst* inst, int add_fn) {
   }
 }
 
+// The index in ;1 of the address at inst->src, which is one past it
+// as arrays start at 1. An immediate one is computed here.
+static const char* i_mem_index(Inst* inst, int add_fn) {
+  if (inst->src.type == IMM)
+    return format("#%d", inst->src.imm % 65536 + 1);
+  i_emit_line(":8 <- %s", i_src_str(inst));
+  i_emit_line(":9 <- #1");
+  i_emit_add(add_fn);
+  return ":8";
+}
+
 static void i_emit_jmp(Inst* inst, int reg_jmp) {
   if (inst->jmp.type == REG) {
     i_emit_line(":11 <- %s", I_REG_NAMES[inst->jmp.reg]);
@@ -256,17 +267,13 @@ static void i_emit_inst(Inst* inst, int add_fn, int reg_jmp, int* label) {
     break;
 
   case LOAD:
-    i_emit_line(":8 <- %s", i_src_str(inst));
-    i_emit_line(":9 <- #1");
-    i_emit_add(add_fn);
-    i_emit_line("%s <- ;1 SUB :8", I_REG_NAMES[inst->dst.reg]);
+    i_emit_line("%s <- ;1 SUB %s",
+                I_REG_NAMES[inst->dst.reg], i_mem_index(inst, add_fn));
     break;
 
   case STORE:
-    i_emit_line(":8 <- %s", i_src_str(inst));
-    i_emit_line(":9 <- #1");
-    i_emit_add(add_fn);
-    i_emit_line(";1 SUB :8 <- %s", I_REG_NAMES[inst->dst.reg]);
+    i_emit_line(";1 SUB %s <- %s",
+                i_mem_index(inst, add_fn), I_REG_NAMES[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -370,16 +377,35 @@ static void i_emit_inst(Inst* inst, int add_fn, int reg_jmp, int* label) {
   }
 }
 
-static void i_emit_reg_jmp_table(uint pc, uint bit, uint max_pc, int* label) {
-  if (bit > max_pc) {
-    if (pc >= max_pc || pc == 0) {
-      i_emit_line("ERR %d", pc);
+// A decision tree on the bits of :11, from the lowest. pc is the value
+// of the bits decided so far, and targets[0..num) are the pcs which
+// match them.
+static void i_emit_reg_jmp_table(int* targets, int num, uint pc, uint bit,
+                                 int* label) {
+  if (num == 0) {
+    i_emit_line("ERR %d", pc);
+    return;
+  }
+  if (num == 1) {
+    if (targets[0] == 0) {
+      i_emit_line("ERR %d", 0);
     } else {
-      i_emit_line("(%d) NEXT", pc);
+      i_emit_line("(%d) NEXT", targets[0]);
     }
     return;
   }
 
+  int* set = malloc(num * sizeof(int));
+  int* unset = malloc(num * sizeof(int));
+  int num_set = 0;
+  int num_unset = 0;
+  for (int i = 0; i < num; i++) {
+    if (targets[i] & bit)
+      set[num_set++] = targets[i];
+    else
+      unset[num_unset++] = targets[i];
+  }
+
   i_emit_line(":8 <- :11 ~ #%d", bit);
   i_emit_intercal_boolize();
 
@@ -387,13 +413,15 @@ static void i_emit_reg_jmp_table(uint pc, uint bit, uint max_pc, int* label) {
   int l2 = ++*label;
   i_emit_line("(%d) NEXT", l1);
 
-  i_emit_reg_jmp_table(pc + bit, bit * 2, max_pc, label);
+  i_emit_reg_jmp_table(set, num_set, pc + bit, bit * 2, label);
 
   emit_line("(%d) DO RESUME :8", l2);
   emit_line("(%d) DO (%d) NEXT", l1, l2);
   i_emit_line("FORGET #1");
 
-  i_emit_reg_jmp_table(pc, bit * 2, max_pc, label);
+  i_emit_reg_jmp_table(unset, num_unset, pc, bit * 2, label);
+  free(set);
+  free(unset);
 }
 
 void target_i(Module* module) {
@@ -413,10 +441,18 @@ void target_i(Module* module) {
     }
     prev_pc = inst->pc;
     emit_line("");
+    FormatMark mark = format_mark();
     i_emit_inst(inst, add_fn, reg_jmp, &label);
+    format_release(mark);
   }
 
   emit_line("");
+  // After each round, the add function returns once the carry in :9
+  // is zero. (add_done) gets :14 = 3 to go on, which resumes the round
+  // after it, and 1 to return, which resumes the RESUME #3 below.
+  int add_next = ++label;
+  int add_next2 = ++label;
+  int add_done = ++label;
   emit_line("(%d) DO NOTe add function", add_fn);
   for (int i = 0; i < 16; i++) {
     i_emit_line(":9 <- :8"I_INT":9");
@@ -425,11 +461,22 @@ void target_i(Module* module) {
     i_emit_line(":9 <- :&9");
     i_emit_line(":9 <- :9 ~ :10");
     i_emit_line(":9 <- ':9"I_INT"#0'~'#32767"I_INT"#1'");
+    if (i < 15) {
+      i_emit_line(":14 <- '#65535 ~ :9'"I_INT"#1");
+      i_emit_line(":14 <- :14 ~ #3");
+      i_emit_line("(%d) NEXT", add_next);
+    }
   }
   i_emit_line("RESUME #1");
+  emit_line("(%d) DO (%d) NEXT", add_next, add_next2);
+  emit_line("(%d) DO (%d) NEXT", add_next2, add_done);
+  i_emit_line("RESUME #3");
+  emit_line("(%d) DO RESUME :14", add_done);
 
   emit_line("");
   i_emit_line("NOTe reg jmp");
   emit_line("(%d) DO FORGET #1", reg_jmp);
-  i_emit_reg_jmp_table(0, 1, reg_jmp, &label);
+  int num_targets;
+  int* targets = indirect_jump_targets(module, &num_targets);
+  i_emit_reg_jmp_table(targets, num_targets, 0, 1, &label);
 }
@@ -1,19 +1,47 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
-static void java_emit_func_prologue(int func_id) {
+// Each chunk of CHUNKED_FUNC_SIZE pcs is split into methods of up to
+// JAVA_METHOD_BUDGET estimated bytes, as HotSpot doesn't JIT compile
+// methods over 8000 bytes. A method keeps the registers in locals and
+// switches on dense case labels, which become a tableswitch. It
+// returns to the chunk's dispatch loop when pc leaves its range.
+#define JAVA_METHOD_BUDGET 7000
+#define JAVA_MAX_METHODS 1024
+
+static int java_func_id;
+static int java_method_starts[JAVA_MAX_METHODS];
+static int java_num_methods;
+static int java_method_size;
+
+static void java_emit_method_prologue(int pc) {
+  if (java_num_methods == JAVA_MAX_METHODS)
+    error("too many methods in a chunk");
+  java_method_starts[java_num_methods] = pc;
+  java_method_size = 0;
   emit_line("");
-  emit_line("private static void func%d() {", func_id);
+  emit_line("private static void func%d_%d() {",
+            java_func_id, java_num_methods++);
   inc_indent();
-  emit_line("while (%d <= pc && pc < %d) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+  for (int i = 0; i < 7; i++) {
+    emit_line("int %s = Main.%s;", reg_names[i], reg_names[i]);
+  }
+  emit_line("for (;;) {");
   inc_indent();
   emit_line("switch (pc) {");
-  emit_line("case -1:  /* dummy */");
+  emit_line("case %d:", pc);
   inc_indent();
 }
 
-static void java_emit_func_epilogue(void) {
+static void java_emit_method_epilogue(void) {
+  emit_line("break;");
+  dec_indent();
+  emit_line("default:");
+  inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("Main.%s = %s;", reg_names[i], reg_names[i]);
+  }
+  emit_line("return;");
   dec_indent();
   emit_line("}");
   emit_line("pc++;");
@@ -23,7 +51,44 @@ static void java_emit_func_epilogue(void) {
   emit_line("}");
 }
 
+static void java_emit_func_prologue(int func_id) {
+  java_func_id = func_id;
+  java_num_methods = 0;
+}
+
+static void java_emit_func_epilogue(void) {
+  java_emit_method_epilogue();
+  emit_line("");
+  emit_line("private static void func%d() {", java_func_id);
+  inc_indent();
+  emit_line("while (%d <= pc && pc < %d) {",
+            java_func_id * CHUNKED_FUNC_SIZE,
+            (java_func_id + 1) * CHUNKED_FUNC_SIZE);
+  inc_indent();
+  for (int i = 1; i < java_num_methods; i++) {
+    emit_line("%sif (pc < %d) func%d_%d();",
+              i > 1 ? "else " : "", java_method_starts[i],
+              java_func_id, i - 1);
+  }
+  emit_line("%sfunc%d_%d();", java_num_methods > 1 ? "else " : "",
+            java_func_id, java_num_methods - 1);
+  dec_indent();
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+}
+
 static void java_emit_pc_change(int pc) {
+  if (java_num_methods == 0) {
+    java_emit_method_prologue(pc);
+    return;
+  }
+  if (java_method_size > JAVA_METHOD_BUDGET) {
+    java_emit_method_epilogue();
+    java_emit_method_prologue(pc);
+    return;
+  }
+  java_method_size += 8;
   emit_line("break;");
   emit_line("");
   dec_indent();
@@ -32,6 +97,7 @@ static void java_emit_pc_change(int pc) {
 }
 
 static void java_emit_inst(Inst* inst) {
+  java_method_size += estimate_bytecode_size(inst);
   switch (inst->op) {
   case MOV:
     emit_line("%s = %s;", reg_names[inst->dst.reg], src_str(inst));
@@ -101,7 +167,39 @@ static void java_emit_inst(Inst* inst) {
   }
 }
 
+// Passes the data as hex strings of 1024 words, one per method as the
+// statements per word are, which is much smaller than those. A string
+// constant may have up to 65535 bytes.
+static int java_init_bulk_data(Data* data, int len) {
+  emit_line("static void initData(int mp, String s) {");
+  inc_indent();
+  emit_line("for (int i = 0; i < s.length(); i += 6)");
+  emit_line(" mem[mp++] = Integer.parseInt(s.substring(i, i + 6), 16);");
+  dec_indent();
+  emit_line("}");
+  int num_inits = 0;
+  for (int mp = 0; mp < len; num_inits++) {
+    emit_line("static void init%d() {", num_inits);
+    inc_indent();
+    emit_line("initData(%d,", mp);
+    int end = mp + 1024 < len ? mp + 1024 : len;
+    while (mp < end) {
+      int n = end - mp < 16 ? end - mp : 16;
+      mp += n;
+      emit_line(" \"%s\"%s", format_data_hex(&data, n),
+                mp == end ? ");" : " +");
+    }
+    dec_indent();
+    emit_line("}");
+  }
+  return num_inits;
+}
+
 static int java_init_state(Data* data) {
+  int bulk_len = bulk_data_len(data);
+  if (bulk_len)
+    return java_init_bulk_data(data, bulk_len);
+
   int prev_mc = -1;
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
@@ -137,7 +235,6 @@ void target_java(Module* module) {
 
   int num_inits = java_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
   int num_funcs = emit_chunked_main_loop(module->text,
                                          java_emit_func_prologue,
                                          java_emit_func_epilogue,
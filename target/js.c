@@ -1,13 +1,73 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
-static void init_state_js(Data* data) {
+// Whether target_js and target_asmjs run main in a Web Worker (see
+// emit_js_worker_glue), chosen by -js-worker.
+bool JS_WORKER;
+
+// Set by elc -js-compact, for pages which load the output. Lines
+// aren't indented, the data is a base64 string, and each function is
+// the source of its body in a template string, compiled with new
+// Function the first time main dispatches to it. The functions can't
+// see the variables of main, so the registers and the running flag
+// are in an Int32Array R, and data words are never kept in globals.
+bool JS_COMPACT;
+
+// The registers the functions copy in and out: the 7 of reg_names,
+// and the virtual ones if the module has them.
+static int js_num_regs;
+
+static const char* js_reg(int i) {
+  return i < 7 ? reg_names[i] : reg_str((Reg)(R0 + i - 7));
+}
+
+static void init_state_js_compact(Data* data) {
+  emit_line("var main=function(getchar,putchar){");
+  emit_line("var R=new Int32Array(%d);R[%d]=1;", js_num_regs + 1, js_num_regs);
+  emit_line("var mem=new Int32Array(1<<24);");
+  int len = 0;
+  int mp = 0;
+  for (Data* d = data; d; d = d->next, mp++) {
+    if (d->v)
+      len = mp + 1;
+  }
+  if (len) {
+    emit_line("var s=atob(\"%s\"),u=new Uint8Array(s.length);",
+              format_data_base64(&data, len));
+    emit_line("for(var i=0;i<s.length;i++)u[i]=s.charCodeAt(i);");
+    emit_line("mem.set(new Int32Array(u.buffer,0,%d));", len);
+  }
+  emit_line("var F=[],C=[];");
+}
+
+static void init_state_js(Module* module) {
+  Data* data = module->data;
+  js_num_regs = 7 + (module->ext_ops & VREG_BIT ? NUM_VREGS : 0);
+  if (JS_COMPACT) {
+    init_state_js_compact(data);
+    return;
+  }
   emit_line("var main = function(getchar, putchar) {");
 
-  for (int i = 0; i < 7; i++) {
-    emit_line("var %s = 0;", reg_names[i]);
+  for (int i = 0; i < js_num_regs; i++) {
+    emit_line("var r_%s = 0;", js_reg(i));
   }
   emit_line("var mem = new Int32Array(1 << 24);");
+  int bulk_len = bulk_data_len(data);
+  if (bulk_len) {
+    emit_line("mem.set([");
+    inc_indent();
+    char line[256];
+    for (int mp = 0; mp < bulk_len; mp += 16) {
+      int len = 0;
+      for (int i = mp; i < bulk_len && i < mp + 16; i++, data = data->next)
+        len += sprintf(line + len, "%d,", data->v);
+      emit_line("%s", line);
+    }
+    dec_indent();
+    emit_line("]);");
+    return;
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("mem[%d] = %d;", mp, data->v);
@@ -15,10 +75,38 @@ static void init_state_js(Data* data) {
   }
 }
 
+static void js_emit_func_prologue_compact(int func_id) {
+  char line[256];
+  int len = 0;
+  for (int i = 0; i < js_num_regs; i++)
+    len += sprintf(line + len, "%s%s=R[%d]", i ? "," : "", js_reg(i), i);
+  emit_line("F[%d]=`var %s;", func_id, line);
+  emit_line("while(%d<=pc&&pc<%d&&R[%d]){switch(pc){case -1:",
+            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE,
+            js_num_regs);
+}
+
+static void js_emit_func_epilogue_compact(void) {
+  char line[256];
+  int len = 0;
+  for (int i = 0; i < js_num_regs; i++)
+    len += sprintf(line + len, "R[%d]=%s;", i, js_reg(i));
+  emit_line("}pc++;}%s`;", line);
+}
+
+static void js_emit_pc_change_compact(int pc) {
+  emit_line("break;case %d:", pc);
+}
+
 static void js_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("var func%d = function() {", func_id);
   inc_indent();
+  // JITs keep locals in machine registers but not variables of the
+  // enclosing closure, so the registers are copied in and out.
+  for (int i = 0; i < js_num_regs; i++) {
+    emit_line("var %s = r_%s;", js_reg(i), js_reg(i));
+  }
   emit_line("while (%d <= pc && pc < %d && running) {",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -28,11 +116,15 @@ static void js_emit_func_prologue(int func_id) {
 }
 
 static void js_emit_func_epilogue(void) {
+  clear_src_loc();
   dec_indent();
   emit_line("}");
   emit_line("pc++;");
   dec_indent();
   emit_line("}");
+  for (int i = 0; i < js_num_regs; i++) {
+    emit_line("r_%s = %s;", js_reg(i), js_reg(i));
+  }
   dec_indent();
   emit_line("};");
 }
@@ -46,29 +138,38 @@ static void js_emit_pc_change(int pc) {
 }
 
 static void js_emit_inst(Inst* inst) {
+  set_src_loc(inst);
   switch (inst->op) {
   case MOV:
-    emit_line("%s = %s;", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = %s;", reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case ADD:
     emit_line("%s = (%s + %s) & " UINT_MAX_STR ";",
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case SUB:
     emit_line("%s = (%s - %s) & " UINT_MAX_STR ";",
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    if (inst->global_var && !JS_COMPACT) {
+      emit_line("%s = g%d;", reg_str(inst->dst.reg), global_var_addr(inst));
+      break;
+    }
+    emit_line("%s = mem[%s];", reg_str(inst->dst.reg), mem_addr_str(inst));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    if (inst->global_var && !JS_COMPACT) {
+      emit_line("g%d = %s;", global_var_addr(inst), reg_str(inst->dst.reg));
+      break;
+    }
+    emit_line("mem[%s] = %s;", mem_addr_str(inst), reg_str(inst->dst.reg));
     break;
 
   case PUTC:
@@ -77,11 +178,14 @@ static void js_emit_inst(Inst* inst) {
 
   case GETC:
     emit_line("%s = getchar();",
-              reg_names[inst->dst.reg]);
+              reg_str(inst->dst.reg));
     break;
 
   case EXIT:
-    emit_line("running = false; break;");
+    if (JS_COMPACT)
+      emit_line("R[%d]=0;break;", js_num_regs);
+    else
+      emit_line("running = false; break;");
     break;
 
   case DUMP:
@@ -94,7 +198,58 @@ static void js_emit_inst(Inst* inst) {
   case LE:
   case GE:
     emit_line("%s = (%s) | 0;",
-              reg_names[inst->dst.reg], cmp_str(inst, "true"));
+              reg_str(inst->dst.reg), cmp_str(inst, "true"));
+    break;
+
+  case MUL:
+    emit_line("%s = (%s * %s) & " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case DIV:
+    emit_line("%s = %s ? Math.floor(%s / %s) : " UINT_MAX_STR ";",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case MOD:
+    emit_line("%s = %s ? %s %% %s : %s;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg));
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    emit_line("%s %s= %s;", reg_str(inst->dst.reg),
+              inst->op == AND ? "&" : inst->op == OR ? "|" : "^",
+              src_str(inst));
+    break;
+
+  case SHL:
+    emit_line("%s = %s < 24 ? (%s << %s) & " UINT_MAX_STR " : 0;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case SHR:
+    emit_line("%s = %s < 24 ? %s >> %s : 0;",
+              reg_str(inst->dst.reg), src_str(inst),
+              reg_str(inst->dst.reg), src_str(inst));
+    break;
+
+  case MEMCPY:
+    emit_line("mem.copyWithin(%s, %s, %s + %s);",
+              reg_str(inst->dst.reg), src_str(inst),
+              src_str(inst), value_str(&inst->jmp));
+    break;
+
+  case MEMSET:
+    emit_line("mem.fill(%s, %s, %s + %s);",
+              src_str(inst), reg_str(inst->dst.reg),
+              reg_str(inst->dst.reg), value_str(&inst->jmp));
     break;
 
   case JEQ:
@@ -113,8 +268,137 @@ static void js_emit_inst(Inst* inst) {
   }
 }
 
+// Runs main when the script is loaded as a Web Worker, with the
+// protocol of tools/elvm_worker.js. The page posts {output, input},
+// two SharedArrayBuffers each holding a ring of 2^n bytes after three
+// Int32s: the bytes written and read, wrapping at 2^32, and whether
+// the writer is done. Output is published at each newline, every 4 KB and before
+// getchar blocks on an Atomics.wait for more input. Without
+// SharedArrayBuffer the page posts {data} with the whole input instead
+// and the output comes back as {out} messages. {exit} ends both.
+void emit_js_worker_glue(void) {
+  emit_line("if (typeof importScripts == 'function' &&"
+            " typeof onmessage != 'undefined') {");
+  emit_line(" onmessage = function(e) {");
+  emit_line("  var o = e.data.output, i = e.data.input, data = e.data.data;");
+  emit_line("  var oc = o && new Int32Array(o, 0, 3);");
+  emit_line("  var ob = o && new Uint8Array(o, 12);");
+  emit_line("  var ic = i && new Int32Array(i, 0, 3);");
+  emit_line("  var ib = i && new Uint8Array(i, 12);");
+  emit_line("  var pending = [];");
+  emit_line("  var ow = 0, ir = 0;");
+  emit_line("  var flush = function() {");
+  emit_line("   if (!o) {");
+  emit_line("    if (pending.length)");
+  emit_line("     postMessage({out: String.fromCharCode.apply(null, pending)});");
+  emit_line("    pending = [];");
+  emit_line("    return;");
+  emit_line("   }");
+  emit_line("   for (var k = 0; k < pending.length; k++) {");
+  emit_line("    var r;");
+  emit_line("    while ((ow - (r = Atomics.load(oc, 1)) | 0) == ob.length)");
+  emit_line("     Atomics.wait(oc, 1, r);");
+  emit_line("    ob[ow & ob.length - 1] = pending[k];");
+  emit_line("    ow = ow + 1 | 0;");
+  emit_line("    if (k % 1024 == 1023)");
+  emit_line("     Atomics.store(oc, 0, ow);");
+  emit_line("   }");
+  emit_line("   Atomics.store(oc, 0, ow);");
+  emit_line("   pending = [];");
+  emit_line("  };");
+  emit_line("  var putchar = function(c) {");
+  emit_line("   pending.push(c & 255);");
+  emit_line("   if (c == 10 || pending.length == 4096)");
+  emit_line("    flush();");
+  emit_line("  };");
+  emit_line("  var getchar = function() {");
+  emit_line("   flush();");
+  emit_line("   if (!i)");
+  emit_line("    return ir < data.length ? data.charCodeAt(ir++) & 255 : 0;");
+  emit_line("   var w;");
+  emit_line("   while (ir == (w = Atomics.load(ic, 0))) {");
+  emit_line("    if (Atomics.load(ic, 2))");
+  emit_line("     return 0;");
+  emit_line("    Atomics.wait(ic, 0, w);");
+  emit_line("   }");
+  emit_line("   var c = ib[ir & ib.length - 1];");
+  emit_line("   ir = ir + 1 | 0;");
+  emit_line("   Atomics.store(ic, 1, ir);");
+  emit_line("   Atomics.notify(ic, 1);");
+  emit_line("   return c;");
+  emit_line("  };");
+  emit_line("  main(getchar, putchar);");
+  emit_line("  flush();");
+  emit_line("  if (o)");
+  emit_line("   Atomics.store(oc, 2, 1);");
+  emit_line("  postMessage({exit: 0});");
+  emit_line(" };");
+  emit_line("}");
+}
+
+const int target_js_ext_ops =
+    ALL_EXT_OPS | MEM_DISP_BIT | VREG_BIT | GLOBAL_VAR_BIT;
+
+static void target_js_compact(Module* module) {
+  init_state_js(module);
+  emit_chunked_main_loop(module->text,
+                         js_emit_func_prologue_compact,
+                         js_emit_func_epilogue_compact,
+                         js_emit_pc_change_compact,
+                         js_emit_inst);
+  emit_line("while(R[%d]){var i=R[6]/%d|0;", js_num_regs, CHUNKED_FUNC_SIZE);
+  emit_line("(C[i]||(C[i]=new Function(\"R\",\"mem\",\"getchar\",\"putchar\","
+            "F[i])))(R,mem,getchar,putchar);}");
+  emit_line("};");
+}
+
+// The worker glue with -js-worker, and the glue which runs main on
+// nodejs.
+static void js_emit_glue(void) {
+  if (JS_WORKER)
+    emit_js_worker_glue();
+
+  // For nodejs
+  emit_line("if (typeof require != 'undefined') {");
+  emit_line(" var fs = require('fs');");
+  emit_line(" var input = null;");
+  emit_line(" var ip = 0;");
+  // Output is written in blocks, before reading, at the end and when
+  // the buffer fills up.
+  emit_line(" var out = Buffer.alloc(1 << 16);");
+  emit_line(" var op = 0;");
+  emit_line(" var flush = function() {");
+  emit_line("  for (var p = 0; p < op;)");
+  emit_line("   p += fs.writeSync(1, out, p, op - p);");
+  emit_line("  op = 0;");
+  emit_line(" };");
+  emit_line(" var getchar = function() {");
+  emit_line("  if (input === null) {");
+  emit_line("   flush();");
+  emit_line("   input = fs.readFileSync('/dev/stdin');");
+  emit_line("  }");
+  emit_line("  return input[ip++] | 0;");
+  emit_line(" };");
+  emit_line(" var putchar = function(c) {");
+  emit_line("  out[op++] = c;");
+  emit_line("  if (op == out.length)");
+  emit_line("   flush();");
+  emit_line(" };");
+  emit_line(" main(getchar, putchar);");
+  emit_line(" flush();");
+  emit_line("}");
+  emit_src_map_url("//# ");
+}
+
 void target_js(Module* module) {
-  init_state_js(module->data);
+  if (JS_COMPACT) {
+    target_js_compact(module);
+    js_emit_glue();
+    return;
+  }
+  start_src_map();
+  init_state_js(module);
+  emit_global_var_inits(module, "var g%d = %d;");
 
   emit_line("var running = true;");
 
@@ -127,7 +411,7 @@ void target_js(Module* module) {
   emit_line("");
   emit_line("while (running) {");
   inc_indent();
-  emit_line("switch (pc / %d | 0) {", CHUNKED_FUNC_SIZE);
+  emit_line("switch (r_pc / %d | 0) {", CHUNKED_FUNC_SIZE);
   for (int i = 0; i < num_funcs; i++) {
     emit_line("case %d:", i);
     emit_line(" func%d();", i);
@@ -138,20 +422,5 @@ void target_js(Module* module) {
   emit_line("}");
 
   emit_line("};");
-
-  // For nodejs
-  emit_line("if (typeof require != 'undefined') {");
-  emit_line(" var sys = require('sys');");
-  emit_line(" var input = null;");
-  emit_line(" var ip = 0;");
-  emit_line(" var getchar = function() {");
-  emit_line("  if (input === null)");
-  emit_line("   input = require('fs').readFileSync('/dev/stdin');");
-  emit_line("  return input[ip++] | 0;");
-  emit_line(" };");
-  emit_line(" var putchar = function(c) {");
-  emit_line("  sys.print(String.fromCharCode(c & 255));");
-  emit_line(" };");
-  emit_line(" main(getchar, putchar);");
-  emit_line("}");
+  js_emit_glue();
 }
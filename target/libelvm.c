@@ -0,0 +1,114 @@
+#include <target/libelvm.h>
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/lower.h>
+#include <ir/mask.h>
+#include <target/targets.h>
+#include <target/util.h>
+
+// In ir/eli.c, built with -DELI_LIBRARY.
+void eli_run(Module* m, int (*getc_fn)(void*),
+             void (*putc_fn)(int, void*), void* ctx);
+void eli_release(void);
+
+static jmp_buf* g_error_jmp;
+static char g_error_msg[256];
+
+static void on_error(const char* msg) {
+  strncpy(g_error_msg, msg, sizeof(g_error_msg) - 1);
+  longjmp(*g_error_jmp, 1);
+}
+
+// Calls fn(arg) with fatal errors caught. Returns -1 (and sets *err)
+// if one was raised.
+static int guard(void (*fn)(void*), void* arg, char** err) {
+  jmp_buf jb;
+  g_error_jmp = &jb;
+  elvm_error_hook = on_error;
+  if (setjmp(jb)) {
+    elvm_error_hook = NULL;
+    if (err)
+      *err = strdup(g_error_msg);
+    return -1;
+  }
+  fn(arg);
+  elvm_error_hook = NULL;
+  return 0;
+}
+
+typedef struct {
+  const char* buf;
+  size_t len;
+  Module* module;
+} LoadArgs;
+
+static void do_load(void* arg) {
+  LoadArgs* a = arg;
+  a->module = load_eir_from_memory(a->buf, a->len);
+}
+
+Module* elvm_load(const char* buf, size_t len, char** err) {
+  LoadArgs a = { buf, len, NULL };
+  if (guard(do_load, &a, err))
+    return NULL;
+  return a.module;
+}
+
+typedef struct {
+  Module* module;
+  const char* target;
+} CompileArgs;
+
+static void do_compile(void* arg) {
+  CompileArgs* a = arg;
+  target_func_t f = get_target_func(a->target);
+  if (f == target_bf)
+    error("bf can't be compiled from a loaded module");
+  lower_ext_ops(a->module, get_native_ext_ops(f));
+  mark_unmasked(a->module->text);
+  f(a->module);
+}
+
+int elvm_compile(Module* module, const char* target,
+                 elvm_sink_t sink, void* ctx, char** err) {
+  char* out = NULL;
+  size_t len = 0;
+  FILE* fp = open_memstream(&out, &len);
+  if (!fp) {
+    if (err)
+      *err = strdup("failed to open the output");
+    return -1;
+  }
+  Emitter* emitter = emitter_new(fp);
+  Emitter* prev = set_emitter(emitter);
+  CompileArgs a = { module, target };
+  int r = guard(do_compile, &a, err);
+  set_emitter(prev);
+  emitter_free(emitter);
+  fclose(fp);
+  if (!r)
+    sink(out, len, ctx);
+  free(out);
+  return r;
+}
+
+typedef struct {
+  Module* module;
+  const ElvmIO* io;
+} RunArgs;
+
+static void do_run(void* arg) {
+  RunArgs* a = arg;
+  eli_run(a->module, a->io->getc, a->io->putc, a->io->ctx);
+}
+
+int elvm_run(Module* module, const ElvmIO* io, char** err) {
+  RunArgs a = { module, io };
+  int r = guard(do_run, &a, err);
+  eli_release();
+  return r;
+}
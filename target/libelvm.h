@@ -0,0 +1,41 @@
+#ifndef ELVM_LIBELVM_H_
+#define ELVM_LIBELVM_H_
+
+#include <stddef.h>
+
+#include <ir/ir.h>
+
+// An in-process API over the IR library, the backends and eli, built
+// as out/libelvm.a. Errors which would make elc or eli exit are
+// returned as -1 (or NULL) instead, with the message in *err if err is
+// not NULL, which the caller frees.
+//
+// The library keeps global state (the error hook, the interpreter's
+// registers, and backend flags such as BF_FOLD_MEM), so calls must not
+// overlap. A Module which failed to compile or run may be half-lowered
+// and should not be used again.
+
+// Receives the output of elvm_compile, in one call.
+typedef void (*elvm_sink_t)(const char* buf, size_t len, void* ctx);
+
+typedef struct {
+  // Returns the next input byte, or EOF.
+  int (*getc)(void* ctx);
+  void (*putc)(int c, void* ctx);
+  void* ctx;
+} ElvmIO;
+
+// Parses EIR or .eirb from len bytes at buf.
+Module* elvm_load(const char* buf, size_t len, char** err);
+
+// Compiles the module for target (e.g., "c", as elc's -c). The module is
+// lowered for the target, so compile a fresh one for each target. bf,
+// which needs the text split at memory ops while parsing, isn't
+// supported.
+int elvm_compile(Module* module, const char* target,
+                 elvm_sink_t sink, void* ctx, char** err);
+
+// Runs the module until it exits, as eli does.
+int elvm_run(Module* module, const ElvmIO* io, char** err);
+
+#endif  // ELVM_LIBELVM_H_
@@ -1,38 +1,258 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/cfg.h>
 #include <ir/ir.h>
 #include <target/util.h>
 
 static int func_idx;
 static int case_idx;
-static int case_pc[512];
-static int case_label[512];
-static int putc_idx;
+static int* case_pc;
+static int* case_label;
 
 static void ll_init_state(void) {
   func_idx = 1;
   case_idx = 0;
-  putc_idx = 0;
+  case_pc = malloc(CHUNKED_FUNC_SIZE * sizeof(int));
+  case_label = malloc(CHUNKED_FUNC_SIZE * sizeof(int));
+  // Internal, so LLVM knows the library calls can't touch them.
+  for (int i = 0; i < 7; i++) {
+    emit_line("@%s = internal global i32 0, align 4", reg_names[i]);
+  }
+  emit_line("@mem = internal global [16777216 x i32] zeroinitializer, align 16");
+}
+
+// Metadata of the accesses to registers and mem: TBAA tags keeping them
+// apart, and the range of the values, which are 24bit words at block
+// boundaries and in mem (see mark_unmasked). The tags are emitted by
+// ll_emit_metadata.
+#define LL_MEM_STORE_MD "!tbaa !3"
+#define LL_MEM_LOAD_MD "!tbaa !3, !range !5"
+#define LL_REG_STORE_MD "!tbaa !4"
+#define LL_REG_LOAD_MD "!tbaa !4, !range !5"
+
+// The line table of elc -g. Each function gets a DISubprogram in the
+// file of its first location, and each location of another file a
+// DILexicalBlockFile of it. The nodes of a function follow it, numbered
+// from LL_DBG_FIRST_ID on, and ll_emit_metadata adds the compile unit.
+#define LL_DBG_CU_ID 6
+#define LL_DBG_FILE_ID 9
+#define LL_DBG_TYPE_ID 10
+#define LL_DBG_FIRST_ID 12
+
+static int ll_dbg_next_id;
+static int* ll_dbg_file_ids;
+static int* ll_dbg_block_ids;
+static int ll_dbg_func_id;
+static int ll_dbg_sp;
+static int ll_dbg_sp_file;
+static char* ll_dbg_nodes;
+static int ll_dbg_nodes_len;
+static int ll_dbg_nodes_cap;
+static char ll_dbg_suffix[32];
+
+static bool ll_has_dbg(void) {
+  return cur_emitter()->src_module != NULL;
+}
+
+static void ll_dbg_node(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap) + 2;
+  va_end(ap);
+  if (ll_dbg_nodes_len + n > ll_dbg_nodes_cap) {
+    ll_dbg_nodes_cap = (ll_dbg_nodes_len + n) * 2;
+    ll_dbg_nodes = realloc(ll_dbg_nodes, ll_dbg_nodes_cap);
+  }
+  va_start(ap, fmt);
+  ll_dbg_nodes_len += vsnprintf(ll_dbg_nodes + ll_dbg_nodes_len, n, fmt, ap);
+  va_end(ap);
+  ll_dbg_nodes[ll_dbg_nodes_len++] = '\n';
+  ll_dbg_nodes[ll_dbg_nodes_len] = 0;
+}
+
+// s as the body of an LLVM string, which escapes bytes as \XX.
+static const char* ll_escape_str(const char* s) {
+  char* buf = format("%*s", (int)strlen(s) * 3, "");
+  char* p = buf;
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\' || c < 32 || c >= 127)
+      p += sprintf(p, "\\%02X", c);
+    else
+      *p++ = c;
+  }
+  *p = 0;
+  return buf;
+}
+
+static int ll_dbg_file(int file) {
+  if (!ll_dbg_file_ids[file]) {
+    const SrcLoc loc = { 0, file, 0 };
+    ll_dbg_file_ids[file] = ll_dbg_next_id++;
+    ll_dbg_node("!%d = !DIFile(filename: \"%s\", directory: \"\")",
+                ll_dbg_file_ids[file], ll_escape_str(src_file_name(&loc)));
+  }
+  return ll_dbg_file_ids[file];
+}
+
+static void ll_dbg_init(void) {
+  if (!ll_has_dbg())
+    return;
+  int n = cur_emitter()->src_module->num_src_files;
+  ll_dbg_next_id = LL_DBG_FIRST_ID;
+  ll_dbg_file_ids = calloc(n + 1, sizeof(int));
+  ll_dbg_block_ids = calloc(n + 1, sizeof(int));
+}
+
+// The " !dbg" of the define of func_id.
+static const char* ll_dbg_func_begin(int func_id) {
+  clear_src_loc();
+  cur_emitter()->line_suffix = NULL;
+  if (!ll_has_dbg())
+    return "";
+  ll_dbg_func_id = func_id;
+  ll_dbg_sp = ll_dbg_next_id++;
+  ll_dbg_sp_file = -1;
+  int n = cur_emitter()->src_module->num_src_files;
+  memset(ll_dbg_block_ids, 0, n * sizeof(int));
+  return format(" !dbg !%d", ll_dbg_sp);
+}
+
+// Makes the lines of inst carry its location.
+static void ll_dbg_inst(Inst* inst) {
+  const SrcLoc* loc = set_src_loc(inst);
+  Emitter* e = cur_emitter();
+  if (!e->cur_src_loc) {
+    e->line_suffix = NULL;
+    return;
+  }
+  if (!loc)
+    return;
+  int file = loc->file;
+  if (file < 0 || file >= e->src_module->num_src_files)
+    file = e->src_module->num_src_files;
+  if (ll_dbg_sp_file < 0)
+    ll_dbg_sp_file = file;
+  int scope = ll_dbg_sp;
+  if (file != ll_dbg_sp_file) {
+    if (!ll_dbg_block_ids[file]) {
+      int f = ll_dbg_file(file);
+      ll_dbg_block_ids[file] = ll_dbg_next_id++;
+      ll_dbg_node("!%d = !DILexicalBlockFile(scope: !%d, file: !%d, "
+                  "discriminator: 0)", ll_dbg_block_ids[file], ll_dbg_sp, f);
+    }
+    scope = ll_dbg_block_ids[file];
+  }
+  int id = ll_dbg_next_id++;
+  ll_dbg_node("!%d = !DILocation(line: %d, column: 0, scope: !%d)",
+              id, loc->line, scope);
+  sprintf(ll_dbg_suffix, ", !dbg !%d", id);
+  e->line_suffix = ll_dbg_suffix;
+}
+
+// Emits the nodes of the function which just ended.
+static void ll_dbg_func_end(void) {
+  cur_emitter()->line_suffix = NULL;
+  if (!ll_has_dbg() || !ll_dbg_sp)
+    return;
+  int file = (ll_dbg_sp_file < 0 ? LL_DBG_FILE_ID :
+              ll_dbg_file(ll_dbg_sp_file));
+  ll_dbg_node("!%d = distinct !DISubprogram(name: \"func%d\", scope: !%d, "
+              "file: !%d, type: !%d, spFlags: DISPFlagDefinition, "
+              "unit: !%d)", ll_dbg_sp, ll_dbg_func_id, file, file,
+              LL_DBG_TYPE_ID, LL_DBG_CU_ID);
+  emit_str(ll_dbg_nodes);
+  ll_dbg_nodes_len = 0;
+  ll_dbg_sp = 0;
+}
+
+static void ll_emit_metadata(void) {
+  emit_line("");
+  emit_line("!0 = !{!\"elvm\"}");
+  emit_line("!1 = !{!\"mem\", !0, i64 0}");
+  emit_line("!2 = !{!\"reg\", !0, i64 0}");
+  emit_line("!3 = !{!1, !1, i64 0}");
+  emit_line("!4 = !{!2, !2, i64 0}");
+  emit_line("!5 = !{i32 0, i32 16777216}");
+  if (!ll_has_dbg())
+    return;
+  Module* m = cur_emitter()->src_module;
+  const char* name = "elvm";
+  for (int i = m->num_src_files - 1; i >= 0; i--) {
+    if (m->src_files[i])
+      name = m->src_files[i];
+  }
+  emit_line("!llvm.dbg.cu = !{!%d}", LL_DBG_CU_ID);
+  emit_line("!llvm.module.flags = !{!7, !8}");
+  emit_line("!%d = distinct !DICompileUnit(language: DW_LANG_C99, "
+            "file: !%d, producer: \"elvm\", isOptimized: false, "
+            "runtimeVersion: 0, emissionKind: LineTablesOnly)",
+            LL_DBG_CU_ID, LL_DBG_FILE_ID);
+  emit_line("!7 = !{i32 2, !\"Debug Info Version\", i32 3}");
+  emit_line("!8 = !{i32 7, !\"Dwarf Version\", i32 4}");
+  emit_line("!%d = !DIFile(filename: \"%s\", directory: \"\")",
+            LL_DBG_FILE_ID, ll_escape_str(name));
+  emit_line("!%d = !DISubroutineType(types: !11)", LL_DBG_TYPE_ID);
+  emit_line("!11 = !{}");
+}
+
+// An ADD, SUB, MUL or SHL whose result can't wrap (see in_range) gets
+// the flags which let LLVM drop the masks after it.
+static const char* ll_wrap_flags(Inst* inst) {
+  return inst->in_range ? " nuw nsw" : "";
+}
+
+static void ll_emit_decls(void) {
+  emit_line("");
+  emit_line("declare i32 @getchar() nounwind");
+  emit_line("declare i32 @putchar(i32) nounwind");
+  emit_line("declare void @exit(i32) noreturn nounwind");
+  emit_line("declare void @llvm.memmove.p0i8.p0i8.i64(i8*, i8*, i64, i1)");
+}
+
+// Functions work on copies of the registers in allocas, which LLVM
+// promotes to SSA values, and write them back only when they return.
+// The globals can't be promoted as they may change across calls.
+static void ll_emit_load_regs(void) {
+  for (int i = 0; i < 7; i++) {
+    emit_line("%%r.%s = alloca i32, align 4", reg_names[i]);
+  }
+  for (int i = 0; i < 7; i++) {
+    emit_line("%%r.%s.in = load i32, i32* @%s, align 4, " LL_REG_LOAD_MD,
+              reg_names[i], reg_names[i]);
+    emit_line("store i32 %%r.%s.in, i32* %%r.%s, align 4",
+              reg_names[i], reg_names[i]);
+  }
+}
+
+static void ll_emit_store_regs(void) {
   for (int i = 0; i < 7; i++) {
-    emit_line("@%s = common global i32 0, align 4", reg_names[i]);
+    emit_line("%%r.%s.out = load i32, i32* %%r.%s, align 4",
+              reg_names[i], reg_names[i]);
+    emit_line("store i32 %%r.%s.out, i32* @%s, align 4, " LL_REG_STORE_MD,
+              reg_names[i], reg_names[i]);
   }
-  emit_line("@mem = common global [16777216 x i32] zeroinitializer, align 16");
 }
 
 static void ll_emit_func_prologue(int func_id) {
   emit_line("");
-  emit_line("define void @func%d() {", func_id);
+  emit_line("define void @func%d()%s {", func_id, ll_dbg_func_begin(func_id));
   inc_indent();
 
+  ll_emit_load_regs();
   emit_line("br label %%1");
 
   emit_line("");
   emit_line("; <label>:1");
-  emit_line("%%2 = load i32, i32* @pc, align 4");
+  emit_line("%%2 = load i32, i32* %%r.pc, align 4");
   emit_line("%%3 = icmp ule i32 %d, %%2", func_id * CHUNKED_FUNC_SIZE);
   emit_line("br i1 %%3, label %%4, label %%7");
 
   emit_line("");
   emit_line("; <label>:4");
-  emit_line("%%5 = load i32, i32* @pc, align 4");
+  emit_line("%%5 = load i32, i32* %%r.pc, align 4");
   emit_line("%%6 = icmp ult i32 %%5, %d", (func_id + 1) * CHUNKED_FUNC_SIZE);
   emit_line("br label %%7");
 
@@ -48,10 +268,11 @@ static void ll_emit_func_prologue(int func_id) {
 }
 
 static void ll_emit_func_epilogue(void) {
+  cur_emitter()->line_suffix = NULL;
   emit_line("br label %%case_bottom");
   emit_line("");
   emit_line("switch_top:");
-  emit_line("%%%d = load i32, i32* @pc, align 4", func_idx);
+  emit_line("%%%d = load i32, i32* %%r.pc, align 4", func_idx);
   emit_line("switch i32 %%%d, label %%case_bottom [", func_idx);
   inc_indent();
   emit_line("i32 -1, label %%9");
@@ -63,20 +284,21 @@ static void ll_emit_func_epilogue(void) {
 
   emit_line("");
   emit_line("case_bottom:");
-  emit_line("%%%d = load i32, i32* @pc, align 4", func_idx+1);
+  emit_line("%%%d = load i32, i32* %%r.pc, align 4", func_idx+1);
   emit_line("%%%d = add i32 %%%d, 1", func_idx+2, func_idx+1);
-  emit_line("store i32 %%%d, i32* @pc, align 4", func_idx+2);
+  emit_line("store i32 %%%d, i32* %%r.pc, align 4", func_idx+2);
   emit_line("br label %%1");
 
   emit_line("");
   emit_line("func_bottom:");
+  ll_emit_store_regs();
   emit_line("ret void");
   dec_indent();
   emit_line("}");
+  ll_dbg_func_end();
   /* reset func_idx */
   func_idx = 1;
   case_idx = 0;
-  putc_idx = 0;
 }
 
 static void ll_emit_pc_change(int pc) {
@@ -112,13 +334,13 @@ const char* ll_cmp_str(Inst* inst) {
 
 static void ll_emit_cmp(Inst* inst) {
   if (inst->src.type == REG) {
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, src_str(inst));
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, src_str(inst));
     emit_line("%%%d = icmp %s i32 %%%d, %%%d",
               func_idx+2, ll_cmp_str(inst), func_idx, func_idx+1);
     func_idx += 3;
   } else if (inst->src.type == IMM) {
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
     emit_line("%%%d = icmp %s i32 %%%d, %s",
               func_idx+1, ll_cmp_str(inst), func_idx, src_str(inst));
     func_idx += 2;
@@ -129,78 +351,182 @@ static void ll_emit_cmp(Inst* inst) {
 
 const char* ll_emit_load(Inst* inst) {
   if (inst->src.type == REG) {
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, src_str(inst));
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, src_str(inst));
     func_idx += 2;
     return format("%d", func_idx);
   } else if (inst->src.type == IMM) {
-    emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
     func_idx += 1;
-    return format("@%s", reg_names[inst->dst.reg]);
+    return format("%%r.%s", reg_names[inst->dst.reg]);
   } else {
     error("invalid value");
   }
 }
 
+// Division by zero and shifts by 24 or more would be undefined, so the
+// operand is replaced first and the result selected afterwards.
+static void ll_emit_ext(Inst* inst) {
+  const char* dst = reg_names[inst->dst.reg];
+  int d = func_idx++;
+  emit_line("%%%d = load i32, i32* %%r.%s, align 4", d, dst);
+  const char* src = src_str(inst);
+  if (inst->src.type == REG) {
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, src);
+    src = format("%%%d", func_idx++);
+  }
+
+  switch (inst->op) {
+  case MUL:
+    emit_line("%%%d = mul%s i32 %%%d, %s", func_idx++, ll_wrap_flags(inst), d, src);
+    if (!inst->unmasked) {
+      emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx - 1);
+      func_idx++;
+    }
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    emit_line("%%%d = %s i32 %%%d, %s", func_idx,
+              inst->op == AND ? "and" : inst->op == OR ? "or" : "xor",
+              d, src);
+    func_idx++;
+    break;
+
+  case DIV:
+  case MOD:
+    emit_line("%%%d = icmp eq i32 %s, 0", func_idx, src);
+    emit_line("%%%d = select i1 %%%d, i32 1, i32 %s",
+              func_idx + 1, func_idx, src);
+    emit_line("%%%d = %s i32 %%%d, %%%d", func_idx + 2,
+              inst->op == DIV ? "udiv" : "urem", d, func_idx + 1);
+    if (inst->op == DIV) {
+      emit_line("%%%d = select i1 %%%d, i32 16777215, i32 %%%d",
+                func_idx + 3, func_idx, func_idx + 2);
+    } else {
+      emit_line("%%%d = select i1 %%%d, i32 %%%d, i32 %%%d",
+                func_idx + 3, func_idx, d, func_idx + 2);
+    }
+    func_idx += 4;
+    break;
+
+  case SHL:
+  case SHR: {
+    // SHR needs no wrap: its operand is a 24bit value.
+    int c = func_idx;
+    emit_line("%%%d = icmp uge i32 %s, 24", c, src);
+    emit_line("%%%d = select i1 %%%d, i32 0, i32 %s", c + 1, c, src);
+    emit_line("%%%d = %s%s i32 %%%d, %%%d", c + 2,
+              inst->op == SHL ? "shl" : "lshr",
+              inst->op == SHL ? ll_wrap_flags(inst) : "", d, c + 1);
+    func_idx = c + 3;
+    if (inst->op == SHL && !inst->unmasked) {
+      emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx - 1);
+      func_idx++;
+    }
+    emit_line("%%%d = select i1 %%%d, i32 0, i32 %%%d",
+              func_idx, c, func_idx - 1);
+    func_idx++;
+    break;
+  }
+
+  default:
+    error("oops");
+  }
+  emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx - 1, dst);
+}
+
+// Returns a value holding v as an address (or size) in bytes.
+static int ll_emit_mem_offset(Value* v, bool is_addr) {
+  const char* x = value_str(v);
+  if (v->type == REG) {
+    emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, x);
+    x = format("%%%d", func_idx++);
+  }
+  emit_line("%%%d = zext i32 %s to i64", func_idx++, x);
+  if (!is_addr) {
+    emit_line("%%%d = mul i64 %%%d, 4", func_idx, func_idx - 1);
+    return func_idx++;
+  }
+  emit_line("%%%d = getelementptr inbounds [16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %%%d", func_idx, func_idx - 1);
+  emit_line("%%%d = bitcast i32* %%%d to i8*", func_idx + 1, func_idx);
+  func_idx += 2;
+  return func_idx - 1;
+}
+
+static void ll_emit_memcpy(Inst* inst) {
+  int d = ll_emit_mem_offset(&inst->dst, true);
+  int s = ll_emit_mem_offset(&inst->src, true);
+  int n = ll_emit_mem_offset(&inst->jmp, false);
+  emit_line("call void @llvm.memmove.p0i8.p0i8.i64"
+            "(i8* %%%d, i8* %%%d, i64 %%%d, i1 false)", d, s, n);
+}
+
 static void ll_emit_inst(Inst* inst) {
+  ll_dbg_inst(inst);
   switch (inst->op) {
   case MOV:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, src_str(inst));
-      emit_line("store i32 %%%d, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, src_str(inst));
+      emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
       func_idx += 1;
     } else if (inst->src.type == IMM) {
-      emit_line("store i32 %s, i32* @%s, align 4", src_str(inst), reg_names[inst->dst.reg]);
+      emit_line("store i32 %s, i32* %%r.%s, align 4", src_str(inst), reg_names[inst->dst.reg]);
     }
     break;
 
   case ADD:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, src_str(inst));
-      emit_line("%%%d = add i32 %%%d, %%%d", func_idx+2, func_idx, func_idx+1);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, src_str(inst));
+      emit_line("%%%d = add%s i32 %%%d, %%%d", func_idx+2, ll_wrap_flags(inst), func_idx, func_idx+1);
       func_idx += 3;
     } else if (inst->src.type == IMM) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("%%%d = add i32 %%%d, %s", func_idx+1, func_idx, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = add%s i32 %%%d, %s", func_idx+1, ll_wrap_flags(inst), func_idx, src_str(inst));
       func_idx += 2;
     } else {
       error("invalid value");
     }
-    emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx-1);
-    emit_line("store i32 %%%d, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-    func_idx += 1;
+    if (!inst->unmasked) {
+      emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx-1);
+      func_idx += 1;
+    }
+    emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx-1, reg_names[inst->dst.reg]);
     break;
 
   case SUB:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, src_str(inst));
-      emit_line("%%%d = sub i32 %%%d, %%%d", func_idx+2, func_idx, func_idx+1);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, src_str(inst));
+      emit_line("%%%d = sub%s i32 %%%d, %%%d", func_idx+2, ll_wrap_flags(inst), func_idx, func_idx+1);
       func_idx += 3;
     } else if (inst->src.type == IMM) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("%%%d = sub i32 %%%d, %s", func_idx+1, func_idx, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = sub%s i32 %%%d, %s", func_idx+1, ll_wrap_flags(inst), func_idx, src_str(inst));
       func_idx += 2;
     } else {
       error("invalid value");
     }
-    emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx-1);
-    emit_line("store i32 %%%d, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-    func_idx += 1;
+    if (!inst->unmasked) {
+      emit_line("%%%d = and i32 %%%d, 16777215", func_idx, func_idx-1);
+      func_idx += 1;
+    }
+    emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx-1, reg_names[inst->dst.reg]);
     break;
 
   case LOAD:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, src_str(inst));
       emit_line("%%%d = zext i32 %%%d to i64", func_idx+1, func_idx);
       emit_line("%%%d = getelementptr inbounds [16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %%%d", func_idx+2, func_idx+1);
-      emit_line("%%%d = load i32, i32* %%%d, align 4", func_idx+3, func_idx+2);
-      emit_line("store i32 %%%d, i32* @%s, align 4", func_idx+3, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* %%%d, align 4, " LL_MEM_LOAD_MD, func_idx+3, func_idx+2);
+      emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx+3, reg_names[inst->dst.reg]);
       func_idx += 4;
     } else if (inst->src.type == IMM) {
-      emit_line("%%%d = load i32, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %s)", func_idx, src_str(inst));
-      emit_line("store i32 %%%d, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %s), align 4, " LL_MEM_LOAD_MD, func_idx, src_str(inst));
+      emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
       func_idx += 1;
     } else {
       error("invalid value");
@@ -209,15 +535,15 @@ static void ll_emit_inst(Inst* inst) {
 
   case STORE:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, src_str(inst));
       emit_line("%%%d = zext i32 %%%d to i64", func_idx+2, func_idx+1);
       emit_line("%%%d = getelementptr inbounds [16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %%%d", func_idx+3, func_idx+2);
-      emit_line("store i32 %%%d, i32* %%%d, align 4", func_idx, func_idx+3);
+      emit_line("store i32 %%%d, i32* %%%d, align 4, " LL_MEM_STORE_MD, func_idx, func_idx+3);
       func_idx += 4;
     } else if (inst->src.type == IMM) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
-      emit_line("store i32 %%%d, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %s)", func_idx, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
+      emit_line("store i32 %%%d, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %s), align 4, " LL_MEM_STORE_MD, func_idx, src_str(inst));
       func_idx += 1;
     } else {
       error("invalid value");
@@ -226,7 +552,7 @@ static void ll_emit_inst(Inst* inst) {
 
   case PUTC:
     if (inst->src.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, src_str(inst));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, src_str(inst));
       emit_line("%%%d = call i32 @putchar(i32 %%%d)", func_idx+1, func_idx);
       func_idx += 2;
     } else if (inst->src.type == IMM) {
@@ -238,29 +564,12 @@ static void ll_emit_inst(Inst* inst) {
     break;
 
   case GETC:
-    emit_line("%%_%d = alloca i32, align 4", putc_idx);
     emit_line("%%%d = call i32 @getchar()", func_idx);
-    emit_line("store i32 %%%d, i32* %%_%d, align 4", func_idx, putc_idx);
-    emit_line("%%%d = load i32, i32* %%_%d, align 4", func_idx+1, putc_idx);
-    emit_line("%%%d = icmp ne i32 %%%d, -1", func_idx+2, func_idx+1);
-    emit_line("br i1 %%%d, label %%%d, label %%%d", func_idx+2, func_idx+3, func_idx+5);
-
-    emit_line("");
-    emit_line("; <label>:%%%d", func_idx+3);
-    emit_line("%%%d = load i32, i32* %%_%d, align 4", func_idx+4, putc_idx);
-    emit_line("br label %%%d", func_idx+6);
-
-    emit_line("");
-    emit_line("; <label>:%%%d", func_idx+5);
-    emit_line("br label %%%d", func_idx+6);
-
-    emit_line("");
-    emit_line("; <label>:%%%d", func_idx+6);
-    emit_line("%%%d = phi i32 [ %%%d, %%%d ], [0, %%%d]",
-                func_idx+7, func_idx+4, func_idx+3, func_idx+5);
-    emit_line("store i32 %%%d, i32* @%s, align 4", func_idx+7, reg_names[inst->dst.reg]);
-    func_idx += 8;
-    putc_idx += 1;
+    emit_line("%%%d = icmp eq i32 %%%d, -1", func_idx+1, func_idx);
+    emit_line("%%%d = select i1 %%%d, i32 0, i32 %%%d",
+              func_idx+2, func_idx+1, func_idx);
+    emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx+2, reg_names[inst->dst.reg]);
+    func_idx += 3;
     break;
 
   case EXIT:
@@ -278,10 +587,25 @@ static void ll_emit_inst(Inst* inst) {
   case GE:
     ll_emit_cmp(inst);
     emit_line("%%%d = zext i1 %%%d to i32", func_idx, func_idx-1);
-    emit_line("store i32 %%%d, i32* @%s, align 4", func_idx, reg_names[inst->dst.reg]);
+    emit_line("store i32 %%%d, i32* %%r.%s, align 4", func_idx, reg_names[inst->dst.reg]);
     func_idx += 1;
     break;
 
+  case MUL:
+  case DIV:
+  case MOD:
+  case AND:
+  case OR:
+  case XOR:
+  case SHL:
+  case SHR:
+    ll_emit_ext(inst);
+    break;
+
+  case MEMCPY:
+    ll_emit_memcpy(inst);
+    break;
+
   case JEQ:
   case JNE:
   case JLT:
@@ -295,16 +619,16 @@ static void ll_emit_inst(Inst* inst) {
                 func_idx-1, func_idx, func_idx+3);
       emit_line("");
       emit_line("; <label>:%%%d", func_idx);
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx+1, value_str(&inst->jmp));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx+1, value_str(&inst->jmp));
       emit_line("%%%d = sub i32 %%%d, 1", func_idx+2, func_idx+1);
-      emit_line("store i32 %d, i32* @pc, align 4", func_idx+2);
+      emit_line("store i32 %%%d, i32* %%r.pc, align 4", func_idx+2);
       func_idx += 3;
     } else if (inst->jmp.type == IMM) {
       emit_line("br i1 %%%d, label %%%d, label %%%d",
                 func_idx-1, func_idx, func_idx+1);
       emit_line("");
       emit_line("; <label>:%%%d", func_idx);
-      emit_line("store i32 %d, i32* @pc, align 4", inst->jmp.imm-1);
+      emit_line("store i32 %d, i32* %%r.pc, align 4", inst->jmp.imm-1);
       func_idx += 1;
     } else {
       error("invalid value");
@@ -318,12 +642,12 @@ static void ll_emit_inst(Inst* inst) {
   case JMP:
     emit_line("; jmp");
     if (inst->jmp.type == REG) {
-      emit_line("%%%d = load i32, i32* @%s, align 4", func_idx, value_str(&inst->jmp));
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4", func_idx, value_str(&inst->jmp));
       emit_line("%%%d = sub i32 %%%d, 1", func_idx+1, func_idx);
-      emit_line("store i32 %%%d, i32* @pc, align 4", func_idx+1);
+      emit_line("store i32 %%%d, i32* %%r.pc, align 4", func_idx+1);
       func_idx += 2;
     } else if (inst->jmp.type == IMM) {
-      emit_line("store i32 %d, i32* @pc, align 4", inst->jmp.imm-1);
+      emit_line("store i32 %d, i32* %%r.pc, align 4", inst->jmp.imm-1);
     }
     break;
 
@@ -332,8 +656,12 @@ static void ll_emit_inst(Inst* inst) {
   }
 }
 
+// MEMSET fills words, which llvm.memset can't, so it is lowered.
+const int target_ll_ext_ops = ALL_EXT_OPS & ~EXT_OP_BIT(MEMSET);
+
 void target_ll(Module* module) {
   ll_init_state();
+  ll_dbg_init();
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          ll_emit_func_prologue,
@@ -341,10 +669,7 @@ void target_ll(Module* module) {
                                          ll_emit_pc_change,
                                          ll_emit_inst);
 
-  emit_line("");
-  emit_line("declare i32 @getchar()");
-  emit_line("declare i32 @putchar(i32)");
-  emit_line("declare void @exit(i32)");
+  ll_emit_decls();
 
   emit_line("");
   emit_line("define i32 @main() {");
@@ -355,7 +680,7 @@ void target_ll(Module* module) {
   Data* data = module->data;
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
-      emit_line("store i32 %d, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %d), align 4", data->v, mp);
+      emit_line("store i32 %d, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %d), align 4, " LL_MEM_STORE_MD, data->v, mp);
     }
   }
   emit_line("br label %%2");
@@ -392,4 +717,219 @@ void target_ll(Module* module) {
   emit_line("ret i32 %%%d", while_bottom+2);
   dec_indent();
   emit_line("}");
+  ll_emit_metadata();
+}
+
+// Like the C CFG mode, the CFG mode gives every pc a basic block and
+// turns direct jumps within a function (see plan_chunks) into
+// branches. A jump through a register, or an entry from main, loads
+// the block address of pc from a table for indirectbr. A return first
+// switches over its likely targets in the function.
+
+static ChunkPlan* ll_cfg_plan;
+static BasicBlock* ll_cfg_blocks;
+static int ll_cfg_num_pcs;
+static int ll_cfg_func_id;
+static int ll_cfg_block_idx;
+
+static bool ll_cfg_is_local(int pc) {
+  return (pc >= 0 && pc < ll_cfg_num_pcs &&
+          ll_cfg_plan->func_of_pc[pc] == ll_cfg_func_id);
+}
+
+// Emits the branch of a jump, taken if cond (an i1 value) is set.
+static void ll_cfg_emit_jump(Inst* inst, const char* cond) {
+  int next = ll_cfg_block_idx++;
+  if (inst->jmp.type == IMM && ll_cfg_is_local(inst->jmp.imm)) {
+    if (cond)
+      emit_line("br i1 %s, label %%L%d, label %%b%d",
+                cond, inst->jmp.imm, next);
+    else
+      emit_line("br label %%L%d", inst->jmp.imm);
+  } else {
+    int taken = ll_cfg_block_idx++;
+    if (cond)
+      emit_line("br i1 %s, label %%b%d, label %%b%d", cond, taken, next);
+    else
+      emit_line("br label %%b%d", taken);
+    emit_line("");
+    emit_line("b%d:", taken);
+    if (inst->jmp.type == REG) {
+      emit_line("%%%d = load i32, i32* %%r.%s, align 4",
+                func_idx, reg_names[inst->jmp.reg]);
+      emit_line("store i32 %%%d, i32* %%r.pc, align 4", func_idx);
+      BasicBlock* b = &ll_cfg_blocks[inst->pc];
+      if (b->returns) {
+        emit_line("switch i32 %%%d, label %%dispatch [", func_idx);
+        for (int i = 0; i < b->num_ret_targets; i++) {
+          int pc = b->ret_targets[i];
+          if (ll_cfg_is_local(pc))
+            emit_line("  i32 %d, label %%L%d", pc, pc);
+        }
+        emit_line("]");
+      } else {
+        emit_line("br label %%dispatch");
+      }
+      func_idx++;
+    } else {
+      emit_line("store i32 %d, i32* %%r.pc, align 4", inst->jmp.imm);
+      emit_line("br label %%leave");
+    }
+  }
+  emit_line("");
+  emit_line("b%d:", next);
+}
+
+static void ll_cfg_emit_inst(Inst* inst) {
+  ll_dbg_inst(inst);
+  switch (inst->op) {
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    ll_emit_cmp(inst);
+    ll_cfg_emit_jump(inst, format("%%%d", func_idx - 1));
+    break;
+
+  case JMP:
+    ll_cfg_emit_jump(inst, NULL);
+    break;
+
+  default:
+    ll_emit_inst(inst);
+  }
+}
+
+static void ll_cfg_emit_func(Module* module, int func_id) {
+  int start = ll_cfg_plan->starts[func_id];
+  int end = ll_cfg_plan->starts[func_id + 1];
+  bool* is_entry = ll_cfg_plan->is_entry;
+  ll_cfg_func_id = func_id;
+  func_idx = 1;
+  ll_cfg_block_idx = 0;
+
+  emit_line("");
+  emit_line("define void @func%d()%s {", func_id, ll_dbg_func_begin(func_id));
+  inc_indent();
+  ll_emit_load_regs();
+  emit_line("br label %%dispatch");
+
+  for (int pc = start; pc < end; pc++) {
+    emit_line("");
+    emit_line("L%d:", pc);
+    Inst* inst = &module->text[module->pc_starts[pc]];
+    for (int i = 0; i < module->pc_lens[pc]; i++, inst++) {
+      FormatMark mark = format_mark();
+      ll_cfg_emit_inst(inst);
+      format_release(mark);
+    }
+    if (pc + 1 < end)
+      emit_line("br label %%L%d", pc + 1);
+  }
+  cur_emitter()->line_suffix = NULL;
+  emit_line("store i32 %d, i32* %%r.pc, align 4", end);
+  emit_line("br label %%leave");
+
+  emit_line("");
+  emit_line("dispatch:");
+  emit_line("%%dpc = load i32, i32* %%r.pc, align 4");
+  emit_line("%%doff = sub i32 %%dpc, %d", start);
+  emit_line("%%din = icmp ult i32 %%doff, %d", end - start);
+  emit_line("br i1 %%din, label %%dtable, label %%leave");
+  emit_line("");
+  emit_line("dtable:");
+  emit_line("%%didx = zext i32 %%doff to i64");
+  emit_line("%%dptr = getelementptr inbounds [%d x i8*], [%d x i8*]* @labels%d, "
+            "i64 0, i64 %%didx", end - start, end - start, func_id);
+  emit_line("%%daddr = load i8*, i8** %%dptr, align 8");
+  emit_line("indirectbr i8* %%daddr, [");
+  for (int pc = start; pc < end; pc++) {
+    if (is_entry[pc])
+      emit_line("  label %%L%d,", pc);
+  }
+  emit_line("  label %%bad");
+  emit_line("]");
+  emit_line("");
+  emit_line("bad:");
+  emit_line("call void @exit(i32 1)");
+  emit_line("unreachable");
+  emit_line("");
+  emit_line("leave:");
+  ll_emit_store_regs();
+  emit_line("ret void");
+  dec_indent();
+  emit_line("}");
+  ll_dbg_func_end();
+
+  emit_line("");
+  emit_line("@labels%d = internal constant [%d x i8*] [",
+            func_id, end - start);
+  for (int pc = start; pc < end; pc++) {
+    emit_line("  i8* blockaddress(@func%d, %%%s)%s", func_id,
+              is_entry[pc] ? format("L%d", pc) : "bad",
+              pc + 1 < end ? "," : "");
+  }
+  emit_line("]");
+}
+
+// Calls the function of pc by a binary search over functions lo to hi.
+static void ll_cfg_emit_call(int lo, int hi) {
+  emit_line("");
+  emit_line("call%d_%d:", lo, hi);
+  if (lo + 1 == hi) {
+    emit_line("call void @func%d()", lo);
+    emit_line("br label %%loop");
+    return;
+  }
+  int mid = (lo + hi) / 2;
+  emit_line("%%lt%d_%d = icmp ult i32 %%pc, %d",
+            lo, hi, ll_cfg_plan->starts[mid]);
+  emit_line("br i1 %%lt%d_%d, label %%call%d_%d, label %%call%d_%d",
+            lo, hi, lo, mid, mid, hi);
+  ll_cfg_emit_call(lo, mid);
+  ll_cfg_emit_call(mid, hi);
+}
+
+void target_ll_cfg(Module* module) {
+  CFG* cfg = build_cfg(module);
+  ll_cfg_plan = plan_chunks(cfg);
+  ll_cfg_blocks = cfg->blocks;
+  ll_cfg_num_pcs = module->num_pcs;
+
+  ll_init_state();
+  ll_dbg_init();
+  int num_funcs = ll_cfg_plan->num_funcs;
+  for (int i = 0; i < num_funcs; i++)
+    ll_cfg_emit_func(module, i);
+
+  ll_emit_decls();
+
+  emit_line("");
+  emit_line("define i32 @main() {");
+  inc_indent();
+  Data* data = module->data;
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v) {
+      emit_line("store i32 %d, i32* getelementptr inbounds ([16777216 x i32], [16777216 x i32]* @mem, i32 0, i64 %d), align 4, " LL_MEM_STORE_MD, data->v, mp);
+    }
+  }
+  emit_line("br label %%loop");
+  emit_line("");
+  emit_line("loop:");
+  emit_line("%%pc = load i32, i32* @pc, align 4");
+  emit_line("%%valid = icmp ult i32 %%pc, %d", module->num_pcs);
+  if (num_funcs) {
+    emit_line("br i1 %%valid, label %%call0_%d, label %%done", num_funcs);
+    ll_cfg_emit_call(0, num_funcs);
+  } else {
+    emit_line("br label %%done");
+  }
+  emit_line("");
+  emit_line("done:");
+  emit_line("ret i32 1");
+  dec_indent();
+  emit_line("}");
+  ll_emit_metadata();
 }
@@ -1,6 +1,28 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Output for LuaJIT, chosen by -luajit: memory in an FFI array, the
+// registers in locals of each function, and the bit library instead of
+// the Lua 5.3 operators, which LuaJIT lacks.
+bool LUA_JIT;
+
+// The registers outside the functions, which copy them into locals.
+static const char* lua_reg(int r) {
+  return LUA_JIT ? format("r_%s", reg_names[r]) : reg_names[r];
+}
+
+// dst = (dst op src) & UINT_MAX, with the operator Lua 5.3 has for it
+// or LuaJIT's bit.band.
+static void lua_emit_arith(Inst* inst, const char* op) {
+  const char* dst = reg_names[inst->dst.reg];
+  if (LUA_JIT) {
+    emit_line("%s = band(%s %s %s, " UINT_MAX_STR ")",
+              dst, dst, op, src_str(inst));
+  } else {
+    emit_line("%s = (%s %s %s) & " UINT_MAX_STR, dst, dst, op, src_str(inst));
+  }
+}
+
 const char* lua_cmp_str(Inst* inst, const char* true_str) {
   int op = normalize_cond(inst->op, 0);
   const char* op_str;
@@ -25,12 +47,44 @@ const char* lua_cmp_str(Inst* inst, const char* true_str) {
   return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
 }
 
+// Decodes the data from hex at once, which is much smaller and faster
+// to load than a statement per word.
+static void lua_emit_bulk_data(Data* data, int len) {
+  emit_line("local data = table.concat{");
+  for (int mp = 0; mp < len; mp += 16) {
+    int n = len - mp < 16 ? len - mp : 16;
+    emit_line("  '%s',", format_data_hex(&data, n));
+  }
+  emit_line("}");
+  emit_line("for i = 0, %d do", len - 1);
+  emit_line("  mem[i] = tonumber(data:sub(i * 6 + 1, i * 6 + 6), 16)");
+  emit_line("end");
+}
+
 static void init_state_lua(Data* data) {
+  if (LUA_JIT) {
+    emit_line("local ffi = require('ffi')");
+    emit_line("local band = require('bit').band");
+  }
+  emit_line("io.stdout:setvbuf('full', %s)", LUA_JIT ? "65536" : "1 << 16");
   for (int i = 0; i < 7; i++) {
-    emit_line("%s = 0", reg_names[i]);
+    emit_line("%s%s = 0", LUA_JIT ? "local " : "", lua_reg(i));
+  }
+  if (LUA_JIT) {
+    // The stack starts at the top of the address space, so it all
+    // counts. ffi.new hands it out zeroed, with no loop.
+    emit_line("local mem = ffi.new('int32_t[?]', %d)", UINT_MAX + 1);
+  } else if (MEM_MODEL == MEM_SPARSE) {
+    emit_line("mem = setmetatable({}, {__index = function() return 0 end})");
+  } else {
+    emit_line("mem = {}");
+    emit_line("for _ = 0, ((1 << 24) -1) do mem[_] = 0; end");
+  }
+  int bulk_len = bulk_data_len(data);
+  if (bulk_len) {
+    lua_emit_bulk_data(data, bulk_len);
+    return;
   }
-  emit_line("mem = {}");
-  emit_line("for _ = 0, ((1 << 24) -1) do mem[_] = 0; end");
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("mem[%d] = %d", mp, data->v);
@@ -38,10 +92,27 @@ static void init_state_lua(Data* data) {
   }
 }
 
+// Copies the registers between the locals of a function and those
+// outside, for -luajit, whose traces keep locals in machine registers.
+static void lua_emit_reg_copy(bool in) {
+  const char* names = reg_names[0];
+  const char* outer = lua_reg(0);
+  for (int i = 1; i < 7; i++) {
+    names = format("%s, %s", names, reg_names[i]);
+    outer = format("%s, %s", outer, lua_reg(i));
+  }
+  if (in)
+    emit_line("local %s = %s", names, outer);
+  else
+    emit_line("%s = %s", outer, names);
+}
+
 static void lua_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("function func%d()", func_id);
   inc_indent();
+  if (LUA_JIT)
+    lua_emit_reg_copy(true);
   emit_line("");
 
   emit_line("while %d <= pc and pc < %d do",
@@ -57,6 +128,8 @@ static void lua_emit_func_epilogue(void) {
   emit_line("pc = pc + 1");
   dec_indent();
   emit_line("end");
+  if (LUA_JIT)
+    lua_emit_reg_copy(false);
   dec_indent();
   emit_line("end");
 }
@@ -75,32 +148,39 @@ static void lua_emit_inst(Inst* inst) {
     break;
 
   case ADD:
-    emit_line("%s = (%s + %s) & " UINT_MAX_STR,
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+    lua_emit_arith(inst, "+");
     break;
 
   case SUB:
-    emit_line("%s = (%s - %s) & " UINT_MAX_STR,
-              reg_names[inst->dst.reg],
-              reg_names[inst->dst.reg], src_str(inst));
+    lua_emit_arith(inst, "-");
     break;
 
   case LOAD:
+    if (inst->global_var) {
+      emit_line("%s = g%d", reg_names[inst->dst.reg], global_var_addr(inst));
+      break;
+    }
     emit_line("%s = mem[%s]", reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case STORE:
+    if (inst->global_var) {
+      emit_line("g%d = %s", global_var_addr(inst), reg_names[inst->dst.reg]);
+      break;
+    }
     emit_line("mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("io.write(string.char(%s))", src_str(inst));
+    if (LUA_JIT)
+      emit_line("io.write(string.char(band(%s, 255)))", src_str(inst));
+    else
+      emit_line("io.write(string.char(%s & 255))", src_str(inst));
     break;
 
   case GETC:
-    emit_line("_ = io.read(1); %s = _ and string.byte(_) or 0",
-              reg_names[inst->dst.reg]);
+    emit_line("io.stdout:flush(); _ = io.read(1); "
+              "%s = _ and string.byte(_) or 0", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
@@ -136,8 +216,11 @@ static void lua_emit_inst(Inst* inst) {
   }
 }
 
+const int target_lua_ext_ops = GLOBAL_VAR_BIT;
+
 void target_lua(Module* module) {
   init_state_lua(module->data);
+  emit_global_var_inits(module, "g%d = %d");
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          lua_emit_func_prologue,
@@ -145,14 +228,17 @@ void target_lua(Module* module) {
                                          lua_emit_pc_change,
                                          lua_emit_inst);
 
+  // A table of the functions, so leaving one costs an index, not a
+  // comparison per function.
   emit_line("");
+  emit_line("local funcs = {");
+  for (int i = 0; i < num_funcs; i++)
+    emit_line("  [%d] = func%d,", i, i);
+  emit_line("}");
   emit_line("while true do");
-  inc_indent();
-  emit_line("if false then");
-  for (int i = 0; i < num_funcs; i++) {
-    emit_line("elseif pc < %d then func%d();", (i + 1) * CHUNKED_FUNC_SIZE, i);
-  }
-  emit_line("end");
-  dec_indent();
+  if (LUA_JIT)
+    emit_line("  funcs[math.floor(r_pc / %d)]()", CHUNKED_FUNC_SIZE);
+  else
+    emit_line("  funcs[pc // %d]()", CHUNKED_FUNC_SIZE);
   emit_line("end");
 }
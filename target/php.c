@@ -5,7 +5,8 @@ static const char* PHP_REG_NAMES[] = {
   "$a", "$b", "$c", "$d", "$bp", "$sp", "$pc"
 };
 
-static void init_state_php(Data* data) {
+static void init_state_php(Module* module) {
+  Data* data = module->data;
   reg_names = PHP_REG_NAMES;
   emit_line("<?php");
 
@@ -15,17 +16,26 @@ static void init_state_php(Data* data) {
     emit_line("%s = 0;", reg_names[i]);
   }
   emit_line("$running = true;");
-  emit_line("$mem = array();");
   /* Array initialization wastes a lot of memory */
   emit_line("ini_set(\"memory_limit\", \"768M\");");
-  emit_line("// for ($_ = 0; $_ < (1 << 24); $_++) $mem[$_] = null; unset($_);");
+  if (MEM_MODEL == MEM_PACKED) {
+    // A packed array of ints, zeroed up front: a load indexes it
+    // directly, where the hash below needs a lookup and a fallback for
+    // missing keys. It takes up to half of the 768M above. The other
+    // models both get the hash.
+    emit_line("$mem = array_fill(0, 1 << 24, 0);");
+  } else {
+    emit_line("$mem = array();");
+  }
 
   emit_line("$stdin = fopen('php://stdin', 'r');");
+  emit_line("ob_start(null, 1 << 16);");
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("$mem[%d] = %d;", mp, data->v);
     }
   }
+  emit_global_var_inits(module, "$g%d = %d;");
   emit_line("goto main;");
 }
 
@@ -80,20 +90,34 @@ static void php_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = @$mem[%s] ?: 0; // @undefined index as 0",
+    if (inst->global_var) {
+      emit_line("%s = $g%d;", reg_names[inst->dst.reg], global_var_addr(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("%s = $mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+      break;
+    }
+    // ?? reads a missing key as 0 without raising a notice, which @
+    // would then have to silence.
+    emit_line("%s = $mem[%s] ?? 0;",
               reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case STORE:
+    if (inst->global_var) {
+      emit_line("$g%d = %s;", global_var_addr(inst), reg_names[inst->dst.reg]);
+      break;
+    }
     emit_line("$mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("printf(\"%%c\", %s);", src_str(inst));
+    emit_line("echo chr(%s);", src_str(inst));
     break;
 
   case GETC:
-    emit_line("%s = ord(fgetc($stdin));",
+    emit_line("ob_flush(); %s = ord(fgetc($stdin));",
               reg_names[inst->dst.reg]);
     break;
 
@@ -130,8 +154,10 @@ static void php_emit_inst(Inst* inst) {
   }
 }
 
+const int target_php_ext_ops = GLOBAL_VAR_BIT;
+
 void target_php(Module* module) {
-  init_state_php(module->data);
+  init_state_php(module);
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          php_emit_func_prologue,
@@ -7,8 +7,15 @@
 
 #define PIET_IMM_BASE 6
 #define PIET_INIT_STACK_SIZE 65545
+#define PIET_CONST_LIMIT (PIET_INIT_STACK_SIZE + 1)
+#define PIET_CONST_STEP 12
+#define PIET_FILL_SIZE 64
 #define PIET_DUMP_INST 0
 
+// Words are 16-bit here, so a MUL wraps at 65536 like ADD does.
+const int target_piet_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(DIV) | EXT_OP_BIT(MOD);
+
 enum {
   PIET_PUSH,
   PIET_POP,
@@ -115,42 +122,147 @@ static void piet_emit(PietInst** pi, uint op) {
   piet_emit_a(pi, op, 0);
 }
 
+static PietBlock* piet_new_block(PietBlock* pb, PietInst** pi) {
+  pb->next = calloc(1, sizeof(PietBlock));
+  pb = pb->next;
+  *pi = calloc(1, sizeof(PietInst));
+  pb->inst = *pi;
+  piet_emit(pi, PIET_POP);
+  return pb;
+}
+
+static uint piet_block_len(PietBlock* pb) {
+  uint len = 0;
+  for (PietInst* pi = pb->inst->next; pi; pi = pi->next)
+    len++;
+  return len;
+}
+
 static void piet_push_digit(PietInst** pi, uint v) {
   assert(v > 0);
   piet_emit_a(pi, PIET_PUSH, v);
 }
 
-static void piet_push(PietInst** pi, uint v) {
-  if (v == 0) {
-    piet_push_digit(pi, 1);
-    piet_emit(pi, PIET_NOT);
-    return;
+// How each constant below PIET_CONST_LIMIT is built, and its cost: an
+// instruction counts 8 plus its codels, so the row width comes first
+// and the pushed block sizes break ties.
+enum {
+  PIET_CONST_DIGIT,
+  PIET_CONST_ZERO,
+  PIET_CONST_MUL,
+  PIET_CONST_SQUARE,
+  PIET_CONST_DOUBLE,
+  PIET_CONST_ADD,
+  PIET_CONST_SUB
+};
+
+typedef struct {
+  uint cost;
+  byte how;
+  uint arg;
+} PietConst;
+
+static PietConst* piet_consts;
+
+static bool piet_relax(uint v, uint cost, byte how, uint arg) {
+  if (v >= PIET_CONST_LIMIT || cost >= piet_consts[v].cost)
+    return false;
+  piet_consts[v].cost = cost;
+  piet_consts[v].how = how;
+  piet_consts[v].arg = arg;
+  return true;
+}
+
+static void piet_init_consts(void) {
+  PietConst* c = calloc(PIET_CONST_LIMIT, sizeof(PietConst));
+  piet_consts = c;
+  // Large enough to never win, small enough to add up without wrapping.
+  for (uint v = 0; v < PIET_CONST_LIMIT; v++)
+    c[v].cost = 1 << 20;
+  c[0].cost = 18;
+  c[0].how = PIET_CONST_ZERO;
+  for (uint v = 1; v <= PIET_IMM_BASE; v++) {
+    c[v].cost = 8 + v;
+    c[v].how = PIET_CONST_DIGIT;
   }
 
-  uint c[16];
-  uint cs = 0;
-  do {
-    c[cs++] = v % PIET_IMM_BASE;
-    v /= PIET_IMM_BASE;
-  } while (v);
-
-  for (uint i = 0; i < cs; i++) {
-    if (i != 0) {
-      piet_push_digit(pi, PIET_IMM_BASE);
-      piet_emit(pi, PIET_MUL);
+  // Products, then doubling and small steps up and down, until nothing
+  // gets cheaper.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (uint a = 2; a * a < PIET_CONST_LIMIT; a++) {
+      changed |= piet_relax(a * a, c[a].cost + 18, PIET_CONST_SQUARE, a);
+      for (uint b = a + 1; a * b < PIET_CONST_LIMIT; b++) {
+        changed |= piet_relax(a * b, c[a].cost + c[b].cost + 9,
+                              PIET_CONST_MUL, a);
+      }
     }
-    char v = c[cs - i - 1];
-    if (v) {
-      piet_push_digit(pi, v);
-      if (i != 0)
-        piet_emit(pi, PIET_ADD);
+    for (uint v = 1; v < PIET_CONST_LIMIT; v++) {
+      changed |= piet_relax(v * 2, c[v].cost + 18, PIET_CONST_DOUBLE, v);
+      for (uint k = 1; k <= PIET_CONST_STEP; k++) {
+        uint cost = c[v].cost + c[k].cost + 9;
+        changed |= piet_relax(v + k, cost, PIET_CONST_ADD, k);
+        if (v > k)
+          changed |= piet_relax(v - k, cost, PIET_CONST_SUB, k);
+      }
     }
   }
 }
 
+static void piet_push(PietInst** pi, uint v) {
+  if (v >= PIET_CONST_LIMIT) {
+    piet_push(pi, v / 65536);
+    piet_push(pi, 65536);
+    piet_emit(pi, PIET_MUL);
+    if (v % 65536) {
+      piet_push(pi, v % 65536);
+      piet_emit(pi, PIET_ADD);
+    }
+    return;
+  }
+
+  if (!piet_consts)
+    piet_init_consts();
+  PietConst* c = &piet_consts[v];
+  switch (c->how) {
+  case PIET_CONST_DIGIT:
+    piet_push_digit(pi, v);
+    break;
+  case PIET_CONST_ZERO:
+    piet_push_digit(pi, 1);
+    piet_emit(pi, PIET_NOT);
+    break;
+  case PIET_CONST_MUL:
+    piet_push(pi, c->arg);
+    piet_push(pi, v / c->arg);
+    piet_emit(pi, PIET_MUL);
+    break;
+  case PIET_CONST_SQUARE:
+    piet_push(pi, c->arg);
+    piet_emit(pi, PIET_DUP);
+    piet_emit(pi, PIET_MUL);
+    break;
+  case PIET_CONST_DOUBLE:
+    piet_push(pi, c->arg);
+    piet_emit(pi, PIET_DUP);
+    piet_emit(pi, PIET_ADD);
+    break;
+  case PIET_CONST_ADD:
+    piet_push(pi, v - c->arg);
+    piet_push(pi, c->arg);
+    piet_emit(pi, PIET_ADD);
+    break;
+  case PIET_CONST_SUB:
+    piet_push(pi, v + c->arg);
+    piet_push(pi, c->arg);
+    piet_emit(pi, PIET_SUB);
+    break;
+  }
+}
+
 static void piet_push_minus1(PietInst** pi) {
-  piet_push(pi, 0);
   piet_push(pi, 1);
+  piet_push(pi, 2);
   piet_emit(pi, PIET_SUB);
 }
 
@@ -200,6 +312,32 @@ static void piet_push_value(PietInst** pi, Value* v, uint stk) {
   }
 }
 
+// Set by -piet-share: LOAD and STORE call shared rows instead of
+// being inlined, and the rest of their block continues in a row after
+// the code.
+bool PIET_SHARE_MEM;
+
+// The rows before pc 0: the fill row, then the shared ones.
+enum {
+  PIET_FILL_ROW,
+  PIET_LOAD_ROW,
+  PIET_STORE_ROW
+};
+
+static uint piet_pc_base;
+static PietBlock* piet_cont_tail;
+static uint piet_cont_row;
+
+static void piet_push_target(PietInst** pi, Value* v, uint stk) {
+  if (v->type == IMM) {
+    piet_push(pi, v->imm + piet_pc_base);
+  } else {
+    piet_push_value(pi, v, stk);
+    piet_push(pi, piet_pc_base);
+    piet_emit(pi, PIET_ADD);
+  }
+}
+
 static void piet_push_dst(PietInst** pi, Inst* inst, uint stk) {
   piet_push_value(pi, &inst->dst, stk);
 }
@@ -214,6 +352,49 @@ static void piet_uint_mod(PietInst** pi) {
   piet_emit(pi, PIET_MOD);
 }
 
+// Replaces the address on top with the word there. |extra| values are
+// between it and the registers.
+static void piet_emit_load(PietInst** pi, uint extra) {
+  piet_emit(pi, PIET_DUP);
+  piet_push(pi, PIET_MEM + 2 + extra);
+  piet_emit(pi, PIET_ADD);
+  piet_push_minus1(pi);
+  piet_emit(pi, PIET_ROLL);
+  // Put a copy back with the address kept below it, rather than
+  // rolling the address through the whole stack.
+  piet_emit(pi, PIET_DUP);
+  piet_rroll(pi, 3, 1);
+  piet_push(pi, PIET_MEM + 2 + extra);
+  piet_emit(pi, PIET_ADD);
+  piet_push(pi, 1);
+  piet_emit(pi, PIET_ROLL);
+}
+
+// Pops the address on top and the value below it into the memory.
+static void piet_emit_store(PietInst** pi, uint extra) {
+  piet_emit(pi, PIET_DUP);
+
+  piet_push(pi, PIET_MEM + 3 + extra);
+  piet_emit(pi, PIET_ADD);
+  piet_push_minus1(pi);
+  piet_emit(pi, PIET_ROLL);
+  piet_emit(pi, PIET_POP);
+
+  piet_push(pi, PIET_MEM + 1 + extra);
+  piet_emit(pi, PIET_ADD);
+  piet_push(pi, 1);
+  piet_emit(pi, PIET_ROLL);
+}
+
+// A call of a shared row pushes the row it returns to, then its
+// arguments, then jumps here. The code after it goes to that row.
+static void piet_call(PietInst** pi, uint row) {
+  piet_push(pi, row);
+  piet_emit(pi, PIET_JMP);
+  piet_cont_tail = piet_new_block(piet_cont_tail, pi);
+  piet_cont_row++;
+}
+
 static void piet_cmp(PietInst** pi, Inst* inst, int stk) {
   Op op = normalize_cond(inst->op, false);
   if (op == JLT) {
@@ -250,6 +431,41 @@ static void piet_cmp(PietInst** pi, Inst* inst, int stk) {
   }
 }
 
+// DIV by 0 gives UINT_MAX and MOD by 0 leaves dst. A register divisor
+// is made 1 when it's 0, and the difference added afterwards.
+static void piet_emit_divmod(PietInst** pi, Inst* inst) {
+  uint op = inst->op == DIV ? PIET_DIV : PIET_MOD;
+  if (inst->src.type == IMM) {
+    if (inst->src.imm % 65536) {
+      piet_push_dst(pi, inst, 0);
+      piet_push_src(pi, inst, 1);
+      piet_emit(pi, op);
+    } else if (op == PIET_DIV) {
+      piet_push(pi, 65535);
+    } else {
+      piet_push_dst(pi, inst, 0);
+    }
+    return;
+  }
+  piet_push_dst(pi, inst, 0);
+  piet_push_src(pi, inst, 1);
+  piet_emit(pi, PIET_DUP);
+  piet_emit(pi, PIET_NOT);
+  piet_emit(pi, PIET_ADD);
+  piet_emit(pi, op);
+  piet_push_src(pi, inst, 1);
+  piet_emit(pi, PIET_NOT);
+  if (op == PIET_DIV) {
+    piet_push(pi, 65535);
+    piet_push_dst(pi, inst, 3);
+    piet_emit(pi, PIET_SUB);
+  } else {
+    piet_push_dst(pi, inst, 2);
+  }
+  piet_emit(pi, PIET_MUL);
+  piet_emit(pi, PIET_ADD);
+}
+
 static void piet_emit_inst(PietInst** pi, Inst* inst) {
   switch (inst->op) {
   case MOV:
@@ -275,48 +491,43 @@ static void piet_emit_inst(PietInst** pi, Inst* inst) {
     piet_store_top(pi, PIET_A + inst->dst.reg);
     break;
 
-  case LOAD:
-    piet_push_src(pi, inst, 0);
-    piet_emit(pi, PIET_DUP);
-    // Put the address to the bottom of the stack.
-    piet_push(pi, PIET_INIT_STACK_SIZE);
-    piet_push(pi, 1);
-    piet_emit(pi, PIET_ROLL);
-
-    piet_push(pi, PIET_MEM + 1);
-    piet_emit(pi, PIET_ADD);
-    piet_push_minus1(pi);
-    piet_emit(pi, PIET_ROLL);
-    piet_emit(pi, PIET_DUP);
-
-    // Get the address from the bottom of the stack.
-    piet_push(pi, PIET_INIT_STACK_SIZE);
-    piet_push_minus1(pi);
-    piet_emit(pi, PIET_ROLL);
+  case MUL:
+    piet_push_dst(pi, inst, 0);
+    piet_push_src(pi, inst, 1);
+    piet_emit(pi, PIET_MUL);
+    piet_uint_mod(pi);
+    piet_store_top(pi, PIET_A + inst->dst.reg);
+    break;
 
-    piet_push(pi, PIET_MEM + 2);
-    piet_emit(pi, PIET_ADD);
-    piet_push(pi, 1);
-    piet_emit(pi, PIET_ROLL);
+  case DIV:
+  case MOD:
+    piet_emit_divmod(pi, inst);
+    piet_store_top(pi, PIET_A + inst->dst.reg);
+    break;
 
+  case LOAD:
+    if (PIET_SHARE_MEM) {
+      piet_push(pi, piet_cont_row);
+      piet_push_src(pi, inst, 1);
+      piet_call(pi, PIET_LOAD_ROW);
+    } else {
+      piet_push_src(pi, inst, 0);
+      piet_emit_load(pi, 0);
+    }
     piet_store_top(pi, PIET_A + inst->dst.reg);
     break;
 
   case STORE:
-    piet_push_dst(pi, inst, 0);
-    piet_push_src(pi, inst, 1);
-    piet_emit(pi, PIET_DUP);
-
-    piet_push(pi, PIET_MEM + 3);
-    piet_emit(pi, PIET_ADD);
-    piet_push_minus1(pi);
-    piet_emit(pi, PIET_ROLL);
-    piet_emit(pi, PIET_POP);
-
-    piet_push(pi, PIET_MEM + 1);
-    piet_emit(pi, PIET_ADD);
-    piet_push(pi, 1);
-    piet_emit(pi, PIET_ROLL);
+    if (PIET_SHARE_MEM) {
+      piet_push(pi, piet_cont_row);
+      piet_push_dst(pi, inst, 1);
+      piet_push_src(pi, inst, 2);
+      piet_call(pi, PIET_STORE_ROW);
+    } else {
+      piet_push_dst(pi, inst, 0);
+      piet_push_src(pi, inst, 1);
+      piet_emit_store(pi, 0);
+    }
     break;
 
   case PUTC:
@@ -377,8 +588,8 @@ static void piet_emit_inst(PietInst** pi, Inst* inst) {
   case JGT:
   case JLE:
   case JGE:
-    piet_push(pi, inst->pc + 1);
-    piet_push_value(pi, &inst->jmp, 1);
+    piet_push(pi, inst->pc + 1 + piet_pc_base);
+    piet_push_target(pi, &inst->jmp, 1);
     piet_push(pi, 2);
     piet_cmp(pi, inst, 3);
     piet_emit(pi, PIET_ROLL);
@@ -387,7 +598,7 @@ static void piet_emit_inst(PietInst** pi, Inst* inst) {
     break;
 
   case JMP:
-    piet_push_value(pi, &inst->jmp, 0);
+    piet_push_target(pi, &inst->jmp, 0);
     piet_emit(pi, PIET_JMP);
     break;
 
@@ -403,8 +614,13 @@ static uint piet_next_color(uint c, uint op) {
   return l + h * 3;
 }
 
-static uint piet_init_state(Data* data, PietInst* pi) {
-  uint vals[PIET_INIT_STACK_SIZE];
+// The initial stack is the memory, the registers and the counter of
+// the first row, from bottom to top. Only the zeros at the bottom are
+// pushed by the init state; the fill row repeats PIET_FILL_SIZE of
+// them, and the rest goes to rows after the code, which end in pc 0.
+static void piet_init_state(Data* data, PietInst* pi, PietBlock* fill,
+                            PietBlock* pb, uint data_row, uint width) {
+  static uint vals[PIET_INIT_STACK_SIZE];
   for (uint i = 0; i < PIET_INIT_STACK_SIZE; i++) {
     uint v = 0;
     if (i >= PIET_MEM + 1 && data) {
@@ -414,49 +630,166 @@ static uint piet_init_state(Data* data, PietInst* pi) {
     vals[PIET_INIT_STACK_SIZE-i-1] = v;
   }
 
-  PietInst* opi = pi;
+  uint zeros = 0;
+  while (zeros < PIET_INIT_STACK_SIZE - 1 && !vals[zeros])
+    zeros++;
+  if (zeros == PIET_INIT_STACK_SIZE - 1)
+    data_row = piet_pc_base;
+
+  PietInst* fpi = fill->inst->next;
+  piet_push(&fpi, 0);
+  for (uint i = 1; i < PIET_FILL_SIZE; i++)
+    piet_emit(&fpi, PIET_DUP);
+  piet_rroll(&fpi, PIET_FILL_SIZE + 1, 1);
+  piet_push(&fpi, 1);
+  piet_emit(&fpi, PIET_SUB);
+  piet_emit(&fpi, PIET_DUP);
+  piet_emit(&fpi, PIET_NOT);
+  piet_push(&fpi, data_row);
+  piet_emit(&fpi, PIET_MUL);
+  piet_emit(&fpi, PIET_JMP);
+  if (width < piet_block_len(fill))
+    width = piet_block_len(fill);
+
+  uint row = data_row;
+  PietInst* dpi = 0;
+  uint len = 0;
   bool prev_zero = false;
-  for (uint i = 0; i < PIET_INIT_STACK_SIZE; i++) {
+  for (uint i = zeros; i < PIET_INIT_STACK_SIZE - 1; i++) {
+    // Leave room for the push of the next row.
+    if (!dpi || len + 8 >= width) {
+      if (dpi)
+        piet_push(&dpi, ++row);
+      pb = piet_new_block(pb, &dpi);
+      len = 0;
+      prev_zero = false;
+    }
+    PietInst* prev = dpi;
     uint v = vals[i];
     if (v == 0 && prev_zero) {
-      piet_emit(&pi, PIET_DUP);
+      piet_emit(&dpi, PIET_DUP);
     } else {
-      piet_push(&pi, v);
+      piet_push(&dpi, v);
     }
     prev_zero = v == 0;
+    for (; prev != dpi; prev = prev->next)
+      len++;
   }
+  if (dpi)
+    piet_push(&dpi, piet_pc_base);
+
+  // The fill row leaves its last count, zero, on the stack.
+  uint loops = zeros > PIET_FILL_SIZE ? (zeros - 1) / PIET_FILL_SIZE : 0;
+  if (loops)
+    zeros -= loops * PIET_FILL_SIZE + 1;
+  for (uint i = 0; i < zeros; i++) {
+    if (i)
+      piet_emit(&pi, PIET_DUP);
+    else
+      piet_push(&pi, 0);
+  }
+  if (loops)
+    piet_push(&pi, loops);
+  piet_push(&pi, loops ? 0 : data_row);
+}
 
-  uint size = 0;
-  for (pi = opi->next; pi; pi = pi->next) {
-    if (pi->op == PIET_PUSH) {
-      size += pi->arg;
+static void piet_put(byte* pixels, uint w, uint y, uint x, byte v) {
+  if (pixels)
+    pixels[y*w+x] = v;
+}
+
+// Lays the instructions of the initial state out in rows of width w
+// which turn at both edges, or only finds where they end if pixels is
+// NULL. Returns the row of the end, and its column in *end_x.
+static uint piet_layout_init(PietInst* init, byte* pixels, uint w,
+                             uint* end_x) {
+  uint c = 0;
+  uint y = 0;
+  uint x = 0;
+  int dx = 1;
+  piet_put(pixels, w, y, x++, 2);
+  for (PietInst* pi = init; pi; pi = pi->next) {
+    c = piet_next_color(c, pi->op);
+
+    if (pi->next && pi->next->op == PIET_PUSH) {
+      for (uint i = 0; i < pi->next->arg; i++) {
+        piet_put(pixels, w, y, x, c + 2);
+        x += dx;
+      }
     } else {
-      size++;
+      piet_put(pixels, w, y, x, c + 2);
+      x += dx;
+    }
+
+    if (x >= w - PIET_IMM_BASE && dx == 1) {
+      piet_put(pixels, w, y+1, x-1, c + 2);
+      piet_put(pixels, w, y+2, x-1, c + 2);
+      piet_put(pixels, w, y+3, x-1, c + 2);
+      x = x-1;
+      y += 4;
+      dx = -1;
+    }
+
+    if ((x <= 1 + PIET_IMM_BASE || !pi->next) && dx == -1) {
+      while (x >= w - 2) {
+        piet_put(pixels, w, y, x, 1);
+        x--;
+      }
+      piet_put(pixels, w, y, x, 1);
+      piet_put(pixels, w, y, x-1, 1);
+      piet_put(pixels, w, y-1, x-1, 1);
+      piet_put(pixels, w, y-1, x, 1);
+      piet_put(pixels, w, y+1, x, 1);
+      piet_put(pixels, w, y+2, x, 1);
+      piet_put(pixels, w, y+3, x, 1);
+      piet_put(pixels, w, y+3, x-1, 1);
+      piet_put(pixels, w, y+2, x-1, 1);
+      piet_put(pixels, w, y+2, x+1, 2);
+      c = 0;
+      x += 2;
+      y += 2;
+      dx = 1;
     }
   }
-  return size;
+  *end_x = x;
+  return y;
 }
 
-
 void target_piet(Module* module) {
   PietBlock pb_head;
   PietBlock* pb = &pb_head;
   PietInst* pi = 0;
 
+  PietBlock* fill = piet_new_block(pb, &pi);
+  pb = fill;
+  piet_pc_base = PIET_LOAD_ROW;
+  if (PIET_SHARE_MEM) {
+    pb = piet_new_block(pb, &pi);
+    piet_emit_load(&pi, 1);
+    piet_roll(&pi, 2, 1);
+    piet_emit(&pi, PIET_JMP);
+
+    pb = piet_new_block(pb, &pi);
+    piet_emit_store(&pi, 1);
+    piet_emit(&pi, PIET_JMP);
+    piet_pc_base = PIET_STORE_ROW + 1;
+  }
+  pi = 0;
+
+  PietBlock cont_head = {};
+  piet_cont_tail = &cont_head;
+  piet_cont_row = piet_pc_base;
+  for (Inst* inst = module->text; inst; inst = inst->next)
+    piet_cont_row = piet_pc_base + inst->pc + 1;
+
   int prev_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     if (prev_pc != inst->pc) {
       if (pi && pi->op != PIET_JMP) {
-        piet_push(&pi, inst->pc);
+        piet_push(&pi, inst->pc + piet_pc_base);
       }
 
-      pb->next = calloc(1, sizeof(PietBlock));
-      pb = pb->next;
-
-      pi = calloc(1, sizeof(PietInst));
-      pb->inst = pi;
-
-      piet_emit(&pi, PIET_POP);
+      pb = piet_new_block(pb, &pi);
 
       // Dump PC.
 #if 0
@@ -470,15 +803,27 @@ void target_piet(Module* module) {
     prev_pc = inst->pc;
     piet_emit_inst(&pi, inst);
   }
+  if (cont_head.next) {
+    pb->next = cont_head.next;
+    pb = piet_cont_tail;
+  }
 
   int pc = 0;
-  int longest_block = 0;
+  uint longest_block = 0;
+  for (PietBlock* b = pb_head.next; b; b = b->next) {
+    pc++;
+    uint block_len = piet_block_len(b);
+    if (longest_block < block_len)
+      longest_block = block_len;
+  }
+
+  PietInst init_state = {};
+  piet_init_state(module->data, &init_state, fill, pb, pc, longest_block);
+
+  pc = 0;
   for (pb = pb_head.next; pb; pb = pb->next) {
     pc++;
-    int block_len = 0;
-    for (pi = pb->inst->next; pi; pi = pi->next) {
-      block_len++;
-    }
+    uint block_len = piet_block_len(pb);
     if (longest_block < block_len)
       longest_block = block_len;
   }
@@ -494,68 +839,16 @@ void target_piet(Module* module) {
   }
 #endif
 
-  PietInst init_state = {};
-  uint init_state_size = piet_init_state(module->data, &init_state);
 
   uint w = longest_block + 20;
-  uint h =
-      pc * 7 + (init_state_size / (w - 4 - PIET_IMM_BASE * 2) + 1) * 4 + 10;
+  uint x;
+  uint y = piet_layout_init(init_state.next, NULL, w, &x);
+  // The rows of the initial state, the border below them, 7 rows per
+  // block and the 10 rows at the bottom.
+  uint h = y + 9 + pc * 7 + 10;
   byte* pixels = calloc(w * h, 1);
-
-#if 0
-  fprintf(stderr, "estimated init_state_size=%d w=%d h=%d\n",
-          init_state_size, w, h);
-#endif
-
-  uint c = 0;
-  uint y = 0;
-  uint x = 0;
-  int dx = 1;
-  pixels[y*w+x++] = 2;
-  for (pi = init_state.next; pi; pi = pi->next) {
-    assert(y < h);
-    c = piet_next_color(c, pi->op);
-
-    if (pi->next && pi->next->op == PIET_PUSH) {
-      for (uint i = 0; i < pi->next->arg; i++) {
-        pixels[y*w+x] = c + 2;
-        x += dx;
-      }
-    } else {
-      pixels[y*w+x] = c + 2;
-      x += dx;
-    }
-
-    if (x >= w - PIET_IMM_BASE && dx == 1) {
-      pixels[(y+1)*w+x-1] = c + 2;
-      pixels[(y+2)*w+x-1] = c + 2;
-      pixels[(y+3)*w+x-1] = c + 2;
-      x = x-1;
-      y += 4;
-      dx = -1;
-    }
-
-    if ((x <= 1 + PIET_IMM_BASE || !pi->next) && dx == -1) {
-      while (x >= w - 2) {
-        pixels[(y+0)*w+x+0] = 1;
-        x--;
-      }
-      pixels[(y+0)*w+x+0] = 1;
-      pixels[(y+0)*w+x-1] = 1;
-      pixels[(y-1)*w+x-1] = 1;
-      pixels[(y-1)*w+x+0] = 1;
-      pixels[(y+1)*w+x+0] = 1;
-      pixels[(y+2)*w+x+0] = 1;
-      pixels[(y+3)*w+x+0] = 1;
-      pixels[(y+3)*w+x-1] = 1;
-      pixels[(y+2)*w+x-1] = 1;
-      pixels[(y+2)*w+x+1] = 2;
-      c = 0;
-      x += 2;
-      y += 2;
-      dx = 1;
-    }
-  }
+  y = piet_layout_init(init_state.next, pixels, w, &x);
+  uint c;
 
   for (; x < w; x++) {
     pixels[y*w+x] = 1;
@@ -636,19 +929,19 @@ void target_piet(Module* module) {
     }
   }
 
-  h = y + 10;
+  assert(y + 10 == h);
 
-  printf("P6\n");
-  printf("#\n");
-  printf("%d %d\n", w, h);
-  printf("255\n");
+  emit_printf("P6\n");
+  emit_printf("#\n");
+  emit_printf("%d %d\n", w, h);
+  emit_printf("255\n");
 
   for (uint y = 0; y < h; y++) {
     for (uint x = 0; x < w; x++) {
       byte* c = PIET_COLOR_TABLE[pixels[y*w+x]];
-      putchar(c[0]);
-      putchar(c[1]);
-      putchar(c[2]);
+      emit_char(c[0]);
+      emit_char(c[1]);
+      emit_char(c[2]);
     }
   }
 }
@@ -148,21 +148,27 @@ static void pietasm_cmp(Inst* inst, bool is_jmp) {
   }
 }
 
-static void pietasm_reg_jmp_table(int min_pc, int max_pc, int last_label) {
-  if (min_pc + 1 == max_pc) {
+// Binary search over the sorted pcs targets[lo..hi).
+static void pietasm_reg_jmp_table(int* targets, int lo, int hi,
+                                  int last_label) {
+  if (lo == hi) {
+    emit_line("halt");
+    return;
+  }
+  if (lo + 1 == hi) {
     pietasm_pop();
-    pietasm_br(min_pc);
+    pietasm_br(targets[lo]);
     return;
   }
 
-  int mid_pc = (min_pc + max_pc) / 2;
+  int mid = (lo + hi) / 2;
   pietasm_dup();
-  pietasm_push(mid_pc-1);
+  pietasm_push(targets[mid]-1);
   emit_line("gt");
-  pietasm_bz(last_label + mid_pc);
-  pietasm_reg_jmp_table(mid_pc, max_pc, last_label);
-  pietasm_label(last_label + mid_pc);
-  pietasm_reg_jmp_table(min_pc, mid_pc, last_label);
+  pietasm_bz(last_label + mid);
+  pietasm_reg_jmp_table(targets, mid, hi, last_label);
+  pietasm_label(last_label + mid);
+  pietasm_reg_jmp_table(targets, lo, mid, last_label);
 }
 
 static void pietasm_emit_inst(Inst* inst, int reg_jmp) {
@@ -317,6 +323,8 @@ void target_pietasm(Module* module) {
     pietasm_emit_inst(inst, reg_jmp);
   }
 
+  int num_targets;
+  int* targets = indirect_jump_targets(module, &num_targets);
   pietasm_label(reg_jmp);
-  pietasm_reg_jmp_table(0, reg_jmp, pietasm_gen_label());
+  pietasm_reg_jmp_table(targets, 0, num_targets, pietasm_gen_label());
 }
@@ -11,19 +11,42 @@ static void init_state_pl(Data* data) {
   emit_line("use strict;");
   emit_line("use warnings;");
   emit_line("use utf8;");
+  // With -mem=packed the memory is a string of 32-bit words read and
+  // written with vec, a sixth of the size of a list of scalars, and
+  // the arithmetic stays in native integers.
+  if (MEM_MODEL == MEM_PACKED)
+    emit_line("use integer;");
   emit_line("$| = 1;");
   emit_line("");
   reg_names = PL_REG_NAMES;
   for (int i = 0; i < 7; i++) {
     emit_line("my %s = 0;", reg_names[i]);
   }
-  emit_line("my @mem = (");
+  if (MEM_MODEL == MEM_PACKED)
+    emit_line("my $mem = pack('N*',");
+  else
+    emit_line("my @mem = (");
   inc_indent();
   for (int mp = 0; data; data = data->next, mp++) {
     emit_line("%d,", data->v);
   }
   dec_indent();
   emit_line(");");
+
+  // Output is written in blocks, before reading or exiting and when
+  // the buffer fills up, and input is read in blocks too.
+  emit_line("my $out = '';");
+  emit_line("my $in = '';");
+  emit_line("my $ip = 0;");
+  emit_line("sub flush_out { print $out; $out = ''; }");
+  emit_line("sub getc_in {");
+  emit_line("  if ($ip >= length $in) {");
+  emit_line("    flush_out();");
+  emit_line("    $ip = 0;");
+  emit_line("    return 0 unless sysread(STDIN, $in, 1 << 16);");
+  emit_line("  }");
+  emit_line("  return ord(substr($in, $ip++, 1));");
+  emit_line("}");
 }
 
 static void pl_emit_inst(Inst* inst) {
@@ -45,23 +68,42 @@ static void pl_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
+    if (inst->global_var) {
+      emit_line("%s = $g%d;", reg_names[inst->dst.reg], global_var_addr(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("%s = vec($mem, %s, 32);",
+                reg_names[inst->dst.reg], src_str(inst));
+      break;
+    }
     emit_line("%s = $mem[%s]||0;", reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case STORE:
+    if (inst->global_var) {
+      emit_line("$g%d = %s;", global_var_addr(inst), reg_names[inst->dst.reg]);
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("vec($mem, %s, 32) = %s;",
+                src_str(inst), reg_names[inst->dst.reg]);
+      break;
+    }
     emit_line("$mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("print chr(%s);", src_str(inst));
+    emit_line("$out .= chr(%s);", src_str(inst));
+    emit_line("flush_out() if length $out >= 1 << 16;");
     break;
 
   case GETC:
-    emit_line("$c = getc(); %s = defined $c ? ord($c) : 0;",
-              reg_names[inst->dst.reg]);
+    emit_line("%s = getc_in();", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
+    emit_line("flush_out();");
     emit_line("exit;");
     break;
 
@@ -97,8 +139,11 @@ static void pl_emit_inst(Inst* inst) {
   }
 }
 
+const int target_pl_ext_ops = GLOBAL_VAR_BIT;
+
 void target_pl(Module* module) {
   init_state_pl(module->data);
+  emit_global_var_inits(module, "my $g%d = %d;");
   emit_line("");
 
   emit_line("");
@@ -117,8 +162,12 @@ void target_pl(Module* module) {
       inc_indent();
       prev_pc = inst->pc;
     }
+    FormatMark mark = format_mark();
     pl_emit_inst(inst);
+    format_release(mark);
   }
+  if (prev_pc != -1)
+    emit_line("goto $codes[++$pc];");
 
   dec_indent();
   emit_line("});");
@@ -1,16 +1,34 @@
 #include<ir/ir.h>
 #include<target/util.h>
 
+const int target_ps_ext_ops=
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(DIV) | EXT_OP_BIT(MOD);
+
 const char *ps_op_names[]={
     "eq", "ne", "lt", "gt", "le", "ge"
 };
 
-static void ps_init_state(int max_pc) {
+// The log2 of the words in a page of mem. A page is zeroed when it's
+// first touched, so pages are about as large as the data, which the
+// heap grows from, within 2^10 and 2^15 words.
+static int ps_page_shift(Data* data){
+    int n=0;
+    for(int mp=0; data; data=data->next, mp++){
+        if(data->v) n=mp+1;
+    }
+    int shift=10;
+    while(shift<15 && (1<<shift)<n){
+        shift++;
+    }
+    return shift;
+}
+
+static void ps_init_state(int max_pc, Data* data) {
     for(int i=0; i<7; i++){
         emit_line("/%s 0 def", reg_names[i]);
     }
 
-    int ps_array_size_shift=15;
+    int ps_array_size_shift=ps_page_shift(data);
     int ps_array_size=1<<ps_array_size_shift;
     emit_line("/mem %d array def", 1 << (24 - ps_array_size_shift));
     emit_line("/zeros{");
@@ -21,12 +39,12 @@ static void ps_init_state(int max_pc) {
     emit_line(" pop");
     emit_line("}def");
     emit_line("/mem_addr{");
-    emit_line(" mem 1 index %d idiv get", ps_array_size);
+    emit_line(" mem 1 index %d bitshift get", -ps_array_size_shift);
     emit_line(" dup null eq{");
     emit_line("  pop zeros");
-    emit_line("  mem 2 index %d idiv 2 index put", ps_array_size);
+    emit_line("  mem 2 index %d bitshift 2 index put", -ps_array_size_shift);
     emit_line(" }if");
-    emit_line(" exch %d mod", ps_array_size);
+    emit_line(" exch %d and", ps_array_size-1);
     emit_line("}def");
 
     emit_line("/stdout (%%stdout) (w) file def");
@@ -94,6 +112,31 @@ static void ps_emit_inst(Inst* inst) {
             emit_line("/%s %s %s sub 16#FFFFFF and def",
                     reg_name, reg_name, ps_value_str(&inst->src));
             break;
+        case MUL:
+            // A product past 2^31 turns real, which "and" won't take,
+            // but it's exact below 2^48.
+            reg_name=reg_names[inst->dst.reg];
+            if(inst->in_range){
+                emit_line("/%s %s %s mul def",
+                        reg_name, reg_name, ps_value_str(&inst->src));
+            }else{
+                emit_line("/%s %s %s mul dup 16777216 div floor"
+                        " 16777216 mul sub cvi def",
+                        reg_name, reg_name, ps_value_str(&inst->src));
+            }
+            break;
+        case DIV:
+            // DIV by 0 gives UINT_MAX.
+            reg_name=reg_names[inst->dst.reg];
+            emit_line("/%s %s %s dup 0 eq{pop pop 16#FFFFFF}{idiv}ifelse def",
+                    reg_name, reg_name, ps_value_str(&inst->src));
+            break;
+        case MOD:
+            // MOD by 0 leaves dst.
+            reg_name=reg_names[inst->dst.reg];
+            emit_line("/%s %s %s dup 0 eq{pop}{mod}ifelse def",
+                    reg_name, reg_name, ps_value_str(&inst->src));
+            break;
         case LOAD:
             emit_line("/%s %s mem_addr get def",
                     reg_names[inst->dst.reg], ps_value_str(&inst->src));
@@ -164,7 +207,7 @@ static int ps_max_pc(Inst* inst){
 }
 
 void target_ps(Module *module) {
-    ps_init_state(ps_max_pc(module->text));
+    ps_init_state(ps_max_pc(module->text), module->data);
     emit_chunked_main_loop(
             module->text,
             ps_emit_func_prologue,
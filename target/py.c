@@ -1,27 +1,118 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Decodes the data from base64 at once, which is much smaller and
+// faster to load than a statement per word.
+static void py_emit_bulk_data(Data* data, int len) {
+  emit_line("_data = struct.unpack('<%dI', base64.b64decode(", len);
+  for (int mp = 0; mp < len; mp += 15) {
+    int n = len - mp < 15 ? len - mp : 15;
+    emit_line("    '%s'%s", format_data_base64(&data, n),
+              mp + n == len ? "))" : "");
+  }
+  if (MEM_MODEL == MEM_SPARSE) {
+    emit_line("mem.update((i, v) for i, v in enumerate(_data) if v)");
+  } else if (MEM_MODEL == MEM_PACKED) {
+    emit_line("mem[:%d] = array.array('I', _data)", len);
+  } else {
+    emit_line("mem[:%d] = _data", len);
+  }
+  emit_line("del _data");
+}
+
+static Module* py_module;
+
+// The data words find_global_vars promoted are Python globals, which a
+// function must declare before its first use of one. Every function
+// declares all of them.
+static void py_emit_global_decls(void) {
+  if (!py_module->global_vars)
+    return;
+  char line[256];
+  int len = 0;
+  for (int mp = 0; mp < py_module->num_data; mp++) {
+    if (!py_module->global_vars[mp])
+      continue;
+    len += sprintf(line + len, "%sg%d", len ? ", " : "global ", mp);
+    if (len > 64) {
+      emit_line("%s", line);
+      len = 0;
+    }
+  }
+  if (len)
+    emit_line("%s", line);
+}
+
 static void init_state_py(Data* data) {
+  int bulk_len = bulk_data_len(data);
+  emit_line("import os");
   emit_line("import sys");
+  if (bulk_len) {
+    emit_line("import base64");
+    emit_line("import struct");
+  }
+  if (MEM_MODEL == MEM_SPARSE)
+    emit_line("import collections");
+  if (MEM_MODEL == MEM_PACKED)
+    emit_line("import array");
   for (int i = 0; i < 7; i++) {
-    emit_line("%s = 0", reg_names[i]);
+    emit_line("r_%s = 0", reg_names[i]);
+  }
+  if (MEM_MODEL == MEM_SPARSE) {
+    emit_line("mem = collections.defaultdict(int)");
+  } else if (MEM_MODEL == MEM_PACKED) {
+    // bytearray gets its zeros from calloc, so pages nobody touches
+    // cost nothing, and a word takes 4 bytes instead of a pointer.
+    emit_line("mem = memoryview(bytearray(4 << 24)).cast('I')");
+  } else {
+    emit_line("mem = [0] * (1 << 24)");
   }
-  emit_line("mem = [0] * (1 << 24)");
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d", mp, data->v);
+  if (bulk_len) {
+    py_emit_bulk_data(data, bulk_len);
+  } else {
+    for (int mp = 0; data; data = data->next, mp++) {
+      if (data->v) {
+        emit_line("mem[%d] = %d", mp, data->v);
+      }
     }
   }
+
+  // Output is written in blocks, before reading or exiting and when
+  // the buffer fills up, and input is read in blocks too.
+  emit_line("out = bytearray()");
+  emit_line("inp = b''");
+  emit_line("ip = 0");
+  emit_line("");
+  emit_line("def flush():");
+  emit_line(" sys.stdout.buffer.write(out)");
+  emit_line(" sys.stdout.buffer.flush()");
+  emit_line(" del out[:]");
+  emit_line("");
+  emit_line("def getc():");
+  emit_line(" global inp, ip");
+  emit_line(" if ip == len(inp):");
+  emit_line("  flush()");
+  emit_line("  inp = os.read(0, 1 << 16)");
+  emit_line("  ip = 0");
+  emit_line("  if not inp:");
+  emit_line("   return 0");
+  emit_line(" ip += 1");
+  emit_line(" return inp[ip - 1]");
 }
 
 static void py_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("def func%d():", func_id);
   inc_indent();
+  // Locals are much faster than globals in CPython, so the registers
+  // are copied in and written back when the function returns.
+  for (int i = 0; i < 7; i++) {
+    emit_line("global r_%s", reg_names[i]);
+  }
+  py_emit_global_decls();
   for (int i = 0; i < 7; i++) {
-    emit_line("global %s", reg_names[i]);
+    emit_line("%s = r_%s", reg_names[i], reg_names[i]);
   }
-  emit_line("global mem");
   emit_line("");
 
   emit_line("while %d <= pc and pc < %d:",
@@ -36,6 +127,9 @@ static void py_emit_func_epilogue(void) {
   dec_indent();
   emit_line("pc += 1");
   dec_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("r_%s = %s", reg_names[i], reg_names[i]);
+  }
   dec_indent();
 }
 
@@ -65,23 +159,32 @@ static void py_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
+    if (inst->global_var) {
+      emit_line("%s = g%d", reg_names[inst->dst.reg], global_var_addr(inst));
+      break;
+    }
     emit_line("%s = mem[%s]", reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case STORE:
+    if (inst->global_var) {
+      emit_line("g%d = %s", global_var_addr(inst), reg_names[inst->dst.reg]);
+      break;
+    }
     emit_line("mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("sys.stdout.write(chr(%s))", src_str(inst));
+    emit_line("out.append(%s & 255)", src_str(inst));
+    emit_line("if len(out) >= 1 << 16: flush()");
     break;
 
   case GETC:
-    emit_line("_ = sys.stdin.read(1); %s = ord(_) if _ else 0",
-              reg_names[inst->dst.reg]);
+    emit_line("%s = getc()", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
+    emit_line("flush()");
     emit_line("sys.exit(0)");
     break;
 
@@ -98,6 +201,78 @@ static void py_emit_inst(Inst* inst) {
               reg_names[inst->dst.reg], cmp_str(inst, "True"));
     break;
 
+  case MUL:
+    emit_line("%s = (%s * %s) & " UINT_MAX_STR,
+              reg_names[inst->dst.reg],
+              reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case DIV:
+    emit_line("%s = %s // %s if %s else " UINT_MAX_STR,
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              src_str(inst), src_str(inst));
+    break;
+
+  case MOD:
+    emit_line("%s = %s %% %s if %s else %s",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              src_str(inst), src_str(inst), reg_names[inst->dst.reg]);
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    emit_line("%s %s= %s", reg_names[inst->dst.reg],
+              inst->op == AND ? "&" : inst->op == OR ? "|" : "^",
+              src_str(inst));
+    break;
+
+  case SHL:
+    emit_line("%s = (%s << %s) & " UINT_MAX_STR " if %s < 24 else 0",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              src_str(inst), src_str(inst));
+    break;
+
+  case SHR:
+    emit_line("%s = %s >> %s if %s < 24 else 0",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              src_str(inst), src_str(inst));
+    break;
+
+  case MEMCPY:
+    if (MEM_MODEL == MEM_SPARSE) {
+      // A dict has no slices; copy in the order memmove would.
+      emit_line("for _ in (range(%s) if %s < %s else range(%s - 1, -1, -1)):"
+                " mem[%s + _] = mem[%s + _]",
+                value_str(&inst->jmp), reg_names[inst->dst.reg],
+                src_str(inst), value_str(&inst->jmp),
+                reg_names[inst->dst.reg], src_str(inst));
+      break;
+    }
+    emit_line("mem[%s:%s + %s] = mem[%s:%s + %s]",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              value_str(&inst->jmp), src_str(inst), src_str(inst),
+              value_str(&inst->jmp));
+    break;
+
+  case MEMSET:
+    if (MEM_MODEL == MEM_SPARSE) {
+      emit_line("for _ in range(%s): mem[%s + _] = %s",
+                value_str(&inst->jmp), reg_names[inst->dst.reg],
+                src_str(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("mem[%s:%s + %s] = array.array('I', [%s]) * %s",
+                reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+                value_str(&inst->jmp), src_str(inst), value_str(&inst->jmp));
+      break;
+    }
+    emit_line("mem[%s:%s + %s] = [%s] * %s",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg],
+              value_str(&inst->jmp), src_str(inst), value_str(&inst->jmp));
+    break;
+
   case JEQ:
   case JNE:
   case JLT:
@@ -114,8 +289,12 @@ static void py_emit_inst(Inst* inst) {
   }
 }
 
+const int target_py_ext_ops = ALL_EXT_OPS | GLOBAL_VAR_BIT;
+
 void target_py(Module* module) {
+  py_module = module;
   init_state_py(module->data);
+  emit_global_var_inits(module, "g%d = %d");
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          py_emit_func_prologue,
@@ -123,12 +302,13 @@ void target_py(Module* module) {
                                          py_emit_pc_change,
                                          py_emit_inst);
 
+  // A list of the functions, so leaving one costs an index, not a
+  // comparison per function.
   emit_line("");
+  emit_line("funcs = [");
+  for (int i = 0; i < num_funcs; i++)
+    emit_line("  func%d,", i);
+  emit_line("]");
   emit_line("while True:");
-  inc_indent();
-  emit_line("if False: pass");
-  for (int i = 0; i < num_funcs; i++) {
-    emit_line("elif pc < %d: func%d()", (i + 1) * CHUNKED_FUNC_SIZE, i);
-  }
-  dec_indent();
+  emit_line("  funcs[r_pc // %d]()", CHUNKED_FUNC_SIZE);
 }
@@ -1,40 +1,102 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
-static const char* RB_REG_NAMES[] = {
-  "@a", "@b", "@c", "@d", "@bp", "@sp", "@pc"
-};
+// Decodes the data from base64 at once, which is much smaller and
+// faster to load than a statement per word.
+static void rb_emit_bulk_data(Data* data, int len) {
+  emit_line("_data = (");
+  for (int mp = 0; mp < len; mp += 15) {
+    int n = len - mp < 15 ? len - mp : 15;
+    emit_line("  '%s'%s", format_data_base64(&data, n),
+              mp + n == len ? ").unpack1('m').unpack('V*')" : " \\");
+  }
+  if (MEM_MODEL == MEM_SPARSE) {
+    emit_line("_data.each_with_index { |v, i| @mem[i] = v if v != 0 }");
+  } else if (MEM_MODEL == MEM_PACKED) {
+    emit_line("_data.each_with_index { |v, i| @mem.set_value(:u32, i * 4, v) }");
+  } else {
+    emit_line("@mem[0, %d] = _data", len);
+  }
+}
 
 static void init_state_rb(Data* data) {
-  reg_names = RB_REG_NAMES;
   for (int i = 0; i < 7; i++) {
-    emit_line("%s = 0", reg_names[i]);
+    emit_line("@%s = 0", reg_names[i]);
   }
-  emit_line("@mem = [0] * (1 << 24)");
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("@mem[%d] = %d", mp, data->v);
+  if (MEM_MODEL == MEM_SPARSE) {
+    emit_line("@mem = Hash.new(0)");
+  } else if (MEM_MODEL == MEM_PACKED) {
+    // A buffer this large is mapped, so untouched pages cost nothing.
+    emit_line("Warning[:experimental] = false");
+    emit_line("@mem = IO::Buffer.new(4 << 24)");
+  } else {
+    emit_line("@mem = [0] * (1 << 24)");
+  }
+  int bulk_len = bulk_data_len(data);
+  if (bulk_len) {
+    rb_emit_bulk_data(data, bulk_len);
+  } else {
+    for (int mp = 0; data; data = data->next, mp++) {
+      if (data->v) {
+        if (MEM_MODEL == MEM_PACKED) {
+          emit_line("@mem.set_value(:u32, %d, %d)", mp * 4, data->v);
+        } else {
+          emit_line("@mem[%d] = %d", mp, data->v);
+        }
+      }
     }
   }
+
+  // Output is written in blocks, before reading or exiting and when
+  // the buffer fills up, and input is read in blocks too.
+  emit_line("STDOUT.binmode");
+  emit_line("@out = String.new(capacity: 1 << 16, encoding: Encoding::BINARY)");
+  emit_line("@inp = ''");
+  emit_line("@ip = 0");
+  emit_line("");
+  emit_line("def flush");
+  emit_line("  STDOUT.write(@out)");
+  emit_line("  STDOUT.flush");
+  emit_line("  @out.clear");
+  emit_line("end");
+  emit_line("");
+  emit_line("def getc");
+  emit_line("  if @ip == @inp.bytesize");
+  emit_line("    flush");
+  emit_line("    @inp = STDIN.readpartial(1 << 16) rescue ''");
+  emit_line("    @ip = 0");
+  emit_line("    return 0 if @inp.empty?");
+  emit_line("  end");
+  emit_line("  @ip += 1");
+  emit_line("  @inp.getbyte(@ip - 1)");
+  emit_line("end");
 }
 
 static void rb_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("def func%d", func_id);
   inc_indent();
-  emit_line("while %d <= @pc && @pc < %d",
+  // Locals are faster than instance variables, so the registers are
+  // copied in and written back when the method returns.
+  for (int i = 0; i < 7; i++) {
+    emit_line("%s = @%s", reg_names[i], reg_names[i]);
+  }
+  emit_line("while %d <= pc && pc < %d",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
-  emit_line("case @pc");
+  emit_line("case pc");
   inc_indent();
 }
 
 static void rb_emit_func_epilogue(void) {
   dec_indent();
   emit_line("end");
-  emit_line("@pc += 1");
+  emit_line("pc += 1");
   dec_indent();
   emit_line("end");
+  for (int i = 0; i < 7; i++) {
+    emit_line("@%s = %s", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("end");
 }
@@ -65,23 +127,42 @@ static void rb_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
+    if (inst->global_var) {
+      emit_line("%s = @g%d", reg_names[inst->dst.reg], global_var_addr(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("%s = @mem.get_value(:u32, %s * 4)",
+                reg_names[inst->dst.reg], src_str(inst));
+      break;
+    }
     emit_line("%s = @mem[%s]", reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case STORE:
+    if (inst->global_var) {
+      emit_line("@g%d = %s", global_var_addr(inst), reg_names[inst->dst.reg]);
+      break;
+    }
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("@mem.set_value(:u32, %s * 4, %s)",
+                src_str(inst), reg_names[inst->dst.reg]);
+      break;
+    }
     emit_line("@mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("putc %s", src_str(inst));
+    emit_line("@out << (%s & 255)", src_str(inst));
+    emit_line("flush if @out.bytesize >= 1 << 16");
     break;
 
   case GETC:
-    emit_line("c = STDIN.getc; %s = c ? c.ord : 0",
-              reg_names[inst->dst.reg]);
+    emit_line("%s = getc", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
+    emit_line("flush");
     emit_line("exit");
     break;
 
@@ -98,6 +179,82 @@ static void rb_emit_inst(Inst* inst) {
               reg_names[inst->dst.reg], cmp_str(inst, "true"));
     break;
 
+  case MUL:
+    emit_line("%s = (%s * %s) & " UINT_MAX_STR,
+              reg_names[inst->dst.reg],
+              reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case DIV:
+    emit_line("%s = %s == 0 ? " UINT_MAX_STR " : %s / %s",
+              reg_names[inst->dst.reg], src_str(inst),
+              reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case MOD:
+    emit_line("%s %%= %s if %s != 0",
+              reg_names[inst->dst.reg], src_str(inst), src_str(inst));
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    emit_line("%s %s= %s", reg_names[inst->dst.reg],
+              inst->op == AND ? "&" : inst->op == OR ? "|" : "^",
+              src_str(inst));
+    break;
+
+  case SHL:
+    emit_line("%s = %s < 24 ? (%s << %s) & " UINT_MAX_STR " : 0",
+              reg_names[inst->dst.reg], src_str(inst),
+              reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case SHR:
+    emit_line("%s = %s < 24 ? %s >> %s : 0",
+              reg_names[inst->dst.reg], src_str(inst),
+              reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case MEMCPY:
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("@mem.copy(@mem, %s * 4, %s * 4, %s * 4)",
+                reg_names[inst->dst.reg], value_str(&inst->jmp),
+                src_str(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_SPARSE) {
+      // A hash has no slices; copy in the order memmove would.
+      emit_line("(%s < %s ? 0.upto(%s - 1) : (%s - 1).downto(0))"
+                ".each { |i| @mem[%s + i] = @mem[%s + i] }",
+                reg_names[inst->dst.reg], src_str(inst),
+                value_str(&inst->jmp), value_str(&inst->jmp),
+                reg_names[inst->dst.reg], src_str(inst));
+      break;
+    }
+    emit_line("@mem[%s, %s] = @mem[%s, %s]",
+              reg_names[inst->dst.reg], value_str(&inst->jmp),
+              src_str(inst), value_str(&inst->jmp));
+    break;
+
+  case MEMSET:
+    if (MEM_MODEL == MEM_PACKED) {
+      emit_line("%s.times { |i| @mem.set_value(:u32, (%s + i) * 4, %s) }",
+                value_str(&inst->jmp), reg_names[inst->dst.reg],
+                src_str(inst));
+      break;
+    }
+    if (MEM_MODEL == MEM_SPARSE) {
+      emit_line("%s.times { |i| @mem[%s + i] = %s }",
+                value_str(&inst->jmp), reg_names[inst->dst.reg],
+                src_str(inst));
+      break;
+    }
+    emit_line("@mem.fill(%s, %s, %s)",
+              src_str(inst), reg_names[inst->dst.reg],
+              value_str(&inst->jmp));
+    break;
+
   case JEQ:
   case JNE:
   case JLT:
@@ -105,7 +262,7 @@ static void rb_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
-    emit_line("%s && @pc = %s - 1",
+    emit_line("%s && pc = %s - 1",
               cmp_str(inst, "true"), value_str(&inst->jmp));
     break;
 
@@ -114,8 +271,11 @@ static void rb_emit_inst(Inst* inst) {
   }
 }
 
+const int target_rb_ext_ops = ALL_EXT_OPS | GLOBAL_VAR_BIT;
+
 void target_rb(Module* module) {
   init_state_rb(module->data);
+  emit_global_var_inits(module, "@g%d = %d");
   emit_line("");
 
   int num_funcs = emit_chunked_main_loop(module->text,
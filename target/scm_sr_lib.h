@@ -36,19 +36,6 @@ static char scm_sr_lib[] =
   "		   0 0 0 0 0 0 0 0\n"
   "		   0 0 0 0 0 0 0 0)))))\n"
   "\n"
-  "(define-syntax flip!\n"
-  "  (syntax-rules (quote)\n"
-  "    ;; optional\n"
-  "    ((_ s x)\n"
-  "     (flip! s x \'()))\n"
-  "    ;; main\n"
-  "    ((_ s \'() \'ys)\n"
-  "     (ck s \'ys))\n"
-  "    ((_ s \'(0 . xs) \'(y ...))\n"
-  "     (flip! s \'xs \'(y ... 1)))\n"
-  "    ((_ s \'(1 . xs) \'(y ...))\n"
-  "     (flip! s \'xs \'(y ... 0)))))\n"
-  "\n"
   "(define-syntax inc!\n"
   "  ;; (inc! x)   => x + 1\n"
   "  ;; (inc! x y) => y ++ (x + 1)\n"
@@ -89,6 +76,11 @@ static char scm_sr_lib[] =
   "    ;;; corner case\n"
   "    ((_ s \'() \'() _ rest)\n"
   "     (ck s rest))\n"
+  "    ;;; the rest of y is zero, as it is for small immediates\n"
+  "    ((_ s \'xs \'(0 ...) \'#f \'(r ...))\n"
+  "     (ck s \'(r ... . xs)))\n"
+  "    ((_ s \'xs \'(0 ...) \'#t \'(r ...))\n"
+  "     (inc! s \'xs \'(r ...)))\n"
   "    ;;; general case\n"
   "    ((_ s \'(0 . xs) \'(0 . ys) \'#f \'(r ...))\n"
   "     (add! s \'xs \'ys \'#f \'(r ... 0)))\n"
@@ -108,9 +100,36 @@ static char scm_sr_lib[] =
   "     (add! s \'xs \'ys \'#t \'(r ... 1)))))\n"
   "\n"
   "(define-syntax sub!\n"
+  "  ;; (sub! x y) => x - y\n"
+  "  ;; (sub! x y borrow rest) => rest ++ (x - y - borrow?1:0)\n"
   "  (syntax-rules (quote)\n"
-  "    ((_ s x y)\n"
-  "     (ck s (add! x (inc! (flip! y)))))))\n"
+  "    ;;; initialize\n"
+  "    ((_ s x y) (sub! s x y \'#f \'()))\n"
+  "    ;;; corner case\n"
+  "    ((_ s \'() \'() _ rest)\n"
+  "     (ck s rest))\n"
+  "    ;;; the rest of y is zero, as it is for small immediates\n"
+  "    ((_ s \'xs \'(0 ...) \'#f \'(r ...))\n"
+  "     (ck s \'(r ... . xs)))\n"
+  "    ((_ s \'xs \'(0 ...) \'#t \'(r ...))\n"
+  "     (dec! s \'xs \'(r ...)))\n"
+  "    ;;; general case\n"
+  "    ((_ s \'(0 . xs) \'(0 . ys) \'#f \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#f \'(r ... 0)))\n"
+  "    ((_ s \'(1 . xs) \'(0 . ys) \'#f \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#f \'(r ... 1)))\n"
+  "    ((_ s \'(0 . xs) \'(1 . ys) \'#f \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#t \'(r ... 1)))\n"
+  "    ((_ s \'(1 . xs) \'(1 . ys) \'#f \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#f \'(r ... 0)))\n"
+  "    ((_ s \'(0 . xs) \'(0 . ys) \'#t \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#t \'(r ... 1)))\n"
+  "    ((_ s \'(1 . xs) \'(0 . ys) \'#t \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#f \'(r ... 0)))\n"
+  "    ((_ s \'(0 . xs) \'(1 . ys) \'#t \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#t \'(r ... 0)))\n"
+  "    ((_ s \'(1 . xs) \'(1 . ys) \'#t \'(r ...))\n"
+  "     (sub! s \'xs \'ys \'#t \'(r ... 1)))))\n"
   "\n"
   "(define-syntax cmp%!\n"
   "  ;; (cmp%! \'x \'y) => \'((x <= y) (x < y))\n"
@@ -7,19 +7,28 @@
 
 static const char SED_REG_NAMES[] = "ABCDFS";
 
+// Set by elc -sed-bucket. The memory moves out of the first line of
+// the hold space into 16 lines "M<d>: m<addr>=<value>...", one for each
+// last hex digit d of the address. An access picks its line with
+// literal regexps, so only that line is searched for the address, and
+// register accesses cut the memory off before they look.
+bool SED_BUCKET_MEM;
+
+static const char SED_HEX_DIGITS[] = "0123456789abcdef";
+
 static void sed_init_state(Data* data) {
   emit_line(":in_loop");
   emit_line("/^$/{x\ns/$/a,/\nx\nbin_done\n}");
   for (int i = 1; i < 128; i++) {
     if (i == 10)
       continue;
-    putchar('/');
-    putchar('^');
+    emit_char('/');
+    emit_char('^');
     if (i == '$' || i == '.' || i == '/' ||
         i == '[' || i == '\\' || i == ']') {
-      putchar('\\');
+      emit_char('\\');
     }
-    putchar(i);
+    emit_char(i);
     emit_line("/{s/.//\nx\ns/$/%x,/\nx\nbin_loop\n}", i);
   }
   emit_line(":in_done");
@@ -32,15 +41,49 @@ static void sed_init_state(Data* data) {
     emit_line("s/$/%c=0 /", SED_REG_NAMES[i]);
   }
   emit_line("s/$/o= /");
-  for (int mp = 0; data; data = data->next, mp++) {
-    emit_line("s/$/m%x=%x /", mp, data->v);
+  if (SED_BUCKET_MEM) {
+    for (int d = 0; d < 16; d++) {
+      emit_line("s/$/\\nM%x:/", d);
+    }
+    for (int mp = 0; data; data = data->next, mp++) {
+      if (data->v)
+        emit_line("s/\\nM%x:/& m%x=%x/", mp % 16, mp, data->v);
+    }
+  } else {
+    for (int mp = 0; data; data = data->next, mp++) {
+      emit_line("s/$/m%x=%x /", mp, data->v);
+    }
   }
   emit_line("x");
 }
 
+// Appends the cells of the bucket of the address at the end of the
+// pattern space. A STORE also takes the bucket out of the hold space.
+static void sed_emit_get_bucket(const char* label, int id, bool take) {
+  for (int d = 0; d < 16; d++) {
+    if (d < 15)
+      emit_line("/%c$/{", SED_HEX_DIGITS[d]);
+    else
+      emit_line("{");
+    emit_line(" G");
+    emit_line(" s/\\n.*\\nM%x://", d);
+    emit_line(" s/\\n.*//");
+    if (take) {
+      emit_line(" x");
+      emit_line(" s/\\nM%x:[^\\n]*//", d);
+      emit_line(" x");
+    }
+    emit_line(" b%s_%d", label, id);
+    emit_line("}");
+  }
+  emit_line(":%s_%d", label, id);
+}
+
 static void sed_emit_value(Value* v) {
   if (v->type == REG) {
     emit_line("G");
+    if (SED_BUCKET_MEM)
+      emit_line("s/\\nM.*//");
     emit_line("s/\\n[^%c]* %c=\\([^ ]*\\).*/\\1/",
               SED_REG_NAMES[v->reg], SED_REG_NAMES[v->reg]);
   } else {
@@ -202,6 +245,16 @@ static void sed_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
+    if (SED_BUCKET_MEM) {
+      static int load_id = 0;
+      sed_emit_src(inst);
+      sed_emit_get_bucket("load", load_id++, false);
+      emit_line("s/^\\([^ ]*\\)\\( [^ ]*\\)* m\\1=\\([^ ]*\\).*/@\\3/");
+      emit_line("/^@/!s/.*/0/");
+      emit_line("s/^@//");
+      sed_emit_set_dst(inst);
+      break;
+    }
     sed_emit_src(inst);
     emit_line("G");
     emit_line("s/^\\([^\\n]*\\)\\n.*m\\1=\\([^ ]*\\).*/@\\2/");
@@ -211,6 +264,20 @@ static void sed_emit_inst(Inst* inst) {
     break;
 
   case STORE:
+    if (SED_BUCKET_MEM) {
+      // The bucket goes back at the end of the hold space, without
+      // the old value of the address.
+      static int store_id = 0;
+      sed_emit_dst_src(inst);
+      sed_emit_get_bucket("store", store_id++, true);
+      emit_line("s/^\\([^ ]*\\) \\([^ ]*\\)\\(\\( [^ ]*\\)*\\) m\\2=[^ ]*"
+                "/\\1 \\2\\3/");
+      emit_line("s/^\\([^ ]*\\) \\([^ ]*\\([^ ]\\)\\)\\(.*\\)"
+                "/M\\3:\\4 m\\2=\\1/");
+      emit_line("H");
+      emit_line("s/.*//");
+      break;
+    }
     sed_emit_dst_src(inst);
     emit_line("G");
     emit_line("/ \\([^\\n]*\\)\\n.*m\\1=/"
@@ -227,13 +294,18 @@ static void sed_emit_inst(Inst* inst) {
     emit_line("s/^/0/");
     emit_line("s/.*\\(..\\)$/\\1/");
     emit_line("G");
-    emit_line("s/^\\(..\\)\\n\\(.*o=[^ ]*\\)/\\2\\1/");
+    if (SED_BUCKET_MEM)
+      emit_line("s/^\\(..\\)\\n\\([^\\n]*o=[^ ]*\\)/\\2\\1/");
+    else
+      emit_line("s/^\\(..\\)\\n\\(.*o=[^ ]*\\)/\\2\\1/");
     emit_line("x");
     emit_line("s/.*//");
     break;
 
   case GETC: {
     emit_line("g");
+    if (SED_BUCKET_MEM)
+      emit_line("s/\\nM.*//");
     emit_line("/i= /s/.*/0/");
     emit_line("/i=[^ ]/{");
     emit_line("s/.*i=\\([^,]*\\),.*/\\1/");
@@ -339,7 +411,7 @@ void target_sed(Module* module) {
   emit_line(":out_loop");
   emit_line("/^$/bout_done");
   for (int i = 0; i < 256; i++) {
-    printf("/^%x%x/{s/..//\nx\n", i / 16, i % 16);
+    emit_printf("/^%x%x/{s/..//\nx\n", i / 16, i % 16);
     if (i == 10) {
       emit_line("p\ns/.*//\nx\n}");
     } else {
@@ -1,6 +1,14 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+#include <stdlib.h>
+#include <string.h>
+
+// Set by elc -sh-bash. Emits a bash-only script that keeps memory in
+// an indexed array, runs each basic block as a function with its
+// arithmetic in one (( )), and buffers input and output in variables.
+bool SH_BASH;
+
 static void sh_init_state(Data* data) {
   for (int i = 0; i < 7; i++) {
     emit_line("%s=0", reg_names[i]);
@@ -132,7 +140,236 @@ static void sh_emit_inst(Inst* inst) {
   }
 }
 
+// The arithmetic of the current block, joined by commas.
+static char* sh_bash_expr;
+static int sh_bash_expr_len;
+static int sh_bash_expr_cap;
+
+static void sh_bash_add_expr(const char* e) {
+  int n = strlen(e);
+  if (sh_bash_expr_len + n + 3 > sh_bash_expr_cap) {
+    sh_bash_expr_cap = (sh_bash_expr_len + n + 3) * 2;
+    sh_bash_expr = realloc(sh_bash_expr, sh_bash_expr_cap);
+  }
+  if (sh_bash_expr_len) {
+    strcpy(sh_bash_expr + sh_bash_expr_len, ", ");
+    sh_bash_expr_len += 2;
+  }
+  strcpy(sh_bash_expr + sh_bash_expr_len, e);
+  sh_bash_expr_len += n;
+}
+
+static void sh_bash_flush_expr(void) {
+  if (sh_bash_expr_len)
+    emit_line("(( %s ))", sh_bash_expr);
+  sh_bash_expr_len = 0;
+}
+
+static void sh_bash_init_state(Data* data) {
+  emit_line("LC_ALL=C");
+  for (int i = 0; i < 7; i++) {
+    emit_line("%s=0", reg_names[i]);
+  }
+  emit_line("declare -ai m");
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v) {
+      emit_line("m[%d]=%d", mp, data->v);
+    }
+  }
+  emit_line("o= on=0 ib= ip=0");
+  emit_line("");
+  emit_line("flush() {");
+  emit_line(" printf -- \"$o\"");
+  emit_line(" o= on=0");
+  emit_line("}");
+  emit_line("");
+  // Input comes a line at a time. read -N would wait for a whole
+  // block on a terminal.
+  emit_line("getc() {");
+  emit_line(" if (( ip >= ${#ib} )); then");
+  emit_line("  flush");
+  emit_line("  ip=0");
+  emit_line("  IFS= read -r ib && ib+=$'\\n' || [ -n \"$ib\" ] || "
+            "{ t=0; return; }");
+  emit_line(" fi");
+  emit_line(" printf -v t %%d \"'${ib:ip:1}\"");
+  emit_line(" (( ip++ ))");
+  emit_line("}");
+}
+
+static const char* sh_bash_cmp_str(Inst* inst) {
+  int op = normalize_cond(inst->op, 0);
+  const char* op_str;
+  switch (op) {
+    case JEQ:
+      op_str = "=="; break;
+    case JNE:
+      op_str = "!="; break;
+    case JLT:
+      op_str = "<"; break;
+    case JGT:
+      op_str = ">"; break;
+    case JLE:
+      op_str = "<="; break;
+    case JGE:
+      op_str = ">="; break;
+    default:
+      error("oops");
+  }
+  return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
+}
+
+// Leaves pc at the next block unless the block ends with an EXIT.
+static void sh_bash_emit_inst(Inst* inst, bool last) {
+  const char* dst = reg_names[inst->dst.reg];
+  switch (inst->op) {
+  case MOV:
+    sh_bash_add_expr(format("%s = %s", dst, src_str(inst)));
+    break;
+
+  case ADD:
+    sh_bash_add_expr(format("%s = (%s + %s) & " UINT_MAX_STR,
+                            dst, dst, src_str(inst)));
+    break;
+
+  case SUB:
+    sh_bash_add_expr(format("%s = (%s - %s) & " UINT_MAX_STR,
+                            dst, dst, src_str(inst)));
+    break;
+
+  case MUL:
+    sh_bash_add_expr(format("%s = (%s * %s) & " UINT_MAX_STR,
+                            dst, dst, src_str(inst)));
+    break;
+
+  case DIV:
+    sh_bash_add_expr(format("%s = %s ? %s / %s : " UINT_MAX_STR, dst,
+                            src_str(inst), dst, src_str(inst)));
+    break;
+
+  case MOD:
+    sh_bash_add_expr(format("%s = %s ? %s %% %s : %s", dst,
+                            src_str(inst), dst, src_str(inst), dst));
+    break;
+
+  case AND:
+  case OR:
+  case XOR:
+    sh_bash_add_expr(format("%s %s= %s", dst,
+                            inst->op == AND ? "&" : inst->op == OR ? "|" : "^",
+                            src_str(inst)));
+    break;
+
+  case SHL:
+    sh_bash_add_expr(format("%s = %s < 24 ? (%s << %s) & " UINT_MAX_STR
+                            " : 0", dst, src_str(inst), dst, src_str(inst)));
+    break;
+
+  case SHR:
+    sh_bash_add_expr(format("%s = %s < 24 ? %s >> %s : 0", dst,
+                            src_str(inst), dst, src_str(inst)));
+    break;
+
+  case LOAD:
+    sh_bash_add_expr(format("%s = m[%s]", dst, src_str(inst)));
+    break;
+
+  case STORE:
+    sh_bash_add_expr(format("m[%s] = %s", src_str(inst), dst));
+    break;
+
+  case PUTC:
+    sh_bash_flush_expr();
+    if (inst->src.type == IMM) {
+      emit_line("o+='\\%03o'", inst->src.imm & 255);
+    } else {
+      emit_line("printf -v t '\\\\%%03o' $(( %s & 255 )); o+=$t",
+                src_str(inst));
+    }
+    emit_line("(( ++on < 4096 )) || flush");
+    break;
+
+  case GETC:
+    sh_bash_flush_expr();
+    emit_line("getc");
+    sh_bash_add_expr(format("%s = t", dst));
+    break;
+
+  case EXIT:
+    sh_bash_flush_expr();
+    emit_line("flush");
+    emit_line("exit");
+    return;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    sh_bash_add_expr(format("%s = %s", dst, sh_bash_cmp_str(inst)));
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    sh_bash_add_expr(format("pc = %s ? %s : %d", sh_bash_cmp_str(inst),
+                            value_str(&inst->jmp), inst->pc + 1));
+    return;
+
+  case JMP:
+    sh_bash_add_expr(format("pc = %s", value_str(&inst->jmp)));
+    return;
+
+  default:
+    error("oops");
+  }
+  if (last)
+    sh_bash_add_expr(format("pc = %d", inst->pc + 1));
+}
+
+const int target_sh_bash_ext_ops = ALL_EXT_OPS & ~(EXT_OP_BIT(MEMCPY) |
+                                                   EXT_OP_BIT(MEMSET));
+
+static void target_sh_bash(Module* module) {
+  sh_bash_init_state(module->data);
+
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      emit_line("");
+      emit_line("p%d() {", inst->pc);
+      inc_indent();
+    }
+    prev_pc = inst->pc;
+    bool last = !inst->next || inst->next->pc != inst->pc;
+    FormatMark mark = format_mark();
+    sh_bash_emit_inst(inst, last);
+    format_release(mark);
+    if (last) {
+      sh_bash_flush_expr();
+      dec_indent();
+      emit_line("}");
+    }
+  }
+
+  emit_line("");
+  emit_line("while :; do");
+  emit_line(" p$pc");
+  emit_line("done");
+}
+
 void target_sh(Module* module) {
+  if (SH_BASH) {
+    target_sh_bash(module);
+    return;
+  }
   sh_init_state(module->data);
   emit_line("");
 
@@ -150,7 +387,9 @@ void target_sh(Module* module) {
       inc_indent();
     }
     prev_pc = inst->pc;
+    FormatMark mark = format_mark();
     sh_emit_inst(inst);
+    format_release(mark);
   }
 
   emit_line(";;");
@@ -1,4 +1,7 @@
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 
@@ -44,6 +47,48 @@ static SQLite3CaseExpr* sqlite3_add_expr(SQLite3CaseExpr* expr,
   return e;
 }
 
+// A step stops growing once an expression it would substitute gets
+// longer than this.
+#define SQLITE3_MAX_EXPR_LEN 2000
+
+// The values of the columns in the middle of a step, as expressions
+// over the row the step starts from. NULL is an unchanged column.
+static const char* sqlite3_cur[SQLITE3_NUM_COLS];
+// The columns the step has changed, and the ones which hold the
+// result of a LOAD, which would read mem again at each use.
+static int sqlite3_dirty;
+static int sqlite3_loaded;
+
+// Concatenates the strings up to NULL. Composed expressions can be
+// longer than format() allows.
+static const char* sqlite3_cat(const char* s, ...) {
+  va_list ap;
+  int len = 0;
+  va_start(ap, s);
+  for (const char* p = s; p; p = va_arg(ap, const char*))
+    len += strlen(p);
+  va_end(ap);
+  char* r = malloc(len + 1);
+  r[0] = 0;
+  va_start(ap, s);
+  for (const char* p = s; p; p = va_arg(ap, const char*))
+    strcat(r, p);
+  va_end(ap);
+  return r;
+}
+
+static const char* sqlite3_col_str(SQLite3Col col) {
+  if (sqlite3_cur[col])
+    return sqlite3_cat("(", sqlite3_cur[col], ")", NULL);
+  return COL_NAMES[col];
+}
+
+static const char* sqlite3_value_str(Value* v) {
+  if (v->type == REG)
+    return sqlite3_col_str((SQLite3Col)v->reg);
+  return format("%d", v->imm);
+}
+
 const char* sqlite3_cmp_str(Inst* inst) {
   int op = normalize_cond(inst->op, 0);
   const char* op_str;
@@ -57,132 +102,156 @@ const char* sqlite3_cmp_str(Inst* inst) {
     default:
       error("oops");
   }
-  return format("%s %s %s", COL_NAMES[inst->dst.reg], op_str, src_str(inst));
+  return sqlite3_cat(sqlite3_col_str((SQLite3Col)inst->dst.reg), " ",
+                     op_str, " ", sqlite3_value_str(&inst->src), NULL);
 }
 
-static void sqlite3_transpose_insts(Inst* inst, SQLite3CaseExpr* cols[]) {
-  
-  int step = 0;
-  int prev_pc = -1;
-  SQLite3Col col_idx = 0;
-  const char* expr = NULL;
-  int updcols = 0;
-
-  for (; inst; inst = inst->next) {
-    if (prev_pc != inst-> pc) {
-      if (prev_pc != -1) {
-        step++;
-        cols[SQLITE3_PC] = sqlite3_add_expr(cols[SQLITE3_PC], prev_pc, step, "pc+1");
-        cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], prev_pc, step, "0");
-      }
-      updcols = 0;
-      step = 0;
-    }
+// Adds the changed columns of the step to cols, and starts the next
+// step.
+static void sqlite3_end_step(SQLite3CaseExpr* cols[], int pc, int* step) {
+  for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+    if (sqlite3_dirty & (1 << i))
+      cols[i] = sqlite3_add_expr(cols[i], pc, *step, sqlite3_cur[i]);
+    sqlite3_cur[i] = NULL;
+  }
+  if (sqlite3_dirty)
+    ++*step;
+  sqlite3_dirty = 0;
+  sqlite3_loaded = 0;
+}
 
-    int usecol = ((inst->src.type == REG) ? (1 << inst->src.reg) : 0) |
-                 ((inst->dst.type == REG) ? (1 << inst->dst.reg) : 0);
+static void sqlite3_set(SQLite3Col col, const char* expr) {
+  sqlite3_cur[col] = expr;
+  sqlite3_dirty |= 1 << col;
+  sqlite3_loaded &= ~(1 << col);
+}
 
-    if ((usecol & updcols) != 0) {
-      step++;
-      updcols = 0;
-    }
+// The columns an instruction reads.
+static int sqlite3_inst_reads(Inst* inst) {
+  int r = inst_reads(inst);
+  if (inst->op == LOAD || inst->op == STORE)
+    r |= 1 << SQLITE3_MEM;
+  if (inst->op == GETC)
+    r |= 1 << SQLITE3_IN;
+  if (inst->op == PUTC)
+    r |= 1 << SQLITE3_OUT;
+  return r;
+}
 
-    switch (inst->op) {
-    case MOV:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = src_str(inst);
-      break;
-
-    case ADD:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("(%s + %s) & " UINT_MAX_STR,
-                    COL_NAMES[inst->dst.reg], src_str(inst));
-      break;
-
-    case SUB:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("(%s - %s) & " UINT_MAX_STR,
-                COL_NAMES[inst->dst.reg], src_str(inst));
-      break;
-
-    case LOAD:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("coalesce(json_extract(mem, '$.'||%s),0)", src_str(inst));
-      break;
-
-    case STORE:
-      col_idx = SQLITE3_MEM;
-      expr = format("json_set(mem, '$.'||%s, %s)",
-                    src_str(inst), COL_NAMES[inst->dst.reg]);
-      break;
-
-    case PUTC:
-      col_idx = SQLITE3_OUT;
-      expr = format("stdout||char(%s)", src_str(inst));
-      break;
-
-    case GETC:
-      cols[SQLITE3_IN] = sqlite3_add_expr(cols[SQLITE3_IN], inst->pc, step,
-                                          "substr(stdin, 2)");
-      col_idx = (SQLite3Col)inst->dst.reg;
-      // todo: can't read a single byte from multibyte character
-      expr = "CASE WHEN length(stdin) = 0 THEN 0 ELSE unicode(stdin) END";
-      break;
-
-    case EXIT:
-      col_idx = SQLITE3_RUN;
-      expr = "0";
-      break;
-
-    case DUMP:
-      goto next_inst;
-
-    case EQ:
-    case NE:
-    case LT:
-    case GT:
-    case LE:
-    case GE:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = sqlite3_cmp_str(inst);
-      break;
-
-    case JEQ:
-    case JNE:
-    case JLT:
-    case JGT:
-    case JLE:
-    case JGE:
-      expr = format("CASE WHEN %s THEN 0 ELSE step+1 END", sqlite3_cmp_str(inst));
-      cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], inst->pc, step, expr);
-      col_idx = SQLITE3_PC;
-      expr = format("CASE WHEN %s THEN %s ELSE pc END",
-                    sqlite3_cmp_str(inst), value_str(&inst->jmp));
-      break;
-    case JMP:
-      cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], inst->pc, step, "0");
-      col_idx = SQLITE3_PC;
-      expr = value_str(&inst->jmp);
-      break;
+// Adds inst to the current step, and returns whether it was an EXIT.
+static bool sqlite3_compose_inst(Inst* inst, SQLite3CaseExpr* cols[],
+                                 int* step) {
+  int reads = sqlite3_inst_reads(inst);
+  bool split = reads & sqlite3_loaded;
+  if ((reads & (1 << SQLITE3_MEM)) && (sqlite3_dirty & (1 << SQLITE3_MEM)))
+    split = true;
+  for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+    if ((reads & (1 << i)) && sqlite3_cur[i] &&
+        strlen(sqlite3_cur[i]) > SQLITE3_MAX_EXPR_LEN)
+      split = true;
+  }
+  if (split)
+    sqlite3_end_step(cols, inst->pc, step);
+
+  SQLite3Col dst = (SQLite3Col)inst->dst.reg;
+  const char* src = sqlite3_value_str(&inst->src);
+  switch (inst->op) {
+  case MOV:
+    sqlite3_set(dst, src);
+    break;
+
+  case ADD:
+    sqlite3_set(dst, sqlite3_cat("(", sqlite3_col_str(dst), " + ", src,
+                                 ") & " UINT_MAX_STR, NULL));
+    break;
+
+  case SUB:
+    sqlite3_set(dst, sqlite3_cat("(", sqlite3_col_str(dst), " - ", src,
+                                 ") & " UINT_MAX_STR, NULL));
+    break;
+
+  case LOAD:
+    sqlite3_set(dst, sqlite3_cat("coalesce(json_extract(mem, '$.'||", src,
+                                 "),0)", NULL));
+    sqlite3_loaded |= 1 << dst;
+    break;
+
+  case STORE:
+    sqlite3_set(SQLITE3_MEM, sqlite3_cat("json_set(mem, '$.'||", src, ", ",
+                                         sqlite3_col_str(dst), ")", NULL));
+    break;
+
+  case PUTC:
+    sqlite3_set(SQLITE3_OUT, sqlite3_cat(sqlite3_col_str(SQLITE3_OUT),
+                                         "||char(", src, ")", NULL));
+    break;
+
+  case GETC: {
+    // todo: can't read a single byte from multibyte character
+    const char* in = sqlite3_col_str(SQLITE3_IN);
+    sqlite3_set(dst, sqlite3_cat("CASE WHEN length(", in, ") = 0 THEN 0 "
+                                 "ELSE unicode(", in, ") END", NULL));
+    sqlite3_set(SQLITE3_IN, sqlite3_cat("substr(", in, ", 2)", NULL));
+    break;
+  }
 
-    default:
-      error("oops");
-    }
+  case EXIT:
+    sqlite3_set(SQLITE3_RUN, "0");
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    sqlite3_set(dst, sqlite3_cmp_str(inst));
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    sqlite3_set(SQLITE3_PC, sqlite3_cat("CASE WHEN ", sqlite3_cmp_str(inst),
+                                        " THEN ", sqlite3_value_str(&inst->jmp),
+                                        " ELSE pc+1 END", NULL));
+    break;
+
+  case JMP:
+    sqlite3_set(SQLITE3_PC, sqlite3_value_str(&inst->jmp));
+    break;
+
+  default:
+    error("oops");
+  }
 
-    cols[col_idx] = sqlite3_add_expr(cols[col_idx], inst->pc, step, expr);
+  return inst->op == EXIT;
+}
 
-    if (inst->op == GETC || inst->op == PUTC || inst->op == STORE) {
-      step++;
-      updcols = 0;
-    } else {
-      updcols |= (1 << col_idx);
+// Runs each basic block in as few steps as it can by substituting the
+// expressions of earlier instructions into later ones. A step ends
+// before reading a LOAD result or memory which it changed, as both
+// would repeat the JSON work, and before expressions get too long.
+static void sqlite3_transpose_insts(Inst* inst, SQLite3CaseExpr* cols[]) {
+  int step = 0;
+  bool exited = false;
+  for (; inst; inst = inst->next) {
+    // Nothing after an EXIT in the block runs.
+    if (!exited && inst->op != DUMP)
+      exited = sqlite3_compose_inst(inst, cols, &step);
+
+    if (!inst->next || inst->next->pc != inst->pc) {
+      // Every block sets pc and step, as their CASEs have no ELSE.
+      if (!(sqlite3_dirty & (1 << SQLITE3_PC)))
+        sqlite3_set(SQLITE3_PC, "pc+1");
+      sqlite3_set(SQLITE3_STEP, "0");
+      sqlite3_end_step(cols, inst->pc, &step);
+      step = 0;
+      exited = false;
     }
-
-  next_inst:
-    prev_pc = inst->pc;
   }
-  cols[SQLITE3_PC] = sqlite3_add_expr(cols[SQLITE3_PC], prev_pc, step, "pc+1");
-  cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], prev_pc, step, "0");
 }
 
 
@@ -281,9 +350,11 @@ void target_sqlite3(Module* module) {
   emit_line("1 running,");
   emit_line("json('{");
   int mp = 0;
+  bool first = true;
   for (Data* data = module->data; data; data = data->next, mp++) {
     if (data->v) {
-      emit_line(" %c\"%d\":%d", mp ? ',' : ' ', mp, data->v);
+      emit_line(" %c\"%d\":%d", first ? ' ' : ',', mp, data->v);
+      first = false;
     }
   }
   emit_line("}') mem,");
@@ -2,10 +2,15 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// The registers are locals in each chunk, loaded from the elvm_*
+// globals on entry and stored back on exit.
 static void swift_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("private func func%d() {", func_id);
   inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("var %s = elvm_%s", reg_names[i], reg_names[i]);
+  }
   emit_line("while %d <= pc && pc < %d {",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
@@ -23,6 +28,9 @@ static void swift_emit_func_epilogue(void) {
   emit_line("pc += 1");
   dec_indent();
   emit_line("}");
+  for (int i = 0; i < 7; i++) {
+    emit_line("elvm_%s = %s", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("}");
 }
@@ -48,13 +56,13 @@ static void swift_emit_inst(Inst* inst) {
     break;
 
   case ADD:
-    emit_line("%s = (%s + %s) & " UINT_MAX_STR,
+    emit_line("%s = (%s &+ %s) & " UINT_MAX_STR,
               reg_names[inst->dst.reg],
               reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case SUB:
-    emit_line("%s = (%s - %s) & " UINT_MAX_STR,
+    emit_line("%s = (%s &- %s) & " UINT_MAX_STR,
               reg_names[inst->dst.reg],
               reg_names[inst->dst.reg], src_str(inst));
     break;
@@ -142,13 +150,17 @@ static int swift_init_state(Data* data) {
 void target_swift(Module* module) {
   emit_line("import Foundation");
   for (int i = 0; i < 7; i++) {
-    emit_line("private var %s: Int = 0", reg_names[i]);
+    emit_line("private var elvm_%s: Int = 0", reg_names[i]);
   }
-  emit_line("private var mem = [Int](repeating: 0, count: 1<<24)");
+  // A raw buffer, as an Array would check every index.
+  emit_line("private let mem = UnsafeMutablePointer<Int>.allocate(capacity: 1<<24)");
+  emit_line("mem.initialize(repeating: 0, count: 1<<24)");
 
   int num_inits = swift_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
+  // Larger chunks may exceed the method size limit.
+  if (CHUNKED_FUNC_SIZE > 256)
+    CHUNKED_FUNC_SIZE = 256;
   int num_funcs = emit_chunked_main_loop(module->text,
                                          swift_emit_func_prologue,
                                          swift_emit_func_epilogue,
@@ -161,7 +173,7 @@ void target_swift(Module* module) {
   emit_line("");
   emit_line("while true {");
   inc_indent();
-  emit_line("switch pc / %d | 0 {", CHUNKED_FUNC_SIZE);
+  emit_line("switch elvm_pc / %d | 0 {", CHUNKED_FUNC_SIZE);
   for (int i = 0; i < num_funcs; i++) {
     emit_line("case %d:", i);
     emit_line(" func%d()", i);
@@ -0,0 +1,125 @@
+#include <target/targets.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <target/util.h>
+
+extern const int target_aarch64_ext_ops;
+extern const int target_arm_ext_ops;
+extern const int target_bef_ext_ops;
+extern const int target_c_ext_ops;
+extern const int target_forth_ext_ops;
+extern const int target_js_ext_ops;
+extern const int target_ll_ext_ops;
+extern const int target_lua_ext_ops;
+extern const int target_php_ext_ops;
+extern const int target_piet_ext_ops;
+extern const int target_pl_ext_ops;
+extern const int target_ps_ext_ops;
+extern const int target_py_ext_ops;
+extern const int target_rb_ext_ops;
+extern const int target_sh_bash_ext_ops;
+extern const int target_wasm_ext_ops;
+extern const int target_ws_ext_ops;
+extern const int target_x86_ext_ops;
+extern const int target_x86_64_ext_ops;
+
+// A bash-only target_sh, chosen by -sh-bash.
+extern bool SH_BASH;
+
+target_func_t find_target_func(const char* ext) {
+  if (!strcmp(ext, "aarch64")) return target_aarch64;
+  if (!strcmp(ext, "arm")) return target_arm;
+  if (!strcmp(ext, "asmjs")) return target_asmjs;
+  if (!strcmp(ext, "bef")) return target_bef;
+  if (!strcmp(ext, "bf")) return target_bf;
+  if (!strcmp(ext, "c")) return target_c;
+  if (!strcmp(ext, "c_cfg")) return target_c_cfg;
+  if (!strcmp(ext, "cl")) return target_cl;
+  if (!strcmp(ext, "cpp")) return target_cpp;
+  if (!strcmp(ext, "cpp_template")) return target_cpp_template;
+  if (!strcmp(ext, "cr")) return target_cr;
+  if (!strcmp(ext, "cs")) return target_cs;
+  if (!strcmp(ext, "el")) return target_el;
+  if (!strcmp(ext, "forth")) return target_forth;
+  if (!strcmp(ext, "fs")) return target_fs;
+  if (!strcmp(ext, "go")) return target_go;
+  if (!strcmp(ext, "i")) return target_i;
+  if (!strcmp(ext, "java")) return target_java;
+  if (!strcmp(ext, "js")) return target_js;
+  if (!strcmp(ext, "lua")) return target_lua;
+  if (!strcmp(ext, "ll")) return target_ll;
+  if (!strcmp(ext, "ll_cfg")) return target_ll_cfg;
+  if (!strcmp(ext, "php")) return target_php;
+  if (!strcmp(ext, "piet")) return target_piet;
+  if (!strcmp(ext, "pietasm")) return target_pietasm;
+  if (!strcmp(ext, "pl")) return target_pl;
+  if (!strcmp(ext, "py")) return target_py;
+  if (!strcmp(ext, "ps")) return target_ps;
+  if (!strcmp(ext, "rb")) return target_rb;
+  if (!strcmp(ext, "scm_sr")) return target_scm_sr;
+  if (!strcmp(ext, "sed")) return target_sed;
+  if (!strcmp(ext, "sh")) return target_sh;
+  if (!strcmp(ext, "sqlite3")) return target_sqlite3;
+  if (!strcmp(ext, "swift")) return target_swift;
+  if (!strcmp(ext, "tex")) return target_tex;
+  if (!strcmp(ext, "tf")) return target_tf;
+  if (!strcmp(ext, "tm")) return target_tm;
+  if (!strcmp(ext, "unl")) return target_unl;
+  if (!strcmp(ext, "vim")) return target_vim;
+  if (!strcmp(ext, "wasm")) return target_wasm;
+  if (!strcmp(ext, "ws")) return target_ws;
+  if (!strcmp(ext, "x86")) return target_x86;
+  if (!strcmp(ext, "x86_64")) return target_x86_64;
+  return NULL;
+}
+
+target_func_t get_target_func(const char* ext) {
+  target_func_t f = find_target_func(ext);
+  if (!f)
+    error("unknown flag: %s", ext);
+  if (f == target_bf)
+    split_basic_block_by_mem();
+  return f;
+}
+
+int get_native_ext_ops(target_func_t f) {
+  if (f == target_aarch64) return target_aarch64_ext_ops;
+  if (f == target_arm) return target_arm_ext_ops;
+  if (f == target_bef) return target_bef_ext_ops;
+  if (f == target_c || f == target_c_cfg) return target_c_ext_ops;
+  if (f == target_forth) return target_forth_ext_ops;
+  if (f == target_js) return target_js_ext_ops;
+  if (f == target_ll || f == target_ll_cfg) return target_ll_ext_ops;
+  if (f == target_lua) return target_lua_ext_ops;
+  if (f == target_php) return target_php_ext_ops;
+  if (f == target_piet) return target_piet_ext_ops;
+  if (f == target_pl) return target_pl_ext_ops;
+  if (f == target_ps) return target_ps_ext_ops;
+  if (f == target_py) return target_py_ext_ops;
+  if (f == target_rb) return target_rb_ext_ops;
+  if (f == target_sh && SH_BASH) return target_sh_bash_ext_ops;
+  if (f == target_wasm) return target_wasm_ext_ops;
+  if (f == target_ws) return target_ws_ext_ops;
+  if (f == target_x86) return target_x86_ext_ops;
+  if (f == target_x86_64) return target_x86_64_ext_ops;
+  return 0;
+}
+
+int get_inline_budget(target_func_t f) {
+  if (f == target_aarch64 || f == target_arm || f == target_x86 ||
+      f == target_x86_64)
+    return 16;
+  return 24;
+}
+
+bool has_cacheable_chunks(target_func_t f) {
+  return (f == target_asmjs || f == target_c || f == target_cl ||
+          f == target_cpp || f == target_cr || f == target_cs ||
+          f == target_el || f == target_forth || f == target_fs ||
+          f == target_java || f == target_js || f == target_ll ||
+          f == target_lua || f == target_php || f == target_ps ||
+          f == target_py || f == target_rb || f == target_swift ||
+          f == target_vim);
+}
@@ -0,0 +1,74 @@
+#ifndef ELVM_TARGETS_H_
+#define ELVM_TARGETS_H_
+
+#include <stdbool.h>
+
+#include <ir/ir.h>
+
+void target_aarch64(Module* module);
+void target_arm(Module* module);
+void target_asmjs(Module* module);
+void target_bef(Module* module);
+void target_bf(Module* module);
+void target_c(Module* module);
+void target_c_cfg(Module* module);
+void target_cl(Module* module);
+void target_cpp(Module* module);
+void target_cpp_template(Module* module);
+void target_cr(Module* module);
+void target_cs(Module* module);
+void target_el(Module* module);
+void target_forth(Module* module);
+void target_fs(Module* module);
+void target_go(Module* module);
+void target_i(Module* module);
+void target_java(Module* module);
+void target_js(Module* module);
+void target_lua(Module* module);
+void target_ll(Module* module);
+void target_ll_cfg(Module* module);
+void target_php(Module* module);
+void target_piet(Module* module);
+void target_pietasm(Module* module);
+void target_pl(Module* module);
+void target_py(Module* module);
+void target_ps(Module* module);
+void target_rb(Module* module);
+void target_scm_sr(Module* module);
+void target_sed(Module* module);
+void target_sh(Module* module);
+void target_sqlite3(Module* module);
+void target_swift(Module* module);
+void target_tex(Module* module);
+void target_tf(Module* module);
+void target_tm(Module* module);
+void target_unl(Module* module);
+void target_vim(Module* module);
+void target_wasm(Module* module);
+void target_ws(Module* module);
+void target_x86(Module* module);
+void target_x86_64(Module* module);
+
+typedef void (*target_func_t)(Module*);
+
+// Returns the backend of a target name like "c", e.g., from -c.
+target_func_t get_target_func(const char* ext);
+
+// Returns the backend of a target name, or NULL if there is none. Unlike
+// get_target_func, it doesn't prepare the parser for the backend.
+target_func_t find_target_func(const char* ext);
+
+// The extension ops (MUL and after) backend f emits natively, as
+// EXT_OP_BITs. The others are lowered before it sees the module.
+int get_native_ext_ops(target_func_t f);
+
+// The inline budget (see set_inline_budget) for backend f. Those for
+// which a call is a few machine instructions take smaller functions
+// than those where a return goes through a dispatch loop.
+int get_inline_budget(target_func_t f);
+
+// Whether each function backend f emits through emit_chunked_main_loop
+// only depends on its instructions, so elc -cache= may reuse it.
+bool has_cacheable_chunks(target_func_t f);
+
+#endif  // ELVM_TARGETS_H_
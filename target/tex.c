@@ -1,6 +1,11 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Set by elc -tex-count. The registers become \count registers, so an
+// op is an \advance or an assignment instead of a round trip through
+// \edef and \the\count0, and a LOAD is a single assignment.
+bool TEX_COUNT_REGS;
+
 const char* tex_value_str(Value* v) {
   if (v->type == REG) {
     return format("\\@reg@%s", reg_names[v->reg]);
@@ -141,10 +146,133 @@ static void tex_emit_inst(Inst* inst) {
   }
 }
 
+// The digits of a value, for \csname and \write.
+static const char* tex_count_text_str(Value* v) {
+  if (v->type == REG)
+    return format("\\the\\@reg@%s", reg_names[v->reg]);
+  return format("%d", v->imm);
+}
+
+static void tex_count_emit_jmp(Inst* inst) {
+  if (inst->jmp.type == REG) {
+    emit_line("\\@reg@pc=\\@reg@%s\\advance\\@reg@pc by-1\\relax",
+              reg_names[inst->jmp.reg]);
+  } else {
+    emit_line("\\@reg@pc=%d\\relax", inst->jmp.imm - 1);
+  }
+}
+
+// Emits \ifnum dst <op> src, true when the condition of inst holds if
+// negate is false.
+static void tex_count_emit_if(Inst* inst, bool* negate) {
+  int op = normalize_cond(inst->op, 0);
+  const char* op_str;
+  *negate = (op == JNE || op == JLE || op == JGE);
+  switch (op) {
+    case JEQ:
+    case JNE:
+      op_str = "="; break;
+    case JLT:
+    case JGE:
+      op_str = "<"; break;
+    case JGT:
+    case JLE:
+      op_str = ">"; break;
+    default:
+      error("oops");
+  }
+  emit_line("\\ifnum\\@reg@%s%s%s\\relax",
+            reg_names[inst->dst.reg], op_str, tex_src_str(inst));
+}
+
+static void tex_count_emit_inst(Inst* inst) {
+  const char* dst = reg_names[inst->dst.reg];
+  bool negate;
+  switch (inst->op) {
+  case MOV:
+    emit_line("\\@reg@%s=%s\\relax", dst, tex_src_str(inst));
+    break;
+
+  case ADD:
+    emit_line("\\advance\\@reg@%s by%s\\relax", dst, tex_src_str(inst));
+    emit_line("\\ifnum\\@reg@%s>%d\\relax"
+              "\\advance\\@reg@%s by-16777216\\relax\\fi",
+              dst, UINT_MAX, dst);
+    break;
+
+  case SUB:
+    emit_line("\\advance\\@reg@%s by-%s\\relax", dst, tex_src_str(inst));
+    emit_line("\\ifnum\\@reg@%s<0\\relax"
+              "\\advance\\@reg@%s by16777216\\relax\\fi", dst, dst);
+    break;
+
+  case LOAD:
+    // An unset word is \relax, which ends the number after the 0.
+    emit_line("\\@reg@%s=0\\csname @mem@%s\\endcsname\\relax",
+              dst, tex_count_text_str(&inst->src));
+    break;
+
+  case STORE:
+    emit_line("\\expandafter\\edef\\csname @mem@%s\\endcsname{\\the\\@reg@%s}",
+              tex_count_text_str(&inst->src), dst);
+    break;
+
+  case PUTC:
+    emit_line("\\immediate\\write\\@out{%s}%%",
+              tex_count_text_str(&inst->src));
+    break;
+
+  case GETC:
+    emit_line("\\read-1to\\@temp\\@reg@%s=\\@temp\\relax", dst);
+    break;
+
+  case EXIT:
+    emit_line("\\let\\@@next\\relax");
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    tex_count_emit_if(inst, &negate);
+    emit_line("\\@reg@%s=%d\\relax\\else\\@reg@%s=%d\\relax\\fi",
+              dst, !negate, dst, negate);
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    tex_count_emit_if(inst, &negate);
+    if (negate)
+      emit_line("\\else");
+    tex_count_emit_jmp(inst);
+    emit_line("\\fi");
+    break;
+
+  case JMP:
+    tex_count_emit_jmp(inst);
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
 static void tex_init_state(Data* data) {
   // register
   for (int i = 0; i < 7; i++) {
-    emit_line("\\def\\@reg@%s{0}", reg_names[i]);
+    if (TEX_COUNT_REGS)
+      emit_line("\\newcount\\@reg@%s", reg_names[i]);
+    else
+      emit_line("\\def\\@reg@%s{0}", reg_names[i]);
   }
 
   // memory
@@ -178,7 +306,12 @@ void target_tex(Module* module) {
       emit_line("\\expandafter\\def\\csname @inst@%d\\endcsname{%%", inst->pc);
     }
     prev_pc = inst->pc;
-    tex_emit_inst(inst);
+    FormatMark mark = format_mark();
+    if (TEX_COUNT_REGS)
+      tex_count_emit_inst(inst);
+    else
+      tex_emit_inst(inst);
+    format_release(mark);
   }
   if(prev_pc != -1) {
     emit_line("}");
@@ -188,11 +321,16 @@ void target_tex(Module* module) {
   emit_line("\\def\\@loop@main{%%");
   emit_line("\\let\\@@next\\@loop@main");
   // execute instraction
-  emit_line("\\csname @inst@\\@reg@pc\\endcsname");
-  // increment pc
-  emit_line("\\count0=\\@reg@pc\\relax");
-  emit_line("\\advance\\count0by1\\relax");
-  emit_line("\\edef\\@reg@pc{\\the\\count0}%%");
+  if (TEX_COUNT_REGS) {
+    emit_line("\\csname @inst@\\the\\@reg@pc\\endcsname");
+    emit_line("\\advance\\@reg@pc by1\\relax");
+  } else {
+    emit_line("\\csname @inst@\\@reg@pc\\endcsname");
+    // increment pc
+    emit_line("\\count0=\\@reg@pc\\relax");
+    emit_line("\\advance\\count0by1\\relax");
+    emit_line("\\edef\\@reg@pc{\\the\\count0}%%");
+  }
   emit_line("\\@@next}\\@loop@main");
 
   // finnaly, close the output
@@ -1,6 +1,11 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Set by elc -tf2. Emits TF2 code which keeps memory in a tf.Variable
+// and runs each pc as a traced tf.function, instead of one big TF1
+// graph.
+bool TF2_FUNCTION;
+
 static void init_state_tf(Data* data) {
   emit_line("import sys");
   emit_line("import tensorflow as tf");
@@ -162,7 +167,179 @@ static void tf_emit_func_epilogue(const char* args) {
   dec_indent();
 }
 
+static void init_state_tf2(Data* data) {
+  emit_line("import sys");
+  emit_line("import tensorflow as tf");
+  emit_line("");
+  emit_line("data = [");
+  inc_indent();
+  for (; data; data = data->next)
+    emit_line("%d,", data->v);
+  dec_indent();
+  emit_line("]");
+  // The stack starts at the top, so memory is the whole 1<<24 words, but
+  // it is allocated once and updated in place.
+  emit_line("mem = tf.Variable(tf.pad(tf.constant(data, tf.int32), "
+            "[[0, (1 << 24) - len(data)]]))");
+  emit_line("");
+  emit_line("SPEC = tf.TensorSpec([], tf.int32)");
+  emit_line("INPUT = sys.stdin.buffer.read()");
+  emit_line("inp = 0");
+  emit_line("out = bytearray()");
+  emit_line("");
+  emit_line("def elvm_getc():");
+  inc_indent();
+  emit_line("global inp");
+  emit_line("if inp >= len(INPUT):");
+  emit_line("  return 0");
+  emit_line("inp += 1");
+  emit_line("return INPUT[inp - 1]");
+  dec_indent();
+  emit_line("");
+  emit_line("def elvm_putc(x):");
+  emit_line("  out.append(int(x) & 255)");
+  emit_line("  return []");
+}
+
+static const char* tf2_value_str(Value* v) {
+  if (v->type == REG) {
+    return reg_names[v->reg];
+  } else if (v->type == IMM) {
+    return format("tf.constant(%d)", v->imm);
+  } else {
+    error("invalid value");
+  }
+}
+
+static const char* tf2_cmp(Inst* inst) {
+  uint op = normalize_cond(inst->op, false);
+  static const char* OPS[] = {
+    "equal", "not_equal", "less", "greater", "less_equal", "greater_equal"
+  };
+  return format("tf.%s(%s, %s)", OPS[op - JEQ],
+                tf2_value_str(&inst->dst), tf2_value_str(&inst->src));
+}
+
+static void tf2_emit_inst(Inst* inst) {
+  const char* dst = reg_names[inst->dst.reg];
+  const char* src = tf2_value_str(&inst->src);
+  switch (inst->op) {
+  case MOV:
+    emit_line("%s = %s", dst, src);
+    break;
+
+  case ADD:
+    emit_line("%s = (%s + %s) %% 16777216", dst, dst, src);
+    break;
+
+  case SUB:
+    emit_line("%s = (%s - %s) %% 16777216", dst, dst, src);
+    break;
+
+  case LOAD:
+    emit_line("%s = mem[%s]", dst, src);
+    break;
+
+  case STORE:
+    emit_line("mem.scatter_nd_update(tf.reshape(%s, [1, 1]), "
+              "tf.reshape(%s, [1]))", src, dst);
+    break;
+
+  case PUTC:
+    emit_line("tf.py_function(elvm_putc, [%s], [])", src);
+    break;
+
+  case GETC:
+    emit_line("%s = tf.py_function(elvm_getc, [], tf.int32)", dst);
+    emit_line("%s.set_shape(())", dst);
+    break;
+
+  case EXIT:
+    emit_line("return a, b, c, d, bp, sp, tf.constant(-1)");
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    emit_line("%s = tf.cast(%s, tf.int32)", dst, tf2_cmp(inst));
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    emit_line("pc = tf.where(%s, %s, pc)",
+              tf2_cmp(inst), tf2_value_str(&inst->jmp));
+    break;
+
+  case JMP:
+    emit_line("pc = %s", tf2_value_str(&inst->jmp));
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
+// A pc ends at a jump, so it is a basic block. Each becomes a
+// tf.function with a fixed signature, traced once on its first call;
+// the Python loop only picks the next one, and the registers stay
+// tensors between them.
+static void target_tf2(Module* module) {
+  init_state_tf2(module->data);
+
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      if (prev_pc >= 0) {
+        emit_line("return a, b, c, d, bp, sp, pc");
+        dec_indent();
+      }
+      emit_line("");
+      emit_line("@tf.function(input_signature=[SPEC] * 6)");
+      emit_line("def pc_%d(a, b, c, d, bp, sp):", inst->pc);
+      inc_indent();
+      emit_line("pc = tf.constant(%d)", inst->pc + 1);
+    }
+    prev_pc = inst->pc;
+    tf2_emit_inst(inst);
+  }
+  if (prev_pc >= 0) {
+    emit_line("return a, b, c, d, bp, sp, pc");
+    dec_indent();
+  }
+
+  emit_line("");
+  emit_line("funcs = [");
+  inc_indent();
+  for (int i = 0; i <= prev_pc; i++)
+    emit_line("pc_%d,", i);
+  dec_indent();
+  emit_line("]");
+  emit_line("");
+  emit_line("regs = [tf.constant(0)] * 6");
+  emit_line("pc = 0");
+  emit_line("while pc >= 0:");
+  inc_indent();
+  emit_line("*regs, pc = funcs[pc](*regs)");
+  emit_line("pc = int(pc)");
+  dec_indent();
+  emit_line("sys.stdout.buffer.write(out)");
+}
+
 void target_tf(Module* module) {
+  if (TF2_FUNCTION) {
+    target_tf2(module);
+    return;
+  }
   init_state_tf(module->data);
 
   static const char STATE_ARGS_STR[] = "a,b,c,d,bp,sp,pc,done,mem,out,inp";
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <ir/ir.h>
 #include <target/util.h>
 
@@ -25,7 +26,9 @@ typedef enum {
   TM_SKIP_BEFORE_SRC = 1,
   TM_SKIP_AFTER_SRC = 2,
   TM_SKIP_BEFORE_DST = 4,
-  TM_SKIP_AFTER_DST = 8
+  TM_SKIP_AFTER_DST = 8,
+  // The cells written are past TM_END, so blank.
+  TM_FRESH = 16
 } tm_writemode_t;
 
 int tm_intcmp(int x, int y) {
@@ -34,12 +37,41 @@ int tm_intcmp(int x, int y) {
   else return 0;
 }
 
+/* The machine is buffered so equivalent states can be merged before
+   it's written out. Lines are kept in order: a transition, or a
+   comment given as a string or an instruction. */
+
+typedef struct {
+  int q, a, r, b, d;
+} tm_trans_t;
+
+typedef struct {
+  int trans;
+  const char* comment;
+  Inst* inst;
+} tm_line_t;
+
+tm_trans_t* tm_trans;
+int tm_num_trans, tm_cap_trans;
+tm_line_t* tm_lines;
+int tm_num_lines, tm_cap_lines;
+
+void tm_add_line(int trans, const char* comment, Inst* inst) {
+  if (tm_num_lines == tm_cap_lines) {
+    tm_cap_lines = tm_cap_lines ? tm_cap_lines * 2 : 1024;
+    tm_lines = realloc(tm_lines, tm_cap_lines * sizeof(tm_line_t));
+  }
+  tm_line_t* l = &tm_lines[tm_num_lines++];
+  l->trans = trans;
+  l->comment = comment;
+  l->inst = inst;
+}
+
 void tm_comment(const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  char* r = vformat(fmt, ap);
+  tm_add_line(-1, vformat(fmt, ap), NULL);
   va_end(ap);
-  printf("// %s\n", r);
 }
 
 /* These functions take a start state and an accept state(s) as
@@ -49,14 +81,19 @@ void tm_comment(const char* fmt, ...) {
    write symbol b, move in direction d, go to state r. */
 
 int tm_transition(int q, tm_symbol_t a, tm_symbol_t b, int d, int r) {
-  const char *dname;
-  if (d == -1)      dname = "L";
-  else if (d == 0)  dname = "N"; 
-  else if (d == +1) dname = "R";
-  else error("invalid direction %d", d);
-  emit_line("%d %s %d %s %s", 
-	    q, tm_symbol_names[a], 
-	    r, tm_symbol_names[b], dname);
+  if (d < -1 || d > +1)
+    error("invalid direction %d", d);
+  if (tm_num_trans == tm_cap_trans) {
+    tm_cap_trans = tm_cap_trans ? tm_cap_trans * 2 : 1024;
+    tm_trans = realloc(tm_trans, tm_cap_trans * sizeof(tm_trans_t));
+  }
+  tm_trans_t* t = &tm_trans[tm_num_trans];
+  t->q = q;
+  t->a = a;
+  t->r = r;
+  t->b = b;
+  t->d = d;
+  tm_add_line(tm_num_trans++, NULL, NULL);
   return r;
 }
 
@@ -69,6 +106,13 @@ int tm_write(int q, tm_symbol_t b, int d, int r) {
   return r;
 }
 
+/* Like tm_write, for a cell known to be blank. Only the transition that
+   can happen is generated. */
+
+int tm_write_blank(int q, tm_symbol_t b, int d, int r) {
+  return tm_transition(q, TM_BLANK, b, d, r);
+}
+
 /* Generate write transitions that do one thing for symbol a, 
    and another thing for all other symbols.
 
@@ -155,14 +199,16 @@ int tm_insert(int q, tm_symbol_t a, int d, int r) {
    leaving a scratch cell before each tm_bit. */
 
 int tm_write_tm_bits(int q, unsigned int x, int n, int mode, int r) {
+  int fresh = mode & TM_FRESH;
   for (int i=n-1; i>=0; i--) {
     if (mode & TM_SKIP_BEFORE_DST)
-      q = tm_move(q, +1, tm_new_state());
-    q = tm_write(q, (1<<i)&x?TM_ONE:TM_ZERO, +1, tm_new_state());
+      q = fresh ? tm_write_blank(q, TM_BLANK, +1, tm_new_state()) : tm_move(q, +1, tm_new_state());
+    tm_symbol_t b = (1<<i)&x?TM_ONE:TM_ZERO;
+    q = fresh ? tm_write_blank(q, b, +1, tm_new_state()) : tm_write(q, b, +1, tm_new_state());
     if (mode & TM_SKIP_AFTER_DST)
-      q = tm_move(q, +1, tm_new_state());
+      q = fresh ? tm_write_blank(q, TM_BLANK, +1, tm_new_state()) : tm_move(q, +1, tm_new_state());
   }
-  return tm_noop(q, r);
+  return fresh ? tm_write_blank(q, TM_BLANK, 0, r) : tm_noop(q, r);
 }
 
 int tm_erase_tm_bits(int q, int r) {
@@ -219,12 +265,12 @@ int tm_find_location(int q, tm_symbol_t type, int addr, int width, int r_found,
 int tm_new_location(int q, tm_symbol_t type, int addr, int awidth, int val, int r) {
   q = tm_ffwd(q, tm_new_state());
   q = tm_write(q, type, +1, tm_new_state());
-  q = tm_move(q, +1, tm_new_state());
-  q = tm_write_tm_bits(q, addr, awidth, TM_SKIP_AFTER_DST, tm_new_state());
-  q = tm_write(q, TM_VALUE, +1, tm_new_state());
-  q = tm_move(q, +1, tm_new_state());
-  q = tm_write_tm_bits(q, val, tm_word_size, TM_SKIP_AFTER_DST, tm_new_state());
-  return tm_write(q, TM_END, -1, r);
+  q = tm_write_blank(q, TM_BLANK, +1, tm_new_state());
+  q = tm_write_tm_bits(q, addr, awidth, TM_SKIP_AFTER_DST|TM_FRESH, tm_new_state());
+  q = tm_write_blank(q, TM_VALUE, +1, tm_new_state());
+  q = tm_write_blank(q, TM_BLANK, +1, tm_new_state());
+  q = tm_write_tm_bits(q, val, tm_word_size, TM_SKIP_AFTER_DST|TM_FRESH, tm_new_state());
+  return tm_write_blank(q, TM_END, -1, r);
 }
 
 int tm_find_register(int q, Reg reg, int r) {
@@ -464,9 +510,9 @@ int tm_find_memory_indirect(int q, int reg, int r) {
   q = tm_copy(q, +1, TM_SKIP_AFTER_SRC|TM_SKIP_BEFORE_DST, tm_new_state());
   q = tm_move(q, +1, tm_new_state());
   q = tm_write(q, TM_VALUE, +1, tm_new_state());
-  q = tm_write_tm_bits(q, 0, tm_word_size, TM_SKIP_BEFORE_DST, tm_new_state());
-  q = tm_move(q, +1, tm_new_state());
-  q = tm_write(q, TM_END, -1, tm_new_state());
+  q = tm_write_tm_bits(q, 0, tm_word_size, TM_SKIP_BEFORE_DST|TM_FRESH, tm_new_state());
+  q = tm_write_blank(q, TM_BLANK, +1, tm_new_state());
+  q = tm_write_blank(q, TM_END, -1, tm_new_state());
   q = tm_find(q, -1, TM_VALUE, tm_new_state(), tm_q_reject);
   tm_move(q, +1, r);
   return r;
@@ -492,6 +538,117 @@ int tm_make_jmpreg(int pc_max, int h, int i) {
   }
 }
 
+/* Merge states with the same transitions, up to states already merged
+   and loops back to the state itself. States are visited from the
+   highest, so chains built forward merge in one pass, and the lowest
+   state of each set is kept, so the start state stays 0. */
+
+const char* tm_dir_names[] = {"L", "N", "R"};
+int* tm_rep;
+
+int tm_find_rep(int q) {
+  if (q < 0)
+    return q;
+  while (tm_rep[q] != q) {
+    tm_rep[q] = tm_rep[tm_rep[q]];
+    q = tm_rep[q];
+  }
+  return q;
+}
+
+// The target of transition i out of state q, with -2 for q itself.
+int tm_row_target(int i, int q) {
+  int r = tm_find_rep(tm_trans[i].r);
+  return r == q ? -2 : r;
+}
+
+unsigned int tm_hash_row(int* row, int q) {
+  unsigned int h = 0;
+  for (int a = 0; a < TM_NUM_SYMBOLS; a++) {
+    int i = row[q * TM_NUM_SYMBOLS + a];
+    h = h * 31 + (i < 0 ? 7 : tm_trans[i].b * 3 + tm_trans[i].d + 1);
+    if (i >= 0)
+      h = h * 31 + tm_row_target(i, q);
+  }
+  return h;
+}
+
+int tm_same_row(int* row, int p, int q) {
+  for (int a = 0; a < TM_NUM_SYMBOLS; a++) {
+    int i = row[p * TM_NUM_SYMBOLS + a], j = row[q * TM_NUM_SYMBOLS + a];
+    if (i < 0 || j < 0) {
+      if (i != j)
+        return 0;
+    } else if (tm_trans[i].b != tm_trans[j].b ||
+               tm_trans[i].d != tm_trans[j].d ||
+               tm_row_target(i, p) != tm_row_target(j, q)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void tm_merge_states() {
+  int n = tm_next_state;
+  int* row = malloc(n * TM_NUM_SYMBOLS * sizeof(int));
+  for (int i = 0; i < n * TM_NUM_SYMBOLS; i++)
+    row[i] = -1;
+  for (int i = 0; i < tm_num_trans; i++)
+    row[tm_trans[i].q * TM_NUM_SYMBOLS + tm_trans[i].a] = i;
+  tm_rep = malloc(n * sizeof(int));
+  for (int q = 0; q < n; q++)
+    tm_rep[q] = q;
+
+  int cap = 1;
+  while (cap < n * 2)
+    cap *= 2;
+  int* table = malloc(cap * sizeof(int));
+  for (int merged = 1; merged;) {
+    merged = 0;
+    for (int i = 0; i < cap; i++)
+      table[i] = -1;
+    for (int q = n - 1; q >= 0; q--) {
+      if (tm_rep[q] != q)
+        continue;
+      for (int h = tm_hash_row(row, q) & (cap - 1);; h = (h + 1) & (cap - 1)) {
+        int p = table[h];
+        if (p < 0) {
+          table[h] = q;
+          break;
+        }
+        if (tm_rep[p] == p && tm_same_row(row, p, q)) {
+          tm_rep[p] = q;
+          table[h] = q;
+          merged = 1;
+          break;
+        }
+      }
+    }
+  }
+  free(table);
+  free(row);
+}
+
+void tm_emit() {
+  for (int i = 0; i < tm_num_lines; i++) {
+    tm_line_t* l = &tm_lines[i];
+    if (l->inst) {
+      emit_printf("// ");
+      dump_inst_fp(l->inst, cur_emitter()->out);
+    } else if (l->comment) {
+      emit_printf("// %s\n", l->comment);
+    } else {
+      tm_trans_t* t = &tm_trans[l->trans];
+      if (tm_rep[t->q] != t->q)
+        continue;
+      emit_line("%d %s %d %s %s",
+                t->q, tm_symbol_names[t->a],
+                tm_find_rep(t->r), tm_symbol_names[t->b],
+                tm_dir_names[t->d + 1]);
+    }
+  }
+}
+
 void target_tm(Module* module) {
   /* Every basic block's entry point is the state with the same number
      as its pc. Additional states are numbered starting after the
@@ -541,7 +698,7 @@ void target_tm(Module* module) {
 
   int prev_pc = 0;
   for (Inst* inst = module->text; inst; inst = inst->next) {
-    printf("// "); dump_inst_fp(inst, stdout);
+    tm_add_line(-1, NULL, inst);
 
     // If new pc, transition to state corresponding to new pc
     if (inst->pc != prev_pc && q != inst->pc)
@@ -714,4 +871,7 @@ void target_tm(Module* module) {
       error("invalid operation");
     }
   }
+
+  tm_merge_states();
+  tm_emit();
 }
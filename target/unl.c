@@ -81,12 +81,12 @@ static UnlReg unl_regpos(Reg r) {
 }
 
 static void unl_emit(const char* s) {
-  fputs(s, stdout);
+  emit_str(s);
 }
 
 static void unl_emit_tick(int n) {
   for (int i = 0; i < n; i++) {
-    putchar('`');
+    emit_char('`');
   }
 }
 
@@ -97,7 +97,7 @@ static void unl_list_begin(int is_first) {
 }
 
 static void unl_list_end(void) {
-  putchar('v');
+  emit_char('v');
 }
 
 static void unl_emit_churchnum(int n) {
@@ -106,17 +106,11 @@ static void unl_emit_churchnum(int n) {
   unl_emit(CHURCHNUM[n]);
 }
 
+// A number as a list of 24 bits, least significant first. Once the
+// rest are all zeros or all ones, they are built from a Church numeral
+// instead of being spelled out, which keeps immediates short. The lists
+// are built once when the program is loaded.
 static void unl_emit_number(int n) {
-  for (int i = 0; i < 24; i++) {
-    unl_list_begin(i == 0);
-    unl_emit(n % 2 ? "k" : "`ki");
-    n /= 2;
-  }
-  unl_list_end();
-}
-
-// Compact, but less efficient
-static void unl_emit_number2(int n) {
   int all_one = UINT_MAX;
   for (int i = 0; i < 24; i++) {
     if (i < 23 && n == 0) {
@@ -208,7 +202,7 @@ static void unl_lib_load() {
 
   unl_emit(S2);
   unl_emit_lib(LIB_LOAD);
-  putchar('i');
+  emit_char('i');
 }
 
 static void unl_lib_store() {
@@ -217,7 +211,7 @@ static void unl_lib_store() {
 
   unl_emit(S2);
   unl_emit_lib(LIB_STORE);
-  putchar('i');
+  emit_char('i');
 }
 
 static void unl_lib_putc() {
@@ -308,7 +302,7 @@ static void unl_bool_to_number_end(void) {
   unl_emit_tick(2);
   unl_emit_churchnum(23);
   unl_emit(CONS_KI);
-  putchar('v');
+  emit_char('v');
 }
 
 static void unl_emit_op(Inst* inst) {
@@ -383,11 +377,11 @@ static void unl_emit_op(Inst* inst) {
       unl_emit_value(&inst->src);
     }
     if (inst->op == JNE || inst->op == JLE || inst->op == JGE) {
-      putchar('i');
+      emit_char('i');
       unl_emit_jmp(&inst->jmp);
     } else {
       unl_emit_jmp(&inst->jmp);
-      putchar('i');
+      emit_char('i');
     }
     break;
 
@@ -454,7 +448,7 @@ static void unl_emit_op(Inst* inst) {
     break;
 
   case DUMP:
-    putchar('i');
+    emit_char('i');
     break;
 
   default:
@@ -464,7 +458,7 @@ static void unl_emit_op(Inst* inst) {
 
 static Inst* unl_emit_chunk(Inst* inst) {
   int pc = inst->pc;
-  printf("\n# pc=%d\n", pc);
+  emit_printf("\n# pc=%d\n", pc);
 
   Inst* reversed = NULL;
   while (inst && inst->pc == pc) {
@@ -475,15 +469,15 @@ static Inst* unl_emit_chunk(Inst* inst) {
   }
 
   for (; reversed; reversed = reversed->next) {
-    printf("# ");
-    dump_inst_fp(reversed, stdout);
+    emit_printf("# ");
+    dump_inst_fp(reversed, cur_emitter()->out);
 
     if (reversed->next) {
       unl_emit_tick(2);
       unl_emit(COMPOSE);
     }
     unl_emit_op(reversed);
-    putchar('\n');
+    emit_char('\n');
   }
 
   return inst;
@@ -502,17 +496,17 @@ static void unl_emit_text(Inst* inst) {
 static void unl_emit_data(Data* data) {
   for (Data* d = data; d; d = d->next) {
     unl_list_begin(d == data);
-    unl_emit_number2(d->v);
+    unl_emit_number(d->v);
   }
   unl_list_end();
 }
 
 static void unl_emit_print(int n) {
   if (n == 10) {
-    putchar('r');
+    emit_char('r');
   } else {
-    putchar('.');
-    putchar(n);
+    emit_char('.');
+    emit_char(n);
   }
 }
 
@@ -534,7 +528,7 @@ static void unl_emit_putc_rec(int n, int b) {
 static void unl_emit_libputc(void) {
   unl_emit(S2);
   unl_emit(S2);
-  putchar('i');
+  emit_char('i');
   unl_emit(K1);
   unl_emit_putc_rec(0, 1);
   unl_emit("`ki");
@@ -547,15 +541,15 @@ static void unl_emit_libgetc(void) {
     unl_emit(S2);
     unl_emit("`d");
     unl_emit("`?");
-    putchar(c);
-    putchar('i');
+    emit_char(c);
+    emit_char('i');
     unl_emit(K1);
-    unl_emit_number2(c);
+    unl_emit_number(c);
   }
   unl_emit(S2);
-  putchar('i');
+  emit_char('i');
   unl_emit(K1);
-  unl_emit_number2(0);
+  unl_emit_number(0);
 }
 
 static void unl_emit_libs(void) {
@@ -569,16 +563,16 @@ static void unl_emit_libs(void) {
 static void unl_emit_core(void) {
   unl_emit(unl_core);
   unl_emit_libs();
-  putchar('\n');
+  emit_char('\n');
 }
 
 void target_unl(Module* module) {
   unl_emit_tick(2);
-  printf("# VM core\n");
+  emit_printf("# VM core\n");
   unl_emit_core();
-  printf("# instructions\n");
+  emit_printf("# instructions\n");
   unl_emit_text(module->text);
-  printf("# data\n");
+  emit_printf("# data\n");
   unl_emit_data(module->data);
-  putchar('\n');
+  emit_char('\n');
 }
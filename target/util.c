@@ -5,12 +5,116 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __eir__
+#include <unistd.h>
+#endif
+
+#include <ir/mask.h>
+
+// Formatted strings are bump-allocated from a list of blocks which is
+// rewound by format_release and then reused.
+#define FORMAT_BLOCK_SIZE 65536
+
+typedef struct FormatBlock_ {
+  struct FormatBlock_* next;
+  int used;
+  char buf[FORMAT_BLOCK_SIZE];
+} FormatBlock;
+
+static const char* DEFAULT_REG_NAMES[7] = {
+  "a", "b", "c", "d", "bp", "sp", "pc"
+};
+
+#ifdef __eir__
+#define THREAD_LOCAL
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+static Emitter g_default_emitter;
+static THREAD_LOCAL Emitter* g_emitter;
+
+static void emitter_init(Emitter* e, FILE* out) {
+  memset(e, 0, sizeof(*e));
+  e->out = out;
+  e->reg_name_list = DEFAULT_REG_NAMES;
+  e->chunked_func_size = 512;
+  e->mem_model = MEM_FULL;
+  e->bulk_data_min = 64;
+}
+
+Emitter* emitter_new(FILE* out) {
+  Emitter* e = malloc(sizeof(Emitter));
+  emitter_init(e, out);
+  return e;
+}
+
+void emitter_free(Emitter* e) {
+  if (e->code)
+    free(e->buf);
+  for (FormatBlock* b = e->format_head; b;) {
+    FormatBlock* next = b->next;
+    free(b);
+    b = next;
+  }
+  free(e);
+}
+
+Emitter* cur_emitter() {
+  if (!g_emitter) {
+    if (!g_default_emitter.reg_name_list)
+      emitter_init(&g_default_emitter, stdout);
+    g_emitter = &g_default_emitter;
+  }
+  return g_emitter;
+}
+
+Emitter* set_emitter(Emitter* e) {
+  Emitter* prev = cur_emitter();
+  g_emitter = e;
+  return prev;
+}
+
+static char* format_alloc(int size) {
+  Emitter* e = cur_emitter();
+  if (!e->format_cur) {
+    e->format_head = e->format_cur = calloc(1, sizeof(FormatBlock));
+  }
+  if (e->format_cur->used + size > FORMAT_BLOCK_SIZE) {
+    if (!e->format_cur->next)
+      e->format_cur->next = calloc(1, sizeof(FormatBlock));
+    e->format_cur = e->format_cur->next;
+    e->format_cur->used = 0;
+  }
+  char* r = e->format_cur->buf + e->format_cur->used;
+  e->format_cur->used += size;
+  return r;
+}
+
+FormatMark format_mark() {
+  Emitter* e = cur_emitter();
+  FormatMark m;
+  m.block = e->format_cur;
+  m.used = e->format_cur ? e->format_cur->used : 0;
+  return m;
+}
+
+void format_release(FormatMark m) {
+  Emitter* e = cur_emitter();
+  e->format_cur = m.block ? m.block : e->format_head;
+  if (e->format_cur)
+    e->format_cur->used = m.used;
+}
 
 char* vformat(const char* fmt, va_list ap) {
   char buf[256];
   vsnprintf(buf, 255, fmt, ap);
   buf[255] = 0;
-  return strdup(buf);
+  int len = strlen(buf);
+  cur_emitter()->num_formats++;
+  char* r = format_alloc(len + 1);
+  memcpy(r, buf, len + 1);
+  return r;
 }
 
 char* format(const char* fmt, ...) {
@@ -26,41 +130,66 @@ void error(const char* fmt, ...) {
   va_start(ap, fmt);
   char* r = vformat(fmt, ap);
   va_end(ap);
-  fprintf(stderr, "%s\n", r);
-  exit(1);
+  ir_fatal("%s", r);
 }
 
-static int g_indent;
-
 void inc_indent() {
-  g_indent++;
+  cur_emitter()->indent++;
 }
 
 void dec_indent() {
-  g_indent--;
+  cur_emitter()->indent--;
 }
 
+static void src_map_line(Emitter* e);
+
 void emit_line(const char* fmt, ...) {
+  Emitter* e = cur_emitter();
+  if (e->src_map && e->cur_src_loc)
+    src_map_line(e);
+  e->num_lines++;
   if (fmt[0]) {
-    for (int i = 0; i < g_indent; i++)
-      putchar(' ');
+    for (int i = 0; i < e->indent; i++)
+      fputc(' ', e->out);
     va_list ap;
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(e->out, fmt, ap);
     va_end(ap);
+    if (e->line_suffix && !strchr("; ", fmt[0]) &&
+        !strchr(":[]", fmt[strlen(fmt) - 1]))
+      fputs(e->line_suffix, e->out);
   }
-  putchar('\n');
+  fputc('\n', e->out);
 }
 
-static const char* DEFAULT_REG_NAMES[7] = {
-  "a", "b", "c", "d", "bp", "sp", "pc"
-};
+void emit_char(int c) {
+  fputc(c, cur_emitter()->out);
+}
 
-const char** reg_names = DEFAULT_REG_NAMES;
+void emit_str(const char* s) {
+  fputs(s, cur_emitter()->out);
+}
+
+void emit_printf(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  emit_vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void emit_vprintf(const char* fmt, va_list ap) {
+  vfprintf(cur_emitter()->out, fmt, ap);
+}
+
+const char* reg_str(Reg r) {
+  if (IS_VREG(r))
+    return format("r%d", r - R0);
+  return reg_names[r];
+}
 
 const char* value_str(Value* v) {
   if (v->type == REG) {
-    return reg_names[v->reg];
+    return reg_str(v->reg);
   } else if (v->type == IMM) {
     return format("%d", v->imm);
   } else {
@@ -72,6 +201,26 @@ const char* src_str(Inst* inst) {
   return value_str(&inst->src);
 }
 
+const char* mem_addr_str(Inst* inst) {
+  if (!inst->disp)
+    return src_str(inst);
+  return format("(%s + %d) & " UINT_MAX_STR, src_str(inst), inst->disp);
+}
+
+int global_var_addr(Inst* inst) {
+  return (inst->src.imm + inst->disp) & UINT_MAX;
+}
+
+void emit_global_var_inits(Module* module, const char* fmt) {
+  if (!module->global_vars)
+    return;
+  Data* data = module->data;
+  for (int mp = 0; mp < module->num_data; mp++, data = data->next) {
+    if (module->global_vars[mp])
+      emit_line(fmt, mp, data->v);
+  }
+}
+
 Op normalize_cond(Op op, bool flip) {
   if (op >= 16)
     op -= 8;
@@ -108,26 +257,76 @@ const char* cmp_str(Inst* inst, const char* true_str) {
   return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
 }
 
-static int g_emit_cnt;
-static bool g_emit_started;
-
 int emit_cnt() {
-  return g_emit_cnt;
+  return cur_emitter()->cnt;
 }
 
 void emit_reset() {
-  g_emit_cnt = 0;
-  g_emit_started = false;
+  Emitter* e = cur_emitter();
+  e->cnt = 0;
+  e->started = false;
+  if (e->code)
+    free(e->buf);
+  e->buf = NULL;
+  e->code = false;
+  e->code_len = 0;
+  e->code_cap = 0;
 }
 
 void emit_start() {
-  g_emit_started = true;
+  cur_emitter()->started = true;
+}
+
+void emit_start_buffer(byte* buf) {
+  Emitter* e = cur_emitter();
+  e->started = true;
+  e->buf = buf;
+}
+
+void emit_start_code() {
+  Emitter* e = cur_emitter();
+  e->started = true;
+  e->code = true;
+  e->code_len = 0;
+}
+
+void emit_patch_begin(int offset) {
+  Emitter* e = cur_emitter();
+  e->patch_end = e->cnt;
+  e->cnt = offset;
+}
+
+void emit_patch_end() {
+  Emitter* e = cur_emitter();
+  e->cnt = e->patch_end;
+}
+
+void emit_flush() {
+  Emitter* e = cur_emitter();
+  fwrite(e->buf, 1, e->code_len, e->out);
+  e->code_len = 0;
+}
+
+static void emit_code_1(Emitter* e, int a) {
+  if (e->cnt == e->code_cap) {
+    int cap = e->code_cap ? e->code_cap * 2 : 65536;
+    e->buf = realloc(e->buf, cap);
+    e->code_cap = cap;
+  }
+  e->buf[e->cnt] = a;
+  if (e->cnt == e->code_len)
+    e->code_len++;
 }
 
 void emit_1(int a) {
-  g_emit_cnt++;
-  if (g_emit_started)
-    putchar(a);
+  Emitter* e = cur_emitter();
+  if (e->code)
+    emit_code_1(e, a);
+  else if (e->buf)
+    e->buf[e->cnt] = a;
+  else if (e->started)
+    fputc(a, e->out);
+  e->cnt++;
 }
 
 void emit_2(int a, int b) {
@@ -185,40 +384,414 @@ void emit_diff(uint32_t a, uint32_t b) {
   emit_1(a >= b ? 0 : 0xff);
 }
 
-int CHUNKED_FUNC_SIZE = 512;
+#ifndef __eir__
+void set_text_stream(EIRStream* s) {
+  cur_emitter()->text_stream = s;
+}
+#endif
+
+typedef struct {
+  void (*prologue)(int func_id);
+  void (*epilogue)(void);
+  void (*pc_change)(int pc);
+  void (*inst)(Inst* inst);
+} ChunkFuncs;
+
+// Emits the function of the instructions from inst up to end.
+static void emit_chunk(const ChunkFuncs* funcs, int func_id,
+                       Inst* inst, Inst* end) {
+  funcs->prologue(func_id);
+  int prev_pc = -1;
+  for (; inst != end; inst = inst->next) {
+    if (prev_pc != inst->pc)
+      funcs->pc_change(inst->pc);
+    prev_pc = inst->pc;
+
+    FormatMark mark = format_mark();
+    funcs->inst(inst);
+    format_release(mark);
+  }
+  funcs->epilogue();
+}
+
+#ifndef __eir__
+static uint64_t fnv1a(uint64_t h, const void* p, size_t n) {
+  const byte* b = p;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ b[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static uint64_t hash_int(uint64_t h, int v) {
+  return fnv1a(h, &v, sizeof(v));
+}
+
+static uint64_t hash_value(uint64_t h, Value* v) {
+  h = hash_int(h, v->type);
+  return hash_int(h, v->type == REG ? (int)v->reg : v->imm);
+}
+
+// Like emit_chunk, but through the chunk cache. The output of a
+// function only depends on its instructions, including their pcs, and
+// on the target, so that's the key.
+static void emit_cached_chunk(const ChunkFuncs* funcs, int func_id,
+                              Inst* inst, Inst* end) {
+  Emitter* e = cur_emitter();
+  uint64_t h = fnv1a(0xcbf29ce484222325ULL, e->chunk_cache_salt,
+                     strlen(e->chunk_cache_salt));
+  h = hash_int(h, func_id);
+  h = hash_int(h, e->indent);
+  for (Inst* i = inst; i != end; i = i->next) {
+    h = hash_int(h, i->op);
+    h = hash_value(h, &i->dst);
+    h = hash_value(h, &i->src);
+    h = hash_value(h, &i->jmp);
+    h = hash_int(h, i->disp);
+    h = hash_int(h, i->pc);
+    h = hash_int(h, i->unmasked | i->in_range << 1 | i->global_var << 2);
+  }
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%016llx",
+           e->chunk_cache_dir, (unsigned long long)h);
+
+  FILE* fp = fopen(path, "rb");
+  if (fp) {
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      fwrite(buf, 1, n, e->out);
+    fclose(fp);
+    e->num_cached_chunks++;
+    return;
+  }
+
+  FILE* out = e->out;
+  char* buf;
+  size_t len;
+  e->out = open_memstream(&buf, &len);
+  if (!e->out)
+    error("open_memstream failed");
+  int indent = e->indent;
+  emit_chunk(funcs, func_id, inst, end);
+  fclose(e->out);
+  e->out = out;
+  fwrite(buf, 1, len, out);
+  // A function which leaves the indentation changed can't be replayed.
+  // Others may run elc on the same directory, so the entry appears
+  // whole or not at all.
+  if (e->indent == indent) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    fp = fopen(tmp, "wb");
+    if (fp) {
+      bool ok = fwrite(buf, 1, len, fp) == len;
+      if (fclose(fp) || !ok || rename(tmp, path))
+        remove(tmp);
+    }
+  }
+  free(buf);
+}
+#endif
 
 int emit_chunked_main_loop(Inst* inst,
                            void (*emit_func_prologue)(int func_id),
                            void (*emit_func_epilogue)(void),
                            void (*emit_pc_change)(int pc),
                            void (*emit_inst)(Inst* inst)) {
-  int prev_pc = -1;
-  int prev_func_id = -1;
-  for (; inst; inst = inst->next) {
-    int func_id = inst->pc / CHUNKED_FUNC_SIZE;
-    if (prev_pc != inst->pc) {
-      if (prev_func_id != func_id) {
-        if (prev_func_id != -1) {
-          emit_func_epilogue();
-        }
-        emit_func_prologue(func_id);
-      }
+  ChunkFuncs funcs = {
+    emit_func_prologue, emit_func_epilogue, emit_pc_change, emit_inst
+  };
+  int num_funcs = 0;
+  for (int end = CHUNKED_FUNC_SIZE;; end += CHUNKED_FUNC_SIZE) {
+#ifndef __eir__
+    EIRStream* text_stream = cur_emitter()->text_stream;
+    if (text_stream) {
+      inst = read_eir_stream(text_stream, end);
+      if (!inst)
+        break;
+      mark_unmasked(inst);
+    }
+#endif
+    while (inst) {
+      int func_id = inst->pc / CHUNKED_FUNC_SIZE;
+      Inst* next = inst;
+      while (next && next->pc / CHUNKED_FUNC_SIZE == func_id)
+        next = next->next;
+#ifndef __eir__
+      if (cur_emitter()->chunk_cache_dir)
+        emit_cached_chunk(&funcs, func_id, inst, next);
+      else
+#endif
+        emit_chunk(&funcs, func_id, inst, next);
+      inst = next;
+      num_funcs = func_id + 1;
+    }
+#ifndef __eir__
+    if (!text_stream)
+#endif
+      break;
+  }
+  if (!num_funcs)
+    emit_func_epilogue();
+  return num_funcs;
+}
+
+static long pc_count(int pc) {
+  Emitter* e = cur_emitter();
+  return pc < e->num_pc_counts ? e->pc_counts[pc] : 0;
+}
 
-      emit_pc_change(inst->pc);
+// The weight of a jump crossing a cut between functions. A backward
+// jump is likely a loop, which would go through main every iteration.
+// With a profile, a jump also weighs as many times as it can have been
+// taken, the fewer of the entries of its ends, so hot callers and their
+// callees end up in one function.
+static long chunk_jump_weight(int from, int to) {
+  long w = to <= from ? 4 : 1;
+  if (cur_emitter()->pc_counts) {
+    long f = pc_count(from);
+    long t = pc_count(to);
+    w += f < t ? f : t;
+  }
+  return w;
+}
+
+// cost[p] is the weight of the jumps a function start at p would cut.
+static long* chunk_cut_costs(CFG* cfg) {
+  int n = cfg->num_blocks;
+  long* cost = calloc(n + 1, sizeof(long));
+  for (int pc = 0; pc < n; pc++) {
+    BasicBlock* b = &cfg->blocks[pc];
+    for (int i = 0; i < b->num_succs; i++) {
+      int to = b->succs[i];
+      if (to == pc + 1)
+        continue;
+      int lo = (to < pc ? to : pc) + 1;
+      int hi = to < pc ? pc : to;
+      cost[lo] += chunk_jump_weight(pc, to);
+      cost[hi + 1] -= chunk_jump_weight(pc, to);
     }
-    prev_pc = inst->pc;
-    prev_func_id = func_id;
+  }
+  for (int pc = 1; pc <= n; pc++)
+    cost[pc] += cost[pc - 1];
+  return cost;
+}
 
-    emit_inst(inst);
+ChunkPlan* plan_chunks(CFG* cfg) {
+  Module* m = cfg->module;
+  int n = m->num_pcs;
+  long* cost = chunk_cut_costs(cfg);
+  ChunkPlan* plan = calloc(1, sizeof(ChunkPlan));
+  plan->starts = malloc((n + 2) * sizeof(int));
+  plan->func_of_pc = malloc((n + 1) * sizeof(int));
+  plan->is_entry = calloc(n + 1, sizeof(bool));
+
+  // Ends each function at the cheapest cut in the second half of its
+  // budget, the latest one on ties.
+  for (int start = 0; start < n;) {
+    int end = n;
+    if (n - start > CHUNKED_FUNC_SIZE) {
+      end = start + CHUNKED_FUNC_SIZE;
+      for (int pc = end - 1; pc > start + CHUNKED_FUNC_SIZE / 2; pc--) {
+        if (cost[pc] < cost[end])
+          end = pc;
+      }
+    }
+    for (int pc = start; pc < end; pc++)
+      plan->func_of_pc[pc] = plan->num_funcs;
+    plan->starts[plan->num_funcs++] = start;
+    plan->is_entry[start] = true;
+    start = end;
+  }
+  plan->starts[plan->num_funcs] = n;
+  free(cost);
+
+  for (int i = 0; i < cfg->num_indirect_targets; i++)
+    plan->is_entry[cfg->indirect_targets[i]] = true;
+  for (int i = 0; i < m->num_insts; i++) {
+    Inst* inst = &m->text[i];
+    if (inst->op < JEQ || inst->op > JMP || inst->jmp.type != IMM)
+      continue;
+    int target = inst->jmp.imm;
+    if (target >= 0 && target < n &&
+        plan->func_of_pc[target] != plan->func_of_pc[inst->pc])
+      plan->is_entry[target] = true;
+  }
+  return plan;
+}
+
+int estimate_bytecode_size(Inst* inst) {
+  switch (inst->op) {
+  case MOV:
+    return 6;
+  case GETC:
+    return 32;
+  case EXIT:
+    return 8;
+  case DUMP:
+    return 0;
+  default:
+    return 16;
   }
-  emit_func_epilogue();
-  return prev_func_id + 1;
 }
 
 #define PACK2(x) ((x) % 256), ((x) / 256)
-#define PACK4(x) ((x) % 256), ((x) / 256 % 256), ((x) / 65536), 0
+#define PACK4(x) ((x) % 256), ((x) / 256 % 256), ((x) / 65536 % 256), \
+    ((x) / 65536 / 256)
+#define PACK8(x) PACK4(x), 0, 0, 0, 0
 
-void emit_elf_header(uint16_t machine, uint32_t filesz) {
+// The sections of set_elf_symbols follow the image: the symbols, their
+// names, the section names and the section headers, each 8-byte
+// aligned. The headers are null, .text, .symtab, .strtab and .shstrtab.
+typedef struct ElfSymbols_ {
+  int num_syms;
+  const char** names;
+  uint32_t* addrs;
+  uint32_t* sizes;
+  uint32_t text_offset;
+  uint32_t text_size;
+  bool is64;
+  uint32_t file_size;
+  uint32_t symtab_offset;
+  uint32_t strtab_offset;
+  uint32_t strtab_size;
+  uint32_t shstrtab_offset;
+  uint32_t shoff;
+} ElfSymbols;
+
+static const char ELF_SHSTRTAB[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+#define ELF_NUM_SECTIONS 5
+
+void set_elf_symbols(Module* module, const int* pc2addr,
+                     uint32_t text_offset, uint32_t text_size) {
+  Emitter* e = cur_emitter();
+  if (!e->src_module || !module->pc_labels)
+    return;
+  ElfSymbols* s = calloc(1, sizeof(ElfSymbols));
+  int n = module->num_pc_labels;
+  s->names = malloc((n + 1) * sizeof(char*));
+  s->addrs = malloc((n + 1) * sizeof(uint32_t));
+  s->sizes = malloc((n + 1) * sizeof(uint32_t));
+  // The setup code before the first pc, where the entry point is.
+  s->names[0] = "_start";
+  s->addrs[0] = 0;
+  s->num_syms = 1;
+  for (int pc = 0; pc < n && pc < module->num_pcs; pc++) {
+    if (!module->pc_labels[pc] || !module->pc_lens[pc])
+      continue;
+    s->names[s->num_syms] = module->pc_labels[pc];
+    s->addrs[s->num_syms++] = pc2addr[pc];
+  }
+  for (int i = 0; i < s->num_syms; i++) {
+    uint32_t end = i + 1 < s->num_syms ? s->addrs[i + 1] : text_size;
+    s->sizes[i] = end - s->addrs[i];
+    s->addrs[i] += ELF_TEXT_START + text_offset;
+  }
+  s->text_offset = text_offset;
+  s->text_size = text_size;
+  e->elf_syms = s;
+}
+
+static uint32_t elf_align(uint32_t v) {
+  return (v + 7) & ~7;
+}
+
+// Lays out the sections after file_size bytes of image, and returns
+// the e_shoff of the header, 0 without symbols.
+static uint32_t elf_layout_sections(uint32_t file_size, bool is64) {
+  ElfSymbols* s = cur_emitter()->elf_syms;
+  if (!s)
+    return 0;
+  s->is64 = is64;
+  s->file_size = file_size;
+  s->symtab_offset = elf_align(file_size);
+  s->strtab_offset = s->symtab_offset + (s->num_syms + 1) * (is64 ? 24 : 16);
+  s->strtab_size = 1;
+  for (int i = 0; i < s->num_syms; i++)
+    s->strtab_size += strlen(s->names[i]) + 1;
+  s->shstrtab_offset = s->strtab_offset + s->strtab_size;
+  s->shoff = elf_align(s->shstrtab_offset + sizeof(ELF_SHSTRTAB));
+  return s->shoff;
+}
+
+static void elf_put(uint64_t v, int n) {
+  for (int i = 0; i < n; i++)
+    fputc(v >> (i * 8) & 255, cur_emitter()->out);
+}
+
+// A section header, whose address-sized fields are 8 bytes in ELF64.
+static void elf_put_shdr(ElfSymbols* s, uint32_t name, uint32_t type,
+                         uint32_t flags, uint32_t addr, uint32_t offset,
+                         uint32_t size, uint32_t link, uint32_t info,
+                         uint32_t entsize) {
+  int w = s->is64 ? 8 : 4;
+  elf_put(name, 4);
+  elf_put(type, 4);
+  elf_put(flags, w);
+  elf_put(addr, w);
+  elf_put(offset, w);
+  elf_put(size, w);
+  elf_put(link, 4);
+  elf_put(info, 4);
+  elf_put(type == 1 ? 16 : w, w);
+  elf_put(entsize, w);
+}
+
+void emit_elf_sections(void) {
+  Emitter* e = cur_emitter();
+  ElfSymbols* s = e->elf_syms;
+  if (!s)
+    return;
+  e->elf_syms = NULL;
+  for (uint32_t p = s->file_size; p < s->symtab_offset; p++)
+    fputc(0, e->out);
+
+  int sym_size = s->is64 ? 24 : 16;
+  for (int i = 0; i < sym_size; i++)
+    fputc(0, e->out);
+  uint32_t name = 1;
+  for (int i = 0; i < s->num_syms; i++) {
+    elf_put(name, 4);
+    if (s->is64) {
+      elf_put(0x12, 1);  // STB_GLOBAL, STT_FUNC
+      elf_put(0, 1);
+      elf_put(1, 2);  // .text
+      elf_put(s->addrs[i], 8);
+      elf_put(s->sizes[i], 8);
+    } else {
+      elf_put(s->addrs[i], 4);
+      elf_put(s->sizes[i], 4);
+      elf_put(0x12, 1);
+      elf_put(0, 1);
+      elf_put(1, 2);
+    }
+    name += strlen(s->names[i]) + 1;
+  }
+  fputc(0, e->out);
+  for (int i = 0; i < s->num_syms; i++)
+    fwrite(s->names[i], strlen(s->names[i]) + 1, 1, e->out);
+  fwrite(ELF_SHSTRTAB, sizeof(ELF_SHSTRTAB), 1, e->out);
+  for (uint32_t p = s->shstrtab_offset + sizeof(ELF_SHSTRTAB);
+       p < s->shoff; p++)
+    fputc(0, e->out);
+
+  int shdr_size = s->is64 ? 64 : 40;
+  for (int i = 0; i < shdr_size; i++)
+    fputc(0, e->out);
+  elf_put_shdr(s, 1, 1, 6, ELF_TEXT_START + s->text_offset, s->text_offset,
+               s->text_size, 0, 0, 0);
+  elf_put_shdr(s, 7, 2, 0, 0, s->symtab_offset, (s->num_syms + 1) * sym_size,
+               3, 1, sym_size);
+  elf_put_shdr(s, 15, 3, 0, 0, s->strtab_offset, s->strtab_size, 0, 0, 0);
+  elf_put_shdr(s, 23, 3, 0, 0, s->shstrtab_offset, sizeof(ELF_SHSTRTAB),
+               0, 0, 0);
+  free(s->names);
+  free(s->addrs);
+  free(s->sizes);
+  free(s);
+}
+
+static void emit_elf_ehdr(uint16_t machine, int phnum, uint32_t shoff) {
   const char ehdr[52] = {
     // e_ident
     0x7f, 0x45, 0x4c, 0x46, 0x01, 0x01, 0x01, 0x00,
@@ -226,27 +799,283 @@ void emit_elf_header(uint16_t machine, uint32_t filesz) {
     PACK2(2),  // e_type
     PACK2(machine),  // e_machine
     PACK4(1),  // e_version
-    PACK4(ELF_TEXT_START + ELF_HEADER_SIZE),  // e_entry
+    PACK4(ELF_TEXT_START + 52 + 32 * phnum),  // e_entry
     PACK4(52),  // e_phoff
-    PACK4(0),  // e_shoff
+    PACK4(shoff),  // e_shoff
     PACK4(0),  // e_flags
     PACK2(52),  // e_ehsize
     PACK2(32),  // e_phentsize
-    PACK2(1),  // e_phnum
+    PACK2(phnum),  // e_phnum
     PACK2(40),  // e_shentsize
-    PACK2(0),  // e_shnum
-    PACK2(0),  // e_shstrndx
+    PACK2(shoff ? ELF_NUM_SECTIONS : 0),  // e_shnum
+    PACK2(shoff ? ELF_NUM_SECTIONS - 1 : 0),  // e_shstrndx
   };
+  fwrite(ehdr, 52, 1, cur_emitter()->out);
+}
+
+static void emit_elf_phdr(uint32_t offset, uint32_t filesz, uint32_t memsz,
+                          int flags) {
   const char phdr[32] = {
     PACK4(1),  // p_type
-    PACK4(0),  // p_offset
-    PACK4(ELF_TEXT_START),  // p_vaddr
-    PACK4(ELF_TEXT_START),  // p_paddr
-    PACK4(filesz + ELF_HEADER_SIZE),  // p_filesz
-    PACK4(filesz + ELF_HEADER_SIZE),  // p_memsz
-    PACK4(5),  // p_flags
+    PACK4(offset),  // p_offset
+    PACK4(ELF_TEXT_START + offset),  // p_vaddr
+    PACK4(ELF_TEXT_START + offset),  // p_paddr
+    PACK4(filesz),  // p_filesz
+    PACK4(memsz),  // p_memsz
+    PACK4(flags),  // p_flags
     PACK4(0x1000),  // p_align
   };
-  fwrite(ehdr, 52, 1, stdout);
-  fwrite(phdr, 32, 1, stdout);
+  fwrite(phdr, 32, 1, cur_emitter()->out);
+}
+
+void emit_elf_header(uint16_t machine, uint32_t filesz) {
+  uint32_t shoff = elf_layout_sections(filesz + ELF_HEADER_SIZE, false);
+  emit_elf_ehdr(machine, 1, shoff);
+  emit_elf_phdr(0, filesz + ELF_HEADER_SIZE, filesz + ELF_HEADER_SIZE, 5);
+}
+
+void emit_elf_data_header(uint16_t machine, uint32_t filesz,
+                          uint32_t data_size, uint32_t mem_size) {
+  uint32_t text_size = filesz - data_size + ELF_DATA_HEADER_SIZE;
+  uint32_t shoff = elf_layout_sections(filesz + ELF_DATA_HEADER_SIZE, false);
+  emit_elf_ehdr(machine, 2, shoff);
+  emit_elf_phdr(0, text_size, text_size, 5);
+  emit_elf_phdr(text_size, data_size, mem_size, 6);
+}
+
+void emit_elf64_header(uint16_t machine, uint32_t filesz) {
+  uint32_t shoff = elf_layout_sections(filesz + ELF64_HEADER_SIZE, true);
+  const char ehdr[64] = {
+    // e_ident
+    0x7f, 0x45, 0x4c, 0x46, 0x02, 0x01, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    PACK2(2),  // e_type
+    PACK2(machine),  // e_machine
+    PACK4(1),  // e_version
+    PACK8(ELF_TEXT_START + ELF64_HEADER_SIZE),  // e_entry
+    PACK8(64),  // e_phoff
+    PACK8(shoff),  // e_shoff
+    PACK4(0),  // e_flags
+    PACK2(64),  // e_ehsize
+    PACK2(56),  // e_phentsize
+    PACK2(1),  // e_phnum
+    PACK2(64),  // e_shentsize
+    PACK2(shoff ? ELF_NUM_SECTIONS : 0),  // e_shnum
+    PACK2(shoff ? ELF_NUM_SECTIONS - 1 : 0),  // e_shstrndx
+  };
+  const char phdr[56] = {
+    PACK4(1),  // p_type
+    PACK4(5),  // p_flags
+    PACK8(0),  // p_offset
+    PACK8(ELF_TEXT_START),  // p_vaddr
+    PACK8(ELF_TEXT_START),  // p_paddr
+    PACK8(filesz + ELF64_HEADER_SIZE),  // p_filesz
+    PACK8(filesz + ELF64_HEADER_SIZE),  // p_memsz
+    PACK8(0x1000),  // p_align
+  };
+  fwrite(ehdr, 64, 1, cur_emitter()->out);
+  fwrite(phdr, 56, 1, cur_emitter()->out);
+}
+
+int bulk_data_len(Data* data) {
+  int len = 0;
+  int num_nonzeros = 0;
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v) {
+      len = mp + 1;
+      num_nonzeros++;
+    }
+  }
+  if (!BULK_DATA_MIN || num_nonzeros < BULK_DATA_MIN)
+    return 0;
+  return len;
+}
+
+const char* format_data_hex(Data** data, int n) {
+  char* buf = format_alloc(n * 6 + 1);
+  cur_emitter()->num_formats++;
+  for (int i = 0; i < n; i++, *data = (*data)->next)
+    sprintf(buf + i * 6, "%06x", (*data)->v);
+  buf[n * 6] = 0;
+  return buf;
+}
+
+static const char kDigits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+const char* format_data_base64(Data** data, int n) {
+  char* buf = format_alloc((n * 4 + 2) / 3 * 4 + 1);
+  cur_emitter()->num_formats++;
+  char* p = buf;
+  // The bytes not yet encoded, up to 3, in the low bits of bits.
+  uint32_t bits = 0;
+  int num_bytes = 0;
+  for (int i = 0; i < n; i++, *data = (*data)->next) {
+    for (int j = 0; j < 4; j++) {
+      bits = bits << 8 | ((*data)->v >> (j * 8) & 255);
+      if (++num_bytes == 3) {
+        for (int k = 18; k >= 0; k -= 6)
+          *p++ = kDigits[bits >> k & 63];
+        bits = 0;
+        num_bytes = 0;
+      }
+    }
+  }
+  if (num_bytes) {
+    bits <<= (3 - num_bytes) * 8;
+    for (int k = 18; k >= 0; k -= 6)
+      *p++ = k >= 18 - num_bytes * 6 ? kDigits[bits >> k & 63] : '=';
+  }
+  *p = 0;
+  return buf;
+}
+
+const SrcLoc* set_src_loc(Inst* inst) {
+  Emitter* e = cur_emitter();
+  if (!e->src_module)
+    return NULL;
+  const SrcLoc* loc = find_src_loc(e->src_module, inst->lineno);
+  if (loc == e->cur_src_loc)
+    return NULL;
+  // Two .locs apart may name the same line.
+  bool same = (loc && e->cur_src_loc && loc->file == e->cur_src_loc->file &&
+               loc->line == e->cur_src_loc->line);
+  e->cur_src_loc = loc;
+  return same ? NULL : loc;
+}
+
+void clear_src_loc(void) {
+  cur_emitter()->cur_src_loc = NULL;
+}
+
+const char* src_file_name(const SrcLoc* loc) {
+  Module* m = cur_emitter()->src_module;
+  if (loc->file < 0 || loc->file >= m->num_src_files ||
+      !m->src_files[loc->file])
+    return "";
+  return m->src_files[loc->file];
+}
+
+// The "mappings" of a source map: a ';' per line, and for each mapped
+// line a segment of base64 VLQs, each relative to the previous one.
+// Lines are mapped as a whole, so the column is always 0.
+typedef struct SrcMap_ {
+  char* buf;
+  int len;
+  int cap;
+  // The lines the mappings have a ';' for, and the last segment.
+  int num_lines;
+  int file;
+  int line;
+} SrcMap;
+
+static void src_map_putc(SrcMap* m, char c) {
+  if (m->len == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 4096;
+    m->buf = realloc(m->buf, m->cap);
+  }
+  m->buf[m->len++] = c;
+}
+
+static void src_map_vlq(SrcMap* m, int v) {
+  unsigned int u = v < 0 ? (unsigned int)-v << 1 | 1 : (unsigned int)v << 1;
+  do {
+    int digit = u & 31;
+    u >>= 5;
+    src_map_putc(m, kDigits[digit | (u ? 32 : 0)]);
+  } while (u);
+}
+
+static void src_map_line(Emitter* e) {
+  SrcMap* m = e->src_map;
+  const SrcLoc* loc = e->cur_src_loc;
+  for (; m->num_lines < e->num_lines; m->num_lines++)
+    src_map_putc(m, ';');
+  src_map_vlq(m, 0);
+  src_map_vlq(m, loc->file - m->file);
+  src_map_vlq(m, loc->line - 1 - m->line);
+  src_map_vlq(m, 0);
+  m->file = loc->file;
+  m->line = loc->line - 1;
+}
+
+void start_src_map(void) {
+  Emitter* e = cur_emitter();
+  if (e->src_module)
+    e->src_map = calloc(1, sizeof(SrcMap));
+}
+
+static void json_str(SrcMap* j, const char* s) {
+  src_map_putc(j, '"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      src_map_putc(j, '\\');
+      src_map_putc(j, c);
+    } else if (c < 32) {
+      char b[8];
+      sprintf(b, "\\u%04x", c);
+      for (char* p = b; *p; p++)
+        src_map_putc(j, *p);
+    } else {
+      src_map_putc(j, c);
+    }
+  }
+  src_map_putc(j, '"');
+}
+
+static void json_raw(SrcMap* j, const char* s) {
+  for (; *s; s++)
+    src_map_putc(j, *s);
+}
+
+void emit_src_map_url(const char* prefix) {
+  Emitter* e = cur_emitter();
+  SrcMap* m = e->src_map;
+  if (!m)
+    return;
+  e->src_map = NULL;
+  src_map_putc(m, 0);
+
+  SrcMap json = {0};
+  json_raw(&json, "{\"version\":3,\"sources\":[");
+  Module* module = e->src_module;
+  for (int i = 0; i < module->num_src_files; i++) {
+    if (i)
+      src_map_putc(&json, ',');
+    json_str(&json, module->src_files[i] ? module->src_files[i] : "");
+  }
+  json_raw(&json, "],\"names\":[],\"mappings\":\"");
+  json_raw(&json, m->buf);
+  json_raw(&json, "\"}");
+
+  fprintf(e->out, "%ssourceMappingURL=data:application/json;base64,",
+          prefix);
+  for (int i = 0; i < json.len; i += 3) {
+    uint32_t bits = (unsigned char)json.buf[i] << 16;
+    if (i + 1 < json.len)
+      bits |= (unsigned char)json.buf[i + 1] << 8;
+    if (i + 2 < json.len)
+      bits |= (unsigned char)json.buf[i + 2];
+    for (int k = 0; k < 4; k++) {
+      bool pad = i + k - 1 >= json.len;
+      fputc(pad ? '=' : kDigits[bits >> (18 - k * 6) & 63], e->out);
+    }
+  }
+  fputc('\n', e->out);
+  e->num_lines++;
+  free(json.buf);
+  free(m->buf);
+  free(m);
+}
+
+int* indirect_jump_targets(Module* module, int* num_targets) {
+  int* targets = malloc(module->num_pcs * sizeof(int));
+  int n = 0;
+  for (int pc = 0; pc < module->num_pcs; pc++) {
+    if (!module->addr_taken || module->addr_taken[pc])
+      targets[n++] = pc;
+  }
+  *num_targets = n;
+  return targets;
 }
@@ -4,7 +4,9 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#include <ir/cfg.h>
 #include <ir/ir.h>
 
 typedef uint32_t uint;
@@ -12,9 +14,117 @@ typedef uint8_t byte;
 
 static const int ELF_TEXT_START = 0x100000;
 static const int ELF_HEADER_SIZE = 84;
+static const int ELF_DATA_HEADER_SIZE = 116;
+static const int ELF64_HEADER_SIZE = 120;
+
+// How the scripting backends hold the memory, chosen by -mem=. A full
+// one is allocated and zeroed up front; a sparse one holds only the
+// words written so far, and the others read as 0; a packed one is a
+// buffer of fixed-size words, smaller than a list of objects but slower
+// to index. Backends without a model use the full one.
+typedef enum {
+  MEM_FULL,
+  MEM_SPARSE,
+  MEM_PACKED
+} MemModel;
+
+
+// The state of writing one output: where it goes, the indentation,
+// the emit_1 counters and buffers, the pool of format(), and the
+// options backends read. Everything in this file works on the current
+// emitter of the calling thread, so threads which each set their own
+// can compile modules at once. A thread starts with a default emitter
+// writing to stdout.
+typedef struct {
+  FILE* out;
+  int indent;
+  int cnt;
+  bool started;
+  byte* buf;
+  // buf is the code buffer of emit_start_code.
+  bool code;
+  int code_len;
+  int code_cap;
+  int patch_end;
+  struct FormatBlock_* format_head;
+  struct FormatBlock_* format_cur;
+  // The format() calls so far, reported by elc -time.
+  long num_formats;
+  const char** reg_name_list;
+  int chunked_func_size;
+  MemModel mem_model;
+  int bulk_data_min;
+  // The entries of each pc in a run of eli --profile-out, loaded by
+  // -profile=, or NULL. pc_counts[pc] for pc < num_pc_counts.
+  long* pc_counts;
+  int num_pc_counts;
+  // The directory where emit_chunked_main_loop keeps the output of each
+  // function, keyed by its instructions and chunk_cache_salt, or NULL.
+  const char* chunk_cache_dir;
+  // Everything else the output depends on: the target and its options.
+  const char* chunk_cache_salt;
+  // The functions emit_chunked_main_loop took from chunk_cache_dir.
+  int num_cached_chunks;
+#ifndef __eir__
+  EIRStream* text_stream;
+#endif
+  // The module whose source locations the output is annotated with,
+  // set by elc -g, or NULL (see set_src_loc).
+  Module* src_module;
+  const SrcLoc* cur_src_loc;
+  // The lines emit_line wrote so far, and the source map of them which
+  // start_src_map began, or NULL.
+  int num_lines;
+  struct SrcMap_* src_map;
+  // The symbols of set_elf_symbols, or NULL.
+  struct ElfSymbols_* elf_syms;
+  // Appended by emit_line to each line but empty ones, comments, labels
+  // and the lines of tables (those starting with ';' or ' ', or ending
+  // with ':', '[' or ']'), or NULL.
+  const char* line_suffix;
+} Emitter;
+
+Emitter* emitter_new(FILE* out);
+void emitter_free(Emitter* e);
+Emitter* cur_emitter();
+// Makes e the current emitter of this thread, NULL for the default
+// one, and returns the previous one.
+Emitter* set_emitter(Emitter* e);
+
+// The register names value_str and friends print, set by backends
+// with their own naming.
+#define reg_names (cur_emitter()->reg_name_list)
+// The pcs per function of emit_chunked_main_loop, set by -chunk=.
+#define CHUNKED_FUNC_SIZE (cur_emitter()->chunked_func_size)
+// The MemModel of the scripting backends, set by -mem=.
+#define MEM_MODEL (cur_emitter()->mem_model)
+// The non-zero data words from which backends initialize the memory
+// from one packed literal instead of a statement per word, set by
+// -bulk-data=. 0 never does.
+#define BULK_DATA_MIN (cur_emitter()->bulk_data_min)
+
+// Writes to the output of the current emitter, for backends which
+// produce it a character or a fragment at a time.
+void emit_char(int c);
+void emit_str(const char* s);
+void emit_printf(const char* fmt, ...);
+void emit_vprintf(const char* fmt, va_list ap);
+
+// Strings returned by format() stay valid until a format_release with a
+// mark taken before they were made, e.g., per instruction:
+//
+//   FormatMark mark = format_mark();
+//   emit_inst(inst);
+//   format_release(mark);
+typedef struct {
+  void* block;
+  int used;
+} FormatMark;
 
 char* vformat(const char* fmt, va_list ap);
 char* format(const char* fmt, ...);
+FormatMark format_mark();
+void format_release(FormatMark m);
 
 #ifdef __GNUC__
 __attribute__((noreturn))
@@ -26,14 +136,35 @@ void dec_indent();
 void emit_line(const char* fmt, ...);
 
 Op normalize_cond(Op op, bool flip);
-extern const char** reg_names;
+// The name of r: reg_names[r], or "r<n>" for the virtual register Rn,
+// which only backends with VREG_BIT see.
+const char* reg_str(Reg r);
 const char* value_str(Value* v);
 const char* src_str(Inst* inst);
+// The address of a LOAD or STORE, with its disp, for backends with
+// MEM_DISP_BIT which index mem with a C-like expression.
+const char* mem_addr_str(Inst* inst);
+// The data word a LOAD or STORE marked global_var names, for backends
+// with GLOBAL_VAR_BIT (see find_global_vars in ir/opt.h).
+int global_var_addr(Inst* inst);
+// Emits fmt with the address and the initial value of each of those
+// words, once the backend's state is set up.
+void emit_global_var_inits(Module* module, const char* fmt);
 const char* cmp_str(Inst* inst, const char* true_str);
 
 int emit_cnt();
 void emit_reset();
 void emit_start();
+// Like emit_start, but writes bytes to buf instead of stdout.
+void emit_start_buffer(byte* buf);
+// Like emit_start, but appends bytes to a growable code buffer which
+// emit_flush then writes to stdout at once.
+void emit_start_code();
+void emit_flush();
+// Redirects emit_* to an earlier offset of the code buffer, where
+// emit_cnt() counts from, to back-patch code of a known size.
+void emit_patch_begin(int offset);
+void emit_patch_end();
 void emit_1(int a);
 void emit_2(int a, int b);
 void emit_3(int a, int b, int c);
@@ -43,7 +174,12 @@ void emit_6(int a, int b, int c, int d, int e, int f);
 void emit_le(uint32_t a);
 void emit_diff(uint32_t a, uint32_t b);
 
-extern int CHUNKED_FUNC_SIZE;
+
+// Calls emit_inst for each instruction, wrapping every
+// CHUNKED_FUNC_SIZE pcs in a function. Returns the number of functions.
+// With a chunk_cache_dir, a function whose instructions were emitted
+// before is copied from there instead, so the callbacks must not keep
+// state across functions.
 
 int emit_chunked_main_loop(Inst* inst,
                            void (*emit_func_prologue)(int func_id),
@@ -51,6 +187,82 @@ int emit_chunked_main_loop(Inst* inst,
                            void (*emit_pc_change)(int pc),
                            void (*emit_inst)(Inst* inst));
 
+// A split of the whole text into functions for backends which see the
+// CFG. Unlike the fixed pc / CHUNKED_FUNC_SIZE chunks, a function has
+// up to CHUNKED_FUNC_SIZE pcs and ends where the fewest jumps cross,
+// so a loop rarely spans two functions.
+typedef struct {
+  int num_funcs;
+  // The first pc of each function, and num_pcs after the last one.
+  int* starts;
+  // The function of each pc.
+  int* func_of_pc;
+  // The pcs at which a function is entered: its first pc, the targets
+  // of direct jumps from other functions and of jumps through a
+  // register.
+  bool* is_entry;
+} ChunkPlan;
+
+ChunkPlan* plan_chunks(CFG* cfg);
+
+// A rough upper bound of the bytes of JVM or CIL code for inst with
+// the registers in locals, for backends which keep methods under a
+// size their JIT compiles well.
+int estimate_bytecode_size(Inst* inst);
+
+#ifndef __eir__
+// Makes emit_chunked_main_loop read its instructions from s, one chunk
+// at a time, when it's given a NULL list.
+void set_text_stream(EIRStream* s);
+#endif
+
+// Returns the data words up to the last non-zero one if there are at
+// least BULK_DATA_MIN non-zero ones, or 0 if the data should be
+// initialized a word at a time.
+int bulk_data_len(Data* data);
+// Format the next n words of *data, advancing it. The hex form has 6
+// digits per word, as they are 24 bits. The base64 form is of 32-bit
+// little-endian words, and pieces of a multiple of 3 words concatenate
+// into the base64 of the whole.
+const char* format_data_hex(Data** data, int n);
+const char* format_data_base64(Data** data, int n);
+
+// Debug info for elc -g. set_src_loc makes the location of inst that
+// of the lines emitted from now on, and returns it if it changed, so a
+// backend can mark it, e.g., with #line. It returns NULL without -g.
+// clear_src_loc forgets it, so the next set_src_loc returns it again.
+const SrcLoc* set_src_loc(Inst* inst);
+void clear_src_loc(void);
+// The name of the .file of loc, "" if it has none.
+const char* src_file_name(const SrcLoc* loc);
+// Makes emit_line map each line to the location of set_src_loc in a
+// source map (version 3), which emit_src_map_url appends to the output
+// as an inline data: URL after prefix, e.g., "//# ". Nothing is done
+// without -g.
+void start_src_map(void);
+void emit_src_map_url(const char* prefix);
+
 void emit_elf_header(uint16_t machine, uint32_t filesz);
+// A header with a second, writable segment of mem_size bytes which the
+// kernel maps right after the text, from the last data_size bytes of
+// the output. Those must start at a page boundary of the file, and the
+// rest of the segment is demand-zero.
+void emit_elf_data_header(uint16_t machine, uint32_t filesz,
+                          uint32_t data_size, uint32_t mem_size);
+void emit_elf64_header(uint16_t machine, uint32_t filesz);
+
+// With elc -g, gives the next ELF header a .text section and a symbol
+// table, which emit_elf_sections then writes after the image. A symbol
+// is a function of pc_labels, which runs up to the next one, or
+// _start for the code before them. pc2addr
+// are the offsets of the pcs in the text, which starts at text_offset
+// of the file and is text_size bytes.
+void set_elf_symbols(Module* module, const int* pc2addr,
+                     uint32_t text_offset, uint32_t text_size);
+void emit_elf_sections(void);
+
+// The pcs a jump through a register may reach, in increasing order: the
+// ones whose address is taken, or all of them when that's unknown.
+int* indirect_jump_targets(Module* module, int* num_targets);
 
 #endif  // ELVM_UTIL_H_
@@ -1,38 +1,171 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Set by elc -vim9. Emits a vim9script whose chunks are compiled def
+// functions.
+bool VIM9_SCRIPT;
+
 static const char* REG_NAMES_VIM[] = {
+  "l:a", "l:b", "l:c", "l:d", "l:bp", "l:sp", "l:pc"
+};
+
+static const char* REG_NAMES_VIM9[] = {
+  "a", "b", "c", "d", "bp", "sp", "pc"
+};
+
+// The registers live in script variables between chunk functions, and
+// in locals of the function while it runs.
+static const char* SCRIPT_REG_NAMES_VIM[] = {
   "s:a", "s:b", "s:c", "s:d", "s:bp", "s:sp", "s:pc"
 };
 
+static const char* SCRIPT_REG_NAMES_VIM9[] = {
+  "ra", "rb", "rc", "rd", "rbp", "rsp", "rpc"
+};
+
+static const char* vim_let(void) {
+  return VIM9_SCRIPT ? "" : "let ";
+}
+
+static const char* vim_script_var(const char* name) {
+  return format("%s%s", VIM9_SCRIPT ? "" : "s:", name);
+}
+
+static const char** vim_script_regs(void) {
+  return VIM9_SCRIPT ? SCRIPT_REG_NAMES_VIM9 : SCRIPT_REG_NAMES_VIM;
+}
+
+// The index of the first of the 3 bytes of a word in the blob of
+// -mem=packed.
+static const char* vim_blob_index(Inst* inst, int byte) {
+  if (inst->src.type == IMM)
+    return format("%d", inst->src.imm * 3 + byte);
+  if (byte)
+    return format("3 * %s + %d", src_str(inst), byte);
+  return format("3 * %s", src_str(inst));
+}
+
+static void vim_emit_packed_data(Data* data) {
+  const char* mem = vim_script_var("mem");
+  emit_line("%s%s = 0z", vim_let(), VIM9_SCRIPT ? "var mem" : mem);
+  int n = 0;
+  while (data) {
+    emit_printf("%s%s += 0z", vim_let(), mem);
+    for (int i = 0; data && i < 256; data = data->next, i++, n++) {
+      emit_printf("%06x", data->v & 0xffffff);
+    }
+    emit_char('\n');
+  }
+  emit_line("%s%s += repeat(0z00, 3 * %d)", vim_let(), mem, (1 << 24) - n);
+}
+
+static void vim_emit_flush_output(void) {
+  // Cuts the output into lines and converts each of them with one
+  // join. Note that Vim treats Nul characters with NL (0xa) in a Vim
+  // buffer.
+  emit_line("");
+  if (VIM9_SCRIPT) {
+    emit_line("def FlushOutput()");
+    inc_indent();
+    emit_line("var lines: list<string> = []");
+    emit_line("var i = 0");
+    emit_line("while true");
+    inc_indent();
+    emit_line("var j = index(output, 10, i)");
+    emit_line("var line = j < 0 ? output[i :] : output[i : j]");
+    emit_line("lines->add(join(mapnew(line, (_, v) => "
+              "v == 10 ? '' : nr2char(v == 0 ? 10 : v)), ''))");
+  } else {
+    emit_line("function! FlushOutput()");
+    inc_indent();
+    emit_line("let l:lines = []");
+    emit_line("let l:i = 0");
+    emit_line("while 1");
+    inc_indent();
+    emit_line("let l:j = index(s:output, 10, l:i)");
+    emit_line("let l:line = l:j < 0 ? s:output[l:i :] : "
+              "s:output[l:i : l:j]");
+    emit_line("call add(l:lines, join(map(l:line, "
+              "'v:val == 10 ? \"\" : nr2char(v:val == 0 ? 10 : v:val)'), ''))");
+  }
+  emit_line("if %s < 0", VIM9_SCRIPT ? "j" : "l:j");
+  inc_indent();
+  emit_line("break");
+  dec_indent();
+  emit_line("endif");
+  emit_line("%s%s = %s + 1", vim_let(), VIM9_SCRIPT ? "i" : "l:i",
+            VIM9_SCRIPT ? "j" : "l:j");
+  dec_indent();
+  emit_line("endwhile");
+  // Vim represents Nul character with NL (0xa) and represents newline
+  // with CR. Converted NL and CR will be automatically replaced on
+  // saving the buffer to a file on binary mode.
+  emit_line("%ssetline(1, %s)", VIM9_SCRIPT ? "" : "call ",
+            VIM9_SCRIPT ? "lines" : "l:lines");
+  dec_indent();
+  emit_line(VIM9_SCRIPT ? "enddef" : "endfunction");
+}
+
 static void init_state_vim(Data* data) {
-  reg_names = REG_NAMES_VIM;
+  reg_names = VIM9_SCRIPT ? REG_NAMES_VIM9 : REG_NAMES_VIM;
+  if (VIM9_SCRIPT)
+    emit_line("vim9script");
+  const char** regs = vim_script_regs();
   for (int i = 0; i < 7; i++) {
-    emit_line("let %s = 0", reg_names[i]);
+    emit_line("%s%s = 0", VIM9_SCRIPT ? "var " : "let ", regs[i]);
   }
-  emit_line("let s:mem = repeat([0], 16777216)");
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("let s:mem[%d] = %d", mp, data->v);
+  const char* decl = VIM9_SCRIPT ? "var " : "let ";
+  const char* mem = vim_script_var("mem");
+  if (MEM_MODEL == MEM_PACKED) {
+    vim_emit_packed_data(data);
+  } else {
+    if (MEM_MODEL == MEM_SPARSE) {
+      emit_line("%s%s = {}", decl,
+                VIM9_SCRIPT ? "mem: dict<number>" : mem);
+    } else {
+      emit_line("%s%s = repeat([0], 16777216)", decl, mem);
+    }
+    for (int mp = 0; data; data = data->next, mp++) {
+      if (data->v) {
+        emit_line("%s%s[%d] = %d", vim_let(), mem, mp, data->v);
+      }
     }
   }
 
   // Assumes that all stdin input is put in the current buffer.
   // Load it to s:input list at first.
-  emit_line("let s:input = map(split(join(getline(1, '$'), \"\\n\"), '\\zs'), 'char2nr(v:val)')");
-  emit_line("let s:ic = 0");
-  emit_line("let s:output = []");
+  if (VIM9_SCRIPT) {
+    emit_line("var input = split(join(getline(1, '$'), \"\\n\"), '\\zs')"
+              "->mapnew((_, v) => char2nr(v))");
+    emit_line("var ic = 0");
+    emit_line("var output: list<number> = []");
+  } else {
+    emit_line("let s:input = map(split(join(getline(1, '$'), \"\\n\"), '\\zs'), 'char2nr(v:val)')");
+    emit_line("let s:ic = 0");
+    emit_line("let s:output = []");
+  }
 
   // After loading input to s:input, delete entire buffer to output the result.
   emit_line("normal! dG");
+
+  vim_emit_flush_output();
 }
 
 static void vim_emit_func_prologue(int func_id) {
   emit_line("");
-  emit_line("function! Func%d()", func_id);
+  if (VIM9_SCRIPT)
+    emit_line("def Func%d(): bool", func_id);
+  else
+    emit_line("function! Func%d()", func_id);
   inc_indent();
-  emit_line("while %d <= s:pc && s:pc < %d",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+  const char** regs = vim_script_regs();
+  for (int i = 0; i < 7; i++) {
+    emit_line("%s %s = %s", VIM9_SCRIPT ? "var" : "let",
+              reg_names[i], regs[i]);
+  }
+  emit_line("while %d <= %s && %s < %d",
+            func_id * CHUNKED_FUNC_SIZE, reg_names[SP + 1],
+            reg_names[SP + 1], (func_id + 1) * CHUNKED_FUNC_SIZE);
   inc_indent();
   emit_line("if 0");
   inc_indent();
@@ -41,58 +174,93 @@ static void vim_emit_func_prologue(int func_id) {
 static void vim_emit_func_epilogue(void) {
   dec_indent();
   emit_line("endif");
-  emit_line("let s:pc += 1");
+  emit_line("%s%s += 1", vim_let(), reg_names[SP + 1]);
   dec_indent();
   emit_line("endwhile");
+  const char** regs = vim_script_regs();
+  for (int i = 0; i < 7; i++) {
+    emit_line("%s%s = %s", vim_let(), regs[i], reg_names[i]);
+  }
+  if (VIM9_SCRIPT)
+    emit_line("return false");
   dec_indent();
-  emit_line("endfunction");
+  emit_line(VIM9_SCRIPT ? "enddef" : "endfunction");
 }
 
 static void vim_emit_pc_change(int pc) {
   emit_line("");
   dec_indent();
-  emit_line("elseif s:pc == %d", pc);
+  emit_line("elseif %s == %d", reg_names[SP + 1], pc);
   inc_indent();
 }
 
 static void vim_emit_inst(Inst* inst) {
+  const char* let = vim_let();
+  const char* mem = vim_script_var("mem");
   switch (inst->op) {
   case MOV:
-    emit_line("let %s = %s", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s%s = %s", let, reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case ADD:
-    emit_line("let %s = and((%s + %s), " UINT_MAX_STR ")",
+    emit_line("%s%s = and((%s + %s), " UINT_MAX_STR ")", let,
               reg_names[inst->dst.reg],
               reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case SUB:
-    emit_line("let %s = and((%s - %s), " UINT_MAX_STR ")",
+    emit_line("%s%s = and((%s - %s), " UINT_MAX_STR ")", let,
               reg_names[inst->dst.reg],
               reg_names[inst->dst.reg], src_str(inst));
     break;
 
   case LOAD:
-    emit_line("let %s = s:mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    if (MEM_MODEL == MEM_SPARSE) {
+      emit_line("%s%s = get(%s, %s, 0)", let,
+                reg_names[inst->dst.reg], mem, src_str(inst));
+    } else if (MEM_MODEL == MEM_PACKED) {
+      emit_line("%s%s = %s[%s] * 65536 + %s[%s] * 256 + %s[%s]", let,
+                reg_names[inst->dst.reg], mem, vim_blob_index(inst, 0),
+                mem, vim_blob_index(inst, 1), mem, vim_blob_index(inst, 2));
+    } else {
+      emit_line("%s%s = %s[%s]", let,
+                reg_names[inst->dst.reg], mem, src_str(inst));
+    }
     break;
 
   case STORE:
-    emit_line("let s:mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    if (MEM_MODEL == MEM_PACKED) {
+      const char* v = reg_names[inst->dst.reg];
+      emit_line("%s%s[%s] = %s / 65536", let, mem,
+                vim_blob_index(inst, 0), v);
+      emit_line("%s%s[%s] = and(%s / 256, 255)", let, mem,
+                vim_blob_index(inst, 1), v);
+      emit_line("%s%s[%s] = and(%s, 255)", let, mem,
+                vim_blob_index(inst, 2), v);
+    } else {
+      emit_line("%s%s[%s] = %s", let, mem,
+                src_str(inst), reg_names[inst->dst.reg]);
+    }
     break;
 
   case PUTC:
     // :echon is not available because it can't output invisible characters such as Nul.
     // So we save the output to s:output and will output it to the current buffer later.
-    emit_line("let s:output += [%s]", src_str(inst));
+    if (VIM9_SCRIPT)
+      emit_line("output->add(%s)", src_str(inst));
+    else
+      emit_line("call add(s:output, %s)", src_str(inst));
     break;
 
   case GETC:
     // getchar() is not available because Vim finishes to run script when stdin reaches to EOF
     // on calling getchar().  To emulate standard getc() behavior, we save the stdin input to
     // s:input at first, then load a character from it.
-    emit_line("let %s = len(s:input) <= s:ic ? 0 : s:input[s:ic]", reg_names[inst->dst.reg]);
-    emit_line("let s:ic += 1");
+    emit_line("%s%s = len(%s) <= %s ? 0 : %s[%s]", let,
+              reg_names[inst->dst.reg], vim_script_var("input"),
+              vim_script_var("ic"), vim_script_var("input"),
+              vim_script_var("ic"));
+    emit_line("%s%s += 1", let, vim_script_var("ic"));
     break;
 
   case EXIT:
@@ -100,33 +268,21 @@ static void vim_emit_inst(Inst* inst) {
     // We can't use :quit here because buffer is not saved yet.
     // And we can't use :finish because script can't be terminated by finish from external
     // input (please see `:help E168`).
-    emit_line("if len(s:output) == 0 | return 1 | endif");
-
-    // Convert the list of characters to list of line strings here.
-    emit_line("let s:lines = ['']");
-    emit_line("for s:ch in s:output");
-    inc_indent();
-    emit_line("if s:ch == 10");
+    // The if keeps a vim9 def from rejecting code after the return.
+    emit_line("if !empty(%s)", vim_script_var("output"));
     inc_indent();
-    emit_line("let s:lines += ['']");
-    dec_indent();
-    emit_line("else");
-    inc_indent();
-    // Note that Vim treats Nul characters with NL (0xa) in a Vim buffer.
-    // So we need to care about it on coverting a character code to a string.
-    emit_line("let s:lines[len(s:lines)-1] .= nr2char(s:ch == 0 ? 10 : s:ch)");
+    emit_line("%sFlushOutput()", VIM9_SCRIPT ? "" : "call ");
     dec_indent();
     emit_line("endif");
-    emit_line("unlet s:ch");
-    dec_indent();
-    emit_line("endfor");
-
-    // Finally writes the result to the current buffer.
-    // Vim represents Nul character with NL (0xa) and represents newline with CR.
-    // Converted NL and CR will be automatically replaced on saving the buffer to
-    // a file on binary mode.
-    emit_line("call setline(1, s:lines)");
-    emit_line("return 1");
+    if (VIM9_SCRIPT) {
+      emit_line("if true");
+      inc_indent();
+      emit_line("return true");
+      dec_indent();
+      emit_line("endif");
+    } else {
+      emit_line("return 1");
+    }
     break;
 
   case DUMP:
@@ -138,7 +294,7 @@ static void vim_emit_inst(Inst* inst) {
   case GT:
   case LE:
   case GE:
-    emit_line("let %s = %s ? 1 : 0",
+    emit_line("%s%s = %s ? 1 : 0", let,
               reg_names[inst->dst.reg], cmp_str(inst, "1"));
     break;
 
@@ -151,7 +307,7 @@ static void vim_emit_inst(Inst* inst) {
   case JMP:
     emit_line("if %s", cmp_str(inst, "1"));
     inc_indent();
-    emit_line("let s:pc = %s - 1", value_str(&inst->jmp));
+    emit_line("%s%s = %s - 1", let, reg_names[SP + 1], value_str(&inst->jmp));
     dec_indent();
     emit_line("endif");
     break;
@@ -171,18 +327,36 @@ void target_vim(Module* module) {
                                          vim_emit_pc_change,
                                          vim_emit_inst);
 
+  // A list of the functions, so leaving one costs an index, not a
+  // comparison per function.
+  const char* pc = vim_script_regs()[SP + 1];
+  const char* funcs = vim_script_var("funcs");
   emit_line("");
-  emit_line("while 1");
-  inc_indent();
-  emit_line("if 0");
+  emit_line("%s%s = [", VIM9_SCRIPT ? "var " : "let ", funcs);
   for (int i = 0; i < num_funcs; i++) {
-    emit_line("elseif s:pc < %d", (i + 1) * CHUNKED_FUNC_SIZE);
+    if (VIM9_SCRIPT)
+      emit_line("  Func%d,", i);
+    else
+      emit_line("      \\ function('Func%d'),", i);
+  }
+  emit_line(VIM9_SCRIPT ? "]" : "      \\ ]");
+  if (VIM9_SCRIPT) {
+    emit_line("def Main()");
     inc_indent();
-    // Func%d() returns 1 if the program exited or not (otherwise returns 0).
-    emit_line("if Func%d() | break | endif", i);
-    dec_indent();
   }
+  emit_line("while 1");
+  inc_indent();
+  // Func%d() returns 1 if the program exited or not (otherwise returns 0).
+  emit_line("if %s[%s / %d]()", funcs, pc, CHUNKED_FUNC_SIZE);
+  inc_indent();
+  emit_line("break");
+  dec_indent();
   emit_line("endif");
   dec_indent();
   emit_line("endwhile");
+  if (VIM9_SCRIPT) {
+    dec_indent();
+    emit_line("enddef");
+    emit_line("Main()");
+  }
 }
@@ -0,0 +1,664 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/cfg.h>
+#include <ir/ir.h>
+#include <target/util.h>
+
+// Emits a WebAssembly module, embedded in a JS loader which provides
+// putchar and getchar in the same way as the js backend.
+//
+// Every function of plan_chunks is a loop around a br_table on pc over
+// one block per pc, so a forward jump within the function is a plain
+// br and anything else sets pc and goes through the br_table. The
+// registers are locals which are copied from and to globals.
+//
+// Memory is mapped with the top WASM_STACK_WORDS words, where the
+// stack grows down from address 0, in front of the data, and linear
+// memory starts from the data and the stack and grows when an access
+// goes past it, instead of reserving 64MB.
+
+#define WASM_STACK_WORDS (1 << 16)
+#define WASM_PAGE_WORDS 16384
+#define WASM_MAX_PAGES 1024
+
+enum {
+  WASM_BLOCK = 0x02, WASM_LOOP = 0x03, WASM_IF = 0x04, WASM_ELSE = 0x05,
+  WASM_END = 0x0b, WASM_BR = 0x0c, WASM_BR_IF = 0x0d,
+  WASM_BR_TABLE = 0x0e, WASM_CALL = 0x10, WASM_SELECT = 0x1b,
+  WASM_UNREACHABLE = 0x00,
+  WASM_LOCAL_GET = 0x20, WASM_LOCAL_SET = 0x21, WASM_LOCAL_TEE = 0x22,
+  WASM_GLOBAL_GET = 0x23, WASM_GLOBAL_SET = 0x24,
+  WASM_I32_LOAD = 0x28, WASM_I32_STORE = 0x36,
+  WASM_MEMORY_SIZE = 0x3f, WASM_MEMORY_GROW = 0x40,
+  WASM_I32_CONST = 0x41, WASM_I32_EQZ = 0x45,
+  WASM_I32_EQ = 0x46, WASM_I32_NE = 0x47, WASM_I32_LT_U = 0x49,
+  WASM_I32_GT_U = 0x4b, WASM_I32_LE_U = 0x4d, WASM_I32_GE_U = 0x4f,
+  WASM_I32_ADD = 0x6a, WASM_I32_SUB = 0x6b, WASM_I32_MUL = 0x6c,
+  WASM_I32_DIV_U = 0x6e, WASM_I32_REM_U = 0x70, WASM_I32_AND = 0x71,
+  WASM_I32_OR = 0x72, WASM_I32_XOR = 0x73, WASM_I32_SHL = 0x74,
+  WASM_I32_SHR_U = 0x76,
+  WASM_VOID = 0x40, WASM_TYPE_I32 = 0x7f,
+};
+
+// Function indices: the imports come first.
+enum {
+  WASM_FUNC_PUTCHAR, WASM_FUNC_GETCHAR, WASM_FUNC_GROW, WASM_FUNC_MAIN,
+  WASM_FUNC_CHUNK0
+};
+
+// Globals: the registers, then these.
+enum {
+  WASM_GLOBAL_PC = 6, WASM_GLOBAL_RUNNING, WASM_GLOBAL_LIMIT
+};
+
+// Locals of the chunk functions: the registers and pc, then a temporary.
+#define WASM_LOCAL_PC 6
+#define WASM_LOCAL_TMP 7
+
+typedef struct {
+  byte* buf;
+  int len;
+  int cap;
+} WasmBuf;
+
+static void wasm_byte(WasmBuf* b, int v) {
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 256;
+    b->buf = realloc(b->buf, b->cap);
+  }
+  b->buf[b->len++] = v;
+}
+
+static void wasm_uleb(WasmBuf* b, uint v) {
+  do {
+    int c = v & 0x7f;
+    v >>= 7;
+    wasm_byte(b, v ? c | 0x80 : c);
+  } while (v);
+}
+
+static void wasm_sleb(WasmBuf* b, int v) {
+  for (;;) {
+    int c = v & 0x7f;
+    v >>= 7;
+    if ((v == 0 && !(c & 0x40)) || (v == -1 && (c & 0x40))) {
+      wasm_byte(b, c);
+      return;
+    }
+    wasm_byte(b, c | 0x80);
+  }
+}
+
+static void wasm_name(WasmBuf* b, const char* s) {
+  wasm_uleb(b, strlen(s));
+  for (; *s; s++)
+    wasm_byte(b, *s);
+}
+
+// Appends src with its size in front.
+static void wasm_sized(WasmBuf* b, WasmBuf* src) {
+  wasm_uleb(b, src->len);
+  for (int i = 0; i < src->len; i++)
+    wasm_byte(b, src->buf[i]);
+  src->len = 0;
+}
+
+static void wasm_section(WasmBuf* out, int id, WasmBuf* body) {
+  wasm_byte(out, id);
+  wasm_sized(out, body);
+}
+
+static void wasm_op1(WasmBuf* b, int op, int arg) {
+  wasm_byte(b, op);
+  wasm_uleb(b, arg);
+}
+
+static void wasm_const(WasmBuf* b, int v) {
+  wasm_byte(b, WASM_I32_CONST);
+  wasm_sleb(b, v);
+}
+
+static void wasm_mem_op(WasmBuf* b, int op) {
+  wasm_byte(b, op);
+  wasm_uleb(b, 2);  // align
+  wasm_uleb(b, 0);  // offset
+}
+
+// The state of the chunk function being emitted.
+static WasmBuf* g_code;
+static ChunkPlan* g_wasm_plan;
+static int g_wasm_func_id;
+static int g_wasm_case;
+static int g_wasm_num_cases;
+
+// Branch depths from the code of the current pc.
+static int wasm_depth_of_case(int pc) {
+  return pc - g_wasm_plan->starts[g_wasm_func_id] - g_wasm_case - 1;
+}
+
+static int wasm_depth_of_loop(void) {
+  return g_wasm_num_cases - 1 - g_wasm_case;
+}
+
+static int wasm_depth_of_leave(void) {
+  return g_wasm_num_cases - g_wasm_case;
+}
+
+static void wasm_emit_value(Value* v) {
+  if (v->type == REG)
+    wasm_op1(g_code, WASM_LOCAL_GET, v->reg);
+  else
+    wasm_const(g_code, v->imm);
+}
+
+static void wasm_emit_mask(void) {
+  wasm_const(g_code, UINT_MAX);
+  wasm_byte(g_code, WASM_I32_AND);
+}
+
+// Leaves the byte offset of the word at the address on the stack.
+static void wasm_emit_addr(Value* v) {
+  wasm_emit_value(v);
+  wasm_const(g_code, WASM_STACK_WORDS);
+  wasm_byte(g_code, WASM_I32_ADD);
+  wasm_emit_mask();
+  wasm_op1(g_code, WASM_LOCAL_TEE, WASM_LOCAL_TMP);
+  wasm_op1(g_code, WASM_GLOBAL_GET, WASM_GLOBAL_LIMIT);
+  wasm_byte(g_code, WASM_I32_GE_U);
+  wasm_byte(g_code, WASM_IF);
+  wasm_byte(g_code, WASM_VOID);
+  wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+  wasm_op1(g_code, WASM_CALL, WASM_FUNC_GROW);
+  wasm_byte(g_code, WASM_END);
+  wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+  wasm_const(g_code, 2);
+  wasm_byte(g_code, WASM_I32_SHL);
+}
+
+static int wasm_cmp_op(Inst* inst) {
+  switch (normalize_cond(inst->op, false)) {
+  case JEQ: return WASM_I32_EQ;
+  case JNE: return WASM_I32_NE;
+  case JLT: return WASM_I32_LT_U;
+  case JGT: return WASM_I32_GT_U;
+  case JLE: return WASM_I32_LE_U;
+  case JGE: return WASM_I32_GE_U;
+  default:
+    error("oops");
+  }
+}
+
+static void wasm_emit_cmp(Inst* inst) {
+  wasm_op1(g_code, WASM_LOCAL_GET, inst->dst.reg);
+  wasm_emit_value(&inst->src);
+  wasm_byte(g_code, wasm_cmp_op(inst));
+}
+
+// Emits dst = op(dst, tmp) where src was stored in tmp, e.g., guarded
+// division.
+static void wasm_emit_ext(Inst* inst) {
+  int d = inst->dst.reg;
+  wasm_emit_value(&inst->src);
+  wasm_op1(g_code, WASM_LOCAL_SET, WASM_LOCAL_TMP);
+  wasm_op1(g_code, WASM_LOCAL_GET, d);
+  switch (inst->op) {
+  case MUL:
+  case AND:
+  case OR:
+  case XOR:
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_byte(g_code, (inst->op == MUL ? WASM_I32_MUL :
+                       inst->op == AND ? WASM_I32_AND :
+                       inst->op == OR ? WASM_I32_OR : WASM_I32_XOR));
+    if (inst->op == MUL)
+      wasm_emit_mask();
+    break;
+
+  case DIV:
+  case MOD:
+    // dst / (tmp ? tmp : 1), then the result for zero.
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_const(g_code, 1);
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_byte(g_code, WASM_SELECT);
+    wasm_byte(g_code, inst->op == DIV ? WASM_I32_DIV_U : WASM_I32_REM_U);
+    if (inst->op == DIV)
+      wasm_const(g_code, UINT_MAX);
+    else
+      wasm_op1(g_code, WASM_LOCAL_GET, d);
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_byte(g_code, WASM_SELECT);
+    break;
+
+  case SHL:
+  case SHR:
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_byte(g_code, inst->op == SHL ? WASM_I32_SHL : WASM_I32_SHR_U);
+    wasm_emit_mask();
+    wasm_const(g_code, 0);
+    wasm_op1(g_code, WASM_LOCAL_GET, WASM_LOCAL_TMP);
+    wasm_const(g_code, 24);
+    wasm_byte(g_code, WASM_I32_LT_U);
+    wasm_byte(g_code, WASM_SELECT);
+    break;
+
+  default:
+    error("oops");
+  }
+  wasm_op1(g_code, WASM_LOCAL_SET, d);
+}
+
+static bool wasm_is_forward(Value* jmp) {
+  if (jmp->type != IMM)
+    return false;
+  int pc = jmp->imm;
+  int cur = g_wasm_plan->starts[g_wasm_func_id] + g_wasm_case;
+  return (pc > cur && pc < g_wasm_plan->starts[g_wasm_func_id + 1]);
+}
+
+// Sets pc and goes to the br_table, from extra blocks deep.
+static void wasm_emit_dispatch(Value* jmp, int extra) {
+  wasm_emit_value(jmp);
+  wasm_op1(g_code, WASM_LOCAL_SET, WASM_LOCAL_PC);
+  wasm_op1(g_code, WASM_BR, wasm_depth_of_loop() + extra);
+}
+
+static void wasm_emit_jmp(Inst* inst) {
+  bool forward = wasm_is_forward(&inst->jmp);
+  if (inst->op == JMP) {
+    if (forward)
+      wasm_op1(g_code, WASM_BR, wasm_depth_of_case(inst->jmp.imm));
+    else
+      wasm_emit_dispatch(&inst->jmp, 0);
+    return;
+  }
+
+  wasm_emit_cmp(inst);
+  if (forward) {
+    wasm_op1(g_code, WASM_BR_IF, wasm_depth_of_case(inst->jmp.imm));
+  } else {
+    wasm_byte(g_code, WASM_IF);
+    wasm_byte(g_code, WASM_VOID);
+    wasm_emit_dispatch(&inst->jmp, 1);
+    wasm_byte(g_code, WASM_END);
+  }
+}
+
+static void wasm_emit_inst(Inst* inst) {
+  int d = inst->dst.reg;
+  switch (inst->op) {
+  case MOV:
+    wasm_emit_value(&inst->src);
+    wasm_op1(g_code, WASM_LOCAL_SET, d);
+    break;
+
+  case ADD:
+  case SUB:
+    wasm_op1(g_code, WASM_LOCAL_GET, d);
+    wasm_emit_value(&inst->src);
+    wasm_byte(g_code, inst->op == ADD ? WASM_I32_ADD : WASM_I32_SUB);
+    wasm_emit_mask();
+    wasm_op1(g_code, WASM_LOCAL_SET, d);
+    break;
+
+  case LOAD:
+    wasm_emit_addr(&inst->src);
+    wasm_mem_op(g_code, WASM_I32_LOAD);
+    wasm_op1(g_code, WASM_LOCAL_SET, d);
+    break;
+
+  case STORE:
+    wasm_emit_addr(&inst->src);
+    wasm_op1(g_code, WASM_LOCAL_GET, d);
+    wasm_mem_op(g_code, WASM_I32_STORE);
+    break;
+
+  case PUTC:
+    wasm_emit_value(&inst->src);
+    wasm_op1(g_code, WASM_CALL, WASM_FUNC_PUTCHAR);
+    break;
+
+  case GETC:
+    wasm_op1(g_code, WASM_CALL, WASM_FUNC_GETCHAR);
+    wasm_op1(g_code, WASM_LOCAL_SET, d);
+    break;
+
+  case EXIT:
+    wasm_const(g_code, 0);
+    wasm_op1(g_code, WASM_GLOBAL_SET, WASM_GLOBAL_RUNNING);
+    wasm_op1(g_code, WASM_BR, wasm_depth_of_leave());
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    wasm_emit_cmp(inst);
+    wasm_op1(g_code, WASM_LOCAL_SET, d);
+    break;
+
+  case MUL:
+  case DIV:
+  case MOD:
+  case AND:
+  case OR:
+  case XOR:
+  case SHL:
+  case SHR:
+    wasm_emit_ext(inst);
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP:
+    wasm_emit_jmp(inst);
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
+static void wasm_emit_chunk(Module* m, int func_id, WasmBuf* body) {
+  int start = g_wasm_plan->starts[func_id];
+  int end = g_wasm_plan->starts[func_id + 1];
+  int n = end - start;
+  g_code = body;
+  g_wasm_func_id = func_id;
+  g_wasm_num_cases = n;
+
+  // (local i32 x 8)
+  wasm_uleb(body, 1);
+  wasm_uleb(body, WASM_LOCAL_TMP + 1);
+  wasm_byte(body, WASM_TYPE_I32);
+  for (int i = 0; i < 7; i++) {
+    wasm_op1(body, WASM_GLOBAL_GET, i);
+    wasm_op1(body, WASM_LOCAL_SET, i);
+  }
+
+  wasm_byte(body, WASM_BLOCK);
+  wasm_byte(body, WASM_VOID);
+  wasm_byte(body, WASM_LOOP);
+  wasm_byte(body, WASM_VOID);
+  for (int i = 0; i < n; i++) {
+    wasm_byte(body, WASM_BLOCK);
+    wasm_byte(body, WASM_VOID);
+  }
+  wasm_op1(body, WASM_LOCAL_GET, WASM_LOCAL_PC);
+  wasm_const(body, start);
+  wasm_byte(body, WASM_I32_SUB);
+  wasm_byte(body, WASM_BR_TABLE);
+  wasm_uleb(body, n);
+  for (int i = 0; i < n; i++)
+    wasm_uleb(body, i);
+  wasm_uleb(body, n + 1);
+
+  for (int i = 0; i < n; i++) {
+    wasm_byte(body, WASM_END);
+    g_wasm_case = i;
+    Inst* inst = &m->text[m->pc_starts[start + i]];
+    for (int j = 0; j < m->pc_lens[start + i]; j++, inst++)
+      wasm_emit_inst(inst);
+  }
+  wasm_const(body, end);
+  wasm_op1(body, WASM_LOCAL_SET, WASM_LOCAL_PC);
+  wasm_byte(body, WASM_END);  // loop
+  wasm_byte(body, WASM_END);  // block
+
+  for (int i = 0; i < 7; i++) {
+    wasm_op1(body, WASM_LOCAL_GET, i);
+    wasm_op1(body, WASM_GLOBAL_SET, i);
+  }
+  wasm_byte(body, WASM_END);
+}
+
+// grow(p) makes word p accessible.
+static void wasm_emit_grow(WasmBuf* body) {
+  wasm_uleb(body, 0);
+  wasm_op1(body, WASM_LOCAL_GET, 0);
+  wasm_const(body, WASM_PAGE_WORDS);
+  wasm_byte(body, WASM_I32_ADD);
+  wasm_const(body, 14);
+  wasm_byte(body, WASM_I32_SHR_U);
+  wasm_op1(body, WASM_MEMORY_SIZE, 0);
+  wasm_byte(body, WASM_I32_SUB);
+  wasm_op1(body, WASM_MEMORY_GROW, 0);
+  wasm_const(body, -1);
+  wasm_byte(body, WASM_I32_EQ);
+  wasm_byte(body, WASM_IF);
+  wasm_byte(body, WASM_VOID);
+  wasm_byte(body, WASM_UNREACHABLE);
+  wasm_byte(body, WASM_END);
+  wasm_op1(body, WASM_MEMORY_SIZE, 0);
+  wasm_const(body, 14);
+  wasm_byte(body, WASM_I32_SHL);
+  wasm_op1(body, WASM_GLOBAL_SET, WASM_GLOBAL_LIMIT);
+  wasm_byte(body, WASM_END);
+}
+
+// Calls the function of pc by a binary search over functions lo to hi.
+static void wasm_emit_call(WasmBuf* body, int lo, int hi) {
+  if (lo + 1 == hi) {
+    wasm_op1(body, WASM_CALL, WASM_FUNC_CHUNK0 + lo);
+    return;
+  }
+  int mid = (lo + hi) / 2;
+  wasm_op1(body, WASM_GLOBAL_GET, WASM_GLOBAL_PC);
+  wasm_const(body, g_wasm_plan->starts[mid]);
+  wasm_byte(body, WASM_I32_LT_U);
+  wasm_byte(body, WASM_IF);
+  wasm_byte(body, WASM_VOID);
+  wasm_emit_call(body, lo, mid);
+  wasm_byte(body, WASM_ELSE);
+  wasm_emit_call(body, mid, hi);
+  wasm_byte(body, WASM_END);
+}
+
+static void wasm_emit_main(Module* m, WasmBuf* body) {
+  wasm_uleb(body, 0);
+  wasm_byte(body, WASM_BLOCK);
+  wasm_byte(body, WASM_VOID);
+  wasm_byte(body, WASM_LOOP);
+  wasm_byte(body, WASM_VOID);
+  wasm_op1(body, WASM_GLOBAL_GET, WASM_GLOBAL_RUNNING);
+  wasm_byte(body, WASM_I32_EQZ);
+  wasm_op1(body, WASM_BR_IF, 1);
+  // A jump to an invalid pc traps.
+  wasm_op1(body, WASM_GLOBAL_GET, WASM_GLOBAL_PC);
+  wasm_const(body, m->num_pcs);
+  wasm_byte(body, WASM_I32_GE_U);
+  wasm_byte(body, WASM_IF);
+  wasm_byte(body, WASM_VOID);
+  wasm_byte(body, WASM_UNREACHABLE);
+  wasm_byte(body, WASM_END);
+  if (g_wasm_plan->num_funcs)
+    wasm_emit_call(body, 0, g_wasm_plan->num_funcs);
+  wasm_op1(body, WASM_BR, 0);
+  wasm_byte(body, WASM_END);
+  wasm_byte(body, WASM_END);
+  wasm_byte(body, WASM_END);
+}
+
+static void wasm_emit_module(Module* m, WasmBuf* out) {
+  WasmBuf sec = {0}, body = {0};
+  int num_funcs = g_wasm_plan->num_funcs;
+
+  int num_data = 0, data_len = 0;
+  for (Data* d = m->data; d; d = d->next) {
+    num_data++;
+    if (d->v)
+      data_len = num_data;
+  }
+  int pages = ((WASM_STACK_WORDS + num_data + WASM_PAGE_WORDS) /
+               WASM_PAGE_WORDS);
+
+  static const byte header[8] = { 0, 'a', 's', 'm', 1, 0, 0, 0 };
+  for (int i = 0; i < 8; i++)
+    wasm_byte(out, header[i]);
+
+  // Types: () -> (), (i32) -> () and () -> i32.
+  wasm_uleb(&sec, 3);
+  wasm_byte(&sec, 0x60);
+  wasm_uleb(&sec, 0);
+  wasm_uleb(&sec, 0);
+  wasm_byte(&sec, 0x60);
+  wasm_uleb(&sec, 1);
+  wasm_byte(&sec, WASM_TYPE_I32);
+  wasm_uleb(&sec, 0);
+  wasm_byte(&sec, 0x60);
+  wasm_uleb(&sec, 0);
+  wasm_uleb(&sec, 1);
+  wasm_byte(&sec, WASM_TYPE_I32);
+  wasm_section(out, 1, &sec);
+
+  wasm_uleb(&sec, 2);
+  wasm_name(&sec, "env");
+  wasm_name(&sec, "putchar");
+  wasm_byte(&sec, 0);
+  wasm_uleb(&sec, 1);
+  wasm_name(&sec, "env");
+  wasm_name(&sec, "getchar");
+  wasm_byte(&sec, 0);
+  wasm_uleb(&sec, 2);
+  wasm_section(out, 2, &sec);
+
+  wasm_uleb(&sec, 2 + num_funcs);
+  wasm_uleb(&sec, 1);
+  wasm_uleb(&sec, 0);
+  for (int i = 0; i < num_funcs; i++)
+    wasm_uleb(&sec, 0);
+  wasm_section(out, 3, &sec);
+
+  wasm_uleb(&sec, 1);
+  wasm_byte(&sec, 1);
+  wasm_uleb(&sec, pages);
+  wasm_uleb(&sec, WASM_MAX_PAGES);
+  wasm_section(out, 5, &sec);
+
+  wasm_uleb(&sec, WASM_GLOBAL_LIMIT + 1);
+  for (int i = 0; i <= WASM_GLOBAL_LIMIT; i++) {
+    wasm_byte(&sec, WASM_TYPE_I32);
+    wasm_byte(&sec, 1);
+    wasm_const(&sec, (i == WASM_GLOBAL_RUNNING ? 1 :
+                      i == WASM_GLOBAL_LIMIT ? pages * WASM_PAGE_WORDS : 0));
+    wasm_byte(&sec, WASM_END);
+  }
+  wasm_section(out, 6, &sec);
+
+  wasm_uleb(&sec, 2);
+  wasm_name(&sec, "main");
+  wasm_byte(&sec, 0);
+  wasm_uleb(&sec, WASM_FUNC_MAIN);
+  wasm_name(&sec, "memory");
+  wasm_byte(&sec, 2);
+  wasm_uleb(&sec, 0);
+  wasm_section(out, 7, &sec);
+
+  wasm_uleb(&sec, 2 + num_funcs);
+  wasm_emit_grow(&body);
+  wasm_sized(&sec, &body);
+  wasm_emit_main(m, &body);
+  wasm_sized(&sec, &body);
+  for (int i = 0; i < num_funcs; i++) {
+    FormatMark mark = format_mark();
+    wasm_emit_chunk(m, i, &body);
+    format_release(mark);
+    wasm_sized(&sec, &body);
+  }
+  wasm_section(out, 10, &sec);
+
+  wasm_uleb(&sec, 1);
+  wasm_byte(&sec, 0);
+  wasm_const(&sec, WASM_STACK_WORDS * 4);
+  wasm_byte(&sec, WASM_END);
+  wasm_uleb(&sec, data_len * 4);
+  Data* d = m->data;
+  for (int i = 0; i < data_len; i++, d = d->next) {
+    for (int j = 0; j < 4; j++)
+      wasm_byte(&sec, (d->v >> (j * 8)) & 255);
+  }
+  wasm_section(out, 11, &sec);
+
+  free(sec.buf);
+  free(body.buf);
+}
+
+static void wasm_emit_base64(WasmBuf* b) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char line[77];
+  int n = 0;
+  for (int i = 0; i < b->len; i += 3) {
+    int v = b->buf[i] << 16;
+    if (i + 1 < b->len)
+      v |= b->buf[i + 1] << 8;
+    if (i + 2 < b->len)
+      v |= b->buf[i + 2];
+    line[n++] = digits[(v >> 18) & 63];
+    line[n++] = digits[(v >> 12) & 63];
+    line[n++] = i + 1 < b->len ? digits[(v >> 6) & 63] : '=';
+    line[n++] = i + 2 < b->len ? digits[v & 63] : '=';
+    if (n == 76 || i + 3 >= b->len) {
+      line[n] = 0;
+      emit_line("'%s'%s", line, i + 3 >= b->len ? ";" : " +");
+      n = 0;
+    }
+  }
+}
+
+const int target_wasm_ext_ops = ALL_EXT_OPS & ~(EXT_OP_BIT(MEMCPY) |
+                                                EXT_OP_BIT(MEMSET));
+
+void target_wasm(Module* module) {
+  g_wasm_plan = plan_chunks(build_cfg(module));
+  WasmBuf wasm = {0};
+  wasm_emit_module(module, &wasm);
+
+  emit_line("var main = function(getchar, putchar) {");
+  emit_line("var wasm =");
+  if (wasm.len)
+    wasm_emit_base64(&wasm);
+  emit_line("var bytes = typeof Buffer != 'undefined' ?");
+  emit_line(" Buffer.from(wasm, 'base64') :");
+  emit_line(" Uint8Array.from(atob(wasm), function(c) {"
+            " return c.charCodeAt(0); });");
+  emit_line("var env = {getchar: getchar, putchar: putchar};");
+  emit_line("new WebAssembly.Instance(new WebAssembly.Module(bytes),"
+            " {env: env}).exports.main();");
+  emit_line("};");
+
+  // For nodejs
+  emit_line("if (typeof require != 'undefined') {");
+  emit_line(" var fs = require('fs');");
+  emit_line(" var input = null;");
+  emit_line(" var ip = 0;");
+  emit_line(" var output = [];");
+  emit_line(" var flush = function() {");
+  emit_line("  fs.writeSync(1, Buffer.from(output));");
+  emit_line("  output = [];");
+  emit_line(" };");
+  emit_line(" var getchar = function() {");
+  emit_line("  if (input === null)");
+  emit_line("   input = fs.readFileSync('/dev/stdin');");
+  emit_line("  return input[ip++] | 0;");
+  emit_line(" };");
+  emit_line(" var putchar = function(c) {");
+  emit_line("  output.push(c & 255);");
+  emit_line("  if (output.length >= 65536)");
+  emit_line("   flush();");
+  emit_line(" };");
+  emit_line(" main(getchar, putchar);");
+  emit_line(" flush();");
+  emit_line("}");
+  free(wasm.buf);
+}
@@ -9,6 +9,16 @@ static const int MEM = 8;
 
 static int mem(int a) { return MEM + a; }
 
+// The heap slot holding 1<<24, which is long as a literal.
+static const int MOD_SLOT = 7;
+
+// The register the previous instruction left the value of on the
+// stack, because this one reads it first, or -1.
+static int ws_reg_on_stack = -1;
+
+const int target_ws_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(DIV) | EXT_OP_BIT(MOD);
+
 typedef enum {
   WS_PUSH,
   WS_DUP,
@@ -72,7 +82,7 @@ static const char* WS_OPS[] = {
 };
 
 static void ws_emit_str(const char* s) {
-  fputs(s, stdout);
+  emit_str(s);
 }
 
 static void ws_emit_num(int v) {
@@ -89,11 +99,11 @@ static void ws_emit_num(int v) {
 }
 
 static void ws_emit_uint_mod_ws() {
-  putchar(' ');
-  putchar('\t');
+  emit_char(' ');
+  emit_char('\t');
   for (int i = 0; i < 24; i++)
-    putchar(' ');
-  putchar('\n');
+    emit_char(' ');
+  emit_char('\n');
 }
 
 static void ws_emit(WsOp op) {
@@ -117,10 +127,30 @@ static void ws_emit_store(int addr, int val) {
 }
 
 static void ws_emit_retrieve(int addr) {
+  if (addr == ws_reg_on_stack) {
+    ws_reg_on_stack = -1;
+    return;
+  }
   ws_emit_op(WS_PUSH, addr);
   ws_emit(WS_RETRIEVE);
 }
 
+// Storing the value computed between these to register reg. With keep,
+// the value is also left on the stack for the next instruction.
+static void ws_emit_reg_store_begin(int reg, bool keep) {
+  if (!keep)
+    ws_emit_op(WS_PUSH, reg);
+}
+
+static void ws_emit_reg_store_end(int reg, bool keep) {
+  if (keep) {
+    ws_emit(WS_DUP);
+    ws_emit_op(WS_PUSH, reg);
+    ws_emit(WS_SWAP);
+  }
+  ws_emit(WS_STORE);
+}
+
 static void ws_emit_value(Value* v, int off) {
   if (v->type == REG) {
     ws_emit_retrieve(v->reg);
@@ -137,16 +167,61 @@ static void ws_emit_src(Inst* inst, int off) {
   ws_emit_value(&inst->src, off);
 }
 
-static void ws_emit_addsub(Inst* inst, WsOp op) {
-  ws_emit_op(WS_PUSH, inst->dst.reg);
+static void ws_emit_addsub(Inst* inst, WsOp op, bool keep) {
+  ws_emit_reg_store_begin(inst->dst.reg, keep);
   ws_emit_retrieve(inst->dst.reg);
   ws_emit_src(inst, 0);
   ws_emit(op);
-  ws_emit(WS_PUSH); ws_emit_uint_mod_ws();
-  ws_emit(WS_ADD);
-  ws_emit(WS_PUSH); ws_emit_uint_mod_ws();
-  ws_emit(WS_MOD);
-  ws_emit(WS_STORE);
+  if (!inst->in_range) {
+    // Only a difference can be negative.
+    if (op == WS_SUB) {
+      ws_emit_retrieve(MOD_SLOT);
+      ws_emit(WS_ADD);
+    }
+    ws_emit_retrieve(MOD_SLOT);
+    ws_emit(WS_MOD);
+  }
+  ws_emit_reg_store_end(inst->dst.reg, keep);
+}
+
+// DIV by 0 gives UINT_MAX and MOD by 0 leaves dst, where whitespace
+// would trap, so a register divisor is tested first.
+static void ws_emit_muldiv(Inst* inst, WsOp op, bool keep, int* label) {
+  ws_emit_reg_store_begin(inst->dst.reg, keep);
+  if (op == WS_MUL) {
+    ws_emit_retrieve(inst->dst.reg);
+    ws_emit_src(inst, 0);
+    ws_emit(WS_MUL);
+    if (!inst->in_range) {
+      ws_emit_retrieve(MOD_SLOT);
+      ws_emit(WS_MOD);
+    }
+  } else if (inst->src.type == IMM && inst->src.imm == 0) {
+    if (op == WS_DIV)
+      ws_emit_op(WS_PUSH, UINT_MAX);
+    else
+      ws_emit_retrieve(inst->dst.reg);
+  } else if (inst->src.type == IMM) {
+    ws_emit_retrieve(inst->dst.reg);
+    ws_emit_src(inst, 0);
+    ws_emit(op);
+  } else {
+    int lz = ++*label;
+    int ld = ++*label;
+    ws_emit_src(inst, 0);
+    ws_emit_local_jmp(WS_JZ, lz);
+    ws_emit_retrieve(inst->dst.reg);
+    ws_emit_src(inst, 0);
+    ws_emit(op);
+    ws_emit_local_jmp(WS_JMP, ld);
+    ws_emit_op(WS_MARK, lz);
+    if (op == WS_DIV)
+      ws_emit_op(WS_PUSH, UINT_MAX);
+    else
+      ws_emit_retrieve(inst->dst.reg);
+    ws_emit_op(WS_MARK, ld);
+  }
+  ws_emit_reg_store_end(inst->dst.reg, keep);
 }
 
 static void ws_emit_cmp_ws(Inst* inst, int flip, int* label) {
@@ -210,29 +285,68 @@ static void ws_emit_jmp(Inst* inst, WsOp op, int reg_jmp) {
   }
 }
 
-static void ws_emit_reg_jmp_table(int min_pc, int max_pc, int last_label) {
-  if (min_pc + 1 == max_pc) {
+// Binary search over the sorted pcs targets[lo..hi).
+static void ws_emit_reg_jmp_table(int* targets, int lo, int hi,
+                                  int last_label) {
+  if (lo == hi) {
+    ws_emit(WS_EXIT);
+    return;
+  }
+  if (lo + 1 == hi) {
     ws_emit(WS_DISCARD);
-    ws_emit_op(WS_JMP, min_pc);
+    ws_emit_op(WS_JMP, targets[lo]);
     return;
   }
 
-  int mid_pc = (min_pc + max_pc) / 2;
+  int mid = (lo + hi) / 2;
   ws_emit(WS_DUP);
-  ws_emit_op(WS_PUSH, mid_pc);
+  ws_emit_op(WS_PUSH, targets[mid]);
   ws_emit(WS_SUB);
-  ws_emit_op(WS_JN, last_label + mid_pc);
-  ws_emit_reg_jmp_table(mid_pc, max_pc, last_label);
-  ws_emit_op(WS_MARK, last_label + mid_pc);
-  ws_emit_reg_jmp_table(min_pc, mid_pc, last_label);
+  ws_emit_op(WS_JN, last_label + mid);
+  ws_emit_reg_jmp_table(targets, mid, hi, last_label);
+  ws_emit_op(WS_MARK, last_label + mid);
+  ws_emit_reg_jmp_table(targets, lo, mid, last_label);
+}
+
+// The register inst reads before anything else, or -1.
+static int ws_first_read(Inst* inst) {
+  switch (inst->op) {
+    case STORE:
+    case PUTC:
+      return inst->src.type == REG ? (int)inst->src.reg : -1;
+
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGT:
+    case JLE:
+    case JGE: {
+      // See ws_emit_cmp_ws.
+      int op = normalize_cond(inst->op, 1);
+      if (op != JGT && op != JLE)
+        return inst->dst.reg;
+      return inst->src.type == REG ? (int)inst->src.reg : -1;
+    }
+
+    case JMP:
+      return inst->jmp.type == REG ? (int)inst->jmp.reg : -1;
+
+    default:
+      return -1;
+  }
 }
 
 static void init_state_ws(Data* data) {
   for (int i = 0; i < 7; i++) {
     ws_emit_store(i, 0);
   }
+  ws_emit_op(WS_PUSH, MOD_SLOT);
+  ws_emit(WS_PUSH); ws_emit_uint_mod_ws();
+  ws_emit(WS_STORE);
+  // The heap reads as 0 where it wasn't stored to.
   for (int mp = 0; data; data = data->next, mp++) {
-    ws_emit_store(mem(mp), data->v);
+    if (data->v)
+      ws_emit_store(mem(mp), data->v);
   }
 }
 
@@ -252,26 +366,47 @@ void target_ws(Module* module) {
     }
     prev_pc = inst->pc;
 
+    // An instruction writing dst.reg keeps it on the stack for the
+    // next one in the block when that reads it first.
+    Inst* next = inst->next;
+    bool writes = (inst->op == MOV || inst->op == ADD || inst->op == SUB ||
+                   inst->op == MUL || inst->op == DIV || inst->op == MOD ||
+                   inst->op == LOAD || (inst->op >= EQ && inst->op <= GE));
+    bool keep = (writes && next && next->pc == inst->pc &&
+                 ws_first_read(next) == (int)inst->dst.reg);
+
     switch (inst->op) {
       case MOV:
-        ws_emit_op(WS_PUSH, inst->dst.reg);
+        ws_emit_reg_store_begin(inst->dst.reg, keep);
         ws_emit_src(inst, 0);
-        ws_emit(WS_STORE);
+        ws_emit_reg_store_end(inst->dst.reg, keep);
         break;
 
       case ADD:
-        ws_emit_addsub(inst, WS_ADD);
+        ws_emit_addsub(inst, WS_ADD, keep);
         break;
 
       case SUB:
-        ws_emit_addsub(inst, WS_SUB);
+        ws_emit_addsub(inst, WS_SUB, keep);
+        break;
+
+      case MUL:
+        ws_emit_muldiv(inst, WS_MUL, keep, &label);
+        break;
+
+      case DIV:
+        ws_emit_muldiv(inst, WS_DIV, keep, &label);
+        break;
+
+      case MOD:
+        ws_emit_muldiv(inst, WS_MOD, keep, &label);
         break;
 
       case LOAD:
-        ws_emit_op(WS_PUSH, inst->dst.reg);
+        ws_emit_reg_store_begin(inst->dst.reg, keep);
         ws_emit_src(inst, 8);
         ws_emit(WS_RETRIEVE);
-        ws_emit(WS_STORE);
+        ws_emit_reg_store_end(inst->dst.reg, keep);
         break;
 
       case STORE:
@@ -303,9 +438,9 @@ void target_ws(Module* module) {
       case GT:
       case LE:
       case GE:
-        ws_emit_op(WS_PUSH, inst->dst.reg);
+        ws_emit_reg_store_begin(inst->dst.reg, keep);
         ws_emit_cmp_ws(inst, 0, &label);
-        ws_emit(WS_STORE);
+        ws_emit_reg_store_end(inst->dst.reg, keep);
         break;
 
       case JEQ:
@@ -325,8 +460,11 @@ void target_ws(Module* module) {
       default:
         error("oops");
     }
+    ws_reg_on_stack = keep ? (int)inst->dst.reg : -1;
   }
 
+  int num_targets;
+  int* targets = indirect_jump_targets(module, &num_targets);
   ws_emit_op(WS_MARK, reg_jmp);
-  ws_emit_reg_jmp_table(0, reg_jmp, label);
+  ws_emit_reg_jmp_table(targets, 0, num_targets, label);
 }
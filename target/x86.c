@@ -4,6 +4,20 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// eli --jit runs the code emitted by this backend in-process. The
+// instruction encodings below are valid in 64bit mode as well. Only
+// system calls, indirect jumps, and the entry/exit sequence differ.
+#if defined(__x86_64__) && defined(__linux__) && !defined(__eir__)
+# define X86_JIT
+# include <sys/mman.h>
+#endif
+
+// The extension ops emitted natively. Division and shifts need EDX and
+// ECX, which hold registers.
+const int target_x86_ext_ops =
+    EXT_OP_BIT(MUL) | EXT_OP_BIT(AND) | EXT_OP_BIT(OR) | EXT_OP_BIT(XOR) |
+    EXT_OP_BIT(MEMCPY) | EXT_OP_BIT(MEMSET);
+
 static int REGNO[] = {
   0,  // A
   3,  // B
@@ -45,67 +59,521 @@ static void emit_mov_imm(Reg dst, int src) {
   emit_le(src);
 }
 
+// A mov of 0 is an xor, which clobbers the flags, so it isn't for
+// code between a cmp and its use.
 static void emit_mov(Reg dst, Value* src) {
   if (src->type == REG) {
     emit_mov_reg(dst, src->reg);
+  } else if (!src->imm) {
+    emit_zero_reg(dst);
   } else {
     emit_mov_imm(dst, src->imm);
   }
 }
 
+static bool is_imm8(int v) {
+  return v >= -128 && v < 128;
+}
+
+// "op r/m32, imm" of group 1 (add, or, and, sub, xor, cmp, ...) by its
+// /digit, with a sign-extended imm8 when it fits.
+static void emit_group1_imm(int digit, Reg dst, int imm) {
+  if (is_imm8(imm)) {
+    emit_3(0x83, 0xc0 + digit * 8 + REGNO[dst], imm & 255);
+  } else {
+    emit_2(0x81, 0xc0 + digit * 8 + REGNO[dst]);
+    emit_le(imm);
+  }
+}
+
+// Wraps dst to 24 bits, by the shorter form for EAX.
+static void emit_mask(Reg dst) {
+  if (dst == A)
+    emit_1(0x25);
+  else
+    emit_2(0x81, 0xe0 + REGNO[dst]);
+  emit_le(0xffffff);
+}
+
+// The immediate of an ADD or SUB as a signed addend. When the result is
+// masked, one near 2^24 may as well be negative, which fits an imm8 or
+// disp8 more often, e.g., "add B, 16777215" is "add EBX, -1".
+static int x86_addend(Inst* inst) {
+  int v = inst->op == SUB ? -inst->src.imm : inst->src.imm;
+  if (!inst->unmasked) {
+    v &= 0xffffff;
+    if (v > 0x7fffff)
+      v -= 0x1000000;
+  }
+  return v;
+}
+
 static void emit_cmp_x86(Inst* inst) {
   if (inst->src.type == REG) {
     emit_2(0x39, modr(inst->dst.reg, inst->src.reg));
   } else {
-    emit_2(0x81, 0xf8 + REGNO[inst->dst.reg]);
-    emit_le(inst->src.imm);
+    emit_group1_imm(7, inst->dst.reg, inst->src.imm);
+  }
+}
+
+// AND, OR or XOR, by the opcode of their "op r/m32, r32" form and the
+// /digit of "op r/m32, imm32".
+static void emit_bitwise(Inst* inst, int op, int digit) {
+  if (inst->src.type == REG) {
+    emit_2(op, modr(inst->dst.reg, inst->src.reg));
+  } else {
+    emit_group1_imm(digit, inst->dst.reg, inst->src.imm);
   }
 }
 
+static void emit_call(int addr) {
+  emit_1(0xe8);
+  emit_diff(addr, emit_cnt() + 4);
+}
+
 static void emit_setcc(Inst* inst, int op) {
   emit_cmp_x86(inst);
   emit_mov_imm(inst->dst.reg, 0);
   emit_3(0x0f, op, 0xc0 + REGNO[inst->dst.reg]);
 }
 
-static void emit_jcc(Inst* inst, int op, int* pc2addr, int rodata_addr) {
-  if (op) {
-    emit_cmp_x86(inst);
-    emit_2(op, inst->jmp.type == REG ? 7 : 5);
+#ifdef X86_JIT
+
+typedef void (*x86_jit_entry_t)(int* mem);
+
+// Set while compiling for x86_jit_compile.
+static bool g_jit;
+static int g_jit_num_pcs;
+static uintptr_t g_jit_base;
+static uintptr_t g_jit_table;
+static int g_jit_bad_jump;
+static uintptr_t g_jit_putc;
+static uintptr_t g_jit_getc;
+static uintptr_t g_jit_fail;
+// The layout of the last x86_jit_compile, for x86_jit_write_perf_map.
+static int* g_jit_pc2addr;
+static int g_jit_code_size;
+
+// cmp + jae + mov r11 + jmp [r11+reg*8]
+#define JIT_JMP_REG_SIZE 26
+
+static void emit_imm64(uintptr_t v) {
+  emit_le((uint32_t)v);
+  emit_le((uint32_t)(v >> 32));
+}
+
+static void emit_jit_call(uintptr_t fn) {
+  // mov RAX, fn
+  emit_2(0x48, 0xb8);
+  emit_imm64(fn);
+  // call RAX
+  emit_2(0xff, 0xd0);
+}
+
+static void emit_jit_jmp_reg(Reg reg) {
+  // cmp reg, num_pcs
+  emit_2(0x81, 0xf8 + REGNO[reg]);
+  emit_le(g_jit_num_pcs);
+  // jae bad_jump
+  emit_2(0x0f, 0x83);
+  emit_diff(g_jit_bad_jump, emit_cnt() + 4);
+  // mov R11, table
+  emit_2(0x49, 0xbb);
+  emit_imm64(g_jit_table);
+  // jmp [R11+reg*8]
+  emit_4(0x41, 0xff, 0x24, 0xc3 + REGNO[reg] * 8);
+}
+
+// PUTC and GETC call stubs which call the host functions, keeping the
+// ELVM registers, with the byte in R8D.
+static int g_jit_putc_stub;
+static int g_jit_getc_stub;
+
+static void emit_jit_io(Inst* inst) {
+  if (inst->op == PUTC) {
+    if (inst->src.type == REG) {
+      // mov R8D, src
+      emit_3(0x41, 0x89, 0xc0 + REGNO[inst->src.reg] * 8);
+    } else {
+      // mov R8D, imm
+      emit_2(0x41, 0xb8);
+      emit_le(inst->src.imm);
+    }
+    emit_call(g_jit_putc_stub);
+  } else {
+    emit_call(g_jit_getc_stub);
+    // mov dst, R8D
+    emit_3(0x44, 0x89, 0xc0 + REGNO[inst->dst.reg]);
   }
+}
 
-  if (inst->jmp.type == REG) {
-    emit_3(0xff, 0x24, 0x85 + (REGNO[inst->jmp.reg] * 8));
-    emit_le(rodata_addr);
+// Seven pushes and the return address keep RSP 16-byte aligned.
+static void emit_jit_io_stub(bool is_putc) {
+  // push RAX, RCX, RDX, RSI, RDI, R10, R11
+  emit_5(0x50, 0x51, 0x52, 0x56, 0x57);
+  emit_4(0x41, 0x52, 0x41, 0x53);
+  if (is_putc) {
+    // mov EDI, R8D
+    emit_3(0x44, 0x89, 0xc7);
+    emit_jit_call(g_jit_putc);
   } else {
-    emit_1(0xe9);
-    emit_diff(pc2addr[inst->jmp.imm], emit_cnt() + 4);
+    emit_jit_call(g_jit_getc);
+    // mov R8D, EAX
+    emit_3(0x41, 0x89, 0xc0);
+  }
+  // pop R11, R10, RDI, RSI, RDX, RCX, RAX; ret
+  emit_4(0x41, 0x5b, 0x41, 0x5a);
+  emit_5(0x5f, 0x5e, 0x5a, 0x59, 0x58);
+  emit_1(0xc3);
+}
+
+static void emit_jit_prologue() {
+  // push RBX, RBP, R12
+  emit_2(0x53, 0x55);
+  emit_2(0x41, 0x54);
+  // mov RSI, RDI
+  emit_3(0x48, 0x89, 0xfe);
+}
+
+static void emit_jit_epilogue() {
+  // pop R12, RBP, RBX
+  emit_2(0x41, 0x5c);
+  emit_2(0x5d, 0x5b);
+  // ret
+  emit_1(0xc3);
+}
+
+#endif  // X86_JIT
+
+// Pointers into memory are 64bit in JIT mode, so instructions on them
+// need REX.W.
+static int emit_ptr_prefix() {
+#ifdef X86_JIT
+  if (g_jit) {
+    emit_1(0x48);
+    return 1;
   }
+#endif
+  return 0;
 }
 
-static void init_state_x86(Data* data) {
-  emit_mov_imm(B, 0);
-  // mov ECX, 1<<26
-  emit_5(0xb8 + REGNO[C], 0, 0, 0, 4);
-  emit_mov_imm(D, 3);  // PROT_READ | PROT_WRITE
-  emit_mov_imm(ESI, 0x22);  // MAP_PRIVATE | MAP_ANONYMOUS
-  // mov EDI, 0xffffffff
-  emit_5(0xb8 + REGNO[EDI], 0xff, 0xff, 0xff, 0xff);
-  emit_mov_imm(BP, 0);
-  emit_mov_imm(A, 192);  // mmap2
+static void emit_push_value(Value* v) {
+  if (v->type == REG) {
+    emit_1(0x50 + REGNO[v->reg]);
+  } else {
+    emit_1(0x68);
+    emit_le(v->imm);
+  }
+}
+
+// MEMCPY and MEMSET by rep movsd/stosd, which take the pointers in ESI
+// and EDI, the count in ECX and the value in EAX.
+static void emit_mem_op(Inst* inst) {
+  // push ESI, EDI, ECX, EAX
+  emit_4(0x56, 0x57, 0x51, 0x50);
+  emit_push_value(&inst->dst);
+  emit_push_value(&inst->src);
+  emit_push_value(&inst->jmp);
+  // pop ECX, EAX, EDI
+  emit_3(0x59, 0x58, 0x5f);
+  // lea EDI, [ESI+EDI*4]
+  emit_ptr_prefix();
+  emit_3(0x8d, 0x3c, 0xbe);
+  if (inst->op == MEMSET) {
+    // rep stosd
+    emit_2(0xf3, 0xab);
+  } else {
+    // lea ESI, [ESI+EAX*4]
+    emit_ptr_prefix();
+    emit_3(0x8d, 0x34, 0x86);
+    // cmp EDI, ESI
+    int rex = emit_ptr_prefix();
+    emit_2(0x39, 0xf7);
+    // jbe forward
+    emit_2(0x76, 14 + rex * 2);
+    // Copies backward from the last words when the destination is
+    // after the source. lea ESI, [ESI+ECX*4-4]; lea EDI, [EDI+ECX*4-4]
+    emit_ptr_prefix();
+    emit_4(0x8d, 0x74, 0x8e, 0xfc);
+    emit_ptr_prefix();
+    emit_4(0x8d, 0x7c, 0x8f, 0xfc);
+    // std; rep movsd; cld; jmp done
+    emit_4(0xfd, 0xf3, 0xa5, 0xfc);
+    emit_2(0xeb, 2);
+    // forward: rep movsd
+    emit_2(0xf3, 0xa5);
+  }
+  // pop EAX, ECX, EDI, ESI
+  emit_4(0x58, 0x59, 0x5f, 0x5e);
+}
+
+// The I/O runtime keeps a 4 KB output and input buffer after the ELVM
+// memory. PUTC appends to the output buffer, which is written out when
+// it is full, before a read and at EXIT. GETC takes bytes from the input
+// buffer, which is refilled by a single read. The counts come first.
+#define IO_BUF_SIZE 4096
+#define OUT_CNT (1 << 26)
+#define IN_POS (OUT_CNT + 4)
+#define IN_CNT (OUT_CNT + 8)
+#define OUT_BUF (OUT_CNT + 12)
+#define IN_BUF (OUT_BUF + IO_BUF_SIZE)
+#define IO_END (IN_BUF + IO_BUF_SIZE)
+
+static int g_flush_addr;
+static int g_putc_addr;
+static int g_getc_addr;
+
+// Emits a short jump whose displacement is set by patch_jmp8.
+static int emit_jmp8(int op) {
+  emit_2(op, 0);
+  return emit_cnt();
+}
+
+static void patch_jmp8(int end) {
+  int d = emit_cnt() - end;
+  emit_patch_begin(end - 1);
+  emit_1(d);
+  emit_patch_end();
+}
+
+static void emit_flush_func() {
+  g_flush_addr = emit_cnt();
+  // push EAX, EBX, ECX, EDX
+  emit_4(0x50, 0x53, 0x51, 0x52);
+  emit_mov_imm(B, 1);  // stdout
+  // lea ECX, [ESI+OUT_BUF]
+  emit_2(0x8d, 0x8e);
+  emit_le(OUT_BUF);
+  // mov EDX, [ESI+OUT_CNT]
+  emit_2(0x8b, 0x96);
+  emit_le(OUT_CNT);
+  int loop = emit_cnt();
+  // test EDX, EDX; jz done
+  emit_2(0x85, 0xd2);
+  int done1 = emit_jmp8(0x74);
+  emit_mov_imm(A, 4);  // write
   emit_int80();
+  // test EAX, EAX; jle done
+  emit_2(0x85, 0xc0);
+  int done2 = emit_jmp8(0x7e);
+  // add ECX, EAX; sub EDX, EAX; jmp loop
+  emit_4(0x01, 0xc1, 0x29, 0xc2);
+  emit_2(0xeb, loop - emit_cnt() - 2);
+  patch_jmp8(done1);
+  patch_jmp8(done2);
+  // mov dword [ESI+OUT_CNT], 0
+  emit_2(0xc7, 0x86);
+  emit_le(OUT_CNT);
+  emit_le(0);
+  // pop EDX, ECX, EBX, EAX; ret
+  emit_5(0x5a, 0x59, 0x5b, 0x58, 0xc3);
+}
+
+// Appends AL to the output buffer, which is written out when full.
+static void emit_putc_func() {
+  g_putc_addr = emit_cnt();
+  // push ECX
+  emit_1(0x51);
+  // mov ECX, [ESI+OUT_CNT]
+  emit_2(0x8b, 0x8e);
+  emit_le(OUT_CNT);
+  // mov [ESI+ECX+OUT_BUF], AL
+  emit_3(0x88, 0x84, 0x0e);
+  emit_le(OUT_BUF);
+  // inc ECX; mov [ESI+OUT_CNT], ECX
+  emit_3(0x41, 0x89, 0x8e);
+  emit_le(OUT_CNT);
+  // cmp ECX, IO_BUF_SIZE; jb skip
+  emit_2(0x81, 0xf9);
+  emit_le(IO_BUF_SIZE);
+  int skip = emit_jmp8(0x72);
+  emit_call(g_flush_addr);
+  patch_jmp8(skip);
+  // pop ECX; ret
+  emit_2(0x59, 0xc3);
+}
+
+// Returns the next input byte, or 0 at EOF, in EAX.
+static void emit_getc_func() {
+  g_getc_addr = emit_cnt();
+  // push EBX, ECX, EDX
+  emit_3(0x53, 0x51, 0x52);
+  // mov EAX, [ESI+IN_POS]; cmp EAX, [ESI+IN_CNT]; jb have
+  emit_2(0x8b, 0x86);
+  emit_le(IN_POS);
+  emit_2(0x3b, 0x86);
+  emit_le(IN_CNT);
+  int have = emit_jmp8(0x72);
+  emit_call(g_flush_addr);
+  emit_mov_imm(B, 0);  // stdin
+  // lea ECX, [ESI+IN_BUF]
+  emit_2(0x8d, 0x8e);
+  emit_le(IN_BUF);
+  emit_mov_imm(D, IO_BUF_SIZE);
+  emit_mov_imm(A, 3);  // read
+  emit_int80();
+  // test EAX, EAX; jg filled; xor EAX, EAX
+  emit_2(0x85, 0xc0);
+  int filled = emit_jmp8(0x7f);
+  emit_zero_reg(A);
+  patch_jmp8(filled);
+  // mov [ESI+IN_CNT], EAX; mov dword [ESI+IN_POS], 0
+  emit_2(0x89, 0x86);
+  emit_le(IN_CNT);
+  emit_2(0xc7, 0x86);
+  emit_le(IN_POS);
+  emit_le(0);
+  // test EAX, EAX; jz done (EAX is 0 at EOF); xor EAX, EAX
+  emit_2(0x85, 0xc0);
+  int eof = emit_jmp8(0x74);
+  emit_zero_reg(A);
+  patch_jmp8(have);
+  // movzx ECX, byte [ESI+EAX+IN_BUF]; inc EAX; mov [ESI+IN_POS], EAX
+  emit_4(0x0f, 0xb6, 0x8c, 0x06);
+  emit_le(IN_BUF);
+  emit_3(0x40, 0x89, 0x86);
+  emit_le(IN_POS);
+  emit_mov_reg(A, C);
+  patch_jmp8(eof);
+  // pop EDX, ECX, EBX; ret
+  emit_4(0x5a, 0x59, 0x5b, 0xc3);
+}
+
+static void emit_io_funcs() {
+  // jmp over
+  emit_1(0xe9);
+  int over = emit_cnt();
+  emit_le(0);
+  emit_flush_func();
+  emit_putc_func();
+  emit_getc_func();
+  int end = emit_cnt();
+  emit_patch_begin(over);
+  emit_diff(end, over + 4);
+  emit_patch_end();
+}
+
+static void emit_buffered_putc(Inst* inst) {
+  if (inst->src.type == REG && inst->src.reg == A) {
+    emit_call(g_putc_addr);
+    return;
+  }
+  // push EAX
+  emit_1(0x50);
+  emit_mov(A, &inst->src);
+  emit_call(g_putc_addr);
+  // pop EAX
+  emit_1(0x58);
+}
 
-  emit_mov_reg(ESI, A);
+static void emit_buffered_getc(Inst* inst) {
+  if (inst->dst.reg == A) {
+    emit_call(g_getc_addr);
+    return;
+  }
+  // push EAX
+  emit_1(0x50);
+  emit_call(g_getc_addr);
+  emit_mov_reg(inst->dst.reg, A);
+  // pop EAX
+  emit_1(0x58);
+}
 
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      // mov dword [EAX+mp*4], data->v
-      emit_2(0xc7, 0x80);
-      emit_le(mp * 4);
-      emit_le(data->v);
+// Direct jumps get a rel8 displacement when their target is in range.
+// Which do is found by laying the code out with every one short, then
+// making long those which don't reach, again until none changes (see
+// x86_relax). Jumps only grow, so it ends, and nothing else depends on
+// addresses for its size, so the last layout is the final one. The
+// arrays are indexed by the order of the jumps in the text.
+static int g_num_jmps;
+static int g_jmp_idx;
+static bool* g_jmp_long;
+static int* g_jmp_ends;
+static int* g_jmp_targets;
+
+static void x86_init_jmps(Module* module) {
+  g_num_jmps = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM)
+      g_num_jmps++;
+  }
+  g_jmp_long = calloc(g_num_jmps + 1, sizeof(bool));
+  g_jmp_ends = calloc(g_num_jmps + 1, sizeof(int));
+  g_jmp_targets = calloc(g_num_jmps + 1, sizeof(int));
+}
+
+static void x86_free_jmps(void) {
+  free(g_jmp_long);
+  free(g_jmp_ends);
+  free(g_jmp_targets);
+}
+
+// Makes long the short jumps of the last layout which don't reach their
+// targets, given as pc2addr for num_addrs pcs. Returns whether any did.
+static bool x86_relax(int* pc2addr, int num_addrs) {
+  bool changed = false;
+  for (int i = 0; i < g_num_jmps; i++) {
+    if (g_jmp_long[i])
+      continue;
+    int t = g_jmp_targets[i];
+    if (t < 0 || t >= num_addrs ||
+        !is_imm8(pc2addr[t] - g_jmp_ends[i])) {
+      g_jmp_long[i] = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// A jump whose op is that of a jcc over the jump, i.e., of the negated
+// condition, or 0 for JMP. Direct jumps take the condition itself.
+static void emit_jcc(Inst* inst, int op, int* pc2addr, int rodata_addr) {
+  if (inst->jmp.type == IMM) {
+    int i = g_jmp_idx++;
+    int target = pc2addr[inst->jmp.imm];
+    if (op)
+      emit_cmp_x86(inst);
+    if (!g_jmp_long[i]) {
+      emit_2(op ? op ^ 1 : 0xeb, (target - emit_cnt() - 2) & 255);
+    } else {
+      if (op)
+        emit_2(0x0f, (op ^ 1) + 0x10);
+      else
+        emit_1(0xe9);
+      emit_diff(target, emit_cnt() + 4);
     }
+    g_jmp_targets[i] = inst->jmp.imm;
+    g_jmp_ends[i] = emit_cnt();
+    return;
   }
 
+  int jmp_reg_size = 7;
+#ifdef X86_JIT
+  if (g_jit)
+    jmp_reg_size = JIT_JMP_REG_SIZE;
+#endif
+  if (op) {
+    emit_cmp_x86(inst);
+    emit_2(op, jmp_reg_size);
+  }
+#ifdef X86_JIT
+  if (g_jit) {
+    emit_jit_jmp_reg(inst->jmp.reg);
+    return;
+  }
+#endif
+  emit_3(0xff, 0x24, 0x85 + (REGNO[inst->jmp.reg] * 8));
+  emit_le(rodata_addr);
+}
+
+// The memory is the data segment of the ELF, whose address is only
+// known after the code, so "mov ESI, mem" is patched at the end.
+static int g_x86_mem_addr;
+
+static void init_state_x86(void) {
+  g_x86_mem_addr = emit_cnt();
+  emit_mov_imm(ESI, 0);
+
   // mov ESP, 1<<24
   emit_5(0xb8 + REGNO[SP], 0, 0, 0, 1);
   emit_zero_reg(A);
@@ -113,36 +581,50 @@ static void init_state_x86(Data* data) {
   emit_zero_reg(C);
   emit_zero_reg(D);
   emit_zero_reg(BP);
+  emit_io_funcs();
+}
+
+// Whether inst and the next one are "mov r, s; add r, imm" (or sub),
+// which x86_emit_inst emits as one "lea r, [s+disp]".
+static bool is_lea(Inst* inst) {
+  Inst* add = inst->next;
+  return (inst->op == MOV && inst->src.type == REG &&
+          inst->src.reg != inst->dst.reg && add && add->pc == inst->pc &&
+          (add->op == ADD || add->op == SUB) && add->src.type == IMM &&
+          add->dst.reg == inst->dst.reg);
 }
 
-static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
+// Emits inst, and returns the last instruction it covered, which is
+// the next one when they are fused.
+static Inst* x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
   switch (inst->op) {
     case MOV:
+      if (is_lea(inst)) {
+        Inst* add = inst->next;
+        int disp = x86_addend(add);
+        int base = 0x40 * (is_imm8(disp) ? 1 : 2);
+        emit_2(0x8d, base + REGNO[inst->dst.reg] * 8 + REGNO[inst->src.reg]);
+        if (is_imm8(disp))
+          emit_1(disp & 255);
+        else
+          emit_le(disp);
+        if (!add->unmasked)
+          emit_mask(add->dst.reg);
+        return add;
+      }
       emit_mov(inst->dst.reg, &inst->src);
       break;
 
     case ADD:
-      if (inst->src.type == REG) {
-        emit_1(0x01);
-        emit_reg2(inst->dst.reg, inst->src.reg);
-      } else {
-        emit_2(0x81, 0xc0 + REGNO[inst->dst.reg]);
-        emit_le(inst->src.imm);
-      }
-      emit_2(0x81, 0xe0 + REGNO[inst->dst.reg]);
-      emit_le(0xffffff);
-      break;
-
     case SUB:
       if (inst->src.type == REG) {
-        emit_1(0x29);
+        emit_1(inst->op == ADD ? 0x01 : 0x29);
         emit_reg2(inst->dst.reg, inst->src.reg);
       } else {
-        emit_2(0x81, 0xe8 + REGNO[inst->dst.reg]);
-        emit_le(inst->src.imm);
+        emit_group1_imm(0, inst->dst.reg, x86_addend(inst));
       }
-      emit_2(0x81, 0xe0 + REGNO[inst->dst.reg]);
-      emit_le(0xffffff);
+      if (!inst->unmasked)
+        emit_mask(inst->dst.reg);
       break;
 
     case LOAD:
@@ -155,6 +637,8 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
       if (inst->src.type == REG) {
         emit_2(4 + (REGNO[inst->dst.reg] * 8),
                0x86 + (REGNO[inst->src.reg] * 8));
+      } else if (is_imm8(inst->src.imm * 4)) {
+        emit_2(0x46 + (REGNO[inst->dst.reg] * 8), inst->src.imm * 4);
       } else {
         emit_1(0x86 + (REGNO[inst->dst.reg] * 8));
         emit_le(inst->src.imm * 4);
@@ -162,51 +646,33 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
       break;
 
     case PUTC:
-      // push EDI
-      emit_1(0x57);
-      emit_mov(EDI, &inst->src);
-      // push EAX, ECX, EDX, EBX, EDI
-      emit_5(0x50, 0x51, 0x52, 0x53, 0x57);
-      emit_mov_imm(B, 1);  // stdout
-      emit_mov_reg(C, ESP);
-      emit_mov_imm(D, 1);
-      emit_mov_imm(A, 4);  // write
-      emit_int80();
-      // pop EDI, EBX, EDX, ECX, EAX
-      emit_5(0x5f, 0x5b, 0x5a, 0x59, 0x58);
-      // pop EDI
-      emit_1(0x5f);
+#ifdef X86_JIT
+      if (g_jit) {
+        emit_jit_io(inst);
+        break;
+      }
+#endif
+      emit_buffered_putc(inst);
       break;
 
     case GETC:
-      // push EDI
-      emit_1(0x57);
-      // push EAX, ECX, EDX, EBX
-      emit_4(0x50, 0x51, 0x52, 0x53);
-      // push 0
-      emit_2(0x6a, 0x00);
-      emit_mov_imm(B, 0);  // stdin
-      emit_mov_reg(C, ESP);
-      emit_mov_imm(D, 1);
-      emit_mov_imm(A, 3);  // read
-      emit_int80();
-
-      // pop EDI
-      emit_1(0x5f);
-      emit_mov_imm(B, 0);
-      // cmp EAX, 1
-      emit_3(0x83, 0xf8, 0x01);
-      // cmovnz EDI, EBX
-      emit_3(0x0f, 0x45, 0xfb);
-
-      // pop EBX, EDX, ECX, EAX
-      emit_4(0x5b, 0x5a, 0x59, 0x58);
-      emit_mov_reg(inst->dst.reg, EDI);
-      // pop EDI
-      emit_1(0x5f);
+#ifdef X86_JIT
+      if (g_jit) {
+        emit_jit_io(inst);
+        break;
+      }
+#endif
+      emit_buffered_getc(inst);
       break;
 
     case EXIT:
+#ifdef X86_JIT
+      if (g_jit) {
+        emit_jit_epilogue();
+        break;
+      }
+#endif
+      emit_call(g_flush_addr);
       emit_mov_imm(B, 0);
       emit_mov_imm(A, 1);  // exit
       emit_int80();
@@ -239,6 +705,38 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
       emit_setcc(inst, 0x9d);
       break;
 
+    case MUL:
+      if (inst->src.type == REG) {
+        emit_3(0x0f, 0xaf, modr(inst->src.reg, inst->dst.reg));
+      } else {
+        if (is_imm8(inst->src.imm)) {
+          emit_3(0x6b, modr(inst->dst.reg, inst->dst.reg), inst->src.imm);
+        } else {
+          emit_2(0x69, modr(inst->dst.reg, inst->dst.reg));
+          emit_le(inst->src.imm);
+        }
+      }
+      if (!inst->unmasked)
+        emit_mask(inst->dst.reg);
+      break;
+
+    case AND:
+      emit_bitwise(inst, 0x21, 4);
+      break;
+
+    case OR:
+      emit_bitwise(inst, 0x09, 1);
+      break;
+
+    case XOR:
+      emit_bitwise(inst, 0x31, 6);
+      break;
+
+    case MEMCPY:
+    case MEMSET:
+      emit_mem_op(inst);
+      break;
+
     case JEQ:
       emit_jcc(inst, 0x75, pc2addr, rodata_addr);
       break;
@@ -270,40 +768,187 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
     default:
       error("oops");
   }
+  return inst;
 }
 
-void target_x86(Module* module) {
-  emit_reset();
-  init_state_x86(module->data);
-
-  int pc_cnt = 0;
-  for (Inst* inst = module->text; inst; inst = inst->next) {
-    pc_cnt++;
-  }
-
-  int* pc2addr = calloc(pc_cnt, sizeof(int));
+// Emits the text from emit_cnt() on, setting pc2addr.
+static void x86_emit_text(Module* module, int* pc2addr, int rodata_addr) {
+  g_jmp_idx = 0;
   int prev_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     if (prev_pc != inst->pc) {
       pc2addr[inst->pc] = emit_cnt();
     }
     prev_pc = inst->pc;
-    x86_emit_inst(inst, pc2addr, 0);
+    inst = x86_emit_inst(inst, pc2addr, rodata_addr);
   }
+}
 
-  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
+void target_x86(Module* module) {
+  int pc_cnt = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    pc_cnt++;
+  }
 
-  emit_elf_header(3, emit_cnt() + pc_cnt * 4);
+  // The jump table follows the code, so it is only known after the
+  // layout, as are the targets of jumps to later pcs.
+  int* pc2addr = calloc(pc_cnt, sizeof(int));
+  x86_init_jmps(module);
+  do {
+    emit_reset();
+    init_state_x86();
+    x86_emit_text(module, pc2addr, 0);
+  } while (x86_relax(pc2addr, pc_cnt));
+  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_DATA_HEADER_SIZE;
+  set_elf_symbols(module, pc2addr, ELF_DATA_HEADER_SIZE, emit_cnt());
 
   emit_reset();
-  emit_start();
-  init_state_x86(module->data);
+  emit_start_code();
+  init_state_x86();
+  x86_emit_text(module, pc2addr, rodata_addr);
+  x86_free_jmps();
+
+  for (int i = 0; i < pc_cnt; i++) {
+    emit_le(ELF_TEXT_START + pc2addr[i] + ELF_DATA_HEADER_SIZE);
+  }
+
+  // The data up to its last non-zero word, from a page boundary. The
+  // rest of the memory and the I/O buffers are left to the kernel.
+  while ((emit_cnt() + ELF_DATA_HEADER_SIZE) % 4096)
+    emit_1(0);
+  int mem_addr = ELF_TEXT_START + emit_cnt() + ELF_DATA_HEADER_SIZE;
+  int data_size = 0;
+  int mp = 0;
+  for (Data* data = module->data; data; data = data->next, mp++) {
+    if (data->v)
+      data_size = (mp + 1) * 4;
+  }
+  mp = 0;
+  for (Data* data = module->data; mp * 4 < data_size; data = data->next, mp++)
+    emit_le(data->v);
+  emit_patch_begin(g_x86_mem_addr);
+  emit_mov_imm(ESI, mem_addr);
+  emit_patch_end();
+
+  emit_elf_data_header(3, emit_cnt(), data_size, IO_END);
+  emit_flush();
+  emit_elf_sections();
+}
+
+#ifdef X86_JIT
+
+static void x86_jit_emit(Module* module, int* pc2addr) {
+  emit_jit_prologue();
+  emit_zero_reg(A);
+  emit_zero_reg(B);
+  emit_zero_reg(C);
+  emit_zero_reg(D);
+  emit_zero_reg(BP);
+  emit_zero_reg(SP);
+  x86_emit_text(module, pc2addr, 0);
+  // Falling off the end of text.
+  emit_mov_imm(EDI, 1);
+  emit_jit_call(g_jit_fail);
+  g_jit_bad_jump = emit_cnt();
+  emit_mov_imm(EDI, 0);
+  emit_jit_call(g_jit_fail);
+  g_jit_putc_stub = emit_cnt();
+  emit_jit_io_stub(true);
+  g_jit_getc_stub = emit_cnt();
+  emit_jit_io_stub(false);
+}
 
+// Compiles the module into an executable buffer. The returned function
+// takes the base of a 1<<24 word memory. putc_fn(int) and getc_fn()
+// do I/O (getc_fn returns 0 on EOF) and fail_fn(int) must not return;
+// it is called with 0 for a jump to an invalid pc and 1 when execution
+// falls off the end of text.
+x86_jit_entry_t x86_jit_compile(Module* module, void* putc_fn,
+                                void* getc_fn, void* fail_fn) {
+  if (module->ext_ops & ~target_x86_ext_ops)
+    return NULL;
+  g_jit = true;
+  g_jit_num_pcs = module->num_pcs;
+  g_jit_putc = (uintptr_t)putc_fn;
+  g_jit_getc = (uintptr_t)getc_fn;
+  g_jit_fail = (uintptr_t)fail_fn;
+
+  // Immediate jumps may target any pc, so size the table to cover them
+  // and send the invalid ones to the bad_jump stub.
+  int num_targets = module->num_pcs;
   for (Inst* inst = module->text; inst; inst = inst->next) {
-    x86_emit_inst(inst, pc2addr, rodata_addr);
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM &&
+        inst->jmp.imm >= num_targets) {
+      num_targets = inst->jmp.imm + 1;
+    }
   }
+  int* pc2addr = calloc(num_targets, sizeof(int));
+
+  // The first passes only measure, until the jumps are relaxed.
+  // Addresses are fixed up by the last one, which emits the same number
+  // of bytes.
+  x86_init_jmps(module);
+  do {
+    emit_reset();
+    x86_jit_emit(module, pc2addr);
+    for (int i = 0; i < num_targets; i++) {
+      if (i >= module->num_pcs || !module->pc_lens[i])
+        pc2addr[i] = g_jit_bad_jump;
+    }
+  } while (x86_relax(pc2addr, num_targets));
+  int code_size = emit_cnt();
+  size_t size = code_size + module->num_pcs * 8;
+
+  byte* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    x86_free_jmps();
+    return NULL;
+  }
+  g_jit_base = (uintptr_t)buf;
+  g_jit_table = g_jit_base + code_size;
 
-  for (int i = 0; i < pc_cnt; i++) {
-    emit_le(ELF_TEXT_START + pc2addr[i] + ELF_HEADER_SIZE);
+  emit_reset();
+  emit_start_buffer(buf);
+  x86_jit_emit(module, pc2addr);
+  for (int i = 0; i < module->num_pcs; i++)
+    emit_imm64(g_jit_base + pc2addr[i]);
+  emit_reset();
+  g_jit = false;
+  free(g_jit_pc2addr);
+  g_jit_pc2addr = pc2addr;
+  g_jit_code_size = code_size;
+  x86_free_jmps();
+
+  if (mprotect(buf, size, PROT_READ | PROT_EXEC)) {
+    munmap(buf, size);
+    return NULL;
   }
+  return (x86_jit_entry_t)buf;
 }
+
+// Writes the code of the last x86_jit_compile as the "start size name"
+// lines perf reads from /tmp/perf-<pid>.map: a symbol per function of
+// pc_labels, and the entry and the stubs around them.
+void x86_jit_write_perf_map(Module* module, FILE* fp) {
+  int start = 0;
+  const char* name = "elvm_jit_entry";
+  int n = module->pc_labels ? module->num_pc_labels : 0;
+  for (int pc = 0; pc < n && pc < module->num_pcs; pc++) {
+    if (!module->pc_labels[pc] || !module->pc_lens[pc])
+      continue;
+    int addr = g_jit_pc2addr[pc];
+    if (addr > start)
+      fprintf(fp, "%lx %x %s\n", (unsigned long)(g_jit_base + start),
+              addr - start, name);
+    start = addr;
+    name = module->pc_labels[pc];
+  }
+  fprintf(fp, "%lx %x %s\n", (unsigned long)(g_jit_base + start),
+          g_jit_bad_jump - start, name);
+  fprintf(fp, "%lx %x elvm_jit_stubs\n",
+          (unsigned long)(g_jit_base + g_jit_bad_jump),
+          g_jit_code_size - g_jit_bad_jump);
+}
+
+#endif  // X86_JIT
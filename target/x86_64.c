@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ir/ir.h>
+#include <target/util.h>
+
+// Unlike x86, every ELVM register and the memory base live in their own
+// 64bit register, so RAX, RCX, RDX, RSI, RDI and R11 are free scratch
+// registers for division, shifts, block memory ops and system calls.
+const int target_x86_64_ext_ops = ALL_EXT_OPS;
+
+#define X64_RAX 0
+#define X64_RCX 1
+#define X64_RDX 2
+#define X64_RSI 6
+#define X64_RDI 7
+#define X64_MEM 8  // R8
+#define X64_R9 9
+#define X64_R10 10
+#define X64_R11 11
+
+static const int X64_REGNO[] = {
+  3,  // A - RBX
+  5,  // B - RBP
+  12,  // C - R12
+  13,  // D - R13
+  14,  // BP - R14
+  15,  // SP - R15
+};
+
+// The condition codes of JEQ..JGE and EQ..GE. The opposite condition
+// is cc ^ 1.
+static const int X64_CC[] = {
+  0x4, 0x5, 0xc, 0xf, 0xe, 0xd
+};
+
+static int x64_reg(Reg r) {
+  return X64_REGNO[r];
+}
+
+static void x64_op(int op) {
+  if (op > 0xff)
+    emit_1(op >> 8);
+  emit_1(op & 0xff);
+}
+
+// Emits a REX prefix when one is needed for the 64bit operand size (w)
+// or for R8-R15 as the ModRM reg, the SIB index or the ModRM r/m. force
+// makes SPL-DIL byte registers rather than AH-BH.
+static void x64_rex(int w, int reg, int idx, int rm, bool force) {
+  int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((idx >> 3) << 1) |
+      (rm >> 3);
+  if (rex != 0x40 || force)
+    emit_1(rex);
+}
+
+// op r/m, reg with both in registers. reg is the /digit of ops which
+// take an immediate.
+static void x64_rr(int op, int w, int rm, int reg) {
+  x64_rex(w, reg, 0, rm, false);
+  x64_op(op);
+  emit_1(0xc0 + ((reg & 7) << 3) + (rm & 7));
+}
+
+// op reg, [MEM+idx*scale+disp], or [MEM+disp] when idx is negative.
+static void x64_rm(int op, int w, int reg, int idx, int scale, int disp) {
+  x64_rex(w, reg, idx < 0 ? 0 : idx, X64_MEM, false);
+  x64_op(op);
+  int mod = !disp ? 0 : (disp >= -128 && disp < 128) ? 0x40 : 0x80;
+  if (idx < 0) {
+    emit_1(mod + ((reg & 7) << 3) + (X64_MEM & 7));
+  } else {
+    emit_1(mod + ((reg & 7) << 3) + 4);
+    emit_1((scale == 8 ? 0xc0 : scale == 4 ? 0x80 : 0) + ((idx & 7) << 3) +
+           (X64_MEM & 7));
+  }
+  if (mod == 0x40)
+    emit_1(disp & 0xff);
+  else if (mod == 0x80)
+    emit_le(disp);
+}
+
+// lea reg, [RIP+target], where target is an offset in the output.
+static void x64_lea_rip(int reg, int target) {
+  x64_rex(1, reg, 0, 0, false);
+  emit_2(0x8d, 0x05 + ((reg & 7) << 3));
+  emit_diff(target, emit_cnt() + 4);
+}
+
+static void x64_mov_imm(int r, int imm) {
+  x64_rex(0, 0, 0, r, false);
+  emit_1(0xb8 + (r & 7));
+  emit_le(imm);
+}
+
+static void x64_zero(int r) {
+  x64_rr(0x31, 0, r, r);
+}
+
+static void x64_mov(int r, Value* v) {
+  if (v->type == REG) {
+    if (x64_reg(v->reg) != r)
+      x64_rr(0x89, 0, r, x64_reg(v->reg));
+  } else {
+    x64_mov_imm(r, v->imm);
+  }
+}
+
+// op r/m32, imm by its /digit.
+static void x64_alu_imm(int digit, int r, int imm) {
+  if (imm >= -128 && imm < 128) {
+    x64_rr(0x83, 0, r, digit);
+    emit_1(imm & 0xff);
+  } else {
+    x64_rr(0x81, 0, r, digit);
+    emit_le(imm);
+  }
+}
+
+// ADD, OR, AND, SUB, XOR or CMP, by the opcode of their "op r/m32, r32"
+// form and the /digit of "op r/m32, imm32".
+static void x64_alu(int op, int digit, Reg dst, Value* src) {
+  if (src->type == REG) {
+    x64_rr(op, 0, x64_reg(dst), x64_reg(src->reg));
+  } else {
+    x64_alu_imm(digit, x64_reg(dst), src->imm);
+  }
+}
+
+static void x64_mask(Reg r) {
+  x64_alu_imm(4, x64_reg(r), 0xffffff);
+}
+
+static void x64_cmp(Inst* inst) {
+  x64_alu(0x39, 7, inst->dst.reg, &inst->src);
+}
+
+static void x64_setcc(Inst* inst) {
+  int r = x64_reg(inst->dst.reg);
+  x64_cmp(inst);
+  // mov keeps the flags, unlike xor.
+  x64_mov_imm(r, 0);
+  x64_rex(0, 0, 0, r, true);
+  emit_3(0x0f, 0x90 + X64_CC[inst->op - EQ], 0xc0 + (r & 7));
+}
+
+static void x64_syscall() {
+  emit_2(0x0f, 0x05);
+}
+
+// Emits a short jump whose displacement is set by x64_patch_jmp8.
+static int x64_jmp8(int op) {
+  emit_2(op, 0);
+  return emit_cnt();
+}
+
+static void x64_patch_jmp8(int end) {
+  int d = emit_cnt() - end;
+  emit_patch_begin(end - 1);
+  emit_1(d);
+  emit_patch_end();
+}
+
+static void x64_call(int addr) {
+  emit_1(0xe8);
+  emit_diff(addr, emit_cnt() + 4);
+}
+
+// DIV and MOD leave UINT_MAX and dst for a zero divisor, as eval_ext_op.
+static void x64_div(Inst* inst) {
+  int dst = x64_reg(inst->dst.reg);
+  if (inst->src.type == IMM && !inst->src.imm) {
+    if (inst->op == DIV)
+      x64_mov_imm(dst, 0xffffff);
+    return;
+  }
+  x64_rr(0x89, 0, X64_RAX, dst);
+  x64_mov(X64_RCX, &inst->src);
+  int zero = 0;
+  if (inst->src.type == REG) {
+    // test ECX, ECX; jz zero
+    x64_rr(0x85, 0, X64_RCX, X64_RCX);
+    zero = x64_jmp8(0x74);
+  }
+  x64_zero(X64_RDX);
+  // div ECX
+  x64_rr(0xf7, 0, X64_RCX, 6);
+  x64_rr(0x89, 0, dst, inst->op == DIV ? X64_RAX : X64_RDX);
+  if (!zero)
+    return;
+  if (inst->op == DIV) {
+    int done = x64_jmp8(0xeb);
+    x64_patch_jmp8(zero);
+    x64_mov_imm(dst, 0xffffff);
+    x64_patch_jmp8(done);
+  } else {
+    x64_patch_jmp8(zero);
+  }
+}
+
+// Shifts by 24 or more give 0, which x86 doesn't do by itself as it
+// takes the count modulo 32.
+static void x64_shift(Inst* inst) {
+  int dst = x64_reg(inst->dst.reg);
+  int digit = inst->op == SHL ? 4 : 5;
+  if (inst->src.type == IMM) {
+    if (inst->src.imm >= 24) {
+      x64_mov_imm(dst, 0);
+    } else if (inst->src.imm) {
+      x64_rr(0xc1, 0, dst, digit);
+      emit_1(inst->src.imm);
+      if (inst->op == SHL && !inst->unmasked)
+        x64_mask(inst->dst.reg);
+    }
+    return;
+  }
+  x64_mov(X64_RCX, &inst->src);
+  x64_rr(0x89, 0, X64_RAX, dst);
+  // shl/shr EAX, CL
+  x64_rr(0xd3, 0, X64_RAX, digit);
+  x64_zero(X64_RDX);
+  x64_alu_imm(7, X64_RCX, 24);
+  // cmovae EAX, EDX
+  x64_rr(0x0f43, 0, X64_RDX, X64_RAX);
+  x64_rr(0x89, 0, dst, X64_RAX);
+  if (inst->op == SHL && !inst->unmasked)
+    x64_mask(inst->dst.reg);
+}
+
+// MEMCPY and MEMSET by rep movsd/stosd, which take the pointers in RSI
+// and RDI, the count in ECX and the value in EAX.
+static void x64_mem_op(Inst* inst) {
+  x64_mov(X64_RDI, &inst->dst);
+  x64_mov(inst->op == MEMSET ? X64_RAX : X64_RSI, &inst->src);
+  x64_mov(X64_RCX, &inst->jmp);
+  // lea RDI, [MEM+RDI*4]
+  x64_rm(0x8d, 1, X64_RDI, X64_RDI, 4, 0);
+  if (inst->op == MEMSET) {
+    // rep stosd
+    emit_2(0xf3, 0xab);
+    return;
+  }
+  // lea RSI, [MEM+RSI*4]
+  x64_rm(0x8d, 1, X64_RSI, X64_RSI, 4, 0);
+  // cmp RDI, RSI; jbe forward
+  emit_3(0x48, 0x39, 0xf7);
+  emit_2(0x76, 16);
+  // Copies backward from the last words when the destination is after
+  // the source. lea RSI, [RSI+RCX*4-4]; lea RDI, [RDI+RCX*4-4]
+  emit_5(0x48, 0x8d, 0x74, 0x8e, 0xfc);
+  emit_5(0x48, 0x8d, 0x7c, 0x8f, 0xfc);
+  // std; rep movsd; cld; jmp done
+  emit_4(0xfd, 0xf3, 0xa5, 0xfc);
+  emit_2(0xeb, 2);
+  // forward: rep movsd
+  emit_2(0xf3, 0xa5);
+}
+
+// The I/O runtime is the one of x86: 4 KB of output and input buffers
+// after the ELVM memory, with the counts first.
+#define X64_IO_BUF_SIZE 4096
+#define X64_OUT_CNT (1 << 26)
+#define X64_IN_POS (X64_OUT_CNT + 4)
+#define X64_IN_CNT (X64_OUT_CNT + 8)
+#define X64_OUT_BUF (X64_OUT_CNT + 12)
+#define X64_IN_BUF (X64_OUT_BUF + X64_IO_BUF_SIZE)
+#define X64_IO_END (X64_IN_BUF + X64_IO_BUF_SIZE)
+
+static int g_x64_flush_addr;
+static int g_x64_getc_addr;
+// The offsets of the jump table and of the initial memory image, which
+// follow the code. Both are 0 in the first pass.
+static int g_x64_table;
+static int g_x64_image;
+static int g_x64_image_lea;
+
+static void x64_emit_flush_func() {
+  g_x64_flush_addr = emit_cnt();
+  x64_mov_imm(X64_RDI, 1);  // stdout
+  // lea RSI, [MEM+OUT_BUF]; mov EDX, [MEM+OUT_CNT]
+  x64_rm(0x8d, 1, X64_RSI, -1, 1, X64_OUT_BUF);
+  x64_rm(0x8b, 0, X64_RDX, -1, 1, X64_OUT_CNT);
+  int loop = emit_cnt();
+  // test EDX, EDX; jz done
+  x64_rr(0x85, 0, X64_RDX, X64_RDX);
+  int done1 = x64_jmp8(0x74);
+  x64_mov_imm(X64_RAX, 1);  // write
+  x64_syscall();
+  // test RAX, RAX; jle done
+  x64_rr(0x85, 1, X64_RAX, X64_RAX);
+  int done2 = x64_jmp8(0x7e);
+  // add RSI, RAX; sub EDX, EAX; jmp loop
+  x64_rr(0x01, 1, X64_RSI, X64_RAX);
+  x64_rr(0x29, 0, X64_RDX, X64_RAX);
+  emit_2(0xeb, loop - emit_cnt() - 2);
+  x64_patch_jmp8(done1);
+  x64_patch_jmp8(done2);
+  // mov dword [MEM+OUT_CNT], 0; ret
+  x64_rm(0xc7, 0, 0, -1, 1, X64_OUT_CNT);
+  emit_le(0);
+  emit_1(0xc3);
+}
+
+// Returns the next input byte, or 0 at EOF, in EAX.
+static void x64_emit_getc_func() {
+  g_x64_getc_addr = emit_cnt();
+  // mov EAX, [MEM+IN_POS]; cmp EAX, [MEM+IN_CNT]; jb have
+  x64_rm(0x8b, 0, X64_RAX, -1, 1, X64_IN_POS);
+  x64_rm(0x3b, 0, X64_RAX, -1, 1, X64_IN_CNT);
+  int have = x64_jmp8(0x72);
+  x64_call(g_x64_flush_addr);
+  x64_zero(X64_RDI);  // stdin
+  x64_rm(0x8d, 1, X64_RSI, -1, 1, X64_IN_BUF);
+  x64_mov_imm(X64_RDX, X64_IO_BUF_SIZE);
+  x64_zero(X64_RAX);  // read
+  x64_syscall();
+  // test EAX, EAX; jg filled; xor EAX, EAX
+  x64_rr(0x85, 0, X64_RAX, X64_RAX);
+  int filled = x64_jmp8(0x7f);
+  x64_zero(X64_RAX);
+  x64_patch_jmp8(filled);
+  // mov [MEM+IN_CNT], EAX; mov dword [MEM+IN_POS], 0
+  x64_rm(0x89, 0, X64_RAX, -1, 1, X64_IN_CNT);
+  x64_rm(0xc7, 0, 0, -1, 1, X64_IN_POS);
+  emit_le(0);
+  // test EAX, EAX; jz done (EAX is 0 at EOF); xor EAX, EAX
+  x64_rr(0x85, 0, X64_RAX, X64_RAX);
+  int eof = x64_jmp8(0x74);
+  x64_zero(X64_RAX);
+  x64_patch_jmp8(have);
+  // movzx ECX, byte [MEM+RAX+IN_BUF]; inc EAX; mov [MEM+IN_POS], EAX
+  x64_rm(0x0fb6, 0, X64_RCX, X64_RAX, 1, X64_IN_BUF);
+  x64_rr(0xff, 0, X64_RAX, 0);
+  x64_rm(0x89, 0, X64_RAX, -1, 1, X64_IN_POS);
+  x64_rr(0x89, 0, X64_RAX, X64_RCX);
+  x64_patch_jmp8(eof);
+  emit_1(0xc3);
+}
+
+static void x64_putc(Inst* inst) {
+  x64_mov(X64_RAX, &inst->src);
+  // mov ECX, [MEM+OUT_CNT]; mov [MEM+RCX+OUT_BUF], AL
+  x64_rm(0x8b, 0, X64_RCX, -1, 1, X64_OUT_CNT);
+  x64_rm(0x88, 0, X64_RAX, X64_RCX, 1, X64_OUT_BUF);
+  // inc ECX; mov [MEM+OUT_CNT], ECX
+  x64_rr(0xff, 0, X64_RCX, 0);
+  x64_rm(0x89, 0, X64_RCX, -1, 1, X64_OUT_CNT);
+  // cmp ECX, IO_BUF_SIZE; jb skip
+  x64_alu_imm(7, X64_RCX, X64_IO_BUF_SIZE);
+  int skip = x64_jmp8(0x72);
+  x64_call(g_x64_flush_addr);
+  x64_patch_jmp8(skip);
+}
+
+// The number of words up to the last non-zero one.
+static int x64_image_size(Data* data) {
+  int n = 0;
+  for (int mp = 0; data; data = data->next, mp++) {
+    if (data->v)
+      n = mp + 1;
+  }
+  return n;
+}
+
+static void x64_init_state(Data* data) {
+  x64_mov_imm(X64_RAX, 9);  // mmap
+  x64_zero(X64_RDI);
+  x64_mov_imm(X64_RSI, X64_IO_END);
+  x64_mov_imm(X64_RDX, 3);  // PROT_READ | PROT_WRITE
+  x64_mov_imm(X64_R10, 0x22);  // MAP_PRIVATE | MAP_ANONYMOUS
+  // mov R8, -1
+  x64_rr(0xc7, 1, X64_MEM, 0);
+  emit_le(-1);
+  x64_zero(X64_R9);
+  x64_syscall();
+  // mov MEM, RAX
+  x64_rr(0x89, 1, X64_MEM, X64_RAX);
+
+  // Copies the initial memory from the image after the code.
+  int n = x64_image_size(data);
+  if (n) {
+    g_x64_image_lea = emit_cnt();
+    x64_lea_rip(X64_RSI, g_x64_image);
+    x64_rr(0x89, 1, X64_RDI, X64_MEM);
+    x64_mov_imm(X64_RCX, n);
+    // rep movsd
+    emit_2(0xf3, 0xa5);
+  }
+
+  for (int i = 0; i < 6; i++)
+    x64_zero(X64_REGNO[i]);
+
+  // jmp over the I/O functions
+  emit_1(0xe9);
+  int over = emit_cnt();
+  emit_le(0);
+  x64_emit_flush_func();
+  x64_emit_getc_func();
+  int end = emit_cnt();
+  emit_patch_begin(over);
+  emit_diff(end, over + 4);
+  emit_patch_end();
+}
+
+// lea R11, [RIP+table]; jmp [R11+reg*8]
+#define X64_JMP_REG_SIZE 11
+
+static void x64_jmp_reg(Reg reg) {
+  int r = x64_reg(reg);
+  x64_lea_rip(X64_R11, g_x64_table);
+  emit_4(0x41 + ((r >> 3) << 1), 0xff, 0x24, 0xc3 + ((r & 7) << 3));
+}
+
+static void x64_jcc(Inst* inst, int* pc2addr) {
+  if (inst->op != JMP) {
+    int cc = X64_CC[inst->op - JEQ];
+    x64_cmp(inst);
+    if (inst->jmp.type == REG) {
+      emit_2(0x70 + (cc ^ 1), X64_JMP_REG_SIZE);
+    } else {
+      emit_2(0x0f, 0x80 + cc);
+      emit_diff(pc2addr[inst->jmp.imm], emit_cnt() + 4);
+      return;
+    }
+  }
+
+  if (inst->jmp.type == REG) {
+    x64_jmp_reg(inst->jmp.reg);
+  } else {
+    emit_1(0xe9);
+    emit_diff(pc2addr[inst->jmp.imm], emit_cnt() + 4);
+  }
+}
+
+static void x64_emit_inst(Inst* inst, int* pc2addr) {
+  int dst = x64_reg(inst->dst.reg);
+  switch (inst->op) {
+    case MOV:
+      x64_mov(dst, &inst->src);
+      break;
+
+    case ADD:
+      x64_alu(0x01, 0, inst->dst.reg, &inst->src);
+      if (!inst->unmasked)
+        x64_mask(inst->dst.reg);
+      break;
+
+    case SUB:
+      x64_alu(0x29, 5, inst->dst.reg, &inst->src);
+      if (!inst->unmasked)
+        x64_mask(inst->dst.reg);
+      break;
+
+    case LOAD:
+    case STORE:
+      if (inst->src.type == REG) {
+        x64_rm(inst->op == LOAD ? 0x8b : 0x89, 0, dst,
+               x64_reg(inst->src.reg), 4, 0);
+      } else {
+        x64_rm(inst->op == LOAD ? 0x8b : 0x89, 0, dst,
+               -1, 1, inst->src.imm * 4);
+      }
+      break;
+
+    case PUTC:
+      x64_putc(inst);
+      break;
+
+    case GETC:
+      x64_call(g_x64_getc_addr);
+      x64_rr(0x89, 0, dst, X64_RAX);
+      break;
+
+    case EXIT:
+      x64_call(g_x64_flush_addr);
+      x64_zero(X64_RDI);
+      x64_mov_imm(X64_RAX, 60);  // exit
+      x64_syscall();
+      break;
+
+    case DUMP:
+      break;
+
+    case EQ:
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+      x64_setcc(inst);
+      break;
+
+    case MUL:
+      if (inst->src.type == REG) {
+        // imul dst, src
+        x64_rr(0x0faf, 0, x64_reg(inst->src.reg), dst);
+      } else {
+        x64_rr(0x69, 0, dst, dst);
+        emit_le(inst->src.imm);
+      }
+      if (!inst->unmasked)
+        x64_mask(inst->dst.reg);
+      break;
+
+    case DIV:
+    case MOD:
+      x64_div(inst);
+      break;
+
+    case AND:
+      x64_alu(0x21, 4, inst->dst.reg, &inst->src);
+      break;
+
+    case OR:
+      x64_alu(0x09, 1, inst->dst.reg, &inst->src);
+      break;
+
+    case XOR:
+      x64_alu(0x31, 6, inst->dst.reg, &inst->src);
+      break;
+
+    case SHL:
+    case SHR:
+      x64_shift(inst);
+      break;
+
+    case MEMCPY:
+    case MEMSET:
+      x64_mem_op(inst);
+      break;
+
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JGT:
+    case JLE:
+    case JGE:
+    case JMP:
+      x64_jcc(inst, pc2addr);
+      break;
+
+    default:
+      error("oops");
+  }
+}
+
+void target_x86_64(Module* module) {
+  emit_reset();
+  emit_start_code();
+  g_x64_table = 0;
+  g_x64_image = 0;
+  x64_init_state(module->data);
+
+  int pc_cnt = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    pc_cnt++;
+  }
+
+  // As in x86, jumps and the RIP-relative references to the jump table
+  // and the memory image after the code are emitted again in place once
+  // the layout is known.
+  int* pc2addr = calloc(pc_cnt, sizeof(int));
+  Inst** jmps = calloc(pc_cnt, sizeof(Inst*));
+  int* jmp_addrs = calloc(pc_cnt, sizeof(int));
+  int num_jmps = 0;
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      pc2addr[inst->pc] = emit_cnt();
+    }
+    prev_pc = inst->pc;
+    if (inst->op >= JEQ && inst->op <= JMP) {
+      jmps[num_jmps] = inst;
+      jmp_addrs[num_jmps++] = emit_cnt();
+    }
+    x64_emit_inst(inst, pc2addr);
+  }
+
+  g_x64_table = emit_cnt();
+  g_x64_image = g_x64_table + pc_cnt * 8;
+  set_elf_symbols(module, pc2addr, ELF64_HEADER_SIZE, g_x64_table);
+
+  for (int i = 0; i < num_jmps; i++) {
+    emit_patch_begin(jmp_addrs[i]);
+    x64_emit_inst(jmps[i], pc2addr);
+    emit_patch_end();
+  }
+  int n = x64_image_size(module->data);
+  if (n) {
+    emit_patch_begin(g_x64_image_lea);
+    x64_lea_rip(X64_RSI, g_x64_image);
+    emit_patch_end();
+  }
+
+  for (int i = 0; i < pc_cnt; i++) {
+    emit_le(ELF_TEXT_START + pc2addr[i] + ELF64_HEADER_SIZE);
+    emit_le(0);
+  }
+  Data* data = module->data;
+  for (int mp = 0; mp < n; data = data->next, mp++)
+    emit_le(data->v);
+
+  emit_elf64_header(62, emit_cnt());
+  emit_flush();
+  emit_elf_sections();
+}
@@ -0,0 +1,82 @@
+M = 16777215
+REGS = %w(A B C D BP SP)
+
+OPS = {
+  'mul' => ->(x, y){ (x * y) & M },
+  'div' => ->(x, y){ y == 0 ? M : x / y },
+  'mod' => ->(x, y){ y == 0 ? x : x % y },
+  'and' => ->(x, y){ x & y },
+  'or' => ->(x, y){ x | y },
+  'xor' => ->(x, y){ x ^ y },
+  'shl' => ->(x, y){ y < 24 ? (x << y) & M : 0 },
+  'shr' => ->(x, y){ y < 24 ? x >> y : 0 },
+}
+
+CASES = [
+  [0, 0], [1, 0], [7, 3], [M, M], [4096, 4096], [12345, 678],
+  [M, 1], [8388608, 2], [100, 23], [100, 24], [100, M],
+  [5592405, 11184810],
+]
+
+def emit_print(m)
+  m.each_byte{|b|
+    puts "putc #{b}"
+  }
+end
+
+$label = 0
+
+# Prints '.' if reg is v and 'X' otherwise.
+def emit_check(reg, v)
+  $label += 1
+  puts "jeq ok#{$label}, #{reg}, #{v}"
+  puts "putc 88"
+  puts "jmp next#{$label}"
+  puts "ok#{$label}:"
+  puts "putc 46"
+  puts "next#{$label}:"
+end
+
+n = 0
+OPS.each do |name, f|
+  emit_print("#{name}: ")
+  CASES.each do |x, y|
+    dst = REGS[n % 6]
+    others = REGS - [dst]
+    others.each_with_index do |r, i|
+      puts "mov #{r}, #{1000 + i}"
+    end
+    puts "mov #{dst}, #{x}"
+    if n % 3 == 0
+      src = y
+    elsif n % 7 == 1
+      # The source is the destination itself.
+      src = dst
+      y = x
+    else
+      src = others[n % 5]
+      puts "mov #{src}, #{y}"
+    end
+    puts "#{name} #{dst}, #{src}"
+    emit_check(dst, f[x, y])
+    others.each_with_index do |r, i|
+      emit_check(r, r == src ? y : 1000 + i)
+    end
+    puts "putc 32"
+    n += 1
+  end
+  emit_print("\n")
+end
+
+# An op in a loop whose block falls through.
+emit_print("loop: ")
+puts "mov A, 1"
+puts "mov B, 1"
+puts "loop:"
+puts "mul A, B"
+puts "add B, 1"
+puts "jle loop, B, 8"
+emit_check('A', 40320)
+emit_check('B', 9)
+emit_print("\n")
+puts "exit"
@@ -0,0 +1,60 @@
+#define ELVM_MALLOC_FREE_LIST
+#include <stdio.h>
+#include <stdlib.h>
+
+static int* make(int n, int v) {
+  int* p = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    p[i] = v + i;
+  return p;
+}
+
+static int sum(int* p, int n) {
+  int s = 0;
+  for (int i = 0; i < n; i++)
+    s += p[i];
+  return s;
+}
+
+int main() {
+  int* live[64];
+  for (int i = 0; i < 64; i++)
+    live[i] = make(i % 7 + 1, i);
+  // Frees every other block and refills the holes.
+  for (int i = 0; i < 64; i += 2)
+    free(live[i]);
+  for (int i = 0; i < 64; i += 2)
+    live[i] = make(i % 7 + 1, i);
+  int s = 0;
+  for (int i = 0; i < 64; i++)
+    s += sum(live[i], i % 7 + 1);
+  printf("%d\n", s);
+
+  // Freed neighbors are merged for a larger request.
+  for (int i = 0; i < 64; i++)
+    free(live[i]);
+  int* big = make(200, 1);
+  printf("%d\n", sum(big, 200));
+
+  int* p = make(10, 100);
+  int* q = make(3, 0);
+  p = realloc(p, 50 * sizeof(int));
+  for (int i = 10; i < 50; i++)
+    p[i] = 100 + i;
+  printf("%d %d\n", sum(p, 50), sum(q, 3));
+  p = realloc(p, 5 * sizeof(int));
+  printf("%d\n", sum(p, 5));
+  free(q);
+  free(p);
+  free(big);
+
+  int* z = calloc(8, sizeof(int));
+  printf("%d\n", sum(z, 8));
+  int* r = realloc(NULL, 4 * sizeof(int));
+  r[3] = 7;
+  printf("%d\n", r[3]);
+  free(r);
+  free(z);
+  free(NULL);
+  return 0;
+}
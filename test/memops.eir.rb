@@ -0,0 +1,82 @@
+BASE = 100
+SIZE = 16
+REGS = %w(A B C D BP SP)
+
+# [op, dst, src, count], as offsets from BASE for addresses.
+CASES = [
+  ['memcpy', 0, 8, 4],
+  ['memcpy', 2, 0, 8],
+  ['memcpy', 0, 3, 10],
+  ['memcpy', 5, 5, 6],
+  ['memcpy', 4, 1, 0],
+  ['memset', 3, 777, 5],
+  ['memset', 0, 0, 0],
+  ['memset', 15, 42, 1],
+  ['memcpy', 0, 1, 15],
+  ['memcpy', 1, 0, 15],
+]
+
+def emit_print(m)
+  m.each_byte{|b|
+    puts "putc #{b}"
+  }
+end
+
+$label = 0
+
+# Prints '.' if reg is v and 'X' otherwise.
+def emit_check(reg, v)
+  $label += 1
+  puts "jeq ok#{$label}, #{reg}, #{v}"
+  puts "putc 88"
+  puts "jmp next#{$label}"
+  puts "ok#{$label}:"
+  puts "putc 46"
+  puts "next#{$label}:"
+end
+
+mem = (0...SIZE).map{|i| i + 1}
+mem.each_with_index do |v, i|
+  puts "mov A, #{v}"
+  puts "store A, #{BASE + i}"
+end
+
+CASES.each_with_index do |(op, d, s, n), ci|
+  emit_print("#{op}: ")
+  if op == 'memcpy'
+    mem[d, n] = mem[s, n]
+    sv = BASE + s
+  else
+    mem[d, n] = [s] * n
+    sv = s
+  end
+
+  # Rotates the operands through the registers, with immediates for
+  # some of them.
+  dst = REGS[ci % 6]
+  src = REGS[(ci + 2) % 6]
+  cnt = REGS[(ci + 4) % 6]
+  src = sv if ci % 3 == 1
+  cnt = n if ci % 4 == 2
+  vals = {}
+  REGS.each_with_index do |r, i|
+    vals[r] = 1000 + i
+  end
+  vals[dst] = BASE + d
+  vals[src] = sv if src.is_a?(String)
+  vals[cnt] = n if cnt.is_a?(String)
+  vals.each do |r, v|
+    puts "mov #{r}, #{v}"
+  end
+  puts "#{op} #{dst}, #{src}, #{cnt}"
+  vals.each do |r, v|
+    emit_check(r, v)
+  end
+  puts "putc 32"
+  mem.each_with_index do |v, i|
+    puts "load A, #{BASE + i}"
+    emit_check('A', v)
+  end
+  emit_print("\n")
+end
+puts "exit"
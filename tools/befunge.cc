@@ -4,6 +4,7 @@
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
 #include <stack>
 #include <vector>
 #include <unordered_map>
@@ -35,6 +36,11 @@
 #define OP_HIF_TRUE 20
 #define OP_VIF_FALSE 21
 #define OP_HIF_FALSE 22
+// fused INT INT REM and INT INT WEM, which hold the cell
+#define OP_REMC 23
+#define OP_WEMC 24
+// the code from here was invalidated by a write to one of its cells
+#define OP_DEOPT 25
 #define OP_IF_TRUE_RANGE 19 ... 20
 #define OP_IF_FALSE_RANGE 21 ... 22
 
@@ -52,17 +58,23 @@ struct cell {
 	int32_t val;
 	// store whether we execute a cell to avoid recompile when modifying non executable cells
 	bool exec;
+	// code offsets whose code depends on this cell, to be deoptimized when it's written
+	std::vector<size_t> uses;
+	// bumped when uses is cleared
+	uint32_t gen;
 
 	cell(){
 		memset(joff, -1, sizeof(joff));
 		val = 0;
 		exec = false;
+		gen = 0;
 	}
 
 	cell(int32_t v){
 		memset(joff, -1, sizeof(joff));
 		val = v;
 		exec = false;
+		gen = 0;
 	}
 };
 
@@ -78,9 +90,55 @@ struct hash_coord {
 	}
 };
 
+// grow v, whose first element is index base, to hold index i
+template<typename T> void grow(std::vector<T>&v, int32_t&base, int32_t i, const T&fill){
+	int32_t n = v.size();
+	if (!n) {
+		base = i;
+		v.push_back(fill);
+	} else if (i < base) {
+		int32_t k = std::max(base - i, n);
+		v.insert(v.begin(), k, fill);
+		base -= k;
+	} else {
+		v.resize(std::max(i - base + 1, 2*n), fill);
+	}
+}
+
+// the playfield: cells within NEAR of the origin live in tiles of TW by TH, held per tile column
+// in directories covering the touched tile rows, the rest in a hash map.
+// cells never move, code holds pointers to them
+struct grid {
+	static const int32_t TWB = 3, THB = 5, TW = 1<<TWB, TH = 1<<THB, NEAR = 1<<25;
+	struct column {
+		int32_t y0; // tile row of tiles[0]
+		std::vector<cell*> tiles;
+	};
+	int32_t x0; // tile column of cols[0]
+	std::vector<column> cols;
+	std::unordered_map<coord, cell, hash_coord> far;
+
+	cell&operator[](const coord&xy){
+		if (xy.x < -NEAR || xy.x >= NEAR || xy.y < -NEAR || xy.y >= NEAR) {
+			return far[xy];
+		}
+		int32_t tx = xy.x >> TWB, ty = xy.y >> THB;
+		if (tx < x0 || tx - x0 >= (int32_t)cols.size()) {
+			grow(cols, x0, tx, column());
+		}
+		column&c = cols[tx - x0];
+		if (ty < c.y0 || ty - c.y0 >= (int32_t)c.tiles.size()) {
+			grow(c.tiles, c.y0, ty, (cell*)nullptr);
+		}
+		cell*&t = c.tiles[ty - c.y0];
+		if (!t) t = new cell[TW*TH];
+		return t[(xy.y & (TH-1))*TW + (xy.x & (TW-1))];
+	}
+};
+
 std::stack<int32_t, std::vector<int32_t>> st;
 std::vector<uint8_t> code;
-std::unordered_map<coord, cell, hash_coord> ps;
+grid ps;
 int32_t mnx, mny, mxx, mxy; // all coords of ps fall within these
 
 // convert character value to interpreter opcode
@@ -121,6 +179,29 @@ void pushint32(int32_t val){
 	*(int32_t*)&code[code.size() - 4] = val;
 }
 
+// where code at a deoptimized offset resumes: the cursor of the first cell compiled into it
+struct deopt {
+	coord xy;
+	uint8_t dir;
+	// the joff which points at the offset, if any
+	size_t*joff;
+	// the recompiled code, once it's been run
+	size_t target;
+};
+std::unordered_map<size_t, deopt> deopts;
+
+// a write to an executed cell only throws away the code compiled from it
+void invalidate(cell*ch){
+	for (size_t o : ch->uses) {
+		code[o] = OP_DEOPT;
+		deopts[o].target = -1;
+	}
+	ch->uses.clear();
+	ch->gen++;
+	memset(ch->joff, -1, sizeof(ch->joff));
+	ch->exec = false;
+}
+
 coord readcoord(size_t offs){
 	return coord {
 		.x = readint32(offs),
@@ -163,6 +244,16 @@ struct cursor {
 			size_t code;
 		};
 		std::vector<PeepData> peep;
+		// every cell compiled, with its entry in uses, and the offsets which may be deoptimized
+		struct Trail {
+			cell*ch;
+			size_t use;
+			uint32_t gen;
+		};
+		std::vector<Trail> trail;
+		std::vector<size_t> marks(1, code.size());
+		deopt first = { .xy = xy, .dir = dir, .joff = nullptr, .target = (size_t)-1 };
+		deopts[code.size()] = first;
 		while(true){
 			cell*ch = &ps[xy];
 			if (ch->joff[dir] != (size_t)-1){
@@ -175,6 +266,10 @@ struct cursor {
 			}
 			int op=opc(ch->val);
 			ch->exec = true;
+			deopt here = { .xy = xy, .dir = dir, .joff = nullptr, .target = (size_t)-1 };
+			size_t at = code.size();
+			size_t trail_at = trail.size();
+			cell*written = nullptr;
 			if (op < 30) {
 				// op >= 30 is movement; only store joff on codegen ops
 				// this way peephole doesn't have to fix up multiple cells
@@ -284,24 +379,37 @@ struct cursor {
 					peep.resize(peep.size()-2);
 					code.resize(code.size()-10); // truncate to first const op
 					pushint32(st.size()?st.top():0);
+				} else if(op==24 && peep.size()>2 && code[peep[peep.size()-2].code]==OP_INT && code[peep[peep.size()-3].code]==OP_INT){
+					coord getxy = {
+						.x = readint32(peep[peep.size()-3].code+1),
+						.y = readint32(peep[peep.size()-2].code+1),
+					};
+					*peep[peep.size()-1].joff = -1;
+					if (peep[peep.size()-2].joff) *peep[peep.size()-2].joff = -1;
+					peep.resize(peep.size()-2);
+					code.resize(code.size()-11);
+					code.push_back(OP_REMC);
+					pushsize((size_t)&ps[getxy]);
 				}
 			case(25){
 				coord putxy;
 				putxy.y = pop();
 				putxy.x = pop();
-				cell*ch = &ps[putxy];
-				ch->val = pop();
-				if (ch->exec){
-					code.clear();
-					peep.clear();
-					for (auto& kv : ps) {
-						memset(kv.second.joff, -1, sizeof(kv.second.joff));
-						kv.second.exec = false;
-					}
+				cell*pch = &ps[putxy];
+				pch->val = pop();
+				// invalidated once this step's code and cells are known
+				if (pch->exec) written = pch;
+				if (peep.size()>2 && code[peep[peep.size()-2].code]==OP_INT && code[peep[peep.size()-3].code]==OP_INT){
+					*peep[peep.size()-1].joff = -1;
+					if (peep[peep.size()-2].joff) *peep[peep.size()-2].joff = -1;
+					peep.resize(peep.size()-2);
+					code.resize(code.size()-10);
+					code.push_back(OP_WEMC);
+					pushsize((size_t)pch);
 				} else {
 					code.push_back(OP_WEM);
-					pushcurse();
 				}
+				pushcurse();
 			}
 			case(26){
 				dir = rand()&3;
@@ -336,6 +444,8 @@ struct cursor {
 						break;
 					}
 					j = 0;
+					trail.push_back(Trail { .ch = sch, .use = sch->uses.size(), .gen = sch->gen });
+					sch->uses.push_back(0);
 					st.push(sch->val);
 					PeepData pd = {
 						.joff = nullptr,
@@ -351,6 +461,32 @@ struct cursor {
 			case(32 ... 35)dir=op&3;
 			case(36);
 			}
+			// attribute the cells of this step to the offset a write to them deoptimizes: the new
+			// code if there is some, else the last offset still known to start with a cell
+			trail.push_back(Trail { .ch = ch, .use = ch->uses.size(), .gen = ch->gen });
+			ch->uses.push_back(0);
+			size_t a;
+			if (code.size() > at && !peep.empty() && peep.back().code >= at) {
+				a = at;
+				if (marks.back() == at) {
+					deopts[at].joff = ch->joff[dir] == at ? ch->joff+dir : nullptr;
+				} else {
+					here.joff = ch->joff[dir] == at ? ch->joff+dir : nullptr;
+					deopts[at] = here;
+					marks.push_back(at);
+				}
+			} else {
+				size_t last = peep.empty() ? marks[0] : peep.back().code;
+				while (marks.back() > last) marks.pop_back();
+				a = marks.back();
+			}
+			for (size_t i = trail.size(); i-- > 0;) {
+				Trail& t = trail[i];
+				if (t.gen != t.ch->gen) continue;
+				if (i < trail_at && t.ch->uses[t.use] <= a) break;
+				t.ch->uses[t.use] = a;
+			}
+			if (written) invalidate(written);
 			mv();
 		}
 	}
@@ -448,6 +584,10 @@ int main(int,char**argv){
 			getxy.x=pop();
 			st.push(ps[getxy].val);
 		}
+		case(OP_REMC){
+			st.push(((cell*)readsize(pc))->val);
+			pc += sizeof(size_t);
+		}
 		case(OP_WEM){
 			coord putxy;
 			putxy.y=pop();
@@ -455,17 +595,25 @@ int main(int,char**argv){
 			int32_t z=pop();
 			cell*ch=&ps[putxy];
 			ch->val = z;
-			if (ch->exec){
-				curse.readcurse(pc);
-				code.clear();
-				for (auto& kv : ps) {
-					memset(kv.second.joff, -1, sizeof(kv.second.joff));
-					kv.second.exec = false;
-				}
-				curse.mv();
+			if (ch->exec) invalidate(ch);
+			pc += 9;
+		}
+		case(OP_WEMC){
+			cell*ch=(cell*)readsize(pc);
+			ch->val = pop();
+			if (ch->exec) invalidate(ch);
+			pc += sizeof(size_t) + 9;
+		}
+		case(OP_DEOPT){
+			deopt&d = deopts[pc-1];
+			if (d.target == (size_t)-1){
+				if (d.joff && *d.joff == pc-1) *d.joff = -1;
+				d.target = code.size();
+				curse.xy = d.xy;
+				curse.dir = d.dir;
 				pc = curse.compile();
 			} else {
-				pc += 9;
+				pc = d.target;
 			}
 		}
 		case(OP_RNG){
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+#
+# Benchmarks a backend over EIR files, usually bench/ built by
+# `make bench-<target>`:
+#
+#   tools/bench.py <target> '<runner>' <report.tsv> <eir>...
+#
+# For each EIR it measures elc's compile time, the generated code size,
+# and the wall time and peak RSS of running the code with <runner> (or
+# directly, if it is empty) on the input next to the EIR (foo.in for
+# foo.eir). The output is checked against eli's. Runners which compile
+# first (e.g., tools/runc.sh) include that in the run time. Linux
+# carries the RSS of the forked harness over exec, so the peak RSS
+# never reads below that of this script (about 10 MB).
+#
+# The report is a TSV with a header line, one row per EIR, tagged with
+# the commit. Compare two of them with
+#
+#   tools/bench.py -c <old.tsv> <new.tsv>
+
+import os
+import subprocess
+import sys
+import time
+
+ELC = 'out/elc'
+ELI = 'out/eli'
+TIMEOUT = float(os.environ.get('BENCH_TIMEOUT', '600'))
+COLUMNS = ['commit', 'target', 'bench', 'elc_sec', 'code_bytes',
+           'run_sec', 'run_rss_kb', 'status']
+
+
+def measure(cmd, stdin, stdout):
+    """Runs cmd and returns (status, seconds, peak RSS in KB)."""
+    start = time.time()
+    proc = subprocess.Popen(cmd, stdin=stdin, stdout=stdout,
+                            stderr=subprocess.DEVNULL)
+    # wait4 gives the peak RSS of the process and its waited children.
+    timed_out = False
+    while True:
+        pid, status, rusage = os.wait4(proc.pid, os.WNOHANG)
+        if pid:
+            break
+        if time.time() > start + TIMEOUT:
+            proc.kill()
+            pid, status, rusage = os.wait4(proc.pid, 0)
+            timed_out = True
+            break
+        time.sleep(0.005)
+    elapsed = time.time() - start
+    proc.returncode = status
+    if timed_out:
+        result = 'timeout'
+    elif os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0:
+        result = 'ok'
+    else:
+        result = 'fail'
+    return result, elapsed, rusage.ru_maxrss
+
+
+def read_input(eir, target):
+    path = os.path.splitext(eir)[0] + '.in'
+    data = b''
+    if os.path.exists(path):
+        with open(path, 'rb') as f:
+            data = f.read()
+    # The same conventions as runtest.sh.
+    if target == 'ws':
+        data += b'\0'
+    elif target == 'sed':
+        data += b'\n'
+    return data
+
+
+def run_with_input(cmd, data, out_path):
+    in_path = out_path + '.stdin'
+    with open(in_path, 'wb') as f:
+        f.write(data)
+    with open(in_path, 'rb') as stdin, open(out_path, 'wb') as stdout:
+        r = measure(cmd, stdin, stdout)
+    os.remove(in_path)
+    return r
+
+
+def expected_output(eir):
+    path = eir + '.out'
+    if (not os.path.exists(path) or
+        os.path.getmtime(path) < os.path.getmtime(eir)):
+        status, _, _ = run_with_input([ELI, eir], read_input(eir, 'eli'),
+                                      path)
+        if status != 'ok':
+            sys.exit('%s: eli failed' % eir)
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def commit():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', '--short', 'HEAD'],
+            stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return '-'
+
+
+def bench(target, runner, eir):
+    name = os.path.basename(eir).split('.')[0]
+    code = '%s.%s' % (eir, target)
+    with open(code, 'wb') as stdout:
+        status, elc_sec, _ = measure([ELC, '-' + target, eir], None, stdout)
+    row = {'bench': name, 'elc_sec': '%.3f' % elc_sec,
+           'code_bytes': '-', 'run_sec': '-', 'run_rss_kb': '-',
+           'status': status}
+    if status != 'ok':
+        row['status'] = 'elc_' + status
+        return row
+    os.chmod(code, 0o755)
+    row['code_bytes'] = str(os.path.getsize(code))
+
+    cmd = runner.split() + [code] if runner else [os.path.abspath(code)]
+    out = code + '.out'
+    status, run_sec, rss = run_with_input(cmd, read_input(eir, target), out)
+    row['run_sec'] = '%.3f' % run_sec
+    row['run_rss_kb'] = str(rss)
+    if status == 'ok':
+        with open(out, 'rb') as f:
+            actual = f.read()
+        if target == 'sed' and actual.endswith(b'\n'):
+            actual = actual[:-1]
+        if actual != expected_output(eir):
+            status = 'wrong'
+    row['status'] = status
+    return row
+
+
+def read_report(path):
+    with open(path) as f:
+        lines = [l.rstrip('\n').split('\t') for l in f]
+    header = lines[0]
+    return {(r['target'], r['bench']): r
+            for r in (dict(zip(header, l)) for l in lines[1:])}
+
+
+def ratio(old, new):
+    try:
+        o = float(old)
+        n = float(new)
+    except ValueError:
+        return '-'
+    if o == 0:
+        return '-'
+    return '%.2fx' % (n / o)
+
+
+def compare(old_path, new_path):
+    old = read_report(old_path)
+    new = read_report(new_path)
+    print('%-8s %-10s %10s %10s %10s %10s  %s' %
+          ('target', 'bench', 'run_sec', 'rss', 'code', 'elc_sec',
+           'status'))
+    for key in sorted(set(old) | set(new)):
+        o = old.get(key)
+        n = new.get(key)
+        if not o or not n:
+            print('%-8s %-10s only in %s' %
+                  (key[0], key[1], old_path if o else new_path))
+            continue
+        status = n['status'] if o['status'] == n['status'] else \
+            '%s -> %s' % (o['status'], n['status'])
+        print('%-8s %-10s %10s %10s %10s %10s  %s' %
+              (key[0], key[1], ratio(o['run_sec'], n['run_sec']),
+               ratio(o['run_rss_kb'], n['run_rss_kb']),
+               ratio(o['code_bytes'], n['code_bytes']),
+               ratio(o['elc_sec'], n['elc_sec']), status))
+
+
+def main(argv):
+    if len(argv) == 4 and argv[1] == '-c':
+        compare(argv[2], argv[3])
+        return
+    if len(argv) < 5:
+        sys.exit('usage: %s <target> <runner> <report.tsv> <eir>...\n'
+                 '       %s -c <old.tsv> <new.tsv>' % (argv[0], argv[0]))
+    target, runner, report = argv[1:4]
+    rev = commit()
+    rows = []
+    for eir in argv[4:]:
+        row = bench(target, runner, eir)
+        row['commit'] = rev
+        row['target'] = target
+        rows.append(row)
+        print('\t'.join(row[c] for c in COLUMNS), flush=True)
+    with open(report, 'w') as f:
+        f.write('\t'.join(COLUMNS) + '\n')
+        for row in rows:
+            f.write('\t'.join(row[c] for c in COLUMNS) + '\n')
+
+
+if __name__ == '__main__':
+    main(sys.argv)
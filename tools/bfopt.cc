@@ -1,3 +1,4 @@
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,14 @@
 #include <string>
 #include <vector>
 
+#include <stdint.h>
+
+// The -j mode emits x86-64 code for the ops and runs it in place.
+#if defined(__x86_64__) && defined(__linux__)
+#define BF_JIT
+#include <sys/mman.h>
+#endif
+
 #ifdef __GNUC__
 #if __has_attribute(fallthrough)
 #define FALLTHROUGH __attribute__((fallthrough))
@@ -23,13 +32,21 @@ typedef unsigned char byte;
 using namespace std;
 
 bool g_verbose;
+// Set by -w. Cells are 32 bits wide, for the output of elc -bf-wide.
+bool g_wide;
 
 struct Loop;
 
 enum OpType {
   OP_MEM,
   OP_PTR,
+  // A balanced loop which only adds to cells. arg is what an iteration
+  // adds to the counter, -1 unless -w.
   OP_LOOP,
+  // [-], which OP_LOOP would do with no other cells.
+  OP_CLEAR,
+  // A loop which only moves the pointer by arg, e.g., [>>>>].
+  OP_SCAN,
 };
 
 struct Op {
@@ -132,13 +149,25 @@ void parse(const char* code, vector<Op*>* ops) {
         }
 
         if (!cur_loop->has_io && cur_loop->ptr == 0 &&
-            cur_loop->addsub[0] == -1) {
-          op->op = OP_LOOP;
+            (cur_loop->addsub[0] == -1 ||
+             (g_wide && cur_loop->addsub[0]))) {
+          op->arg = cur_loop->addsub[0];
+          op->op = (cur_loop->addsub.size() == 1 && op->arg == -1) ?
+              OP_CLEAR : OP_LOOP;
           op->loop = cur_loop;
           cur_loop = new Loop();
           cur_loop->has_io = true;
+        } else if (cur_loop->code.size() == 2 &&
+                   cur_loop->code[0]->op == '[' &&
+                   cur_loop->code[1]->op == OP_PTR) {
+          op->op = OP_SCAN;
+          op->arg = cur_loop->code[1]->arg;
+          cur_loop = new Loop();
+          cur_loop->has_io = true;
         } else {
           cur_loop->reset(ops);
+          // The pointer and the cells are unknown after a loop.
+          cur_loop->has_io = true;
           op->op = c;
           op->arg = loop_stack.back();
           (*ops)[op->arg]->arg = ops->size();
@@ -177,17 +206,46 @@ void check_bound(int mp) {
   }
 }
 
-void alloc_mem(size_t mp, vector<byte>* mem) {
+template <class Cell>
+void alloc_mem(size_t mp, vector<Cell>* mem) {
   if (mp >= mem->size()) {
     mem->resize(mp * 2);
   }
 }
 
-int read_mem(const vector<byte>& mem, int index) {
+// The number of iterations after which a loop whose counter starts at v
+// and steps by step stops, i.e., the least n with v + n * step == 0
+// modulo 2^32. Exits when there is none.
+uint32_t loop_count(uint32_t v, int step) {
+  uint32_t s = step;
+  int tz = 0;
+  while (!(s & 1)) {
+    s >>= 1;
+    tz++;
+  }
+  uint32_t nv = -v;
+  if (nv & ((1u << tz) - 1)) {
+    fprintf(stderr, "infinite loop\n");
+    exit(1);
+  }
+  // The inverse of the odd part by Newton's method, 3 bits to 48.
+  uint32_t inv = s;
+  for (int i = 0; i < 4; i++)
+    inv *= 2 - s * inv;
+  uint32_t n = (nv >> tz) * inv;
+  return tz ? n & (0xffffffffu >> tz) : n;
+}
+
+int read_mem(const byte* mem, int index) {
   return mem[index-1] * 65536 + mem[index] * 256 + mem[index+1];
 }
 
-void dump_state(const vector<byte>& mem) {
+int read_mem(const uint32_t* mem, int index) {
+  return mem[index] & 0xffffff;
+}
+
+template <class Cell>
+void dump_state(const Cell* mem) {
   static const char* kRegs[] = {
     "PC", "A", "B", "C", "D", "BP", "SP"
   };
@@ -203,36 +261,64 @@ void dump_state(const vector<byte>& mem) {
   fflush(stdout);
 }
 
-void run(const vector<Op*>& ops) {
-  int mp = 0;
-  vector<byte> mem(1);
+// The flattened form of the ops, which run() walks. Each OP_LOOP has
+// its non-zero offsets in [begin, end) of the AddSub vector, and lo and
+// hi bound them so a single check covers the whole loop.
+struct Code {
+  char op;
+  int arg;
+  int begin, end;
+  int lo, hi;
+};
+
+struct AddSub {
+  int off;
+  int mul;
+};
+
+void flatten(const vector<Op*>& ops, vector<Code>* code,
+             vector<AddSub>* addsubs) {
   for (size_t pc = 0; pc < ops.size(); pc++) {
     const Op* op = ops[pc];
-    switch (op->op) {
-      case '+':
-        mem[mp]++;
-        break;
-
-      case '-':
-        mem[mp]--;
-        break;
+    Code c;
+    c.op = op->op;
+    c.arg = op->arg;
+    c.begin = c.end = addsubs->size();
+    c.lo = c.hi = 0;
+    if (op->op == OP_LOOP) {
+      for (map<int, int>::const_iterator iter = op->loop->addsub.begin();
+           iter != op->loop->addsub.end();
+           ++iter) {
+        AddSub as;
+        as.off = iter->first;
+        as.mul = iter->second;
+        if (as.off == 0 || as.mul == 0)
+          continue;
+        addsubs->push_back(as);
+        c.lo = min(c.lo, as.off);
+        c.hi = max(c.hi, as.off);
+      }
+      c.end = addsubs->size();
+    }
+    code->push_back(c);
+  }
+}
 
+template <class Cell>
+void run(const vector<Code>& code, const vector<AddSub>& addsubs) {
+  int mp = 0;
+  vector<Cell> mem(1);
+  const Code* start = code.data();
+  const Code* end = start + code.size();
+  const AddSub* as = addsubs.data();
+  for (const Code* c = start; c < end; c++) {
+    switch (c->op) {
       case OP_MEM:
-        mem[mp] += op->arg;
-        break;
-
-      case '>':
-        mp++;
-        alloc_mem(mp, &mem);
-        break;
-
-      case '<':
-        mp--;
-        check_bound(mp);
+        mem[mp] += c->arg;
         break;
 
       case OP_PTR:
-        mp += op->arg;
+        mp += c->arg;
         check_bound(mp);
         alloc_mem(mp, &mem);
         break;
@@ -247,80 +333,351 @@ void run(const vector<Op*>& ops) {
 
       case '[':
         if (mem[mp] == 0)
-          pc = op->arg;
+          c = start + c->arg;
         break;
 
       case ']':
-        pc = op->arg - 1;
+        c = start + c->arg - 1;
         break;
 
-      case OP_LOOP: {
-        int v = mem[mp];
+      case OP_CLEAR:
         mem[mp] = 0;
-        for (map<int, int>::const_iterator iter = op->loop->addsub.begin();
-             iter != op->loop->addsub.end();
-             ++iter) {
-          int p = iter->first;
-          int d = iter->second;
-          if (p != 0) {
-            alloc_mem(mp + p, &mem);
-            mem[mp + p] += v * d;
+        break;
+
+      case OP_SCAN:
+        // Cells past the end of mem are zero.
+        if (sizeof(Cell) == 1 && c->arg == 1) {
+          const Cell* p = (const Cell*)memchr(&mem[mp], 0, mem.size() - mp);
+          mp = p ? p - mem.data() : mem.size();
+        } else if (c->arg > 0) {
+          while ((size_t)mp < mem.size() && mem[mp])
+            mp += c->arg;
+        } else {
+          while (mem[mp]) {
+            mp += c->arg;
+            check_bound(mp);
           }
         }
+        alloc_mem(mp, &mem);
+        break;
+
+      case OP_LOOP: {
+        Cell v = mem[mp];
+        if (!v)
+          break;
+        if (c->arg != -1)
+          v = loop_count(v, c->arg);
+        mem[mp] = 0;
+        check_bound(mp + c->lo);
+        alloc_mem(mp + c->hi, &mem);
+        for (int i = c->begin; i < c->end; i++)
+          mem[mp + as[i].off] += v * (Cell)as[i].mul;
         break;
       }
 
       case '@':
         if (g_verbose)
-          dump_state(mem);
+          dump_state(mem.data());
+        break;
+
+    }
+  }
+}
+
+#ifdef BF_JIT
+
+// Emits x86-64 code, with the memory pointer in RBX and the start of the
+// memory in R12, into an mmap'd buffer. There are no bound checks, as in
+// the C output of -c.
+struct JIT {
+  vector<byte> buf;
+
+  void emit(int n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < n; i++)
+      buf.push_back(va_arg(ap, int));
+    va_end(ap);
+  }
+
+  void emit_le(unsigned int v) {
+    emit(4, v & 255, v >> 8 & 255, v >> 16 & 255, v >> 24);
+  }
+
+  void emit_call(const void* fn) {
+    // mov rax, fn; call rax
+    unsigned long long a = (unsigned long long)fn;
+    emit(2, 0x48, 0xb8);
+    emit_le(a);
+    emit_le(a >> 32);
+    emit(2, 0xff, 0xd0);
+  }
+
+  // A jcc rel32 whose target is filled by patch().
+  size_t emit_jcc(int cc) {
+    // cmp byte [rbx], 0
+    emit(3, 0x80, 0x3b, 0x00);
+    emit(2, 0x0f, cc);
+    emit_le(0);
+    return buf.size();
+  }
+
+  void patch(size_t from, size_t to) {
+    unsigned int d = to - from;
+    for (int i = 0; i < 4; i++)
+      buf[from - 4 + i] = d >> (i * 8) & 255;
+  }
+};
+
+void run_jit(const vector<Code>& code, const vector<AddSub>& addsubs) {
+  JIT j;
+  // push rbx; push r12; push rax; mov rbx, rdi; mov r12, rdi
+  j.emit(8, 0x53, 0x41, 0x54, 0x50, 0x48, 0x89, 0xfb, 0x49);
+  j.emit(2, 0x89, 0xfc);
+  vector<size_t> loops;
+  for (size_t pc = 0; pc < code.size(); pc++) {
+    const Code& c = code[pc];
+    switch (c.op) {
+      case OP_MEM:
+        // add byte [rbx], arg
+        j.emit(3, 0x80, 0x03, c.arg & 255);
+        break;
+
+      case OP_PTR:
+        // add rbx, arg
+        j.emit(3, 0x48, 0x81, 0xc3);
+        j.emit_le(c.arg);
+        break;
+
+      case '.':
+        // movzx edi, byte [rbx]
+        j.emit(3, 0x0f, 0xb6, 0x3b);
+        j.emit_call((const void*)putchar);
+        break;
+
+      case ',':
+        j.emit_call((const void*)getchar);
+        // mov [rbx], al
+        j.emit(2, 0x88, 0x03);
+        break;
+
+      case '[':
+        // je after the matching ]
+        loops.push_back(j.emit_jcc(0x84));
+        break;
+
+      case ']': {
+        // jne after the matching [
+        size_t begin = loops.back();
+        loops.pop_back();
+        size_t end = j.emit_jcc(0x85);
+        j.patch(end, begin);
+        j.patch(begin, end);
+        break;
+      }
+
+      case OP_LOOP:
+        // movzx eax, byte [rbx]
+        j.emit(3, 0x0f, 0xb6, 0x03);
+        for (int i = c.begin; i < c.end; i++) {
+          const AddSub& as = addsubs[i];
+          // imul ecx, eax, mul; add [rbx+off], cl
+          j.emit(2, 0x69, 0xc8);
+          j.emit_le(as.mul);
+          j.emit(2, 0x00, 0x8b);
+          j.emit_le(as.off);
+        }
+        // mov byte [rbx], 0
+        j.emit(3, 0xc6, 0x03, 0x00);
+        break;
+
+      case OP_CLEAR:
+        // mov byte [rbx], 0
+        j.emit(3, 0xc6, 0x03, 0x00);
+        break;
+
+      case OP_SCAN: {
+        // loop: je done; add rbx, arg; jmp loop; done:
+        size_t loop = j.buf.size();
+        size_t done = j.emit_jcc(0x84);
+        j.emit(3, 0x48, 0x81, 0xc3);
+        j.emit_le(c.arg);
+        j.emit(1, 0xe9);
+        j.emit_le(0);
+        j.patch(j.buf.size(), loop);
+        j.patch(done, j.buf.size());
+        break;
+      }
+
+      case '@':
+        // mov rdi, r12
+        j.emit(3, 0x4c, 0x89, 0xe7);
+        j.emit_call((const void*)dump_state<byte>);
+        break;
+
+    }
+  }
+  // pop rax; pop r12; pop rbx; ret
+  j.emit(5, 0x58, 0x41, 0x5c, 0x5b, 0xc3);
+
+  void* text = mmap(NULL, j.buf.size(), PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  // The same size as the memory of the C output, mapped on demand.
+  size_t mem_size = 4096 * 4096 * 10;
+  void* mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (text == MAP_FAILED || mem == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memcpy(text, j.buf.data(), j.buf.size());
+  ((void (*)(byte*))text)((byte*)mem);
+}
+
+#endif
+
+// The number of cells the ops can reach, or 0 when the pointer isn't
+// bounded: a scan, a loop which moves the pointer, or a move below the
+// start.
+size_t tape_size(const vector<Op*>& ops) {
+  int off = 0;
+  int hi = 0;
+  vector<int> loops;
+  for (size_t pc = 0; pc < ops.size(); pc++) {
+    const Op* op = ops[pc];
+    switch (op->op) {
+      case '>':
+        off++;
+        break;
+
+      case '<':
+        off--;
+        break;
+
+      case OP_PTR:
+        off += op->arg;
+        break;
+
+      case '[':
+        loops.push_back(off);
+        break;
+
+      case ']':
+        if (loops.back() != off)
+          return 0;
+        loops.pop_back();
+        break;
+
+      case OP_LOOP:
+        for (map<int, int>::const_iterator iter = op->loop->addsub.begin();
+             iter != op->loop->addsub.end();
+             ++iter) {
+          if (off + iter->first < 0)
+            return 0;
+          hi = max(hi, off + iter->first);
+        }
         break;
 
+      case OP_SCAN:
+        return 0;
     }
+    if (off < 0)
+      return 0;
+    hi = max(hi, off);
   }
+  return hi + 1;
 }
 
+// Writes C for the ops. The pointer moves of straight-line code are
+// folded into the offsets of cell accesses, e.g., mp[3] += 2, and only
+// applied at loops. Runs of output become one fwrite.
 void compile(const vector<Op*>& ops, const char* fname) {
   FILE* fp = fopen(fname, "wb");
   fprintf(fp, "#include <stdio.h>\n");
-  fprintf(fp, "unsigned char mem[4096*4096*10];\n");
+  fprintf(fp, "#include <stdlib.h>\n");
+  fprintf(fp, "#include <string.h>\n");
+  size_t size = tape_size(ops);
+  const char* cell = g_wide ? "unsigned int" : "unsigned char";
+  fprintf(fp, "%s mem[%zu];\n", cell, size ? size : 4096 * 4096 * 10);
+  if (g_wide) {
+    fprintf(fp, "static unsigned int loop_count(unsigned int v, int step) {\n");
+    fprintf(fp, "  unsigned int s = step, nv = -v, inv, n;\n");
+    fprintf(fp, "  int tz = 0, i;\n");
+    fprintf(fp, "  while (!(s & 1)) { s >>= 1; tz++; }\n");
+    fprintf(fp, "  if (nv & ((1u << tz) - 1)) {\n");
+    fprintf(fp, "    fprintf(stderr, \"infinite loop\\n\");\n");
+    fprintf(fp, "    exit(1);\n");
+    fprintf(fp, "  }\n");
+    fprintf(fp, "  for (inv = s, i = 0; i < 4; i++) inv *= 2 - s * inv;\n");
+    fprintf(fp, "  n = (nv >> tz) * inv;\n");
+    fprintf(fp, "  return tz ? n & (0xffffffffu >> tz) : n;\n");
+    fprintf(fp, "}\n");
+  }
   fprintf(fp, "int main() {\n");
-  fprintf(fp, "unsigned char* mp = mem;\n");
+  fprintf(fp, "%s* mp = mem;\n", cell);
 
+  int off = 0;
   for (size_t pc = 0; pc < ops.size(); pc++) {
     const Op* op = ops[pc];
+    switch (op->op) {
+      case '[':
+      case ']':
+      case OP_SCAN:
+        if (off)
+          fprintf(fp, "mp += %d;\n", off);
+        off = 0;
+        break;
+    }
+
     switch (op->op) {
       case '+':
-        fprintf(fp, "++*mp;\n");
+        fprintf(fp, "++mp[%d];\n", off);
         break;
 
       case '-':
-        fprintf(fp, "--*mp;\n");
+        fprintf(fp, "--mp[%d];\n", off);
         break;
 
       case OP_MEM:
         if (op->arg)
-          fprintf(fp, "*mp += %d;\n", op->arg);
+          fprintf(fp, "mp[%d] += %d;\n", off, op->arg);
         break;
 
       case '>':
-        fprintf(fp, "mp++;\n");
+        off++;
         break;
 
       case '<':
-        fprintf(fp, "mp--;\n");
+        off--;
         break;
 
       case OP_PTR:
-        if (op->arg)
-          fprintf(fp, "mp += %d;\n", op->arg);
+        off += op->arg;
         break;
 
-      case '.':
-        fprintf(fp, "putchar(*mp);\n");
+      case '.': {
+        vector<int> outs(1, off);
+        while (pc + 1 < ops.size() &&
+               (ops[pc + 1]->op == '.' || ops[pc + 1]->op == OP_PTR)) {
+          pc++;
+          if (ops[pc]->op == '.')
+            outs.push_back(off);
+          else
+            off += ops[pc]->arg;
+        }
+        if (outs.size() == 1) {
+          fprintf(fp, "putchar(mp[%d]);\n", outs[0]);
+          break;
+        }
+        fprintf(fp, "{ const unsigned char o[] = {");
+        for (size_t i = 0; i < outs.size(); i++)
+          fprintf(fp, "%smp[%d]", i ? ", " : "", outs[i]);
+        fprintf(fp, "}; fwrite(o, 1, %zu, stdout); }\n", outs.size());
         break;
+      }
 
       case ',':
-        fprintf(fp, "*mp = getchar();\n");
+        fprintf(fp, "mp[%d] = getchar();\n", off);
         break;
 
       case '[':
@@ -332,19 +689,35 @@ void compile(const vector<Op*>& ops, const char* fname) {
         break;
 
       case OP_LOOP: {
+        if (op->arg != -1) {
+          fprintf(fp, "if (mp[%d]) mp[%d] = loop_count(mp[%d], %d);\n",
+                  off, off, off, op->arg);
+        }
         for (map<int, int>::const_iterator iter = op->loop->addsub.begin();
              iter != op->loop->addsub.end();
              ++iter) {
           int p = iter->first;
           int d = iter->second;
           if (p != 0) {
-            fprintf(fp, "mp[%d] += *mp * %d;\n", p, d);
+            fprintf(fp, "mp[%d] += mp[%d] * %d;\n", off + p, off, d);
           }
         }
-        fprintf(fp, "*mp = 0;\n");
+        fprintf(fp, "mp[%d] = 0;\n", off);
         break;
       }
 
+      case OP_CLEAR:
+        fprintf(fp, "mp[%d] = 0;\n", off);
+        break;
+
+      case OP_SCAN:
+        if (op->arg == 1 && !g_wide) {
+          fprintf(fp, "mp = memchr(mp, 0, mem + sizeof(mem) - mp);\n");
+        } else {
+          fprintf(fp, "while (*mp) mp += %d;\n", op->arg);
+        }
+        break;
+
     }
   }
 
@@ -355,12 +728,22 @@ void compile(const vector<Op*>& ops, const char* fname) {
 
 int main(int argc, char* argv[]) {
   bool should_compile = false;
+  bool should_jit = false;
   const char* arg0 = argv[0];
   while (argc >= 2 && argv[1][0] == '-') {
     if (!strcmp(argv[1], "-c")) {
       should_compile = true;
+    } else if (!strcmp(argv[1], "-j")) {
+#ifdef BF_JIT
+      should_jit = true;
+#else
+      fprintf(stderr, "-j is only supported on x86-64 Linux\n");
+      return 1;
+#endif
     } else if (!strcmp(argv[1], "-v")) {
       g_verbose = true;
+    } else if (!strcmp(argv[1], "-w")) {
+      g_wide = true;
     } else {
       fprintf(stderr, "Unknown flag: %s\n", argv[1]);
       return 1;
@@ -392,8 +775,23 @@ int main(int argc, char* argv[]) {
 
   vector<Op*> ops;
   parse(buf.c_str(), &ops);
-  if (should_compile)
+  if (should_compile) {
     compile(ops, argv[2]);
+    return 0;
+  }
+
+  vector<Code> code;
+  vector<AddSub> addsubs;
+  flatten(ops, &code, &addsubs);
+#ifdef BF_JIT
+  // The JIT only knows byte cells, so -w runs the interpreter.
+  if (should_jit && !g_wide) {
+    run_jit(code, addsubs);
+    return 0;
+  }
+#endif
+  if (g_wide)
+    run<uint32_t>(code, addsubs);
   else
-    run(ops);
+    run<byte>(code, addsubs);
 }
@@ -27,12 +27,12 @@ for prog in 8cc elc; do
     sed 's/ *#.*//' out/${prog}.c.eir > ${dir}/stage1/${prog}.c.eir
 done
 
-if [ ${TARGET} = x86 ]; then
+if [ ${TARGET} = x86 ] || [ ${TARGET} = x86_64 ]; then
     run_trg() {
         chmod 755 $1
         ${time} $1
     }
-elif [ ${TARGET} = arm ]; then
+elif [ ${TARGET} = arm ] || [ ${TARGET} = aarch64 ]; then
     run_trg() {
         chmod 755 $1
         ${time} $1
@@ -62,14 +62,25 @@ run() {
     run_trg ${dir}/stage$1/$2.c.eir.${TARGET}
 }
 
+build() {
+    echo "Building stage$2 $3.eir"
+    cat ${dir}/$3.c | run $1 8cc > ${dir}/stage$2/$3.c.eir
+    echo "Building stage$2 $3.${TARGET}"
+    (echo ${TARGET} && cat ${dir}/stage$2/$3.c.eir) | \
+        run $1 elc > ${dir}/stage$2/$3.c.eir.${TARGET}
+}
+
+# 8cc and elc of a stage only need the previous stage, so they are
+# built in parallel.
 for stage in 1 2; do
     nstage=$((${stage} + 1))
+    pids=
     for prog in 8cc elc; do
-        echo "Building stage${nstage} ${prog}.eir"
-        cat ${dir}/${prog}.c | run ${stage} 8cc > ${dir}/stage${nstage}/${prog}.c.eir
-        echo "Building stage${nstage} ${prog}.${TARGET}"
-        (echo ${TARGET} && cat ${dir}/stage${nstage}/${prog}.c.eir) | \
-            run ${stage} elc > ${dir}/stage${nstage}/${prog}.c.eir.${TARGET}
+        build ${stage} ${nstage} ${prog} &
+        pids="${pids} $!"
+    done
+    for pid in ${pids}; do
+        wait ${pid}
     done
 done
 
@@ -3,26 +3,27 @@
 (load-file "out/elc.c.eir.el")
 (setq elc-main elvm-main)
 
+;; Output is inserted into the output buffer as it comes, as
+;; concatenating it to a string copies all of it for each character.
+(defvar elvm-output-buffer nil)
 (defun putchar (c)
-  (setq elvm-output (concat elvm-output (char-to-string c))))
+  (with-current-buffer elvm-output-buffer
+    (insert c)))
+(defun elvm-run (main name)
+  (setq elvm-output-buffer (get-buffer-create name))
+  (with-current-buffer elvm-output-buffer
+    (erase-buffer))
+  (funcall main)
+  (switch-to-buffer elvm-output-buffer))
 (defun 8cc ()
   (interactive)
   (setq elvm-input (buffer-string))
-  (setq elvm-output "")
-  (funcall 8cc-main)
-  (switch-to-buffer "*8cc output*")
-  (insert-string elvm-output))
+  (elvm-run 8cc-main "*8cc output*"))
 (defun elc ()
   (interactive)
   (setq elvm-input (buffer-string))
-  (setq elvm-output "")
-  (funcall elc-main)
-  (switch-to-buffer "*elc output*")
-  (insert-string elvm-output))
+  (elvm-run elc-main "*elc output*"))
 
 (defun elvm-main ()
   (interactive)
-  (setq elvm-output "")
-  (funcall elvm-main)
-  (switch-to-buffer "*elvm output*")
-  (insert-string elvm-output))
+  (elvm-run elvm-main "*elvm output*"))
@@ -0,0 +1,106 @@
+// Runs a program built by `elc -js -js-worker` (or -asmjs) in a Web
+// Worker, so a long run neither blocks the page nor holds its output
+// back until the end:
+//
+//   var p = elvmSpawn(new Worker('8cc.c.eir.worker.js'),
+//                     function(s) { out.value += s; },
+//                     function() { console.log('done'); });
+//   p.write(src);
+//   p.close();
+//
+// On a cross-origin isolated page, output and input go through
+// SharedArrayBuffer rings (see emit_js_worker_glue in target/js.c):
+// output shows up as the program writes it, and getchar waits for
+// input written later. Elsewhere the input is sent once close() is
+// called and the output comes back in messages.
+
+var ELVM_RING_SIZE = 1 << 16;
+
+function elvmString(bytes) {
+  var s = '';
+  for (var i = 0; i < bytes.length; i += 8192)
+    s += String.fromCharCode.apply(null, bytes.slice(i, i + 8192));
+  return s;
+}
+
+function elvmSpawn(worker, onOutput, onExit) {
+  var shared = typeof SharedArrayBuffer != 'undefined' &&
+      typeof Atomics != 'undefined' &&
+      (typeof crossOriginIsolated == 'undefined' || crossOriginIsolated);
+  var pending = [];
+  var closed = false;
+  var done = false;
+  var ring = function() {
+    return new SharedArrayBuffer(12 + ELVM_RING_SIZE);
+  };
+  var output = shared && ring();
+  var input = shared && ring();
+  var oc = shared && new Int32Array(output, 0, 3);
+  var ob = shared && new Uint8Array(output, 12);
+  var ic = shared && new Int32Array(input, 0, 3);
+  var ib = shared && new Uint8Array(input, 12);
+  var iw = 0;
+
+  // Moves the output out of its ring, and pending input into the other.
+  var pump = function() {
+    var w = Atomics.load(oc, 0);
+    var r = Atomics.load(oc, 1);
+    if (w != r) {
+      var s = [];
+      for (; r != w; r = r + 1 | 0)
+        s.push(ob[r & ob.length - 1]);
+      Atomics.store(oc, 1, r);
+      Atomics.notify(oc, 1);
+      onOutput(elvmString(s));
+    }
+    var k = 0;
+    while (k < pending.length &&
+           (iw - Atomics.load(ic, 1) | 0) < ib.length) {
+      ib[iw & ib.length - 1] = pending[k++];
+      iw = iw + 1 | 0;
+    }
+    pending = pending.slice(k);
+    Atomics.store(ic, 0, iw);
+    if (closed && !pending.length)
+      Atomics.store(ic, 2, 1);
+    Atomics.notify(ic, 0);
+  };
+
+  var poll = function() {
+    if (done)
+      return;
+    pump();
+    setTimeout(poll, 10);
+  };
+
+  worker.onmessage = function(e) {
+    if ('out' in e.data)
+      onOutput(e.data.out);
+    if ('exit' in e.data) {
+      done = true;
+      if (shared)
+        pump();
+      if (worker.terminate)
+        worker.terminate();
+      if (onExit)
+        onExit(e.data.exit);
+    }
+  };
+
+  if (shared) {
+    worker.postMessage({output: output, input: input});
+    poll();
+  }
+
+  return {
+    write: function(s) {
+      for (var i = 0; i < s.length; i++)
+        pending.push(s.charCodeAt(i) & 255);
+    },
+    close: function() {
+      closed = true;
+      if (!shared)
+        worker.postMessage({data: elvmString(pending)});
+    }
+  };
+}
@@ -3,7 +3,7 @@
 require 'fileutils'
 require 'json'
 
-system("make out/8cc.c.eir.asmjs out/elc.c.eir.asmjs out/eli.c.eir.asmjs")
+system("make out/8cc.c.eir out/elc.c.eir out/eli.c.eir")
 
 headers = {}
 Dir.glob('libc/*.h').each do |hf|
@@ -14,9 +14,20 @@ end
 
 FileUtils.mkdir_p('web')
 FileUtils.ln_sf('../tools/8cc.js.html', 'web')
-FileUtils.ln_sf('../out/8cc.c.eir.asmjs', 'web/8cc.c.eir.js')
-FileUtils.ln_sf('../out/elc.c.eir.asmjs', 'web/elc.c.eir.js')
-FileUtils.ln_sf('../out/eli.c.eir.asmjs', 'web/eli.c.eir.js')
+FileUtils.ln_sf('../tools/elvm_worker.js', 'web')
+# The page loads these before it can be used, but only runs them when
+# it can't use workers, so they are compact and compiled lazily.
+%w(8cc elc eli).each do |n|
+  # Older builds linked them to out/*.c.eir.asmjs.
+  FileUtils.rm_f("web/#{n}.c.eir.js")
+  system("out/elc -js -js-compact out/#{n}.c.eir > web/#{n}.c.eir.js") or
+    raise "failed to build #{n}"
+end
+# Builds run in Web Workers by the page (see tools/elvm_worker.js).
+%w(8cc elc eli).each do |n|
+  system("out/elc -asmjs -js-worker out/#{n}.c.eir > web/#{n}.c.eir.worker.js") or
+    raise "failed to build the #{n} worker"
+end
 File.open('web/headers.js', 'w') do |of|
   of.print 'var HEADERS = '
   of.print JSON.dump(headers)
@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+#
+# Times each EIR op on a backend with generated microbenchmarks, and
+# writes a table of what each costs:
+#
+#   tools/microbench.py <target> '<runner>' <table.tsv>
+#
+# usually through `make microbench-<target>`, which writes
+# out/bench/micro-<target>.tsv. Each benchmark is a loop whose body
+# repeats one op, by operand kind, compiled by elc and run with
+# <runner> (as in tools/bench.py). Its cost is the time of the loop
+# less that of the empty loop, per op, less the cost of any helper ops
+# in the body. Besides the ops, there are loads and stores chasing
+# pointers through a table in sequential and in random order, taken
+# and untaken branches, jumps across chunks, and PUTC and GETC
+# throughput.
+#
+# The table has a header line and "commit target key ns rel" rows,
+# where rel is the cost relative to mov_reg, so that backends can be
+# compared op by op. tools/predict.py --calibrate uses the same
+# benchmarks for its table.
+
+import os
+import random
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from bench import ELC, commit, measure  # noqa: E402
+
+COLUMNS = ['commit', 'target', 'key', 'ns', 'rel']
+
+# Ops which take a register or an immediate as their source. Each runs
+# as "op A, B" and "op A, 3".
+BINARY_OPS = ['mov', 'add', 'sub', 'eq', 'ne', 'lt', 'gt', 'le', 'ge',
+              'mul', 'div', 'mod', 'and', 'or', 'xor', 'shl', 'shr']
+# The operands which make each conditional jump fall through, with
+# A=1 and B=2.
+UNTAKEN = {
+    'jeq': ('A, B', 'A, 3'),
+    'jne': ('B, B', 'A, 1'),
+    'jlt': ('B, A', 'A, 0'),
+    'jgt': ('A, B', 'A, 3'),
+    'jle': ('B, A', 'A, 0'),
+    'jge': ('A, B', 'A, 3'),
+}
+# The words of the tables which the pointer chasing benchmarks walk.
+TABLE_SIZE = 1 << 16
+REPEAT = 50
+# The most input of a benchmark, as some backends read it all at once.
+INPUT_MAX = 16 << 20
+
+
+def bench(body, less=(), table=None, stdin=False, elc_args=()):
+    """A benchmark: body runs with A=1, B=2 and C=100 (an address in
+    memory), or C=0 with a table ('seq' or 'rand') of addresses at 0,
+    which "load C, C" walks. It changes no register but A and C. {L} is
+    a fresh label. Its cost is less those of the keys in less. stdin is
+    empty, or with stdin, holds a byte for each run of the body, which
+    caps the iterations."""
+    return {'body': body, 'less': list(less), 'table': table,
+            'stdin': stdin, 'elc_args': list(elc_args)}
+
+
+def microbenches():
+    """The benchmarks by key, in the order they run, so that the keys
+    each one subtracts come before it."""
+    b = {}
+    for op in BINARY_OPS:
+        b[op + '_reg'] = bench('%s A, B' % op)
+        b[op + '_imm'] = bench('%s A, 3' % op)
+    b['load_reg'] = bench('load A, C')
+    b['load_imm'] = bench('load A, 100')
+    b['store_reg'] = bench('store A, C')
+    b['store_imm'] = bench('store A, 100')
+    for op, (reg, imm) in UNTAKEN.items():
+        b[op + '_reg'] = bench('%s {L}, %s\n{L}:' % (op, reg))
+        b[op + '_imm'] = bench('%s {L}, %s\n{L}:' % (op, imm))
+    b['jmp_imm'] = bench('jmp {L}\n{L}:')
+    b['jmp_reg'] = bench('mov A, {L}\njmp A\n{L}:', ['mov_imm'])
+    # The taken jump, less the one falling through.
+    b['taken'] = bench('jeq {L}, B, B\n{L}:', ['jeq_reg'])
+    # Every jump leaves its chunk with -chunk=1.
+    b['dispatch'] = bench('jeq {L}, B, B\n{L}:', ['jeq_reg', 'taken'],
+                          elc_args=['-chunk=1'])
+    b['load_seq'] = bench('load C, C', table='seq')
+    b['load_rand'] = bench('load C, C', table='rand')
+    # The stores write back the entries just read, not to break the
+    # cycle.
+    b['store_seq'] = bench('load A, C\nstore A, C\nmov C, A',
+                           ['load_seq', 'mov_reg'], table='seq')
+    b['store_rand'] = bench('load A, C\nstore A, C\nmov C, A',
+                            ['load_rand', 'mov_reg'], table='rand')
+    b['putc_reg'] = bench('putc B')
+    b['putc_imm'] = bench('putc 65')
+    b['getc'] = bench('getc A', stdin=True)
+    b['getc_eof'] = bench('getc A')
+    return b
+
+
+def table_words(table):
+    """The words of a table whose entries hold the address of the next
+    one to visit, all of them in a cycle."""
+    order = list(range(TABLE_SIZE))
+    if table == 'rand':
+        random.Random(1).shuffle(order)
+    words = [0] * TABLE_SIZE
+    for i, addr in enumerate(order):
+        words[addr] = order[(i + 1) % TABLE_SIZE]
+    return words
+
+
+def microbench_eir(b, iters):
+    """The EIR of benchmark b, or of the empty loop if b has no body,
+    running iters times."""
+    lines = ['.text', 'mov A, 1', 'mov B, 2',
+             'mov C, %d' % (0 if b['table'] else 100),
+             'mov D, %d' % iters, 'loop:']
+    for i in range(REPEAT if b['body'] else 0):
+        lines += ['  ' + l for l in
+                  b['body'].replace('{L}', 'l%d' % i).split('\n')]
+    lines += ['sub D, 1', 'jne loop, D, 0', 'exit']
+    # The table is the first data, so its entries are their addresses.
+    if b['table']:
+        lines.append('.data')
+        lines += ['.long %d' % w for w in table_words(b['table'])]
+    return '\n'.join(lines) + '\n'
+
+
+def time_eir(tmp, name, eir, target, runner, elc_args=(), stdin=None):
+    src = os.path.join(tmp, name + '.eir')
+    code = src + '.' + target
+    with open(src, 'w') as f:
+        f.write(eir)
+    with open(code, 'wb') as out:
+        status, _, _ = measure([ELC, '-' + target] + list(elc_args) + [src],
+                               None, out)
+    if status != 'ok':
+        sys.exit('%s: elc failed' % src)
+    os.chmod(code, 0o755)
+    cmd = runner.split() + [code] if runner else [code]
+    path = os.path.join(tmp, 'input') if stdin else os.devnull
+    with open(path, 'rb') as stdin, open(os.devnull, 'wb') as stdout:
+        status, sec, _ = measure(cmd, stdin, stdout)
+    if status != 'ok':
+        sys.exit('%s: %s' % (code, status))
+    return sec
+
+
+def measure_costs(target, runner, keys=None, log=None):
+    """Returns {key: ns} for the benchmarks in keys (all by default),
+    those they subtract, mov_reg, and 'startup', the time of a run of
+    the empty loop."""
+    benches = microbenches()
+    want = set(keys or benches) | {'mov_reg'}
+    for key in reversed(list(benches)):
+        if key in want:
+            want.update(benches[key]['less'])
+
+    with tempfile.TemporaryDirectory() as tmp:
+        # Picks the iterations so that the mov loop runs for a while.
+        iters = 100
+        while True:
+            base = time_eir(tmp, 'base', microbench_eir(bench(''), iters),
+                            target, runner)
+            sec = time_eir(tmp, 'mov_reg',
+                           microbench_eir(benches['mov_reg'], iters),
+                           target, runner)
+            if sec - base > 0.5 or iters >= 1 << 22:
+                break
+            iters *= 4
+        costs = {}
+        costs['startup'] = 1e9 * time_eir(tmp, 'startup',
+                                          microbench_eir(bench(''), 1),
+                                          target, runner)
+        # The empty loop by table, elc flags and iterations.
+        bases = {(None, (), iters): base}
+        for key, b in benches.items():
+            if key not in want:
+                continue
+            args = tuple(b['elc_args'])
+            its = iters
+            if b['stdin']:
+                its = min(iters, INPUT_MAX // REPEAT)
+                with open(os.path.join(tmp, 'input'), 'wb') as f:
+                    f.write(b'y' * its * REPEAT)
+            base_key = (b['table'], args, its)
+            if base_key not in bases:
+                empty = bench('', table=b['table'])
+                bases[base_key] = time_eir(
+                    tmp, 'base', microbench_eir(empty, its),
+                    target, runner, args)
+            sec = time_eir(tmp, key, microbench_eir(b, its), target,
+                           runner, args, b['stdin'])
+            ns = (sec - bases[base_key]) * 1e9 / (its * REPEAT)
+            costs[key] = max(0.0, ns - sum(costs[k] for k in b['less']))
+            if log:
+                log('%-8s %-10s %10.3f ns' % (target, key, costs[key]))
+    return costs
+
+
+def write_table(target, costs, path):
+    rev = commit()
+    unit = costs.get('mov_reg') or 1.0
+    with open(path, 'w') as f:
+        f.write('\t'.join(COLUMNS) + '\n')
+        for key, ns in costs.items():
+            rel = '-' if key == 'startup' else '%.2f' % (ns / unit)
+            f.write('%s\t%s\t%s\t%.3f\t%s\n' % (rev, target, key, ns, rel))
+
+
+def main(argv):
+    if len(argv) != 4:
+        sys.exit('usage: %s <target> <runner> <table.tsv>' % argv[0])
+    target, runner, path = argv[1:]
+    costs = measure_costs(target, runner,
+                          log=lambda s: print(s, flush=True))
+    write_table(target, costs, path)
+
+
+if __name__ == '__main__':
+    main(sys.argv)
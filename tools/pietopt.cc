@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// Runs a Piet image, as target/piet.c emits it (a P6 PPM with 1x1
+// codels):
+//
+//   pietopt <ppm>
+//
+// The image is split into color blocks once, and the move out of a
+// block for each of its 8 DP/CC states, white slides and blocked
+// retries included, is worked out on its first use. The commands
+// between two pointer or switch commands don't depend on the stack, so
+// each such run is compiled into ops, with constants pushed then used
+// folded into the ops using them. Commands with too few values on the
+// stack are skipped, as npiet does, and reading a char at EOF pushes 0,
+// which tools/runpiet.sh also marks EOF with.
+
+using namespace std;
+
+typedef long long Word;
+
+enum OpType {
+  // The Piet commands, in the order of their hue and lightness change.
+  OP_NONE,
+  OP_PUSH,
+  OP_POP,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_NOT,
+  OP_GT,
+  OP_PTR,
+  OP_SWITCH,
+  OP_DUP,
+  OP_ROLL,
+  OP_INN,
+  OP_IN,
+  OP_OUTN,
+  OP_OUT,
+
+  // push arg; <op> for OP_ADD to OP_GT.
+  OP_ADD_IMM,
+  OP_SUB_IMM,
+  OP_MUL_IMM,
+  OP_DIV_IMM,
+  OP_MOD_IMM,
+  // Never emitted, as NOT takes one value.
+  OP_NOT_IMM,
+  OP_GT_IMM,
+  // push arg; push arg2; roll
+  OP_ROLL_IMM,
+  // Continues at the state arg, compiling it if it is new. It becomes
+  // OP_JMP once that is done.
+  OP_GOTO,
+  OP_JMP,
+  OP_HALT,
+};
+
+struct Op {
+  int op;
+  Word arg;
+  Word arg2;
+};
+
+// A move out of a block in a DP/CC state.
+struct Move {
+  bool done;
+  bool halt;
+  int op;
+  // The size of the block moved out of, for OP_PUSH.
+  Word size;
+  // The block and DP/CC state moved into.
+  int next;
+};
+
+struct Block {
+  Word size;
+  // The codel a move in each DP/CC state leaves from.
+  int exit_x[8];
+  int exit_y[8];
+};
+
+// Right, down, left and up, clockwise as DP turns.
+static const int kDx[4] = { 1, 0, -1, 0 };
+static const int kDy[4] = { 0, 1, 0, -1 };
+
+static const unsigned char kColors[20][3] = {
+  { 0x00, 0x00, 0x00 },
+  { 0xff, 0xff, 0xff },
+  { 0xff, 0xc0, 0xc0 }, { 0xff, 0x00, 0x00 }, { 0xc0, 0x00, 0x00 },
+  { 0xff, 0xff, 0xc0 }, { 0xff, 0xff, 0x00 }, { 0xc0, 0xc0, 0x00 },
+  { 0xc0, 0xff, 0xc0 }, { 0x00, 0xff, 0x00 }, { 0x00, 0xc0, 0x00 },
+  { 0xc0, 0xff, 0xff }, { 0x00, 0xff, 0xff }, { 0x00, 0xc0, 0xc0 },
+  { 0xc0, 0xc0, 0xff }, { 0x00, 0x00, 0xff }, { 0x00, 0x00, 0xc0 },
+  { 0xff, 0xc0, 0xff }, { 0xff, 0x00, 0xff }, { 0xc0, 0x00, 0xc0 },
+};
+
+enum {
+  BLACK,
+  WHITE
+};
+
+static int g_w;
+static int g_h;
+// The index in kColors of each codel. Others count as black.
+static vector<unsigned char> g_color;
+// The block of each colored codel, or -1.
+static vector<int> g_block_of;
+static vector<Block> g_blocks;
+static vector<Move> g_moves;
+
+static void fail(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+static int read_header_int(FILE* fp) {
+  int c = fgetc(fp);
+  while (c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    if (c == '#') {
+      while (c != '\n' && c != EOF)
+        c = fgetc(fp);
+    }
+    c = fgetc(fp);
+  }
+  int v = 0;
+  if (c < '0' || c > '9')
+    fail("broken PPM header");
+  for (; c >= '0' && c <= '9'; c = fgetc(fp))
+    v = v * 10 + c - '0';
+  return v;
+}
+
+static void read_ppm(const char* fname) {
+  FILE* fp = fopen(fname, "rb");
+  if (!fp) {
+    perror("open");
+    exit(1);
+  }
+  if (fgetc(fp) != 'P' || fgetc(fp) != '6')
+    fail("not a P6 PPM");
+  g_w = read_header_int(fp);
+  g_h = read_header_int(fp);
+  if (read_header_int(fp) != 255)
+    fail("not an 8bit PPM");
+
+  g_color.resize((size_t)g_w * g_h);
+  for (size_t i = 0; i < g_color.size(); i++) {
+    unsigned char rgb[3];
+    if (fread(rgb, 1, 3, fp) != 3)
+      fail("truncated PPM");
+    g_color[i] = BLACK;
+    for (int c = 0; c < 20; c++) {
+      if (!memcmp(rgb, kColors[c], 3)) {
+        g_color[i] = c;
+        break;
+      }
+    }
+  }
+  fclose(fp);
+}
+
+static int color_at(int x, int y) {
+  if (x < 0 || y < 0 || x >= g_w || y >= g_h)
+    return BLACK;
+  return g_color[(size_t)y * g_w + x];
+}
+
+// Fills each colored block, and finds its exit codels: the furthest
+// edge along DP, then the furthest codel of it to the CC side, which
+// is left (0) or right (1) of DP.
+static void find_blocks() {
+  g_block_of.assign(g_color.size(), -1);
+  vector<int> todo;
+  for (size_t start = 0; start < g_color.size(); start++) {
+    int c = g_color[start];
+    if (c == BLACK || c == WHITE || g_block_of[start] >= 0)
+      continue;
+    int id = g_blocks.size();
+    Block b;
+    b.size = 0;
+    int sx = start % g_w;
+    int sy = start / g_w;
+    for (int i = 0; i < 8; i++) {
+      b.exit_x[i] = sx;
+      b.exit_y[i] = sy;
+    }
+    g_block_of[start] = id;
+    todo.push_back(start);
+    while (!todo.empty()) {
+      int p = todo.back();
+      todo.pop_back();
+      int x = p % g_w;
+      int y = p / g_w;
+      b.size++;
+      for (int dp = 0; dp < 4; dp++) {
+        // How far along DP, and along each CC side of it.
+        int along = x * kDx[dp] + y * kDy[dp];
+        int left = x * kDy[dp] - y * kDx[dp];
+        for (int cc = 0; cc < 2; cc++) {
+          int s = dp * 2 + cc;
+          int ex = b.exit_x[s];
+          int ey = b.exit_y[s];
+          int e_along = ex * kDx[dp] + ey * kDy[dp];
+          int e_left = ex * kDy[dp] - ey * kDx[dp];
+          int side = cc ? -left : left;
+          int e_side = cc ? -e_left : e_left;
+          if (along > e_along || (along == e_along && side > e_side)) {
+            b.exit_x[s] = x;
+            b.exit_y[s] = y;
+          }
+        }
+        int nx = x + kDx[dp];
+        int ny = y + kDy[dp];
+        if (color_at(nx, ny) != c)
+          continue;
+        size_t np = (size_t)ny * g_w + nx;
+        if (g_block_of[np] < 0) {
+          g_block_of[np] = id;
+          todo.push_back(np);
+        }
+      }
+    }
+    g_blocks.push_back(b);
+  }
+  g_moves.resize(g_blocks.size() * 8);
+}
+
+static int command(int from, int to) {
+  from -= 2;
+  to -= 2;
+  int dh = (to / 3 - from / 3 + 6) % 6;
+  int dl = (to % 3 - from % 3 + 3) % 3;
+  return dh * 3 + dl;
+}
+
+// Works out the move out of the block b in the DP/CC state s. Blocked
+// moves toggle CC, then turn DP, eight times at most. A slide through
+// white which is blocked does both at once, and stops when it comes
+// back to where it was.
+static const Move& move_of(int b, int s) {
+  Move* m = &g_moves[b * 8 + s];
+  if (m->done)
+    return *m;
+  m->done = true;
+  m->halt = true;
+  m->op = OP_NONE;
+  m->size = g_blocks[b].size;
+
+  int dp = s / 2;
+  int cc = s % 2;
+  const Block& blk = g_blocks[b];
+  int color = -1;
+  for (int tries = 0; tries < 8; tries++) {
+    int x = blk.exit_x[dp * 2 + cc];
+    int y = blk.exit_y[dp * 2 + cc];
+    color = g_color[(size_t)y * g_w + x];
+    int nx = x + kDx[dp];
+    int ny = y + kDy[dp];
+    int c = color_at(nx, ny);
+    if (c == BLACK) {
+      if (tries % 2 == 0)
+        cc ^= 1;
+      else
+        dp = (dp + 1) % 4;
+      continue;
+    }
+    if (c != WHITE) {
+      m->halt = false;
+      m->op = command(color, c);
+      m->next = g_block_of[(size_t)ny * g_w + nx] * 8 + dp * 2 + cc;
+      return *m;
+    }
+
+    // A slide can only loop through the codels it was blocked at.
+    vector<size_t> blocked;
+    x = nx;
+    y = ny;
+    while (true) {
+      nx = x + kDx[dp];
+      ny = y + kDy[dp];
+      c = color_at(nx, ny);
+      if (c == BLACK) {
+        size_t key = ((size_t)y * g_w + x) * 4 + dp;
+        if (find(blocked.begin(), blocked.end(), key) != blocked.end())
+          return *m;
+        blocked.push_back(key);
+        cc ^= 1;
+        dp = (dp + 1) % 4;
+      } else if (c == WHITE) {
+        x = nx;
+        y = ny;
+      } else {
+        m->halt = false;
+        m->next = g_block_of[(size_t)ny * g_w + nx] * 8 + dp * 2 + cc;
+        return *m;
+      }
+    }
+  }
+  return *m;
+}
+
+static vector<Op> g_code;
+// Where the code of each block and DP/CC state starts, or -1.
+static vector<int> g_entry;
+// The first op of the current run which may be folded.
+static size_t g_fuse_floor;
+
+static bool is_push(size_t back) {
+  return g_code.size() >= g_fuse_floor + back + 1 &&
+      g_code[g_code.size() - 1 - back].op == OP_PUSH;
+}
+
+static Word push_arg(size_t back) {
+  return g_code[g_code.size() - 1 - back].arg;
+}
+
+static Word floor_mod(Word a, Word b) {
+  Word r = a % b;
+  if (r && ((r < 0) != (b < 0)))
+    r += b;
+  return r;
+}
+
+static Word arith(int op, Word a, Word b) {
+  switch (op) {
+    case OP_ADD: return a + b;
+    case OP_SUB: return a - b;
+    case OP_MUL: return a * b;
+    case OP_DIV: return a / b;
+    case OP_MOD: return floor_mod(a, b);
+    case OP_GT: return a > b;
+    default: fail("oops");
+  }
+  return 0;
+}
+
+static void add_op(int op, Word arg, Word arg2) {
+  Op o;
+  o.op = op;
+  o.arg = arg;
+  o.arg2 = arg2;
+  g_code.push_back(o);
+}
+
+// Appends a command, folded with the pushes before it where possible.
+static void add_command(int op, Word size) {
+  bool is_arith = op >= OP_ADD && op <= OP_GT && op != OP_NOT;
+  if (is_arith && is_push(0) && is_push(1)) {
+    Word a = push_arg(1);
+    Word b = push_arg(0);
+    if (b || (op != OP_DIV && op != OP_MOD)) {
+      g_code.resize(g_code.size() - 2);
+      add_op(OP_PUSH, arith(op, a, b), 0);
+      return;
+    }
+  }
+  if (is_arith && is_push(0)) {
+    Word b = push_arg(0);
+    g_code.pop_back();
+    add_op(OP_ADD_IMM + op - OP_ADD, b, 0);
+    return;
+  }
+  if (op == OP_NOT && is_push(0)) {
+    g_code.back().arg = !g_code.back().arg;
+    return;
+  }
+  if (op == OP_DUP && is_push(0)) {
+    add_op(OP_PUSH, push_arg(0), 0);
+    return;
+  }
+  if (op == OP_POP && is_push(0)) {
+    g_code.pop_back();
+    return;
+  }
+  if (op == OP_ROLL && is_push(0) && is_push(1)) {
+    Word depth = push_arg(1);
+    Word count = push_arg(0);
+    g_code.resize(g_code.size() - 2);
+    add_op(OP_ROLL_IMM, depth, count);
+    return;
+  }
+  add_op(op, op == OP_PUSH ? size : 0, 0);
+}
+
+// Compiles the run of commands from the state s, up to a pointer or
+// switch command, the end of the program, or a state it has been in.
+static int compile(int s) {
+  int start = g_code.size();
+  g_entry[s] = start;
+  g_fuse_floor = start;
+  vector<int> seen;
+  while (true) {
+    seen.push_back(s);
+    const Move& m = move_of(s / 8, s % 8);
+    if (m.halt) {
+      add_op(OP_HALT, 0, 0);
+      break;
+    }
+    if (m.op == OP_PTR || m.op == OP_SWITCH) {
+      add_op(m.op, m.next, 0);
+      break;
+    }
+    if (m.op != OP_NONE)
+      add_command(m.op, m.size);
+    s = m.next;
+    if (g_entry[s] >= 0) {
+      add_op(OP_JMP, g_entry[s], 0);
+      break;
+    }
+    if (find(seen.begin(), seen.end(), s) != seen.end()) {
+      add_op(OP_GOTO, s, 0);
+      break;
+    }
+  }
+  return start;
+}
+
+static int entry(int s) {
+  return g_entry[s] >= 0 ? g_entry[s] : compile(s);
+}
+
+// Rolls the top depth values count times, as npiet does.
+static void roll(vector<Word>* stack, Word depth, Word count) {
+  if (depth <= 0)
+    return;
+  count = floor_mod(count, depth);
+  vector<Word>::iterator end = stack->end();
+  rotate(end - depth, end - count, end);
+}
+
+static void run() {
+  vector<Word> st;
+  g_entry.assign(g_blocks.size() * 8, -1);
+  if (color_at(0, 0) == BLACK || color_at(0, 0) == WHITE)
+    fail("the first codel must be colored");
+  size_t pc = entry(g_block_of[0] * 8);
+  while (true) {
+    Op o = g_code[pc++];
+    switch (o.op) {
+      case OP_PUSH:
+        st.push_back(o.arg);
+        break;
+
+      case OP_POP:
+        if (!st.empty())
+          st.pop_back();
+        break;
+
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+      case OP_GT: {
+        if (st.size() < 2)
+          break;
+        Word b = st.back();
+        if (!b && (o.op == OP_DIV || o.op == OP_MOD))
+          break;
+        st.pop_back();
+        st.back() = arith(o.op, st.back(), b);
+        break;
+      }
+
+      case OP_NOT:
+        if (!st.empty())
+          st.back() = !st.back();
+        break;
+
+      case OP_PTR:
+      case OP_SWITCH: {
+        int s = o.arg;
+        if (!st.empty()) {
+          Word n = st.back();
+          st.pop_back();
+          int dp = s % 8 / 2;
+          int cc = s % 2;
+          if (o.op == OP_PTR)
+            dp = floor_mod(dp + n, 4);
+          else
+            cc ^= n & 1;
+          s = s / 8 * 8 + dp * 2 + cc;
+        }
+        pc = entry(s);
+        break;
+      }
+
+      case OP_DUP:
+        if (!st.empty())
+          st.push_back(st.back());
+        break;
+
+      case OP_ROLL: {
+        if (st.size() < 2)
+          break;
+        Word depth = st[st.size() - 2];
+        Word count = st.back();
+        if (depth < 0 || (size_t)depth > st.size() - 2)
+          break;
+        st.resize(st.size() - 2);
+        roll(&st, depth, count);
+        break;
+      }
+
+      case OP_INN: {
+        long long v;
+        if (scanf("%lld", &v) == 1)
+          st.push_back(v);
+        break;
+      }
+
+      case OP_IN: {
+        int c = getchar();
+        st.push_back(c == EOF ? 0 : c);
+        break;
+      }
+
+      case OP_OUTN:
+        if (!st.empty()) {
+          printf("%lld", st.back());
+          st.pop_back();
+        }
+        break;
+
+      case OP_OUT:
+        if (!st.empty()) {
+          putchar(st.back());
+          st.pop_back();
+        }
+        break;
+
+      case OP_ADD_IMM:
+      case OP_SUB_IMM:
+      case OP_MUL_IMM:
+      case OP_DIV_IMM:
+      case OP_MOD_IMM:
+      case OP_GT_IMM: {
+        int op = o.op - OP_ADD_IMM + OP_ADD;
+        if (st.empty() || (!o.arg && (op == OP_DIV || op == OP_MOD)))
+          st.push_back(o.arg);
+        else
+          st.back() = arith(op, st.back(), o.arg);
+        break;
+      }
+
+      case OP_ROLL_IMM:
+        if (o.arg < 0 || (size_t)o.arg > st.size()) {
+          st.push_back(o.arg);
+          st.push_back(o.arg2);
+          break;
+        }
+        roll(&st, o.arg, o.arg2);
+        break;
+
+      case OP_GOTO: {
+        size_t at = pc - 1;
+        int to = entry(o.arg);
+        g_code[at].op = OP_JMP;
+        g_code[at].arg = to;
+        pc = to;
+        break;
+      }
+
+      case OP_JMP:
+        pc = o.arg;
+        break;
+
+      case OP_HALT:
+        return;
+
+      default:
+        fail("oops");
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <ppm>\n", argv[0]);
+    return 1;
+  }
+  read_ppm(argv[1]);
+  find_blocks();
+  run();
+}
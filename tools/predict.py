@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+#
+# Estimates how long a program would run on each backend, from a
+# profile of it on eli and a table of per-op costs:
+#
+#   out/eli --cost-profile prog.prof prog.eir < prog.in
+#   tools/predict.py prog.prof [target...]
+#
+# The estimate is the startup time of the target, plus the sum over
+# ops of their counts times their costs, plus the cost of taken
+# conditional jumps, plus a dispatch cost for
+# each jump or fall-through whose ends are in different chunks of
+# -chunk= pcs (512 by default, see CHUNKED_FUNC_SIZE). Ops missing from
+# a target's table fall back to their class (cmp, jcc or ext), then to
+# the mean of the target's op costs.
+#
+# The table, tools/costs.tsv, has "target key ns" lines. Measure the
+# costs of a target with
+#
+#   tools/predict.py --calibrate <target> '<runner>'
+#
+# which runs the benchmarks of tools/microbench.py with <runner> (as in
+# tools/bench.py).
+
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from microbench import measure_costs  # noqa: E402
+
+COSTS = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                     'costs.tsv')
+CHUNK = 512
+
+CMP_OPS = ['eq', 'ne', 'lt', 'gt', 'le', 'ge']
+JCC_OPS = ['jeq', 'jne', 'jlt', 'jgt', 'jle', 'jge']
+EXT_OPS = ['mul', 'div', 'mod', 'and', 'or', 'xor', 'shl', 'shr']
+# Keys which aren't ops.
+EXTRA_KEYS = ['startup', 'taken', 'dispatch']
+# Ops which run at most once.
+FREE_OPS = ['exit', 'dump']
+
+
+def read_costs(path=COSTS):
+    costs = {}
+    if not os.path.exists(path):
+        return costs
+    with open(path) as f:
+        for line in f:
+            if line.startswith('#') or not line.strip():
+                continue
+            target, key, ns = line.split()
+            costs.setdefault(target, {})[key] = float(ns)
+    return costs
+
+
+def write_costs(costs, path=COSTS):
+    with open(path, 'w') as f:
+        f.write('# target key ns (see tools/predict.py)\n')
+        for target in sorted(costs):
+            for key in sorted(costs[target]):
+                f.write('%s\t%s\t%.3f\n' % (target, key, costs[target][key]))
+
+
+def read_profile(path):
+    """Returns ({op_kind: count}, [(kind, from, to, count)])."""
+    ops = {}
+    edges = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith('#'):
+                continue
+            w = line.split()
+            if len(w) == 2:
+                ops[w[0]] = int(w[1])
+            elif len(w) == 4:
+                edges.append((w[0], int(w[1]), int(w[2]), int(w[3])))
+    return ops, edges
+
+
+def op_class(key):
+    op, _, kind = key.partition('_')
+    if op in CMP_OPS:
+        return 'cmp_' + kind
+    if op in JCC_OPS:
+        return 'jcc_' + kind
+    if op in EXT_OPS:
+        return 'ext_' + kind
+    return None
+
+
+def op_cost(table, key, missing):
+    if key in table:
+        return table[key]
+    cls = op_class(key)
+    if cls in table:
+        return table[cls]
+    if key in FREE_OPS:
+        return 0.0
+    missing.add(key)
+    op_costs = [v for k, v in table.items() if k not in EXTRA_KEYS]
+    return sum(op_costs) / len(op_costs) if op_costs else 0.0
+
+
+def predict(table, ops, edges, chunk):
+    """Returns (seconds, keys missing from table)."""
+    missing = set()
+    ns = table.get('startup', 0.0)
+    for key, count in ops.items():
+        ns += count * op_cost(table, key, missing)
+    for kind, src, dst, count in edges:
+        if kind == 'taken':
+            ns += count * table.get('taken', 0.0)
+        if src // chunk != dst // chunk:
+            ns += count * table.get('dispatch', 0.0)
+    return ns / 1e9, missing
+
+
+def main_predict(argv):
+    chunk = CHUNK
+    args = []
+    for a in argv:
+        if a.startswith('-chunk='):
+            chunk = int(a[7:])
+        else:
+            args.append(a)
+    if not args:
+        sys.exit('usage: %s [-chunk=N] <profile> [target...]\n'
+                 '       %s --calibrate <target> <runner>' %
+                 (sys.argv[0], sys.argv[0]))
+    costs = read_costs()
+    ops, edges = read_profile(args[0])
+    targets = args[1:] or sorted(costs)
+    rows = []
+    for target in targets:
+        if target not in costs:
+            print('%-8s no costs in %s' % (target, COSTS))
+            continue
+        sec, missing = predict(costs[target], ops, edges, chunk)
+        rows.append((sec, target, missing))
+    for sec, target, missing in sorted(rows):
+        note = ''
+        if missing:
+            note = '  (guessed: %s)' % ' '.join(sorted(missing))
+        print('%-8s %12.3f%s' % (target, sec, note))
+
+
+def main_calibrate(target, runner):
+    table = measure_costs(target, runner,
+                          log=lambda s: print(s, flush=True))
+    # The memory access patterns and GETC at EOF don't match ops of a
+    # profile.
+    table = {k: v for k, v in table.items()
+             if k in EXTRA_KEYS or k == 'getc' or
+             k.endswith('_reg') or k.endswith('_imm')}
+    costs = read_costs()
+    costs[target] = table
+    write_costs(costs)
+
+
+def main(argv):
+    if len(argv) == 4 and argv[1] == '--calibrate':
+        main_calibrate(argv[2], argv[3])
+    else:
+        main_predict(argv[1:])
+
+
+if __name__ == '__main__':
+    main(sys.argv)
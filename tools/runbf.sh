@@ -2,6 +2,13 @@
 
 set -e
 
-out/bfopt -c $1 $1.c
+. tools/unzprog.sh
+
+if [ "$(uname -sm)" = "Linux x86_64" ]; then
+  out/bfopt -j "$prog"
+  exit
+fi
+
+out/bfopt -c "$prog" $1.c
 tinycc/tcc -Btinycc $1.c -o $1.c.exe
 ./$1.c.exe
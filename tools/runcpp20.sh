@@ -0,0 +1,21 @@
+#!/bin/bash
+
+set -e
+
+dir=$(mktemp -d)
+mkdir -p $dir
+cp $1 $dir
+infile=${dir}/input.txt
+
+cat > $infile
+
+if [ ! -s $infile ]; then
+    echo '""' > $infile
+else
+  sed -i '1s/^/R"(/' $infile
+  echo ')"' >> $infile
+fi
+
+g++ -std=c++20 -fconstexpr-loop-limit=100000000 -fconstexpr-ops-limit=4294967296 -x c++ ${dir}/$(basename $1) -o $1.exe
+rm -fr $dir
+./$1.exe
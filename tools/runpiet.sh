@@ -2,8 +2,10 @@
 
 set -e
 
+. tools/unzprog.sh
+
 #convert $1 $1.png
-(cat /dev/stdin && /bin/echo -ne "\0") | npiet/npiet -q $1
+(cat /dev/stdin && /bin/echo -ne "\0") | out/pietopt "$prog"
 exit
 
 # http://www.matthias-ernst.eu/pietcompiler.html
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+#
+# A parallel runtest.sh. It runs a binary on each of its inputs, as
+#
+#   tools/runtest.py [-j N] [-t times.tsv] <out> <cmd>...
+#
+# or, with -f, every (binary, input) case of the jobs listed in a file,
+# one "<out> <cmd>..." per line, in one pool:
+#
+#   tools/runtest.py [-j N] [-t times.tsv] -f <jobs>
+#
+# Each <out> is written as runtest.sh writes it: the outputs of the
+# inputs test/<name>*.in in sorted order, each after an "=== <input> ==="
+# line, with the same ws and sed conventions. An <out> whose cases don't
+# all succeed isn't written and makes the exit status 1. The time of
+# each case goes to stderr, and to a TSV with -t. N defaults to the
+# number of cores, or RUNTEST_JOBS. With RUNTEST_CACHE set, results are
+# cached there as runtest.sh caches them.
+
+import concurrent.futures
+import glob
+import hashlib
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+
+class Job:
+    def __init__(self, out, cmd):
+        self.out = out
+        self.cmd = cmd
+        name = os.path.basename(out).split('.')[0]
+        self.ext = ' '.join(cmd).split('.')[-1]
+        self.ins = sorted(glob.glob('*/%s*.in' % name))
+        self.cached = None
+
+
+def read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+# The key of runtest.sh, with this script in place of that one.
+def cache_key(job):
+    h = hashlib.sha256(' '.join(job.cmd).encode() + b'\n')
+    for w in job.cmd + [__file__]:
+        if os.path.isfile(w):
+            h.update(('== %s\n' % w).encode() + read(w))
+    for path in job.ins:
+        h.update(('== %s\n' % path).encode() + read(path))
+    return h.hexdigest()
+
+
+def run_case(job, path):
+    data = b''
+    if path:
+        with open(path, 'rb') as f:
+            data = f.read()
+    if job.ext == 'ws' and path:
+        data += b'\0'
+    elif job.ext == 'sed':
+        data += b'\n'
+    start = time.time()
+    proc = subprocess.run(job.cmd, input=data, stdout=subprocess.PIPE)
+    return proc.returncode, proc.stdout, time.time() - start
+
+
+# runtest.sh drops the last newline of the whole file after each sed
+# run, which may be the one after the "===" line.
+def strip_sed(job, buf):
+    if job.ext == 'sed' and buf.endswith(b'\n'):
+        return buf[:-1]
+    return buf
+
+
+def assemble(job, results):
+    if not job.ins:
+        return strip_sed(job, results[0][1])
+    buf = b''
+    for path, (_, out, _) in zip(job.ins, results):
+        buf = strip_sed(job, buf + ('=== %s ===\n' % path).encode() + out)
+        buf += b'\n'
+    return buf
+
+
+def main(argv):
+    jobs_arg = os.environ.get('RUNTEST_JOBS')
+    num_workers = int(jobs_arg) if jobs_arg else os.cpu_count()
+    times_path = None
+    jobs = []
+    args = argv[1:]
+    while args and args[0] in ('-j', '-t', '-f'):
+        if len(args) < 2:
+            sys.exit('%s needs an argument' % args[0])
+        opt, val = args[:2]
+        args = args[2:]
+        if opt == '-j':
+            num_workers = int(val)
+        elif opt == '-t':
+            times_path = val
+        else:
+            with open(val) as f:
+                jobs += [Job(l.split()[0], l.split()[1:])
+                         for l in f if l.strip()]
+    if args:
+        if len(args) < 2:
+            sys.exit('usage: %s [-j N] [-t times.tsv] <out> <cmd>...\n'
+                     '       %s [-j N] [-t times.tsv] -f <jobs>' %
+                     (argv[0], argv[0]))
+        jobs.append(Job(args[0], args[1:]))
+
+    cache = os.environ.get('RUNTEST_CACHE', '')
+    for job in jobs:
+        if cache:
+            job.cached = os.path.join(cache, cache_key(job))
+            if os.path.exists(job.cached):
+                shutil.copyfile(job.cached, job.out)
+    jobs = [job for job in jobs
+            if not job.cached or not os.path.exists(job.cached)]
+
+    cases = [(job, i, path)
+             for job in jobs
+             for i, path in enumerate(job.ins or [None])]
+    results = {}
+    with concurrent.futures.ThreadPoolExecutor(num_workers) as pool:
+        futures = {pool.submit(run_case, job, path): (job, i, path)
+                   for job, i, path in cases}
+        for future in concurrent.futures.as_completed(futures):
+            job, i, path = futures[future]
+            status, out, elapsed = future.result()
+            results[id(job), i] = (status, out, elapsed)
+            sys.stderr.write('%s %s %.3f%s\n' %
+                             (job.out, path or '-', elapsed,
+                              ' FAILED' if status else ''))
+
+    failed = False
+    for job in jobs:
+        r = [results[id(job), i] for i in range(len(job.ins or [None]))]
+        if any(status for status, _, _ in r):
+            failed = True
+            continue
+        tmp = job.out + '.tmp'
+        with open(tmp, 'wb') as f:
+            f.write(assemble(job, r))
+        if job.cached:
+            os.makedirs(cache, exist_ok=True)
+            shutil.copyfile(tmp, job.cached + '.tmp')
+            os.rename(job.cached + '.tmp', job.cached)
+        os.rename(tmp, job.out)
+
+    if times_path:
+        with open(times_path, 'w') as f:
+            f.write('out\tinput\tsec\tstatus\n')
+            for job, i, path in cases:
+                status, _, elapsed = results[id(job), i]
+                f.write('%s\t%s\t%.3f\t%s\n' %
+                        (job.out, path or '-', elapsed,
+                         'fail' if status else 'ok'))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main(sys.argv)
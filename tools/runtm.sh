@@ -0,0 +1,7 @@
+#!/bin/sh
+
+set -e
+
+. tools/unzprog.sh
+
+out/tm "$prog"
@@ -2,6 +2,8 @@
 
 set -e
 
-Whitespace/whitespace.out $1 -t > $1.c
+. tools/unzprog.sh
+
+out/wsopt -c "$prog" $1.c
 tinycc/tcc -Btinycc $1.c -o $1.c.exe
 ./$1.c.exe
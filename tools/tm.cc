@@ -39,8 +39,16 @@
    status 1. In either case, the contents of the tape are written to
    stdout, using the same encoding as described above. Symbols that
    are neither 0 nor 1 are ignored, as are incomplete bytes.
+
+   Unless tracing with -v -v, the machine runs from a dense table of
+   renumbered states and symbols, and a transition back to its own
+   state that moves the head is applied to the whole run of its symbol
+   at once, on a tape of 2 or 4 bits a cell when the machine has few
+   enough symbols. With -c, a C program running the machine that way
+   is written to stdout instead.
  */
 
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -77,6 +85,9 @@ namespace std {
 class dtm {
   std::unordered_map<condition, action> transitions;
 public:
+  const std::unordered_map<condition, action> &get_transitions() const {
+    return transitions;
+  }
   void add_transition(state_t q, symbol_t a, state_t r, symbol_t b, int d) {
     if (transitions.count(make_tuple(q,a)) > 0)
       throw std::runtime_error("machine is not deterministic at state " + to_string(q));
@@ -148,7 +159,7 @@ void read_dtm(ifstream &is, dtm &m) {
       m.add_transition(convert_state(fields[0]), convert_symbol(fields[1]),
 		       convert_state(fields[2]), convert_symbol(fields[3]),
 		       convert_direction(fields[4]));
-    } catch (parse_error e) {
+    } catch (const parse_error &e) {
       cerr << e.what() << endl;
       exit(2);
     }
@@ -201,6 +212,231 @@ bool run_dtm(const dtm &m, vector<symbol_t> &tape, int verbose=0) {
   return accept;
 }
 
+// The machine with states and symbols renumbered, and a table of
+// actions indexed by state * nsyms + symbol.
+const int ACCEPT = -1, REJECT = -2;
+
+struct packed_action {
+  int next;
+  uint8_t write;
+  int8_t dir;
+};
+
+struct compiled_dtm {
+  vector<state_t> states;
+  vector<symbol_t> symbols;
+  int sym_index[256];
+  vector<packed_action> table;
+
+  int nsyms() const { return symbols.size(); }
+  const packed_action &at(int q, int a) const {
+    return table[q*symbols.size()+a];
+  }
+  // a self-loop which moves, applied to a run of its symbol at once
+  bool is_sweep(int q, const packed_action &t) const {
+    return t.next == q && t.dir != 0;
+  }
+};
+
+void compile_dtm(const dtm &m, compiled_dtm &c) {
+  unordered_map<state_t, int> state_index;
+  auto state = [&](state_t q) {
+    if (q < 0) return ACCEPT;
+    auto it = state_index.find(q);
+    if (it != state_index.end()) return it->second;
+    c.states.push_back(q);
+    return state_index[q] = c.states.size()-1;
+  };
+  fill(c.sym_index, c.sym_index+256, -1);
+  auto symbol = [&](symbol_t a) {
+    int &i = c.sym_index[(unsigned char)a];
+    if (i < 0) {
+      i = c.symbols.size();
+      c.symbols.push_back(a);
+    }
+    return i;
+  };
+  state(0);
+  for (auto a : {BLANK, ZERO, ONE})
+    symbol(a);
+  for (const auto &t: m.get_transitions()) {
+    state(get<0>(t.first));
+    state(get<0>(t.second));
+    symbol(get<1>(t.first));
+    symbol(get<1>(t.second));
+  }
+  c.table.assign(c.states.size()*c.symbols.size(), packed_action{REJECT, 0, 0});
+  for (const auto &t: m.get_transitions()) {
+    packed_action &p = c.table[state(get<0>(t.first))*c.symbols.size()
+                               + symbol(get<1>(t.first))];
+    p.next = state(get<0>(t.second));
+    p.write = symbol(get<1>(t.second));
+    p.dir = get<2>(t.second);
+  }
+}
+
+// A tape of BITS-bit cells, BITS dividing 8, packed into bytes so that
+// the small alphabets of target_tm take 2 or 4 bits a cell. Cells
+// past the end read as 0, the blank. It only grows, doubling.
+template<int BITS>
+class packed_tape {
+  static const int PER_BYTE = 8 / BITS;
+  static const uint8_t MASK = (1 << BITS) - 1;
+  vector<uint8_t> bytes;
+  size_t n;
+public:
+  explicit packed_tape(size_t size): bytes((size+PER_BYTE-1)/PER_BYTE, 0), n(size) {}
+  size_t size() const { return n; }
+  void grow() {
+    n *= 2;
+    bytes.resize((n+PER_BYTE-1)/PER_BYTE, 0);
+  }
+  uint8_t get(size_t i) const {
+    return bytes[i/PER_BYTE] >> (i%PER_BYTE*BITS) & MASK;
+  }
+  void set(size_t i, uint8_t a) {
+    uint8_t &b = bytes[i/PER_BYTE];
+    int shift = i%PER_BYTE*BITS;
+    b = (b & ~(MASK << shift)) | a << shift;
+  }
+};
+
+template<int BITS>
+bool run_packed_dtm(const compiled_dtm &m, vector<symbol_t> &tape, int verbose) {
+  size_t len = max(tape.size(), (size_t)1);
+  packed_tape<BITS> t(len*2);
+  for (size_t i = 0; i < tape.size(); i++)
+    t.set(i, m.sym_index[(unsigned char)tape[i]]);
+  // hi is one past the furthest position the head has been at
+  size_t pos = 0, hi = 1;
+  long long int steps = 0;
+  long long int report = verbose == 1 ? 10000000 : -1ULL/2;
+  int q = 0;
+  while (q >= 0) {
+    uint8_t s = t.get(pos);
+    const packed_action &a = m.at(q, s);
+    if (a.next == REJECT)
+      break;
+    if (m.is_sweep(q, a)) {
+      if (a.dir > 0) {
+        do {
+          t.set(pos++, a.write);
+          steps++;
+          if (pos == hi && ++hi == t.size())
+            t.grow();
+        } while (t.get(pos) == s);
+      } else {
+        do {
+          t.set(pos, a.write);
+          steps++;
+          if (!pos) break;
+          pos--;
+        } while (t.get(pos) == s);
+      }
+    } else {
+      t.set(pos, a.write);
+      q = a.next;
+      steps++;
+      if (a.dir > 0) {
+        pos++;
+        if (pos == hi && ++hi == t.size())
+          t.grow();
+      } else if (a.dir < 0 && pos > 0) {
+        pos--;
+      }
+    }
+    if (steps >= report) {
+      cerr << "running: steps=" << steps << " cells=" << hi << endl;
+      report += 10000000;
+    }
+  }
+  bool accept = q < 0;
+  if (verbose >= 1) {
+    cerr << "halt: accept=" << accept << " steps=" << steps << " cells=" << hi << endl;
+  }
+  tape.clear();
+  for (size_t i = 0; i < max(hi, len); i++)
+    tape.push_back(m.symbols[t.get(i)]);
+  return accept;
+}
+
+bool run_compiled_dtm(const compiled_dtm &m, vector<symbol_t> &tape, int verbose=0) {
+  if (m.nsyms() <= 4)
+    return run_packed_dtm<2>(m, tape, verbose);
+  if (m.nsyms() <= 16)
+    return run_packed_dtm<4>(m, tape, verbose);
+  return run_packed_dtm<8>(m, tape, verbose);
+}
+
+// Writes a C program which runs the machine like run_compiled_dtm,
+// with each state a label switching on the symbol under the head.
+void emit_c(const compiled_dtm &m) {
+  cout << "#include <stdio.h>\n#include <stdlib.h>\n\n"
+       << "static unsigned char *tape;\n"
+       << "static size_t pos, hi = 1, size = 1;\n\n"
+       << "static void grow(void) {\n"
+       << "  if (++pos == hi) {\n"
+       << "    if (hi == size) {\n"
+       << "      tape = realloc(tape, size * 2);\n"
+       << "      for (size_t i = size; i < size * 2; i++)\n"
+       << "        tape[i] = " << int(BLANK) << ";\n"
+       << "      size *= 2;\n"
+       << "    }\n"
+       << "    hi++;\n"
+       << "  }\n"
+       << "}\n\n"
+       << "int main(void) {\n"
+       << "  int c;\n"
+       << "  tape = malloc(size);\n"
+       << "  tape[0] = " << int(BLANK) << ";\n"
+       << "  pos = -1;\n"
+       << "  while ((c = getchar()) != EOF) {\n"
+       << "    for (int i = 7; i >= 0; i--) {\n"
+       << "      grow();\n"
+       << "      tape[pos] = c >> i & 1 ? " << int(ONE) << " : " << int(ZERO) << ";\n"
+       << "    }\n"
+       << "  }\n"
+       << "  pos = 0;\n";
+  for (size_t q = 0; q < m.states.size(); q++) {
+    cout << " q" << q << ":\n  switch (tape[pos]) {\n";
+    for (int a = 0; a < m.nsyms(); a++) {
+      const packed_action &t = m.at(q, a);
+      if (t.next == REJECT)
+        continue;
+      int s = m.symbols[a], w = m.symbols[t.write];
+      cout << "  case " << s << ":\n";
+      if (m.is_sweep(q, t)) {
+        cout << "    do {\n      tape[pos] = " << w << ";\n"
+             << (t.dir > 0 ? "      grow();\n" : "      if (!pos) break;\n      pos--;\n")
+             << "    } while (tape[pos] == " << s << ");\n";
+      } else {
+        if (w != s)
+          cout << "    tape[pos] = " << w << ";\n";
+        if (t.dir > 0)
+          cout << "    grow();\n";
+        else if (t.dir < 0)
+          cout << "    if (pos) pos--;\n";
+      }
+      if (t.next == ACCEPT)
+        cout << "    goto accept;\n";
+      else
+        cout << "    goto q" << t.next << ";\n";
+    }
+    cout << "  default:\n    return 1;\n  }\n";
+  }
+  cout << " accept:\n"
+       << "  c = 0;\n"
+       << "  for (size_t i = 0, k = 0; i < hi; i++) {\n"
+       << "    if (tape[i] != " << int(ONE) << " && tape[i] != " << int(ZERO) << ")\n"
+       << "      continue;\n"
+       << "    c = (c << 1 | (tape[i] == " << int(ONE) << ")) & 255;\n"
+       << "    if (++k % 8 == 0)\n"
+       << "      putchar(c);\n"
+       << "  }\n"
+       << "  return 0;\n"
+       << "}\n";
+}
+
 void encode_tape(const string &s, vector<symbol_t> &tape) {
   tape.clear();
   for (auto c: s) {
@@ -230,19 +466,22 @@ void decode_tape(const vector<symbol_t> &tape, string &s) {
 }
 
 void usage() {
-  cerr << "usage: tm [-n] [-v] <filename>\n";
+  cerr << "usage: tm [-n] [-v] [-c] <filename>\n";
   exit(2);
 }
 
 int main(int argc, char *argv[]) {
   int verbose = 0;
-  bool read_input = true;
+  bool read_input = true, to_c = false;
   int ch;
-  while ((ch = getopt(argc, argv, "nv")) != -1) {
+  while ((ch = getopt(argc, argv, "nvc")) != -1) {
     switch (ch) {
     case 'n':
       read_input = false;
       break;
+    case 'c':
+      to_c = true;
+      break;
     case 'v': 
       verbose++;
       break;
@@ -261,6 +500,12 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   read_dtm(is, m);
+  compiled_dtm cm;
+  compile_dtm(m, cm);
+  if (to_c) {
+    emit_c(cm);
+    return 0;
+  }
 
   char c;
   string s;
@@ -271,7 +516,7 @@ int main(int argc, char *argv[]) {
   vector<symbol_t> tape;
   encode_tape(s, tape);
 
-  if (run_dtm(m, tape, verbose)) {
+  if (verbose >= 2 ? run_dtm(m, tape, verbose) : run_compiled_dtm(cm, tape, verbose)) {
     decode_tape(tape, s);
     cout << s;
     return 0;
@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Runs Unlambda, as target/unl.c emits it:
+//
+//   unlopt <unl>
+//
+// Expressions, values and continuation frames are all 16 byte cells in
+// one pool. The cells of the program are never freed; the others are
+// reused through a free list after a mark and sweep, which doesn't look
+// into the program except where a value was memoized in it.
+//
+// An application of only s, k, i, v and d always evaluates to the same
+// value, so its node is replaced by an indirection to the value once
+// it is evaluated, and the recursions unl.c builds by delaying such
+// expressions share their work. The combinators of unl.c which build
+// lists and numbers (CONS, CAR, CDR, COMPOSE and the Church numerals)
+// become native functions when they appear in the source.
+
+using namespace std;
+
+typedef unsigned int uint;
+
+enum Tag {
+  // Values. The ones which take arguments hold them in a and b.
+  T_S,
+  T_K,
+  T_I,
+  T_V,
+  T_C,
+  T_D,
+  T_E,
+  T_AT,
+  T_PIPE,
+  // .x, and r as .\n, with the char in a.
+  T_DOT,
+  // ?x, with the char in a.
+  T_QUES,
+  T_S1,
+  T_S2,
+  T_K1,
+  // A promise of the expression a.
+  T_D1,
+  // A continuation: the frame a.
+  T_CONT,
+  // COMPOSE, which applies a to the result of b.
+  T_B,
+  T_B1,
+  T_B2,
+  T_CONS,
+  T_CONS1,
+  T_CONS2,
+  T_CAR,
+  T_CDR,
+  // The Church numeral a, and it applied to b.
+  T_CHURCH,
+  T_CHURCH1,
+
+  // Expressions: a applied to b, which can be memoized if c is set,
+  // and the value a such an application evaluated to.
+  T_APP,
+  T_IND,
+
+  // Continuation frames, each with its next frame in b.
+  // The operator was evaluated; the operand is the expression a.
+  F_ARG,
+  // Apply the value a to the result.
+  F_APPLY,
+  // Apply the result to the value a.
+  F_APPLY_TO,
+  // Memoize the result in the application a.
+  F_MEMO,
+  // The first half of S: apply the value a to the value c next.
+  F_S,
+  // Apply the value a to the result c more times.
+  F_CHURCH,
+  F_HALT,
+
+  T_FREE,
+  NUM_TAGS
+};
+
+struct Cell {
+  uint tag;
+  uint a;
+  uint b;
+  uint c;
+};
+
+// Which of a, b and c point to cells, as bits 1, 2 and 4.
+static unsigned char g_ptrs[NUM_TAGS];
+
+static vector<Cell> g_heap;
+// Cells below this are the program's, and are never freed.
+static uint g_perm;
+static uint g_free;
+static uint g_num_free;
+// The applications which were memoized, the only program cells which
+// point to the rest.
+static vector<uint> g_memos;
+
+// Values without arguments.
+static uint g_s, g_k, g_i, g_v, g_c, g_d, g_e, g_at, g_pipe, g_ki;
+static uint g_b, g_cons, g_car, g_cdr;
+static uint g_halt;
+
+// The registers of the machine, which are the roots of a GC.
+static uint g_expr;
+static uint g_val;
+static uint g_fn;
+static uint g_k_reg;
+
+static int g_cur_char = -1;
+
+static void fail(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+static uint new_cell(uint tag, uint a, uint b, uint c) {
+  uint i;
+  if (g_free) {
+    i = g_free;
+    g_free = g_heap[i].a;
+    g_num_free--;
+  } else {
+    i = g_heap.size();
+    g_heap.push_back(Cell());
+  }
+  Cell* p = &g_heap[i];
+  p->tag = tag;
+  p->a = a;
+  p->b = b;
+  p->c = c;
+  return i;
+}
+
+static void init_tags() {
+  const uint A = 1, B = 2, C = 4;
+  g_ptrs[T_S1] = A;
+  g_ptrs[T_S2] = A | B;
+  g_ptrs[T_K1] = A;
+  g_ptrs[T_D1] = A;
+  g_ptrs[T_CONT] = A;
+  g_ptrs[T_B1] = A;
+  g_ptrs[T_B2] = A | B;
+  g_ptrs[T_CONS1] = A;
+  g_ptrs[T_CONS2] = A | B;
+  g_ptrs[T_CHURCH1] = B;
+  g_ptrs[T_APP] = A | B;
+  g_ptrs[T_IND] = A;
+  g_ptrs[F_ARG] = A | B;
+  g_ptrs[F_APPLY] = A | B;
+  g_ptrs[F_APPLY_TO] = A | B;
+  g_ptrs[F_MEMO] = A | B;
+  g_ptrs[F_S] = A | B | C;
+  g_ptrs[F_CHURCH] = A | B;
+}
+
+static void gc() {
+  vector<bool> marked(g_heap.size());
+  vector<uint> todo;
+  todo.push_back(g_expr);
+  todo.push_back(g_val);
+  todo.push_back(g_fn);
+  todo.push_back(g_k_reg);
+  for (size_t i = 0; i < g_memos.size(); i++)
+    todo.push_back(g_heap[g_memos[i]].a);
+  while (!todo.empty()) {
+    uint i = todo.back();
+    todo.pop_back();
+    if (i < g_perm || marked[i])
+      continue;
+    marked[i] = true;
+    const Cell& c = g_heap[i];
+    uint ptrs = g_ptrs[c.tag];
+    if (ptrs & 1)
+      todo.push_back(c.a);
+    if (ptrs & 2)
+      todo.push_back(c.b);
+    if (ptrs & 4)
+      todo.push_back(c.c);
+  }
+
+  g_free = 0;
+  g_num_free = 0;
+  for (uint i = g_heap.size(); i-- > g_perm;) {
+    if (marked[i])
+      continue;
+    g_heap[i].tag = T_FREE;
+    g_heap[i].a = g_free;
+    g_free = i;
+    g_num_free++;
+  }
+  // Keep at least as many free cells as live ones.
+  size_t live = g_heap.size() - g_perm - g_num_free;
+  if (g_num_free < live + 4096)
+    g_heap.reserve(g_heap.size() + live + 4096);
+}
+
+// Whether the free list and the room left in the pool can't take the
+// cells of one step.
+static bool needs_gc() {
+  return g_num_free < 4 && g_heap.size() + 4 > g_heap.capacity();
+}
+
+static uint val_of(uint x) {
+  return g_heap[x].tag == T_IND ? g_heap[x].a : x;
+}
+
+static bool is_value(uint x) {
+  return g_heap[x].tag < T_APP;
+}
+
+// Parsing.
+
+static const char CONS[] = "``s``s`ks``s`kk``s`ks``s`k`sik`kk";
+static const char CAR[] = "``si`kk";
+static const char CDR[] = "``si`k`ki";
+static const char COMPOSE[] = "``s`ksk";
+
+static const char* CHURCHNUM[] = {
+  "`ki",
+  "i",
+  "``s``s`kski",
+  "```ss``ss`ki``s`ksk",
+  "``ci``s``s`kski",
+  "``s``s`ksk``ci``s``s`kski",
+  "```ss``ss`k``ci``s``s`kski``s`ksk",
+  "```ss``ss``ss`k``ci``s``s`kski``s`ksk",
+  "```s``s`ksk`ci``s``s`kski",
+  "````ss`ss``ss`ki``s`ksk",
+  "```ss```ss`ss``ss`ki``s`ksk",
+  "```ss``ss```ss`ss``ss`ki``s`ksk",
+  "```ss``ss``ss```ss`ss``ss`ki``s`ksk",
+  "```ss``ss``ss``ss```ss`ss``ss`ki``s`ksk",
+  "```ss``ss``ss``ss``ss```ss`ss``ss`ki``s`ksk",
+  "```ss``ss``ss``ss``ss``ss```ss`ss``ss`ki``s`ksk",
+  "```s`cii``s``s`kski",
+  "``s``s`ksk```s`cii``s``s`kski",
+  "```ss``ss`k```s`cii``s``s`kski``s`ksk",
+  "```ss``ss``ss`k```s`cii``s``s`kski``s`ksk",
+  "````sss``s`ksk``ci``s``s`kski",
+  "```ss``s``sss`k``ci``s``s`kski``s`ksk",
+  "```ss``ss``s``sss`k``ci``s``s`kski``s`ksk",
+  "```ss``ss``ss``s``sss`k``ci``s``s`kski``s`ksk",
+  "```s``si``s`ci`k`s``s`ksk``s`cii``s``s`kski",
+};
+
+// The native value of each combinator spelled as above.
+static map<string, uint> g_natives;
+
+static void init_values() {
+  g_s = new_cell(T_S, 0, 0, 0);
+  g_k = new_cell(T_K, 0, 0, 0);
+  g_i = new_cell(T_I, 0, 0, 0);
+  g_v = new_cell(T_V, 0, 0, 0);
+  g_c = new_cell(T_C, 0, 0, 0);
+  g_d = new_cell(T_D, 0, 0, 0);
+  g_e = new_cell(T_E, 0, 0, 0);
+  g_at = new_cell(T_AT, 0, 0, 0);
+  g_pipe = new_cell(T_PIPE, 0, 0, 0);
+  g_ki = new_cell(T_K1, g_i, 0, 0);
+  g_b = new_cell(T_B, 0, 0, 0);
+  g_cons = new_cell(T_CONS, 0, 0, 0);
+  g_car = new_cell(T_CAR, 0, 0, 0);
+  g_cdr = new_cell(T_CDR, 0, 0, 0);
+  g_halt = new_cell(F_HALT, 0, 0, 0);
+
+  g_natives[CONS] = g_cons;
+  g_natives[CAR] = g_car;
+  g_natives[CDR] = g_cdr;
+  g_natives[COMPOSE] = g_b;
+  for (uint n = 0; n < sizeof(CHURCHNUM) / sizeof(CHURCHNUM[0]); n++) {
+    if (CHURCHNUM[n][0] == '`')
+      g_natives[CHURCHNUM[n]] = new_cell(T_CHURCH, n, 0, 0);
+  }
+}
+
+static bool is_pure(uint x) {
+  const Cell& c = g_heap[x];
+  switch (c.tag) {
+    case T_S:
+    case T_K:
+    case T_I:
+    case T_V:
+    case T_D:
+    case T_B:
+    case T_CONS:
+    case T_CAR:
+    case T_CDR:
+    case T_CHURCH:
+      return true;
+    case T_APP:
+      return c.c;
+    default:
+      return false;
+  }
+}
+
+// Reads an expression, without the whitespace and comments, as the
+// text the natives are matched against.
+static uint parse(FILE* fp) {
+  struct Pending {
+    // The application being read, its operator once it is read, and
+    // where its text starts.
+    uint fn;
+    bool has_fn;
+    size_t start;
+  };
+  vector<Pending> stack;
+  string text;
+  size_t max_native = 0;
+  for (map<string, uint>::const_iterator it = g_natives.begin();
+       it != g_natives.end(); ++it) {
+    max_native = max(max_native, it->first.size());
+  }
+
+  while (true) {
+    int ch = fgetc(fp);
+    if (ch == EOF)
+      fail("unexpected EOF");
+    if (ch == '#') {
+      while (ch != '\n' && ch != EOF)
+        ch = fgetc(fp);
+      continue;
+    }
+    if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r')
+      continue;
+
+    text += ch;
+    if (ch == '`') {
+      Pending p;
+      p.fn = 0;
+      p.has_fn = false;
+      p.start = text.size() - 1;
+      stack.push_back(p);
+      continue;
+    }
+
+    uint x;
+    switch (ch) {
+      case 's': case 'S': x = g_s; break;
+      case 'k': case 'K': x = g_k; break;
+      case 'i': case 'I': x = g_i; break;
+      case 'v': case 'V': x = g_v; break;
+      case 'c': case 'C': x = g_c; break;
+      case 'd': case 'D': x = g_d; break;
+      case 'e': case 'E': x = g_e; break;
+      case '@': x = g_at; break;
+      case '|': x = g_pipe; break;
+      case 'r': case 'R': x = new_cell(T_DOT, '\n', 0, 0); break;
+      case '.':
+      case '?': {
+        int arg = fgetc(fp);
+        if (arg == EOF)
+          fail("unexpected EOF");
+        text += arg;
+        x = new_cell(ch == '.' ? T_DOT : T_QUES, arg, 0, 0);
+        break;
+      }
+      default:
+        fprintf(stderr, "unknown char: %c\n", ch);
+        exit(1);
+    }
+
+    // Close the applications this completes.
+    while (true) {
+      if (stack.empty())
+        return x;
+      Pending* p = &stack.back();
+      if (!p->has_fn) {
+        p->fn = x;
+        p->has_fn = true;
+        break;
+      }
+      size_t len = text.size() - p->start;
+      if (len <= max_native) {
+        map<string, uint>::const_iterator found =
+            g_natives.find(text.substr(p->start, len));
+        if (found != g_natives.end()) {
+          x = found->second;
+          stack.pop_back();
+          continue;
+        }
+      }
+      x = new_cell(T_APP, p->fn, x, is_pure(p->fn) && is_pure(x));
+      stack.pop_back();
+    }
+  }
+}
+
+// Evaluation.
+
+enum Mode {
+  EVAL,
+  RETURN,
+  APPLY
+};
+
+static void run(uint prog) {
+  Mode mode = EVAL;
+  g_expr = prog;
+  g_k_reg = g_halt;
+  while (true) {
+    if (needs_gc())
+      gc();
+
+    switch (mode) {
+      case EVAL: {
+        const Cell& c = g_heap[g_expr];
+        if (c.tag == T_IND) {
+          g_val = c.a;
+          mode = RETURN;
+          break;
+        }
+        if (c.tag != T_APP) {
+          g_val = g_expr;
+          mode = RETURN;
+          break;
+        }
+        uint f = c.a;
+        uint x = c.b;
+        if (c.c)
+          g_k_reg = new_cell(F_MEMO, g_expr, g_k_reg, 0);
+        if (!is_value(f) && g_heap[f].tag != T_IND) {
+          g_k_reg = new_cell(F_ARG, x, g_k_reg, 0);
+          g_expr = f;
+          break;
+        }
+        f = val_of(f);
+        if (g_heap[f].tag == T_D) {
+          g_val = new_cell(T_D1, x, 0, 0);
+          mode = RETURN;
+        } else if (is_value(x) || g_heap[x].tag == T_IND) {
+          g_fn = f;
+          g_val = val_of(x);
+          mode = APPLY;
+        } else {
+          g_k_reg = new_cell(F_APPLY, f, g_k_reg, 0);
+          g_expr = x;
+        }
+        break;
+      }
+
+      case RETURN: {
+        const Cell k = g_heap[g_k_reg];
+        switch (k.tag) {
+          case F_ARG:
+            g_k_reg = k.b;
+            if (g_heap[g_val].tag == T_D) {
+              g_val = new_cell(T_D1, k.a, 0, 0);
+            } else if (is_value(k.a) || g_heap[k.a].tag == T_IND) {
+              g_fn = g_val;
+              g_val = val_of(k.a);
+              mode = APPLY;
+            } else {
+              g_k_reg = new_cell(F_APPLY, g_val, g_k_reg, 0);
+              g_expr = k.a;
+              mode = EVAL;
+            }
+            break;
+
+          case F_APPLY:
+            g_fn = k.a;
+            g_k_reg = k.b;
+            mode = APPLY;
+            break;
+
+          case F_APPLY_TO:
+            g_fn = g_val;
+            g_val = k.a;
+            g_k_reg = k.b;
+            mode = APPLY;
+            break;
+
+          case F_MEMO:
+            g_heap[k.a].tag = T_IND;
+            g_heap[k.a].a = g_val;
+            g_memos.push_back(k.a);
+            g_k_reg = k.b;
+            break;
+
+          case F_S:
+            g_k_reg = new_cell(F_APPLY, g_val, k.b, 0);
+            g_fn = k.a;
+            g_val = k.c;
+            mode = APPLY;
+            break;
+
+          case F_CHURCH:
+            g_fn = k.a;
+            g_k_reg = k.c > 1 ? new_cell(F_CHURCH, k.a, k.b, k.c - 1) : k.b;
+            mode = APPLY;
+            break;
+
+          case F_HALT:
+            return;
+
+          default:
+            fail("oops");
+        }
+        break;
+      }
+
+      case APPLY: {
+        const Cell f = g_heap[g_fn];
+        uint x = g_val;
+        mode = RETURN;
+        switch (f.tag) {
+          case T_S:
+            g_val = new_cell(T_S1, x, 0, 0);
+            break;
+          case T_S1:
+            g_val = new_cell(T_S2, f.a, x, 0);
+            break;
+          case T_S2:
+            g_k_reg = new_cell(F_S, f.b, g_k_reg, x);
+            g_fn = f.a;
+            mode = APPLY;
+            break;
+          case T_K:
+            g_val = new_cell(T_K1, x, 0, 0);
+            break;
+          case T_K1:
+            g_val = f.a;
+            break;
+          case T_I:
+            break;
+          case T_V:
+            g_val = g_v;
+            break;
+          case T_C:
+            g_fn = x;
+            g_val = new_cell(T_CONT, g_k_reg, 0, 0);
+            mode = APPLY;
+            break;
+          case T_D:
+            g_val = new_cell(T_D1, x, 0, 0);
+            break;
+          case T_D1:
+            g_k_reg = new_cell(F_APPLY_TO, x, g_k_reg, 0);
+            g_expr = f.a;
+            mode = EVAL;
+            break;
+          case T_CONT:
+            g_k_reg = f.a;
+            break;
+          case T_E:
+            fflush(stdout);
+            exit(0);
+          case T_DOT:
+            putchar(f.a);
+            break;
+          case T_AT:
+            g_cur_char = getchar();
+            g_fn = x;
+            g_val = g_cur_char == EOF ? g_v : g_i;
+            mode = APPLY;
+            break;
+          case T_QUES:
+            g_fn = x;
+            g_val = g_cur_char == (int)f.a ? g_i : g_v;
+            mode = APPLY;
+            break;
+          case T_PIPE:
+            g_fn = x;
+            g_val = g_cur_char == EOF ? g_v : new_cell(T_DOT, g_cur_char, 0, 0);
+            mode = APPLY;
+            break;
+          case T_B:
+            g_val = new_cell(T_B1, x, 0, 0);
+            break;
+          case T_B1:
+            g_val = new_cell(T_B2, f.a, x, 0);
+            break;
+          case T_B2:
+            g_k_reg = new_cell(F_APPLY, f.a, g_k_reg, 0);
+            g_fn = f.b;
+            mode = APPLY;
+            break;
+          case T_CONS:
+            g_val = new_cell(T_CONS1, x, 0, 0);
+            break;
+          case T_CONS1:
+            g_val = new_cell(T_CONS2, f.a, x, 0);
+            break;
+          case T_CONS2:
+            g_k_reg = new_cell(F_APPLY_TO, f.b, g_k_reg, 0);
+            g_fn = x;
+            g_val = f.a;
+            mode = APPLY;
+            break;
+          case T_CAR:
+            g_fn = x;
+            g_val = g_k;
+            mode = APPLY;
+            break;
+          case T_CDR:
+            g_fn = x;
+            g_val = g_ki;
+            mode = APPLY;
+            break;
+          case T_CHURCH:
+            g_val = new_cell(T_CHURCH1, f.a, x, 0);
+            break;
+          case T_CHURCH1:
+            if (!f.a)
+              break;
+            if (f.a > 1)
+              g_k_reg = new_cell(F_CHURCH, f.b, g_k_reg, f.a - 1);
+            g_fn = f.b;
+            mode = APPLY;
+            break;
+          default:
+            fail("oops");
+        }
+        break;
+      }
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <unl>\n", argv[0]);
+    return 1;
+  }
+  FILE* fp = fopen(argv[1], "rb");
+  if (!fp) {
+    perror("open");
+    return 1;
+  }
+  init_tags();
+  // Index 0 is never a cell, so that it can end the free list.
+  new_cell(T_FREE, 0, 0, 0);
+  init_values();
+  uint prog = parse(fp);
+  fclose(fp);
+  g_perm = g_heap.size();
+  g_heap.reserve(g_perm + (1 << 20));
+  g_expr = g_val = g_fn = prog;
+  run(prog);
+  fflush(stdout);
+}
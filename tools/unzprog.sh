@@ -0,0 +1,17 @@
+# Sourced by the runners to accept programs written by elc -z=gzip or
+# -z=zstd. Sets prog to $1, or to a fifo the program is decompressed
+# into, so that it's never stored uncompressed.
+
+prog=$1
+case "$(od -An -tx1 -N4 "$1" | tr -d ' ')" in
+  1f8b*) unz="gzip -dc" ;;
+  28b52ffd) unz="zstd -dcq" ;;
+  *) unz= ;;
+esac
+if [ -n "$unz" ]; then
+  unzdir=$(mktemp -d)
+  trap 'rm -rf "$unzdir"' EXIT
+  prog=$unzdir/prog
+  mkfifo "$prog"
+  $unz "$1" > "$prog" &
+fi
@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Runs Whitespace, as target/ws.c emits it, or compiles it to C with -c:
+//
+//   wsopt <ws>
+//   wsopt -c <ws> <c>
+//
+// Labels are resolved to offsets when the program is read, the heap is
+// a plain array, and the push/retrieve/store sequences of
+// ws_emit_retrieve and ws_emit_reg_store_end become single ops. Numbers
+// are 64bit, which the 24bit words and their products fit in. GETC
+// stores 0 at EOF, as ELVM does.
+
+using namespace std;
+
+typedef long long Word;
+
+enum OpType {
+  OP_PUSH,
+  OP_DUP,
+  OP_COPY,
+  OP_SWAP,
+  OP_DISCARD,
+  OP_SLIDE,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_STORE,
+  OP_RETRIEVE,
+  OP_MARK,
+  OP_CALL,
+  OP_JMP,
+  OP_JZ,
+  OP_JN,
+  OP_RET,
+  OP_EXIT,
+  OP_PUTC,
+  OP_PUTINT,
+  OP_GETC,
+  OP_GETINT,
+
+  // push arg; retrieve
+  OP_LOAD,
+  // push arg; push arg2; store
+  OP_STORE_IMM,
+  // push arg; swap; store, which stores the top at arg.
+  OP_STORE_TO,
+  // dup; push arg; swap; store, which keeps the top, too.
+  OP_STORE_KEEP,
+  // push arg; <op> for OP_ADD to OP_MOD.
+  OP_ADD_IMM,
+  OP_SUB_IMM,
+  OP_MUL_IMM,
+  OP_DIV_IMM,
+  OP_MOD_IMM,
+  // push arg; retrieve; <op> for OP_ADD to OP_MOD.
+  OP_ADD_HEAP,
+  OP_SUB_HEAP,
+  OP_MUL_HEAP,
+  OP_DIV_HEAP,
+  OP_MOD_HEAP,
+};
+
+static const struct {
+  const char* ws;
+  OpType op;
+  // Whether a number (1) or a label (2) follows.
+  int arg;
+} kOps[] = {
+  { "  ", OP_PUSH, 1 },
+  { " \n ", OP_DUP, 0 },
+  { " \t ", OP_COPY, 1 },
+  { " \n\t", OP_SWAP, 0 },
+  { " \n\n", OP_DISCARD, 0 },
+  { " \t\n", OP_SLIDE, 1 },
+  { "\t   ", OP_ADD, 0 },
+  { "\t  \t", OP_SUB, 0 },
+  { "\t  \n", OP_MUL, 0 },
+  { "\t \t ", OP_DIV, 0 },
+  { "\t \t\t", OP_MOD, 0 },
+  { "\t\t ", OP_STORE, 0 },
+  { "\t\t\t", OP_RETRIEVE, 0 },
+  { "\n  ", OP_MARK, 2 },
+  { "\n \t", OP_CALL, 2 },
+  { "\n \n", OP_JMP, 2 },
+  { "\n\t ", OP_JZ, 2 },
+  { "\n\t\t", OP_JN, 2 },
+  { "\n\t\n", OP_RET, 0 },
+  { "\n\n\n", OP_EXIT, 0 },
+  { "\t\n  ", OP_PUTC, 0 },
+  { "\t\n \t", OP_PUTINT, 0 },
+  { "\t\n\t ", OP_GETC, 0 },
+  { "\t\n\t\t", OP_GETINT, 0 },
+};
+
+struct Op {
+  OpType op;
+  Word arg;
+  Word arg2;
+};
+
+struct Program {
+  vector<Op> code;
+  // The label of each jump or call, resolved into arg by link().
+  vector<string> label_of;
+  map<string, int> labels;
+  // The code from here on may be fused: no label points inside it.
+  size_t fuse_floor;
+};
+
+static void fail(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+// Whether the last n ops can be rewritten.
+static bool fusable(const Program* p, size_t n) {
+  return p->code.size() >= p->fuse_floor + n;
+}
+
+static const Op& back(const Program* p, size_t i) {
+  return p->code[p->code.size() - 1 - i];
+}
+
+static void pop_ops(Program* p, size_t n) {
+  p->code.resize(p->code.size() - n);
+  p->label_of.resize(p->code.size());
+}
+
+static void push_op(Program* p, OpType op, Word arg, Word arg2) {
+  Op o;
+  o.op = op;
+  o.arg = arg;
+  o.arg2 = arg2;
+  p->code.push_back(o);
+  p->label_of.resize(p->code.size());
+}
+
+// Appends op, fused with the ones before it where possible.
+static void add_op(Program* p, OpType op, Word arg) {
+  if (op == OP_RETRIEVE && fusable(p, 1) && back(p, 0).op == OP_PUSH) {
+    Word a = back(p, 0).arg;
+    pop_ops(p, 1);
+    push_op(p, OP_LOAD, a, 0);
+    return;
+  }
+  if (op == OP_STORE) {
+    if (fusable(p, 3) && back(p, 2).op == OP_DUP &&
+        back(p, 1).op == OP_PUSH && back(p, 0).op == OP_SWAP) {
+      Word a = back(p, 1).arg;
+      pop_ops(p, 3);
+      push_op(p, OP_STORE_KEEP, a, 0);
+      return;
+    }
+    if (fusable(p, 2) && back(p, 1).op == OP_PUSH &&
+        back(p, 0).op == OP_SWAP) {
+      Word a = back(p, 1).arg;
+      pop_ops(p, 2);
+      push_op(p, OP_STORE_TO, a, 0);
+      return;
+    }
+    if (fusable(p, 2) && back(p, 1).op == OP_PUSH &&
+        back(p, 0).op == OP_PUSH) {
+      Word a = back(p, 1).arg;
+      Word v = back(p, 0).arg;
+      pop_ops(p, 2);
+      push_op(p, OP_STORE_IMM, a, v);
+      return;
+    }
+  }
+  if (op >= OP_ADD && op <= OP_MOD && fusable(p, 1)) {
+    OpType prev = back(p, 0).op;
+    Word a = back(p, 0).arg;
+    if (prev == OP_PUSH || prev == OP_LOAD) {
+      pop_ops(p, 1);
+      int base = prev == OP_PUSH ? OP_ADD_IMM : OP_ADD_HEAP;
+      push_op(p, (OpType)(base + op - OP_ADD), a, 0);
+      return;
+    }
+  }
+  push_op(p, op, arg, 0);
+}
+
+static void parse(const string& src, Program* p) {
+  p->fuse_floor = 0;
+  size_t i = 0;
+  while (i < src.size()) {
+    int k = 0;
+    int n = sizeof(kOps) / sizeof(kOps[0]);
+    for (; k < n; k++) {
+      size_t len = strlen(kOps[k].ws);
+      if (!src.compare(i, len, kOps[k].ws))
+        break;
+    }
+    if (k == n)
+      fail("unknown instruction");
+    i += strlen(kOps[k].ws);
+
+    Word num = 0;
+    string label;
+    if (kOps[k].arg) {
+      size_t end = src.find('\n', i);
+      if (end == string::npos)
+        fail("unterminated argument");
+      label = src.substr(i, end - i);
+      i = end + 1;
+      if (kOps[k].arg == 1) {
+        if (label.empty())
+          fail("number without a sign");
+        for (size_t j = 1; j < label.size(); j++)
+          num = num * 2 + (label[j] == '\t');
+        if (label[0] == '\t')
+          num = -num;
+      }
+    }
+
+    OpType op = kOps[k].op;
+    if (op == OP_MARK) {
+      if (p->labels.count(label))
+        fail("duplicate label");
+      p->labels[label] = p->code.size();
+      p->fuse_floor = p->code.size();
+      continue;
+    }
+    add_op(p, op, num);
+    if (kOps[k].arg == 2)
+      p->label_of.back() = label;
+  }
+}
+
+static void link(Program* p) {
+  for (size_t i = 0; i < p->code.size(); i++) {
+    OpType op = p->code[i].op;
+    if (op != OP_CALL && op != OP_JMP && op != OP_JZ && op != OP_JN)
+      continue;
+    map<string, int>::const_iterator found = p->labels.find(p->label_of[i]);
+    if (found == p->labels.end())
+      fail("undefined label");
+    p->code[i].arg = found->second;
+  }
+  // Falling off the end exits.
+  push_op(p, OP_EXIT, 0, 0);
+}
+
+// Haskell's div and mod, as the reference interpreter has them.
+static Word floor_div(Word a, Word b) {
+  if (!b)
+    fail("division by zero");
+  Word q = a / b;
+  if ((a % b) && ((a < 0) != (b < 0)))
+    q--;
+  return q;
+}
+
+static Word floor_mod(Word a, Word b) {
+  return a - floor_div(a, b) * b;
+}
+
+static Word arith(OpType op, Word a, Word b) {
+  switch (op) {
+    case OP_ADD: return a + b;
+    case OP_SUB: return a - b;
+    case OP_MUL: return a * b;
+    case OP_DIV: return floor_div(a, b);
+    case OP_MOD: return floor_mod(a, b);
+    default: fail("oops");
+  }
+  return 0;
+}
+
+static Word* heap_at(vector<Word>* heap, Word a) {
+  if (a < 0)
+    fail("negative heap address");
+  if ((size_t)a >= heap->size())
+    heap->resize(max((size_t)a + 1, heap->size() * 2));
+  return &(*heap)[a];
+}
+
+static void run(const vector<Op>& code) {
+  vector<Word> stack;
+  vector<Word> heap(1 << 16);
+  vector<int> calls;
+  size_t pc = 0;
+  while (true) {
+    const Op& o = code[pc++];
+    switch (o.op) {
+      case OP_PUSH:
+        stack.push_back(o.arg);
+        break;
+
+      case OP_DUP:
+        stack.push_back(stack.back());
+        break;
+
+      case OP_COPY:
+        stack.push_back(stack[stack.size() - 1 - o.arg]);
+        break;
+
+      case OP_SWAP:
+        swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+        break;
+
+      case OP_DISCARD:
+        stack.pop_back();
+        break;
+
+      case OP_SLIDE: {
+        Word top = stack.back();
+        stack.resize(stack.size() - 1 - o.arg);
+        stack.push_back(top);
+        break;
+      }
+
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD: {
+        Word b = stack.back();
+        stack.pop_back();
+        stack.back() = arith(o.op, stack.back(), b);
+        break;
+      }
+
+      case OP_STORE: {
+        Word v = stack.back();
+        stack.pop_back();
+        *heap_at(&heap, stack.back()) = v;
+        stack.pop_back();
+        break;
+      }
+
+      case OP_RETRIEVE:
+        stack.back() = *heap_at(&heap, stack.back());
+        break;
+
+      case OP_CALL:
+        calls.push_back(pc);
+        pc = o.arg;
+        break;
+
+      case OP_JMP:
+        pc = o.arg;
+        break;
+
+      case OP_JZ:
+      case OP_JN: {
+        Word v = stack.back();
+        stack.pop_back();
+        if (o.op == OP_JZ ? v == 0 : v < 0)
+          pc = o.arg;
+        break;
+      }
+
+      case OP_RET:
+        if (calls.empty())
+          fail("return outside a call");
+        pc = calls.back();
+        calls.pop_back();
+        break;
+
+      case OP_EXIT:
+        return;
+
+      case OP_PUTC:
+        putchar(stack.back());
+        stack.pop_back();
+        break;
+
+      case OP_PUTINT:
+        printf("%lld", stack.back());
+        stack.pop_back();
+        break;
+
+      case OP_GETC: {
+        int c = getchar();
+        *heap_at(&heap, stack.back()) = c == EOF ? 0 : c;
+        stack.pop_back();
+        break;
+      }
+
+      case OP_GETINT: {
+        long long v = 0;
+        if (scanf("%lld", &v) != 1)
+          v = 0;
+        *heap_at(&heap, stack.back()) = v;
+        stack.pop_back();
+        break;
+      }
+
+      case OP_LOAD:
+        stack.push_back(*heap_at(&heap, o.arg));
+        break;
+
+      case OP_STORE_IMM:
+        *heap_at(&heap, o.arg) = o.arg2;
+        break;
+
+      case OP_STORE_TO:
+        *heap_at(&heap, o.arg) = stack.back();
+        stack.pop_back();
+        break;
+
+      case OP_STORE_KEEP:
+        *heap_at(&heap, o.arg) = stack.back();
+        break;
+
+      case OP_ADD_IMM:
+      case OP_SUB_IMM:
+      case OP_MUL_IMM:
+      case OP_DIV_IMM:
+      case OP_MOD_IMM:
+        stack.back() = arith((OpType)(OP_ADD + o.op - OP_ADD_IMM),
+                             stack.back(), o.arg);
+        break;
+
+      case OP_ADD_HEAP:
+      case OP_SUB_HEAP:
+      case OP_MUL_HEAP:
+      case OP_DIV_HEAP:
+      case OP_MOD_HEAP:
+        stack.back() = arith((OpType)(OP_ADD + o.op - OP_ADD_HEAP),
+                             stack.back(), *heap_at(&heap, o.arg));
+        break;
+
+      default:
+        fail("oops");
+    }
+  }
+}
+
+static const char* kCArith[] = { "+", "-", "*", "/", "%" };
+
+// The C of an arithmetic op on a and b. Division and modulo floor, as
+// in run().
+static string c_arith(int op, const string& a, const string& b) {
+  if (op == OP_DIV)
+    return "fdiv(" + a + ", " + b + ")";
+  if (op == OP_MOD)
+    return "fmod_(" + a + ", " + b + ")";
+  return a + " " + kCArith[op - OP_ADD] + " " + b;
+}
+
+// Writes C with a label before each op a jump or a return goes to. The
+// stack is an array indexed by sp, and returns switch over the call
+// sites. The heap covers the 24bit address space after the 8 words
+// target/ws.c keeps before it.
+static void compile(const vector<Op>& code, const char* fname) {
+  vector<bool> is_target(code.size() + 1);
+  vector<int> calls;
+  for (size_t i = 0; i < code.size(); i++) {
+    OpType op = code[i].op;
+    if (op == OP_CALL || op == OP_JMP || op == OP_JZ || op == OP_JN)
+      is_target[code[i].arg] = true;
+    if (op == OP_CALL) {
+      is_target[i + 1] = true;
+      calls.push_back(i + 1);
+    }
+  }
+
+  FILE* fp = fopen(fname, "wb");
+  if (!fp) {
+    perror("open");
+    exit(1);
+  }
+  fprintf(fp, "#include <stdio.h>\n");
+  fprintf(fp, "typedef long long W;\n");
+  fprintf(fp, "static W heap[(1 << 24) + 16];\n");
+  fprintf(fp, "static W st[1 << 20];\n");
+  fprintf(fp, "static int calls[1 << 16];\n");
+  fprintf(fp, "static W fdiv(W a, W b) {\n");
+  fprintf(fp, "  W q = a / b;\n");
+  fprintf(fp, "  return (a %% b) && ((a < 0) != (b < 0)) ? q - 1 : q;\n");
+  fprintf(fp, "}\n");
+  fprintf(fp, "static W fmod_(W a, W b) { return a - fdiv(a, b) * b; }\n");
+  fprintf(fp, "int main() {\n");
+  fprintf(fp, "int sp = 0, csp = 0, c;\n");
+  fprintf(fp, "(void)c;\n");
+  for (size_t i = 0; i < code.size(); i++) {
+    if (is_target[i])
+      fprintf(fp, "L%zu:\n", i);
+    const Op& o = code[i];
+    switch (o.op) {
+      case OP_PUSH:
+        fprintf(fp, "st[sp++] = %lldLL;\n", o.arg);
+        break;
+      case OP_DUP:
+        fprintf(fp, "st[sp] = st[sp - 1]; sp++;\n");
+        break;
+      case OP_COPY:
+        fprintf(fp, "st[sp] = st[sp - 1 - %lld]; sp++;\n", o.arg);
+        break;
+      case OP_SWAP:
+        fprintf(fp, "{ W t = st[sp - 1]; st[sp - 1] = st[sp - 2];"
+                " st[sp - 2] = t; }\n");
+        break;
+      case OP_DISCARD:
+        fprintf(fp, "sp--;\n");
+        break;
+      case OP_SLIDE:
+        fprintf(fp, "st[sp - 1 - %lld] = st[sp - 1]; sp -= %lld;\n",
+                o.arg, o.arg);
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+        fprintf(fp, "sp--; st[sp - 1] = %s;\n",
+                c_arith(o.op, "st[sp - 1]", "st[sp]").c_str());
+        break;
+      case OP_STORE:
+        fprintf(fp, "heap[st[sp - 2]] = st[sp - 1]; sp -= 2;\n");
+        break;
+      case OP_RETRIEVE:
+        fprintf(fp, "st[sp - 1] = heap[st[sp - 1]];\n");
+        break;
+      case OP_CALL:
+        fprintf(fp, "calls[csp++] = %zu; goto L%lld;\n", i + 1, o.arg);
+        break;
+      case OP_JMP:
+        fprintf(fp, "goto L%lld;\n", o.arg);
+        break;
+      case OP_JZ:
+        fprintf(fp, "if (!st[--sp]) goto L%lld;\n", o.arg);
+        break;
+      case OP_JN:
+        fprintf(fp, "if (st[--sp] < 0) goto L%lld;\n", o.arg);
+        break;
+      case OP_RET:
+        fprintf(fp, "switch (calls[--csp]) {\n");
+        for (size_t j = 0; j < calls.size(); j++)
+          fprintf(fp, "case %d: goto L%d;\n", calls[j], calls[j]);
+        fprintf(fp, "}\n");
+        fprintf(fp, "return 1;\n");
+        break;
+      case OP_EXIT:
+        fprintf(fp, "return 0;\n");
+        break;
+      case OP_PUTC:
+        fprintf(fp, "putchar(st[--sp]);\n");
+        break;
+      case OP_PUTINT:
+        fprintf(fp, "printf(\"%%lld\", st[--sp]);\n");
+        break;
+      case OP_GETC:
+        fprintf(fp, "c = getchar(); heap[st[--sp]] = c == EOF ? 0 : c;\n");
+        break;
+      case OP_GETINT:
+        fprintf(fp, "{ W v = 0; if (scanf(\"%%lld\", &v) != 1) v = 0;"
+                " heap[st[--sp]] = v; }\n");
+        break;
+      case OP_LOAD:
+        fprintf(fp, "st[sp++] = heap[%lld];\n", o.arg);
+        break;
+      case OP_STORE_IMM:
+        fprintf(fp, "heap[%lld] = %lldLL;\n", o.arg, o.arg2);
+        break;
+      case OP_STORE_TO:
+        fprintf(fp, "heap[%lld] = st[--sp];\n", o.arg);
+        break;
+      case OP_STORE_KEEP:
+        fprintf(fp, "heap[%lld] = st[sp - 1];\n", o.arg);
+        break;
+      case OP_ADD_IMM:
+      case OP_SUB_IMM:
+      case OP_MUL_IMM:
+      case OP_DIV_IMM:
+      case OP_MOD_IMM: {
+        char b[32];
+        snprintf(b, sizeof(b), "%lldLL", o.arg);
+        fprintf(fp, "st[sp - 1] = %s;\n",
+                c_arith(OP_ADD + o.op - OP_ADD_IMM, "st[sp - 1]", b).c_str());
+        break;
+      }
+      case OP_ADD_HEAP:
+      case OP_SUB_HEAP:
+      case OP_MUL_HEAP:
+      case OP_DIV_HEAP:
+      case OP_MOD_HEAP: {
+        char b[32];
+        snprintf(b, sizeof(b), "heap[%lld]", o.arg);
+        fprintf(fp, "st[sp - 1] = %s;\n",
+                c_arith(OP_ADD + o.op - OP_ADD_HEAP, "st[sp - 1]", b).c_str());
+        break;
+      }
+      default:
+        fail("oops");
+    }
+  }
+  if (is_target[code.size()])
+    fprintf(fp, "L%zu:\n", code.size());
+  fprintf(fp, "return 0;\n");
+  fprintf(fp, "}\n");
+  fclose(fp);
+}
+
+int main(int argc, char* argv[]) {
+  bool should_compile = false;
+  const char* arg0 = argv[0];
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-c")) {
+      should_compile = true;
+    } else {
+      fprintf(stderr, "Unknown flag: %s\n", argv[1]);
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+
+  if (argc < 2 || (argc < 3 && should_compile)) {
+    fprintf(stderr, "Usage: %s [-c] <ws> [<c>]\n", arg0);
+    return 1;
+  }
+
+  FILE* fp = fopen(argv[1], "rb");
+  if (!fp) {
+    perror("open");
+    return 1;
+  }
+  string src;
+  while (true) {
+    int c = fgetc(fp);
+    if (c == EOF)
+      break;
+    if (c == ' ' || c == '\t' || c == '\n')
+      src += c;
+  }
+  fclose(fp);
+
+  Program p;
+  parse(src, &p);
+  link(&p);
+  if (should_compile) {
+    compile(p.code, argv[2]);
+    return 0;
+  }
+  run(p.code);
+}